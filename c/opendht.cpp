@@ -57,6 +57,14 @@ const char* dht_pkid_print(const dht_pkid* h) {
 }
 
 // dht::Blob
+dht_blob* dht_blob_new(size_t size) {
+    return reinterpret_cast<dht_blob*>(new dht::Blob(size));
+}
+
+uint8_t* dht_blob_get_mutable_data(dht_blob* data) {
+    return reinterpret_cast<dht::Blob*>(data)->data();
+}
+
 void dht_blob_delete(dht_blob* data) {
     delete reinterpret_cast<dht::Blob*>(data);
 }
@@ -101,6 +109,21 @@ dht_value* dht_value_new(const uint8_t* data, size_t size) {
     return reinterpret_cast<dht_value*>(new ValueSp(std::make_shared<dht::Value>(data, size)));
 }
 
+dht_value* dht_value_new_take(uint8_t* data, size_t size, dht_free_cb free_cb, void* user_data) {
+    // dht::Value owns its data as a Blob: the buffer is copied once and released now
+    auto value = dht_value_new(data, size);
+    if (free_cb)
+        free_cb(data, size, user_data);
+    return value;
+}
+
+dht_value* dht_value_new_from_blob(dht_blob* blob) {
+    auto data = reinterpret_cast<dht::Blob*>(blob);
+    auto value = std::make_shared<dht::Value>(std::move(*data));
+    delete data;
+    return reinterpret_cast<dht_value*>(new ValueSp(std::move(value)));
+}
+
 dht_value* dht_value_ref(const dht_value* v) {
     return reinterpret_cast<dht_value*>(new ValueSp(*reinterpret_cast<const ValueSp*>(v)));
 }
@@ -309,6 +332,33 @@ void dht_runner_get(dht_runner* r, const dht_infohash* h, dht_get_cb cb, dht_don
     });
 }
 
+/* Views of values, valid as long as values */
+inline std::vector<dht_value_view> dht_value_views(const std::vector<ValueSp>& values) {
+    std::vector<dht_value_view> views;
+    views.reserve(values.size());
+    for (const auto& value : values) {
+        dht_value_view view;
+        view.value = reinterpret_cast<const dht_value*>(&value);
+        view.id = value->id;
+        view.data.data = value->data.data();
+        view.data.size = value->data.size();
+        views.emplace_back(view);
+    }
+    return views;
+}
+
+void dht_runner_get_batch(dht_runner* r, const dht_infohash* h, dht_get_batch_cb cb, dht_done_cb done_cb, void* cb_user_data) {
+    auto runner = reinterpret_cast<dht::DhtRunner*>(r);
+    auto hash = reinterpret_cast<const dht::InfoHash*>(h);
+    runner->get(*hash, [cb,cb_user_data](const std::vector<ValueSp>& values){
+        auto views = dht_value_views(values);
+        return cb(views.data(), views.size(), cb_user_data);
+    }, [done_cb, cb_user_data](bool ok, const std::vector<std::shared_ptr<dht::Node>>&){
+        if (done_cb)
+            done_cb(ok, cb_user_data);
+    });
+}
+
 struct ScopeGuardCb {
     ScopeGuardCb(dht_shutdown_cb cb, void* data)
      : onDestroy(cb), userData(data) {}
@@ -337,6 +387,18 @@ dht_op_token* dht_runner_listen(dht_runner* r, const dht_infohash* h, dht_value_
     return (dht_op_token*)fret;
 }
 
+dht_op_token* dht_runner_listen_batch(dht_runner* r, const dht_infohash* h, dht_value_batch_cb cb, dht_shutdown_cb done_cb, void* cb_user_data) {
+    auto runner = reinterpret_cast<dht::DhtRunner*>(r);
+    auto hash = reinterpret_cast<const dht::InfoHash*>(h);
+    auto fret = new std::future<size_t>;
+    auto guard = done_cb ? std::make_shared<ScopeGuardCb>(done_cb, cb_user_data) : std::shared_ptr<ScopeGuardCb>{};
+    *fret = runner->listen(*hash, [cb,cb_user_data, guard](const std::vector<ValueSp>& values, bool expired) {
+        auto views = dht_value_views(values);
+        return cb(views.data(), views.size(), expired, cb_user_data);
+    });
+    return (dht_op_token*)fret;
+}
+
 void dht_runner_cancel_listen(dht_runner* r, const dht_infohash* h, dht_op_token* t) {
     auto runner = reinterpret_cast<dht::DhtRunner*>(r);
     auto hash = reinterpret_cast<const dht::InfoHash*>(h);
@@ -21,7 +21,10 @@ typedef struct dht_data_view dht_data_view;
 // dht::Blob
 struct OPENDHT_C_PUBLIC dht_blob;
 typedef struct dht_blob dht_blob;
+OPENDHT_C_PUBLIC dht_blob* dht_blob_new(size_t size);
 OPENDHT_C_PUBLIC dht_data_view dht_blob_get_data(const dht_blob* data);
+// Writable data of a blob, to fill it before dht_value_new_from_blob
+OPENDHT_C_PUBLIC uint8_t* dht_blob_get_mutable_data(dht_blob* data);
 OPENDHT_C_PUBLIC void dht_blob_delete(dht_blob* data);
 
 // dht::InfoHash
@@ -81,7 +84,12 @@ OPENDHT_C_PUBLIC void dht_identity_delete(dht_identity*);
 struct OPENDHT_C_PUBLIC dht_value;
 typedef struct dht_value dht_value;
 typedef uint64_t dht_value_id;
+typedef void (*dht_free_cb)(uint8_t* data, size_t size, void* user_data);
 OPENDHT_C_PUBLIC dht_value* dht_value_new(const uint8_t* data, size_t size);
+// Takes ownership of data, released with free_cb once the value doesn't need it anymore
+OPENDHT_C_PUBLIC dht_value* dht_value_new_take(uint8_t* data, size_t size, dht_free_cb free_cb, void* user_data);
+// Takes ownership of blob, used as the value data without copy
+OPENDHT_C_PUBLIC dht_value* dht_value_new_from_blob(dht_blob* blob);
 OPENDHT_C_PUBLIC dht_value* dht_value_ref(const dht_value*);
 OPENDHT_C_PUBLIC void dht_value_unref(dht_value*);
 OPENDHT_C_PUBLIC dht_data_view dht_value_get_data(const dht_value* data);
@@ -90,10 +98,22 @@ OPENDHT_C_PUBLIC dht_publickey* dht_value_get_owner(const dht_value* data);
 OPENDHT_C_PUBLIC dht_infohash dht_value_get_recipient(const dht_value* data);
 OPENDHT_C_PUBLIC const char* dht_value_get_user_type(const dht_value* data);
 
+// Non-owning view of a value, valid during the callback it is passed to.
+// The data stays valid as long as a reference to value is held (see dht_value_ref).
+struct OPENDHT_C_PUBLIC dht_value_view {
+    const dht_value* value;
+    dht_value_id id;
+    dht_data_view data;
+};
+typedef struct dht_value_view dht_value_view;
+
 // callbacks
 typedef bool (*dht_get_cb)(const dht_value* value, void* user_data);
 typedef bool (*dht_value_cb)(const dht_value* value, bool expired, void* user_data);
 typedef void (*dht_done_cb)(bool ok, void* user_data);
+// Called once for all the values received together
+typedef bool (*dht_get_batch_cb)(const dht_value_view* values, size_t count, void* user_data);
+typedef bool (*dht_value_batch_cb)(const dht_value_view* values, size_t count, bool expired, void* user_data);
 typedef void (*dht_shutdown_cb)(void* user_data);
 
 struct OPENDHT_C_PUBLIC dht_op_token;
@@ -140,7 +160,9 @@ OPENDHT_C_PUBLIC void dht_runner_run_config(dht_runner* runner, in_port_t port,
 OPENDHT_C_PUBLIC void dht_runner_ping(dht_runner* runner, struct sockaddr* addr, socklen_t addr_len);
 OPENDHT_C_PUBLIC void dht_runner_bootstrap(dht_runner* runner, const char* host, const char* service);
 OPENDHT_C_PUBLIC void dht_runner_get(dht_runner* runner, const dht_infohash* hash, dht_get_cb cb, dht_done_cb done_cb, void* cb_user_data);
+OPENDHT_C_PUBLIC void dht_runner_get_batch(dht_runner* runner, const dht_infohash* hash, dht_get_batch_cb cb, dht_done_cb done_cb, void* cb_user_data);
 OPENDHT_C_PUBLIC dht_op_token* dht_runner_listen(dht_runner* runner, const dht_infohash* hash, dht_value_cb cb, dht_shutdown_cb done_cb, void* cb_user_data);
+OPENDHT_C_PUBLIC dht_op_token* dht_runner_listen_batch(dht_runner* runner, const dht_infohash* hash, dht_value_batch_cb cb, dht_shutdown_cb done_cb, void* cb_user_data);
 OPENDHT_C_PUBLIC void dht_runner_cancel_listen(dht_runner* runner, const dht_infohash* hash, dht_op_token* token);
 OPENDHT_C_PUBLIC void dht_runner_put(dht_runner* runner, const dht_infohash* hash, const dht_value* value, dht_done_cb done_cb, void* cb_user_data, bool permanent);
 OPENDHT_C_PUBLIC void dht_runner_put_signed(dht_runner* runner, const dht_infohash* hash, const dht_value* value, dht_done_cb done_cb, void* cb_user_data, bool permanent);
@@ -0,0 +1,223 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "dhtrunner.h"
+
+#if !defined(__cpp_impl_coroutine) || __cpp_impl_coroutine < 201902L
+#error "opendht/awaitable.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace dht {
+
+/**
+ * Awaitable DhtRunner operations, for C++20 coroutines:
+ *
+ *   auto values = co_await runner.getAsync(key, executor);
+ *   bool ok = co_await runner.putAsync(key, value, executor);
+ *   auto listener = runner.listenAsync(key, executor);
+ *   while (auto event = co_await listener.next()) { ... }
+ *
+ * Executor is a callable taking a std::function<void()>, called from
+ * the DHT thread to resume the coroutine, that should queue the function
+ * to the caller's event loop or thread pool. No thread is blocked while
+ * waiting for the result.
+ */
+
+/** Resumes coroutines on the thread completing the operation */
+struct InlineExecutor {
+    void operator()(std::function<void()>&& f) const { f(); }
+};
+
+template <typename Executor>
+class GetAwaitable {
+public:
+    GetAwaitable(DhtRunner& runner, InfoHash key, Executor executor, Value::Filter f, Where w)
+        : runner_(runner), key_(key), executor_(std::move(executor)), filter_(std::move(f)), where_(std::move(w)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        // values and done are both called from the DHT thread
+        runner_.get(key_, [this](const std::vector<Sp<Value>>& values) {
+            values_.insert(values_.end(), values.begin(), values.end());
+            return true;
+        }, [this, h](bool, const std::vector<Sp<Node>>&) {
+            executor_([h]{ h.resume(); });
+        }, std::move(filter_), std::move(where_));
+    }
+    std::vector<Sp<Value>> await_resume() { return std::move(values_); }
+
+private:
+    DhtRunner& runner_;
+    InfoHash key_;
+    Executor executor_;
+    Value::Filter filter_;
+    Where where_;
+    std::vector<Sp<Value>> values_;
+};
+
+template <typename Executor>
+class PutAwaitable {
+public:
+    PutAwaitable(DhtRunner& runner, InfoHash key, Sp<Value> value, Executor executor, bool permanent)
+        : runner_(runner), key_(key), value_(std::move(value)), executor_(std::move(executor)), permanent_(permanent) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        runner_.put(key_, std::move(value_), [this, h](bool ok, const std::vector<Sp<Node>>&) {
+            ok_ = ok;
+            executor_([h]{ h.resume(); });
+        }, time_point::max(), permanent_);
+    }
+    bool await_resume() const { return ok_; }
+
+private:
+    DhtRunner& runner_;
+    InfoHash key_;
+    Sp<Value> value_;
+    Executor executor_;
+    bool permanent_;
+    bool ok_ {false};
+};
+
+/**
+ * Values received by a listener, or expired if expired is true.
+ */
+struct ListenEvent {
+    std::vector<Sp<Value>> values;
+    bool expired;
+};
+
+/**
+ * Asynchronous generator of listen events.
+ * Listening stops when the generator is closed or destroyed.
+ * next() must not be awaited by more than one coroutine at a time.
+ */
+template <typename Executor>
+class ListenGenerator {
+    struct State {
+        std::mutex lock;
+        std::deque<ListenEvent> events;
+        std::coroutine_handle<> waiter;
+        bool closed {false};
+    };
+public:
+    ListenGenerator(DhtRunner& runner, InfoHash key, Executor executor, Value::Filter f, Where w)
+        : runner_(runner), key_(key), state_(std::make_shared<State>())
+    {
+        token_ = runner_.listen(key_, [state = state_, executor = std::move(executor)](const std::vector<Sp<Value>>& values, bool expired) {
+            std::coroutine_handle<> waiter;
+            {
+                std::lock_guard<std::mutex> lk(state->lock);
+                if (state->closed)
+                    return false;
+                state->events.push_back({values, expired});
+                std::swap(waiter, state->waiter);
+            }
+            if (waiter)
+                executor([waiter]{ waiter.resume(); });
+            return true;
+        }, std::move(f), std::move(w));
+    }
+    ListenGenerator(const ListenGenerator&) = delete;
+    ListenGenerator& operator=(const ListenGenerator&) = delete;
+    ~ListenGenerator() { close(); }
+
+    /**
+     * Stops listening. A coroutine waiting on next() is resumed
+     * with no event, from the calling thread.
+     */
+    void close() {
+        std::coroutine_handle<> waiter;
+        {
+            std::lock_guard<std::mutex> lk(state_->lock);
+            if (state_->closed)
+                return;
+            state_->closed = true;
+            std::swap(waiter, state_->waiter);
+        }
+        runner_.cancelListen(key_, token_);
+        if (waiter)
+            waiter.resume();
+    }
+
+    class NextAwaitable {
+    public:
+        bool await_ready() const {
+            std::lock_guard<std::mutex> lk(state_->lock);
+            return state_->closed or not state_->events.empty();
+        }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> lk(state_->lock);
+            if (state_->closed or not state_->events.empty())
+                return false;
+            state_->waiter = h;
+            return true;
+        }
+        /** @return the next event, or nothing once closed */
+        std::optional<ListenEvent> await_resume() {
+            std::lock_guard<std::mutex> lk(state_->lock);
+            if (state_->events.empty())
+                return std::nullopt;
+            auto event = std::move(state_->events.front());
+            state_->events.pop_front();
+            return event;
+        }
+    private:
+        friend class ListenGenerator;
+        explicit NextAwaitable(const Sp<State>& state) : state_(state) {}
+        Sp<State> state_;
+    };
+
+    NextAwaitable next() { return NextAwaitable(state_); }
+
+private:
+    DhtRunner& runner_;
+    InfoHash key_;
+    Sp<State> state_;
+    std::shared_future<size_t> token_;
+};
+
+template <typename Executor>
+GetAwaitable<Executor>
+DhtRunner::getAsync(InfoHash key, Executor executor, Value::Filter f, Where w)
+{
+    return {*this, key, std::move(executor), std::move(f), std::move(w)};
+}
+
+template <typename Executor>
+PutAwaitable<Executor>
+DhtRunner::putAsync(InfoHash key, Sp<Value> value, Executor executor, bool permanent)
+{
+    return {*this, key, std::move(value), std::move(executor), permanent};
+}
+
+template <typename Executor>
+ListenGenerator<Executor>
+DhtRunner::listenAsync(InfoHash key, Executor executor, Value::Filter f, Where w)
+{
+    return {*this, key, std::move(executor), std::move(f), std::move(w)};
+}
+
+}
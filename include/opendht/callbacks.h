@@ -22,6 +22,7 @@
 
 #include "infohash.h"
 #include "value.h"
+#include "metrics.h"
 
 #include <vector>
 #include <memory>
@@ -35,6 +36,10 @@
 namespace dht {
 
 struct Node;
+class StorageBackend;
+namespace crypto {
+class IdentityPool;
+}
 
 /**
  * Current status of a DHT node.
@@ -60,6 +65,9 @@ struct OPENDHT_PUBLIC NodeStats {
     unsigned table_depth {0};
     unsigned searches {0};
     unsigned node_cache_size {0};
+    /* gets answered locally (from recent results or listens), and sent to the network */
+    unsigned get_cache_hits {0},
+             get_cache_misses {0};
     unsigned getKnownNodes() const { return good_nodes + dubious_nodes; }
     unsigned long getNetworkSizeEstimation() const { return 8 * std::exp2(table_depth); }
     std::string toString() const;
@@ -73,7 +81,42 @@ struct OPENDHT_PUBLIC NodeStats {
     explicit NodeStats(const Json::Value& v);
 #endif
 
-    MSGPACK_DEFINE_MAP(good_nodes, dubious_nodes, cached_nodes, incoming_nodes, table_depth, searches, node_cache_size)
+    MSGPACK_DEFINE_MAP(good_nodes, dubious_nodes, cached_nodes, incoming_nodes, table_depth, searches, node_cache_size, get_cache_hits, get_cache_misses)
+};
+
+/**
+ * Approximate memory used by the subsystems of a node, in bytes.
+ * Counts are maintained along the data structures, and multiplied
+ * by typical entry sizes where entries have no size of their own.
+ */
+struct OPENDHT_PUBLIC MemoryStats {
+    /* stored values and keys */
+    size_t storage {0};
+    /* routing table buckets, and cached nodes */
+    size_t routing_table {0};
+    size_t node_cache {0};
+    /* searches and their nodes */
+    size_t searches {0};
+    /* values cached by listen operations */
+    size_t value_caches {0};
+    /* local listeners, and remote listeners of stored keys */
+    size_t listeners {0};
+    /* received messages being reassembled */
+    size_t partial_messages {0};
+    /* cached certificates, public keys, session keys and signature checks */
+    size_t certificates {0};
+    /* operations of a proxy server */
+    size_t proxy {0};
+
+    size_t getTotal() const {
+        return storage + routing_table + node_cache + searches + value_caches
+             + listeners + partial_messages + certificates + proxy;
+    }
+    std::string toString() const;
+
+#ifdef OPENDHT_JSONCPP
+    Json::Value toJson() const;
+#endif
 };
 
 struct OPENDHT_PUBLIC NodeInfo {
@@ -84,6 +127,10 @@ struct OPENDHT_PUBLIC NodeInfo {
     size_t ongoing_ops {0};
     in_port_t bound4 {0};
     in_port_t bound6 {0};
+    /** Latency distributions, see net::NetworkMetrics::getStats */
+    std::map<std::string, LatencyStats> latency {};
+    /** Received messages dropped by an overloaded node, by type, see net::DropCounters */
+    std::map<std::string, uint64_t> rx_dropped {};
 
 #ifdef OPENDHT_JSONCPP
     /**
@@ -97,6 +144,16 @@ struct OPENDHT_PUBLIC NodeInfo {
     MSGPACK_DEFINE_MAP(id, node_id, ipv4, ipv6)
 };
 
+/**
+ * Choice of the values discarded when the storage limit is exceeded,
+ * among the values stored for the peer using the most storage.
+ */
+enum class EvictionPolicy {
+    Oldest, // first stored
+    LRU,    // least recently read
+    LFU     // least read among the least recently read
+};
+
 /**
  * Dht configuration.
  */
@@ -120,6 +177,12 @@ struct OPENDHT_PUBLIC Config {
     /** If set, the dht will load its state from this file on start and save its state in this file on shutdown */
     std::string persist_path {};
 
+    /**
+     * If set, stored values are written through this backend,
+     * and loaded from it on start. See LogStorageBackend.
+     */
+    std::shared_ptr<StorageBackend> storage_backend {};
+
     /** If non-0, overrides the default global rate-limit. -1 means no limit. */
     ssize_t max_req_per_sec {0};
 
@@ -132,12 +195,55 @@ struct OPENDHT_PUBLIC Config {
     /* If non-0, overrides the default maximum store size. -1 means no limit.  */
     ssize_t max_store_size {0};
 
+    /** Values discarded first when the storage limit is exceeded */
+    EvictionPolicy eviction_policy {EvictionPolicy::Oldest};
+
+    /**
+     * If non-0, identical values of at least this size stored by peers
+     * under several keys share the same memory. Each copy still counts
+     * towards the storage quota of its peer.
+     */
+    size_t intern_threshold {0};
+
+    /**
+     * If non-0, overrides the default bandwidth budget of routing table
+     * maintenance messages, in bytes per second. -1 means no limit.
+     */
+    ssize_t maintenance_bandwidth {0};
+
+    /**
+     * Number of search nodes, closest first, among which requests are
+     * sent to the node with the lowest expected latency (smoothed RTT
+     * weighted by recent timeouts). 1 selects nodes by distance only.
+     * 0 means the default.
+     */
+    unsigned search_rtt_window {0};
+
+    /**
+     * If non-0, the values found by a get are reused for this time by
+     * later gets on the same key, instead of searching the network again.
+     */
+    duration get_cache_ttl {duration::zero()};
+
+    /** Same as get_cache_ttl, for gets that found no value */
+    duration get_cache_negative_ttl {duration::zero()};
+
     /** 
      * Use appropriate bahavior for a public IP, stable node:
      *   - No connectivity change triggered when a search fails
      *   - Larger listen refresh time
      */
     bool public_stable {false};
+
+    /**
+     * For testing purposes only: if set, the node uses a virtual clock
+     * starting at this time, which only moves with the time given to
+     * periodic(). time_point::min() uses the system clock.
+     */
+    time_point virtual_time_start {time_point::min()};
+
+    /** For testing purposes only: if non-0, seeds the random engine of the node */
+    uint64_t random_seed {0};
 };
 
 /**
@@ -148,11 +254,42 @@ struct OPENDHT_PUBLIC SecureDhtConfig
     Config node_config {};
     crypto::Identity id {};
 
+    /**
+     * If set and no identity is provided,
+     * the identity is taken from this pool.
+     */
+    std::shared_ptr<crypto::IdentityPool> identity_pool {};
+
     /** 
      * Cache all encountered public keys and certificates,
      * for use by the certificate store, putEncrypted and putSigned
      */
     bool cert_cache_all {false};
+
+    /**
+     * Number of signature verification results kept by signed content,
+     * so that values received again aren't verified again. 0 to disable.
+     */
+    size_t signature_cache_size {4096};
+
+    /**
+     * Number of certificates, and of public keys, kept in cache,
+     * and for how long they are kept after they were registered.
+     */
+    size_t key_cache_size {1024};
+    duration key_cache_ttl {std::chrono::hours(1)};
+
+    /**
+     * If set, putEncrypted reuses the AES key generated for a recipient
+     * for this long, and for at most session_key_max_use values, so that
+     * only the first value costs an RSA encryption.
+     * Values encrypted with the same session start with the same
+     * encapsulated key, which makes them linkable to each other by any
+     * node storing them: keep this disabled where it matters.
+     * Session keys received are always reused to decrypt.
+     */
+    duration session_key_lifetime {};
+    unsigned session_key_max_use {256};
 };
 
 static constexpr size_t DEFAULT_STORAGE_LIMIT {1024 * 1024 * 64};
@@ -169,18 +306,31 @@ using CertificateStoreQuery = std::function<std::vector<std::shared_ptr<crypto::
 
 typedef bool (*GetCallbackRaw)(std::shared_ptr<Value>, void *user_data);
 typedef bool (*ValueCallbackRaw)(std::shared_ptr<Value>, bool expired, void *user_data);
+/* Called once for all the values received together, rather than for each value */
+typedef bool (*GetBatchCallbackRaw)(std::vector<std::shared_ptr<Value>>* values, void *user_data);
+typedef bool (*ValueBatchCallbackRaw)(std::vector<std::shared_ptr<Value>>* values, bool expired, void *user_data);
 
 using DoneCallback = std::function<void(bool success, const std::vector<std::shared_ptr<Node>>& nodes)>;
 typedef void (*DoneCallbackRaw)(bool, std::vector<std::shared_ptr<Node>>*, void *user_data);
 typedef void (*ShutdownCallbackRaw)(void *user_data);
 typedef void (*DoneCallbackSimpleRaw)(bool, void *user_data);
 typedef bool (*FilterRaw)(const Value&, void *user_data);
+/* Called with the user data once the callback bound to it is destroyed */
+typedef void (*ReleaseCallbackRaw)(void *user_data);
 
 using DoneCallbackSimple = std::function<void(bool success)>;
 
+/* Callbacks of batch operations are called with the index of the item in the batch */
+using BatchGetCallback = std::function<bool(size_t index, const std::vector<std::shared_ptr<Value>>& values)>;
+using BatchValueCallback = std::function<bool(size_t index, const std::vector<std::shared_ptr<Value>>& values, bool expired)>;
+using BatchDoneCallback = std::function<void(size_t index, bool success)>;
+
 OPENDHT_PUBLIC GetCallbackSimple bindGetCb(const GetCallbackRaw& raw_cb, void* user_data);
 OPENDHT_PUBLIC GetCallback bindGetCb(const GetCallbackSimple& cb);
 OPENDHT_PUBLIC ValueCallback bindValueCb(const ValueCallbackRaw& raw_cb, void* user_data);
+OPENDHT_PUBLIC GetCallback bindGetBatchCb(const GetBatchCallbackRaw& raw_cb, void* user_data);
+OPENDHT_PUBLIC ValueCallback bindValueBatchCb(const ValueBatchCallbackRaw& raw_cb, void* user_data);
+OPENDHT_PUBLIC ValueCallback bindValueBatchCb(const ValueBatchCallbackRaw& raw_cb, void* user_data, ReleaseCallbackRaw release);
 OPENDHT_PUBLIC ShutdownCallback bindShutdownCb(const ShutdownCallbackRaw& shutdown_cb_raw, void* user_data);
 OPENDHT_PUBLIC DoneCallback bindDoneCb(DoneCallbackSimple donecb);
 OPENDHT_PUBLIC DoneCallback bindDoneCb(const DoneCallbackRaw& raw_cb, void* user_data);
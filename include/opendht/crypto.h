@@ -32,6 +32,8 @@ extern "C" {
 
 #include <vector>
 #include <memory>
+#include <map>
+#include <mutex>
 
 #ifdef _WIN32
 #include <iso646.h>
@@ -69,6 +71,31 @@ class RevocationList;
 
 using Identity = std::pair<std::shared_ptr<PrivateKey>, std::shared_ptr<Certificate>>;
 
+/**
+ * An AES key with its encapsulation for an RSA public key.
+ * Cyphers made with a session key have the format of PublicKey::encrypt,
+ * so that the recipient decrypts them with PrivateKey::decrypt,
+ * but encrypting with it doesn't require an RSA operation.
+ * All cyphers of a session start with the same encapsulated key: anyone
+ * seeing them can tell they were made by the same sender for the same
+ * recipient.
+ */
+struct OPENDHT_PUBLIC SessionKey
+{
+    Blob key;
+    Blob encapsulated;
+
+    Blob encrypt(const uint8_t* data, size_t data_len) const;
+    Blob encrypt(const Blob& data) const {
+        return encrypt(data.data(), data.size());
+    }
+    /**
+     * Decrypts a cypher starting with this encapsulated key.
+     * @throw DecryptError if the cypher wasn't made with the key.
+     */
+    Blob decrypt(const Blob& cypher) const;
+};
+
 /**
  * A public key.
  */
@@ -115,6 +142,9 @@ struct OPENDHT_PUBLIC PublicKey
         return encrypt(data.data(), data.size());
     }
 
+    /** Generates a new AES key, encapsulated for this RSA key */
+    SessionKey generateSessionKey() const;
+
     void pack(Blob& b) const;
     int pack(uint8_t* out, size_t* out_len) const;
     void unpack(const uint8_t* dat, size_t dat_size);
@@ -179,6 +209,18 @@ struct OPENDHT_PUBLIC PrivateKey
      */
     Blob decrypt(const Blob& cypher) const;
 
+    /**
+     * @return the size of the RSA block starting cyphers made by
+     *         PublicKey::encrypt for this key.
+     */
+    size_t getCypherBlockSize() const;
+
+    /**
+     * Decrypts the AES key encapsulated at the beginning of cypher.
+     * It can then decrypt other cyphers starting with the same block.
+     */
+    SessionKey decryptSessionKey(const Blob& cypher) const;
+
     /**
      * Generate a new RSA key pair
      * @param key_length : size of the modulus in bits
@@ -186,7 +228,13 @@ struct OPENDHT_PUBLIC PrivateKey
      *      Recommended values: 4096, 8192
      */
     static PrivateKey generate(unsigned key_length = 4096);
+    /**
+     * Generate a new EC key pair. EC keys sign and verify values faster
+     * than RSA keys, but can't encrypt or decrypt data.
+     */
     static PrivateKey generateEC();
+    /** Same as generateEC, for an Ed25519 key pair (requires GnuTLS 3.6) */
+    static PrivateKey generateEd25519();
 
     gnutls_privkey_t key {};
     gnutls_x509_privkey_t x509_key {};
@@ -595,8 +643,11 @@ struct OPENDHT_PUBLIC TrustList
         OPENDHT_PUBLIC friend std::ostream& operator<< (std::ostream& s, const VerifyResult& h);
     };
 
+    static constexpr size_t MAX_CACHED_RESULTS {1024};
+
     TrustList();
-    TrustList(TrustList&& o) noexcept : trust(std::move(o.trust)) {
+    TrustList(TrustList&& o) noexcept : trust(std::move(o.trust)),
+        validTtl_(o.validTtl_), invalidTtl_(o.invalidTtl_), cache_(std::move(o.cache_)) {
         o.trust = nullptr;
     }
     TrustList& operator=(TrustList&& o) noexcept;
@@ -604,12 +655,40 @@ struct OPENDHT_PUBLIC TrustList
     void add(const Certificate& crt);
     void add(const RevocationList& crl);
     void remove(const Certificate& crt, bool parents = true);
+
+    /**
+     * Verifies the chain of crt.
+     * Results are cached by the SHA-256 fingerprints of the chain,
+     * until the trust list changes, and for at most the configured TTLs.
+     */
     VerifyResult verify(const Certificate& crt) const;
 
+    /**
+     * Sets for how long valid and invalid results are cached.
+     * Valid results are never kept past the expiration of the chain.
+     * Zero durations disable the cache.
+     */
+    void setCacheTtl(duration valid, duration invalid);
+
 private:
     TrustList(const TrustList& o) = delete;
     TrustList& operator=(const TrustList& o) = delete;
     gnutls_x509_trust_list_t trust {nullptr};
+
+    struct CachedResult {
+        VerifyResult result;
+        time_point expiration;
+    };
+    duration validTtl_ {std::chrono::minutes(10)};
+    duration invalidTtl_ {std::chrono::minutes(1)};
+    /* guards the TTLs, the cache and its generation */
+    mutable std::mutex cacheLock_ {};
+    mutable std::map<Blob, CachedResult> cache_ {};
+    /* incremented on each change of the list: results computed before aren't cached */
+    uint64_t generation_ {0};
+
+    /** Clears the cache after a change of the list */
+    void clearCache();
 };
 
 template <class T>
@@ -713,6 +792,13 @@ OPENDHT_PUBLIC Identity generateIdentity(const std::string& name = "dhtnode", co
 OPENDHT_PUBLIC Identity generateEcIdentity(const std::string& name, const Identity& ca, bool is_ca);
 OPENDHT_PUBLIC Identity generateEcIdentity(const std::string& name = "dhtnode", const Identity& ca = {});
 
+/**
+ * Generate an Ed25519 key pair and a certificate, for fast value signatures.
+ * Values can't be encrypted for such identities.
+ */
+OPENDHT_PUBLIC Identity generateEd25519Identity(const std::string& name, const Identity& ca, bool is_ca);
+OPENDHT_PUBLIC Identity generateEd25519Identity(const std::string& name = "dhtnode", const Identity& ca = {});
+
 OPENDHT_PUBLIC void saveIdentity(const Identity& id, const std::string& path, const std::string& privkey_password = {});
 
 /**
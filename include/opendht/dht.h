@@ -33,6 +33,11 @@
 #include <array>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <queue>
+#include <deque>
+#include <list>
+#include <tuple>
 #include <functional>
 #include <memory>
 
@@ -49,6 +54,7 @@ struct Request;
 struct Storage;
 struct ValueStorage;
 class StorageBucket;
+class StorageBackend;
 struct Listener;
 struct LocalListener;
 
@@ -94,6 +100,7 @@ public:
     }
 
     net::DatagramSocket* getSocket() const override { return network_engine.getSocket(); };
+    Sp<net::NetworkMetrics> getNetworkMetrics() const override { return network_engine.getMetrics(); };
 
     /**
      * Performs final operations before quitting.
@@ -140,6 +147,7 @@ public:
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) override {
         return periodic(buf, buflen, SockAddr(from, fromlen), now);
     }
+    time_point periodic(net::ReceivedPacket&& pkt, const time_point& now) override;
 
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
@@ -263,12 +271,13 @@ public:
 
     /**
      * Inform the DHT of lower-layer connectivity changes.
-     * This will cause the DHT to assume a public IP address change.
-     * The DHT will recontact neighbor nodes, re-register for listen ops etc.
+     * A sample of known good nodes is pinged first: if none answers,
+     * the DHT recontacts neighbor nodes, re-register for listen ops etc.
+     * If our public address changed, searches are kept but get new tokens
+     * and re-register their listen ops. Otherwise nothing is reset.
      */
     void connectivityChanged(sa_family_t) override;
     void connectivityChanged() override {
-        reported_addr.clear();
         connectivityChanged(AF_INET);
         connectivityChanged(AF_INET6);
     }
@@ -281,6 +290,8 @@ public:
 
     std::vector<ValuesExport> exportValues() const override;
     void importValues(const std::vector<ValuesExport>&) override;
+    void exportValuesTo(const ValuesExportCallback& cb) const override;
+    std::vector<ValuesSnapshot> getValuesSnapshot() const override;
 
     void saveState(const std::string& path) const;
     void loadState(const std::string& path);
@@ -314,6 +325,8 @@ public:
         return {total_store_size, total_values};
     }
 
+    MemoryStats getMemoryStats() const override;
+
     std::vector<SockAddr> getPublicAddress(sa_family_t family = 0) override;
 
     void pushNotificationReceived(const std::map<std::string, std::string>&) override {}
@@ -345,6 +358,19 @@ private:
     /* The maximum number of hashes we're willing to track. */
     static constexpr unsigned MAX_HASHES {1024 * 1024};
 
+    /* The maximum number of IP addresses (or IPv6 /64) storing values on this node. */
+    static constexpr size_t MAX_STORE_SOURCES {1024 * 64};
+
+    /* The maximum number of storages expired per scheduler pass, and the delay before the next pass. */
+    static constexpr size_t EXPIRE_STORE_BUDGET {256};
+    static constexpr duration EXPIRE_STORE_DELAY {std::chrono::milliseconds(10)};
+
+    /* The maximum number of remote listeners updated per scheduler pass, and the delay before the next pass. */
+    static constexpr size_t LISTENER_UPDATES_BUDGET {512};
+    static constexpr duration LISTENER_UPDATES_DELAY {std::chrono::milliseconds(10)};
+    /* The maximum number of remote listeners with deferred updates, beyond which the oldest are dropped. */
+    static constexpr size_t MAX_LISTENER_UPDATES {64 * 1024};
+
     /* The maximum number of searches we keep data about. */
     static constexpr unsigned MAX_SEARCHES {1024 * 1024};
 
@@ -359,6 +385,21 @@ private:
 
     static constexpr duration REANNOUNCE_MARGIN {std::chrono::seconds(10)};
 
+    /* Routing table maintenance messages are sent together, once per period */
+    static constexpr duration MAINTENANCE_PERIOD {std::chrono::milliseconds(500)};
+    /* Default maintenance bandwidth budget, in bytes per second */
+    static constexpr size_t MAINTENANCE_BANDWIDTH {32 * 1024};
+    static constexpr size_t MAX_MAINTENANCE_QUEUE {4096};
+
+    /* Default number of search nodes among which the fastest one is asked first */
+    static constexpr unsigned SEARCH_RTT_WINDOW {3};
+
+    /* Operations evaluated by a search step */
+    static constexpr unsigned STEP_GETS {1 << 0};
+    static constexpr unsigned STEP_ANNOUNCES {1 << 1};
+    static constexpr unsigned STEP_LISTENERS {1 << 2};
+    static constexpr unsigned STEP_ALL {STEP_GETS | STEP_ANNOUNCES | STEP_LISTENERS};
+
     static constexpr size_t TOKEN_SIZE {32};
 
     // internal structures
@@ -382,16 +423,32 @@ private:
     TypeStore types;
 
     using SearchMap = std::map<InfoHash, Sp<Search>>;
+    /* Pings sent to known good nodes after a connectivity change */
+    struct ConnectivityProbe {
+        /* our public addresses reported before the change */
+        std::vector<SockAddr> previous_addr;
+        unsigned pending {0};
+        unsigned answered {0};
+        /* an answer reported a new public address */
+        bool moved {false};
+        Sp<Scheduler::Job> timeout {};
+    };
     struct Kad {
         RoutingTable buckets {};
         SearchMap searches {};
         unsigned pending_pings {0};
         NodeStatus status;
+        unsigned get_cache_hits {0};
+        unsigned get_cache_misses {0};
+        Sp<ConnectivityProbe> connectivity_probe {};
 
         NodeStatus getStatus(time_point now) const;
         NodeStats getNodesStats(time_point now, const InfoHash& myid) const;
     };
 
+    /* approximate memory of the values cached by listens, see ValueCache */
+    size_t value_cache_size {0};
+
     Kad dht4 {};
     Kad dht6 {};
 
@@ -399,12 +456,27 @@ private:
     std::chrono::steady_clock::duration bootstrap_period {std::chrono::seconds(10)};
     Sp<Scheduler::Job> bootstrapJob {};
 
-    std::map<InfoHash, Storage> store;
-    std::map<SockAddr, StorageBucket, SockAddr::ipCmp> store_quota;
+    std::unordered_map<InfoHash, Storage, SeededIdHash> store;
+    /* storages by time of their next expiration, see Storage::indexed_expiration */
+    using StoreExpiration = std::pair<time_point, InfoHash>;
+    std::priority_queue<StoreExpiration, std::vector<StoreExpiration>, std::greater<StoreExpiration>> store_expirations;
+    std::unordered_map<SockAddr, StorageBucket, SockAddr::ipHash, SockAddr::ipEqual> store_quota;
     size_t total_values {0};
     size_t total_store_size {0};
+    /* remote listeners of stored keys, see Storage::listener_count */
+    size_t total_listeners {0};
     size_t max_store_keys {MAX_HASHES};
     size_t max_store_size {DEFAULT_STORAGE_LIMIT};
+    const EvictionPolicy eviction_policy {EvictionPolicy::Oldest};
+    /* gets of stored keys answered with or without values, and values evicted for space */
+    size_t store_hits {0};
+    size_t store_misses {0};
+    size_t store_evictions {0};
+    /* stored values by hash of their data, see Config::intern_threshold */
+    const size_t intern_threshold {0};
+    std::unordered_map<InfoHash, std::weak_ptr<Value>, SeededIdHash> interned_values;
+    size_t interned_sweep_size {0};
+    size_t interned_hits {0};
 
     size_t max_searches {MAX_SEARCHES};
     size_t search_id {0};
@@ -419,12 +491,39 @@ private:
     Scheduler scheduler;
     Sp<Scheduler::Job> nextNodesConfirmation {};
     Sp<Scheduler::Job> nextStorageMaintenance {};
+    Sp<Scheduler::Job> nextStoreExpiration {};
+    time_point next_store_expiration {time_point::max()};
+
+    /* Updates of remote listeners deferred to later passes, one entry per listener */
+    using ListenerKey = std::tuple<InfoHash, Sp<Node>, size_t>;
+    struct ListenerUpdate {
+        ListenerKey listener;
+        /* the latest version of each updated value */
+        std::map<Value::Id, Sp<Value>> values;
+    };
+    std::list<ListenerUpdate> listener_updates {};
+    std::map<ListenerKey, std::list<ListenerUpdate>::iterator> pending_listener_updates {};
+    Sp<Scheduler::Job> nextListenerUpdates {};
 
     net::NetworkEngine network_engine;
     using ReportedAddr = std::pair<unsigned, SockAddr>;
     std::vector<ReportedAddr> reported_addr;
 
     std::string persistPath;
+    /* writes stored values through, if set */
+    Sp<StorageBackend> storage_backend;
+
+    /*
+     * Routing table maintenance messages waiting to be sent, within the
+     * bandwidth budget. Each task sends a message and returns its request,
+     * or nothing if the message is not needed anymore.
+     */
+    using MaintenanceTask = std::function<Sp<net::Request>()>;
+    std::deque<MaintenanceTask> maintenance_queue {};
+    Sp<Scheduler::Job> nextMaintenance {};
+    const ssize_t maintenance_bandwidth {(ssize_t)MAINTENANCE_BANDWIDTH};
+    double maintenance_budget {0};
+    time_point maintenance_time {};
 
     // are we a bootstrap node ?
     // note: Any running node can be used as a bootstrap node.
@@ -433,6 +532,9 @@ private:
     const bool is_bootstrap {false};
     const bool maintain_storage {false};
     const bool public_stable {false};
+    const unsigned search_rtt_window {SEARCH_RTT_WINDOW};
+    const duration get_cache_ttl {duration::zero()};
+    const duration get_cache_negative_ttl {duration::zero()};
 
     inline const duration& getListenExpiration() const {
         return public_stable ? LISTEN_EXPIRE_TIME_PUBLIC : LISTEN_EXPIRE_TIME;
@@ -445,16 +547,37 @@ private:
 
     void reportedAddr(const SockAddr&);
 
+    void onConnectivityProbed(sa_family_t af);
+    /* Assume every node and search of af must be confirmed again */
+    void resetConnectivity(sa_family_t af);
+
     // Storage
     void storageAddListener(const InfoHash& id, const Sp<Node>& node, size_t tid, Query&& = {}, int version = 0);
     bool storageStore(const InfoHash& id, const Sp<Value>& value, time_point created, const SockAddr& sa = {}, bool permanent = false);
     bool storageErase(const InfoHash& id, Value::Id vid);
     bool storageRefresh(const InfoHash& id, Value::Id vid);
     void expireStore();
-    void expireStorage(InfoHash h);
     void expireStore(decltype(store)::iterator);
+    /**
+     * Expires up to max storages due for expiration.
+     * @return true if no storage is left due.
+     */
+    bool expireStorages(size_t max);
+    /** Scheduled job expiring due storages, within EXPIRE_STORE_BUDGET */
+    void expireStoreStep();
+    /** Indexes storage id to be expired at t, if earlier than already indexed */
+    void indexStorageExpiration(const InfoHash& id, Storage& st, time_point t);
 
     void storageChanged(const InfoHash& id, Storage& st, ValueStorage&, bool newValue);
+    ValuesSnapshot snapshotStorage(const decltype(store)::value_type&) const;
+    /** @return a stored value identical to value if any, or value */
+    Sp<Value> internValue(const Sp<Value>& value);
+    void importKeyValues(const ValuesExport&);
+    /** Sends deferred listener updates, within LISTENER_UPDATES_BUDGET */
+    void sendListenerUpdates();
+    /** Defers an update, replacing a pending update of the same value to this listener */
+    void queueListenerUpdate(const InfoHash& id, const Sp<Node>& node, size_t socket_id, const Sp<Value>&);
+    void sendListenerUpdate(const InfoHash& id, const Sp<Node>& node, size_t socket_id, const Listener&, const Sp<Value>&);
     std::string printStorageLog(const decltype(store)::value_type&) const;
 
     /**
@@ -514,7 +637,27 @@ private:
     void expireSearches();
 
     void confirmNodes();
+
+    /**
+     * Routing table snapshots, saved next to the state file.
+     * Buckets are restored as they were, and their nodes are then
+     * pinged as maintenance, instead of being inserted one by one.
+     */
+    void saveRoutingSnapshot(const std::string& path) const;
+    bool loadRoutingSnapshot(const std::string& path);
+
+    /**
+     * Queue a maintenance message, to be sent by the next maintenance
+     * tick with the other messages due.
+     */
+    void queueMaintenance(MaintenanceTask&& task);
+    void maintenance();
     void expire();
+
+    /** Run a periodic() pass, processing a message with process() */
+    template <typename ProcessFn>
+    time_point periodicStep(const time_point& now, ProcessFn&& process);
+
     void onDisconnected();
 
     /**
@@ -563,14 +706,40 @@ private:
      */
     void searchSendAnnounceValue(const Sp<Search>& sr);
 
+    /* values to announce, with their next refresh time */
+    using AnnounceList = std::vector<std::pair<Sp<Value>, time_point>>;
+
+    /**
+     * Sends 'put' requests for values created at the same time to a
+     * search node, several values per request if the node supports it.
+     */
+    void searchNodeSendAnnounce(const Sp<Search>& sr, SearchNode& sn, time_point created, const AnnounceList& values,
+            const net::NetworkEngine::RequestCb& onDone, const net::NetworkEngine::RequestExpiredCb& onExpired);
+
+    /**
+     * Sends 'refresh' requests for permanent values to a search node,
+     * several values per request if the node supports it.
+     * Values unknown to the node are put again.
+     */
+    void searchNodeSendRefresh(const Sp<Search>& sr, SearchNode& sn, const AnnounceList& values,
+            const net::NetworkEngine::RequestCb& onDone, const net::NetworkEngine::RequestExpiredCb& onExpired);
+
+    /**
+     * Schedules a step of the search at t to refresh its permanent values.
+     * A single job per search is kept, at the earliest requested time.
+     */
+    void scheduleRefresh(const Sp<Search>& sr, time_point t);
+
     /**
      * Main process of a Search's operations. This function will demand the
      * network engine to send requests packets for all pending operations
      * ('get', 'put' and 'listen').
      *
      * @param sr  The search to execute its operations.
+     * @param what  Operations to evaluate (STEP_*), in addition to the ones
+     *              marked by Search::scheduleStep since the last step.
      */
-    void searchStep(Sp<Search>);
+    void searchStep(Sp<Search>, unsigned what = STEP_ALL);
     void searchSynchedNodeListen(const Sp<Search>&, SearchNode&);
 
     void dumpSearch(const Search& sr, std::ostream& out) const;
@@ -20,11 +20,13 @@
 
 #include "infohash.h"
 #include "log_enable.h"
+#include "network_utils.h"
 
 namespace dht {
 
 namespace net {
     class DatagramSocket;
+    struct NetworkMetrics;
 }
 
 class OPENDHT_PUBLIC DhtInterface {
@@ -48,6 +50,12 @@ public:
 
     virtual net::DatagramSocket* getSocket() const { return {}; };
 
+    /**
+     * Latency distributions measured by the network layer, if any.
+     * Can be read from any thread.
+     */
+    virtual std::shared_ptr<net::NetworkMetrics> getNetworkMetrics() const { return {}; };
+
     /**
      * Get the ID of the DHT node.
      */
@@ -86,6 +94,11 @@ public:
     virtual time_point periodic(const uint8_t *buf, size_t buflen, SockAddr, const time_point& now) = 0;
     virtual time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) = 0;
 
+    /** Process a received packet, using pkt.msg if it was already decoded */
+    virtual time_point periodic(net::ReceivedPacket&& pkt, const time_point& now) {
+        return periodic(pkt.data.data(), pkt.data.size(), std::move(pkt.from), now);
+    }
+
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
      * and call the provided get callback when values are found at key.
@@ -197,6 +210,19 @@ public:
     virtual std::vector<ValuesExport> exportValues() const = 0;
     virtual void importValues(const std::vector<ValuesExport>&) = 0;
 
+    /**
+     * Calls cb with the values of each stored key, packed one key
+     * at a time instead of all at once.
+     */
+    virtual void exportValuesTo(const ValuesExportCallback& cb) const {
+        for (auto& e : exportValues())
+            if (not cb(std::move(e)))
+                break;
+    }
+
+    /** @return the stored values, see ValuesSnapshot */
+    virtual std::vector<ValuesSnapshot> getValuesSnapshot() const { return {}; }
+
     virtual NodeStats getNodesStats(sa_family_t af) const = 0;
 
     virtual std::string getStorageLog() const = 0;
@@ -220,6 +246,11 @@ public:
      */
     virtual std::pair<size_t, size_t> getStoreSize() const = 0;
 
+    /**
+     * Returns the approximate memory used by each subsystem.
+     */
+    virtual MemoryStats getMemoryStats() const { return {}; }
+
     virtual std::vector<SockAddr> getPublicAddress(sa_family_t family = 0) = 0;
 
     /**
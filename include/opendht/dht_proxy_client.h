@@ -52,11 +52,23 @@ public:
 
     DhtProxyClient();
 
+    /**
+     * @param serverHost  proxy URL, or a comma separated list of proxy URLs
+     */
     explicit DhtProxyClient(
         std::shared_ptr<crypto::Certificate> serverCA, crypto::Identity clientIdentity,
         std::function<void()> loopSignal, const std::string& serverHost,
         const std::string& pushClientId = "", std::shared_ptr<Logger> logger = {});
 
+    /**
+     * Operations go to the fastest healthy proxy of serverHosts, and move
+     * to another one if it fails or gets slow.
+     */
+    explicit DhtProxyClient(
+        std::shared_ptr<crypto::Certificate> serverCA, crypto::Identity clientIdentity,
+        std::function<void()> loopSignal, const std::vector<std::string>& serverHosts,
+        const std::string& pushClientId = "", std::shared_ptr<Logger> logger = {});
+
     void setHeaderFields(http::Request& request);
 
     virtual void setPushNotificationToken(const std::string& token) override {
@@ -264,9 +276,11 @@ public:
     std::vector<unsigned> getNodeMessageStats(bool) override { return {}; }
     void setStorageLimit(size_t) override {}
     void connectivityChanged(sa_family_t) override {
+        resetConnections(getProxyUrl());
         getProxyInfos();
     }
     void connectivityChanged() override {
+        resetConnections(getProxyUrl());
         getProxyInfos();
         loopSignal_();
     }
@@ -309,9 +323,50 @@ private:
     void handleResubscribe(const asio::error_code& ec, const InfoHash& key,
                            const size_t token, std::shared_ptr<OperationState> opstate);
 
+    /**
+     * Stream carrying the listen operations of all keys over one connection,
+     * used instead of a request per listen when no device key is set.
+     * Guarded by searchLock_.
+     */
+    struct Stream;
+    Sp<Stream> stream_;
+    /* set if the proxy doesn't provide streams */
+    std::atomic_bool streamUnsupported_ {false};
+
+    /** Queue an operation for the stream, opening it if needed */
+    void streamSend(Json::Value&& op);
+    void openStream();
+    void flushStream();
+    /** Falls back to a request per key for the listen operations refused by the proxy */
+    void onStreamResults(const std::weak_ptr<Stream>& stream, const Json::Value& ops, const std::string& body);
+    void onStreamValue(const InfoHash& key, Sp<Value> value, bool expired);
+    void onStreamClosed(const std::weak_ptr<Stream>& stream, unsigned status_code, bool aborted);
+    /** Listen on key over the stream if possible, or with a request */
+    void startListen(const InfoHash& key, size_t token, Listener& listener, bool stream = true);
+
+    /** Sends the put now, or queues it for the next batch if the proxy supports it */
     void doPut(const InfoHash&, Sp<Value>, DoneCallbackSimple, time_point created, bool permanent);
+    void sendPut(const InfoHash&, Sp<Value>, DoneCallbackSimple, bool permanent);
+    /** Records the id given by the proxy to val */
+    void onPutResult(const InfoHash& key, const Sp<Value>& val, Value::Id id, bool permanent);
     void handleRefreshPut(const asio::error_code& ec, InfoHash key, Value::Id id);
 
+    /**
+     * Puts issued within BATCH_DELAY of each other, sent with one request.
+     * Guarded by batchLock_, the timer is only used on the http thread.
+     */
+    struct BatchPut {
+        InfoHash key;
+        Sp<Value> value;
+        DoneCallbackSimple cb;
+        bool permanent;
+    };
+    std::mutex batchLock_;
+    std::vector<BatchPut> batchPuts_;
+    Sp<asio::steady_timer> batchTimer_;
+    void flushPuts(const asio::error_code& ec);
+    void sendBatch(std::vector<BatchPut>&& puts);
+
     /**
      * Initialize statusIpvX_
      */
@@ -322,6 +377,27 @@ private:
     void cancelAllListeners();
 
     std::atomic_bool isDestroying_ {false};
+    /* set if the proxy advertises msgpack, used instead of JSON for values */
+    std::atomic_bool useMsgpack_ {false};
+    /* set if the proxy advertises batch requests */
+    std::atomic_bool useBatch_ {false};
+
+    /**
+     * Proxies to choose from, probed with the node info query.
+     * proxyUrl_ is the one of proxies_[currentProxy_].
+     * Guarded by proxyLock_, with resolver_.
+     */
+    struct ProxyCandidate {
+        std::string url;
+        /* smoothed node info round trip, max() until probed */
+        std::chrono::steady_clock::duration latency {std::chrono::steady_clock::duration::max()};
+        bool healthy {true};
+    };
+    mutable std::mutex proxyLock_;
+    std::vector<ProxyCandidate> proxies_;
+    size_t currentProxy_ {0};
+    std::chrono::steady_clock::time_point lastProxySwitch_ {};
+    Sp<asio::steady_timer> proxyProbeTimer_;
 
     std::string proxyUrl_;
     dht::crypto::Identity clientIdentity_;
@@ -349,6 +425,24 @@ private:
      */
     asio::io_context httpContext_;
     std::shared_ptr<http::Resolver> resolver_;
+    /* keep-alive connections to the proxy, used by all requests */
+    const std::shared_ptr<http::ConnectionPool> connectionPool_ {std::make_shared<http::ConnectionPool>()};
+    /** Drops the pooled connections and the cached addresses of proxyUrl */
+    void resetConnections(const std::string& proxyUrl);
+    std::string getProxyUrl() const;
+
+    void probeProxies(const asio::error_code& ec);
+    void onProxyProbe(size_t index, bool ok, std::chrono::steady_clock::duration latency);
+    /**
+     * Picks the proxy to move to, called with proxyLock_.
+     * @param failed  set if the current proxy failed
+     * @return the index of the proxy, or proxies_.size() to stay
+     */
+    size_t selectProxy(bool failed) const;
+    /** Moves all operations to proxies_[index] */
+    void switchProxy(size_t index);
+    /** Marks the current proxy failed, moving to another one if possible */
+    void onProxyFailed();
 
     mutable std::mutex requestLock_;
     std::map<unsigned, std::shared_ptr<http::Request>> requests_;
@@ -409,6 +503,7 @@ private:
     std::unique_ptr<Json::CharReader> jsonReader_;
 
     std::shared_ptr<http::Request> buildRequest(const std::string& target = {});
+    std::shared_ptr<http::Request> buildRequest(const std::shared_ptr<http::Resolver>& resolver, const std::string& target);
 };
 
 }
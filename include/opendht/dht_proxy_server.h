@@ -28,11 +28,15 @@
 #include "sockaddr.h"
 #include "value.h"
 #include "http.h"
+#include "rate_limiter.h"
 
 #include <restinio/all.hpp>
 #include <restinio/tls.hpp>
 #include <json/json.h>
 
+#include <array>
+#include <atomic>
+#include <list>
 #include <memory>
 #include <mutex>
 
@@ -63,8 +67,24 @@ using RequestStatus = restinio::request_handling_status_t;
 
 struct ProxyServerConfig {
     in_port_t port {8000};
+    /* number of threads running the HTTP server, 0 for one per core */
+    unsigned threads {1};
+    /* lifetime of the cached GET responses, 0 to disable the cache */
+    duration getCacheTtl {std::chrono::seconds(5)};
+    /* requests accepted per second from one IP address, 0 for no limit */
+    size_t maxRequestsPerIp {0};
+    /* IPv6 clients are limited together by prefix of this length, as they usually get a whole /64 */
+    unsigned ipv6LimitPrefix {64};
+    /* subscriptions and permanent puts accepted per second for one push token, 0 for no limit */
+    size_t maxRequestsPerPushToken {0};
+    /* requests of one route handled or waiting for the DHT at once,
+       or listens open at once, 0 for no limit */
+    size_t maxConcurrentRequests {0};
     std::string pushServer {};
     std::string persistStatePath {};
+    /* permanent puts and push listens re-issued per second when the state
+       is restored, 0 for no limit */
+    size_t restoreRate {1000};
     dht::crypto::Identity identity {};
 };
 
@@ -106,13 +126,34 @@ public:
         size_t pushListenersCount {0};
         /** Average requests per second */
         double requestRate {0};
+        /** GET requests answered from the cache, since the start */
+        size_t getCacheHits {0};
+        /** GET requests sent to the DHT while the cache is enabled, since the start */
+        size_t getCacheMisses {0};
         /** Node Info **/
         std::shared_ptr<NodeInfo> nodeInfo {};
 
+        template <typename Packer>
+        void msgpack_pack(Packer& pk) const
+        {
+            pk.pack_map(nodeInfo ? 8 : 7);
+            pk.pack("listenCount"); pk.pack(listenCount);
+            pk.pack("putCount"); pk.pack(putCount);
+            pk.pack("totalPermanentPuts"); pk.pack(totalPermanentPuts);
+            pk.pack("pushListenersCount"); pk.pack(pushListenersCount);
+            pk.pack("requestRate"); pk.pack(requestRate);
+            pk.pack("getCacheHits"); pk.pack(getCacheHits);
+            pk.pack("getCacheMisses"); pk.pack(getCacheMisses);
+            if (nodeInfo) {
+                pk.pack("nodeInfo"); pk.pack(*nodeInfo);
+            }
+        }
+
         std::string toString() const {
             std::ostringstream ss;
             ss << "Listens: " << listenCount << " Puts: " << putCount << " PushListeners: " << pushListenersCount << std::endl;
             ss << "Requests: " << requestRate << " per second." << std::endl;
+            ss << "GET cache hits: " << getCacheHits << " misses: " << getCacheMisses << std::endl;
             if (nodeInfo) {
                 auto& ipv4 = nodeInfo->ipv4;
                 if (ipv4.table_depth > 1)
@@ -134,25 +175,30 @@ public:
             result["totalPermanentPuts"] = static_cast<Json::UInt64>(totalPermanentPuts);
             result["pushListenersCount"] = static_cast<Json::UInt64>(pushListenersCount);
             result["requestRate"] = requestRate;
+            result["getCacheHits"] = static_cast<Json::UInt64>(getCacheHits);
+            result["getCacheMisses"] = static_cast<Json::UInt64>(getCacheMisses);
             if (nodeInfo)
                 result["nodeInfo"] = nodeInfo->toJson();
             return result;
         }
     };
 
-    std::shared_ptr<ServerStats> stats() const { return stats_; }
+    std::shared_ptr<ServerStats> stats() const { return std::atomic_load(&stats_); }
 
     std::shared_ptr<ServerStats> updateStats(std::shared_ptr<NodeInfo> info) const;
 
     std::shared_ptr<DhtRunner> getNode() const { return dht_; }
 
+    /** @return the memory used by the node, and by the operations of the proxy */
+    MemoryStats getMemoryStats() const;
+
 private:
     class ConnectionListener;
     struct RestRouterTraitsTls;
     struct RestRouterTraits;
 
     template <typename HttpResponse>
-    static HttpResponse initHttpResponse(HttpResponse response);
+    static HttpResponse initHttpResponse(HttpResponse response, bool msgpack = false);
     static restinio::request_handling_status_t serverError(restinio::request_t& request);
 
     template< typename ServerSettings >
@@ -163,6 +209,18 @@ private:
 
     void onConnectionClosed(restinio::connection_id_t);
 
+    /** Routes measured separately in the metrics */
+    enum class Route : uint8_t { NodeInfo = 0, NodeStats, Metrics, Options, Get, Put, Listen, Stream, Subscribe, Unsubscribe, Sign, Encrypt, Batch };
+    static constexpr size_t ROUTES {13};
+
+    using RouteHandler = std::function<RequestStatus(restinio::request_handle_t, restinio::router::route_params_t)>;
+    /** Wraps a route handler to record its latency and requests in flight */
+    RouteHandler measured(Route route, RouteHandler&& handler);
+
+    /** @return false if the request must be rejected before any work */
+    bool admit(Route route, const restinio::request_t& request);
+    static RequestStatus tooManyRequests(restinio::request_t& request);
+
     /**
      * Return the PublicKey id, the node id and node stats
      * Method: GET "/"
@@ -182,6 +240,16 @@ private:
     RequestStatus getStats(restinio::request_handle_t request,
                            restinio::router::route_params_t params);
 
+    /**
+     * Return the server metrics in the Prometheus text format:
+     * request latency histograms by route, requests in flight,
+     * connections, push queue depth and DHT latency histograms.
+     * Method: GET "/metrics"
+     * Result: HTTP 200, body: metrics in text format
+     */
+    RequestStatus getMetrics(restinio::request_handle_t request,
+                             restinio::router::route_params_t params);
+
     /**
      * Return Values of an infoHash
      * Method: GET "/{InfoHash: .*}"
@@ -220,7 +288,59 @@ private:
     RequestStatus put(restinio::request_handle_t request,
                       restinio::router::route_params_t params);
 
-    void handleCancelPermamentPut(const asio::error_code &ec, const InfoHash& key, Value::Id vid);
+    /**
+     * Put several values on the DHT with one request
+     * Method: POST "/batch"
+     * body = JSON array of operations:
+     * {"op":"put","key":"<hash>","value":<Value in JSON>,"permanent":<as for put>}
+     * Return: HTTP 200 once all operations are done, with a JSON array of
+     * their results in order: {"ok":true,"id":"<value id>"}
+     * HTTP 400, body: {"err":"xxxx"} if bad json or too many operations
+     * @param session
+     */
+    RequestStatus batch(restinio::request_handle_t request,
+                        restinio::router::route_params_t params);
+
+    using PutCallback = std::function<void(bool ok)>;
+    /**
+     * Puts value at key, as a permanent put if permanent is not null:
+     * true or the push request of the client.
+     * done is called with the result, once value->id is set.
+     * @return false if the push token is rate limited, done isn't called.
+     */
+    bool putValue(const InfoHash& key, const Sp<Value>& value, const Json::Value& permanent, PutCallback done);
+
+    /**
+     * Open a stream carrying the listen operations of a client on many keys,
+     * over a single connection.
+     * Method: GET "/stream/open"
+     * Return: Multiple JSON object in parts. The first one is {"stream":"<id>"},
+     * followed by the values of the keys listened, with a "key" member,
+     * and the results of the puts: {"key":"<hash>","put":"<value id>","ok":true}
+     * The stream is closed with its connection.
+     * Objects are msgpack maps instead of JSON lines if the client
+     * accepts application/msgpack.
+     * @param session
+     */
+    RequestStatus openStream(restinio::request_handle_t request,
+                             restinio::router::route_params_t params);
+
+    /**
+     * Send operations to a stream
+     * Method: POST "/stream/{id}"
+     * body = JSON array of operations:
+     * {"op":"listen","key":"<hash>"}, {"op":"cancel","key":"<hash>"}
+     * or {"op":"put","key":"<hash>","value":<Value in JSON>,"permanent":...}
+     * Puts go through the same limits as REST puts, their results are sent on the stream.
+     * Return: HTTP 200, body: JSON array with the result of each operation,
+     * {"ok":true} or {"ok":false,"err":"xxxx"}; HTTP 404 if the stream is unknown
+     * HTTP 400, body: {"err":"xxxx"} if bad json
+     * @param session
+     */
+    RequestStatus streamOperations(restinio::request_handle_t request,
+                                   restinio::router::route_params_t params);
+
+    void handleCancelPermamentPut(const InfoHash& key, Value::Id vid);
 
 #ifdef OPENDHT_PROXY_SERVER_IDENTITY
     /**
@@ -296,36 +416,42 @@ private:
                               restinio::router::route_params_t params);
 
     /**
-     * Send a push notification via a gorush push gateway
+     * Send a push notification via a gorush push gateway.
+     * Notifications are queued by type and priority, and sent in batches.
      * @param key of the device
      * @param json, the content to send
      */
     void sendPushNotification(const std::string& key, Json::Value&& json, PushType type, bool highPriority);
 
+    /** Send the queued push notifications */
+    void flushPushNotifications();
+
+    /** Send an array of notifications to the push gateway */
+    void sendPushBatch(Json::Value&& notifications);
+
     /**
      * Send push notification with an expire timeout.
-     * @param ec
      * @param pushToken
      * @param json
      * @param type
      */
-    void handleNotifyPushListenExpire(const asio::error_code &ec, const std::string pushToken,
+    void handleNotifyPushListenExpire(const std::string pushToken,
                                       std::function<Json::Value()> json, PushType type);
 
     /**
      * Remove a push listener between a client and a hash
-     * @param ec
      * @param pushToken
      * @param key
      * @param clientId
      */
-    void handleCancelPushListen(const asio::error_code &ec, const std::string pushToken,
+    void handleCancelPushListen(const std::string pushToken,
                                 const InfoHash key, const std::string clientId);
 
 #endif //OPENDHT_PUSH_NOTIFICATIONS
 
     void handlePrintStats(const asio::error_code &ec);
     void updateStats();
+    void startServerThreads(unsigned threads, std::function<void()>&& open);
 
     template <typename Os>
     void saveState(Os& stream);
@@ -336,24 +462,81 @@ private:
     using clock = std::chrono::steady_clock;
     using time_point = clock::time_point;
 
+    /**
+     * Map split in shards with their own lock, by hash of the key,
+     * so that operations on different keys don't contend.
+     * ShardData is extra state kept by each shard, guarded by its lock.
+     */
+    struct NoShardData {};
+    template <typename Key, typename T, typename ShardData = NoShardData>
+    class ShardedMap {
+    public:
+        static constexpr size_t SHARDS {16};
+        struct Shard : ShardData {
+            std::mutex lock;
+            std::map<Key, T> map;
+        };
+        Shard& shard(const Key& key) { return shards_[index(key)]; }
+        std::array<Shard, SHARDS>& shards() { return shards_; }
+    private:
+        std::array<Shard, SHARDS> shards_ {};
+        /* keys may be chosen by clients */
+        const SeededIdHash hash_ {crypto::random_device{}()};
+        size_t index(const InfoHash& key) const { return hash_(key) % SHARDS; }
+        size_t index(const std::string& key) const {
+            // seeded FNV-1a, std::hash isn't seeded
+            uint64_t h = 14695981039346656037ull ^ hash_.seed;
+            for (unsigned char c : key)
+                h = (h ^ c) * 1099511628211ull;
+            h = (h ^ (h >> 29)) * UINT64_C(0x9e3779b97f4a7c15);
+            return (h ^ (h >> 32)) % SHARDS;
+        }
+        size_t index(uint64_t key) const { return key % SHARDS; }
+    };
+
+    /**
+     * Packs a sharded map as a single msgpack array of rows.
+     * rows(entry) returns the number of rows of an entry, packed by pack(pk, key, entry).
+     */
+    template <typename Packer, typename Key, typename T, typename Rows, typename Pack>
+    static void packRows(Packer& pk, ShardedMap<Key, T>& map, Rows&& rows, Pack&& pack);
+
+    struct ClientLimiter {
+        RateLimiter limiter;
+        /* position in the LRU list of the shard */
+        std::list<const std::string*>::iterator lru;
+    };
+    struct LimitersOrder {
+        /* keys of the shard, least recently seen first */
+        std::list<const std::string*> lru;
+    };
+    using Limiters = ShardedMap<std::string, ClientLimiter, LimitersOrder>;
+    /**
+     * @return false if the quota of key is reached.
+     * When the table is full, the least recently seen client is forgotten.
+     */
+    bool limit(Limiters& limiters, const std::string& key, size_t quota);
+    /** @return the key of the client of request in ipLimiters_ */
+    std::string clientKey(const restinio::request_t& request) const;
+
     std::shared_ptr<asio::io_context> ioContext_;
     std::shared_ptr<DhtRunner> dht_;
     Json::StreamWriterBuilder jsonBuilder_;
     Json::CharReaderBuilder jsonReaderBuilder_;
+    std::mutex rdLock_;
     std::mt19937_64 rd {crypto::getSeededRandomEngine<std::mt19937_64>()};
 
     std::string persistPath_;
 
-    // http server
-    std::thread serverThread_;
+    // http server, run by a pool of threads sharing the io context
+    std::vector<std::thread> serverThreads_;
     std::unique_ptr<restinio::http_server_t<RestRouterTraitsTls>> httpsServer_;
     std::unique_ptr<restinio::http_server_t<RestRouterTraits>> httpServer_;
 
     // http client
     std::pair<std::string, std::string> pushHostPort_;
 
-    mutable std::mutex requestLock_;
-    std::map<unsigned int /*id*/, std::shared_ptr<http::Request>> requests_;
+    ShardedMap<uint64_t /*id*/, std::shared_ptr<http::Request>> requests_;
 
     std::shared_ptr<dht::Logger> logger_;
 
@@ -361,10 +544,38 @@ private:
     std::shared_ptr<NodeInfo> nodeInfo_ {};
     std::unique_ptr<asio::steady_timer> printStatsTimer_;
 
-    // Thread-safe access to listeners map.
-    std::mutex lockListener_;
+    /**
+     * Timing wheel driving the expirations of permanent puts and push
+     * listeners, run by a single timer of the io context.
+     */
+    class ExpirationWheel;
+    std::unique_ptr<ExpirationWheel> expirations_;
+
+    /**
+     * Task run on the io context at a given time by the expiration wheel,
+     * cancelled when destroyed. Refreshing it is a constant time operation.
+     */
+    class Expiration {
+    public:
+        Expiration() {}
+        Expiration(Expiration&& o) noexcept : wheel_(o.wheel_), job_(std::move(o.job_)) {}
+        Expiration& operator=(Expiration&& o) noexcept;
+        ~Expiration() { cancel(); }
+
+        /** Runs task at t, replacing the previous task */
+        void set(ExpirationWheel& wheel, time_point t, std::function<void()>&& task);
+        /** Runs the task again at t, once set */
+        void reschedule(time_point t);
+        void cancel();
+
+        explicit operator bool() const { return (bool)job_; }
+    private:
+        ExpirationWheel* wheel_ {nullptr};
+        Sp<Scheduler::Job> job_ {};
+    };
+
     // Shared with connection listener.
-    std::map<restinio::connection_id_t, http::ListenerSession> listeners_;
+    ShardedMap<uint64_t /*restinio::connection_id_t*/, http::ListenerSession> listeners_;
     // Connection Listener observing conn state changes.
     std::shared_ptr<ConnectionListener> connListener_;
 
@@ -378,42 +589,166 @@ private:
         std::string pushToken;
         std::string clientId;
         std::shared_ptr<PushSessionContext> sessionCtx;
-        std::unique_ptr<asio::steady_timer> expireTimer;
-        std::unique_ptr<asio::steady_timer> expireNotifyTimer;
+        Expiration expireTimer;
+        Expiration expireNotifyTimer;
         Sp<Value> value;
         PushType type;
 
-        template <typename Packer>
-        void msgpack_pack(Packer& p) const
-        {
-            p.pack_map(2 + (sessionCtx ? 1 : 0) + (clientId.empty() ? 0 : 1) + (type == PushType::None ? 0 : 2));
-            p.pack("value"); p.pack(value);
-            p.pack("exp"); p.pack(to_time_t(expiration));
-            if (not clientId.empty()) {
-                p.pack("cid"); p.pack(clientId);
-            }
-            if (sessionCtx) {
-                std::lock_guard<std::mutex> l(sessionCtx->lock);
-                p.pack("sid"); p.pack(sessionCtx->sessionId);
-            }
-            if (type != PushType::None) {
-                p.pack("t"); p.pack(type);
-                p.pack("token"); p.pack(pushToken);
-            }
-        }
-
+        /* state saved by previous versions */
         void msgpack_unpack(const msgpack::object& o);
     };
     struct SearchPuts {
         std::map<dht::Value::Id, PermanentPut> puts;
         MSGPACK_DEFINE_ARRAY(puts)
     };
-    std::mutex lockSearchPuts_;
-    std::map<InfoHash, SearchPuts> puts_;
+    ShardedMap<InfoHash, SearchPuts> puts_;
+
+    /**
+     * Operations of the restored state waiting to be re-issued to the DHT,
+     * by increasing expiration: the most recently refreshed are restored first.
+     */
+    struct RestoreOp {
+        time_point expiration;
+        InfoHash key;
+        /* permanent put vid if pushToken is empty, push listen of clientId otherwise */
+        Value::Id vid {0};
+        std::string pushToken;
+        std::string clientId;
+    };
+    const size_t restoreRate_;
+    std::mutex restoreLock_;
+    std::vector<RestoreOp> restoreQueue_;
+    std::unique_ptr<asio::steady_timer> restoreTimer_;
+
+    /** Starts re-issuing the operations of restoreQueue_ */
+    void startRestore();
+    void handleRestore(const asio::error_code& ec);
+    void restore(const RestoreOp& op);
+
+    /**
+     * Called with the values received or expired on a shared listen,
+     * and their serialization if requested.
+     */
+    using ListenSubscriber = std::function<void(const std::vector<Sp<Value>>& values, bool expired, const std::shared_ptr<std::string>& body)>;
+    /**
+     * Serialization of the values given to a subscriber: JSON lines,
+     * or msgpack maps {"v": value, "exp": true, "key": hash} if packed.
+     * Keyed serializations include the key.
+     */
+    enum class ListenBody : uint8_t { None = 0, Values, KeyedValues, Packed, KeyedPacked };
+    static constexpr size_t LISTEN_BODIES {5};
+
+    /**
+     * A single DHT listen on a key, shared by all the listen sessions
+     * and push listeners of the key.
+     */
+    struct SharedListen {
+        SharedListen(const InfoHash& k) : key(k) {}
+        const InfoHash key;
+        std::mutex lock;
+        std::future<size_t> token;
+        /* values currently found, sent to new subscribers */
+        std::map<Value::Id, Sp<Value>> values;
+        /* subscribers, and the serialization they need */
+        std::map<size_t, std::pair<Sp<ListenSubscriber>, ListenBody>> subscribers;
+        std::array<size_t, LISTEN_BODIES> bodySubscribers {};
+        size_t nextId {1};
+        time_point start {clock::now()};
+        /* serialized values, for GET requests, cleared on updates */
+        std::array<std::shared_ptr<std::string>, LISTEN_BODIES> bodies {};
+    };
+    ShardedMap<InfoHash, Sp<SharedListen>> sharedListens_;
+
+    /** @return the subscription id, to unsubscribe */
+    size_t subscribeListen(const InfoHash& key, ListenSubscriber&& cb, ListenBody body);
+    void unsubscribeListen(const InfoHash& key, size_t id);
+    void onListenValues(SharedListen& listen, const std::vector<Sp<Value>>& values, bool expired);
+    /** Serializes values, with key for keyed serializations */
+    std::shared_ptr<std::string> serializeValues(const std::vector<Sp<Value>>& values, bool expired,
+                                                 ListenBody body = ListenBody::Values, const InfoHash& key = {}) const;
+
+    /* A stream opened by a client, carrying the listens of many keys */
+    struct StreamSession {
+        /* guards subscriptions */
+        std::mutex lock;
+        std::map<InfoHash, size_t> subscriptions;
+        /* values are sent as ListenBody::KeyedPacked if set */
+        bool packed {false};
+        /* guards response */
+        std::mutex writeLock;
+        std::shared_ptr<restinio::response_builder_t<restinio::chunked_output_t>> response;
+        void write(std::shared_ptr<std::string> data);
+    };
+    ShardedMap<std::string /*stream id*/, Sp<StreamSession>> streams_;
+    ShardedMap<uint64_t /*restinio::connection_id_t*/, std::string> streamConnections_;
+    void closeStream(const std::string& id);
+
+    /**
+     * Cache of GET responses, by key and filter.
+     * Unfiltered GET requests are also answered from the shared listen
+     * of the key, once it ran for longer than the cache lifetime.
+     * Responses are stamped with the cache generation read when their
+     * DHT get started, and dropped if a PUT on the key came after it.
+     */
+    struct CachedGet {
+        std::shared_ptr<std::string> body;
+        time_point expiration;
+        uint64_t generation;
+    };
+    struct CachedGets {
+        /* generation of the last PUT on the key */
+        uint64_t invalidated {0};
+        std::map<std::pair<ListenBody, std::string /*where*/>, CachedGet> entries;
+    };
+    static constexpr size_t MAX_CACHED_GETS {4096};
+    const duration getCacheTtl_;
+    ShardedMap<InfoHash, CachedGets> getCache_;
+    std::atomic<uint64_t> getCacheGeneration_ {0};
+    /* highest PUT generation of the keys evicted from the cache */
+    std::atomic<uint64_t> getCacheEvicted_ {0};
+    std::atomic<size_t> getCacheHits_ {0};
+    std::atomic<size_t> getCacheMisses_ {0};
+
+    /** @return the cached response, or null */
+    std::shared_ptr<std::string> getCached(const InfoHash& key, const std::string& where, ListenBody format);
+    /** @return the generation to pass to cacheGet for a DHT get starting now */
+    uint64_t getCacheGeneration() const { return getCacheGeneration_.load(); }
+    void cacheGet(const InfoHash& key, const std::string& where, ListenBody format, std::shared_ptr<std::string> body, uint64_t generation);
+    void invalidateGetCache(const InfoHash& key);
+    void pruneGetCache(ShardedMap<InfoHash, CachedGets>::Shard& shard, time_point now);
+
+    /**
+     * Admission control, enforced before the DHT is involved.
+     * Clients are limited by IP address and push token, and the requests
+     * of each route being handled or waiting for the DHT are capped.
+     */
+    static constexpr size_t MAX_LIMITERS {64 * 1024};
+    const size_t maxRequestsPerIp_;
+    const size_t maxRequestsPerPushToken_;
+    const size_t maxConcurrentRequests_;
+    const unsigned ipv6LimitPrefix_;
+    Limiters ipLimiters_;
+    Limiters pushTokenLimiters_;
+    std::array<std::atomic<size_t>, ROUTES> routeOps_ {};
+    std::array<std::atomic<uint64_t>, ROUTES> rateLimited_ {};
+    std::array<std::atomic<uint64_t>, ROUTES> concurrencyLimited_ {};
+
+    /* counters for ServerStats, updated along the maps */
+    std::atomic<size_t> listenCount_ {0};
+    std::atomic<size_t> putCount_ {0};
+    std::atomic<size_t> permanentPutCount_ {0};
+    std::atomic<size_t> pushListenersCount_ {0};
 
     mutable std::atomic<size_t> requestNum_ {0};
     mutable std::atomic<time_point> lastStatsReset_ {time_point::min()};
 
+    /* metrics, updated without locking */
+    std::array<LatencyHistogram, ROUTES> routeLatency_ {};
+    std::atomic<size_t> requestsInFlight_ {0};
+    LatencyHistogram dhtGetLatency_ {};
+    LatencyHistogram dhtPutLatency_ {};
+    std::atomic<size_t> dhtOpsInFlight_ {0};
+
     std::string pushServer_;
 
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
@@ -421,33 +756,35 @@ private:
         time_point expiration;
         std::string clientId;
         std::shared_ptr<PushSessionContext> sessionCtx;
-        std::future<size_t> internalToken;
-        std::unique_ptr<asio::steady_timer> expireTimer;
-        std::unique_ptr<asio::steady_timer> expireNotifyTimer;
+        /* subscription to the shared listen of the key */
+        size_t subscription {0};
+        Expiration expireTimer;
+        Expiration expireNotifyTimer;
         PushType type;
 
-        template <typename Packer>
-        void msgpack_pack(Packer& p) const
-        {
-            p.pack_map(sessionCtx ? 4 : 3);
-            p.pack("cid"); p.pack(clientId);
-            p.pack("exp"); p.pack(to_time_t(expiration));
-            if (sessionCtx) {
-                std::lock_guard<std::mutex> l(sessionCtx->lock);
-                p.pack("sid"); p.pack(sessionCtx->sessionId);
-            }
-            p.pack("t"); p.pack(type);
-        }
-
+        /* state saved by previous versions */
         void msgpack_unpack(const msgpack::object& o);
     };
     struct PushListener {
         std::map<InfoHash, std::vector<Listener>> listeners;
         MSGPACK_DEFINE_ARRAY(listeners)
     };
-    std::mutex lockPushListeners_;
-    std::map<std::string, PushListener> pushListeners_;
+    ShardedMap<std::string, PushListener> pushListeners_;
     proxy::ListenToken tokenPushNotif_ {0};
+
+    /** Subscribes a push listener to the shared listen of key */
+    void subscribePushListen(const std::string& pushToken, const InfoHash& key, Listener& listener);
+
+    /* notifications waiting to be sent, by type and priority */
+    static constexpr size_t PUSH_BATCH_SIZE {100};
+    static constexpr size_t MAX_IDLE_PUSH_CONNECTIONS {4};
+    std::mutex pushLock_;
+    std::map<std::pair<PushType, bool>, Json::Value> pushBatches_;
+    std::unique_ptr<asio::steady_timer> pushTimer_;
+    bool pushTimerScheduled_ {false};
+    /* keep-alive connections to the push gateway */
+    const std::shared_ptr<http::ConnectionPool> pushConnections_ {
+        std::make_shared<http::ConnectionPool>(http::ConnectionPool::Config {MAX_IDLE_PUSH_CONNECTIONS})};
 #endif //OPENDHT_PUSH_NOTIFICATIONS
 };
 
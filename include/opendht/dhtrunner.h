@@ -27,6 +27,7 @@
 #include "sockaddr.h"
 #include "log_enable.h"
 #include "network_utils.h"
+#include "mpsc_queue.h"
 
 #include <thread>
 #include <mutex>
@@ -34,7 +35,6 @@
 #include <condition_variable>
 #include <future>
 #include <exception>
-#include <queue>
 #include <chrono>
 
 namespace dht {
@@ -44,6 +44,12 @@ class SecureDht;
 class PeerDiscovery;
 struct SecureDhtConfig;
 
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+template <typename Executor> class GetAwaitable;
+template <typename Executor> class PutAwaitable;
+template <typename Executor> class ListenGenerator;
+#endif
+
 /**
  * Provides a thread-safe interface to run the (secure) DHT.
  * The class will open sockets on the provided port and will
@@ -55,14 +61,46 @@ class OPENDHT_PUBLIC DhtRunner {
 public:
     using StatusCallback = std::function<void(NodeStatus, NodeStatus)>;
 
+    /** What to drop when the receive queue is full */
+    enum class RxQueuePolicy {
+        /** Drop the oldest packets */
+        DropOldest,
+        /**
+         * Drop new requests from other nodes first, keeping replies
+         * and data for our own operations.
+         */
+        ShedRequests
+    };
+
     struct Config {
         SecureDhtConfig dht_config {};
         bool threaded {true};
+        /** Proxy URL, or comma separated proxy URLs to choose from */
         std::string proxy_server {};
         std::string push_node_id {};
         std::string push_token {};
         bool peer_discovery {false};
         bool peer_publish {false};
+        /**
+         * LAN bootstrap: with peer_publish, the good nodes of the routing
+         * table are published with the node. With peer_discovery, until
+         * the node is connected, a discovered peer and the nodes it
+         * publishes are pinged, and inserted once they answer.
+         */
+        bool lan_bootstrap {false};
+        /** Number of UDP receive threads, sharing the port with SO_REUSEPORT */
+        unsigned receive_threads {1};
+        /**
+         * Number of DHT engines run by the runner, up to 256. Each engine
+         * has its own thread, socket and node id, and handles the keys
+         * of a slice of the keyspace, selected by their first byte.
+         * Node information and statistics are the ones of the first engine.
+         * Requires threaded mode, and is ignored when using a proxy.
+         */
+        unsigned shards {1};
+        /** Maximum number of received packets waiting for the DHT thread */
+        size_t rx_queue_max_size {net::RX_QUEUE_MAX_SIZE};
+        RxQueuePolicy rx_queue_policy {RxQueuePolicy::ShedRequests};
         std::shared_ptr<dht::crypto::Certificate> server_ca;
         dht::crypto::Identity client_identity;
     };
@@ -134,6 +172,26 @@ public:
         return p->get_future();
     }
 
+    /**
+     * Get the first value found for key and matching the filter,
+     * or nullptr if no value is found.
+     * The search stops as soon as a value is received, without waiting
+     * for other nodes: callbacks returning false to get() do the same.
+     */
+    std::future<Sp<Value>> getFirst(InfoHash key, Value::Filter f = {}, Where w = {}) {
+        auto p = std::make_shared<std::promise<Sp<Value>>>();
+        auto value = std::make_shared<Sp<Value>>();
+        get(key, [=](const std::vector<Sp<Value>>& vlist) {
+            if (not *value and not vlist.empty())
+                *value = vlist.front();
+            return not *value;
+        }, [=](bool) {
+            p->set_value(std::move(*value));
+        },
+        f, w);
+        return p->get_future();
+    }
+
     template <class T>
     std::future<std::vector<T>> get(InfoHash key) {
         auto p = std::make_shared<std::promise<std::vector<T>>>();
@@ -255,6 +313,37 @@ public:
     }
     void putEncrypted(const std::string& key, InfoHash to, Value&& value, DoneCallback cb={}, bool permanent = false);
 
+    /**
+     * Batch operations, queued to the DHT thread as a single operation.
+     * Done callbacks are either called for each item with its index in
+     * the batch, or once all items are done, with success if all succeeded.
+     */
+    void putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, BatchDoneCallback cb, bool permanent = false);
+    void putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, DoneCallbackSimple cb = {}, bool permanent = false);
+
+    void getMany(std::vector<InfoHash> keys, BatchGetCallback cb, BatchDoneCallback donecb, Value::Filter f = {}, Where w = {});
+    void getMany(std::vector<InfoHash> keys, BatchGetCallback cb, DoneCallbackSimple donecb = {}, Value::Filter f = {}, Where w = {});
+
+    /**
+     * @return a future to the listen tokens, in the order of keys,
+     *         to be used with cancelListen.
+     */
+    std::future<std::vector<size_t>> listenMany(std::vector<InfoHash> keys, BatchValueCallback cb, Value::Filter f = {}, Where w = {});
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+    /**
+     * Awaitable operations for C++20 coroutines, defined in awaitable.h.
+     * The coroutine is resumed by calling executor with a function,
+     * from the thread completing the operation.
+     */
+    template <typename Executor>
+    GetAwaitable<Executor> getAsync(InfoHash key, Executor executor, Value::Filter f = {}, Where w = {});
+    template <typename Executor>
+    PutAwaitable<Executor> putAsync(InfoHash key, std::shared_ptr<Value> value, Executor executor, bool permanent = false);
+    template <typename Executor>
+    ListenGenerator<Executor> listenAsync(InfoHash key, Executor executor, Value::Filter f = {}, Where w = {});
+#endif
+
     /**
      * Insert known nodes to the routing table, without necessarly ping them.
      * Usefull to restart a node and get things running fast without putting load on the network.
@@ -321,12 +410,22 @@ public:
 
     std::pair<size_t, size_t> getStoreSize() const;
 
+    /** @return the approximate memory used by each subsystem */
+    MemoryStats getMemoryStats() const;
+
     void setStorageLimit(size_t limit = DEFAULT_STORAGE_LIMIT);
 
     std::vector<NodeExport> exportNodes() const;
 
     std::vector<ValuesExport> exportValues() const;
 
+    /**
+     * Calls cb with the values of each stored key, from the calling thread.
+     * The DHT is only locked while taking a ValuesSnapshot, values
+     * are packed and passed to cb afterwards.
+     */
+    void exportValuesTo(const ValuesExportCallback& cb) const;
+
     void setLogger(const Sp<Logger>& logger = {});
     void setLogger(const Logger& logger) {
         setLogger(std::make_shared<Logger>(logger));
@@ -351,6 +450,14 @@ public:
     NodeInfo getNodeInfo() const;
     void getNodeInfo(std::function<void(std::shared_ptr<NodeInfo>)>);
 
+    /**
+     * @return the latency histograms of the local DHT instance,
+     *         readable from any thread, or null if not running.
+     */
+    std::shared_ptr<net::NetworkMetrics> getNetworkMetrics() const {
+        return metrics_;
+    }
+
     std::vector<unsigned> getNodeMessageStats(bool in = false) const;
     std::string getStorageLog() const;
     std::string getStorageLog(const InfoHash&) const;
@@ -467,6 +574,13 @@ private:
 
     bool checkShutdown();
     void opEnded();
+
+    /** Publishes the node with peer discovery, and nodes for LAN bootstrap */
+    void publishPeer(const std::vector<NodeExport>& nodes = {});
+    /** Bootstraps from a peer discovered on the LAN and the nodes it exports */
+    void bootstrapLan(const InfoHash& id, const SockAddr& addr, std::vector<NodeExport>&& nodes);
+    /* next time the exported nodes are published, for LAN bootstrap */
+    time_point nextLanExport_ {time_point::min()};
     DoneCallback bindOpDoneCallback(DoneCallback&& cb);
     DoneCallbackSimple bindOpDoneCallback(DoneCallbackSimple&& cb);
 
@@ -476,6 +590,9 @@ private:
     /** Proxy client instance */
     std::unique_ptr<SecureDht> dht_via_proxy_;
 
+    /** Latency metrics of the local DHT instance */
+    std::shared_ptr<net::NetworkMetrics> metrics_;
+
     /** true if we are currently using a proxy */
     std::atomic_bool use_proxy {false};
 
@@ -491,6 +608,39 @@ private:
      */
     SecureDht* activeDht() const;
 
+    /**
+     * Start the other DHT engines, with node ids in their key slice.
+     */
+    void startShards(const Config& config, const std::shared_ptr<Logger>& logger, const CertificateStoreQuery& certificateStore);
+    /**
+     * @return the engine handling key when sharded,
+     *         or nullptr if key is handled by this runner.
+     */
+    DhtRunner* shardFor(const InfoHash& key) const;
+    DhtRunner& runnerFor(const InfoHash& key) {
+        auto shard = shardFor(key);
+        return shard ? *shard : *this;
+    }
+
+    void putMany_(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, BatchDoneCallback cb, bool permanent);
+    void getMany_(std::vector<InfoHash> keys, BatchGetCallback cb, BatchDoneCallback donecb, Value::Filter f, Where w);
+    std::future<std::vector<size_t>> listenMany_(std::vector<InfoHash> keys, BatchValueCallback cb, Value::Filter f, Where w);
+
+    /**
+     * Start listening on the DHT thread.
+     * @return the runner listen token
+     */
+    size_t listen_(SecureDht& dht, InfoHash hash, ValueCallback vcb, Value::Filter f, Where w);
+
+    /**
+     * Signal the DHT thread after pushing an operation or a packet,
+     * if it is waiting for work.
+     */
+    void wakeUp();
+
+    /** @return a callback running functions on the DHT thread, for SecureDht */
+    std::function<void(std::function<void()>&&)> getLoopCallback();
+
     /**
      * Store current listeners and translates global tokens for each client.
      */
@@ -502,14 +652,26 @@ private:
     std::thread dht_thread {};
     std::condition_variable cv {};
     std::mutex sock_mtx {};
+    /* replies (or every packet with DropOldest), and requests from other nodes */
     net::PacketList rcv {};
+    decltype(rcv) rcv_requests {};
     decltype(rcv) rcv_free {};
-
-    std::queue<std::function<void(SecureDht&)>> pending_ops_prio {};
-    std::queue<std::function<void(SecureDht&)>> pending_ops {};
+    /* received packets dropped before being processed */
+    net::DropCounters rx_dropped_ {};
+
+    /* Operations to run on the DHT thread, pushed from any thread */
+    using Operation = std::function<void(SecureDht&)>;
+    MpscQueue<Operation> pending_ops_prio {};
+    MpscQueue<Operation> pending_ops {};
+    /* true while the DHT thread waits, or is about to wait, on cv */
+    std::atomic_bool parked {false};
     std::mutex storage_mtx {};
 
     std::atomic<State> running {State::Idle};
+
+    /* Other DHT engines when sharded, and the engine of each key slice */
+    std::vector<std::unique_ptr<DhtRunner>> shards_ {};
+    std::vector<DhtRunner*> slices_ {};
     std::atomic_size_t ongoing_ops {0};
     std::vector<ShutdownCallback> shutdownCallbacks_;
 
@@ -33,9 +33,13 @@
 #include <restinio/http_headers.hpp>
 #include <restinio/message_builders.hpp>
 
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
 #include <queue>
 #include <mutex>
+#include <tuple>
 
 namespace Json {
 class Value;
@@ -116,6 +120,11 @@ public:
     void timeout(const std::chrono::seconds timeout, HandlerCb cb = {});
     void close();
 
+    /** @return the TLS session of the connection, to resume it later */
+    std::shared_ptr<SSL_SESSION> get_tls_session() const;
+    /** Resumes session on the next handshake, if the server accepts it */
+    void set_tls_session(const std::shared_ptr<SSL_SESSION>& session);
+
 private:
 
     template<typename T>
@@ -145,6 +154,76 @@ private:
     std::shared_ptr<dht::Logger> logger_;
 };
 
+/**
+ * Idle keep-alive connections, shared by the requests to the same servers.
+ *
+ * Connections are kept by host, port and TLS settings, at most
+ * maxIdlePerHost per server, and are closed once idle for idleTimeout.
+ * The last TLS session of every server is kept too, so that a new
+ * connection can resume it instead of doing a full handshake.
+ * All connections of a pool must use the same io_context.
+ */
+class OPENDHT_PUBLIC ConnectionPool
+{
+public:
+    struct Config {
+        size_t maxIdlePerHost {4};
+        std::chrono::seconds idleTimeout {30};
+    };
+
+    struct Key {
+        std::string host;
+        std::string service;
+        bool ssl {false};
+        /* certificate authority and client identity of TLS connections */
+        std::string credentials {};
+
+        bool operator<(const Key& o) const {
+            return std::tie(host, service, ssl, credentials) < std::tie(o.host, o.service, o.ssl, o.credentials);
+        }
+    };
+
+    ConnectionPool() : ConnectionPool(Config {}) {}
+    ConnectionPool(Config config) : config_(config) {}
+    ~ConnectionPool();
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    /** @return an open idle connection to key, or nullptr */
+    std::shared_ptr<Connection> get(const Key& key);
+
+    /** Keeps a connection for a next request to key */
+    void put(const Key& key, std::shared_ptr<Connection> conn);
+
+    /** Closes the idle connections and drops the TLS sessions */
+    void clear();
+
+    /** @return the number of idle connections */
+    size_t size() const;
+
+    std::shared_ptr<SSL_SESSION> get_tls_session(const Key& key) const;
+    void set_tls_session(const Key& key, std::shared_ptr<SSL_SESSION> session);
+
+private:
+    using clock = std::chrono::steady_clock;
+    struct Idle {
+        std::shared_ptr<Connection> conn;
+        clock::time_point since;
+    };
+    struct Host {
+        std::deque<Idle> idle;
+        std::shared_ptr<SSL_SESSION> session;
+    };
+
+    /** Moves the connections idle for too long to expired */
+    void expire(clock::time_point now, std::vector<std::shared_ptr<Connection>>& expired);
+
+    const Config config_;
+    mutable std::mutex lock_;
+    std::map<Key, Host> hosts_;
+};
+
 /**
  * Session value associated with a connection_id_t key.
  */
@@ -152,12 +231,76 @@ struct ListenerSession
 {
     ListenerSession() = default;
     dht::InfoHash hash;
-    std::future<size_t> token;
+    /* subscription to the shared listen of hash */
+    size_t subscription {0};
     std::shared_ptr<restinio::response_builder_t<restinio::chunked_output_t>> response;
 };
 
+/**
+ * Process-wide cache of host name resolutions, shared by all resolvers.
+ *
+ * The system resolver doesn't report record TTLs: endpoints are kept for
+ * ttl and errors for errorTtl. An entry used after refreshAfter is resolved
+ * again in the background while its endpoints are still served.
+ * Endpoints alternate address families, IPv6 first (RFC 8305), and the
+ * last endpoint a connection succeeded to comes first.
+ * This is only an order: connections try the endpoints one after the
+ * other, without racing attempts or a timeout per endpoint, so an
+ * unreachable address delays the connection by the system connect timeout.
+ * An expired entry is resolved again before being used.
+ */
+class OPENDHT_PUBLIC ResolverCache
+{
+public:
+    struct Config {
+        std::chrono::seconds ttl {300};
+        std::chrono::seconds refreshAfter {240};
+        std::chrono::seconds errorTtl {5};
+        size_t maxEntries {256};
+    };
+
+    static ResolverCache& instance();
+
+    void setConfig(const Config& config);
+
+    /**
+     * @param refresh  set to true if the caller should resolve host again,
+     *                 only once until the next set().
+     * @return true if a valid entry was found.
+     */
+    bool get(const std::string& host, const std::string& service, asio::error_code& ec,
+             std::vector<asio::ip::tcp::endpoint>& endpoints, bool& refresh);
+
+    /**
+     * Stores a resolution, an error doesn't replace valid endpoints.
+     * @return endpoints in connection order.
+     */
+    std::vector<asio::ip::tcp::endpoint> set(const std::string& host, const std::string& service,
+             const asio::error_code& ec, std::vector<asio::ip::tcp::endpoint> endpoints);
+
+    /** Tries endpoint first for the next connections to host */
+    void connected(const std::string& host, const std::string& service, const asio::ip::tcp::endpoint& endpoint);
+
+    void erase(const std::string& host, const std::string& service);
+    void clear();
+
+private:
+    using clock = std::chrono::steady_clock;
+    struct Entry {
+        asio::error_code ec;
+        std::vector<asio::ip::tcp::endpoint> endpoints;
+        clock::time_point resolved;
+        bool refreshing {false};
+    };
+
+    mutable std::mutex lock_;
+    Config config_ {};
+    std::map<std::pair<std::string, std::string>, Entry> entries_;
+};
+
 /* @class Resolver
  * @brief The purpose is to only resolve once to avoid mutliple dns requests per operation.
+ * Resolutions are shared through the ResolverCache.
  */
 class OPENDHT_PUBLIC Resolver
 {
@@ -189,6 +332,8 @@ public:
 
 private:
     void resolve(const std::string& host, const std::string& service);
+    /** Resolves with the system resolver, and stores the result in the cache */
+    void lookup(const std::string& host, const std::string& service, bool background);
 
     mutable std::mutex mutex_;
 
@@ -200,6 +345,9 @@ private:
 
     bool completed_ {false};
     std::queue<ResolverCb> cbs_;
+    /* set if endpoints_ come from the cache, resolved for url_.host and service_ */
+    bool cached_ {false};
+    std::string service_;
 
     std::shared_ptr<dht::Logger> logger_;
 };
@@ -255,6 +403,12 @@ public:
     inline unsigned int id() const { return  id_; };
     void set_connection(std::shared_ptr<Connection> connection);
     std::shared_ptr<Connection> get_connection() const;
+
+    /**
+     * Take the connection from pool when possible, and give it back
+     * once done if the server kept it alive.
+     */
+    void set_connection_pool(std::shared_ptr<ConnectionPool> pool);
     inline const Url& get_url() const {
         return resolver_->get_url();
     };
@@ -321,9 +475,20 @@ private:
 
     void connect(std::vector<asio::ip::tcp::endpoint>&& endpoints, HandlerCb cb = {});
 
+    ConnectionPool::Key pool_key() const;
+    /**
+     * Sends the request again on a new connection if ec happened before
+     * any response on a pooled connection, likely closed by the server.
+     * A request that was sent, even partly, is only sent again if its
+     * method is idempotent.
+     * @return true if the request is sent again.
+     */
+    bool retry(const asio::error_code& ec, bool sent);
+    bool is_idempotent() const;
+
     void post();
 
-    void handle_request(const asio::error_code& ec);
+    void handle_request(const asio::error_code& ec, size_t sent);
     void handle_response(const asio::error_code& ec, size_t bytes);
 
     void onHeadersComplete();
@@ -352,6 +517,9 @@ private:
     asio::io_context& ctx_;
     sa_family_t family_ = AF_UNSPEC;
     std::shared_ptr<Connection> conn_;
+    std::shared_ptr<ConnectionPool> pool_;
+    /* set if conn_ was taken from pool_ */
+    bool reused_ {false};
     std::shared_ptr<Resolver> resolver_;
 
     Response response_ {};
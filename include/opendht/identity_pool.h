@@ -0,0 +1,80 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "crypto.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace dht {
+namespace crypto {
+
+/**
+ * Pool of identities generated ahead of demand.
+ *
+ * Missing identities are generated in the background, on the computation
+ * thread pool, so that get() usually returns immediately.
+ * If a path is set, the identities ready are saved to path.<n>.pem and
+ * path.<n>.crt, and loaded back when the pool is created. An identity is
+ * removed from disk before get() returns it, so it is never handed out twice.
+ * Private keys are saved encrypted with the password if one is set, and in
+ * clear otherwise. On POSIX systems key files are only readable by their owner.
+ */
+class OPENDHT_PUBLIC IdentityPool {
+public:
+    using Generator = std::function<Identity()>;
+
+    struct Config {
+        /* number of identities kept ready */
+        size_t size {2};
+        /* generates a new identity, a 4096 bits RSA identity if not set */
+        Generator generator {};
+        /* prefix of the files of the identities saved, if not empty */
+        std::string path {};
+        /* password encrypting the private keys saved, saved in clear if empty */
+        std::string password {};
+    };
+
+    IdentityPool();
+    IdentityPool(Config config);
+    ~IdentityPool();
+
+    IdentityPool(const IdentityPool&) = delete;
+    IdentityPool& operator=(const IdentityPool&) = delete;
+
+    /**
+     * @return a new identity, generated on the calling thread
+     *         if none is ready.
+     */
+    Identity get();
+
+    /** @return the number of identities ready */
+    size_t available() const;
+
+private:
+    struct State;
+    std::shared_ptr<State> state_;
+};
+
+}
+}
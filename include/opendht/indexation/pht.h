@@ -24,6 +24,7 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <list>
 #include <functional>
 #include <stdexcept>
 #include <bitset>
@@ -298,6 +299,9 @@ public:
      */
     static constexpr const size_t MAX_NODE_ENTRY_COUNT {16};
 
+    /* Default number of trie nodes fetched at once by a range query */
+    static constexpr const size_t RANGE_QUERY_WINDOW {8};
+
     /* A key for a an index entry */
     using Key = std::map<std::string, Blob>;
 
@@ -315,6 +319,8 @@ public:
         };
     }
     using LookupCallbackSimple = std::function<void(std::vector<std::shared_ptr<Value>>& values)>;
+    /* Receives the values of a leaf, returns false to stop the query */
+    using RangeCallback = std::function<bool(std::vector<std::shared_ptr<Value>>& values)>;
     typedef void (*LookupCallbackSimpleRaw)(std::vector<std::shared_ptr<Value>>* values, void *user_data);
     static LookupCallbackSimple
     bindLookupCbSimple(LookupCallbackSimpleRaw raw_cb, void* user_data) {
@@ -359,7 +365,54 @@ public:
         Pht::insert(p, entry, lo, hi, clock::now(), true, done_cb);
     }
 
+    /**
+     * Inserts many entries at once.
+     *
+     * Entries are sorted by linearized key and grouped by leaf: the trie
+     * is looked up once per distinct leaf, and leaves overflowing
+     * MAX_NODE_ENTRY_COUNT are split locally before the entries are put.
+     * DHT round trips then scale with the number of leaves.
+     *
+     * @param entries : Keys and values to insert
+     * @param done_cb : Callback called once all entries are inserted,
+     *                  with false if any insertion failed
+     */
+    void bulkInsert(const std::vector<std::pair<Key, Value>>& entries, DoneCallbackSimple done_cb = {});
+
+    /**
+     * Streams the entries with a linearized key between min and max,
+     * included. For keys of several fields, the order is the one of the
+     * z-curve interleaving their bits.
+     *
+     * The leaves covering the range are fetched a window of nodes at a
+     * time, and their entries are passed to cb in key order, one leaf at
+     * a time. The query stops once cb returns false.
+     *
+     * @param min     : Lowest key of the range
+     * @param max     : Highest key of the range
+     * @param cb      : Callback receiving the entries, leaf by leaf
+     * @param done_cb : Callback called once the range is covered or cb
+     *                  stopped the query, with false if a get failed
+     * @param window  : Maximum number of trie nodes fetched at once
+     */
+    void rangeQuery(Key min, Key max, RangeCallback cb, DoneCallbackSimple done_cb = {},
+                    size_t window = RANGE_QUERY_WINDOW);
+
+    /**
+     * Saves the leaves known by the lookups to path, so that a new Pht
+     * can start warm with loadCache().
+     */
+    void saveCache(const std::string& path) const;
+
+    /**
+     * Loads the leaves saved by saveCache(), ignoring the expired ones.
+     * Nothing is loaded if the file is missing or invalid.
+     */
+    void loadCache(const std::string& path);
+
 private:
+    /* Number of depths split points probed at once by a lookup step */
+    static constexpr const int LOOKUP_PROBES {3};
 
     /**
      * Insert function which really insert onto the pht
@@ -376,43 +429,72 @@ private:
     void insert(const Prefix& kp, IndexEntry entry, std::shared_ptr<int> lo, std::shared_ptr<int> hi, time_point time_p,
                 bool check_split, DoneCallbackSimple done_cb = {});
 
+    /**
+     * Leaves met by lookups, used to start the next lookups of a key from
+     * the depth of its leaf.
+     *
+     * Leaves are kept in least recently used order: the branches of the
+     * tree no longer leading to a leaf destroy themselves.
+     */
     class Cache {
     public:
         /**
          * Insert all needed node into the tree according to a prefix
          * @param p : Prefix that we need to insert
+         * @param last_reply : Time the leaf was known to be at p
          */
-        void insert(const Prefix& p);
+        void insert(const Prefix& p, time_point last_reply = clock::now());
 
         /**
          * Lookup into the tree to return the maximum prefix length in the cache tree
          *
          * @param p : Prefix that we are looking for
          *
-         * @return  : The size of the longest prefix known in the cache between 0 and p.size_
+         * @return  : The size of the longest prefix known in the cache between 0 and p.size_ - 1,
+         *            or -1 if the cache is empty
          */
 
         int lookup(const Prefix& p);
 
+        /**
+         * Calls cb for every leaf in the cache, least recently used first.
+         */
+        void forEach(const std::function<void(const Prefix& p, time_point last_reply)>& cb) const;
+
     private:
-        static constexpr const size_t MAX_ELEMENT {1024};
-        static constexpr const std::chrono::minutes NODE_EXPIRE_TIME {5};
+        static constexpr const size_t MAX_ELEMENT {16384};
+        static constexpr const std::chrono::hours NODE_EXPIRE_TIME {1};
+
+        struct Node;
+        struct Leaf {
+            Prefix prefix;
+            std::shared_ptr<Node> node;
+        };
+        using Leaves = std::list<Leaf>;
 
         struct Node {
             time_point last_reply;           /* Made the assocation between leaves and leaves multimap */
             std::shared_ptr<Node> parent;    /* Share_ptr to the parent, it allow the self destruction of tree */
             std::weak_ptr<Node> left_child;  /* Left child, for bit equal to 1 */
             std::weak_ptr<Node> right_child; /* Right child, for bit equal to 0 */
+            Leaves::iterator leaf;           /* Position in leaves_, if is_leaf */
+            bool is_leaf {false};
         };
 
         std::weak_ptr<Node> root_;                         /* Root of the tree */
 
         /**
-         * This mutlimap contains all prefix insert in the tree in time order
+         * This list contains all prefix insert in the tree, most recently used first.
          * We could then delete the last one if there is too much node
          * The tree will self destroy is branch ( thanks to share_ptr )
          */
-        std::multimap<time_point, std::shared_ptr<Node>> leaves_;
+        Leaves leaves_;
+
+        /** Removes the leaves expired or over MAX_ELEMENT */
+        void expire(time_point now);
+
+        /** Moves the node to the front of leaves_ */
+        void touch(const std::shared_ptr<Node>& node, const Prefix& p);
     };
 
     /* Callback used for insert value by using the pht */
@@ -423,6 +505,12 @@ private:
      * Performs a step in the lookup operation. Each steps are performed
      * asynchronously.
      *
+     * A step gets LOOKUP_PROBES depths of the range and their children at
+     * once, narrowing the range to a fraction of its size. When start is
+     * set, the step gets the node at start, as well as its child and its
+     * parent: the cached leaf is confirmed, or found one level up after a
+     * merge, in a single round trip.
+     *
      * @param k          : Prefix on which the lookup is performed
      * @param lo         : lowest bound on the prefix (where to start)
      * @param hi         : highest bound on the prefix (where to stop)
@@ -503,6 +591,62 @@ private:
      */
     void split(const Prefix& insert, const std::vector<std::shared_ptr<IndexEntry>>& vals, IndexEntry entry, RealInsertCallback end_cb);
 
+    /* State of a bulk insertion, entries are sorted by prefix */
+    struct BulkInsert {
+        std::vector<IndexEntry> entries;
+        size_t next {0};      /* First entry not yet looked up */
+        unsigned pending {1}; /* Lookups and puts in progress */
+        bool ok {true};
+        time_point time_p;
+        DoneCallbackSimple done_cb;
+
+        void end(bool success) {
+            ok = ok and success;
+            if (--pending == 0 and done_cb)
+                done_cb(ok);
+        }
+    };
+
+    void bulkInsert(std::vector<IndexEntry> entries, time_point time_p, DoneCallbackSimple done_cb);
+
+    /**
+     * Looks up the leaf of the next entry of the bulk insertion, then
+     * publishes all the following entries belonging to the same leaf.
+     */
+    void bulkInsertStep(std::shared_ptr<BulkInsert> op);
+
+    /**
+     * Publishes entries under the node at prefix.size_ bits of their
+     * prefix, splitting the node until leaves hold MAX_NODE_ENTRY_COUNT
+     * entries or less.
+     *
+     * @param entries : Entries sharing the first depth bits of their prefix
+     * @param depth   : Depth of the node in the trie
+     */
+    void publishLeaves(std::vector<IndexEntry> entries, size_t depth, const std::shared_ptr<BulkInsert>& op);
+
+    /**
+     * Same as checkPhtUpdate for all the entries of a leaf, with one listen.
+     */
+    void checkPhtUpdate(Prefix p, std::vector<IndexEntry> entries, time_point time_p);
+
+    /* State of a range query, the nodes of the range in key order */
+    struct RangeQuery;
+    struct RangeSlot;
+
+    /**
+     * Passes the leaves ready at the front of the range to the callback,
+     * then fetches the next nodes, up to the window of the query.
+     */
+    void rangeStep(const std::shared_ptr<RangeQuery>& q);
+
+    /**
+     * Gets the entries of the node of slot and the canary of its first
+     * child: the slot is replaced by its children if the child is in the
+     * trie, or becomes a leaf.
+     */
+    void rangeFetch(const std::shared_ptr<RangeQuery>& q, const std::shared_ptr<RangeSlot>& slot);
+
     /**
      * Tells if the key is valid according to the key spec.
      */
@@ -105,9 +105,10 @@ public:
     bool operator!=(const Hash& h) const { return !(*this == h); }
 
     bool operator<(const Hash& o) const {
-        for(unsigned i = 0; i < N; i++) {
-            if(data_[i] != o.data_[i])
-                return data_[i] < o.data_[i];
+        for (unsigned i = 0; i < WORDS; i++) {
+            auto w1 = word(*this, i), w2 = word(o, i);
+            if (w1 != w2)
+                return w1 < w2;
         }
         return false;
     }
@@ -130,16 +131,11 @@ public:
      * Result will allways be lower than 8*N
      */
     inline int lowbit() const {
-        int i, j;
-        for(i = N-1; i >= 0; i--)
-            if(data_[i] != 0)
-                break;
-        if(i < 0)
-            return -1;
-        for(j = 7; j >= 0; j--)
-            if((data_[i] & (0x80 >> j)) != 0)
-                break;
-        return 8 * i + j;
+        for (int i = WORDS-1; i >= 0; i--) {
+            if (auto w = word(*this, i))
+                return 64 * i + 63 - ctz(w);
+        }
+        return -1;
     }
 
     /**
@@ -154,45 +150,53 @@ public:
     static inline unsigned
     commonBits(const Hash& id1, const Hash& id2)
     {
-        unsigned i, j;
-        uint8_t x;
-        for(i = 0; i < N; i++) {
-            if(id1.data_[i] != id2.data_[i])
-                break;
-        }
-
-        if(i == N)
-            return 8*N;
-
-        x = id1.data_[i] ^ id2.data_[i];
-
-        j = 0;
-        while((x & 0x80) == 0) {
-            x <<= 1;
-            j++;
+        for (unsigned i = 0; i < WORDS; i++) {
+            if (auto x = word(id1, i) ^ word(id2, i))
+                return 64 * i + clz(x);
         }
-
-        return 8 * i + j;
+        return 8*N;
     }
 
     /** Determine whether id1 or id2 is closer to this */
     int
     xorCmp(const Hash& id1, const Hash& id2) const
     {
-        for(unsigned i = 0; i < N; i++) {
-            uint8_t xor1, xor2;
-            if(id1.data_[i] == id2.data_[i])
+        for (unsigned i = 0; i < WORDS; i++) {
+            auto w1 = word(id1, i), w2 = word(id2, i);
+            if (w1 == w2)
                 continue;
-            xor1 = id1.data_[i] ^ data_[i];
-            xor2 = id2.data_[i] ^ data_[i];
-            if(xor1 < xor2)
-                return -1;
-            else
-                return 1;
+            auto w = word(*this, i);
+            return (w1 ^ w) < (w2 ^ w) ? -1 : 1;
         }
         return 0;
     }
 
+    /**
+     * Finds the ids closest to this one in the XOR metric.
+     * Distances are computed once per id, 64 bits at a time.
+     * @return the indices in ids of the k (at most) closest ids, closest first.
+     */
+    std::vector<size_t>
+    closest(const Hash* ids, size_t count, size_t k) const
+    {
+        using Distance = std::array<uint64_t, WORDS>;
+        std::vector<std::pair<Distance, size_t>> dist(count);
+        Distance self;
+        for (unsigned w = 0; w < WORDS; w++)
+            self[w] = word(*this, w);
+        for (size_t i = 0; i < count; i++) {
+            for (unsigned w = 0; w < WORDS; w++)
+                dist[i].first[w] = word(ids[i], w) ^ self[w];
+            dist[i].second = i;
+        }
+        k = std::min(k, count);
+        std::partial_sort(dist.begin(), dist.begin() + k, dist.end());
+        std::vector<size_t> ret(k);
+        for (size_t i = 0; i < k; i++)
+            ret[i] = dist[i].second;
+        return ret;
+    }
+
     bool
     getBit(unsigned nbit) const
     {
@@ -263,8 +267,63 @@ public:
         std::copy_n(o.via.bin.ptr, N, data_.data());
     }
 private:
+    static constexpr unsigned WORDS = (N + 7) / 8;
+
+    /**
+     * @return the big-endian 64 bits word at index i of h,
+     *         zero-padded past the end of the hash.
+     */
+    static inline uint64_t word(const Hash& h, unsigned i) {
+        const auto begin = i * 8;
+        if (begin + 8 <= N) {
+            uint64_t w;
+            std::memcpy(&w, h.data_.data() + begin, sizeof(w));
+            return fromBigEndian(w);
+        }
+        uint64_t w = 0;
+        for (unsigned b = begin; b < begin + 8; b++)
+            w = (w << 8) | (b < N ? h.data_[b] : 0);
+        return w;
+    }
+
+    static inline uint64_t fromBigEndian(uint64_t w) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return w;
+#elif defined(__GNUC__)
+        return __builtin_bswap64(w);
+#elif defined(_MSC_VER)
+        return _byteswap_uint64(w);
+#else
+        w = ((w & 0x00ff00ff00ff00ffull) << 8)  | ((w >> 8)  & 0x00ff00ff00ff00ffull);
+        w = ((w & 0x0000ffff0000ffffull) << 16) | ((w >> 16) & 0x0000ffff0000ffffull);
+        return (w << 32) | (w >> 32);
+#endif
+    }
+
+    /* leading and trailing zero bits of w, that must not be zero */
+    static inline unsigned clz(uint64_t w) {
+#ifdef __GNUC__
+        return __builtin_clzll(w);
+#else
+        unsigned n = 0;
+        for (uint64_t m = 1ull << 63; not (w & m); m >>= 1) n++;
+        return n;
+#endif
+    }
+    static inline unsigned ctz(uint64_t w) {
+#ifdef __GNUC__
+        return __builtin_ctzll(w);
+#else
+        unsigned n = 0;
+        for (; not (w & 1); w >>= 1) n++;
+        return n;
+#endif
+    }
+
     T data_;
     void fromString(const char*);
+    /** Writes the 2*N hex characters of the hash to out */
+    void toHex(char* out) const;
 };
 
 #define HASH_LEN 20u
@@ -272,6 +331,53 @@ using InfoHash = Hash<HASH_LEN>;
 using h256 = Hash<32>;
 using PkId = h256;
 
+/**
+ * Hash function for unordered containers of ids that may be chosen by
+ * peers: ids are mixed with a random seed, so that colliding ids can't
+ * be forged.
+ */
+struct SeededIdHash {
+    uint64_t seed;
+    template <size_t N>
+    size_t operator()(const Hash<N>& id) const {
+        static_assert(N % sizeof(uint32_t) == 0, "hash size must be a multiple of 4");
+        uint64_t h = seed;
+        for (size_t i = 0; i < N; i += sizeof(uint32_t)) {
+            uint32_t w;
+            std::memcpy(&w, id.data() + i, sizeof(w));
+            h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+            h ^= h >> 29;
+        }
+        return static_cast<size_t>(h);
+    }
+};
+
+struct HexMap : public std::array<std::array<char, 2>, 256> {
+    HexMap() {
+        for (size_t i=0; i<size(); i++) {
+            auto& e = (*this)[i];
+            e[0] = hex_digits[(i >> 4) & 0x0F];
+            e[1] = hex_digits[i & 0x0F];
+        }
+    }
+private:
+    static constexpr const char* hex_digits = "0123456789abcdef";
+};
+
+/* Value of hex digits, 0xff for other characters */
+struct HexUnmap : public std::array<uint8_t, 256> {
+    HexUnmap() {
+        fill(0xff);
+        for (uint8_t i=0; i<10; i++)
+            (*this)['0' + i] = i;
+        for (uint8_t i=0; i<6; i++)
+            (*this)['a' + i] = (*this)['A' + i] = 10 + i;
+    }
+};
+
+OPENDHT_PUBLIC extern const HexMap hex_map;
+OPENDHT_PUBLIC extern const HexUnmap hex_unmap;
+
 template <size_t N>
 std::ostream& operator<< (std::ostream& s, const Hash<N>& h)
 {
@@ -300,18 +406,16 @@ Hash<N>::Hash(const std::string& hex) {
 template <size_t N>
 void
 Hash<N>::fromString(const char* in) {
-    auto hex2bin = [](char c) -> uint8_t {
-        if      (c >= 'a' and c <= 'f') return 10 + c - 'a';
-        else if (c >= 'A' and c <= 'F') return 10 + c - 'A';
-        else if (c >= '0' and c <= '9') return c - '0';
-        else throw std::domain_error("not an hex character");
-    };
-    try {
-        for (size_t i=0; i<N; i++)
-            data_[i] = (hex2bin(in[2*i]) << 4) | hex2bin(in[2*i+1]);
-    } catch (const std::domain_error&) {
-        data_.fill(0);
+    // invalid characters map to 0xff: check them once at the end
+    uint8_t invalid = 0;
+    for (size_t i=0; i<N; i++) {
+        auto hi = hex_unmap[(uint8_t)in[2*i]];
+        auto lo = hex_unmap[(uint8_t)in[2*i+1]];
+        invalid |= hi | lo;
+        data_[i] = (hi << 4) | (lo & 0x0F);
     }
+    if (invalid & 0xF0)
+        data_.fill(0);
 }
 
 template <size_t N>
@@ -340,30 +444,28 @@ Hash<N>::getRandom(Rd& rdev)
     return h;
 }
 
-struct HexMap : public std::array<std::array<char, 2>, 256> {
-    HexMap() {
-        for (size_t i=0; i<size(); i++) {
-            auto& e = (*this)[i];
-            e[0] = hex_digits[(i >> 4) & 0x0F];
-            e[1] = hex_digits[i & 0x0F];
-        }
+template <size_t N>
+void
+Hash<N>::toHex(char* out) const
+{
+    // 8 bytes at a time, giving the compiler full word stores
+    constexpr size_t words_end = N - N % 8;
+    for (size_t i = 0; i < words_end; i += 8) {
+        std::array<char, 16> chunk;
+        for (size_t j=0; j<8; j++)
+            std::memcpy(chunk.data() + 2*j, hex_map[data_[i+j]].data(), 2);
+        std::memcpy(out + 2*i, chunk.data(), chunk.size());
     }
-private:
-    static constexpr const char* hex_digits = "0123456789abcdef";
-};
-
-OPENDHT_PUBLIC extern const HexMap hex_map;
+    for (size_t i = words_end; i < N; i++)
+        std::memcpy(out + 2*i, hex_map[data_[i]].data(), 2);
+}
 
 template <size_t N>
 const char*
 Hash<N>::to_c_str() const
 {
-    thread_local std::array<char, N*2+1> buf;
-    for (size_t i=0; i<N; i++) {
-        auto b = buf.data()+i*2;
-        const auto& m = hex_map[data_[i]];
-        *((uint16_t*)b) = *((uint16_t*)&m);
-    }
+    thread_local std::array<char, N*2+1> buf {};
+    toHex(buf.data());
     return buf.data();
 }
 
@@ -371,7 +473,9 @@ template <size_t N>
 std::string
 Hash<N>::toString() const
 {
-    return std::string(to_c_str(), N*2);
+    std::string ret(N*2, '\0');
+    toHex(&ret[0]);
+    return ret;
 }
 
 const InfoHash zeroes {};
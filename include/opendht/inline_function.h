@@ -0,0 +1,157 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dht {
+
+template <typename Signature, size_t Capacity>
+class InlineFunction;
+
+/**
+ * Move-only function wrapper storing callables of up to Capacity bytes
+ * in place, without heap allocation.
+ * Larger callables are still accepted and moved to the heap.
+ */
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity> {
+public:
+    InlineFunction() {}
+    InlineFunction(std::nullptr_t) {}
+
+    template <typename F, typename D = typename std::decay<F>::type,
+              typename = typename std::enable_if<not std::is_same<D, InlineFunction>::value>::type>
+    InlineFunction(F&& f) {
+        emplace<D>(std::forward<F>(f));
+    }
+
+    InlineFunction(InlineFunction&& o) noexcept {
+        moveFrom(o);
+    }
+    InlineFunction& operator=(InlineFunction&& o) noexcept {
+        if (this != &o) {
+            reset();
+            moveFrom(o);
+        }
+        return *this;
+    }
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    R operator()(Args... args) {
+        if (not ops_)
+            throw std::bad_function_call();
+        return ops_->invoke(&storage_, std::forward<Args>(args)...);
+    }
+
+    void reset() {
+        if (ops_) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    /** @return true if callables of type F are stored in place */
+    template <typename F>
+    static constexpr bool fitsInline() {
+        return sizeof(F) <= Capacity
+           and alignof(F) <= alignof(Storage)
+           and std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    using Storage = typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type;
+
+    struct Ops {
+        R (*invoke)(void*, Args&&...);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    template <typename F>
+    struct InlineOps {
+        static R invoke(void* s, Args&&... args) {
+            return (*static_cast<F*>(s))(std::forward<Args>(args)...);
+        }
+        static void move(void* dst, void* src) {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void destroy(void* s) {
+            static_cast<F*>(s)->~F();
+        }
+        static constexpr Ops ops {&invoke, &move, &destroy};
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static F*& ptr(void* s) { return *static_cast<F**>(s); }
+        static R invoke(void* s, Args&&... args) {
+            return (*ptr(s))(std::forward<Args>(args)...);
+        }
+        static void move(void* dst, void* src) {
+            ::new (dst) F*(ptr(src));
+        }
+        static void destroy(void* s) {
+            delete ptr(s);
+        }
+        static constexpr Ops ops {&invoke, &move, &destroy};
+    };
+
+    Storage storage_;
+    const Ops* ops_ {nullptr};
+
+    template <typename F, typename T>
+    typename std::enable_if<fitsInline<F>()>::type emplace(T&& f) {
+        ::new (&storage_) F(std::forward<T>(f));
+        ops_ = &InlineOps<F>::ops;
+    }
+    template <typename F, typename T>
+    typename std::enable_if<not fitsInline<F>()>::type emplace(T&& f) {
+        ::new (&storage_) F*(new F(std::forward<T>(f)));
+        ops_ = &HeapOps<F>::ops;
+    }
+
+    void moveFrom(InlineFunction& o) {
+        if (o.ops_) {
+            o.ops_->move(&storage_, &o.storage_);
+            ops_ = o.ops_;
+            o.ops_ = nullptr;
+        }
+    }
+};
+
+template <typename R, typename... Args, size_t Capacity>
+template <typename F>
+constexpr typename InlineFunction<R(Args...), Capacity>::Ops InlineFunction<R(Args...), Capacity>::InlineOps<F>::ops;
+
+template <typename R, typename... Args, size_t Capacity>
+template <typename F>
+constexpr typename InlineFunction<R(Args...), Capacity>::Ops InlineFunction<R(Args...), Capacity>::HeapOps<F>::ops;
+
+}
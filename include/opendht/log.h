@@ -22,8 +22,11 @@
 #include "def.h"
 #include "log_enable.h"
 
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <string>
 
 namespace dht {
 
@@ -70,6 +73,57 @@ constexpr const Color::Modifier yellow(Color::FG_YELLOW);
 OPENDHT_PUBLIC void
 printLog(std::ostream &s, char const *m, va_list args);
 
+enum class LogLevel { debug, warning, error };
+
+/**
+ * A formatted log record.
+ */
+struct LogRecord {
+    LogLevel level {LogLevel::debug};
+    std::chrono::steady_clock::time_point time {};
+    std::string message {};
+};
+
+/**
+ * Print a log record to std::ostream, as printLog does.
+ */
+OPENDHT_PUBLIC void
+printRecord(std::ostream &s, const LogRecord& record);
+
+using LogSink = std::function<void(const LogRecord&)>;
+
+/**
+ * Logger writing to a sink from a background thread.
+ *
+ * Messages are formatted on the calling thread into a bounded lock-free
+ * ring buffer of records, which a writer thread passes to the sink, so
+ * that logging doesn't block on I/O. Records logged while the buffer is
+ * full are dropped and counted: the writer then reports them to the sink.
+ * Pending records are written when the logger is destroyed.
+ */
+class OPENDHT_PUBLIC AsyncLogger : public Logger {
+public:
+    AsyncLogger(LogSink sink, size_t capacity = 4096);
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    /** Blocks until the records logged before the call are written */
+    void flush();
+
+    /** @return the number of records dropped since the logger was created */
+    uint64_t getDropped() const;
+
+private:
+    struct Impl;
+    std::shared_ptr<Impl> impl_;
+};
+
+/**
+ * Asynchronous loggers writing to stdout and stderr, to a file
+ * or to syslog.
+ */
 OPENDHT_PUBLIC
 std::shared_ptr<Logger> getStdLogger();
 
@@ -44,7 +44,7 @@ struct LogMethod {
     LogMethod(const LogMethod& l) : func(l.func) {}
 
     LogMethod& operator=(dht::LogMethod&& l) {
-        func = std::forward<LogMethod>(l.func);
+        func = std::move(l.func);
         return *this;
     }
     LogMethod& operator=(const dht::LogMethod& l) {
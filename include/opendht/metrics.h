@@ -0,0 +1,177 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "def.h"
+#include "utils.h"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef OPENDHT_JSONCPP
+#include <json/json.h>
+#endif
+
+namespace dht {
+
+/**
+ * Summary of a latency distribution, in milliseconds.
+ */
+struct OPENDHT_PUBLIC LatencyStats {
+    uint64_t count {0};
+    double mean {0};
+    double p50 {0};
+    double p90 {0};
+    double p99 {0};
+    double max {0};
+
+    std::string toString() const;
+
+#ifdef OPENDHT_JSONCPP
+    Json::Value toJson() const;
+    LatencyStats() {}
+    explicit LatencyStats(const Json::Value& v);
+#endif
+
+    MSGPACK_DEFINE_MAP(count, mean, p50, p90, p99, max)
+};
+
+/**
+ * Latency histogram that can be updated and read concurrently without locking.
+ *
+ * Durations are recorded in microseconds in log-linear buckets (HDR style):
+ * each power-of-two range is split in SUB_BUCKETS linear buckets, keeping the
+ * relative error under 1/SUB_BUCKETS from 1us up to about an hour.
+ */
+class OPENDHT_PUBLIC LatencyHistogram {
+public:
+    void record(duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        uint64_t v = us > 0 ? std::min<uint64_t>(us, uint64_t(MAX_VALUE)) : 0;
+        counts_[bucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        auto m = max_.load(std::memory_order_relaxed);
+        while (v > m and not max_.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    /** @return the sum of recorded durations, in milliseconds */
+    double sum() const {
+        return sum_.load(std::memory_order_relaxed) / 1000.;
+    }
+
+    /** Compute a summary of recorded durations */
+    LatencyStats getStats() const;
+
+    /**
+     * @param bounds  ascending upper bounds, in milliseconds.
+     * @return the number of durations recorded up to each bound,
+     *         as in cumulative (Prometheus style) histograms.
+     */
+    std::vector<uint64_t> getCumulativeCounts(const std::vector<double>& bounds) const;
+
+private:
+    static constexpr unsigned SUB_BUCKET_BITS {3};
+    static constexpr unsigned SUB_BUCKETS {1 << SUB_BUCKET_BITS};
+    static constexpr unsigned MAGNITUDES {32};
+    static constexpr uint64_t MAX_VALUE {(UINT64_C(1) << MAGNITUDES) - 1};
+    static constexpr unsigned BUCKETS {SUB_BUCKETS * (MAGNITUDES - SUB_BUCKET_BITS + 1)};
+
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_ {};
+    std::atomic<uint64_t> count_ {0};
+    std::atomic<uint64_t> sum_ {0};
+    std::atomic<uint64_t> max_ {0};
+
+    static unsigned bucketIndex(uint64_t v) {
+        if (v < SUB_BUCKETS)
+            return (unsigned)v;
+        unsigned magnitude = SUB_BUCKET_BITS;
+        while ((v >> (magnitude + 1)) != 0)
+            magnitude++;
+        unsigned shift = magnitude - SUB_BUCKET_BITS;
+        return SUB_BUCKETS * (shift + 1) + (unsigned)((v >> shift) - SUB_BUCKETS);
+    }
+
+    /** Middle of the range of values counted in bucket i */
+    static double bucketValue(unsigned i) {
+        if (i < SUB_BUCKETS)
+            return i;
+        unsigned shift = i / SUB_BUCKETS - 1;
+        uint64_t low = uint64_t(SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+        return low + ((UINT64_C(1) << shift) - 1) / 2.;
+    }
+};
+
+namespace net {
+
+/**
+ * Latency distributions measured by the NetworkEngine.
+ * Can be read from any thread while the DHT is running.
+ */
+struct OPENDHT_PUBLIC NetworkMetrics {
+    /* Round-trip time between the last transmission of a request and its reply */
+    LatencyHistogram rtt_ping, rtt_find, rtt_get, rtt_put, rtt_listen, rtt_refresh, rtt_update;
+    /* Time spent processing incoming requests */
+    LatencyHistogram handle_ping, handle_find, handle_get, handle_put, handle_listen, handle_refresh, handle_update;
+    /* Time received packets wait between the socket and message processing */
+    LatencyHistogram rx_queue;
+
+    /**
+     * @return a summary of each non-empty distribution,
+     *         indexed by name (e.g. "rtt.get", "handle.put", "rx.queue").
+     */
+    std::map<std::string, LatencyStats> getStats() const;
+
+    /** Calls cb with the name and the histogram of each distribution */
+    void forEach(const std::function<void(const char* name, const LatencyHistogram&)>& cb) const;
+};
+
+/**
+ * Counts of received messages dropped before being processed, by message type.
+ * Can be updated and read from any thread.
+ */
+class OPENDHT_PUBLIC DropCounters {
+public:
+    static constexpr unsigned MESSAGE_TYPES {12};
+
+    void add(unsigned type) {
+        if (type < MESSAGE_TYPES)
+            counts_[type].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the non-zero counts, indexed by message type name
+     *         (e.g. "reply", "get", "listen").
+     */
+    std::map<std::string, uint64_t> getStats() const;
+
+private:
+    std::array<std::atomic<uint64_t>, MESSAGE_TYPES> counts_ {};
+};
+
+}
+}
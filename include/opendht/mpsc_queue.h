@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+namespace dht {
+
+/**
+ * Unbounded lock-free multi-producer single-consumer queue.
+ *
+ * Values are stored in intrusive nodes linked from the last pushed one
+ * (Vyukov's design): pushing is a single atomic exchange, from any thread.
+ * pop(), drain(), empty() and clear() must only be called by the consumer thread.
+ * T must be default-constructible.
+ */
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) {}
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    ~MpscQueue() { clear(); }
+
+    template <typename... Args>
+    void emplace(Args&&... args) {
+        push(new Node(std::forward<Args>(args)...));
+    }
+
+    /**
+     * Moves the oldest value to v.
+     * @return false if the queue is empty, or if the next value
+     *         is still being pushed.
+     */
+    bool pop(T& v) {
+        auto n = popNode();
+        if (not n)
+            return false;
+        v = std::move(n->value);
+        delete n;
+        return true;
+    }
+
+    /**
+     * Pops and calls f with the values pushed before this call.
+     * Values pushed meanwhile, including by f, are left in the queue.
+     * @return the number of values popped.
+     */
+    template <typename F>
+    size_t drain(F&& f) {
+        auto last = head_.load(std::memory_order_acquire);
+        // the stub was pushed last: drain the values linked before it
+        bool toStub = last == &stub_;
+        if (toStub and tail_ == &stub_)
+            return 0;
+        size_t count = 0;
+        while (auto n = popNode()) {
+            bool done = toStub ? tail_ == &stub_ : n == last;
+            T v = std::move(n->value);
+            delete n;
+            count++;
+            f(v);
+            if (done)
+                break;
+        }
+        return count;
+    }
+
+    /**
+     * @return true if no value was pushed since the queue was
+     *         last found empty by pop().
+     */
+    bool empty() const {
+        auto head = head_.load(std::memory_order_seq_cst);
+        return head == tail_ and head == &stub_;
+    }
+
+    void clear() {
+        T v;
+        while (pop(v)) {}
+    }
+
+private:
+    struct Node {
+        Node() {}
+        template <typename... Args>
+        Node(Args&&... args) : value(std::forward<Args>(args)...) {}
+        std::atomic<Node*> next {nullptr};
+        T value {};
+    };
+
+    void push(Node* n) {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        auto prev = head_.exchange(n, std::memory_order_seq_cst);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    Node* popNode() {
+        auto tail = tail_;
+        auto next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (not next)
+                return nullptr;
+            tail_ = tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (not next) {
+            // tail is the last node: push the stub behind it to pop it
+            if (tail != head_.load(std::memory_order_acquire))
+                return nullptr;
+            push(&stub_);
+            // a push racing with ours is linking its node behind tail:
+            // wait for it rather than leaving tail behind the stub
+            while (not (next = tail->next.load(std::memory_order_acquire)))
+                std::this_thread::yield();
+        }
+        tail_ = next;
+        return tail;
+    }
+
+    /* last pushed node, written by producers */
+    std::atomic<Node*> head_;
+    /* next node to pop, owned by the consumer */
+    Node* tail_;
+    Node stub_;
+};
+
+}
@@ -29,6 +29,7 @@
 #include "rate_limiter.h"
 #include "log_enable.h"
 #include "network_utils.h"
+#include "metrics.h"
 
 #include <vector>
 #include <string>
@@ -36,6 +37,8 @@
 #include <algorithm>
 #include <memory>
 #include <queue>
+#include <list>
+#include <unordered_map>
 
 namespace dht {
 namespace net {
@@ -265,6 +268,12 @@ public:
 
     void connectivityChanged(sa_family_t);
 
+    /**
+     * Handles the errors of packets sent in a batch, as requestStep does
+     * for packets sent immediately: nodes at an unreachable address expire.
+     */
+    void onSendErrors(const std::vector<DatagramSocket::SendError>& errors);
+
     /**************
      *  Requests  *
      **************/
@@ -385,6 +394,29 @@ public:
                                   const Blob& token,
                                   RequestCb&& on_done,
                                   RequestExpiredCb&& on_expired);
+    /**
+     * Send a "announce" request carrying several values to a given node,
+     * that must support it (see canAnnounceValues). The request is
+     * completed when the node acknowledges all the values.
+     */
+    Sp<Request> sendAnnounceValues(Sp<Node> n,
+                                  const InfoHash& hash,
+                                  const std::vector<Sp<Value>>& values,
+                                  time_point created,
+                                  const Blob& token,
+                                  RequestCb&& on_done,
+                                  RequestExpiredCb&& on_expired);
+
+    /**
+     * @return true if a node advertising this protocol version accepts
+     *         several values in a single "announce" request.
+     */
+    static bool canAnnounceValues(int version);
+
+    /* Max. number and total size of values batched in a single "announce" request */
+    static constexpr size_t MAX_ANNOUNCE_VALUES {16};
+    static constexpr size_t MAX_ANNOUNCE_SIZE {600};
+
     /**
      * Send a "refresh" request to a given node. Asks a node to keep the
      * associated value Value.type.expiration more minutes in its storage.
@@ -405,6 +437,28 @@ public:
                                  RequestCb&& on_done,
                                  RequestErrorCb&& on_error,
                                  RequestExpiredCb&& on_expired);
+    /**
+     * Send a "refresh" request for several values stored under the same
+     * hash to a given node, that must support it (see canRefreshValues).
+     * The node answers with an error if any of the values isn't found.
+     */
+    Sp<Request> sendRefreshValues(Sp<Node> n,
+                                 const InfoHash& hash,
+                                 const std::vector<Value::Id>& vids,
+                                 const Blob& token,
+                                 RequestCb&& on_done,
+                                 RequestErrorCb&& on_error,
+                                 RequestExpiredCb&& on_expired);
+
+    /**
+     * @return true if a node advertising this protocol version accepts
+     *         several value ids in a single "refresh" request.
+     */
+    static bool canRefreshValues(int version);
+
+    /* Max. number of value ids in a single "refresh" request */
+    static constexpr size_t MAX_REFRESH_VALUES {64};
+
     /**
      * Send a "update" request to a given node. Used for Listen operations
      *
@@ -435,12 +489,47 @@ public:
      */
     void processMessage(const uint8_t *buf, size_t buflen, SockAddr addr);
 
+    /**
+     * Process a message previously decoded with parseMessage.
+     */
+    void processMessage(ParsedMessagePtr&& msg, SockAddr addr);
+
+    /**
+     * Decode a message and run the checks that don't depend on the engine
+     * state (martian source, format, network id).
+     * Can be called from any thread.
+     *
+     * The returned message may reference buf.
+     * @return the decoded message, or nullptr if it should be dropped.
+     */
+    static ParsedMessagePtr parseMessage(const uint8_t *buf, size_t buflen, SockAddr addr,
+            NetId network, const Sp<Logger>& logger = {});
+
+    /** @return the type of a decoded message, as counted by DropCounters */
+    static unsigned getMessageType(const ParsedMessage& msg);
+
+    /**
+     * @return true if msg is a request from another node, rather than
+     *         a reply or data sent for one of our requests.
+     */
+    static bool isRequest(const ParsedMessage& msg);
+
     Sp<Node> insertNode(const InfoHash& id, const SockAddr& addr) {
-        auto n = cache.getNode(id, addr, scheduler.time(), 0);
+        auto n = getNode(id, addr);
         onNewNode(n, 0);
         return n;
     }
 
+    /** @return the node with this id from the cache, added if unknown */
+    Sp<Node> getNode(const InfoHash& id, const SockAddr& addr) {
+        return cache.getNode(id, addr, scheduler.time(), 0);
+    }
+
+    /** Latency distributions, can be read from any thread */
+    const Sp<NetworkMetrics>& getMetrics() const {
+        return metrics;
+    }
+
     std::vector<unsigned> getNodeMessageStats(bool in) {
         auto& st = in ? in_stats : out_stats;
         std::vector<unsigned> stats {st.ping,  st.find,  st.get,  st.listen,  st.put};
@@ -450,6 +539,12 @@ public:
 
     void blacklistNode(const Sp<Node>& n);
 
+    /**
+     * Drop the cached encoding of values with this id.
+     * Must be called when a stored value is replaced or modified.
+     */
+    void invalidatePackedValue(Value::Id id);
+
     std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, sa_family_t sa_f, size_t count) {
         return cache.getCachedNodes(id, sa_f, count);
     }
@@ -468,10 +563,24 @@ public:
     size_t getPartialCount() const {
         return partial_messages.size();
     }
+    /** @return the size of the messages being reassembled */
+    size_t getPartialSize() const {
+        return partial_size;
+    }
 
 private:
 
     struct PartialMessage;
+    struct SentParts;
+
+    /* Serialized value, kept to answer repeated requests */
+    struct PackedValue {
+        std::weak_ptr<Value> value;
+        Blob packed;
+        Blob compressed {};
+        bool compressed_done {false};
+        std::list<Value::Id>::iterator lru;
+    };
 
     /***************
      *  Constants  *
@@ -487,9 +596,23 @@ private:
     static constexpr std::chrono::seconds RX_MAX_PACKET_TIME {10};
     /* Max. time between packet fragments */
     static constexpr std::chrono::seconds RX_TIMEOUT {3};
+    /* Time without new fragment after which missing parts are requested again */
+    static constexpr std::chrono::seconds RX_PART_TIMEOUT {1};
+    /* Max. number of times missing parts are requested for a message */
+    static constexpr unsigned RX_MAX_MISSING_REQUESTS {2};
+    /* Max. number of missing ranges considered per value of a request */
+    static constexpr size_t RX_MAX_MISSING_RANGES {64};
+    /* Max. total size of messages being reassembled */
+    static constexpr size_t RX_PARTIAL_MAX_SIZE {1024 * 1024 * 8};
+    /* Max. total size of sent values kept to answer missing part requests */
+    static constexpr size_t TX_PARTS_MAX_SIZE {1024 * 1024 * 2};
+    /* Max. total size of cached value encodings */
+    static constexpr size_t PACKED_VALUES_MAX_SIZE {1024 * 1024 * 4};
     /* The maximum number of nodes that we snub.  There is probably little
         reason to increase this value. */
     static constexpr unsigned BLACKLISTED_MAX {10};
+    /* Max. number of IP addresses tracked by the per-IP rate limiter */
+    static constexpr size_t IP_LIMITER_MAX_SIZE {1024 * 64};
 
     static constexpr size_t MTU {1280};
     static constexpr size_t MAX_PACKET_VALUE_SIZE {600};
@@ -526,7 +649,13 @@ private:
     int send(const SockAddr& addr, const char *buf, size_t len, bool confirmed = false);
 
     void sendValueParts(Tid tid, const std::vector<Blob>& svals, const SockAddr& addr);
-    std::vector<Blob> packValueHeader(msgpack::sbuffer&, const std::vector<Sp<Value>>&);
+    void sendValuePart(Tid tid, unsigned index, const Blob& v, size_t start, const SockAddr& addr);
+    void sendMissingParts(Tid tid, const ParsedMessage& msg, const SockAddr& addr);
+    void resendValueParts(const ParsedMessage& msg, const SockAddr& from);
+    void maintainSentParts(Tid tid, const SockAddr& addr);
+    std::vector<Blob> packValueHeader(msgpack::sbuffer&, const std::vector<Sp<Value>>&, bool compress = false, bool cached = false);
+    Blob packValue(const Sp<Value>& v, bool compress);
+    void erasePackedValue(std::unordered_map<Value::Id, PackedValue>::iterator it);
     void maintainRxBuffer(Tid tid);
 
     /*************
@@ -541,7 +670,8 @@ private:
             const Blob& nodes6,
             const std::vector<Sp<Value>>& st,
             const Query& query,
-            const Blob& token);
+            const Blob& token,
+            bool compress = false);
     Blob bufferNodes(sa_family_t af, const InfoHash& id, std::vector<Sp<Node>>& nodes);
 
     std::pair<Blob, Blob> bufferNodes(sa_family_t af,
@@ -573,16 +703,27 @@ private:
 
     // global limiting should be triggered by at least 8 different IPs
     using IpLimiter = RateLimiter;
-    using IpLimiterMap = std::map<SockAddr, IpLimiter, SockAddr::ipCmp>;
+    using IpLimiterMap = std::unordered_map<SockAddr, IpLimiter, SockAddr::ipHash, SockAddr::ipEqual>;
     IpLimiterMap address_rate_limiter;
+    /* shared by the addresses not fitting in address_rate_limiter */
+    IpLimiter overflow_rate_limiter;
     RateLimiter rate_limiter;
     ssize_t limiter_maintenance {0};
 
     // requests handling
-    std::map<Tid, Sp<Request>> requests {};
+    TidMap<Sp<Request>> requests {};
     std::map<Tid, PartialMessage> partial_messages;
+    size_t partial_size {0};
+    std::map<std::pair<Tid, SockAddr>, SentParts> sent_parts;
+    size_t sent_parts_size {0};
+
+    // encoded values sent in replies, most recently used first
+    std::unordered_map<Value::Id, PackedValue> packed_values;
+    std::list<Value::Id> packed_values_lru;
+    size_t packed_values_size {0};
 
     MessageStats in_stats {}, out_stats {};
+    const Sp<NetworkMetrics> metrics {std::make_shared<NetworkMetrics>()};
     std::set<SockAddr> blacklist {};
 
     Scheduler& scheduler;
@@ -44,18 +44,39 @@ namespace net {
 static const constexpr in_port_t DHT_DEFAULT_PORT = 4222;
 static const constexpr size_t RX_QUEUE_MAX_SIZE = 1024 * 16;
 static const constexpr std::chrono::milliseconds RX_QUEUE_MAX_DELAY(650);
-
-int bindSocket(const SockAddr& addr, SockAddr& bound);
+/** Maximum number of datagrams read per wakeup when batched receive is available */
+static const constexpr size_t RX_BATCH_MAX_SIZE = 32;
+/** Buffer capacity reserved for each pooled packet, fitting a typical MTU */
+static const constexpr size_t RX_PACKET_BUFFER_SIZE = 1536;
+/** Packet buffers grown above this size (jumbo packets) are released when recycled */
+static const constexpr size_t RX_PACKET_MAX_RECYCLED_SIZE = 1024 * 8;
+/** Number of packets preallocated by UdpSocket */
+static const constexpr size_t RX_POOL_INITIAL_SIZE = 256;
+/** Maximum number of datagrams written per system call when flushing a send batch */
+static const constexpr size_t TX_BATCH_MAX_SIZE = 64;
+
+int bindSocket(const SockAddr& addr, SockAddr& bound, bool reusePort = false);
 
 bool setNonblocking(int fd, bool nonblocking = true);
 
 #ifdef _WIN32
 void udpPipe(int fds[2]);
 #endif
+struct ParsedMessage;
+using ParsedMessagePtr = std::unique_ptr<ParsedMessage, void(*)(ParsedMessage*)>;
+
+/**
+ * A datagram received by a DatagramSocket.
+ * The msg member changes the layout of this struct compared to earlier
+ * releases: code allocating or copying it must be rebuilt.
+ */
 struct ReceivedPacket {
     Blob data;
     SockAddr from;
     time_point received;
+    /** Message decoded from data before reaching the DHT thread, if any.
+     *  It may reference data, which must be kept untouched while it is set. */
+    ParsedMessagePtr msg {nullptr, nullptr};
 };
 using PacketList = std::list<ReceivedPacket>;
 
@@ -69,6 +90,22 @@ public:
 
     virtual int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) = 0;
 
+    /**
+     * Start queuing packets given to sendTo until flush() is called.
+     * Implementations without batching support send immediately.
+     */
+    virtual void startBatch() {}
+
+    /** A packet that could not be sent, with its destination and error */
+    using SendError = std::pair<SockAddr, int>;
+
+    /**
+     * Send packets queued since startBatch() and stop queuing.
+     * @return the errors of the queued packets that could not be sent,
+     *         which sendTo() could not report.
+     */
+    virtual std::vector<SendError> flush() { return {}; }
+
     inline void setOnReceive(OnReceive&& cb) {
         std::lock_guard<std::mutex> lk(lock);
         rx_callback = std::move(cb);
@@ -97,23 +134,49 @@ public:
 protected:
 
     PacketList getNewPacket() {
+        return getNewPackets(1);
+    }
+
+    /**
+     * Get n packets from the pool of recycled packets.
+     * New packets are allocated only when the pool is exhausted.
+     */
+    PacketList getNewPackets(size_t n) {
+        std::lock_guard<std::mutex> lk(lock);
         PacketList pkts;
-        if (toRecycle_.empty()) {
-            pkts.emplace_back();
-        } else {
-            auto begIt = toRecycle_.begin();
-            auto begItNext = std::next(begIt);
-            pkts.splice(pkts.end(), toRecycle_, begIt, begItNext);
-        }
+        auto endIt = toRecycle_.begin();
+        size_t i = 0;
+        for (; i < n and endIt != toRecycle_.end(); ++i)
+            ++endIt;
+        pkts.splice(pkts.end(), toRecycle_, toRecycle_.begin(), endIt);
+        for (; i < n; ++i)
+            newPacket(pkts);
         return pkts;
     }
 
+    /** Preallocate n packets in the pool */
+    void reservePackets(size_t n) {
+        std::lock_guard<std::mutex> lk(lock);
+        for (size_t i = toRecycle_.size(); i < n; ++i)
+            newPacket(toRecycle_);
+    }
+
     inline void onReceived(PacketList&& packets) {
         std::lock_guard<std::mutex> lk(lock);
         if (rx_callback) {
             auto r = rx_callback(std::move(packets));
-            if (not r.empty() and toRecycle_.size() < RX_QUEUE_MAX_SIZE)
+            if (not r.empty() and toRecycle_.size() < RX_QUEUE_MAX_SIZE) {
+                for (auto& pkt : r) {
+                    pkt.msg.reset();
+                    if (pkt.data.capacity() > RX_PACKET_MAX_RECYCLED_SIZE) {
+                        Blob().swap(pkt.data);
+                        pkt.data.reserve(RX_PACKET_BUFFER_SIZE);
+                    } else {
+                        pkt.data.clear();
+                    }
+                }
                 toRecycle_.splice(toRecycle_.end(), std::move(r));
+            }
         }
     }
 protected:
@@ -121,16 +184,29 @@ protected:
 private:
     OnReceive rx_callback;
     PacketList toRecycle_;
+
+    static void newPacket(PacketList& pkts) {
+        pkts.emplace_back();
+        pkts.back().data.reserve(RX_PACKET_BUFFER_SIZE);
+    }
 };
 
 class OPENDHT_PUBLIC UdpSocket : public DatagramSocket {
 public:
-    UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l = {});
-    UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l = {});
+    /**
+     * @param rxThreads: number of receive threads. When greater than one,
+     *        additional sockets are bound to the same port with SO_REUSEPORT,
+     *        so that the kernel spreads incoming packets between threads.
+     */
+    UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l = {}, unsigned rxThreads = 1);
+    UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l = {}, unsigned rxThreads = 1);
     ~UdpSocket();
 
     int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) override;
 
+    void startBatch() override;
+    std::vector<SendError> flush() override;
+
     const SockAddr& getBoundRef(sa_family_t family = AF_UNSPEC) const override {
         return (family == AF_INET6) ? bound6 : bound4;
     }
@@ -147,6 +223,7 @@ public:
     void stop() override;
 private:
     std::shared_ptr<Logger> logger;
+    const unsigned rx_threads {1};
     int s4 {-1};
     int s6 {-1};
     int stopfd {-1};
@@ -154,7 +231,19 @@ private:
     std::thread rcv_thread {};
     std::atomic_bool running {false};
 
+    struct PendingPacket {
+        SockAddr dest;
+        Blob data;
+        bool replied;
+    };
+    std::mutex tx_lock;
+    std::vector<PendingPacket> tx_queue;
+    bool tx_batch {false};
+
     void openSockets(const SockAddr& bind4, const SockAddr& bind6);
+    int sendPacket(const SockAddr& dest, const uint8_t* data, size_t size, bool replied);
+    void sendBatch(sa_family_t af, std::vector<PendingPacket>::iterator begin, std::vector<PendingPacket>::iterator end,
+                   std::vector<SendError>& errors);
 };
 
 }
@@ -22,6 +22,8 @@
 
 #include <list>
 #include <memory>
+#include <set>
+#include <unordered_map>
 
 namespace dht {
 
@@ -44,21 +46,45 @@ struct NodeCache {
      */
     void clearBadNodes(sa_family_t family = 0);
 
-    NodeCache(std::mt19937_64& r) : rd(r) {};
+    NodeCache(std::mt19937_64& r) : cache_4(r), cache_6(r), rd(r) {};
     ~NodeCache();
 
+    /*
+     * Number of nodes kept in the cache per address family, beyond which
+     * entries of nodes not used anymore are evicted. Nodes still in use
+     * are never evicted, so that a node id maps to a single Node.
+     */
+    static constexpr size_t MAX_NODES {16 * 1024};
+
 private:
-    class NodeMap : private std::map<InfoHash, std::weak_ptr<Node>> {
+    /**
+     * Nodes indexed by id, in a hash table of about MAX_NODES entries.
+     * The least recently used entries of released nodes are evicted first.
+     * Ids are also kept sorted, to find the nodes close to an id.
+     */
+    class NodeMap {
     public:
+        NodeMap(std::mt19937_64& rd) : nodes_(0, SeededIdHash{rd()}) {}
         Sp<Node> getNode(const InfoHash& id);
         Sp<Node> getNode(const InfoHash& id, const SockAddr&, time_point now, bool confirmed, bool client, std::mt19937_64& rd);
         std::vector<Sp<Node>> getCachedNodes(const InfoHash& id, size_t count) const;
         void clearBadNodes();
         void setExpired();
-        void cleanup();
-        size_t count() const { return size(); }
+        size_t count() const { return lru_.size(); }
     private:
-        size_t cleanup_counter {0};
+        struct Entry {
+            InfoHash id;
+            std::weak_ptr<Node> node;
+        };
+        using Lru = std::list<Entry>;
+
+        /* most recently used first */
+        Lru lru_;
+        std::unordered_map<InfoHash, Lru::iterator, SeededIdHash> nodes_;
+        std::set<InfoHash> sorted_;
+
+        void erase(Lru::iterator it);
+        void evict();
     };
 
     const NodeMap& cache(sa_family_t af) const { return af == AF_INET ? cache_4 : cache_6; }
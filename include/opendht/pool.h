@@ -0,0 +1,104 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "def.h"
+#include "utils.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace dht {
+
+/**
+ * Recycles memory blocks of a single size, the size of the first
+ * allocation. Blocks are allocated by chunks and kept in free lists
+ * once released. Chunks are only given back when the pool is destroyed,
+ * so the pool is sized by the peak number of blocks in use.
+ * Blocks of other sizes are passed to the global allocator.
+ * Blocks are aligned for any standard type. Thread-safe: each thread
+ * mostly uses one of several free lists, to limit lock contention.
+ */
+class OPENDHT_PUBLIC BlockPool {
+public:
+    /** @param chunk_blocks  number of blocks allocated at once */
+    BlockPool(size_t chunk_blocks = 64) : chunk_blocks_(chunk_blocks ? chunk_blocks : 1) {}
+    BlockPool(const BlockPool&) = delete;
+    BlockPool& operator=(const BlockPool&) = delete;
+    ~BlockPool();
+
+    void* allocate(size_t size);
+    void deallocate(void* p, size_t size);
+
+    /** @return the number of blocks allocated, used or free */
+    size_t capacity() const {
+        return chunk_count_.load(std::memory_order_relaxed) * chunk_blocks_;
+    }
+
+private:
+    static constexpr size_t STRIPES {8};
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct alignas(64) Stripe {
+        std::mutex lock;
+        FreeBlock* free {nullptr};
+        std::vector<void*> chunks;
+    };
+    const size_t chunk_blocks_;
+    std::atomic<size_t> block_size_ {0};
+    std::atomic<size_t> chunk_count_ {0};
+    std::array<Stripe, STRIPES> stripes_;
+
+    /** @return the free list of the calling thread */
+    Stripe& stripe();
+};
+
+/**
+ * Allocator using a shared BlockPool, meant for std::allocate_shared:
+ * the object and its control block are allocated as a single block.
+ * Allocators hold the pool, so that objects may outlive its owner.
+ */
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+    Sp<BlockPool> pool;
+
+    PoolAllocator(const Sp<BlockPool>& p) : pool(p) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& o) : pool(o.pool) {}
+
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types can't be pooled");
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(pool->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        pool->deallocate(p, n * sizeof(T));
+    }
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& o) const { return pool == o.pool; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& o) const { return pool != o.pool; }
+};
+
+}
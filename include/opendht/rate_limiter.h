@@ -19,38 +19,57 @@
 #pragma once
 
 #include "utils.h"
-#include <queue>
+
+#include <algorithm>
+#include <limits>
 
 namespace dht {
 
+/**
+ * Limits the rate of events to quota per period.
+ *
+ * Implemented with the generic cell rate algorithm (a token bucket
+ * tracking a single "theoretical arrival time"), so memory usage is
+ * constant and each call is O(1) whatever the quota.
+ * Up to quota events may be accepted in a burst.
+ */
 class RateLimiter {
 public:
     RateLimiter(size_t quota, const duration& period = std::chrono::seconds(1))
-     : quota_(quota), period_(period) {}
+     : quota_(quota), period_(period),
+       interval_(quota ? period / (duration::rep)std::min<size_t>(quota, std::numeric_limits<duration::rep>::max()) : period) {}
 
-    /** Clear outdated records and return current quota usage */
+    /** Return current quota usage */
     size_t maintain(const time_point& now) {
-        auto limit = now - period_;
-        while (not records.empty() and records.front() < limit)
-            records.pop();
-        return records.size();
+        if (tat_ <= now) {
+            tat_ = time_point::min();
+            return 0;
+        }
+        auto interval = std::max(interval_, duration(1));
+        return (tat_ - now + interval - duration(1)) / interval;
     }
     /** Return false if quota is reached, insert record and return true otherwise. */
     bool limit(const time_point& now) {
         if (quota_ == std::numeric_limits<size_t>::max())
             return true;
-        if (maintain(now) >= quota_)
+        if (quota_ == 0)
+            return false;
+        auto tat = std::max(tat_, now) + interval_;
+        if (tat - now > period_)
             return false;
-        records.emplace(now);
+        tat_ = tat;
         return true;
     }
     bool empty() const {
-        return records.empty();
+        return tat_ == time_point::min();
     }
 private:
     const size_t quota_;
     const duration period_;
-    std::queue<time_point> records {};
+    /* time earned by each accepted event */
+    const duration interval_;
+    /* time at which quota usage will be back to zero */
+    time_point tat_ {time_point::min()};
 };
 
 }
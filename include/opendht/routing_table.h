@@ -21,6 +21,10 @@
 
 #include "node.h"
 
+#include <algorithm>
+#include <array>
+#include <vector>
+
 namespace dht {
 
 static constexpr unsigned TARGET_NODES {8};
@@ -28,6 +32,80 @@ namespace net {
 class NetworkEngine;
 }
 
+/**
+ * Nodes of a bucket, stored in place.
+ * Keeps the order and the subset of the std::list interface used by
+ * buckets, for up to TARGET_NODES nodes.
+ */
+class BucketNodes {
+public:
+    using value_type = Sp<Node>;
+    using iterator = value_type*;
+    using const_iterator = const value_type*;
+    static constexpr size_t CAPACITY {TARGET_NODES};
+
+    BucketNodes() {}
+    BucketNodes(BucketNodes&& o) noexcept : nodes_(std::move(o.nodes_)), size_(o.size_) { o.clear(); }
+    BucketNodes& operator=(BucketNodes&& o) noexcept {
+        if (this != &o) {
+            nodes_ = std::move(o.nodes_);
+            size_ = o.size_;
+            o.clear();
+        }
+        return *this;
+    }
+    BucketNodes(const BucketNodes&) = default;
+    BucketNodes& operator=(const BucketNodes&) = default;
+
+    iterator begin() { return nodes_.data(); }
+    iterator end() { return nodes_.data() + size_; }
+    const_iterator begin() const { return nodes_.data(); }
+    const_iterator end() const { return nodes_.data() + size_; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == CAPACITY; }
+    value_type& front() { return nodes_[0]; }
+    value_type& back() { return nodes_[size_ - 1]; }
+    const value_type& front() const { return nodes_[0]; }
+    const value_type& back() const { return nodes_[size_ - 1]; }
+
+    /** Insert a node first. When full, the last node is dropped. */
+    void emplace_front(value_type node) {
+        if (full())
+            size_--;
+        std::move_backward(begin(), end(), end() + 1);
+        nodes_[0] = std::move(node);
+        size_++;
+    }
+    /** Insert a node last. When full, nothing is inserted. */
+    void emplace_back(value_type node) {
+        if (not full())
+            nodes_[size_++] = std::move(node);
+    }
+    iterator erase(iterator it) {
+        std::move(it + 1, end(), it);
+        nodes_[--size_].reset();
+        return it;
+    }
+    template <typename Predicate>
+    void remove_if(Predicate&& pred) {
+        auto last = std::remove_if(begin(), end(), std::forward<Predicate>(pred));
+        while (end() != last)
+            nodes_[--size_].reset();
+    }
+    void clear() {
+        while (size_)
+            nodes_[--size_].reset();
+    }
+
+private:
+    std::array<value_type, CAPACITY> nodes_ {};
+    size_t size_ {0};
+};
+
 struct Bucket {
     Bucket() : cached() {}
     Bucket(sa_family_t af, const InfoHash& f = {}, time_point t = time_point::min())
@@ -35,7 +113,7 @@ struct Bucket {
     sa_family_t af {0};
     InfoHash first {};
     time_point time {time_point::min()}; /* time of last reply in this bucket */
-    std::list<Sp<Node>> nodes {};
+    BucketNodes nodes {};
     Sp<Node> cached;                    /* the address of a likely candidate */
 
     /** Return a random node in a bucket. */
@@ -49,9 +127,14 @@ struct Bucket {
     }
 };
 
-class RoutingTable : public std::list<Bucket> {
+/**
+ * Buckets of the routing table, sorted by the first id of their range,
+ * stored contiguously so that buckets can be found with a binary search.
+ * Iterators are invalidated when a bucket is split.
+ */
+class RoutingTable : public std::vector<Bucket> {
 public:
-    using std::list<Bucket>::list;
+    using std::vector<Bucket>::vector;
 
     time_point grow_time {time_point::min()};
     bool is_client {false};
@@ -86,6 +169,13 @@ public:
 
     bool onNewNode(const Sp<Node>& node, int comfirm, const time_point& now, const InfoHash& myid, net::NetworkEngine& ne);
 
+    /**
+     * Add a node to its bucket, without pinging other nodes
+     * nor splitting the bucket, as when restoring a snapshot.
+     * @return false if the bucket is full or already has the node.
+     */
+    bool restoreNode(const Sp<Node>& node);
+
     /**
      * Return a random id in the bucket's range.
      */
@@ -20,10 +20,15 @@
 
 #pragma once
 
+#include "def.h"
 #include "utils.h"
+#include "inline_function.h"
+#include "pool.h"
 
 #include <functional>
-#include <map>
+#include <array>
+#include <vector>
+#include <mutex>
 
 namespace dht {
 
@@ -32,15 +37,48 @@ namespace dht {
  * @brief   Job scheduler
  * @details
  * Maintains the timings upon which to execute a job.
+ *
+ * Jobs are kept in a hierarchical timing wheel with millisecond slots:
+ * scheduling, rescheduling and cancelling a job are constant time
+ * operations, and a job is unlinked from the wheel as soon as it is
+ * cancelled. Jobs still run in order of their exact scheduled time.
+ *
+ * Jobs are allocated from a pool recycled by the scheduler and store
+ * small callables in place, so that scheduling usually doesn't allocate.
  */
-class Scheduler {
+class OPENDHT_PUBLIC Scheduler {
 public:
+    /* Callables of up to this size are stored in the job itself */
+    static constexpr size_t TASK_INLINE_SIZE {64};
+    using Task = InlineFunction<void(), TASK_INLINE_SIZE>;
+
     struct Job {
-        Job(std::function<void()>&& f) : do_(std::move(f)) {}
-        std::function<void()> do_;
-        void cancel() { do_ = {}; }
+        template <typename F>
+        Job(F&& f) : do_(std::forward<F>(f)) {}
+        Task do_;
+
+        /** Clear the job and remove it from its scheduler */
+        void cancel();
+
+        /** @return true if the job is waiting in a scheduler */
+        bool scheduled() const { return slot_ != nullptr; }
+    private:
+        friend class Scheduler;
+        Scheduler* scheduler_ {nullptr};
+        Job** slot_ {nullptr};
+        Job* prev_ {nullptr};
+        Job* next_ {nullptr};
+        time_point time_ {};
+        uint64_t seq_ {0};
+        /* keeps the job alive while it is scheduled */
+        Sp<Job> self_ {};
     };
 
+    Scheduler() {}
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler();
+
     /**
      * Adds another job to the queue.
      *
@@ -49,17 +87,18 @@ public:
      *
      * @return pointer to the newly scheduled job.
      */
-    Sp<Scheduler::Job> add(time_point t, std::function<void()>&& job_func) {
-        auto job = std::make_shared<Job>(std::move(job_func));
-        if (t != time_point::max())
-            timers.emplace(std::move(t), job);
+    template <typename F>
+    Sp<Scheduler::Job> add(time_point t, F&& job_func) {
+        auto job = std::allocate_shared<Job>(PoolAllocator<Job>(pool_), std::forward<F>(job_func));
+        add(job, t);
         return job;
     }
 
-    void add(const Sp<Scheduler::Job>& job, time_point t) {
-        if (t != time_point::max())
-            timers.emplace(std::move(t), job);
-    }
+    /**
+     * Schedules an existing job at time t, moving it if it was
+     * already scheduled.
+     */
+    void add(const Sp<Scheduler::Job>& job, time_point t);
 
     /**
      * Reschedules a job.
@@ -71,11 +110,7 @@ public:
         if (not job) {
             return;
         }
-        // std::function move doesn't garantee to leave the object empty.
-        // Force clearing old value.
-        auto task = std::move(job->do_);
-        job->do_ = {};
-        job = add(t, std::move(task));
+        add(job, t);
     }
 
     /**
@@ -83,41 +118,68 @@ public:
      *
      * @return The time for the next job to run.
      */
-    time_point run() {
-        while (not timers.empty()) {
-            auto timer = timers.begin();
-            /*
-             * Running jobs scheduled before "now" prevents run+rescheduling
-             * loops before this method ends. It is garanteed by the fact that a
-             * job will at least be scheduled for "now" and not before.
-             */
-            if (timer->first > now)
-                break;
-
-            auto job = std::move(timer->second);
-            timers.erase(timer);
-
-            if (job->do_)
-                job->do_();
-        }
-        return getNextJobTime();
-    }
+    time_point run();
 
-    inline time_point getNextJobTime() const {
-        return timers.empty() ? time_point::max() : timers.begin()->first;
-    }
+    time_point getNextJobTime() const;
 
     /**
      * Accessors for the common time reference used for synchronizing
      * operations.
      */
     inline const time_point& time() const { return now; }
-    inline time_point syncTime() { return (now = clock::now()); }
+    inline time_point syncTime() { return virtual_time_ ? now : (now = clock::now()); }
     inline void syncTime(const time_point& n) { now = n; }
 
+    /**
+     * Makes the scheduler use a virtual clock starting at start:
+     * its time then only moves when set with syncTime(t).
+     * Must be called before any job is scheduled.
+     */
+    void setVirtualTime(const time_point& start) {
+        virtual_time_ = true;
+        now = epoch_ = start;
+    }
+
 private:
+    static constexpr unsigned SLOT_BITS {8};
+    static constexpr unsigned SLOTS {1 << SLOT_BITS};
+    static constexpr uint64_t SLOT_MASK {SLOTS - 1};
+    /* 4 levels of 256 slots cover about 49 days, later jobs go to an overflow list */
+    static constexpr unsigned LEVELS {4};
+    static constexpr unsigned OVERFLOW_SLOT {LEVELS * SLOTS};
+
     time_point now {clock::now()};
-    std::multimap<time_point, Sp<Job>> timers {}; /* the jobs ordered by time */
+    /* time of tick 0 */
+    time_point epoch_ {now};
+    bool virtual_time_ {false};
+    /* current tick, in milliseconds since epoch_ */
+    uint64_t current_ {0};
+    uint64_t seq_ {0};
+
+    /* the jobs, linked in slots of LEVELS wheels, followed by the overflow list */
+    std::array<Job*, LEVELS * SLOTS + 1> slots_ {};
+    std::array<size_t, LEVELS + 1> counts_ {};
+
+    /* recycled memory blocks for jobs, shared with jobs outliving the scheduler */
+    const Sp<BlockPool> pool_ {std::make_shared<BlockPool>()};
+
+    mutable time_point next_ {time_point::max()};
+    mutable bool next_valid_ {true};
+
+    uint64_t tick(const time_point& t) const;
+    unsigned slotIndex(uint64_t tick) const;
+    void link(Job& job);
+    Sp<Job> unlink(Job& job);
+    void cascade();
+    void collect(std::vector<Sp<Job>>& ready);
 };
 
+inline void
+Scheduler::Job::cancel()
+{
+    do_ = {};
+    if (scheduler_)
+        scheduler_->unlink(*this);
+}
+
 }
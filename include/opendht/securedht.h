@@ -23,10 +23,15 @@
 #include "dht.h"
 #include "crypto.h"
 
+#include <list>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include <random>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 namespace dht {
 
@@ -35,6 +40,9 @@ public:
 
     typedef std::function<void(bool)> SignatureCheckCallback;
 
+    /** Called from any thread with a function to run on the DHT thread */
+    using LoopCallback = std::function<void(std::function<void()>&&)>;
+
     using Config = SecureDhtConfig;
 
     static dht::Config getConfig(const SecureDht::Config& conf)
@@ -64,6 +72,18 @@ public:
         return key_ ? key_->getPublicKey().getLongId() : PkId();
     }
 
+    /**
+     * Once set, signatures of the values received by get and listen
+     * operations are checked in parallel on ThreadPool::computation()
+     * when a reply holds at least ASYNC_CHECK_MIN unchecked signatures.
+     * Values are then delivered from onLoop, in the order they were
+     * received, followed by the done callback of get operations.
+     * Otherwise values are checked on the DHT thread.
+     */
+    void setLoopCallback(LoopCallback&& onLoop) {
+        onLoop_ = std::make_shared<LoopCallback>(std::move(onLoop));
+    }
+
     ValueType secureType(ValueType&& type);
 
     ValueType secureType(const ValueType& type) {
@@ -159,6 +179,8 @@ public:
     std::pair<size_t, size_t> getStoreSize() const override {
         return dht_->getStoreSize();
     }
+
+    MemoryStats getMemoryStats() const override;
     std::string getStorageLog() const override {
         return dht_->getStorageLog();
     }
@@ -174,6 +196,12 @@ public:
     std::vector<ValuesExport> exportValues() const override {
         return dht_->exportValues();
     }
+    void exportValuesTo(const ValuesExportCallback& cb) const override {
+        dht_->exportValuesTo(cb);
+    }
+    std::vector<ValuesSnapshot> getValuesSnapshot() const override {
+        return dht_->getValuesSnapshot();
+    }
     void importValues(const std::vector<ValuesExport>& v) override {
         dht_->importValues(v);
     }
@@ -201,6 +229,9 @@ public:
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen, const time_point& now) override {
         return dht_->periodic(buf, buflen, from, fromlen, now);
     }
+    time_point periodic(net::ReceivedPacket&& pkt, const time_point& now) override {
+        return dht_->periodic(std::move(pkt), now);
+    }
     NodeStatus updateStatus(sa_family_t af) override  {
         return dht_->updateStatus(af);
     }
@@ -210,6 +241,9 @@ public:
     NodeStatus getStatus() const override {
         return dht_->getStatus();
     }
+    Sp<net::NetworkMetrics> getNetworkMetrics() const override {
+        return dht_->getNetworkMetrics();
+    }
     net::DatagramSocket* getSocket() const override {
         return dht_->getSocket();
     };
@@ -294,9 +328,7 @@ public:
     size_t listen(const InfoHash& key, GetCallbackSimple cb, Value::Filter f={}, Where w = {}) override {
         return listen(key, bindGetCb(cb), f, w);
     }
-    bool cancelListen(const InfoHash& h, size_t token) override {
-        return dht_->cancelListen(h, token);
-    }
+    bool cancelListen(const InfoHash& h, size_t token) override;
     void connectivityChanged(sa_family_t af) override {
         dht_->connectivityChanged(af);
     }
@@ -344,9 +376,33 @@ private:
     SecureDht(const SecureDht&) = delete;
     SecureDht& operator=(const SecureDht&) = delete;
 
+    /* Number of signatures to check in a reply from which they are checked in parallel */
+    static constexpr size_t ASYNC_CHECK_MIN {4};
+    /* Number of signatures checked by each task */
+    static constexpr size_t CHECK_CHUNK {8};
+
+    /* Replies of an operation, waiting for their signatures to be checked */
+    struct CheckQueue;
+    /* Signature checks running on the thread pool */
+    struct RunningChecks {
+        std::mutex lock;
+        std::condition_variable cv;
+        size_t count {0};
+    };
+
     Sp<Value> checkValue(const Sp<Value>& v);
-    ValueCallback getCallbackFilter(const ValueCallback&, Value::Filter&&);
-    GetCallback getCallbackFilter(const GetCallback&, Value::Filter&&);
+    /** Same as encrypt, using the session key of the recipient if enabled */
+    Value encryptFor(Value& v, const crypto::PublicKey& to);
+    Blob decryptCypher(const Blob& cypher);
+    ValueCallback getCallbackFilter(const ValueCallback&, Value::Filter&&, Sp<CheckQueue>* queue = nullptr);
+    GetCallback getCallbackFilter(const GetCallback&, Value::Filter&&, Sp<CheckQueue>* queue = nullptr);
+    /** Sets the signature check result of v if it is cached */
+    bool lookupSignature(Value& v);
+    void cacheSignature(const Value& v);
+    bool filterValues(CheckQueue& q, const std::vector<Sp<Value>>& values, bool expired);
+    bool enqueueValues(const Sp<CheckQueue>& q, const std::vector<Sp<Value>>& values, bool expired);
+    void drainChecks(CheckQueue& q);
+    void setSignatureChecked(Value& v, bool valid);
 
     Sp<crypto::PrivateKey> key_ {};
     Sp<crypto::Certificate> certificate_ {};
@@ -355,11 +411,91 @@ private:
     CertificateStoreQuery localQueryMethod_ {};
 
     // our certificate cache
-    std::map<InfoHash, Sp<crypto::Certificate>> nodesCertificates_ {};
-    std::map<InfoHash, Sp<const crypto::PublicKey>> nodesPubKeys_ {};
+    /* Objects by id, least recently used and expired ones are dropped */
+    template <typename T>
+    class KeyCache {
+    public:
+        KeyCache(size_t maxSize = 0, duration ttl = {}) : maxSize_(maxSize), ttl_(ttl) {}
+
+        size_t size() const { return entries_.size(); }
+
+        Sp<T> get(const InfoHash& id) const {
+            auto it = entries_.find(id);
+            if (it == entries_.end())
+                return {};
+            if (it->second.expiration < clock::now()) {
+                lru_.erase(it->second.lru);
+                entries_.erase(it);
+                return {};
+            }
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return it->second.value;
+        }
+
+        void put(const InfoHash& id, Sp<T> value, bool replace = true) {
+            auto it = entries_.find(id);
+            if (it != entries_.end()) {
+                if (replace) {
+                    it->second.value = std::move(value);
+                    it->second.expiration = clock::now() + ttl_;
+                }
+                lru_.splice(lru_.begin(), lru_, it->second.lru);
+                return;
+            }
+            if (not maxSize_)
+                return;
+            lru_.emplace_front(id);
+            entries_.emplace(id, Entry {std::move(value), clock::now() + ttl_, lru_.begin()});
+            if (entries_.size() > maxSize_) {
+                entries_.erase(lru_.back());
+                lru_.pop_back();
+            }
+        }
+    private:
+        struct Entry {
+            Sp<T> value;
+            time_point expiration;
+            std::list<InfoHash>::iterator lru;
+        };
+        size_t maxSize_;
+        duration ttl_;
+        mutable std::map<InfoHash, Entry> entries_;
+        /* most recently used first */
+        mutable std::list<InfoHash> lru_;
+    };
+
+    KeyCache<crypto::Certificate> nodesCertificates_ {};
+    KeyCache<const crypto::PublicKey> nodesPubKeys_ {};
+
+    /* session keys by recipient id, and received ones by hash of their encapsulation */
+    struct OutgoingSession {
+        crypto::SessionKey key;
+        unsigned remaining;
+    };
+    duration sessionKeyLifetime_ {};
+    unsigned sessionKeyMaxUse_ {0};
+    KeyCache<OutgoingSession> outgoingSessions_ {};
+    KeyCache<const crypto::SessionKey> incomingSessions_ {};
+    /* callbacks of the certificate lookups in progress, by node */
+    std::map<InfoHash, std::vector<std::function<void(const Sp<crypto::Certificate>)>>> certificateLookups_ {};
 
     std::atomic_bool forward_all_ {false};
     bool enableCache_ {false};
+
+    /* results of signature checks by SHA-256 of the signed data and signature, most recently used first */
+    struct SignatureCheck {
+        bool valid;
+        std::list<h256>::iterator lru;
+    };
+    size_t signatureCacheSize_ {0};
+    std::unordered_map<h256, SignatureCheck, SeededIdHash> signatureCache_;
+    std::list<h256> signatureLru_ {};
+
+    Sp<LoopCallback> onLoop_ {};
+    /* pointer to this SecureDht, reset on destruction, for checks completing later */
+    const Sp<SecureDht*> self_ {std::make_shared<SecureDht*>(this)};
+    const Sp<RunningChecks> runningChecks_ {std::make_shared<RunningChecks>()};
+    std::map<size_t, std::weak_ptr<CheckQueue>> listenQueues_ {};
 };
 
 const ValueType CERTIFICATE_TYPE = {
@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "dht.h"
+#include "network_utils.h"
+
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace dht {
+namespace net {
+
+/**
+ * In-process network of Dht nodes, driven by a virtual clock.
+ *
+ * Nodes are given simulated sockets, with IPv4 addresses from 10.0.0.1,
+ * and are run on the calling thread: packets are delivered and node jobs
+ * are run in order of their virtual time, as fast as possible.
+ * Latency, loss and bandwidth are simulated for every packet. Node ids,
+ * node random engines, latencies and losses are drawn from the seed of
+ * the network, so that runs can be reproduced.
+ */
+class OPENDHT_PUBLIC SimulatedNetwork {
+public:
+    struct Config {
+        /* one-way latency of packets, uniformly distributed in this range */
+        duration min_latency {std::chrono::milliseconds(10)};
+        duration max_latency {std::chrono::milliseconds(100)};
+        /* probability for a packet to be lost */
+        double loss {0};
+        /* upload bandwidth of each node, in bytes per second, 0 for no limit */
+        size_t bandwidth {0};
+        /* seed of the network, and of node ids and random engines */
+        uint64_t seed {0};
+        /* virtual time of the start of the network */
+        time_point start {std::chrono::hours(24)};
+    };
+
+    /** Traffic of a node, since it was added */
+    struct Traffic {
+        uint64_t packets_sent {0};
+        uint64_t bytes_sent {0};
+        uint64_t packets_received {0};
+        uint64_t bytes_received {0};
+        /* sent packets lost, or sent to unknown addresses */
+        uint64_t packets_lost {0};
+    };
+
+    SimulatedNetwork();
+    SimulatedNetwork(Config config, const Sp<Logger>& logger = {});
+    ~SimulatedNetwork();
+
+    SimulatedNetwork(const SimulatedNetwork&) = delete;
+    SimulatedNetwork& operator=(const SimulatedNetwork&) = delete;
+
+    /**
+     * Adds a node to the network. The node id and the seed of its random
+     * engine are drawn from the network seed if not set, and its clock
+     * is the virtual clock of the network.
+     * @return the index of the node.
+     */
+    size_t addNode(dht::Config config = {});
+
+    size_t size() const { return nodes_.size(); }
+
+    /**
+     * @return node i. The node is woken up at the current time,
+     *         so that operations started on it are processed.
+     */
+    Dht& node(size_t i);
+    const Dht& node(size_t i) const;
+
+    const SockAddr& address(size_t i) const;
+
+    /** @return the index of the node bound to addr, or size() */
+    size_t find(const SockAddr& addr) const;
+
+    const Traffic& traffic(size_t i) const;
+
+    /** Sends a ping from node i to node j, inserting j if it answers */
+    void bootstrap(size_t i, size_t j);
+
+    /** Delivers packets and runs node jobs up to time t */
+    void runUntil(const time_point& t);
+    void runFor(const duration& d) { runUntil(now_ + d); }
+
+    /** @return the virtual time of the network */
+    const time_point& now() const { return now_; }
+
+private:
+    class Socket;
+    struct Node;
+    struct Event {
+        time_point time;
+        uint64_t seq;
+        size_t node;
+        /* packet delivered to node, empty for a wake-up */
+        Blob data;
+        size_t from;
+    };
+
+    Config config_;
+    Sp<Logger> logger_;
+    std::mt19937_64 rd_;
+    std::uniform_int_distribution<duration::rep> latency_;
+    std::bernoulli_distribution loss_;
+    time_point now_;
+    uint64_t seq_ {0};
+
+    /* min-heap of events, by time then order of insertion */
+    std::vector<Event> events_;
+    std::vector<std::unique_ptr<Node>> nodes_;
+
+    static bool later(const Event& a, const Event& b);
+    void push(Event&& ev);
+    void wake(size_t i, const time_point& t);
+    void send(size_t from, const SockAddr& dest, const uint8_t* data, size_t size);
+    void process(Event&& ev);
+};
+
+}
+}
@@ -41,6 +41,7 @@ typedef uint16_t in_port_t;
 #include <memory>
 #include <vector>
 #include <stdexcept>
+#include <new>
 #include <stdlib.h>
 
 #include <cstring>
@@ -53,6 +54,7 @@ OPENDHT_PUBLIC std::string print_addr(const sockaddr_storage& ss, socklen_t ssle
 
 /**
  * A Socket Address (sockaddr*), with abstraction for IPv4, IPv6 address families.
+ * IPv4 and IPv6 addresses are stored inline, larger ones on the heap.
  */
 class OPENDHT_PUBLIC SockAddr {
 public:
@@ -60,8 +62,11 @@ public:
     SockAddr(const SockAddr& o) {
         set(o.get(), o.getLength());
     }
-    SockAddr(SockAddr&& o) noexcept : addr(std::move(o.addr)), len(o.len) {
-        o.len = 0;
+    SockAddr(SockAddr&& o) noexcept {
+        take(o);
+    }
+    ~SockAddr() {
+        set(nullptr, 0);
     }
 
     /**
@@ -95,21 +100,24 @@ public:
     bool operator<(const SockAddr& o) const {
         if (len != o.len)
             return len < o.len;
-        return std::memcmp((const uint8_t*)get(), (const uint8_t*)o.get(), len) < 0;
+        // empty addresses have no storage
+        return len and std::memcmp((const uint8_t*)get(), (const uint8_t*)o.get(), len) < 0;
     }
 
     bool equals(const SockAddr& o) const {
         return len == o.len
-            && std::memcmp((const uint8_t*)get(), (const uint8_t*)o.get(), len) == 0;
+            && (not len or std::memcmp((const uint8_t*)get(), (const uint8_t*)o.get(), len) == 0);
     }
     SockAddr& operator=(const SockAddr& o) {
-        set(o.get(), o.getLength());
+        if (this != &o)
+            set(o.get(), o.getLength());
         return *this;
     }
-    SockAddr& operator=(SockAddr&& o) {
-        len = o.len;
-        o.len = 0;
-        addr = std::move(o.addr);
+    SockAddr& operator=(SockAddr&& o) noexcept {
+        if (this != &o) {
+            set(nullptr, 0);
+            take(o);
+        }
         return *this;
     }
 
@@ -120,7 +128,7 @@ public:
     /**
      * Returns the address family or AF_UNSPEC if the address is not set.
      */
-    sa_family_t getFamily() const { return len ? addr->sa_family : AF_UNSPEC; }
+    sa_family_t getFamily() const { return len ? get()->sa_family : AF_UNSPEC; }
 
     /**
      * Resize the managed structure to the appropriate size (if needed),
@@ -140,12 +148,11 @@ public:
             new_length = 0;
         }
         if (new_length != len) {
-            len = new_length;
-            if (len) addr.reset((sockaddr*)::calloc(len, 1));
-            else     addr.reset();
+            set(nullptr, new_length);
+            if (len) std::memset(get(), 0, len);
         }
         if (len > sizeof(sa_family_t))
-            addr->sa_family = af;
+            get()->sa_family = af;
     }
 
     /**
@@ -215,13 +222,17 @@ public:
      * Returns the address to the managed sockaddr structure.
      * The accessible length is returned by #getLength().
      */
-    const sockaddr* get() const { return addr.get(); }
+    const sockaddr* get() const { return const_cast<SockAddr*>(this)->get(); }
 
     /**
      * Returns the address to the managed sockaddr structure.
      * The accessible length is returned by #getLength().
      */
-    sockaddr* get() { return addr.get(); }
+    sockaddr* get() {
+        if (len == 0)
+            return nullptr;
+        return len > INLINE_LENGTH ? heap() : reinterpret_cast<sockaddr*>(storage_);
+    }
 
     const sockaddr_in& getIPv4() const {
         return *reinterpret_cast<const sockaddr_in*>(get());
@@ -260,41 +271,91 @@ public:
         bool operator()(const SockAddr& a, const SockAddr& b) const {
             if (a.len != b.len)
                 return a.len < b.len;
-            socklen_t start, len;
-            switch(a.getFamily()) {
-                case AF_INET:
-                    start = offsetof(sockaddr_in, sin_addr);
-                    len = sizeof(in_addr);
-                    break;
-                case AF_INET6:
-                    start = offsetof(sockaddr_in6, sin6_addr);
-                    // don't consider more than 64 bits (IPv6)
-                    len = 8;
-                    break;
-                default:
-                    start = 0;
-                    len = a.len;
-                    break;
-            }
-            return std::memcmp((uint8_t*)a.get()+start,
-                               (uint8_t*)b.get()+start, len) < 0;
+            auto r = a.ipRange();
+            return r.second and std::memcmp((uint8_t*)a.get()+r.first,
+                               (uint8_t*)b.get()+r.first, r.second) < 0;
+        }
+    };
+    /**
+     * Hash and equality functors matching ipCmp, to index
+     * IP addresses in unordered containers.
+     * Containers indexing remote addresses should use a random seed,
+     * so that bucket collisions can't be chosen by peers.
+     */
+    struct ipHash {
+        uint64_t seed {0};
+        size_t operator()(const SockAddr& a) const {
+            auto r = a.ipRange();
+            // seeded FNV-1a
+            uint64_t h = (14695981039346656037ull ^ seed) ^ a.len;
+            auto p = (const uint8_t*)a.get() + r.first;
+            for (socklen_t i = 0; i < r.second; i++)
+                h = (h ^ p[i]) * 1099511628211ull;
+            h = (h ^ (h >> 29)) * UINT64_C(0x9e3779b97f4a7c15);
+            return (size_t)(h ^ (h >> 32));
+        }
+    };
+    struct ipEqual {
+        bool operator()(const SockAddr& a, const SockAddr& b) const {
+            if (a.len != b.len)
+                return false;
+            auto r = a.ipRange();
+            return not r.second or std::memcmp((uint8_t*)a.get()+r.first,
+                               (uint8_t*)b.get()+r.first, r.second) == 0;
         }
     };
 private:
-    struct free_delete { void operator()(void* p) { ::free(p); } };
-    std::unique_ptr<sockaddr, free_delete> addr {};
+    /** Offset and length of the address bytes considered by ipCmp */
+    std::pair<socklen_t, socklen_t> ipRange() const {
+        switch(getFamily()) {
+            case AF_INET:
+                return {offsetof(sockaddr_in, sin_addr), sizeof(in_addr)};
+            case AF_INET6:
+                // don't consider more than 64 bits (IPv6)
+                return {offsetof(sockaddr_in6, sin6_addr), 8};
+            default:
+                return {0, len};
+        }
+    }
+
+    static constexpr socklen_t INLINE_LENGTH {sizeof(sockaddr_in6)};
+
+    /* The address if len <= INLINE_LENGTH, otherwise a pointer to it */
+    alignas(sockaddr*) uint8_t storage_[INLINE_LENGTH];
     socklen_t len {0};
 
+    sockaddr* heap() const {
+        sockaddr* p;
+        std::memcpy(&p, storage_, sizeof(p));
+        return p;
+    }
+
+    /** Resize the storage to length and copy sa in it, if not null */
     void set(const sockaddr* sa, socklen_t length) {
         if (len != length) {
+            if (len > INLINE_LENGTH)
+                ::free(heap());
             len = length;
-            if (len) addr.reset((sockaddr*)::malloc(len));
-            else     addr.reset();
+            if (len > INLINE_LENGTH) {
+                auto p = (sockaddr*)::malloc(len);
+                if (not p) {
+                    len = 0;
+                    throw std::bad_alloc();
+                }
+                std::memcpy(storage_, &p, sizeof(p));
+            }
         }
-        if (len)
+        if (len and sa)
             std::memcpy((uint8_t*)get(), (const uint8_t*)sa, len);
     }
 
+    /** Take the address of o, which must be empty or freed */
+    void take(SockAddr& o) noexcept {
+        len = o.len;
+        std::memcpy(storage_, o.storage_, len > INLINE_LENGTH ? sizeof(sockaddr*) : len);
+        o.len = 0;
+    }
+
 };
 
 OPENDHT_PUBLIC bool operator==(const SockAddr& a, const SockAddr& b);
@@ -0,0 +1,149 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "infohash.h"
+#include "value.h"
+#include "sockaddr.h"
+#include "log_enable.h"
+
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+
+namespace dht {
+
+/**
+ * Persistent storage for the values stored by a Dht node.
+ *
+ * The Dht keeps serving values from memory and writes every change
+ * through the backend, so that stored values survive a restart: the
+ * backend doesn't reduce the memory used by the storage.
+ * The address of the node that sent each value is persisted with it,
+ * so that values count again against the store quota of their origin
+ * once loaded. All methods are called from the DHT thread.
+ */
+class OPENDHT_PUBLIC StorageBackend {
+public:
+    using LoadCallback = std::function<void(const InfoHash& key, const Sp<Value>& value, time_point created,
+                                            time_point expiration, const SockAddr& source)>;
+
+    virtual ~StorageBackend() = default;
+
+    /**
+     * Stores a new value, or replaces the value with the same id.
+     * @param source  the node that sent the value, empty for local values.
+     */
+    virtual void put(const InfoHash& key, const Value& value, time_point created, time_point expiration,
+                     const SockAddr& source = {}) = 0;
+
+    /** Updates the lifetime of a stored value */
+    virtual void refresh(const InfoHash& key, Value::Id vid, time_point created, time_point expiration) = 0;
+
+    /** Removes a stored value */
+    virtual void erase(const InfoHash& key, Value::Id vid) = 0;
+
+    /** Calls cb with every value stored and not yet expired */
+    virtual void load(const LoadCallback& cb) = 0;
+
+    /** Called periodically by the Dht, for cleanup work */
+    virtual void maintain() {}
+};
+
+/**
+ * Log-structured storage backend.
+ *
+ * Changes are appended to segment files named path.<n>, listed in the
+ * manifest file at path. The location of every live value is kept in
+ * memory. maintain() flushes the log, and rewrites the live values of the
+ * oldest segment to the newest one when most of the log is obsolete,
+ * one segment per call.
+ * Changes are only guaranteed to be on disk once flushed.
+ */
+class OPENDHT_PUBLIC LogStorageBackend : public StorageBackend {
+public:
+    static constexpr size_t DEFAULT_SEGMENT_SIZE {64 * 1024 * 1024};
+
+    /**
+     * @param path  manifest path, segments are created next to it.
+     * @throw DhtException if the log can't be opened.
+     */
+    LogStorageBackend(const std::string& path, size_t segment_size = DEFAULT_SEGMENT_SIZE, const Sp<Logger>& logger = {});
+    ~LogStorageBackend();
+
+    void put(const InfoHash& key, const Value& value, time_point created, time_point expiration,
+             const SockAddr& source = {}) override;
+    void refresh(const InfoHash& key, Value::Id vid, time_point created, time_point expiration) override;
+    void erase(const InfoHash& key, Value::Id vid) override;
+    void load(const LoadCallback& cb) override;
+    void maintain() override;
+
+    /** @return the size of the live values in the log, in bytes */
+    size_t liveSize() const { return live_size_; }
+    /** @return the size of the log on disk, in bytes */
+    size_t logSize() const { return log_size_; }
+
+private:
+    LogStorageBackend(const LogStorageBackend&) = delete;
+    LogStorageBackend& operator=(const LogStorageBackend&) = delete;
+
+    enum class Op : uint8_t { PUT = 0, REFRESH, ERASE };
+
+    /* Position of the last put of a value in the log */
+    struct Location {
+        uint64_t segment;
+        size_t offset;
+        size_t size;
+        int64_t created;
+        int64_t expiration;
+    };
+    struct Segment {
+        size_t size {0};
+        size_t live {0};
+    };
+    using Key = std::pair<InfoHash, Value::Id>;
+
+    std::string path_;
+    size_t segment_size_;
+    Sp<Logger> logger_;
+
+    std::map<Key, Location> index_;
+    std::map<uint64_t, Segment> segments_;
+    uint64_t active_id_ {0};
+    std::ofstream active_;
+    size_t live_size_ {0};
+    size_t log_size_ {0};
+
+    std::string segmentPath(uint64_t id) const;
+    void readManifest();
+    void writeManifest() const;
+    void openSegment();
+    void scanSegment(uint64_t id);
+    void compact(uint64_t id);
+
+    /** Appends a record, returning its location */
+    Location append(const msgpack::sbuffer& record, int64_t created, int64_t expiration);
+    /** Appends the put of value, a Value or its packed msgpack object */
+    template <typename V>
+    void writePut(const Key& key, const V& value, int64_t created, int64_t expiration, const SockAddr& source);
+    void drop(std::map<Key, Location>::iterator it);
+};
+
+}
@@ -20,17 +20,48 @@
 #pragma once
 
 #include "def.h"
+#include "metrics.h"
 
 #include <condition_variable>
 #include <vector>
 #include <queue>
 #include <future>
 #include <functional>
+#include <atomic>
+#include <memory>
 
 namespace dht {
 
+/**
+ * Work-stealing thread pool.
+ *
+ * Each worker thread has its own task deque: tasks submitted from a worker
+ * are pushed to its deque, and idle workers steal from the others.
+ * Tasks submitted from other threads go through a shared lock-free queue.
+ * Threads are started on demand, up to maxThreads.
+ *
+ * Tasks have a priority: high priority tasks are picked before any other
+ * queued task, low priority tasks only when no other task is waiting
+ * (or occasionally, so that they are not starved).
+ */
 class OPENDHT_PUBLIC ThreadPool {
 public:
+    enum class Priority : unsigned { High = 0, Normal, Low };
+    static constexpr unsigned PRIORITY_COUNT {3};
+
+    struct OPENDHT_PUBLIC Stats {
+        /* number of started threads */
+        unsigned threads {0};
+        /* number of threads running a task */
+        unsigned active {0};
+        /* per priority: tasks waiting to run, time spent waiting and running */
+        std::array<size_t, PRIORITY_COUNT> queued {};
+        std::array<LatencyStats, PRIORITY_COUNT> wait {};
+        std::array<LatencyStats, PRIORITY_COUNT> run {};
+
+        std::string toString() const;
+    };
+
     static ThreadPool& computation();
     static ThreadPool& io();
 
@@ -38,10 +69,10 @@ public:
     ThreadPool(size_t maxThreads);
     ~ThreadPool();
 
-    void run(std::function<void()>&& cb);
+    void run(std::function<void()>&& cb, Priority priority = Priority::Normal);
 
     template<class T>
-    std::future<T> get(std::function<T()>&& cb) {
+    std::future<T> get(std::function<T()>&& cb, Priority priority = Priority::Normal) {
         auto ret = std::make_shared<std::promise<T>>();
         run([cb = std::move(cb), ret]() mutable {
             try {
@@ -51,33 +82,60 @@ public:
                     ret->set_exception(std::current_exception());
                 } catch(...) {}
             }
-        });
+        }, priority);
         return ret->get_future();
     }
     template<class T>
-    std::shared_future<T> getShared(std::function<T()>&& cb) {
-        return get(std::move(cb));
+    std::shared_future<T> getShared(std::function<T()>&& cb, Priority priority = Priority::Normal) {
+        return get(std::move(cb), priority);
     }
 
+    Stats getStats() const;
+
     void stop();
     void join();
 
 private:
-    struct ThreadState;
-    std::queue<std::function<void()>> tasks_ {};
-    std::vector<std::unique_ptr<ThreadState>> threads_;
-    unsigned readyThreads_ {0};
+    struct Task {
+        std::function<void()> cb;
+        Priority priority;
+        time_point queued;
+    };
+    class TaskDeque;
+    class TaskQueue;
+    struct Worker;
+
+    /* a low priority task is picked first once every LOW_PRIORITY_PERIOD tasks */
+    static constexpr unsigned LOW_PRIORITY_PERIOD {64};
+
+    const unsigned maxThreads_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    /* queues for tasks submitted from outside the pool, by priority */
+    std::array<std::unique_ptr<TaskQueue>, PRIORITY_COUNT> injectors_;
+    /* number of started threads */
+    std::atomic<unsigned> threadCount_ {0};
+    /* number of tasks submitted and not yet picked */
+    std::atomic<size_t> pending_ {0};
+    std::atomic<unsigned> sleeping_ {0};
+    std::atomic<unsigned> active_ {0};
+    std::atomic_bool running_ {true};
+
+    std::array<std::atomic<size_t>, PRIORITY_COUNT> queued_ {};
+    std::array<LatencyHistogram, PRIORITY_COUNT> waitTime_ {};
+    std::array<LatencyHistogram, PRIORITY_COUNT> runTime_ {};
+
     std::mutex lock_ {};
     std::condition_variable cv_ {};
 
-    const unsigned maxThreads_;
-    bool running_ {true};
+    void startThread();
+    void workerLoop(unsigned index);
+    Task* pickTask(unsigned index, uint64_t& rand, unsigned& picked);
 };
 
 class OPENDHT_PUBLIC Executor : public std::enable_shared_from_this<Executor> {
 public:
-    Executor(ThreadPool& pool, unsigned maxConcurrent = 1)
-     : threadPool_(pool), maxConcurrent_(maxConcurrent)
+    Executor(ThreadPool& pool, unsigned maxConcurrent = 1, ThreadPool::Priority priority = ThreadPool::Priority::Normal)
+     : threadPool_(pool), maxConcurrent_(maxConcurrent), priority_(priority)
     {}
 
     void run(std::function<void()>&& task);
@@ -85,6 +143,7 @@ public:
 private:
     std::reference_wrapper<ThreadPool> threadPool_;
     const unsigned maxConcurrent_ {1};
+    const ThreadPool::Priority priority_ {ThreadPool::Priority::Normal};
     std::mutex lock_ {};
     unsigned current_ {0};
     std::queue<std::function<void()>> tasks_ {};
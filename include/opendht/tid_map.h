@@ -0,0 +1,231 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+namespace dht {
+
+using Tid = uint32_t;
+
+/**
+ * Flat hash table indexed by transaction id.
+ *
+ * Entries are stored in a single power-of-two sized array using linear
+ * probing, so lookups touch a couple of contiguous slots instead of walking
+ * a tree. Tid 0 is never allocated and marks empty slots.
+ * Insertion and erasure invalidate iterators.
+ * Neither insertion nor erasure shrinks the table: shrink() frees it
+ * once empty, as one is kept for each known node, or shrinks it if
+ * mostly unused.
+ */
+template <typename T>
+class TidMap {
+public:
+    using value_type = std::pair<Tid, T>;
+
+    template <bool Const>
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = TidMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = typename std::conditional<Const, const value_type*, value_type*>::type;
+        using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
+
+        Iterator() {}
+        Iterator(pointer p, pointer end) : p_(p), end_(end) { skip(); }
+        template <bool C, typename = typename std::enable_if<Const and not C>::type>
+        Iterator(const Iterator<C>& o) : p_(o.p_), end_(o.end_) {}
+
+        reference operator*() const { return *p_; }
+        pointer operator->() const { return p_; }
+        Iterator& operator++() { ++p_; skip(); return *this; }
+        Iterator operator++(int) { auto it = *this; ++*this; return it; }
+        bool operator==(const Iterator& o) const { return p_ == o.p_; }
+        bool operator!=(const Iterator& o) const { return p_ != o.p_; }
+    private:
+        friend class TidMap;
+        template <bool> friend class Iterator;
+        pointer p_ {nullptr};
+        pointer end_ {nullptr};
+        void skip() {
+            while (p_ != end_ and p_->first == 0)
+                ++p_;
+        }
+    };
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    TidMap() {}
+    TidMap(const TidMap&) = default;
+    TidMap& operator=(const TidMap&) = default;
+    /* The moved-from map is left empty */
+    TidMap(TidMap&& o) noexcept : slots_(std::move(o.slots_)), bits_(o.bits_), size_(o.size_) {
+        o.clear();
+    }
+    TidMap& operator=(TidMap&& o) noexcept {
+        if (this != &o) {
+            slots_ = std::move(o.slots_);
+            bits_ = o.bits_;
+            size_ = o.size_;
+            o.clear();
+        }
+        return *this;
+    }
+
+    iterator begin() { return {slots_.data(), slots_.data() + slots_.size()}; }
+    iterator end() { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+    const_iterator begin() const { return {slots_.data(), slots_.data() + slots_.size()}; }
+    const_iterator end() const { return {slots_.data() + slots_.size(), slots_.data() + slots_.size()}; }
+
+    size_t size() const { return size_; }
+    /** Number of slots of the table */
+    size_t capacity() const { return slots_.size(); }
+    bool empty() const { return size_ == 0; }
+
+    iterator find(Tid tid) {
+        if (tid == 0 or slots_.empty())
+            return end();
+        for (size_t i = home(tid);; i = (i + 1) & mask()) {
+            auto& s = slots_[i];
+            if (s.first == tid)
+                return at(i);
+            if (s.first == 0)
+                return end();
+        }
+    }
+    const_iterator find(Tid tid) const {
+        return const_cast<TidMap*>(this)->find(tid);
+    }
+
+    /**
+     * Insert v for tid if tid is not already present.
+     * Return an iterator to the entry for tid and whether insertion happened.
+     */
+    template <typename V>
+    std::pair<iterator, bool> emplace(Tid tid, V&& v) {
+        if (tid == 0)
+            return {end(), false};
+        if ((size_ + 1) * 2 > slots_.size())
+            rehash(slots_.empty() ? size_t(MIN_CAPACITY) : slots_.size() * 2);
+        size_t i = home(tid);
+        for (; slots_[i].first != 0; i = (i + 1) & mask())
+            if (slots_[i].first == tid)
+                return {at(i), false};
+        slots_[i].first = tid;
+        slots_[i].second = std::forward<V>(v);
+        size_++;
+        return {at(i), true};
+    }
+
+    size_t erase(Tid tid) {
+        auto it = find(tid);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    void erase(const_iterator it) {
+        removeAt(it.p_ - slots_.data());
+    }
+
+    /** Remove all entries and free the table. */
+    void clear() {
+        std::vector<value_type>().swap(slots_);
+        bits_ = 0;
+        size_ = 0;
+    }
+
+    /**
+     * Free the table if empty or, once at most an eighth full, halve it
+     * while at most a quarter full: a table at the growth threshold must
+     * lose most of its entries before being shrunk again.
+     * Invalidates iterators: not to be called while iterating.
+     */
+    void shrink() {
+        if (size_ == 0) {
+            if (not slots_.empty())
+                clear();
+            return;
+        }
+        auto capacity = slots_.size();
+        if (size_ * 8 > capacity)
+            return;
+        while (capacity > MIN_CAPACITY and size_ * 4 <= capacity)
+            capacity /= 2;
+        if (capacity != slots_.size())
+            rehash(capacity);
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY {2};
+
+    std::vector<value_type> slots_ {};
+    uint32_t bits_ {0};
+    uint32_t size_ {0};
+
+    size_t mask() const { return slots_.size() - 1; }
+
+    size_t home(Tid tid) const {
+        // Fibonacci hashing, spreading sequential ids over the table
+        return (uint32_t)(tid * UINT32_C(0x9E3779B1)) >> (32 - bits_);
+    }
+
+    iterator at(size_t i) {
+        return {slots_.data() + i, slots_.data() + slots_.size()};
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<value_type> old(capacity);
+        old.swap(slots_);
+        bits_ = 0;
+        while ((size_t(1) << bits_) < capacity)
+            bits_++;
+        for (auto& s : old) {
+            if (s.first == 0)
+                continue;
+            size_t i = home(s.first);
+            while (slots_[i].first != 0)
+                i = (i + 1) & mask();
+            slots_[i] = std::move(s);
+        }
+    }
+
+    /* Backward shift deletion: keeps probe sequences contiguous without tombstones */
+    void removeAt(size_t i) {
+        for (size_t j = (i + 1) & mask(); slots_[j].first != 0; j = (j + 1) & mask()) {
+            size_t k = home(slots_[j].first);
+            if (((j - k) & mask()) >= ((j - i) & mask())) {
+                slots_[i] = std::move(slots_[j]);
+                i = j;
+            }
+        }
+        slots_[i] = {};
+        size_--;
+    }
+};
+
+}
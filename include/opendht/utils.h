@@ -155,23 +155,36 @@ using Blob = std::vector<uint8_t>;
  */
 OPENDHT_PUBLIC Blob unpackBlob(const msgpack::object& o);
 
+/**
+ * Msgpack output stream appending to a Blob, so that packed data
+ * doesn't have to be copied from a msgpack::sbuffer.
+ */
+struct BlobWriter {
+    Blob& blob;
+    explicit BlobWriter(Blob& b) : blob(b) {}
+    void write(const char* buf, size_t len) {
+        blob.insert(blob.end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+    }
+};
+
 template <typename Type>
 Blob
 packMsg(const Type& t) {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    Blob ret;
+    BlobWriter out(ret);
+    msgpack::packer<BlobWriter> pk(&out);
     pk.pack(t);
-    return {buffer.data(), buffer.data()+buffer.size()};
+    return ret;
 }
 
 template <typename Type>
 Type
-unpackMsg(Blob b) {
+unpackMsg(const Blob& b) {
     msgpack::unpacked msg_res = msgpack::unpack((const char*)b.data(), b.size());
     return msg_res.get().as<Type>();
 }
 
-msgpack::unpacked unpackMsg(Blob b);
+msgpack::unpacked unpackMsg(const Blob& b);
 
 msgpack::object* findMapValue(const msgpack::object& map, const char* key, size_t length);
 
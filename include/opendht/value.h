@@ -23,6 +23,7 @@
 #include "crypto.h"
 #include "utils.h"
 #include "sockaddr.h"
+#include "pool.h"
 
 #include <msgpack.hpp>
 
@@ -364,6 +365,9 @@ struct OPENDHT_PUBLIC Value
     /**
      * Check that the value is signed and that the signature matches.
      * If true, the owner field will contain the signer public key.
+     * The signed part is packed and verified on every call, as the
+     * fields of the value may have changed: SecureDht keeps the result
+     * of the check of each received value instead.
      */
     bool checkSignature() const {
         return isSigned() and owner->checkSignature(getToSign(), signature);
@@ -377,12 +381,17 @@ struct OPENDHT_PUBLIC Value
      * Sign the value with from and returns the encrypted version for to.
      */
     Value encrypt(const crypto::PrivateKey& from, const crypto::PublicKey& to) {
-        if (isEncrypted())
-            throw DhtException("Data is already encrypted.");
-        setRecipient(to.getId());
-        sign(from);
         Value nv {id};
-        nv.setCypher(to.encrypt(getToEncrypt()));
+        nv.setCypher(to.encrypt(signToEncrypt(from, to.getId())));
+        return nv;
+    }
+
+    /**
+     * Same as encrypt(from, to), with a session key generated for to.
+     */
+    Value encrypt(const crypto::PrivateKey& from, const crypto::PublicKey& to, const crypto::SessionKey& session) {
+        Value nv {id};
+        nv.setCypher(session.encrypt(signToEncrypt(from, to.getId())));
         return nv;
     }
 
@@ -464,20 +473,22 @@ struct OPENDHT_PUBLIC Value
      * Pack part of the data to be signed (must always be done the same way)
      */
     Blob getToSign() const {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        Blob ret;
+        BlobWriter out(ret);
+        msgpack::packer<BlobWriter> pk(&out);
         msgpack_pack_to_sign(pk);
-        return {buffer.data(), buffer.data()+buffer.size()};
+        return ret;
     }
 
     /**
      * Pack part of the data to be encrypted
      */
     Blob getToEncrypt() const {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        Blob ret;
+        BlobWriter out(ret);
+        msgpack::packer<BlobWriter> pk(&out);
         msgpack_pack_to_encrypt(pk);
-        return {buffer.data(), buffer.data()+buffer.size()};
+        return ret;
     }
 
     /** print value for debugging */
@@ -582,10 +593,11 @@ struct OPENDHT_PUBLIC Value
     void msgpack_unpack(const msgpack::object& o);
     void msgpack_unpack_body(const msgpack::object& o);
     Blob getPacked() const {
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        Blob ret;
+        BlobWriter out(ret);
+        msgpack::packer<BlobWriter> pk(&out);
         pk.pack(*this);
-        return {buffer.data(), buffer.data()+buffer.size()};
+        return ret;
     }
 
     void msgpack_unpack_fields(const std::set<Value::Field>& fields, const msgpack::object& o, unsigned offset);
@@ -644,10 +656,64 @@ private:
     bool signatureValid {false};
     bool decrypted {false};
     Sp<Value> decryptedValue {};
+
+    /* Signs the value for the recipient, returning the data to encrypt */
+    Blob signToEncrypt(const crypto::PrivateKey& from, const InfoHash& to) {
+        if (isEncrypted())
+            throw DhtException("Data is already encrypted.");
+        setRecipient(to);
+        // pack the signed part once, to sign it and to encrypt it
+        owner = std::make_shared<const crypto::PublicKey>(from.getPublicKey());
+        auto to_sign = getToSign();
+        signature = from.sign(to_sign);
+        return packToEncrypt(to_sign);
+    }
+
+    /* Same as getToEncrypt(), with the signed part already packed */
+    Blob packToEncrypt(const Blob& to_sign) const {
+        Blob ret;
+        BlobWriter out(ret);
+        msgpack::packer<BlobWriter> pk(&out);
+        pk.pack_map(isSigned() ? 2 : 1);
+        pk.pack(VALUE_KEY_BODY); out.write((const char*)to_sign.data(), to_sign.size());
+        if (isSigned()) {
+            pk.pack(VALUE_KEY_SIGNATURE); pk.pack_bin(signature.size());
+                                          pk.pack_bin_body((const char*)signature.data(), signature.size());
+        }
+        return ret;
+    }
 };
 
+/** Pool of the memory blocks holding values made by makeValue */
+OPENDHT_PUBLIC const Sp<BlockPool>& getValuePool();
+
+/**
+ * Same as std::make_shared<Value>, but recycles memory blocks
+ * of released values. Used for values received from the network.
+ */
+template <typename... Args>
+Sp<Value> makeValue(Args&&... args) {
+    return std::allocate_shared<Value>(PoolAllocator<Value>(getValuePool()), std::forward<Args>(args)...);
+}
+
 using ValuesExport = std::pair<InfoHash, Blob>;
 
+/**
+ * Values stored at a key with their creation time, shared with the
+ * storage: taking a snapshot only copies pointers, and the snapshot
+ * can be packed later, from any thread.
+ */
+struct OPENDHT_PUBLIC ValuesSnapshot {
+    InfoHash key;
+    std::vector<std::pair<time_point, Sp<Value>>> values;
+
+    /** Packs the values, as exported by Dht::exportValues */
+    ValuesExport pack() const;
+};
+
+/** Called with the values of each key, returns false to stop */
+using ValuesExportCallback = std::function<bool(ValuesExport&&)>;
+
 /**
  * @class   FieldValue
  * @brief   Describes a value filter.
@@ -873,18 +939,22 @@ struct OPENDHT_PUBLIC Where
 
     /**
      * Computes the Value::Filter based on the list of field value set.
+     * Constraints are compiled to a single set of conditions on the
+     * value fields, checked without chaining a filter per field.
      *
      * @return the resulting Value::Filter.
      */
-    Value::Filter getFilter() const {
-        if (filters_.empty()) return {};
-        std::vector<Value::Filter> fset;
-        fset.reserve(filters_.size());
-        for (const auto& f : filters_) {
-            if (auto lf = f.getLocalFilter())
-                fset.emplace_back(std::move(lf));
-        }
-        return Value::Filter::chainAll(std::move(fset));
+    Value::Filter getFilter() const;
+
+    /**
+     * @return the first constraint on field, or nullptr if the field
+     * is not restricted.
+     */
+    const FieldValue* getFieldValue(Value::Field field) const {
+        auto it = std::find_if(filters_.begin(), filters_.end(), [&](const FieldValue& f) {
+            return f.getField() == field;
+        });
+        return it == filters_.end() ? nullptr : &(*it);
     }
 
     template <typename Packer>
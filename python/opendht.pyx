@@ -39,6 +39,7 @@ from cpython cimport ref
 
 cimport opendht_cpp as cpp
 
+import asyncio
 import threading
 
 cdef inline void lookup_callback(cpp.vector[cpp.shared_ptr[cpp.IndexValue]]* values, cpp.Prefix* p, void *user_data) with gil:
@@ -57,21 +58,39 @@ cdef inline void shutdown_callback(void* user_data) with gil:
         cbs['shutdown']()
     ref.Py_DECREF(cbs)
 
-cdef inline bool get_callback(shared_ptr[cpp.Value] value, void *user_data) with gil:
+cdef inline list wrap_values(cpp.vector[shared_ptr[cpp.Value]]* values, f):
+    vals = []
+    for value in deref(values):
+        pv = Value()
+        pv._value = value
+        if not f or f(pv):
+            vals.append(pv)
+    return vals
+
+# The GIL is taken once for all the values received together.
+# Callbacks registered with batch=True are called with the list of values,
+# other callbacks are called for each value.
+cdef inline bool get_callback(cpp.vector[shared_ptr[cpp.Value]]* values, void *user_data) with gil:
     cbs = <object>user_data
     cb = cbs['get']
-    f = cbs['filter'] if 'filter' in cbs else None
-    pv = Value()
-    pv._value = value
-    return cb(pv) if not f or f(pv) else True
-
-cdef inline bool value_callback(shared_ptr[cpp.Value] value, bool expired, void *user_data) with gil:
+    vals = wrap_values(values, cbs.get('filter'))
+    if cbs.get('batch'):
+        return cb(vals) if vals else True
+    for pv in vals:
+        if not cb(pv):
+            return False
+    return True
+
+cdef inline bool value_callback(cpp.vector[shared_ptr[cpp.Value]]* values, bool expired, void *user_data) with gil:
     cbs = <object>user_data
     cb = cbs['valcb']
-    f = cbs['filter'] if 'filter' in cbs else None
-    pv = Value()
-    pv._value = value
-    return cb(pv, expired) if not f or f(pv) else True
+    vals = wrap_values(values, cbs.get('filter'))
+    if cbs.get('batch'):
+        return cb(vals, expired) if vals else True
+    for pv in vals:
+        if not cb(pv, expired):
+            return False
+    return True
 
 cdef inline void done_callback(bool done, cpp.vector[shared_ptr[cpp.Node]]* nodes, void *user_data) with gil:
     node_ids = []
@@ -91,6 +110,12 @@ cdef inline void done_callback_simple(bool done, void *user_data) with gil:
         cbs['done'](done)
     ref.Py_DECREF(cbs)
 
+# Called when the C++ callback holding the reference is destroyed,
+# possibly from the DHT thread after the listener was cancelled.
+cdef void release_callback(void *user_data) with gil:
+    cbs = <object>user_data
+    ref.Py_DECREF(cbs)
+
 cdef class _WithID(object):
     def __repr__(self):
         return "<%s '%s'>" % (self.__class__.__name__, str(self))
@@ -413,7 +438,7 @@ cdef class TrustList(object):
 cdef class ListenToken(object):
     cdef cpp.InfoHash _h
     cdef cpp.shared_future[size_t] _t
-    _cb = dict()
+    cdef object _cb
 
 cdef class Identity(object):
     cdef cpp.Identity _id
@@ -474,10 +499,15 @@ cdef class DhtRunner(_WithID):
     def getNodeId(self):
         return self.thisptr.get().getNodeId().toString()
     def ping(self, SockAddr addr, done_cb=None):
+        cdef cpp.SockAddr a
+        cdef cpp.DoneCallbackSimple cb
         if done_cb:
             cb_obj = {'done':done_cb}
             ref.Py_INCREF(cb_obj)
-            self.thisptr.get().bootstrap(addr._addr, cpp.bindDoneCbSimple(done_callback_simple, <void*>cb_obj))
+            a = addr._addr
+            cb = cpp.bindDoneCbSimple(done_callback_simple, <void*>cb_obj)
+            with nogil:
+                self.thisptr.get().bootstrap(a, cb)
         else:
             lock = threading.Condition()
             pending = 0
@@ -497,22 +527,38 @@ cdef class DhtRunner(_WithID):
     def bootstrap(self, str host, str port=None):
         host_bytes = host.encode()
         port_bytes = port.encode() if port else b'4222'
-        self.thisptr.get().bootstrap(<cpp.const_char*>host_bytes, <cpp.const_char*>port_bytes)
+        cdef cpp.const_char* h = host_bytes
+        cdef cpp.const_char* p = port_bytes
+        with nogil:
+            self.thisptr.get().bootstrap(h, p)
     def run(self, Identity id=None, is_bootstrap=False, cpp.in_port_t port=0, str ipv4="", str ipv6="", DhtConfig config=DhtConfig()):
+        cdef cpp.DhtRunnerConfig c
+        cdef cpp.const_char* b4
+        cdef cpp.const_char* b6
+        cdef cpp.const_char* s
         if id:
             config.setIdentity(id)
+        c = config._config
         if ipv4 or ipv6:
             bind4 = ipv4.encode() if ipv4 else b''
             bind6 = ipv6.encode() if ipv6 else b''
-            self.thisptr.get().run(bind4, bind6, str(port).encode(), config._config)
+            service = str(port).encode()
+            b4, b6, s = bind4, bind6, service
+            with nogil:
+                self.thisptr.get().run(b4, b6, s, c)
         else:
-            self.thisptr.get().run(port, config._config)
+            with nogil:
+                self.thisptr.get().run(port, c)
     def join(self):
-        self.thisptr.get().join()
+        with nogil:
+            self.thisptr.get().join()
     def shutdown(self, shutdown_cb=None):
+        cdef cpp.ShutdownCallback cb
         cb_obj = {'shutdown':shutdown_cb}
         ref.Py_INCREF(cb_obj)
-        self.thisptr.get().shutdown(cpp.bindShutdownCb(shutdown_callback, <void*>cb_obj))
+        cb = cpp.bindShutdownCb(shutdown_callback, <void*>cb_obj)
+        with nogil:
+            self.thisptr.get().shutdown(cb)
     def enableLogging(self):
         cpp.enableLogging(self.thisptr.get()[0])
     def disableLogging(self):
@@ -538,7 +584,7 @@ cdef class DhtRunner(_WithID):
             stats.append(n)
         return stats
 
-    def get(self, InfoHash key, get_cb=None, done_cb=None, filter=None, Where where=None):
+    def get(self, InfoHash key, get_cb=None, done_cb=None, filter=None, Where where=None, bool batch=False):
         """Retreive values associated with a key on the DHT.
 
         key     -- the key for which to search
@@ -546,23 +592,33 @@ cdef class DhtRunner(_WithID):
                    is found on the DHT.
         done_cb -- optional callback used when get_cb is set. Called when the
                    operation is completed.
+        batch   -- if set, get_cb is called with the list of values received
+                   together instead of each value.
         """
+        cdef cpp.InfoHash h
+        cdef cpp.GetCallback gcb
+        cdef cpp.DoneCallback dcb
+        cdef cpp.Where w
         if get_cb:
-            cb_obj = {'get':get_cb, 'done':done_cb, 'filter':filter}
+            cb_obj = {'get':get_cb, 'done':done_cb, 'filter':filter, 'batch':batch}
             ref.Py_INCREF(cb_obj)
             if where is None:
                 where = Where()
-            self.thisptr.get().get(key._infohash, cpp.bindGetCb(get_callback, <void*>cb_obj),
-                    cpp.bindDoneCb(done_callback, <void*>cb_obj),
-                    cpp.nullptr, #filter implemented in the get_callback
-                    where._where)
+            h = key._infohash
+            gcb = cpp.bindGetBatchCb(get_callback, <void*>cb_obj)
+            dcb = cpp.bindDoneCb(done_callback, <void*>cb_obj)
+            w = where._where
+            with nogil:
+                self.thisptr.get().get(h, gcb, dcb,
+                        cpp.nullptr, #filter implemented in the get_callback
+                        w)
         else:
             lock = threading.Condition()
             pending = 0
             res = []
-            def tmp_get(v):
+            def tmp_get(vals):
                 nonlocal res
-                res.append(v)
+                res.extend(vals)
                 return True
             def tmp_done(ok, nodes):
                 nonlocal pending, lock
@@ -571,7 +627,7 @@ cdef class DhtRunner(_WithID):
                     lock.notify()
             with lock:
                 pending += 1
-                self.get(key, get_cb=tmp_get, done_cb=tmp_done, filter=filter, where=where)
+                self.get(key, get_cb=tmp_get, done_cb=tmp_done, filter=filter, where=where, batch=True)
                 while pending > 0:
                     lock.wait()
             return res
@@ -582,10 +638,17 @@ cdef class DhtRunner(_WithID):
         val     -- the value to put on the DHT
         done_cb -- optional callback called when the operation is completed.
         """
+        cdef cpp.InfoHash h
+        cdef shared_ptr[cpp.Value] v
+        cdef cpp.DoneCallback dcb
         if done_cb:
             cb_obj = {'done':done_cb}
             ref.Py_INCREF(cb_obj)
-            self.thisptr.get().put(key._infohash, val._value, cpp.bindDoneCb(done_callback, <void*>cb_obj))
+            h = key._infohash
+            v = val._value
+            dcb = cpp.bindDoneCb(done_callback, <void*>cb_obj)
+            with nogil:
+                self.thisptr.get().put(h, v, dcb)
         else:
             lock = threading.Condition()
             pending = 0
@@ -602,19 +665,104 @@ cdef class DhtRunner(_WithID):
                 while pending > 0:
                     lock.wait()
             return ok
-    def listen(self, InfoHash key, value_cb):
-        t = ListenToken()
+    def listen(self, InfoHash key, value_cb, filter=None, bool batch=False):
+        """Listen for values associated with key.
+
+        value_cb -- called with each value and whether it expired, or with
+                    the list of values received together if batch is set.
+        """
+        cdef ListenToken t = ListenToken()
+        cdef cpp.ValueCallback vcb
+        cdef cpp.ListenToken token
         t._h = key._infohash
-        cb_obj = {'valcb':value_cb}
-        t._cb['cb'] = cb_obj
-        # avoid the callback being destructed if the token is destroyed
+        cb_obj = {'valcb':value_cb, 'filter':filter, 'batch':batch}
+        t._cb = cb_obj
+        # owned by the C++ callback, released when it is destroyed
         ref.Py_INCREF(cb_obj)
-        t._t = self.thisptr.get().listen(t._h, cpp.bindValueCb(value_callback, <void*>cb_obj)).share()
+        vcb = cpp.bindValueBatchCb(value_callback, <void*>cb_obj, release_callback)
+        with nogil:
+            token = self.thisptr.get().listen(t._h, vcb)
+        t._t = token.share()
         return t
     def cancelListen(self, ListenToken token):
-        self.thisptr.get().cancelListen(token._h, token._t)
-        ref.Py_DECREF(<object>token._cb['cb'])
-        # fixme: not thread safe
+        with nogil:
+            self.thisptr.get().cancelListen(token._h, token._t)
+
+    # asyncio API: operations return awaitables resolved in the event loop
+    # of the caller, and listens are async iterators.
+    def pingAsync(self, SockAddr addr):
+        """Return an awaitable of whether the node at addr answered."""
+        loop = asyncio.get_event_loop()
+        fut = loop.create_future()
+        self.ping(addr, done_cb=lambda ok: _resolve(loop, fut, ok))
+        return fut
+    def getAsync(self, InfoHash key, filter=None, Where where=None):
+        """Return an awaitable of the list of values found at key."""
+        loop = asyncio.get_event_loop()
+        fut = loop.create_future()
+        res = []
+        def on_values(vals):
+            res.extend(vals)
+            return True
+        self.get(key, get_cb=on_values, done_cb=lambda ok, nodes: _resolve(loop, fut, res),
+                 filter=filter, where=where, batch=True)
+        return fut
+    def putAsync(self, InfoHash key, Value val):
+        """Return an awaitable of whether the value was put at key."""
+        loop = asyncio.get_event_loop()
+        fut = loop.create_future()
+        self.put(key, val, done_cb=lambda ok, nodes: _resolve(loop, fut, ok))
+        return fut
+    def listenAsync(self, InfoHash key, filter=None):
+        """Return an async iterator of (values, expired) batches received at key."""
+        return AsyncListener(self, key, filter)
+
+def _resolve(loop, fut, result):
+    def set_result():
+        if not fut.done():
+            fut.set_result(result)
+    try:
+        loop.call_soon_threadsafe(set_result)
+    except RuntimeError:
+        # the event loop is closed
+        pass
+
+class AsyncListener(object):
+    """Async iterator of the (values, expired) batches received at a key,
+    until the listener is cancelled. Also an async context manager,
+    cancelling the listener on exit.
+    """
+    def __init__(self, DhtRunner runner, InfoHash key, filter=None):
+        self._loop = asyncio.get_event_loop()
+        self._queue = asyncio.Queue()
+        self._runner = runner
+        self._token = runner.listen(key, self._on_values, filter=filter, batch=True)
+    def _on_values(self, values, expired):
+        try:
+            self._loop.call_soon_threadsafe(self._queue.put_nowait, (values, expired))
+        except RuntimeError:
+            # the event loop is closed
+            return False
+        return True
+    def cancel(self):
+        if self._token is not None:
+            self._runner.cancelListen(self._token)
+            self._token = None
+            # wake up a pending __anext__
+            self._queue.put_nowait(None)
+    def __aiter__(self):
+        return self
+    async def __anext__(self):
+        while True:
+            if self._token is None and self._queue.empty():
+                raise StopAsyncIteration
+            item = await self._queue.get()
+            if item is not None:
+                return item
+    async def __aenter__(self):
+        return self
+    async def __aexit__(self, *exc):
+        self.cancel()
 
 cdef class IndexValue(object):
     cdef cpp.shared_ptr[cpp.IndexValue] _value
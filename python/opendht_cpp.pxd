@@ -182,12 +182,15 @@ cdef extern from "opendht/node.h" namespace "dht":
         string getAddrStr() const
         bool isExpired() const
 
-cdef extern from "opendht/callbacks.h" namespace "dht":
+cdef extern from "opendht/callbacks.h" namespace "dht" nogil:
     ctypedef void (*ShutdownCallbackRaw)(void *user_data)
     ctypedef bool (*GetCallbackRaw)(shared_ptr[Value] values, void *user_data)
     ctypedef bool (*ValueCallbackRaw)(shared_ptr[Value] values, bool expired, void *user_data)
+    ctypedef bool (*GetBatchCallbackRaw)(vector[shared_ptr[Value]]* values, void *user_data)
+    ctypedef bool (*ValueBatchCallbackRaw)(vector[shared_ptr[Value]]* values, bool expired, void *user_data)
     ctypedef void (*DoneCallbackRaw)(bool done, vector[shared_ptr[Node]]* nodes, void *user_data)
     ctypedef void (*DoneCallbackSimpleRaw)(bool done, void *user_data)
+    ctypedef void (*ReleaseCallbackRaw)(void *user_data)
 
     cppclass ShutdownCallback:
         ShutdownCallback() except +
@@ -203,6 +206,9 @@ cdef extern from "opendht/callbacks.h" namespace "dht":
     cdef ShutdownCallback bindShutdownCb(ShutdownCallbackRaw cb, void *user_data)
     cdef GetCallback bindGetCb(GetCallbackRaw cb, void *user_data)
     cdef ValueCallback bindValueCb(ValueCallbackRaw cb, void *user_data)
+    cdef GetCallback bindGetBatchCb(GetBatchCallbackRaw cb, void *user_data)
+    cdef ValueCallback bindValueBatchCb(ValueBatchCallbackRaw cb, void *user_data)
+    cdef ValueCallback bindValueBatchCb(ValueBatchCallbackRaw cb, void *user_data, ReleaseCallbackRaw release)
     cdef DoneCallback bindDoneCb(DoneCallbackRaw cb, void *user_data)
     cdef DoneCallbackSimple bindDoneCbSimple(DoneCallbackSimpleRaw cb, void *user_data)
 
@@ -218,7 +224,7 @@ cdef extern from "opendht/callbacks.h" namespace "dht":
         Config node_config
         Identity id
 
-cdef extern from "opendht/dhtrunner.h" namespace "dht":
+cdef extern from "opendht/dhtrunner.h" namespace "dht" nogil:
     ctypedef future[size_t] ListenToken
     ctypedef shared_future[size_t] SharedListenToken
     cdef cppclass DhtRunner:
@@ -230,8 +236,8 @@ cdef extern from "opendht/dhtrunner.h" namespace "dht":
         InfoHash getNodeId() const
         void bootstrap(const_char*, const_char*)
         void bootstrap(const SockAddr&, DoneCallbackSimple done_cb)
-        void run(in_port_t, Config config)
-        void run(const_char*, const_char*, const_char*, Config config)
+        void run(in_port_t, Config config) except +
+        void run(const_char*, const_char*, const_char*, Config config) except +
         void join()
         void shutdown(ShutdownCallback)
         bool isRunning()
@@ -1,3 +1,4 @@
+import asyncio
 import unittest
 import opendht as dht
 
@@ -18,6 +19,24 @@ class OpenDhtTester(unittest.TestCase):
         b.run()
         self.assertTrue(b.ping(a.getBound()))
 
+    # test the asyncio API: put, get and listen between two nodes
+    def test_async(self):
+        a = dht.DhtRunner()
+        a.run()
+        b = dht.DhtRunner()
+        b.run()
+        key = dht.InfoHash.getRandom()
+        async def run():
+            self.assertTrue(await b.pingAsync(a.getBound()))
+            async with b.listenAsync(key) as listener:
+                self.assertTrue(await a.putAsync(key, dht.Value(b'async')))
+                values, expired = await asyncio.wait_for(listener.__anext__(), 10)
+                self.assertFalse(expired)
+                self.assertEqual(values[0].data, b'async')
+            values = await b.getAsync(key)
+            self.assertEqual([v.data for v in values], [b'async'])
+        asyncio.get_event_loop().run_until_complete(run())
+
     def test_crypto(self):
         i = dht.Identity.generate("id")
         message = dht.InfoHash.getRandom().toString()
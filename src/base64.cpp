@@ -131,6 +131,16 @@ base64_encode(const std::vector<unsigned char>& str)
     return base64_encode(str.cbegin(), str.cend());
 }
 
+void
+base64_decode(const char* str, size_t length, std::vector<unsigned char>& out)
+{
+    size_t output_length = length / 4 * 3 + 2;
+    out.resize(output_length);
+    if (not base64_decode(str, length, out.data(), &output_length))
+        output_length = 0;
+    out.resize(output_length);
+}
+
 std::vector<unsigned char>
 base64_decode(const std::string& str)
 {
@@ -34,3 +34,10 @@ std::string base64_encode(const std::vector<unsigned char>& str);
  * @return a base64-decoded buffer
  */
 std::vector<unsigned char> base64_decode(const std::string& str);
+/**
+ * Decode a buffer in base64 into out, replacing its content.
+ *
+ * @param str the input buffer
+ * @param length the input buffer size
+ */
+void base64_decode(const char* str, size_t length, std::vector<unsigned char>& out);
@@ -58,6 +58,35 @@ bindValueCb(const ValueCallbackRaw& raw_cb, void* user_data)
     };
 }
 
+GetCallback
+bindGetBatchCb(const GetBatchCallbackRaw& raw_cb, void* user_data)
+{
+    if (not raw_cb) return {};
+    return [=](const std::vector<std::shared_ptr<Value>>& values) {
+        return raw_cb((std::vector<std::shared_ptr<Value>>*)&values, user_data);
+    };
+}
+
+ValueCallback
+bindValueBatchCb(const ValueBatchCallbackRaw& raw_cb, void* user_data)
+{
+    if (not raw_cb) return {};
+    return [=](const std::vector<std::shared_ptr<Value>>& values, bool expired) {
+        return raw_cb((std::vector<std::shared_ptr<Value>>*)&values, expired, user_data);
+    };
+}
+
+ValueCallback
+bindValueBatchCb(const ValueBatchCallbackRaw& raw_cb, void* user_data, ReleaseCallbackRaw release)
+{
+    // released with the last copy of the callback
+    std::shared_ptr<void> data(user_data, release);
+    if (not raw_cb) return {};
+    return [=](const std::vector<std::shared_ptr<Value>>& values, bool expired) {
+        return raw_cb((std::vector<std::shared_ptr<Value>>*)&values, expired, data.get());
+    };
+}
+
 ShutdownCallback
 bindShutdownCb(const ShutdownCallbackRaw& shutdown_cb_raw, void* user_data)
 {
@@ -95,6 +124,8 @@ NodeStats::toString() const
     std::stringstream ss;
     ss << "Known nodes: " << good_nodes << " good, " << dubious_nodes << " dubious, " << incoming_nodes << " incoming." << std::endl;
     ss << searches << " searches, " << node_cache_size << " total cached nodes" << std::endl;
+    if (get_cache_hits or get_cache_misses)
+        ss << "Get cache: " << get_cache_hits << " hits, " << get_cache_misses << " misses" << std::endl;
     if (table_depth > 1) {
         ss << "Routing table depth: " << table_depth << std::endl;
         ss << "Network size estimation: " << getNetworkSizeEstimation() << " nodes" << std::endl;
@@ -102,7 +133,40 @@ NodeStats::toString() const
     return ss.str();
 }
 
+std::string
+MemoryStats::toString() const
+{
+    std::stringstream ss;
+    auto kib = [](size_t s) { return (s + 1023) / 1024; };
+    ss << "Memory: " << kib(getTotal()) << " KiB total" << std::endl;
+    ss << "  storage " << kib(storage) << " KiB, listeners " << kib(listeners) << " KiB" << std::endl;
+    ss << "  routing table " << kib(routing_table) << " KiB, node cache " << kib(node_cache) << " KiB" << std::endl;
+    ss << "  searches " << kib(searches) << " KiB, value caches " << kib(value_caches) << " KiB" << std::endl;
+    ss << "  partial messages " << kib(partial_messages) << " KiB, certificates " << kib(certificates) << " KiB" << std::endl;
+    if (proxy)
+        ss << "  proxy " << kib(proxy) << " KiB" << std::endl;
+    return ss.str();
+}
+
 #ifdef OPENDHT_JSONCPP
+Json::Value
+MemoryStats::toJson() const
+{
+    Json::Value val;
+    val["total"] = Json::Value::UInt64(getTotal());
+    val["storage"] = Json::Value::UInt64(storage);
+    val["routing_table"] = Json::Value::UInt64(routing_table);
+    val["node_cache"] = Json::Value::UInt64(node_cache);
+    val["searches"] = Json::Value::UInt64(searches);
+    val["value_caches"] = Json::Value::UInt64(value_caches);
+    val["listeners"] = Json::Value::UInt64(listeners);
+    val["partial_messages"] = Json::Value::UInt64(partial_messages);
+    val["certificates"] = Json::Value::UInt64(certificates);
+    if (proxy)
+        val["proxy"] = Json::Value::UInt64(proxy);
+    return val;
+}
+
 /**
  * Build a json object from a NodeStats
  */
@@ -117,6 +181,10 @@ NodeStats::toJson() const
         val["table_depth"] = static_cast<Json::LargestUInt>(table_depth);
         val["network_size_estimation"] = static_cast<Json::LargestUInt>(getNetworkSizeEstimation());
     }
+    if (get_cache_hits or get_cache_misses) {
+        val["get_cache_hits"] = static_cast<Json::LargestUInt>(get_cache_hits);
+        val["get_cache_misses"] = static_cast<Json::LargestUInt>(get_cache_misses);
+    }
     return val;
 }
 
@@ -130,6 +198,10 @@ NodeStats::NodeStats(const Json::Value& val)
         incoming_nodes = static_cast<unsigned>(val["incoming"].asLargestUInt());
     if (val.isMember("table_depth"))
         table_depth = static_cast<unsigned>(val["table_depth"].asLargestUInt());
+    if (val.isMember("get_cache_hits"))
+        get_cache_hits = static_cast<unsigned>(val["get_cache_hits"].asLargestUInt());
+    if (val.isMember("get_cache_misses"))
+        get_cache_misses = static_cast<unsigned>(val["get_cache_misses"].asLargestUInt());
 }
 
 /**
@@ -145,6 +217,16 @@ NodeInfo::toJson() const
     val["ipv4"] = ipv4.toJson();
     val["ipv6"] = ipv6.toJson();
     val["ops"] = Json::Value::LargestUInt(ongoing_ops);
+    if (not latency.empty()) {
+        auto& l = val["latency"];
+        for (const auto& s : latency)
+            l[s.first] = s.second.toJson();
+    }
+    if (not rx_dropped.empty()) {
+        auto& d = val["rx_dropped"];
+        for (const auto& c : rx_dropped)
+            d[c.first] = Json::Value::UInt64(c.second);
+    }
     return val;
 }
 
@@ -156,6 +238,16 @@ NodeInfo::NodeInfo(const Json::Value& v)
     ipv4 = NodeStats(v["ipv4"]);
     ipv6 = NodeStats(v["ipv6"]);
     ongoing_ops = v["ops"].asLargestUInt();
+    if (v.isMember("latency")) {
+        const auto& l = v["latency"];
+        for (const auto& name : l.getMemberNames())
+            latency.emplace(name, LatencyStats(l[name]));
+    }
+    if (v.isMember("rx_dropped")) {
+        const auto& d = v["rx_dropped"];
+        for (const auto& name : d.getMemberNames())
+            rx_dropped.emplace(name, d[name].asUInt64());
+    }
 }
 
 #endif
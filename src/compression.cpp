@@ -0,0 +1,87 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "compression.h"
+
+#include <msgpack.hpp>
+#ifdef OPENDHT_ZSTD
+#include <zstd.h>
+#endif
+
+#include <stdexcept>
+
+namespace dht {
+namespace net {
+
+#ifdef OPENDHT_ZSTD
+/* Favor speed: values are compressed once per packet sent */
+static constexpr int ZSTD_LEVEL {3};
+#endif
+
+bool
+compressionSupported()
+{
+#ifdef OPENDHT_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+Blob
+compressValue(const Blob& packed)
+{
+#ifdef OPENDHT_ZSTD
+    if (packed.size() < COMPRESSION_MIN_SIZE)
+        return {};
+    Blob compressed(ZSTD_compressBound(packed.size()));
+    auto len = ZSTD_compress(compressed.data(), compressed.size(), packed.data(), packed.size(), ZSTD_LEVEL);
+    if (ZSTD_isError(len))
+        return {};
+    msgpack::sbuffer buffer(len + 8);
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_bin(len);
+    pk.pack_bin_body((const char*)compressed.data(), len);
+    if (buffer.size() >= packed.size())
+        return {};
+    return {buffer.data(), buffer.data() + buffer.size()};
+#else
+    (void)packed;
+    return {};
+#endif
+}
+
+Blob
+decompressValue(const uint8_t* data, size_t size, size_t max_size)
+{
+#ifdef OPENDHT_ZSTD
+    auto len = ZSTD_getFrameContentSize(data, size);
+    if (len == ZSTD_CONTENTSIZE_ERROR or len == ZSTD_CONTENTSIZE_UNKNOWN or len > max_size)
+        throw std::runtime_error("Invalid compressed value");
+    Blob ret(len);
+    auto res = ZSTD_decompress(ret.data(), ret.size(), data, size);
+    if (ZSTD_isError(res) or res != len)
+        throw std::runtime_error("Can't decompress value");
+    return ret;
+#else
+    (void)data; (void)size; (void)max_size;
+    throw std::runtime_error("Compressed values are not supported");
+#endif
+}
+
+}
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "utils.h"
+
+namespace dht {
+namespace net {
+
+/* Packed values smaller than this are always sent uncompressed */
+static constexpr size_t COMPRESSION_MIN_SIZE {256};
+
+/**
+ * @return true if the library was built with value compression support.
+ */
+bool compressionSupported();
+
+/**
+ * Compress a packed value.
+ *
+ * @param packed the msgpack-encoded value
+ * @return the compressed value wrapped in a msgpack bin object,
+ *         or an empty blob if compression is unavailable or doesn't reduce the size.
+ */
+Blob compressValue(const Blob& packed);
+
+/**
+ * Decompress the content of a msgpack bin object produced by compressValue.
+ *
+ * @param max_size the maximum accepted size of the decompressed value
+ * @return the msgpack-encoded value
+ * @throw std::runtime_error if data is invalid or larger than max_size
+ */
+Blob decompressValue(const uint8_t* data, size_t size, size_t max_size);
+
+}
+}
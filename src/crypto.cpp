@@ -342,6 +342,52 @@ PrivateKey::decrypt(const Blob& cipher) const
     return aesDecrypt(Blob {cipher.begin() + cypher_block_sz, cipher.end()}, decryptBloc(cipher.data(), cypher_block_sz));
 }
 
+size_t
+PrivateKey::getCypherBlockSize() const
+{
+    if (!key)
+        throw CryptoException("Can't decrypt data without private key !");
+    unsigned key_len = 0;
+    int err = gnutls_privkey_get_pk_algorithm(key, &key_len);
+    if (err < 0)
+        throw CryptoException("Can't read public key length !");
+    if (err != GNUTLS_PK_RSA)
+        throw CryptoException("Must be an RSA key");
+    return key_len / 8;
+}
+
+SessionKey
+PrivateKey::decryptSessionKey(const Blob& cipher) const
+{
+    auto cypher_block_sz = getCypherBlockSize();
+    if (cipher.size() <= cypher_block_sz)
+        throw DecryptError("Unexpected cipher length");
+    SessionKey session;
+    session.key = decryptBloc(cipher.data(), cypher_block_sz);
+    session.encapsulated.assign(cipher.begin(), cipher.begin() + cypher_block_sz);
+    return session;
+}
+
+Blob
+SessionKey::encrypt(const uint8_t* data, size_t data_len) const
+{
+    auto data_encrypted = aesEncrypt(data, data_len, key);
+    Blob ret;
+    ret.reserve(encapsulated.size() + data_encrypted.size());
+    ret.insert(ret.end(), encapsulated.begin(), encapsulated.end());
+    ret.insert(ret.end(), data_encrypted.begin(), data_encrypted.end());
+    return ret;
+}
+
+Blob
+SessionKey::decrypt(const Blob& cipher) const
+{
+    if (cipher.size() <= encapsulated.size()
+        or not std::equal(encapsulated.begin(), encapsulated.end(), cipher.begin()))
+        throw DecryptError("Cipher doesn't match the session key");
+    return aesDecrypt(Blob {cipher.begin() + encapsulated.size(), cipher.end()}, key);
+}
+
 Blob
 PrivateKey::serialize(const std::string& password) const
 {
@@ -469,9 +515,16 @@ bool PublicKey::checkSignature(const uint8_t* data, size_t data_len, const uint8
 {
     if (!pk)
         return false;
+    // PrivateKey::sign uses SHA512 with the scheme of the key algorithm
+    int algo = gnutls_pubkey_get_pk_algorithm(pk, nullptr);
+    if (algo < 0)
+        return false;
+    auto sign_algo = gnutls_pk_to_sign((gnutls_pk_algorithm_t)algo, GNUTLS_DIG_SHA512);
+    if (sign_algo == GNUTLS_SIGN_UNKNOWN)
+        return false;
     const gnutls_datum_t sig {(uint8_t*)signature, (unsigned)signature_len};
     const gnutls_datum_t dat {(uint8_t*)data, (unsigned)data_len};
-    int rc = gnutls_pubkey_verify_data2(pk, GNUTLS_SIGN_RSA_SHA512, 0, &dat, &sig);
+    int rc = gnutls_pubkey_verify_data2(pk, sign_algo, 0, &dat, &sig);
     return rc >= 0;
 }
 
@@ -515,23 +568,38 @@ PublicKey::encrypt(const uint8_t* data, size_t data_len) const
     /* Otherwise use RSA+AES-GCM,
        using the max. AES key size that can fit
        in a single RSA packet () */
+    return generateSessionKey().encrypt(data, data_len);
+}
+
+SessionKey
+PublicKey::generateSessionKey() const
+{
+    if (!pk)
+        throw CryptoException("Can't read public key !");
+
+    unsigned key_len = 0;
+    int err = gnutls_pubkey_get_pk_algorithm(pk, &key_len);
+    if (err < 0)
+        throw CryptoException("Can't read public key length !");
+    if (err != GNUTLS_PK_RSA)
+        throw CryptoException("Must be an RSA key");
+
+    const unsigned max_block_sz = key_len / 8 - 11;
+    const unsigned cypher_block_sz = key_len / 8;
+    // the max. AES key size that can fit in a single RSA packet
     unsigned aes_key_sz = aesKeySize(max_block_sz);
     if (aes_key_sz == 0)
         throw CryptoException("Key is not long enough for AES128");
-    Blob key(aes_key_sz);
+
+    SessionKey session;
+    session.key.resize(aes_key_sz);
     {
         crypto::random_device rdev;
-        std::generate_n(key.begin(), key.size(), std::bind(rand_byte, std::ref(rdev)));
+        std::generate_n(session.key.begin(), session.key.size(), std::bind(rand_byte, std::ref(rdev)));
     }
-    auto data_encrypted = aesEncrypt(data, data_len, key);
-
-    Blob ret;
-    ret.reserve(cypher_block_sz + data_encrypted.size());
-
-    ret.resize(cypher_block_sz);
-    encryptBloc(key.data(), key.size(), ret.data(), cypher_block_sz);
-    ret.insert(ret.end(), data_encrypted.begin(), data_encrypted.end());
-    return ret;
+    session.encapsulated.resize(cypher_block_sz);
+    encryptBloc(session.key.data(), session.key.size(), session.encapsulated.data(), cypher_block_sz);
+    return session;
 }
 
 InfoHash
@@ -1090,6 +1158,24 @@ PrivateKey::generateEC()
     return PrivateKey{key};
 }
 
+PrivateKey
+PrivateKey::generateEd25519()
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    gnutls_x509_privkey_t key;
+    if (gnutls_x509_privkey_init(&key) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Can't initialize private key.");
+    int err = gnutls_x509_privkey_generate(key, GNUTLS_PK_EDDSA_ED25519, GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_ED25519), 0);
+    if (err != GNUTLS_E_SUCCESS) {
+        gnutls_x509_privkey_deinit(key);
+        throw CryptoException(std::string("Can't generate Ed25519 key pair: ") + gnutls_strerror(err));
+    }
+    return PrivateKey{key};
+#else
+    throw CryptoException("Ed25519 keys require GnuTLS 3.6 or later");
+#endif
+}
+
 Identity
 generateIdentity(const std::string& name, const Identity& ca, unsigned key_length, bool is_ca)
 {
@@ -1117,6 +1203,19 @@ generateEcIdentity(const std::string& name, const Identity& ca) {
     return generateEcIdentity(name, ca, !ca.first || !ca.second);
 }
 
+Identity
+generateEd25519Identity(const std::string& name, const Identity& ca, bool is_ca)
+{
+    auto key = std::make_shared<PrivateKey>(PrivateKey::generateEd25519());
+    auto cert = std::make_shared<Certificate>(Certificate::generate(*key, name, ca, is_ca));
+    return {std::move(key), std::move(cert)};
+}
+
+Identity
+generateEd25519Identity(const std::string& name, const Identity& ca) {
+    return generateEd25519Identity(name, ca, !ca.first || !ca.second);
+}
+
 void
 saveIdentity(const Identity& id, const std::string& path, const std::string& privkey_password)
 {
@@ -1603,9 +1702,32 @@ TrustList::operator=(TrustList&& o) noexcept
         gnutls_x509_trust_list_deinit(trust, true);
     trust = o.trust;
     o.trust = nullptr;
+    std::lock_guard<std::mutex> lk(cacheLock_);
+    validTtl_ = o.validTtl_;
+    invalidTtl_ = o.invalidTtl_;
+    cache_ = std::move(o.cache_);
+    generation_++;
     return *this;
 }
 
+void
+TrustList::setCacheTtl(duration valid, duration invalid)
+{
+    std::lock_guard<std::mutex> lk(cacheLock_);
+    validTtl_ = valid;
+    invalidTtl_ = invalid;
+    cache_.clear();
+    generation_++;
+}
+
+void
+TrustList::clearCache()
+{
+    std::lock_guard<std::mutex> lk(cacheLock_);
+    cache_.clear();
+    generation_++;
+}
+
 void TrustList::add(const Certificate& crt)
 {
     auto chain = crt.getChainWithRevocations(true);
@@ -1615,12 +1737,14 @@ void TrustList::add(const Certificate& crt)
                 trust,
                 chain.second.data(), chain.second.size(),
                 GNUTLS_TL_VERIFY_CRL | GNUTLS_TL_NO_DUPLICATES, 0);
+    clearCache();
 }
 
 void TrustList::add(const RevocationList& crl)
 {
     auto copy = crl.getCopy();
     gnutls_x509_trust_list_add_crls(trust, &copy, 1, GNUTLS_TL_VERIFY_CRL | GNUTLS_TL_NO_DUPLICATES, 0);
+    clearCache();
 }
 
 void TrustList::remove(const Certificate& crt, bool parents)
@@ -1630,12 +1754,48 @@ void TrustList::remove(const Certificate& crt, bool parents)
         for (auto c = crt.issuer; c; c = c->issuer)
             gnutls_x509_trust_list_remove_cas(trust, &c->cert, 1);
     }
+    clearCache();
 }
 
 TrustList::VerifyResult
 TrustList::verify(const Certificate& crt) const
 {
     auto chain = crt.getChain();
+
+    duration validTtl, invalidTtl;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lk(cacheLock_);
+        validTtl = validTtl_;
+        invalidTtl = invalidTtl_;
+        generation = generation_;
+    }
+
+    // the chain is identified by the SHA-256 fingerprints of its certificates
+    Blob chainId;
+    bool cache = validTtl > duration::zero() or invalidTtl > duration::zero();
+    if (cache) {
+        for (const auto& c : chain) {
+            std::array<uint8_t, 64> fpr;
+            size_t sz = fpr.size();
+            if (gnutls_x509_crt_get_fingerprint(c, GNUTLS_DIG_SHA256, fpr.data(), &sz) != GNUTLS_E_SUCCESS) {
+                cache = false;
+                break;
+            }
+            chainId.insert(chainId.end(), fpr.begin(), fpr.begin() + sz);
+        }
+    }
+    const auto now = clock::now();
+    if (cache) {
+        std::lock_guard<std::mutex> lk(cacheLock_);
+        auto it = cache_.find(chainId);
+        if (it != cache_.end()) {
+            if (it->second.expiration > now)
+                return it->second.result;
+            cache_.erase(it);
+        }
+    }
+
     VerifyResult ret;
     ret.ret = gnutls_x509_trust_list_verify_crt2(
         trust,
@@ -1643,6 +1803,28 @@ TrustList::verify(const Certificate& crt) const
         nullptr, 0,
         GNUTLS_PROFILE_TO_VFLAGS(GNUTLS_PROFILE_MEDIUM),
         &ret.result, nullptr);
+
+    if (cache) {
+        auto expiration = now + (ret.isValid() ? validTtl : invalidTtl);
+        if (ret.isValid()) {
+            // the result changes when a certificate of the chain expires
+            for (auto c = &crt; c; c = c->issuer.get()) {
+                auto exp = c->getExpiration() - std::chrono::system_clock::now();
+                expiration = std::min(expiration, now + std::chrono::duration_cast<duration>(exp));
+            }
+        }
+        std::lock_guard<std::mutex> lk(cacheLock_);
+        // the list may have changed during the verification
+        if (expiration > now and generation == generation_) {
+            if (cache_.size() >= MAX_CACHED_RESULTS) {
+                for (auto it = cache_.begin(); it != cache_.end();)
+                    it = it->second.expiration <= now ? cache_.erase(it) : std::next(it);
+                if (cache_.size() >= MAX_CACHED_RESULTS)
+                    cache_.clear();
+            }
+            cache_[chainId] = {ret, expiration};
+        }
+    }
     return ret;
 }
 
@@ -21,7 +21,9 @@
 #include "rng.h"
 #include "search.h"
 #include "storage.h"
+#include "storage_backend.h"
 #include "request.h"
+#include "tracepoints.h"
 
 #include <msgpack.hpp>
 
@@ -29,6 +31,7 @@
 #include <random>
 #include <sstream>
 #include <fstream>
+#include <limits>
 
 namespace dht {
 
@@ -39,7 +42,21 @@ constexpr std::chrono::minutes Dht::SEARCH_EXPIRE_TIME;
 constexpr duration Dht::LISTEN_EXPIRE_TIME;
 constexpr duration Dht::LISTEN_EXPIRE_TIME_PUBLIC;
 constexpr duration Dht::REANNOUNCE_MARGIN;
+constexpr duration Dht::MAINTENANCE_PERIOD;
+constexpr size_t Dht::MAINTENANCE_BANDWIDTH;
+constexpr size_t Dht::MAX_MAINTENANCE_QUEUE;
+constexpr unsigned Dht::SEARCH_RTT_WINDOW;
+constexpr unsigned Dht::STEP_GETS;
+constexpr unsigned Dht::STEP_ANNOUNCES;
+constexpr unsigned Dht::STEP_LISTENERS;
+constexpr unsigned Dht::STEP_ALL;
+constexpr duration Dht::EXPIRE_STORE_DELAY;
+constexpr duration Dht::LISTENER_UPDATES_DELAY;
 static constexpr size_t MAX_REQUESTS_PER_SEC {8 * 1024};
+/* Known good nodes pinged to evaluate a connectivity change */
+static constexpr unsigned CONNECTIVITY_PROBE_NODES {8};
+/* Time given to these nodes to answer */
+static constexpr std::chrono::seconds CONNECTIVITY_PROBE_TIMEOUT {5};
 
 NodeStatus
 Dht::updateStatus(sa_family_t af)
@@ -130,10 +147,59 @@ Dht::findNode(const InfoHash& id, sa_family_t af) const
 void
 Dht::sendCachedPing(Bucket& b)
 {
-    if (b.cached)
+    if (not b.cached)
+        return;
+    // the bucket keeps its candidate until the ping is actually sent
+    queueMaintenance([this, node = b.cached]() -> Sp<net::Request> {
+        if (node->isPendingMessage())
+            return {};
         if (logger_)
-            logger_->d(b.cached->id, "[node %s] sending ping to cached node", b.cached->toString().c_str());
-    b.sendCachedPing(network_engine);
+            logger_->d(node->id, "[node %s] sending ping to cached node", node->toString().c_str());
+        auto req = network_engine.sendPing(node, nullptr, nullptr);
+        auto b = findBucket(node->id, node->getFamily());
+        if (req and b and b->cached == node)
+            b->cached = {};
+        return req;
+    });
+}
+
+void
+Dht::queueMaintenance(MaintenanceTask&& task)
+{
+    if (maintenance_queue.size() >= MAX_MAINTENANCE_QUEUE)
+        return;
+    maintenance_queue.emplace_back(std::move(task));
+    if (nextMaintenance and not nextMaintenance->scheduled())
+        scheduler.edit(nextMaintenance, std::max(scheduler.time(), maintenance_time + MAINTENANCE_PERIOD));
+}
+
+/* Sends the queued maintenance messages, up to the bandwidth budget,
+   as one burst flushed with the other packets of this pass. */
+void
+Dht::maintenance()
+{
+    const auto& now = scheduler.time();
+    if (maintenance_bandwidth > 0) {
+        const double rate = maintenance_bandwidth;
+        auto elapsed = std::chrono::duration<double>(now - maintenance_time).count();
+        maintenance_budget = std::min(maintenance_budget + elapsed * rate,
+                                      rate * std::chrono::duration<double>(MAINTENANCE_PERIOD).count());
+    }
+    maintenance_time = now;
+
+    size_t sent = 0;
+    while (not maintenance_queue.empty() and (maintenance_bandwidth < 0 or maintenance_budget > 0)) {
+        auto task = std::move(maintenance_queue.front());
+        maintenance_queue.pop_front();
+        if (auto req = task()) {
+            maintenance_budget -= req->getMessageSize();
+            sent++;
+        }
+    }
+    if (sent and logger_)
+        logger_->d(myid, "[maintenance] sent %zu messages, %zu queued", sent, maintenance_queue.size());
+    if (not maintenance_queue.empty())
+        scheduler.edit(nextMaintenance, now + MAINTENANCE_PERIOD);
 }
 
 std::vector<SockAddr>
@@ -165,7 +231,7 @@ Dht::trySearchInsert(const Sp<Node>& node)
         auto& s = *it->second;
         if (s.insertNode(node, now)) {
             inserted = true;
-            scheduler.edit(s.nextSearchStep, now);
+            s.scheduleStep(scheduler);
         } else if (not s.expired and not s.done)
             break;
     }
@@ -175,7 +241,7 @@ Dht::trySearchInsert(const Sp<Node>& node)
         auto& s = *it->second;
         if (s.insertNode(node, now)) {
             inserted = true;
-            scheduler.edit(s.nextSearchStep, now);
+            s.scheduleStep(scheduler);
         } else if (not s.expired and not s.done)
             break;
     }
@@ -257,6 +323,10 @@ Dht::searchNodeGetDone(const net::Request& req,
 {
     const auto& now = scheduler.time();
     if (auto sr = ws.lock()) {
+        /* a node getting synced may unblock any operation */
+        auto prev = sr->getNode(req.node);
+        if (not prev or not prev->isSynced(now))
+            sr->step_dirty |= STEP_ALL;
         sr->insertNode(req.node, now, answer.ntoken);
         if (auto srn = sr->getNode(req.node)) {
             /* all other get requests which are satisfied by this answer
@@ -273,7 +343,7 @@ Dht::searchNodeGetDone(const net::Request& req,
             if (srn->syncJob)
                 scheduler.edit(srn->syncJob, syncTime);
             else
-                srn->syncJob = scheduler.add(syncTime, std::bind(&Dht::searchStep, this, sr));
+                srn->syncJob = scheduler.add(syncTime, std::bind(&Dht::searchStep, this, sr, STEP_ALL));
         }
         onGetValuesDone(req.node, answer, sr, query);
     }
@@ -291,7 +361,7 @@ Dht::searchNodeGetExpired(const net::Request& status,
             if (over)
                 srn->getStatus.erase(query);
         }
-        scheduler.edit(sr->nextSearchStep, scheduler.time());
+        sr->scheduleStep(scheduler);
     }
 }
 
@@ -373,12 +443,7 @@ Dht::searchSendGetValues(Sp<Search> sr, SearchNode* pn, bool update)
         if (pn and pn->canGet(now, up, query)) {
             n = pn;
         } else {
-            for (auto& sn : sr->nodes) {
-                if (sn->canGet(now, up, query)) {
-                    n = sn.get();
-                    break;
-                }
-            }
+            n = sr->selectNode(now, up, query, search_rtt_window);
         }
 
         if (sr->callbacks.empty()) { /* 'find_node' request */
@@ -432,7 +497,7 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
     { /* when put done */
         if (auto sr = ws.lock()) {
             onAnnounceDone(req.node, answer, sr);
-            searchStep(sr);
+            searchStep(sr, STEP_ANNOUNCES);
         }
     };
 
@@ -440,7 +505,7 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
     { /* when put expired */
         if (over)
             if (auto sr = ws.lock())
-                scheduler.edit(sr->nextSearchStep, scheduler.time());
+                sr->scheduleStep(scheduler);
     };
 
     auto onSelectDone =
@@ -455,9 +520,12 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
 
         if (not sn->isSynced(now)) {
             /* Search is now unsynced. Let's call searchStep to sync again. */
-            scheduler.edit(sr->nextSearchStep, now);
+            sr->scheduleStep(scheduler);
             return;
         }
+        /* values to put, by creation time, and to refresh */
+        std::map<time_point, AnnounceList> puts;
+        AnnounceList refreshes;
         for (auto& a : sr->announce) {
             if (sn->getAnnounceTime(a.value->id) > now)
                 continue;
@@ -481,40 +549,12 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
                     logger_->d(sr->id, sn->node->id, "[search %s] [node %s] sending 'put' (vid: %d)",
                         sr->id.toString().c_str(), sn->node->toString().c_str(), a.value->id);
                 auto created = a.permanent ? time_point::max() : a.created;
-                sn->acked[a.value->id] = {
-                    network_engine.sendAnnounceValue(sn->node, sr->id, a.value, created, sn->token, onDone, onExpired),
-                    next_refresh_time
-                };
+                puts[created].emplace_back(a.value, next_refresh_time);
             } else if (hasValue and a.permanent) {
                 if (logger_)
-                    logger_->w(sr->id, sn->node->id, "[search %s] [node %s] sending 'refresh' (vid: %d)",
+                    logger_->d(sr->id, sn->node->id, "[search %s] [node %s] sending 'refresh' (vid: %d)",
                         sr->id.toString().c_str(), sn->node->toString().c_str(), a.value->id);
-                sn->acked[a.value->id] = {
-                    network_engine.sendRefreshValue(sn->node, sr->id, a.value->id, sn->token, onDone,
-                    [this, ws, node=sn->node, v=a.value, 
-                     onDone, 
-                     onExpired, 
-                     created = a.permanent ? time_point::max() : a.created,
-                     next_refresh_time
-                    ](const net::Request& /*req*/, net::DhtProtocolException&& e){
-                        if (e.getCode() == net::DhtProtocolException::NOT_FOUND) {
-                            if (logger_)
-                                logger_->e(node->id, "[node %s] returned error 404: storage not found", node->toString().c_str());
-                            if (auto sr = ws.lock()) {
-                                if (auto sn = sr->getNode(node)) {
-                                    sn->acked[v->id] = {
-                                        network_engine.sendAnnounceValue(sn->node, sr->id, v, created, sn->token, onDone, onExpired),
-                                        next_refresh_time
-                                    };
-                                    scheduler.edit(sr->nextSearchStep, scheduler.time());
-                                    return true;
-                                }
-                            }
-                        }
-                        return false;
-                    }, onExpired),
-                    next_refresh_time
-                };
+                refreshes.emplace_back(a.value, next_refresh_time);
             } else {
                 if (logger_)
                     logger_->w(sr->id, sn->node->id, "[search %s] [node %s] already has value (vid: %d). Aborting.",
@@ -524,16 +564,16 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
                 sn->acked[a.value->id] = std::make_pair(std::move(ack_req), next_refresh_time);
 
                 /* step to clear announces */
-                scheduler.edit(sr->nextSearchStep, now);
-            }
-            if (a.permanent) {
-                scheduler.add(next_refresh_time - REANNOUNCE_MARGIN, [this,ws] {
-                    if (auto sr = ws.lock()) {
-                        searchStep(sr);
-                    }
-                });
+                sr->scheduleStep(scheduler, STEP_ANNOUNCES);
             }
+            if (a.permanent)
+                scheduleRefresh(sr, next_refresh_time - REANNOUNCE_MARGIN);
         }
+
+        for (const auto& p : puts)
+            searchNodeSendAnnounce(sr, *sn, p.first, p.second, onDone, onExpired);
+        if (not refreshes.empty())
+            searchNodeSendRefresh(sr, *sn, refreshes, onDone, onExpired);
     };
 
     static const auto PROBE_QUERY = std::make_shared<Query>(Select {}.field(Value::Field::Id).field(Value::Field::SeqNum));
@@ -550,6 +590,8 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
         }
 
         bool sendQuery = false;
+        /* non-permanent values to put, by creation time */
+        std::map<time_point, AnnounceList> puts;
         for (auto& a : sr->announce) {
             if (n.getAnnounceTime(a.value->id) <= now) {
                 if (a.permanent) {
@@ -558,13 +600,12 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
                     if (logger_)
                         logger_->w(sr->id, n.node->id, "[search %s] [node %s] sending 'put' (vid: %d)",
                             sr->id.toString().c_str(), n.node->toString().c_str(), a.value->id);
-                    n.acked[a.value->id] = {
-                        network_engine.sendAnnounceValue(n.node, sr->id, a.value, a.created, n.token, onDone, onExpired),
-                        now + getType(a.value->type).expiration
-                    };
+                    puts[a.created].emplace_back(a.value, now + getType(a.value->type).expiration);
                 }
             }
         }
+        for (const auto& p : puts)
+            searchNodeSendAnnounce(sr, n, p.first, p.second, onDone, onExpired);
 
         if (sendQuery) {
             n.probe_query = PROBE_QUERY;
@@ -584,6 +625,86 @@ void Dht::searchSendAnnounceValue(const Sp<Search>& sr) {
     }
 }
 
+void
+Dht::searchNodeSendAnnounce(const Sp<Search>& sr, SearchNode& sn, time_point created, const AnnounceList& values,
+        const net::NetworkEngine::RequestCb& onDone, const net::NetworkEngine::RequestExpiredCb& onExpired)
+{
+    /* batch values, if the node supports it */
+    const size_t max_values = net::NetworkEngine::canAnnounceValues(sn.node->getVersion())
+        ? net::NetworkEngine::MAX_ANNOUNCE_VALUES : 1;
+    std::vector<Sp<Value>> batch;
+    auto it = values.begin();
+    while (it != values.end()) {
+        size_t batch_size = 0;
+        auto end = it;
+        do {
+            batch.emplace_back(end->first);
+            batch_size += end->first->size();
+            ++end;
+        } while (end != values.end() and batch.size() < max_values
+             and batch_size + end->first->size() <= net::NetworkEngine::MAX_ANNOUNCE_SIZE);
+        auto req = network_engine.sendAnnounceValues(sn.node, sr->id, batch, created, sn.token,
+            net::NetworkEngine::RequestCb(onDone), net::NetworkEngine::RequestExpiredCb(onExpired));
+        for (; it != end; ++it)
+            sn.acked[it->first->id] = {req, it->second};
+        batch.clear();
+    }
+}
+
+void
+Dht::searchNodeSendRefresh(const Sp<Search>& sr, SearchNode& sn, const AnnounceList& values,
+        const net::NetworkEngine::RequestCb& onDone, const net::NetworkEngine::RequestExpiredCb& onExpired)
+{
+    std::weak_ptr<Search> ws = sr;
+    /* batch value ids, if the node supports it */
+    const size_t max_values = net::NetworkEngine::canRefreshValues(sn.node->getVersion())
+        ? net::NetworkEngine::MAX_REFRESH_VALUES : 1;
+    for (auto it = values.begin(); it != values.end();) {
+        auto end = it + std::min<size_t>(max_values, values.end() - it);
+        AnnounceList batch(it, end);
+        std::vector<Value::Id> vids;
+        vids.reserve(batch.size());
+        for (const auto& v : batch)
+            vids.emplace_back(v.first->id);
+        auto req = network_engine.sendRefreshValues(sn.node, sr->id, vids, sn.token, net::NetworkEngine::RequestCb(onDone),
+            [this, ws, node=sn.node, batch, onDone, onExpired](const net::Request& /*req*/, net::DhtProtocolException&& e) {
+                if (e.getCode() == net::DhtProtocolException::NOT_FOUND) {
+                    if (logger_)
+                        logger_->e(node->id, "[node %s] returned error 404: storage not found", node->toString().c_str());
+                    if (auto sr = ws.lock()) {
+                        if (auto sn = sr->getNode(node)) {
+                            /* put the values again */
+                            searchNodeSendAnnounce(sr, *sn, time_point::max(), batch, onDone, onExpired);
+                            sr->scheduleStep(scheduler, STEP_ANNOUNCES);
+                            return true;
+                        }
+                    }
+                }
+                return false;
+            }, net::NetworkEngine::RequestExpiredCb(onExpired));
+        for (; it != end; ++it)
+            sn.acked[it->first->id] = {req, it->second};
+    }
+}
+
+void
+Dht::scheduleRefresh(const Sp<Search>& sr, time_point t)
+{
+    if (t >= sr->refresh_time)
+        return;
+    sr->refresh_time = t;
+    if (not sr->nextRefresh) {
+        std::weak_ptr<Search> ws = sr;
+        sr->nextRefresh = scheduler.add(t, [this,ws] {
+            if (auto sr = ws.lock()) {
+                sr->refresh_time = time_point::max();
+                searchStep(sr, STEP_ANNOUNCES);
+            }
+        });
+    } else
+        scheduler.edit(sr->nextRefresh, t);
+}
+
 void
 Dht::searchSynchedNodeListen(const Sp<Search>& sr, SearchNode& n)
 {
@@ -608,13 +729,14 @@ Dht::searchSynchedNodeListen(const Sp<Search>& sr, SearchNode& n)
                     n.node->openSocket([this,ws,query](const Sp<Node>& node, net::RequestAnswer&& answer) mutable {
                         /* on new values */
                         if (auto sr = ws.lock()) {
-                            scheduler.edit(sr->nextSearchStep, scheduler.time());
+                            sr->scheduleStep(scheduler, STEP_LISTENERS);
                             sr->insertNode(node, scheduler.time(), answer.ntoken);
                             if (auto sn = sr->getNode(node)) {
                                 sn->onValues(query, std::move(answer), types, scheduler);
                             }
                         }
-                    }))).first;
+                    }),
+                    &value_cache_size)).first;
             r->second.cacheExpirationJob = scheduler.add(time_point::max(), [this,ws,query,node=n.node]{
                 if (auto sr = ws.lock()) {
                     if (auto sn = sr->getNode(node)) {
@@ -627,9 +749,9 @@ Dht::searchSynchedNodeListen(const Sp<Search>& sr, SearchNode& n)
             [this,ws,query](const net::Request& req, net::RequestAnswer&& answer) mutable
             { /* on done */
                 if (auto sr = ws.lock()) {
-                    scheduler.edit(sr->nextSearchStep, scheduler.time());
+                    sr->scheduleStep(scheduler, STEP_LISTENERS);
                     if (auto sn = sr->getNode(req.node)) {
-                        scheduler.add(sn->getListenTime(query, getListenExpiration()), std::bind(&Dht::searchStep, this, sr));
+                        scheduler.add(sn->getListenTime(query, getListenExpiration()), std::bind(&Dht::searchStep, this, sr, STEP_LISTENERS));
                         sn->onListenSynced(query);
                     }
                     onListenDone(req.node, answer, sr);
@@ -638,7 +760,7 @@ Dht::searchSynchedNodeListen(const Sp<Search>& sr, SearchNode& n)
             [this,ws,query](const net::Request& req, bool over) mutable
             { /* on request expired */
                 if (auto sr = ws.lock()) {
-                    scheduler.edit(sr->nextSearchStep, scheduler.time());
+                    sr->scheduleStep(scheduler);
                     if (over)
                         if (auto sn = sr->getNode(req.node))
                             sn->listenStatus.erase(query);
@@ -656,48 +778,63 @@ Dht::searchSynchedNodeListen(const Sp<Search>& sr, SearchNode& n)
 /* When a search is in progress, we periodically call search_step to send
    further requests. */
 void
-Dht::searchStep(Sp<Search> sr)
+Dht::searchStep(Sp<Search> sr, unsigned what)
 {
     if (not sr or sr->expired or sr->done) return;
 
+    /* without any hint, evaluate everything */
+    what |= sr->step_dirty;
+    sr->step_dirty = 0;
+    if (not what)
+        what = STEP_ALL;
+
     const auto& now = scheduler.time();
     /*if (auto req_count = sr->currentlySolicitedNodeCount())
         if (logger_)
             logger_->d(sr->id, "[search %s IPv%c] step (%d requests)",
                 sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6', req_count);*/
     sr->step_time = now;
+    sr->step_count++;
+    DHT_TRACE(search__step, sr->id.data(), sr->af, what, sr->nodes.size());
 
     if (sr->refill_time + Node::NODE_EXPIRE_TIME < now and sr->nodes.size()-sr->getNumberOfBadNodes() < SEARCH_NODES)
         refill(*sr);
 
     /* Check if the first TARGET_NODES (8) live nodes have replied. */
     if (sr->isSynced(now)) {
-        if (not (sr->callbacks.empty() and sr->announce.empty())) {
+        if ((what & STEP_GETS) and not sr->callbacks.empty()) {
             // search is synced but some (newer) get operations are not complete
             // Call callbacks when done
+            // coalesced gets share their query: collect them all before clearing it
+            sr->step_cost += sr->callbacks.size() * sr->nodes.size();
             std::vector<Get> completed_gets;
             for (auto b = sr->callbacks.begin(); b != sr->callbacks.end();) {
                 if (sr->isDone(b->second)) {
-                    sr->setDone(b->second);
                     completed_gets.emplace_back(std::move(b->second));
                     b = sr->callbacks.erase(b);
                 }
                 else
                     ++b;
             }
+            for (const auto& get : completed_gets) {
+                if (get_cache_ttl > duration::zero() or get_cache_negative_ttl > duration::zero())
+                    sr->cacheResult(get, now);
+                sr->setDone(get);
+            }
             // clear corresponding queries
             for (const auto& get : completed_gets)
                 for (auto& sn : sr->nodes) {
                     sn->getStatus.erase(get.query);
                     sn->pagination_queries.erase(get.query);
                 }
-
+        }
+        if ((what & STEP_ANNOUNCES) and not sr->announce.empty()) {
             /* clearing callbacks for announced values */
+            sr->step_cost += sr->announce.size() * sr->nodes.size();
             sr->checkAnnounced();
-
-            if (sr->callbacks.empty() && sr->announce.empty() && sr->listeners.empty())
-                sr->setDone();
         }
+        if (sr->callbacks.empty() && sr->announce.empty() && sr->listeners.empty())
+            sr->setDone();
 
         // true if this node is part of the target nodes cluter.
         /*bool in = sr->id.xorCmp(myid, sr->nodes.back().node->id) < 0;
@@ -705,11 +842,12 @@ Dht::searchStep(Sp<Search> sr)
         logger__DBG("[search %s IPv%c] synced%s",
                 sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6', in ? ", in" : "");*/
 
-        if (not sr->listeners.empty()) {
+        if ((what & STEP_LISTENERS) and not sr->listeners.empty()) {
             unsigned i = 0;
             for (auto& n : sr->nodes) {
                 if (not n->isSynced(now))
                     continue;
+                sr->step_cost += sr->listeners.size();
                 searchSynchedNodeListen(sr, *n);
                 if (not n->candidate and ++i == LISTEN_NODES)
                     break;
@@ -717,7 +855,10 @@ Dht::searchStep(Sp<Search> sr)
         }
 
         // Announce requests
-        searchSendAnnounceValue(sr);
+        if (what & STEP_ANNOUNCES) {
+            sr->step_cost += sr->announce.size() * std::min<size_t>(sr->nodes.size(), TARGET_NODES);
+            searchSendAnnounceValue(sr);
+        }
 
         if (sr->callbacks.empty() && sr->announce.empty() && sr->listeners.empty())
             sr->setDone();
@@ -779,9 +920,15 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback q
     auto& srs = searches(af);
     const auto& srp = srs.find(id);
     Sp<Search> sr {};
+    const bool cacheable = gcb and not qcb
+        and (get_cache_ttl > duration::zero() or get_cache_negative_ttl > duration::zero());
 
     if (srp != srs.end()) {
         sr = srp->second;
+        if (cacheable and sr->getCachedResult(scheduler.time(), get_cache_ttl, get_cache_negative_ttl, f, q, gcb, dcb)) {
+            dht(af).get_cache_hits++;
+            return sr;
+        }
         sr->done = false;
         sr->expired = false;
     } else {
@@ -810,14 +957,16 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback gcb, QueryCallback q
         sr->expired = false;
         sr->nodes.clear();
         sr->nodes.reserve(SEARCH_NODES+1);
-        sr->nextSearchStep = scheduler.add(time_point::max(), std::bind(&Dht::searchStep, this, sr));
+        sr->nextSearchStep = scheduler.add(time_point::max(), std::bind(&Dht::searchStep, this, sr, 0));
         if (logger_)
             logger_->w(id, "[search %s IPv%c] new search", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
         if (search_id == 0)
             search_id++;
     }
 
-    sr->get(f, q, qcb, gcb, dcb, scheduler);
+    auto local = sr->get(f, q, qcb, gcb, dcb, scheduler);
+    if (cacheable)
+        (local ? dht(af).get_cache_hits : dht(af).get_cache_misses)++;
     refill(*sr);
 
     return sr;
@@ -835,7 +984,8 @@ Dht::announce(const InfoHash& id,
     auto srp = srs.find(id);
     if (auto sr = srp == srs.end() ? search(id, af) : srp->second) {
         sr->put(value, callback, created, permanent);
-        scheduler.edit(sr->nextSearchStep, scheduler.time());
+        sr->last_result = {};
+        sr->scheduleStep(scheduler, STEP_ANNOUNCES);
     } else if (callback) {
         callback(false, {});
     }
@@ -908,8 +1058,11 @@ Dht::cancelListen(const InfoHash& id, size_t token)
         logger_->d(id, "cancelListen %s with token %d", id.toString().c_str(), token);
     if (auto tokenlocal = std::get<0>(it->second)) {
         auto st = store.find(id);
-        if (st != store.end())
+        if (st != store.end()) {
             st->second.cancelListen(tokenlocal);
+            // the storage may now be unused
+            indexStorageExpiration(id, st->second, scheduler.time());
+        }
     }
     auto searches_cancel_listen = [this,&id](std::map<InfoHash, Sp<Search>>& srs, size_t token) {
         if (token) {
@@ -1038,7 +1191,10 @@ Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filt
     auto f = filter.chain(q->where.getFilter());
 
     /* Try to answer this search locally. */
-    gcb(getLocal(id, f));
+    auto st = store.find(id);
+    gcb(st == store.end() ? std::vector<Sp<Value>> {} : st->second.get(q->where, filter));
+    if (op->status.done)
+        return;
 
     Dht::search(id, AF_INET, gcb, {}, [=](bool ok, const std::vector<Sp<Node>>& nodes) {
         //logger__WARN("DHT done IPv4");
@@ -1169,6 +1325,7 @@ Dht::cancelPut(const InfoHash& id, const Value::Id& vid)
 void
 Dht::storageChanged(const InfoHash& id, Storage& st, ValueStorage& v, bool newValue)
 {
+    DHT_TRACE(storage__changed, id.data(), v.data->id, st.local_listeners.size(), st.listeners.size());
     if (newValue) {
         if (not st.local_listeners.empty()) {
             if (logger_)
@@ -1196,22 +1353,30 @@ Dht::storageChanged(const InfoHash& id, Storage& st, ValueStorage& v, bool newVa
     if (not st.listeners.empty()) {
         if (logger_)
             logger_->d(id, "[store %s] %lu remote listeners", id.toString().c_str(), st.listeners.size());
-        for (const auto& node_listeners : st.listeners) {
-            for (const auto& l : node_listeners.second) {
-                auto f = l.second.query.where.getFilter();
-                if (f and not f(*v.data))
-                    continue;
-                if (logger_)
-                    logger_->w(id, node_listeners.first->id, "[store %s] [node %s] sending update",
-                        id.toString().c_str(),
-                        node_listeners.first->toString().c_str());
-                std::vector<Sp<Value>> vals {};
-                vals.push_back(v.data);
-                Blob ntoken = makeToken(node_listeners.first->getAddr(), false);
-                network_engine.tellListener(node_listeners.first, l.first, id, 0, ntoken, {}, {},
-                        std::move(vals), l.second.query, l.second.version);
-            }
+        // listeners mostly share a few queries: filter once per query
+        std::vector<std::pair<const Where*, bool>> matches;
+        auto match = [&](const Where& w) {
+            for (const auto& m : matches)
+                if (m.first->isSatisfiedBy(w) and w.isSatisfiedBy(*m.first))
+                    return m.second;
+            auto f = w.getFilter();
+            bool ok = not f or f(*v.data);
+            matches.emplace_back(&w, ok);
+            return ok;
+        };
+        // keep updates in order once some are deferred
+        size_t budget = listener_updates.empty() ? LISTENER_UPDATES_BUDGET : 0;
+        for (const auto& l : st.listeners) {
+            if (not match(l.listener.query.where))
+                continue;
+            if (budget) {
+                sendListenerUpdate(id, l.node, l.socket_id, l.listener, v.data);
+                budget--;
+            } else
+                queueListenerUpdate(id, l.node, l.socket_id, v.data);
         }
+        if (not listener_updates.empty() and nextListenerUpdates and not nextListenerUpdates->scheduled())
+            scheduler.edit(nextListenerUpdates, scheduler.time() + LISTENER_UPDATES_DELAY);
     }
 }
 
@@ -1223,6 +1388,24 @@ Dht::storageStore(const InfoHash& id, const Sp<Value>& value, time_point created
     auto expiration = permanent ? time_point::max() : created + getType(value->type).expiration;
     if (expiration < now)
         return false;
+    DHT_TRACE(storage__store, id.data(), value->id, value->size());
+
+    // the value may be new or modified in place: drop any stale encoding
+    network_engine.invalidatePackedValue(value->id);
+
+    StorageBucket* store_bucket {nullptr};
+    if (sa) {
+        auto q = store_quota.find(sa);
+        if (q == store_quota.end()) {
+            if (store_quota.size() >= MAX_STORE_SOURCES) {
+                if (logger_)
+                    logger_->w(id, "[store %s] too many sources, rejecting value from %s", id.toString().c_str(), sa.toString().c_str());
+                return false;
+            }
+            q = store_quota.emplace(sa, StorageBucket{}).first;
+        }
+        store_bucket = &q->second;
+    }
 
     auto st = store.find(id);
     if (st == store.end()) {
@@ -1234,38 +1417,123 @@ Dht::storageStore(const InfoHash& id, const Sp<Value>& value, time_point created
             scheduler.add(st->second.maintenance_time, std::bind(&Dht::dataPersistence, this, id));
     }
 
-    StorageBucket* store_bucket {nullptr};
-    if (sa)
-        store_bucket = &store_quota[sa];
-
-    auto store = st->second.store(id, value, created, expiration, store_bucket);
+    // share the memory of identical values stored by peers under other keys
+    auto v = (intern_threshold and sa and value->size() >= intern_threshold) ? internValue(value) : value;
+    auto store = st->second.store(id, v, created, expiration, store_bucket);
     if (auto vs = store.first) {
         total_store_size += store.second.size_diff;
         total_values += store.second.values_diff;
-        if (not permanent) {
-            scheduler.add(expiration, std::bind(&Dht::expireStorage, this, id));
-        }
+        indexStorageExpiration(id, st->second, expiration);
+        if (storage_backend)
+            storage_backend->put(id, *value, created, expiration, sa);
         if (total_store_size > max_store_size) {
             expireStore();
         }
         storageChanged(id, st->second, *vs, store.second.values_diff > 0);
+    } else if (st->second.empty()) {
+        indexStorageExpiration(id, st->second, now);
     }
 
     return std::get<0>(store);
 }
 
+Sp<Value>
+Dht::internValue(const Sp<Value>& value)
+{
+    // hashing the data is enough to find copies, without packing the value
+    auto& interned = interned_values[InfoHash::get(value->data.data(), value->data.size())];
+    if (auto v = interned.lock()) {
+        // another value with the same data, or a hash collision
+        if (v == value or not (*v == *value))
+            return value;
+        interned_hits++;
+        return v;
+    }
+    interned = value;
+    // drop entries of released values once the table doubled
+    if (interned_values.size() > 2 * interned_sweep_size) {
+        for (auto it = interned_values.begin(); it != interned_values.end();) {
+            if (it->second.expired())
+                it = interned_values.erase(it);
+            else
+                ++it;
+        }
+        interned_sweep_size = std::max<size_t>(interned_values.size(), 64);
+    }
+    return value;
+}
+
 bool
 Dht::storageErase(const InfoHash& id, Value::Id vid)
 {
     auto st = store.find(id);
     if (st == store.end())
         return false;
-    auto ret = st->second.remove(id, vid);
+    auto ret = st->second.remove(vid);
     total_store_size += ret.size_diff;
     total_values += ret.values_diff;
+    if (ret.values_diff and storage_backend)
+        storage_backend->erase(id, vid);
     return ret.values_diff;
 }
 
+void
+Dht::sendListenerUpdate(const InfoHash& id, const Sp<Node>& node, size_t socket_id, const Listener& l, const Sp<Value>& value)
+{
+    if (logger_)
+        logger_->w(id, node->id, "[store %s] [node %s] sending update",
+            id.toString().c_str(), node->toString().c_str());
+    Blob ntoken = makeToken(node->getAddr(), false);
+    network_engine.tellListener(node, socket_id, id, 0, ntoken, {}, {}, {value}, l.query, l.version);
+}
+
+void
+Dht::queueListenerUpdate(const InfoHash& id, const Sp<Node>& node, size_t socket_id, const Sp<Value>& value)
+{
+    ListenerKey key {id, node, socket_id};
+    auto it = pending_listener_updates.find(key);
+    if (it == pending_listener_updates.end()) {
+        if (listener_updates.size() >= MAX_LISTENER_UPDATES) {
+            if (logger_)
+                logger_->w("Too many deferred listener updates, dropping the oldest");
+            pending_listener_updates.erase(listener_updates.front().listener);
+            listener_updates.pop_front();
+        }
+        auto u = listener_updates.emplace(listener_updates.end(), ListenerUpdate {key, {}});
+        it = pending_listener_updates.emplace(std::move(key), u).first;
+    }
+    it->second->values[value->id] = value;
+}
+
+void
+Dht::sendListenerUpdates()
+{
+    size_t sent = 0;
+    while (sent < LISTENER_UPDATES_BUDGET and not listener_updates.empty()) {
+        auto u = std::move(listener_updates.front());
+        pending_listener_updates.erase(u.listener);
+        listener_updates.pop_front();
+        const auto& id = std::get<0>(u.listener);
+        const auto& node = std::get<1>(u.listener);
+        auto socket_id = std::get<2>(u.listener);
+        // the listener may have expired, or the values been removed, meanwhile
+        auto st = store.find(id);
+        if (st == store.end())
+            continue;
+        auto l = st->second.listeners.find(node, socket_id);
+        if (not l)
+            continue;
+        for (const auto& v : u.values) {
+            if (st->second.getById(v.first) != v.second)
+                continue;
+            sendListenerUpdate(id, node, socket_id, l->listener, v.second);
+            sent++;
+        }
+    }
+    if (not listener_updates.empty())
+        scheduler.edit(nextListenerUpdates, scheduler.time() + LISTENER_UPDATES_DELAY);
+}
+
 void
 Dht::storageAddListener(const InfoHash& id, const Sp<Node>& node, size_t socket_id, Query&& query, int version)
 {
@@ -1276,19 +1544,22 @@ Dht::storageAddListener(const InfoHash& id, const Sp<Node>& node, size_t socket_
             return;
         st = store.emplace(id, now).first;
     }
-    auto& node_listeners = st->second.listeners[node];
-    auto l = node_listeners.find(socket_id);
-    if (l == node_listeners.end()) {
-        auto vals = st->second.get(query.where.getFilter());
+    auto l = st->second.listeners.find(node, socket_id);
+    if (not l) {
+        auto vals = st->second.get(query.where);
         if (not vals.empty()) {
+            if (eviction_policy != EvictionPolicy::Oldest)
+                st->second.touch(vals);
             network_engine.tellListener(node, socket_id, id, WANT4 | WANT6, makeToken(node->getAddr(), false),
                     dht4.buckets.findClosestNodes(id, now, TARGET_NODES), dht6.buckets.findClosestNodes(id, now, TARGET_NODES),
                     std::move(vals), query, version);
         }
-        node_listeners.emplace(socket_id, Listener {now, std::forward<Query>(query), version});
+        st->second.listeners.add(node, socket_id, Listener {now, std::forward<Query>(query), version});
+        total_listeners++;
+        indexStorageExpiration(id, st->second, now + Node::NODE_EXPIRE_TIME);
     }
     else
-        l->second.refresh(now, std::forward<Query>(query));
+        st->second.listeners.refresh(*l, now, std::forward<Query>(query));
 }
 
 void
@@ -1296,9 +1567,14 @@ Dht::expireStore(decltype(store)::iterator i)
 {
     const auto& id = i->first;
     auto& st = i->second;
-    auto stats = st.expire(id, scheduler.time());
+    auto listener_count = st.listeners.size();
+    auto stats = st.expire(scheduler.time());
+    total_listeners -= listener_count - st.listeners.size();
     total_store_size += stats.first;
     total_values -= stats.second.size();
+    if (storage_backend)
+        for (const auto& v : stats.second)
+            storage_backend->erase(id, v->id);
     if (not stats.second.empty()) {
         if (logger_)
             logger_->d(id, "[store %s] discarded %ld expired values (%ld bytes)",
@@ -1313,15 +1589,13 @@ Dht::expireStore(decltype(store)::iterator i)
             for (const auto& v : stats.second)
                 ids.emplace_back(v->id);
 
-            for (const auto& node_listeners : st.listeners) {
-                for (const auto& l : node_listeners.second) {
-                    if (logger_)
-                        logger_->w(id, node_listeners.first->id, "[store %s] [node %s] sending expired",
-                            id.toString().c_str(),
-                            node_listeners.first->toString().c_str());
-                    Blob ntoken = makeToken(node_listeners.first->getAddr(), false);
-                    network_engine.tellListenerExpired(node_listeners.first, l.first, id, ntoken, ids, l.second.version);
-                }
+            for (const auto& l : st.listeners) {
+                if (logger_)
+                    logger_->w(id, l.node->id, "[store %s] [node %s] sending expired",
+                        id.toString().c_str(),
+                        l.node->toString().c_str());
+                Blob ntoken = makeToken(l.node->getAddr(), false);
+                network_engine.tellListenerExpired(l.node, l.socket_id, id, ntoken, ids, l.listener.version);
             }
         }
         for (const auto& local_listeners : st.local_listeners) {
@@ -1331,28 +1605,72 @@ Dht::expireStore(decltype(store)::iterator i)
 }
 
 void
-Dht::expireStorage(InfoHash h)
-{
-    auto i = store.find(h);
-    if (i != store.end())
-        expireStore(i);
+Dht::indexStorageExpiration(const InfoHash& id, Storage& st, time_point t)
+{
+    if (t < st.indexed_expiration) {
+        st.indexed_expiration = t;
+        store_expirations.emplace(t, id);
+        if (t < next_store_expiration) {
+            next_store_expiration = t;
+            scheduler.edit(nextStoreExpiration, t);
+        }
+    }
 }
 
 void
-Dht::expireStore()
+Dht::expireStoreStep()
+{
+    const auto& now = scheduler.time();
+    if (expireStorages(EXPIRE_STORE_BUDGET))
+        next_store_expiration = store_expirations.empty() ? time_point::max() : store_expirations.top().first;
+    else
+        // let other jobs run before expiring more
+        next_store_expiration = now + EXPIRE_STORE_DELAY;
+    scheduler.edit(nextStoreExpiration, next_store_expiration);
+}
+
+bool
+Dht::expireStorages(size_t max)
 {
+    const auto& now = scheduler.time();
+    // storages due for expiration, ignoring outdated index entries
+    std::vector<InfoHash> due;
+    while (not store_expirations.empty() and store_expirations.top().first <= now) {
+        if (due.size() >= max)
+            break;
+        auto e = store_expirations.top();
+        store_expirations.pop();
+        auto i = store.find(e.second);
+        if (i == store.end() or i->second.indexed_expiration != e.first)
+            continue;
+        i->second.indexed_expiration = time_point::max();
+        due.emplace_back(e.second);
+    }
+
     // removing expired values
-    for (auto i = store.begin(); i != store.end();) {
+    for (const auto& id : due) {
+        auto i = store.find(id);
+        if (i == store.end())
+            continue;
         expireStore(i);
-
+        // listeners may have changed the store
+        i = store.find(id);
+        if (i == store.end())
+            continue;
         if (i->second.empty() && i->second.listeners.empty() && i->second.local_listeners.empty()) {
             if (logger_)
                 logger_->d(i->first, "[store %s] discarding empty storage", i->first.toString().c_str());
-            i = store.erase(i);
-        }
-        else
-            ++i;
+            store.erase(i);
+        } else
+            indexStorageExpiration(id, i->second, i->second.getNextExpiration());
     }
+    return store_expirations.empty() or store_expirations.top().first > now;
+}
+
+void
+Dht::expireStore()
+{
+    expireStorages(std::numeric_limits<size_t>::max());
 
     // remove more values if storage limit is exceeded
     while (total_store_size > max_store_size) {
@@ -1363,25 +1681,32 @@ Dht::expireStore()
             break;
         }
         auto largest = store_quota.begin();
-        for (auto it = ++largest; it != store_quota.end(); ++it) {
+        for (auto it = std::next(largest); it != store_quota.end(); ++it) {
             if (it->second.size() > largest->second.size())
                 largest = it;
         }
+        if (largest->second.empty()) {
+            if (logger_)
+                logger_->w("No space left: local data consumes all the quota!");
+            break;
+        }
         if (logger_)
             logger_->w("No space left: discarding value of largest consumer %s", largest->first.toString().c_str());
-        while (true) {
-            auto exp_value = largest->second.getOldest();
-            auto storage = store.find(exp_value.first);
-            if (storage != store.end()) {
-                auto ret = storage->second.remove(exp_value.first, exp_value.second);
-                total_store_size += ret.size_diff;
-                total_values += ret.values_diff;
-                if (logger_)
-                    logger_->w("Discarded %ld bytes, still %ld used", largest->first.toString().c_str(), total_store_size);
-                if (ret.values_diff)
-                    break;
-            }
-        }
+        // buckets only list stored values
+        auto exp_value = largest->second.getEvictionCandidate(eviction_policy);
+        auto storage = store.find(exp_value.key);
+        if (storage == store.end())
+            break;
+        auto ret = storage->second.remove(exp_value.vid);
+        if (not ret.values_diff)
+            break;
+        total_store_size += ret.size_diff;
+        total_values += ret.values_diff;
+        store_evictions++;
+        if (storage_backend)
+            storage_backend->erase(exp_value.key, exp_value.vid);
+        if (logger_)
+            logger_->w("Discarded %ld bytes, still %ld used", -ret.size_diff, total_store_size);
     }
 
     // remove unused quota entires
@@ -1395,6 +1720,104 @@ Dht::expireStore()
 
 void
 Dht::connectivityChanged(sa_family_t af)
+{
+    auto& d = dht(af);
+    if (d.connectivity_probe)
+        return;
+    const auto& now = scheduler.time();
+    std::vector<Sp<Node>> good;
+    for (const auto& b : d.buckets)
+        for (const auto& n : b.nodes)
+            if (n->isGood(now))
+                good.emplace_back(n);
+    if (good.empty()) {
+        resetConnectivity(af);
+        return;
+    }
+    std::shuffle(good.begin(), good.end(), rd);
+    if (good.size() > CONNECTIVITY_PROBE_NODES)
+        good.resize(CONNECTIVITY_PROBE_NODES);
+
+    auto probe = std::make_shared<ConnectivityProbe>();
+    probe->previous_addr = getPublicAddress(af);
+    probe->pending = good.size();
+    d.connectivity_probe = probe;
+    if (logger_)
+        logger_->d("[connectivity] IPv%c changed, probing %zu nodes", af == AF_INET ? '4' : '6', good.size());
+
+    std::weak_ptr<ConnectivityProbe> wprobe = probe;
+    auto onProbe = [this, wprobe, af](bool answered) {
+        if (auto probe = wprobe.lock()) {
+            if (answered)
+                probe->answered++;
+            if (--probe->pending == 0)
+                onConnectivityProbed(af);
+        }
+    };
+    probe->timeout = scheduler.add(now + CONNECTIVITY_PROBE_TIMEOUT, [this, wprobe, af] {
+        if (wprobe.lock())
+            onConnectivityProbed(af);
+    });
+    for (const auto& n : good) {
+        network_engine.sendPing(n, [onProbe](const net::Request&, net::RequestAnswer&&) {
+            onProbe(true);
+        }, [onProbe](const net::Request&, bool over) {
+            if (over)
+                onProbe(false);
+        });
+    }
+}
+
+void
+Dht::onConnectivityProbed(sa_family_t af)
+{
+    auto& d = dht(af);
+    auto probe = std::move(d.connectivity_probe);
+    if (not probe)
+        return;
+    if (probe->timeout)
+        probe->timeout->cancel();
+
+    if (probe->answered == 0) {
+        if (logger_)
+            logger_->w("[connectivity] IPv%c: no probed node answered, confirming all nodes", af == AF_INET ? '4' : '6');
+        resetConnectivity(af);
+        return;
+    }
+    if (not probe->moved) {
+        // nodes that didn't answer are expired as usual, the rest is still valid
+        if (logger_)
+            logger_->d("[connectivity] IPv%c: %u nodes answered, public address unchanged", af == AF_INET ? '4' : '6', probe->answered);
+        return;
+    }
+
+    // tokens and listen registrations are bound to our previous public address
+    if (logger_)
+        logger_->d("[connectivity] IPv%c: %u nodes answered, public address changed", af == AF_INET ? '4' : '6', probe->answered);
+    reported_addr.erase(std::remove_if(reported_addr.begin(), reported_addr.end(), [&](const ReportedAddr& addr){
+        return std::find(probe->previous_addr.begin(), probe->previous_addr.end(), addr.second) != probe->previous_addr.end();
+    }), reported_addr.end());
+    for (auto& s : d.searches) {
+        auto& sr = *s.second;
+        if (sr.expired or sr.done)
+            continue;
+        for (auto& sn : sr.nodes) {
+            sn->token.clear();
+            sn->last_get_reply = time_point::min();
+            // keep the value caches, but send listens again once synced
+            for (auto& l : sn->listenStatus) {
+                if (l.second.req) {
+                    sn->node->cancelRequest(l.second.req);
+                    l.second.req.reset();
+                }
+            }
+        }
+        sr.scheduleStep(scheduler);
+    }
+}
+
+void
+Dht::resetConnectivity(sa_family_t af)
 {
     const auto& now = scheduler.time();
     scheduler.edit(nextNodesConfirmation, now);
@@ -1466,6 +1889,32 @@ Dht::getNodesStats(sa_family_t af) const
     return stats;
 }
 
+MemoryStats
+Dht::getMemoryStats() const
+{
+    // entries of node-based containers also use about 4 pointers
+    constexpr size_t NODE_OVERHEAD {4 * sizeof(void*)};
+    // shared_ptr control block
+    constexpr size_t SHARED_OVERHEAD {2 * sizeof(void*)};
+    MemoryStats stats;
+    stats.storage = total_store_size
+        + total_values * (sizeof(ValueStorage) + sizeof(Value) + SHARED_OVERHEAD)
+        + store.size() * (sizeof(decltype(store)::value_type) + NODE_OVERHEAD);
+    stats.routing_table = (dht4.buckets.size() + dht6.buckets.size()) * sizeof(Bucket);
+    // nodes are indexed by id and in a least recently used list
+    stats.node_cache = network_engine.getNodeCacheSize()
+        * (sizeof(Node) + SHARED_OVERHEAD + sizeof(std::pair<InfoHash, std::weak_ptr<Node>>) + 2 * NODE_OVERHEAD);
+    // searches have about SEARCH_NODES nodes
+    stats.searches = (dht4.searches.size() + dht6.searches.size())
+        * (sizeof(Search) + SHARED_OVERHEAD + NODE_OVERHEAD + SEARCH_NODES * (sizeof(SearchNode) + sizeof(void*)));
+    stats.value_caches = value_cache_size;
+    // remote listeners are in an array, a hash index and an expiration queue
+    stats.listeners = listeners.size() * (sizeof(decltype(listeners)::value_type) + NODE_OVERHEAD)
+        + total_listeners * (sizeof(RemoteListeners::Entry) + NODE_OVERHEAD + sizeof(time_point) + 2 * sizeof(void*));
+    stats.partial_messages = network_engine.getPartialSize() + network_engine.getPartialCount() * NODE_OVERHEAD;
+    return stats;
+}
+
 NodeStats
 Dht::Kad::getNodesStats(time_point now, const InfoHash& myid) const
 {
@@ -1484,6 +1933,8 @@ Dht::Kad::getNodesStats(time_point now, const InfoHash& myid) const
     }
     stats.table_depth = buckets.depth(buckets.findBucket(myid));
     stats.searches = searches.size();
+    stats.get_cache_hits = get_cache_hits;
+    stats.get_cache_misses = get_cache_misses;
     return stats;
 }
 
@@ -1529,6 +1980,10 @@ Dht::dumpSearch(const Search& sr, std::ostream& out) const
     if (synced && sr.isListening(now, listen_expire))
         out << " [listening]";
     out << std::endl;
+    out << "Steps: " << sr.step_count << ", cost: " << sr.step_cost;
+    if (sr.step_count)
+        out << " (" << sr.step_cost / sr.step_count << " per step)";
+    out << std::endl;
 
     /*printing the queries*/
     if (sr.callbacks.size() + sr.listeners.size() > 0)
@@ -1545,7 +2000,8 @@ Dht::dumpSearch(const Search& sr, std::ostream& out) const
         out << "Announcement: " << *a.value << (announced ? " [announced]" : "") << std::endl;
     }
 
-    out << " Common bits    InfoHash                       Conn. Get   Ops  IP" << std::endl;
+    out << "Node selection: fastest of " << search_rtt_window << " closest" << std::endl;
+    out << " Common bits    InfoHash                       Conn. RTT    TO Get   Ops  IP" << std::endl;
     auto last_get = sr.getLastGetTime();
     for (const auto& np : sr.nodes) {
         auto& n = *np;
@@ -1558,6 +2014,13 @@ Dht::dumpSearch(const Search& sr, std::ostream& out) const
             out << ' ';
         out << (n.node->isExpired() ? 'x' : ' ') << "]";
 
+        // Latency: smoothed RTT in ms, and recent timeouts
+        if (n.node->getRtt() != duration::zero())
+            out << ' ' << std::setw(5) << duration_cast<milliseconds>(n.node->getRtt()).count() << "ms";
+        else
+            out << "      -";
+        out << ' ' << std::setw(2) << n.node->getRecentTimeouts();
+
         // Get status
         {
             char g_i = n.pending(n.getStatus) ? (n.candidate ? 'c' : 'f') : ' ';
@@ -1644,6 +2107,10 @@ Dht::getStorageLog() const
     else
         out << (total_store_size/1024) << " / " << (max_store_size/1024) << " KB)";
     out << std::endl;
+    out << "Gets: " << store_hits << " hits, " << store_misses << " misses, "
+        << store_evictions << " values evicted" << std::endl;
+    if (intern_threshold)
+        out << "Deduplicated " << interned_hits << " values, " << interned_values.size() << " tracked" << std::endl;
     return out.str();
 }
 
@@ -1671,10 +2138,11 @@ Dht::printStorageLog(const decltype(store)::value_type& s) const
                       << st.totalSize() << " bytes)" << std::endl;
     if (not st.local_listeners.empty())
         out << "   " << st.local_listeners.size() << " local listeners" << std::endl;
-    for (const auto& node_listeners : st.listeners) {
-        const auto& node = node_listeners.first;
-        out << "   " << "Listener " << node->toString() << " : " << node_listeners.second.size() << " entries" << std::endl;
-    }
+    std::map<Sp<Node>, size_t> node_listeners;
+    for (const auto& l : st.listeners)
+        node_listeners[l.node]++;
+    for (const auto& nl : node_listeners)
+        out << "   " << "Listener " << nl.first->toString() << " : " << nl.second << " entries" << std::endl;
     return out.str();
 }
 
@@ -1747,14 +2215,18 @@ fromDhtConfig(const Config& config)
     return netConf;
 }
 
-Dht::Dht() : store(), network_engine(logger_, rd, scheduler, {}) {}
+Dht::Dht() : store(0, SeededIdHash{rd()}), store_quota(0, SockAddr::ipHash{rd()}), interned_values(0, SeededIdHash{rd()}), network_engine(logger_, rd, scheduler, {}) {}
 
 Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock, const Config& config, const Sp<Logger>& l)
     : DhtInterface(l),
+    rd(config.random_seed ? std::mt19937_64(config.random_seed) : crypto::getSeededRandomEngine<std::mt19937_64>()),
     myid(config.node_id ? config.node_id : InfoHash::getRandom(rd)),
-    store(),
-    store_quota(),
+    store(0, SeededIdHash{rd()}),
+    store_quota(0, SockAddr::ipHash{rd()}),
     max_store_keys(config.max_store_size ? (int)config.max_store_size : MAX_HASHES),
+    eviction_policy(config.eviction_policy),
+    intern_threshold(config.intern_threshold),
+    interned_values(0, SeededIdHash{rd()}),
     max_searches(config.max_searches ? (int)config.max_searches : MAX_SEARCHES),
     network_engine(myid, fromDhtConfig(config), std::move(sock), logger_, rd, scheduler,
             std::bind(&Dht::onError, this, _1, _2),
@@ -1767,10 +2239,17 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock, const Config& config, cons
             std::bind(&Dht::onAnnounce, this, _1, _2, _3, _4, _5),
             std::bind(&Dht::onRefresh, this, _1, _2, _3, _4)),
     persistPath(config.persist_path),
+    storage_backend(config.storage_backend),
+    maintenance_bandwidth(config.maintenance_bandwidth ? config.maintenance_bandwidth : (ssize_t)MAINTENANCE_BANDWIDTH),
     is_bootstrap(config.is_bootstrap),
     maintain_storage(config.maintain_storage),
-    public_stable(config.public_stable)
+    public_stable(config.public_stable),
+    search_rtt_window(config.search_rtt_window ? config.search_rtt_window : SEARCH_RTT_WINDOW),
+    get_cache_ttl(config.get_cache_ttl),
+    get_cache_negative_ttl(config.get_cache_negative_ttl)
 {
+    if (config.virtual_time_start != time_point::min())
+        scheduler.setVirtualTime(config.virtual_time_start);
     scheduler.syncTime();
     auto s = network_engine.getSocket();
     if (not s or (not s->hasIPv4() and not s->hasIPv6()))
@@ -1788,11 +2267,23 @@ Dht::Dht(std::unique_ptr<net::DatagramSocket>&& sock, const Config& config, cons
 
     uniform_duration_distribution<> time_dis {std::chrono::seconds(3), std::chrono::seconds(5)};
     nextNodesConfirmation = scheduler.add(scheduler.time() + time_dis(rd), std::bind(&Dht::confirmNodes, this));
+    nextMaintenance = scheduler.add(time_point::max(), std::bind(&Dht::maintenance, this));
+    nextStoreExpiration = scheduler.add(time_point::max(), std::bind(&Dht::expireStoreStep, this));
+    nextListenerUpdates = scheduler.add(time_point::max(), std::bind(&Dht::sendListenerUpdates, this));
 
     // Fill old secret
     secret = std::uniform_int_distribution<uint64_t>{}(rd);
     rotateSecrets();
 
+    if (storage_backend) {
+        // detached while loading: these values are already persisted
+        auto backend = std::move(storage_backend);
+        backend->load([this](const InfoHash& key, const Sp<Value>& value, time_point created, time_point expiration,
+                             const SockAddr& source) {
+            storageStore(key, value, created, source, expiration == time_point::max());
+        });
+        storage_backend = std::move(backend);
+    }
     if (not persistPath.empty())
         loadState(persistPath);
 
@@ -1830,12 +2321,14 @@ Dht::neighbourhoodMaintenance(RoutingTable& list)
 
     auto n = q->randomNode(rd);
     if (n) {
-        if (logger_)
-            logger_->d(id, n->id, "[node %s] sending [find %s] for neighborhood maintenance",
-                n->toString().c_str(), id.toString().c_str());
-        /* Since our node-id is the same in both DHTs, it's probably
-           profitable to query both families. */
-        network_engine.sendFindNode(n, id, network_engine.want());
+        queueMaintenance([this, n, id]() -> Sp<net::Request> {
+            if (logger_)
+                logger_->d(id, n->id, "[node %s] sending [find %s] for neighborhood maintenance",
+                    n->toString().c_str(), id.toString().c_str());
+            /* Since our node-id is the same in both DHTs, it's probably
+               profitable to query both families. */
+            return network_engine.sendFindNode(n, id, network_engine.want());
+        });
     }
 
     return true;
@@ -1884,17 +2377,21 @@ Dht::bucketMaintenance(RoutingTable& list)
                         want = WANT4 | WANT6;
                 }
 
-                if (logger_)
-                    logger_->d(id, n->id, "[node %s] sending find %s for bucket maintenance", n->toString().c_str(), id.toString().c_str());
-                //auto start = scheduler.time();
-                network_engine.sendFindNode(n, id, want, nullptr, [this,n](const net::Request&, bool over) {
-                    if (over) {
-                        const auto& end = scheduler.time();
-                        // using namespace std::chrono;
-                        // if (logger_)
-                        //     logger_->d(n->id, "[node %s] bucket maintenance op expired after %s", n->toString().c_str(), print_duration(end-start).c_str());
-                        scheduler.edit(nextNodesConfirmation, end + Node::MAX_RESPONSE_TIME);
-                    }
+                queueMaintenance([this, n, id, want]() -> Sp<net::Request> {
+                    if (n->isPendingMessage())
+                        return {};
+                    if (logger_)
+                        logger_->d(id, n->id, "[node %s] sending find %s for bucket maintenance", n->toString().c_str(), id.toString().c_str());
+                    //auto start = scheduler.time();
+                    return network_engine.sendFindNode(n, id, want, nullptr, [this,n](const net::Request&, bool over) {
+                        if (over) {
+                            const auto& end = scheduler.time();
+                            // using namespace std::chrono;
+                            // if (logger_)
+                            //     logger_->d(n->id, "[node %s] bucket maintenance op expired after %s", n->toString().c_str(), print_duration(end-start).c_str());
+                            scheduler.edit(nextNodesConfirmation, end + Node::MAX_RESPONSE_TIME);
+                        }
+                    });
                 });
                 sent = true;
             }
@@ -1947,6 +2444,9 @@ Dht::maintainStorage(decltype(store)::value_type& storage, bool force, const Don
     if (not want4 and not want6) {
         if (logger_)
             logger_->d(storage.first, "Discarding storage values %s", storage.first.toString().c_str());
+        if (storage_backend)
+            for (const auto& v : storage.second.getValues())
+                storage_backend->erase(storage.first, v.data->id);
         auto diff = storage.second.clear();
         total_store_size += diff.size_diff;
         total_values += diff.values_diff;
@@ -1955,19 +2455,45 @@ Dht::maintainStorage(decltype(store)::value_type& storage, bool force, const Don
     return announce_per_af;
 }
 
+template <typename ProcessFn>
 time_point
-Dht::periodic(const uint8_t *buf, size_t buflen, SockAddr from, const time_point& now)
+Dht::periodicStep(const time_point& now, ProcessFn&& process)
 {
     scheduler.syncTime(now);
-    if (buflen) {
-        try {
-            network_engine.processMessage(buf, buflen, std::move(from));
-        } catch (const std::exception& e) {
-            if (logger_)
-                logger_->w("Can't process message: %s", e.what());
-        }
+    // Packets sent during this pass are flushed together
+    auto sock = network_engine.getSocket();
+    if (sock)
+        sock->startBatch();
+    try {
+        process();
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->w("Can't process message: %s", e.what());
     }
-    return scheduler.run();
+    auto next = scheduler.run();
+    if (sock)
+        network_engine.onSendErrors(sock->flush());
+    return next;
+}
+
+time_point
+Dht::periodic(const uint8_t *buf, size_t buflen, SockAddr from, const time_point& now)
+{
+    return periodicStep(now, [&]{
+        if (buflen)
+            network_engine.processMessage(buf, buflen, std::move(from));
+    });
+}
+
+time_point
+Dht::periodic(net::ReceivedPacket&& pkt, const time_point& now)
+{
+    return periodicStep(now, [&]{
+        if (pkt.msg)
+            network_engine.processMessage(std::move(pkt.msg), std::move(pkt.from));
+        else if (not pkt.data.empty())
+            network_engine.processMessage(pkt.data.data(), pkt.data.size(), std::move(pkt.from));
+    });
 }
 
 void
@@ -1980,6 +2506,8 @@ Dht::expire()
     expireBuckets(dht6.buckets);
     expireStore();
     expireSearches();
+    if (storage_backend)
+        storage_backend->maintain();
     scheduler.add(expire_stuff_time, std::bind(&Dht::expire, this));
 }
 
@@ -2049,67 +2577,87 @@ Dht::confirmNodes()
     scheduler.edit(nextNodesConfirmation, confirm_nodes_time);
 }
 
+ValuesSnapshot
+Dht::snapshotStorage(const decltype(store)::value_type& h) const
+{
+    ValuesSnapshot s;
+    s.key = h.first;
+    const auto& vals = h.second.getValues();
+    s.values.reserve(vals.size());
+    for (const auto& v : vals)
+        s.values.emplace_back(v.created, v.data);
+    return s;
+}
+
+std::vector<ValuesSnapshot>
+Dht::getValuesSnapshot() const
+{
+    std::vector<ValuesSnapshot> s;
+    s.reserve(store.size());
+    for (const auto& h : store)
+        if (not h.second.empty())
+            s.emplace_back(snapshotStorage(h));
+    return s;
+}
+
 std::vector<ValuesExport>
 Dht::exportValues() const
 {
     std::vector<ValuesExport> e {};
     e.reserve(store.size());
-    for (const auto& h : store) {
-        ValuesExport ve;
-        ve.first = h.first;
-
-        msgpack::sbuffer buffer;
-        msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        const auto& vals = h.second.getValues();
-        pk.pack_array(vals.size());
-        for (const auto& v : vals) {
-            pk.pack_array(2);
-            pk.pack(v.created.time_since_epoch().count());
-            v.data->msgpack_pack(pk);
-        }
-        ve.second = {buffer.data(), buffer.data()+buffer.size()};
-        e.push_back(std::move(ve));
-    }
+    for (const auto& h : store)
+        e.emplace_back(snapshotStorage(h).pack());
     return e;
 }
 
+void
+Dht::exportValuesTo(const ValuesExportCallback& cb) const
+{
+    for (const auto& h : store)
+        if (not h.second.empty() and not cb(snapshotStorage(h).pack()))
+            break;
+}
+
 void
 Dht::importValues(const std::vector<ValuesExport>& import)
 {
-    const auto& now = scheduler.time();
+    for (const auto& value : import)
+        importKeyValues(value);
+}
 
-    for (const auto& value : import) {
-        if (value.second.empty())
-            continue;
+void
+Dht::importKeyValues(const ValuesExport& value)
+{
+    const auto& now = scheduler.time();
+    if (value.second.empty())
+        return;
 
-        try {
-            msgpack::unpacked msg;
-            msgpack::unpack(msg, (const char*)value.second.data(), value.second.size());
-            auto valarr = msg.get();
-            if (valarr.type != msgpack::type::ARRAY)
+    try {
+        msgpack::unpacked msg;
+        msgpack::unpack(msg, (const char*)value.second.data(), value.second.size());
+        auto valarr = msg.get();
+        if (valarr.type != msgpack::type::ARRAY)
+            throw msgpack::type_error();
+        for (unsigned i = 0; i < valarr.via.array.size; i++) {
+            auto& valel = valarr.via.array.ptr[i];
+            if (valel.type != msgpack::type::ARRAY or valel.via.array.size < 2)
                 throw msgpack::type_error();
-            for (unsigned i = 0; i < valarr.via.array.size; i++) {
-                auto& valel = valarr.via.array.ptr[i];
-                if (valel.type != msgpack::type::ARRAY or valel.via.array.size < 2)
-                    throw msgpack::type_error();
-                time_point val_time;
-                Value tmp_val;
-                try {
-                    val_time = time_point{time_point::duration{valel.via.array.ptr[0].as<time_point::duration::rep>()}};
-                    tmp_val.msgpack_unpack(valel.via.array.ptr[1]);
-                } catch (const std::exception&) {
-                    if (logger_)
-                        logger_->e(value.first, "Error reading value at %s", value.first.toString().c_str());
-                    continue;
-                }
-                val_time = std::min(val_time, now);
-                storageStore(value.first, std::make_shared<Value>(std::move(tmp_val)), val_time);
+            time_point val_time;
+            Value tmp_val;
+            try {
+                val_time = time_point{time_point::duration{valel.via.array.ptr[0].as<time_point::duration::rep>()}};
+                tmp_val.msgpack_unpack(valel.via.array.ptr[1]);
+            } catch (const std::exception&) {
+                if (logger_)
+                    logger_->e(value.first, "Error reading value at %s", value.first.toString().c_str());
+                continue;
             }
-        } catch (const std::exception&) {
-            if (logger_)
-                logger_->e(value.first, "Error reading values at %s", value.first.toString().c_str());
-            continue;
+            val_time = std::min(val_time, now);
+            storageStore(value.first, makeValue(std::move(tmp_val)), val_time);
         }
+    } catch (const std::exception&) {
+        if (logger_)
+            logger_->e(value.first, "Error reading values at %s", value.first.toString().c_str());
     }
 }
 
@@ -2190,7 +2738,7 @@ Dht::onError(Sp<net::Request> req, net::DhtProtocolException e) {
                 n->token.clear();
                 n->last_get_reply = time_point::min();
                 searchSendGetValues(sr);
-                scheduler.edit(sr->nextSearchStep, scheduler.time());
+                sr->scheduleStep(scheduler);
                 break;
             }
         }
@@ -2204,8 +2752,14 @@ Dht::onError(Sp<net::Request> req, net::DhtProtocolException e) {
 void
 Dht::onReportedAddr(const InfoHash& /*id*/, const SockAddr& addr)
 {
-    if (addr)
-        reportedAddr(addr);
+    if (not addr)
+        return;
+    reportedAddr(addr);
+    if (const auto& probe = dht(addr.getFamily()).connectivity_probe) {
+        auto& prev = probe->previous_addr;
+        if (std::find(prev.begin(), prev.end(), addr) == prev.end())
+            probe->moved = true;
+    }
 }
 
 net::RequestAnswer
@@ -2245,10 +2799,16 @@ Dht::onGetValues(Sp<Node> node, const InfoHash& hash, want_t, const Query& query
     answer.nodes4 = dht4.buckets.findClosestNodes(hash, now, TARGET_NODES);
     answer.nodes6 = dht6.buckets.findClosestNodes(hash, now, TARGET_NODES);
     if (st != store.end() && not st->second.empty()) {
-        answer.values = st->second.get(query.where.getFilter());
+        answer.values = st->second.get(query.where);
         if (logger_)
             logger_->d(hash, "[node %s] sending %u values", node->toString().c_str(), answer.values.size());
     }
+    if (not answer.values.empty()) {
+        store_hits++;
+        if (eviction_policy != EvictionPolicy::Oldest)
+            st->second.touch(answer.values);
+    } else
+        store_misses++;
     return answer;
 }
 
@@ -2272,30 +2832,49 @@ void Dht::onGetValuesDone(const Sp<Node>& node,
             if (logger_)
                 logger_->d(sr->id, node->id, "[search %s] [node %s] found %u values",
                       sr->id.toString().c_str(), node->toString().c_str(), a.values.size());
-            for (auto& getp : sr->callbacks) { /* call all callbacks for this search */
-                auto& get = getp.second;
+            std::vector<Get> stopped_gets;
+            for (auto getp = sr->callbacks.begin(); getp != sr->callbacks.end();) { /* call all callbacks for this search */
+                auto& get = getp->second;
                 if (not (get.get_cb or get.query_cb) or
-                        (orig_query and get.query and not get.query->isSatisfiedBy(*orig_query)))
+                        (orig_query and get.query and not get.query->isSatisfiedBy(*orig_query))) {
+                    ++getp;
                     continue;
+                }
 
+                bool more = true;
                 if (get.query_cb) { /* in case of a request with query */
                     if (not a.fields.empty()) {
-                        get.query_cb(a.fields);
+                        more = get.query_cb(a.fields);
                     } else if (not a.values.empty()) {
                         std::vector<Sp<FieldValueIndex>> fields;
                         fields.reserve(a.values.size());
                         for (const auto& v : a.values)
                             fields.emplace_back(std::make_shared<FieldValueIndex>(*v, orig_query ? orig_query->select : Select {}));
-                        get.query_cb(fields);
+                        more = get.query_cb(fields);
                     }
                 } else if (get.get_cb) { /* in case of a vanilla get request */
                     std::vector<Sp<Value>> tmp;
-                    for (const auto& v : a.values)
+                    for (const auto& v : a.values) {
+                        if (get.received)
+                            (*get.received)[v->id] = v;
                         if (not get.filter or get.filter(*v))
                             tmp.emplace_back(v);
+                    }
                     if (not tmp.empty())
-                        get.get_cb(tmp);
+                        more = get.get_cb(tmp);
                 }
+
+                /* the callback asked to stop: end this get now */
+                if (not more) {
+                    stopped_gets.emplace_back(std::move(get));
+                    getp = sr->callbacks.erase(getp);
+                } else
+                    ++getp;
+            }
+            if (not stopped_gets.empty()) {
+                for (const auto& get : stopped_gets)
+                    sr->stopGet(get);
+                sr->scheduleStep(scheduler, STEP_GETS);
             }
 
             /* callbacks for local search listeners */
@@ -2327,7 +2906,7 @@ void Dht::onGetValuesDone(const Sp<Node>& node,
         searchSendGetValues(sr);
 
         // Force to recompute the next step time
-        scheduler.edit(sr->nextSearchStep, scheduler.time());
+        sr->scheduleStep(scheduler, STEP_GETS);
     }
 }
 
@@ -2360,9 +2939,8 @@ Dht::onListenDone(const Sp<Node>& /* node */, net::RequestAnswer& /* answer */,
     //            sr->id.toString().c_str(), node->toString().c_str(), answer.values.size());
 
     if (not sr->done) {
-        const auto& now = scheduler.time();
         searchSendGetValues(sr);
-        scheduler.edit(sr->nextSearchStep, now);
+        sr->scheduleStep(scheduler, STEP_LISTENERS);
     }
 }
 
@@ -2480,21 +3058,20 @@ Dht::storageRefresh(const InfoHash& id, Value::Id vid)
             if (logger_)
                 logger_->d(id, "[store %s] %lu remote listeners", id.toString().c_str(), st.listeners.size());
             std::vector<Value::Id> ids = {vid};
-            for (const auto& node_listeners : st.listeners) {
-                for (const auto& l : node_listeners.second) {
-                    if (logger_)
-                        logger_->w(id, node_listeners.first->id, "[store %s] [node %s] sending refresh",
-                            id.toString().c_str(),
-                            node_listeners.first->toString().c_str());
-                    Blob ntoken = makeToken(node_listeners.first->getAddr(), false);
-                    network_engine.tellListenerRefreshed(node_listeners.first, l.first, id, ntoken, ids, l.second.version);
-                }
+            for (const auto& l : st.listeners) {
+                if (logger_)
+                    logger_->w(id, l.node->id, "[store %s] [node %s] sending refresh",
+                        id.toString().c_str(),
+                        l.node->toString().c_str());
+                Blob ntoken = makeToken(l.node->getAddr(), false);
+                network_engine.tellListenerRefreshed(l.node, l.socket_id, id, ntoken, ids, l.listener.version);
             }
         }
 
         auto expiration = s->second.refresh(now, vid, types);
-        if (expiration != time_point::max())
-            scheduler.add(expiration, std::bind(&Dht::expireStorage, this, id));
+        // the storage stays indexed at its earlier expiration
+        if (expiration != time_point::max() and storage_backend)
+            storage_backend->refresh(id, vid, now, expiration);
         return true;
     }
     return false;
@@ -2511,6 +3088,9 @@ Dht::onAnnounceDone(const Sp<Node>& node, net::RequestAnswer& answer, Sp<Search>
 }
 
 
+/* Size of the blocks read by loadState */
+static constexpr size_t STATE_READ_CHUNK {64 * 1024};
+
 struct DhtState {
     unsigned v {1};
     InfoHash id;
@@ -2520,15 +3100,194 @@ struct DhtState {
     MSGPACK_DEFINE_MAP(v, id, nodes, values)
 };
 
+/*
+ * Routing table snapshot, little-endian, with fixed size records:
+ *   header: magic (8 bytes), version (u32), node id (20 bytes)
+ *   then for IPv4 and IPv6: family (u32, 4 or 6), bucket count (u32),
+ *   node count (u32), first id of each bucket (20 bytes each), and nodes:
+ *   id (20 bytes), address (16 bytes), port (u16), reserved (u16),
+ *   smoothed RTT in microseconds (u32), seconds since the last reply (u32).
+ */
+static constexpr char SNAPSHOT_MAGIC[] {"ODHTNODE"};
+static constexpr size_t SNAPSHOT_MAGIC_SIZE {8};
+static constexpr uint32_t SNAPSHOT_VERSION {1};
+static constexpr size_t SNAPSHOT_NODE_SIZE {HASH_LEN + 16 + 2 + 2 + 4 + 4};
+static constexpr uint32_t SNAPSHOT_NEVER {std::numeric_limits<uint32_t>::max()};
+static const std::string SNAPSHOT_EXTENSION {".nodes"};
+
+static void
+putSnapshotInt(std::string& out, uint32_t v, size_t bytes = 4)
+{
+    for (size_t i = 0; i < bytes; i++)
+        out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+static uint32_t
+getSnapshotInt(const uint8_t*& in, size_t bytes = 4)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < bytes; i++)
+        v |= static_cast<uint32_t>(in[i]) << (8 * i);
+    in += bytes;
+    return v;
+}
+
+void
+Dht::saveRoutingSnapshot(const std::string& path) const
+{
+    const auto& now = scheduler.time();
+    std::string out(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    putSnapshotInt(out, SNAPSHOT_VERSION);
+    out.append((const char*)myid.data(), HASH_LEN);
+    for (auto af : {AF_INET, AF_INET6}) {
+        const auto& table = buckets(af);
+        size_t count = 0;
+        for (const auto& b : table)
+            for (const auto& n : b.nodes)
+                if (not n->isExpired())
+                    count++;
+        putSnapshotInt(out, af == AF_INET ? 4 : 6);
+        putSnapshotInt(out, table.size());
+        putSnapshotInt(out, count);
+        for (const auto& b : table)
+            out.append((const char*)b.first.data(), HASH_LEN);
+        for (const auto& b : table) {
+            for (const auto& n : b.nodes) {
+                if (n->isExpired())
+                    continue;
+                out.append((const char*)n->id.data(), HASH_LEN);
+                char addr[16] {};
+                const auto& sa = n->getAddr();
+                if (af == AF_INET)
+                    std::memcpy(addr, &sa.getIPv4().sin_addr, sizeof(in_addr));
+                else
+                    std::memcpy(addr, &sa.getIPv6().sin6_addr, sizeof(in6_addr));
+                out.append(addr, sizeof(addr));
+                putSnapshotInt(out, sa.getPort(), 2);
+                putSnapshotInt(out, 0, 2);
+                auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(n->getRtt()).count();
+                putSnapshotInt(out, std::min<uint64_t>(rtt, SNAPSHOT_NEVER));
+                const auto& reply = n->getReplyTime();
+                uint32_t age = SNAPSHOT_NEVER;
+                if (reply != time_point::min() and reply <= now)
+                    age = std::min<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(now - reply).count(), SNAPSHOT_NEVER - 1);
+                putSnapshotInt(out, age);
+            }
+        }
+    }
+    std::ofstream file(path, std::ios::binary);
+    file.write(out.data(), out.size());
+}
+
+bool
+Dht::loadRoutingSnapshot(const std::string& path)
+{
+    std::vector<uint8_t> data;
+    {
+        std::ifstream file(path, std::ios::binary|std::ios::ate);
+        if (!file.is_open())
+            return false;
+        auto size = file.tellg();
+        file.seekg(0, std::ios::beg);
+        data.resize(size);
+        file.read((char*)data.data(), size);
+    }
+    const auto header_size = SNAPSHOT_MAGIC_SIZE + 4 + HASH_LEN;
+    if (data.size() < header_size or std::memcmp(data.data(), SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+        if (logger_)
+            logger_->w("Ignoring invalid routing table snapshot %s", path.c_str());
+        return false;
+    }
+    const uint8_t* in = data.data() + SNAPSHOT_MAGIC_SIZE;
+    const uint8_t* end = data.data() + data.size();
+    auto version = getSnapshotInt(in);
+    InfoHash id(in, HASH_LEN);
+    in += HASH_LEN;
+    if (version != SNAPSHOT_VERSION or id != myid) {
+        if (logger_)
+            logger_->d("Ignoring routing table snapshot %s: version %u for node %s",
+                path.c_str(), version, id.toString().c_str());
+        return false;
+    }
+
+    // (age, node) of the restored nodes
+    std::vector<std::pair<uint32_t, Sp<Node>>> restored;
+    while (end - in >= 12) {
+        auto family = getSnapshotInt(in);
+        auto bucket_count = getSnapshotInt(in);
+        auto node_count = getSnapshotInt(in);
+        if (uint64_t(end - in) < uint64_t(bucket_count) * HASH_LEN + uint64_t(node_count) * SNAPSHOT_NODE_SIZE)
+            break;
+        auto af = family == 4 ? AF_INET : AF_INET6;
+        auto& table = buckets(af);
+        // keep the table if the family is disabled, or if the buckets are not sorted
+        bool valid = not table.empty() and bucket_count and InfoHash(in, HASH_LEN) == InfoHash();
+        for (size_t i = 1; valid and i < bucket_count; i++)
+            valid = std::memcmp(in + (i-1)*HASH_LEN, in + i*HASH_LEN, HASH_LEN) < 0;
+        if (valid) {
+            bool is_client = table.is_client;
+            table.clear();
+            table.is_client = is_client;
+            table.reserve(bucket_count);
+            for (size_t i = 0; i < bucket_count; i++)
+                table.emplace_back(af, InfoHash(in + i*HASH_LEN, HASH_LEN));
+        }
+        in += bucket_count * HASH_LEN;
+        for (size_t i = 0; i < node_count; i++, in += SNAPSHOT_NODE_SIZE) {
+            if (not valid)
+                continue;
+            const uint8_t* p = in + HASH_LEN + 16;
+            auto port = getSnapshotInt(p, 2);
+            getSnapshotInt(p, 2);
+            auto rtt = getSnapshotInt(p);
+            auto age = getSnapshotInt(p);
+            SockAddr addr;
+            addr.setFamily(af);
+            if (af == AF_INET)
+                std::memcpy(&addr.getIPv4().sin_addr, in + HASH_LEN, sizeof(in_addr));
+            else
+                std::memcpy(&addr.getIPv6().sin6_addr, in + HASH_LEN, sizeof(in6_addr));
+            addr.setPort(port);
+            auto node = network_engine.getNode(InfoHash(in, HASH_LEN), addr);
+            if (rtt and node->getRtt() == duration::zero())
+                node->updateRtt(std::chrono::microseconds(rtt));
+            if (table.restoreNode(node))
+                restored.emplace_back(age, std::move(node));
+        }
+    }
+    if (restored.empty())
+        return false;
+
+    // ping the most recently seen nodes first
+    std::sort(restored.begin(), restored.end(), [](const std::pair<uint32_t, Sp<Node>>& a, const std::pair<uint32_t, Sp<Node>>& b) {
+        return a.first < b.first;
+    });
+    if (logger_)
+        logger_->d("Restored %zu nodes from routing table snapshot %s", restored.size(), path.c_str());
+    for (auto& n : restored) {
+        queueMaintenance([this, node = std::move(n.second)]() -> Sp<net::Request> {
+            if (node->isExpired() or node->isGood(scheduler.time()) or node->isPendingMessage())
+                return {};
+            return network_engine.sendPing(node, nullptr, nullptr);
+        });
+    }
+    return true;
+}
+
 void
 Dht::saveState(const std::string& path) const
 {
     DhtState state;
     state.id = myid;
     state.nodes = exportNodes();
-    state.values = exportValues();
-    std::ofstream file(path);
-    msgpack::pack(file, state);    
+    std::ofstream file(path, std::ios::binary);
+    msgpack::pack(file, state);
+    // values follow the state, one key at a time
+    exportValuesTo([&](ValuesExport&& e) {
+        msgpack::pack(file, e);
+        return (bool)file;
+    });
+    saveRoutingSnapshot(path + SNAPSHOT_EXTENSION);
 }
 
 void
@@ -2537,33 +3296,38 @@ Dht::loadState(const std::string& path)
     if (logger_)
         logger_->d("Importing state from %s", path.c_str());
     try {
-        // Import nodes from binary file
-        msgpack::unpacker pac;
-        {
-            // Read whole file
-            std::ifstream file(path, std::ios::binary|std::ios::ate);
-            if (!file.is_open()) {
-                return;
-            }
-            auto size = file.tellg();
-            file.seekg (0, std::ios::beg);
-            pac.reserve_buffer(size);
-            file.read (pac.buffer(), size);
-            pac.buffer_consumed(size);
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return;
         }
-        // Import nodes
+        // Read the file in chunks: the state, then the values of each key
+        msgpack::unpacker pac;
         msgpack::object_handle oh;
-        if (pac.next(oh)) {
-            auto state = oh.get().as<DhtState>();
-            if (logger_)
-                logger_->d("Importing %zu nodes", state.nodes.size());
-            if (state.id)
-                myid = state.id;
-            std::vector<Sp<Node>> tmpNodes;
-            tmpNodes.reserve(state.nodes.size());
-            for (const auto& node : state.nodes)
-                tmpNodes.emplace_back(network_engine.insertNode(node.id, SockAddr(node.ss, node.sslen)));
-            importValues(state.values);
+        bool stateLoaded {false};
+        std::vector<Sp<Node>> tmpNodes;
+        while (file) {
+            pac.reserve_buffer(STATE_READ_CHUNK);
+            file.read(pac.buffer(), STATE_READ_CHUNK);
+            pac.buffer_consumed(file.gcount());
+            while (pac.next(oh)) {
+                if (stateLoaded) {
+                    importKeyValues(oh.get().as<ValuesExport>());
+                    continue;
+                }
+                auto state = oh.get().as<DhtState>();
+                if (logger_)
+                    logger_->d("Importing %zu nodes", state.nodes.size());
+                if (state.id)
+                    myid = state.id;
+                if (not loadRoutingSnapshot(path + SNAPSHOT_EXTENSION)) {
+                    tmpNodes.reserve(state.nodes.size());
+                    for (const auto& node : state.nodes)
+                        tmpNodes.emplace_back(network_engine.insertNode(node.id, SockAddr(node.ss, node.sslen)));
+                }
+                // values saved inside the state by earlier versions
+                importValues(state.values);
+                stateLoaded = true;
+            }
         }
     } catch (const std::exception& e) {
         if (logger_)
@@ -22,9 +22,13 @@
 #include "dhtrunner.h"
 #include "op_cache.h"
 #include "utils.h"
+#include "base64.h"
+#include "line_split.h"
 
 #include <http_parser.h>
+#include <cstring>
 #include <deque>
+#include <sstream>
 
 namespace dht {
 
@@ -50,6 +54,16 @@ struct DhtProxyClient::Listener
     Sp<OperationState> opstate;
     std::shared_ptr<http::Request> request;
     std::unique_ptr<asio::steady_timer> refreshSubscriberTimer;
+    /* values are received from the stream */
+    bool streamed {false};
+};
+
+struct DhtProxyClient::Stream {
+    std::shared_ptr<http::Request> request;
+    /* id given by the proxy, operations are queued until it's received */
+    std::string id {};
+    Json::Value pending {Json::arrayValue};
+    std::atomic_bool stop {false};
 };
 
 struct PermanentPut {
@@ -71,28 +85,196 @@ struct DhtProxyClient::ProxySearch {
     std::set<Sp<Value>> pendingPuts  {};
 };
 
-struct LineSplit {
-    void append(const char* d, size_t l) {
-        buf_.insert(buf_.end(), d, d+l);
-    }
-    bool getLine(char c) {
-        auto it = buf_.begin();
-        while (it != buf_.end()) {
-            if (*(it++) == c) {
-                line_.clear();
-                line_.insert(line_.end(), buf_.begin(), it);
-                buf_.erase(buf_.begin(), it);
-                return true;
+/*
+ * Decodes a value sent as a flat JSON object straight from the bytes
+ * received, without building a Json::Value. Strings are only copied when
+ * they have escapes, and base64 fields are decoded into the value.
+ * Objects with other members, nested objects or arrays are left to the
+ * JSON parser.
+ */
+struct ValueLineParser {
+    /** @return false if the line must be parsed as JSON */
+    bool parse(const char* begin, const char* end) {
+        p_ = begin;
+        end_ = end;
+        value = makeValue();
+        key = {};
+        expired = false;
+        fields = 0;
+        skipSpace();
+        if (not consume('{'))
+            return false;
+        skipSpace();
+        if (consume('}'))
+            return atEnd();
+        do {
+            Str name, str;
+            skipSpace();
+            if (not readString(name))
+                return false;
+            std::string field(name.data, name.size);
+            skipSpace();
+            if (not consume(':'))
+                return false;
+            skipSpace();
+            if (field == "expired") {
+                if (not readBool(expired))
+                    return false;
+            } else if (field == "seq" or field == "type" or field == "prio") {
+                int64_t n;
+                if (not readInt(n))
+                    return false;
+                if (field == "seq") value->seq = n;
+                else if (field == "type") value->type = n;
+                else value->priority = n;
+            } else if (field == "id") {
+                int64_t n;
+                if (readString(str)) {
+                    std::string id(str.data, str.size);
+                    value->id = std::strtoull(id.c_str(), nullptr, 10);
+                } else if (readInt(n))
+                    value->id = n;
+                else
+                    return false;
+            } else {
+                if (not readString(str))
+                    return false;
+                if (field == "data")
+                    base64_decode(str.data, str.size, value->data);
+                else if (field == "sig")
+                    base64_decode(str.data, str.size, value->signature);
+                else if (field == "cypher")
+                    base64_decode(str.data, str.size, value->cypher);
+                else if (field == "owner")
+                    value->owner = std::make_shared<const crypto::PublicKey>(Blob(str.data, str.data + str.size));
+                else if (field == "to")
+                    value->recipient = InfoHash(std::string(str.data, str.size));
+                else if (field == "utype")
+                    value->user_type.assign(str.data, str.size);
+                else if (field == "key")
+                    key = InfoHash(std::string(str.data, str.size));
+                else
+                    return false;
             }
+            fields++;
+            skipSpace();
+        } while (consume(','));
+        return consume('}') and atEnd();
+    }
+
+    Sp<Value> value;
+    InfoHash key;
+    bool expired {false};
+    size_t fields {0};
+
+private:
+    struct Str {
+        const char* data;
+        size_t size;
+    };
+    const char* p_ {nullptr};
+    const char* end_ {nullptr};
+    /* unescaped strings, reused between lines */
+    std::string unescaped_;
+
+    void skipSpace() {
+        while (p_ < end_ and (*p_ == ' ' or *p_ == '\t' or *p_ == '\r' or *p_ == '\n'))
+            p_++;
+    }
+    bool atEnd() {
+        skipSpace();
+        return p_ == end_;
+    }
+    bool consume(char c) {
+        if (p_ == end_ or *p_ != c)
+            return false;
+        p_++;
+        return true;
+    }
+    bool readString(Str& s) {
+        if (p_ == end_ or *p_ != '"')
+            return false;
+        auto b = ++p_;
+        while (p_ < end_ and *p_ != '"' and *p_ != '\\')
+            p_++;
+        if (p_ < end_ and *p_ == '"') {
+            s = {b, (size_t)(p_++ - b)};
+            return true;
         }
-        return false;
+        unescaped_.assign(b, p_);
+        while (p_ < end_ and *p_ != '"') {
+            char c = *p_++;
+            if (c == '\\') {
+                if (p_ == end_)
+                    return false;
+                switch (c = *p_++) {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case '"': case '\\': case '/': break;
+                default:
+                    // unicode escapes are left to the JSON parser
+                    return false;
+                }
+            }
+            unescaped_.push_back(c);
+        }
+        if (not consume('"'))
+            return false;
+        s = {unescaped_.data(), unescaped_.size()};
+        return true;
+    }
+    bool readInt(int64_t& n) {
+        auto b = p_;
+        if (p_ < end_ and *p_ == '-')
+            p_++;
+        while (p_ < end_ and *p_ >= '0' and *p_ <= '9')
+            p_++;
+        if (p_ == b or (p_ < end_ and (*p_ == '.' or *p_ == 'e' or *p_ == 'E')))
+            return false;
+        n = std::strtoll(std::string(b, p_).c_str(), nullptr, 10);
+        return true;
+    }
+    bool readBool(bool& v) {
+        if (end_ - p_ >= 4 and std::memcmp(p_, "true", 4) == 0) {
+            p_ += 4;
+            v = true;
+        } else if (end_ - p_ >= 5 and std::memcmp(p_, "false", 5) == 0) {
+            p_ += 5;
+            v = false;
+        } else
+            return false;
+        return true;
+    }
+};
+
+/* Splits the msgpack objects received in parts */
+struct PackedSplit {
+    void append(const char* d, size_t l) {
+        unpacker_.reserve_buffer(l);
+        std::copy(d, d + l, unpacker_.buffer());
+        unpacker_.buffer_consumed(l);
     }
-    const std::string& line() const { return  line_; }
+    bool next() { return unpacker_.next(object_); }
+    const msgpack::object& object() const { return object_.get(); }
 private:
-    std::deque<char> buf_ {};
-    std::string line_ {};
+    msgpack::unpacker unpacker_ {};
+    msgpack::object_handle object_ {};
 };
 
+constexpr char CONTENT_TYPE_MSGPACK[] = "application/msgpack";
+constexpr const std::chrono::minutes PROXY_PROBE_PERIOD {1};
+/* operations on a proxy slower than this move to one at least twice as fast */
+constexpr const std::chrono::milliseconds PROXY_LATENCY_THRESHOLD {500};
+/* failures right after a switch are from the previous proxy */
+constexpr const std::chrono::seconds PROXY_SWITCH_DELAY {10};
+/* puts issued within this delay are sent in one batch request */
+constexpr const std::chrono::milliseconds BATCH_DELAY {50};
+/* permanent puts due within this window are refreshed together */
+constexpr const std::chrono::minutes REFRESH_ALIGN_WINDOW {60};
+
 std::string
 getRandomSessionId(size_t length = 8) {
     static constexpr const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789!#$%&()*+,./:;<=>?@[]^_`{|}~";
@@ -103,14 +285,36 @@ getRandomSessionId(size_t length = 8) {
     return str;
 }
 
+static std::vector<std::string>
+splitProxyList(const std::string& list)
+{
+    std::vector<std::string> urls;
+    std::istringstream is(list);
+    std::string url;
+    while (std::getline(is, url, ',')) {
+        auto begin = url.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+            continue;
+        urls.emplace_back(url.substr(begin, url.find_last_not_of(" \t") + 1 - begin));
+    }
+    return urls;
+}
+
 DhtProxyClient::DhtProxyClient() {}
 
 DhtProxyClient::DhtProxyClient(
         std::shared_ptr<dht::crypto::Certificate> serverCA, dht::crypto::Identity clientIdentity,
         std::function<void()> signal, const std::string& serverHost,
         const std::string& pushClientId, std::shared_ptr<dht::Logger> logger)
+    : DhtProxyClient(serverCA, clientIdentity, signal, splitProxyList(serverHost), pushClientId, logger)
+{}
+
+DhtProxyClient::DhtProxyClient(
+        std::shared_ptr<dht::crypto::Certificate> serverCA, dht::crypto::Identity clientIdentity,
+        std::function<void()> signal, const std::vector<std::string>& serverHosts,
+        const std::string& pushClientId, std::shared_ptr<dht::Logger> logger)
     : DhtInterface(logger)
-    , proxyUrl_(serverHost)
+    , proxyUrl_(serverHosts.empty() ? std::string{} : serverHosts.front())
     , clientIdentity_(clientIdentity), serverCertificate_(serverCA)
     , pushClientId_(pushClientId), pushSessionId_(getRandomSessionId())
     , loopSignal_(signal)
@@ -118,6 +322,8 @@ DhtProxyClient::DhtProxyClient(
 {
     jsonBuilder_["commentStyle"] = "None";
     jsonBuilder_["indentation"] = "";
+    for (const auto& url : serverHosts)
+        proxies_.emplace_back(ProxyCandidate {url});
     if (logger_) {
         if (serverCertificate_)
             logger_->d("[proxy:client] using ca certificate for ssl:\n%s",
@@ -149,16 +355,23 @@ DhtProxyClient::DhtProxyClient(
 void
 DhtProxyClient::startProxy()
 {
-    if (proxyUrl_.empty())
+    auto proxyUrl = getProxyUrl();
+    if (proxyUrl.empty())
         return;
 
     if (logger_)
-        logger_->d("[proxy:client] start proxy with %s", proxyUrl_.c_str());
+        logger_->d("[proxy:client] start proxy with %s", proxyUrl.c_str());
 
     nextProxyConfirmationTimer_ = std::make_shared<asio::steady_timer>(httpContext_, std::chrono::steady_clock::now());
     nextProxyConfirmationTimer_->async_wait(std::bind(&DhtProxyClient::handleProxyConfirm, this, std::placeholders::_1));
 
     listenerRestartTimer_ = std::make_shared<asio::steady_timer>(httpContext_);
+    batchTimer_ = std::make_shared<asio::steady_timer>(httpContext_);
+
+    if (proxies_.size() > 1) {
+        proxyProbeTimer_ = std::make_shared<asio::steady_timer>(httpContext_, std::chrono::steady_clock::now());
+        proxyProbeTimer_->async_wait(std::bind(&DhtProxyClient::probeProxies, this, std::placeholders::_1));
+    }
 
     loopSignal_();
 }
@@ -173,7 +386,7 @@ DhtProxyClient::handleProxyConfirm(const asio::error_code &ec)
             logger_->e("[proxy:client] confirm error: %s", ec.message().c_str());
         return;
     }
-    if (proxyUrl_.empty())
+    if (getProxyUrl().empty())
         return;
     getConnectivityStatus();
 }
@@ -187,7 +400,11 @@ void
 DhtProxyClient::stop()
 {
     if (not isDestroying_.exchange(true)) {
-        resolver_.reset();
+        {
+            std::lock_guard<std::mutex> l(proxyLock_);
+            resolver_.reset();
+        }
+        connectionPool_->clear();
         cancelAllListeners();
         if (infoState_)
             infoState_->cancel = true;
@@ -201,6 +418,15 @@ DhtProxyClient::stop()
         if (httpClientThread_.joinable())
             httpClientThread_.join();
         requests_.clear();
+        // the puts waiting for a batch won't be sent
+        std::vector<BatchPut> puts;
+        {
+            std::lock_guard<std::mutex> l(batchLock_);
+            puts.swap(batchPuts_);
+        }
+        for (auto& put : puts)
+            if (put.cb)
+                put.cb(false);
     }
 }
 
@@ -234,11 +460,18 @@ DhtProxyClient::cancelAllListeners()
             if (l == s.second.listeners.end())
                 return;
             l->second.opstate->stop.store(true);
-            l->second.request->cancel();
+            if (l->second.request)
+                l->second.request->cancel();
             // implicit request.reset()
             s.second.listeners.erase(token);
         });
     }
+    if (stream_) {
+        stream_->stop = true;
+        if (stream_->request)
+            stream_->request->cancel();
+        stream_.reset();
+    }
 }
 
 void
@@ -313,7 +546,6 @@ DhtProxyClient::get(const InfoHash& key, GetCallback cb, DoneCallback donecb, Va
     try {
         auto request = buildRequest("/" + key.toString());
         auto reqid = request->id();
-        //request->set_connection_type(restinio::http_connection_header_t::keep_alive);
         request->set_method(restinio::http_method_get());
         setHeaderFields(*request);
 
@@ -321,21 +553,44 @@ DhtProxyClient::get(const InfoHash& key, GetCallback cb, DoneCallback donecb, Va
         Value::Filter filter = w.empty() ? f : f.chain(w.getFilter());
 
         auto rxBuf = std::make_shared<LineSplit>();
-        request->add_on_body_callback([this, key, opstate, filter, rxBuf, cb](const char* at, size_t length){
+        auto rxParser = std::make_shared<ValueLineParser>();
+        std::shared_ptr<PackedSplit> rxPacked;
+        if (useMsgpack_) {
+            request->set_header_field(restinio::http_field_t::accept, CONTENT_TYPE_MSGPACK);
+            rxPacked = std::make_shared<PackedSplit>();
+        }
+        request->add_on_body_callback([this, key, opstate, filter, rxBuf, rxParser, rxPacked, cb](const char* at, size_t length){
             try {
+                std::vector<Sp<Value>> values;
+                if (rxPacked) {
+                    // one {"v": value} map per value
+                    rxPacked->append(at, length);
+                    while (rxPacked->next() and !opstate->stop) {
+                        if (auto v = findMapValue(rxPacked->object(), "v")) {
+                            auto value = makeValue(*v);
+                            if ((not filter or filter(*value)) and cb)
+                                values.emplace_back(std::move(value));
+                        }
+                    }
+                }
                 auto& b = *rxBuf;
-                b.append(at, length);
+                if (not rxPacked)
+                    b.append(at, length);
                 // one value per body line
-                std::vector<Sp<Value>> values;
-                while (b.getLine('\n') and !opstate->stop) {
-                    std::string err;
-                    Json::Value json;
+                while (b.getLine() and !opstate->stop) {
                     const auto& line = b.line();
-                    if (!jsonReader_->parse(line.data(), line.data() + line.size(), &json, &err)){
-                        opstate->ok.store(false);
-                        return;
+                    Sp<Value> value;
+                    if (rxParser->parse(line.data(), line.data() + line.size()))
+                        value = std::move(rxParser->value);
+                    else {
+                        std::string err;
+                        Json::Value json;
+                        if (!jsonReader_->parse(line.data(), line.data() + line.size(), &json, &err)){
+                            opstate->ok.store(false);
+                            return;
+                        }
+                        value = makeValue(json);
                     }
-                    auto value = std::make_shared<Value>(json);
                     if ((not filter or filter(*value)) and cb)
                         values.emplace_back(std::move(value));
                 }
@@ -455,14 +710,42 @@ DhtProxyClient::handleRefreshPut(const asio::error_code &ec, InfoHash key, Value
             p->second.refreshPutTimer->async_wait(std::bind(&DhtProxyClient::handleRefreshPut, this, std::placeholders::_1, key, id));
         }
     }
+    if (not useBatch_)
+        return;
+    // Refresh the puts due soon with this one, so that they are sent
+    // in the same batch and keep being refreshed together.
+    auto due = std::chrono::steady_clock::now() + REFRESH_ALIGN_WINDOW;
+    for (auto& s : searches_) {
+        for (auto& put : s.second.puts) {
+            if ((s.first == key and put.first == id) or not put.second.refreshPutTimer
+                or put.second.refreshPutTimer->expiry() > due)
+                continue;
+            doPut(s.first, put.second.value, [ok = put.second.ok](bool result){
+                *ok = result;
+            }, time_point::max(), true);
+            put.second.refreshPutTimer->expires_after(proxy::OP_TIMEOUT - proxy::OP_MARGIN);
+            put.second.refreshPutTimer->async_wait(std::bind(&DhtProxyClient::handleRefreshPut, this,
+                                                   std::placeholders::_1, s.first, put.first));
+        }
+    }
 }
 
 std::shared_ptr<http::Request>
 DhtProxyClient::buildRequest(const std::string& target)
 {
-    auto resolver = resolver_;
-    if (not resolver)
-        resolver = std::make_shared<http::Resolver>(httpContext_, proxyUrl_, logger_);
+    std::shared_ptr<http::Resolver> resolver;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        resolver = resolver_;
+        if (not resolver)
+            resolver = std::make_shared<http::Resolver>(httpContext_, proxyUrl_, logger_);
+    }
+    return buildRequest(resolver, target);
+}
+
+std::shared_ptr<http::Request>
+DhtProxyClient::buildRequest(const std::shared_ptr<http::Resolver>& resolver, const std::string& target)
+{
     auto request = target.empty()
         ? std::make_shared<http::Request>(httpContext_, resolver)
         : std::make_shared<http::Request>(httpContext_, resolver, target);
@@ -471,11 +754,158 @@ DhtProxyClient::buildRequest(const std::string& target)
     if (clientIdentity_.first and clientIdentity_.second)
         request->set_identity(clientIdentity_);
     request->set_header_field(restinio::http_field_t::user_agent, "RESTinio client");
+    request->set_connection_type(restinio::http_connection_header_t::keep_alive);
+    request->set_connection_pool(connectionPool_);
     return request;
 }
 
 void
 DhtProxyClient::doPut(const InfoHash& key, Sp<Value> val, DoneCallbackSimple cb, time_point /*created*/, bool permanent)
+{
+    if (useBatch_) {
+        std::unique_lock<std::mutex> l(batchLock_);
+        if (isDestroying_) {
+            // stop() already failed the queued puts
+            l.unlock();
+            if (cb)
+                cb(false);
+            return;
+        }
+        batchPuts_.emplace_back(BatchPut {key, std::move(val), std::move(cb), permanent});
+        if (batchPuts_.size() == 1) {
+            httpContext_.post([this]{
+                if (isDestroying_)
+                    return;
+                if (not batchTimer_) {
+                    flushPuts({});
+                    return;
+                }
+                batchTimer_->expires_after(BATCH_DELAY);
+                batchTimer_->async_wait(std::bind(&DhtProxyClient::flushPuts, this, std::placeholders::_1));
+            });
+        }
+        return;
+    }
+    sendPut(key, std::move(val), std::move(cb), permanent);
+}
+
+void
+DhtProxyClient::onPutResult(const InfoHash& key, const Sp<Value>& val, Value::Id id, bool permanent)
+{
+    val->id = id;
+    if (not permanent)
+        return;
+    std::lock_guard<std::mutex> lock(searchLock_);
+    auto& search = searches_[key];
+    auto it = search.pendingPuts.find(val);
+    if (it != search.pendingPuts.end()) {
+        auto sok = std::make_shared<std::atomic_bool>(true);
+        auto refreshPutTimer = std::make_unique<asio::steady_timer>(httpContext_, proxy::OP_TIMEOUT - proxy::OP_MARGIN);
+        refreshPutTimer->async_wait(std::bind(&DhtProxyClient::handleRefreshPut, this, std::placeholders::_1, key, id));
+        search.puts.emplace(std::piecewise_construct,
+            std::forward_as_tuple(id),
+            std::forward_as_tuple(val, std::move(refreshPutTimer), sok));
+        search.pendingPuts.erase(it);
+    }
+}
+
+void
+DhtProxyClient::flushPuts(const asio::error_code& ec)
+{
+    if (ec == asio::error::operation_aborted)
+        return;
+    std::vector<BatchPut> puts;
+    {
+        std::lock_guard<std::mutex> l(batchLock_);
+        puts.swap(batchPuts_);
+    }
+    if (puts.size() == 1) {
+        auto& put = puts.front();
+        sendPut(put.key, std::move(put.value), std::move(put.cb), put.permanent);
+    } else if (not puts.empty())
+        sendBatch(std::move(puts));
+}
+
+void
+DhtProxyClient::sendBatch(std::vector<BatchPut>&& batch)
+{
+    if (logger_)
+        logger_->d("[proxy:client] [put] sending %zu puts in a batch", batch.size());
+    auto puts = std::make_shared<std::vector<BatchPut>>(std::move(batch));
+    try {
+        Json::Value refresh;
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+        if (not deviceKey_.empty())
+            getPushRequest(refresh);
+#endif
+        // [{"op":"put","key":"<hash>","value":{...},"permanent":true or the push request}, ...]
+        Json::Value ops(Json::arrayValue);
+        for (const auto& put : *puts) {
+            Json::Value op;
+            op["op"] = "put";
+            op["key"] = put.key.toString();
+            op["value"] = put.value->toJson();
+            if (put.permanent)
+                op["permanent"] = refresh.isObject() ? refresh : Json::Value(true);
+            ops.append(std::move(op));
+        }
+
+        auto request = buildRequest("/batch");
+        auto reqid = request->id();
+        request->set_method(restinio::http_method_post());
+        setHeaderFields(*request);
+        request->set_body(Json::writeString(jsonBuilder_, ops));
+        request->add_on_done_callback([this, reqid, puts] (const http::Response& response){
+            Json::Value results;
+            if (response.status_code == 200) {
+                std::string err;
+                if (not jsonReader_->parse(response.body.data(), response.body.data() + response.body.size(), &results, &err)
+                    or not results.isArray())
+                {
+                    if (logger_)
+                        logger_->e("[proxy:client] [put] failed to parse batch results from server");
+                    results = Json::Value();
+                }
+            } else {
+                if (logger_)
+                    logger_->e("[proxy:client] [status] failed with code=%i", response.status_code);
+                if (not response.aborted and response.status_code == 0)
+                    opFailed();
+            }
+            for (Json::ArrayIndex i = 0; i < puts->size(); i++) {
+                auto& put = (*puts)[i];
+                bool ok = false;
+                if (results.isArray() and i < results.size()) {
+                    const auto& result = results[i];
+                    ok = result["ok"].asBool();
+                    if (ok and put.value->id == Value::INVALID_ID and result.isMember("id")) {
+                        try {
+                            onPutResult(put.key, put.value, std::stoull(result["id"].asString()), put.permanent);
+                        } catch (const std::exception&) {}
+                    }
+                }
+                if (put.cb)
+                    put.cb(ok);
+            }
+            if (not isDestroying_) {
+                std::lock_guard<std::mutex> l(requestLock_);
+                requests_.erase(reqid);
+            }
+        });
+        {
+            std::lock_guard<std::mutex> l(requestLock_);
+            requests_[reqid] = request;
+        }
+        request->send();
+    }
+    catch (const std::exception &e){
+        if (logger_)
+            logger_->e("[proxy:client] [put] batch error: %s", e.what());
+    }
+}
+
+void
+DhtProxyClient::sendPut(const InfoHash& key, Sp<Value> val, DoneCallbackSimple cb, bool permanent)
 {
     if (logger_)
         logger_->d("[proxy:client] [put] [search %s] executing for %s", key.to_c_str(), val->toString().c_str());
@@ -486,45 +916,64 @@ DhtProxyClient::doPut(const InfoHash& key, Sp<Value> val, DoneCallbackSimple cb,
         request->set_method(restinio::http_method_post());
         setHeaderFields(*request);
 
-        auto json = val->toJson();
-        if (permanent) {
-            if (deviceKey_.empty()) {
-                json["permanent"] = true;
-            } else {
+        Json::Value refresh;
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
-                Json::Value refresh;
-                getPushRequest(refresh);
-                json["permanent"] = refresh;
-#else
-                json["permanent"] = true;
+        if (permanent and not deviceKey_.empty())
+            getPushRequest(refresh);
 #endif
+        bool packed = useMsgpack_;
+        if (packed) {
+            // {"v": value, "permanent": true or the push request}
+            msgpack::sbuffer buffer;
+            msgpack::packer<msgpack::sbuffer> pk(&buffer);
+            pk.pack_map(permanent ? 2 : 1);
+            pk.pack("v"); pk.pack(*val);
+            if (permanent) {
+                pk.pack("permanent");
+                if (refresh.isObject()) {
+                    pk.pack_map(refresh.size());
+                    for (const auto& name : refresh.getMemberNames()) {
+                        pk.pack(name);
+                        pk.pack(refresh[name].asString());
+                    }
+                } else
+                    pk.pack(true);
             }
+            request->set_header_field(restinio::http_field_t::content_type, CONTENT_TYPE_MSGPACK);
+            request->set_header_field(restinio::http_field_t::accept, CONTENT_TYPE_MSGPACK);
+            request->set_body(std::string(buffer.data(), buffer.size()));
+        } else {
+            auto json = val->toJson();
+            if (permanent)
+                json["permanent"] = refresh.isObject() ? refresh : Json::Value(true);
+            request->set_body(Json::writeString(jsonBuilder_, json));
         }
-        request->set_body(Json::writeString(jsonBuilder_, json));
-        request->add_on_done_callback([this, reqid, cb, val, key, permanent] (const http::Response& response){
+        request->add_on_done_callback([this, reqid, cb, val, key, permanent, packed] (const http::Response& response){
             bool ok = response.status_code == 200;
             if (ok) {
                 if (val->id == Value::INVALID_ID) {
-                    std::string err;
-                    Json::Value parsedValue;
-                    if (jsonReader_->parse(response.body.data(), response.body.data() + response.body.size(), &parsedValue, &err)){
-                        auto id = dht::Value(parsedValue).id;
-                        val->id = id;
-                        if (permanent) {
-                            std::lock_guard<std::mutex> lock(searchLock_);
-                            auto& search = searches_[key];
-                            auto it = search.pendingPuts.find(val);
-                            if (it != search.pendingPuts.end()) {
-                                auto sok = std::make_shared<std::atomic_bool>(ok);
-                                auto refreshPutTimer = std::make_unique<asio::steady_timer>(httpContext_, proxy::OP_TIMEOUT - proxy::OP_MARGIN);
-                                refreshPutTimer->async_wait(std::bind(&DhtProxyClient::handleRefreshPut, this, std::placeholders::_1, key, id));
-                                search.puts.emplace(std::piecewise_construct,
-                                    std::forward_as_tuple(id),
-                                    std::forward_as_tuple(val, std::move(refreshPutTimer), sok));
-                                search.pendingPuts.erase(it);
+                    // the proxy replies with the value put
+                    bool parsed = false;
+                    Value::Id id = Value::INVALID_ID;
+                    if (packed) {
+                        try {
+                            auto msg = msgpack::unpack(response.body.data(), response.body.size());
+                            if (auto v = findMapValue(msg.get(), "v")) {
+                                id = dht::Value(*v).id;
+                                parsed = true;
                             }
-                        }
+                        } catch (const std::exception&) {}
                     } else {
+                        std::string err;
+                        Json::Value parsedValue;
+                        if (jsonReader_->parse(response.body.data(), response.body.data() + response.body.size(), &parsedValue, &err)) {
+                            id = dht::Value(parsedValue).id;
+                            parsed = true;
+                        }
+                    }
+                    if (parsed)
+                        onPutResult(key, val, id, permanent);
+                    else {
                         if (logger_)
                             logger_->e("[proxy:client] [status] failed to parse value from  server", response.status_code);
                     }
@@ -623,10 +1072,14 @@ DhtProxyClient::getProxyInfos()
     if (logger_)
         logger_->d("[proxy:client] [status] sending request");
 
-    auto resolver = std::make_shared<http::Resolver>(httpContext_, proxyUrl_, logger_);
+    std::shared_ptr<http::Resolver> resolver;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        resolver = std::make_shared<http::Resolver>(httpContext_, proxyUrl_, logger_);
+        resolver_ = resolver;
+    }
     queryProxyInfo(infoState, resolver, AF_INET);
     queryProxyInfo(infoState, resolver, AF_INET6);
-    resolver_ = resolver;
 }
 
 void
@@ -696,6 +1149,16 @@ DhtProxyClient::onProxyInfos(const Json::Value& proxyInfos, const sa_family_t fa
                        family == AF_INET ? "ipv4" : "ipv6");
         try {
             myid = InfoHash(proxyInfos["node_id"].asString());
+            bool msgpack = false;
+            for (const auto& format : proxyInfos["formats"])
+                if (format.asString() == "msgpack")
+                    msgpack = true;
+            useMsgpack_ = msgpack;
+            bool batch = false;
+            for (const auto& format : proxyInfos["formats"])
+                if (format.asString() == "batch")
+                    batch = true;
+            useBatch_ = batch;
             stats4_ = NodeStats(proxyInfos["ipv4"]);
             stats6_ = NodeStats(proxyInfos["ipv6"]);
             if (stats4_.good_nodes + stats6_.good_nodes)
@@ -726,6 +1189,8 @@ DhtProxyClient::onProxyInfos(const Json::Value& proxyInfos, const sa_family_t fa
         nextProxyConfirmationTimer_->async_wait(std::bind(&DhtProxyClient::handleProxyConfirm, this, std::placeholders::_1));
     }
     else if (newStatus == NodeStatus::Disconnected) {
+        if (proxies_.size() > 1)
+            httpContext_.post([this]{ onProxyFailed(); });
         nextProxyConfirmationTimer_->expires_at(std::chrono::steady_clock::now() + std::chrono::minutes(1));
         nextProxyConfirmationTimer_->async_wait(std::bind(&DhtProxyClient::handleProxyConfirm, this, std::placeholders::_1));
     }
@@ -813,26 +1278,304 @@ DhtProxyClient::listen(const InfoHash& key, ValueCallback cb, Value::Filter filt
             l->second.refreshSubscriberTimer->async_wait(std::bind(&DhtProxyClient::handleResubscribe, this,
                                                          std::placeholders::_1, key, token, opstate));
         }
-        ListenMethod method;
+        if (deviceKey_.empty()) {
+            startListen(key, token, l->second);
+            return token;
+        }
         restinio::http_request_header_t header;
-        if (deviceKey_.empty()){ // listen
-            method = ListenMethod::LISTEN;
+        header.method(restinio::http_method_subscribe());
+        header.request_target("/" + key.toString());
+        sendListen(header, l->second.cb, opstate, l->second, ListenMethod::SUBSCRIBE);
+        return token;
+    });
+}
+
+void
+DhtProxyClient::startListen(const InfoHash& key, size_t token, Listener& listener, bool stream)
+{
+    if (stream and not streamUnsupported_) {
+        listener.streamed = true;
+        // the key is listened once on the stream for all its listeners
+        auto search = searches_.find(key);
+        if (search != searches_.end())
+            for (const auto& l : search->second.listeners)
+                if (l.first != token and l.second.streamed)
+                    return;
+        Json::Value op;
+        op["op"] = "listen";
+        op["key"] = key.toString();
+        streamSend(std::move(op));
+        return;
+    }
+    listener.streamed = false;
+    restinio::http_request_header_t header;
 #ifdef OPENDHT_PROXY_HTTP_PARSER_FORK
-            header.method(restinio::method_listen);
-            header.request_target("/" + key.toString());
+    header.method(restinio::method_listen);
+    header.request_target("/" + key.toString());
 #else
-            header.method(restinio::http_method_get());
-            header.request_target("/key/" + key.toString() + "/listen");
+    header.method(restinio::http_method_get());
+    header.request_target("/key/" + key.toString() + "/listen");
 #endif
+    sendListen(header, listener.cb, listener.opstate, listener, ListenMethod::LISTEN);
+}
+
+void
+DhtProxyClient::streamSend(Json::Value&& op)
+{
+    if (not stream_)
+        openStream();
+    stream_->pending.append(std::move(op));
+    flushStream();
+}
+
+void
+DhtProxyClient::openStream()
+{
+    if (logger_)
+        logger_->d("[proxy:client] [stream] opening");
+    auto stream = std::make_shared<Stream>();
+    stream_ = stream;
+    std::weak_ptr<Stream> w = stream;
+    try {
+        auto request = buildRequest("/stream/open");
+        auto reqid = request->id();
+        stream->request = request;
+        request->set_method(restinio::http_method_get());
+        setHeaderFields(*request);
+        request->set_connection_type(restinio::http_connection_header_t::keep_alive);
+        auto rxBuf = std::make_shared<LineSplit>();
+        auto rxParser = std::make_shared<ValueLineParser>();
+        std::shared_ptr<PackedSplit> rxPacked;
+        if (useMsgpack_) {
+            request->set_header_field(restinio::http_field_t::accept, CONTENT_TYPE_MSGPACK);
+            rxPacked = std::make_shared<PackedSplit>();
         }
-        else {
-            method = ListenMethod::SUBSCRIBE;
-            header.method(restinio::http_method_subscribe());
-            header.request_target("/" + key.toString());
+        request->add_on_body_callback([this, w, rxBuf, rxParser, rxPacked, reqid](const char* at, size_t length){
+            try {
+                if (rxPacked) {
+                    rxPacked->append(at, length);
+                    while (rxPacked->next()) {
+                        auto s = w.lock();
+                        if (not s or s->stop)
+                            return;
+                        const auto& o = rxPacked->object();
+                        if (auto id = findMapValue(o, "stream")) {
+                            std::lock_guard<std::mutex> lock(searchLock_);
+                            if (stream_ == s) {
+                                s->id = id->as<std::string>();
+                                if (logger_)
+                                    logger_->d("[proxy:client] [stream %s] opened", s->id.c_str());
+                                flushStream();
+                            }
+                        } else if (findMapValue(o, "put")) {
+                            continue;
+                        } else if (auto v = findMapValue(o, "v")) {
+                            auto key = findMapValue(o, "key");
+                            auto exp = findMapValue(o, "exp");
+                            if (key)
+                                onStreamValue(InfoHash(*key), makeValue(*v), exp and exp->as<bool>());
+                        }
+                    }
+                    return;
+                }
+                auto& b = *rxBuf;
+                b.append(at, length);
+                while (b.getLine()) {
+                    auto s = w.lock();
+                    if (not s or s->stop)
+                        return;
+                    const auto& line = b.line();
+                    if (rxParser->parse(line.data(), line.data() + line.size())) {
+                        if (rxParser->key)
+                            onStreamValue(rxParser->key, std::move(rxParser->value), rxParser->expired);
+                        continue;
+                    }
+                    std::string err;
+                    Json::Value json;
+                    if (!jsonReader_->parse(line.data(), line.data() + line.size(), &json, &err))
+                        return;
+                    if (json.isMember("stream")) {
+                        std::lock_guard<std::mutex> lock(searchLock_);
+                        if (stream_ == s) {
+                            s->id = json["stream"].asString();
+                            if (logger_)
+                                logger_->d("[proxy:client] [stream %s] opened", s->id.c_str());
+                            flushStream();
+                        }
+                    } else if (json.isMember("key") and not json.isMember("put"))
+                        onStreamValue(InfoHash(json["key"].asString()), makeValue(json),
+                                      json.get("expired", Json::Value(false)).asBool());
+                }
+            } catch(const std::exception& e) {
+                if (logger_)
+                    logger_->e("[proxy:client] [stream] request #%i error in parsing: %s", reqid, e.what());
+            }
+        });
+        request->add_on_done_callback([this, w, reqid] (const http::Response& response) {
+            if (isDestroying_)
+                return;
+            {
+                std::lock_guard<std::mutex> l(requestLock_);
+                requests_.erase(reqid);
+            }
+            httpContext_.post([this, w, status = response.status_code, aborted = response.aborted]{
+                onStreamClosed(w, status, aborted);
+            });
+        });
+        {
+            std::lock_guard<std::mutex> l(requestLock_);
+            requests_[reqid] = request;
         }
-        sendListen(header, l->second.cb, opstate, l->second, method);
-        return token;
-    });
+        request->send();
+    }
+    catch (const std::exception &e){
+        if (logger_)
+            logger_->e("[proxy:client] [stream] request failed: %s", e.what());
+    }
+}
+
+void
+DhtProxyClient::flushStream()
+{
+    auto& stream = *stream_;
+    if (stream.id.empty() or stream.pending.empty())
+        return;
+    auto ops = std::make_shared<Json::Value>(Json::arrayValue);
+    std::swap(*ops, stream.pending);
+    std::weak_ptr<Stream> w = stream_;
+    try {
+        auto request = buildRequest("/stream/" + stream.id);
+        auto reqid = request->id();
+        request->set_method(restinio::http_method_post());
+        setHeaderFields(*request);
+        request->set_body(Json::writeString(jsonBuilder_, *ops));
+        request->add_on_done_callback([this, reqid, w, ops] (const http::Response& response) {
+            if (response.status_code != 200) {
+                if (logger_)
+                    logger_->e("[proxy:client] [stream] send request #%i failed with code=%i",
+                                reqid, response.status_code);
+                // the operations are lost: the stream is reopened with the listeners
+                if (not response.aborted)
+                    opFailed();
+            } else if (not isDestroying_)
+                onStreamResults(w, *ops, response.body);
+            if (not isDestroying_) {
+                std::shared_ptr<http::Request> request;
+                std::lock_guard<std::mutex> l(requestLock_);
+                auto it = requests_.find(reqid);
+                if (it != requests_.end()) {
+                    request = std::move(it->second);
+                    requests_.erase(it);
+                }
+            }
+        });
+        {
+            std::lock_guard<std::mutex> l(requestLock_);
+            requests_[reqid] = request;
+        }
+        request->send();
+    }
+    catch (const std::exception &e){
+        if (logger_)
+            logger_->e("[proxy:client] [stream] request failed: %s", e.what());
+    }
+}
+
+void
+DhtProxyClient::onStreamResults(const std::weak_ptr<Stream>& w, const Json::Value& ops, const std::string& body)
+{
+    // [{"ok":true}, {"ok":false,"err":"..."}, ...], in the order of the operations
+    std::string err;
+    Json::Value results;
+    if (not jsonReader_->parse(body.data(), body.data() + body.size(), &results, &err)
+        or not results.isArray())
+    {
+        if (logger_)
+            logger_->e("[proxy:client] [stream] failed to parse operation results");
+        opFailed();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(searchLock_);
+    auto stream = w.lock();
+    // a reopened stream listens again for all the listeners
+    if (not stream or stream != stream_ or stream->stop)
+        return;
+    for (Json::ArrayIndex i = 0; i < ops.size(); i++) {
+        const auto& op = ops[i];
+        if (op["op"].asString() != "listen")
+            continue;
+        if (i < results.size() and results[i]["ok"].asBool())
+            continue;
+        // the proxy refused to listen on the stream, listen with a request for the key
+        InfoHash key(op["key"].asString());
+        if (logger_)
+            logger_->w("[proxy:client] [stream %s] listen %s failed: %s", stream->id.c_str(), key.to_c_str(),
+                       i < results.size() ? results[i]["err"].asString().c_str() : "no result");
+        auto search = searches_.find(key);
+        if (search == searches_.end())
+            continue;
+        for (auto& l : search->second.listeners)
+            if (l.second.streamed)
+                startListen(key, l.first, l.second, false);
+    }
+}
+
+void
+DhtProxyClient::onStreamValue(const InfoHash& key, Sp<Value> value, bool expired)
+{
+    std::vector<std::function<void()>> cbs;
+    {
+        std::lock_guard<std::mutex> lock(searchLock_);
+        auto search = searches_.find(key);
+        if (search == searches_.end())
+            return;
+        for (const auto& l : search->second.listeners) {
+            if (not l.second.streamed)
+                continue;
+            cbs.emplace_back([cb = l.second.cb, opstate = l.second.opstate, value, expired]() {
+                if (not opstate->stop.load() and not cb({value}, expired, system_clock::time_point::min()))
+                    opstate->stop.store(true);
+            });
+        }
+    }
+    if (cbs.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(lockCallbacks_);
+        for (auto& cb : cbs)
+            callbacks_.emplace_back(std::move(cb));
+    }
+    loopSignal_();
+}
+
+void
+DhtProxyClient::onStreamClosed(const std::weak_ptr<Stream>& w, unsigned status_code, bool aborted)
+{
+    if (isDestroying_)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(searchLock_);
+        auto stream = w.lock();
+        if (not stream or stream != stream_ or stream->stop)
+            return;
+        stream_.reset();
+        if (stream->id.empty() and status_code != 0 and status_code != 200) {
+            // the proxy doesn't provide streams, listen with a request per key
+            if (logger_)
+                logger_->w("[proxy:client] [stream] not supported by the proxy (code=%i)", status_code);
+            streamUnsupported_ = true;
+            for (auto& search : searches_)
+                for (auto& l : search.second.listeners)
+                    if (l.second.streamed)
+                        startListen(search.first, l.first, l.second);
+            return;
+        }
+        if (logger_)
+            logger_->w("[proxy:client] [stream] closed (code=%i)", status_code);
+    }
+    // listeners are restarted once the proxy is reachable
+    if (not aborted)
+        opFailed();
 }
 
 void
@@ -947,11 +1690,25 @@ DhtProxyClient::handleExpireListener(const asio::error_code &ec, const InfoHash&
                 if (logger_)
                      logger_->e("[proxy:client] [unsubscribe %s] failed: %s", key.to_c_str(), e.what());
             }
-        } else {
+        } else if (not listener.streamed) {
             // stop the request
             listener.request.reset();
         }
+        bool streamed = listener.streamed;
         search->second.listeners.erase(it);
+        if (streamed and stream_) {
+            // cancel the stream listen with the last listener of the key
+            bool last = true;
+            for (const auto& l : search->second.listeners)
+                if (l.second.streamed)
+                    last = false;
+            if (last) {
+                Json::Value op;
+                op["op"] = "cancel";
+                op["key"] = key.toString();
+                streamSend(std::move(op));
+            }
+        }
         if (logger_)
             logger_->d("[proxy:client] [listen:cancel] [search %s] %zu listener remaining",
                     key.to_c_str(), search->second.listeners.size());
@@ -989,27 +1746,35 @@ DhtProxyClient::sendListen(const restinio::http_request_header_t& header,
         request->set_body(body);
 #endif
         auto rxBuf = std::make_shared<LineSplit>();
-        request->add_on_body_callback([this, reqid, opstate, rxBuf, cb](const char* at, size_t length){
+        auto rxParser = std::make_shared<ValueLineParser>();
+        request->add_on_body_callback([this, reqid, opstate, rxBuf, rxParser, cb](const char* at, size_t length){
             try {
                 auto& b = *rxBuf;
                 b.append(at, length);
 
                 // one value per body line
-                while (b.getLine('\n') and !opstate->stop) {
-                    std::string err;
-                    Json::Value json;
+                while (b.getLine() and !opstate->stop) {
                     const auto& line = b.line();
-                    if (!jsonReader_->parse(line.data(), line.data() + line.size(), &json, &err)){
-                        opstate->ok.store(false);
-                        return;
-                    }
-                    if (json.size() == 0) { // it's the end
-                        break;
+                    Sp<Value> value;
+                    bool expired;
+                    if (rxParser->parse(line.data(), line.data() + line.size())) {
+                        if (rxParser->fields == 0) // it's the end
+                            break;
+                        value = std::move(rxParser->value);
+                        expired = rxParser->expired;
+                    } else {
+                        std::string err;
+                        Json::Value json;
+                        if (!jsonReader_->parse(line.data(), line.data() + line.size(), &json, &err)){
+                            opstate->ok.store(false);
+                            return;
+                        }
+                        if (json.size() == 0) // it's the end
+                            break;
+                        value = makeValue(json);
+                        expired = json.get("expired", Json::Value(false)).asBool();
                     }
-
-                    auto value = std::make_shared<Value>(json);
                     if (cb){
-                        auto expired = json.get("expired", Json::Value(false)).asBool();
                         {
                             std::lock_guard<std::mutex> lock(lockCallbacks_);
                             callbacks_.emplace_back([cb, value, opstate, expired]() {
@@ -1052,6 +1817,174 @@ DhtProxyClient::sendListen(const restinio::http_request_header_t& header,
     }
 }
 
+void
+DhtProxyClient::resetConnections(const std::string& proxyUrl)
+{
+    // connections and addresses from before a network change are likely stale
+    connectionPool_->clear();
+    http::Url url(proxyUrl);
+    http::ResolverCache::instance().erase(url.host, url.service.empty() ? url.protocol : url.service);
+}
+
+std::string
+DhtProxyClient::getProxyUrl() const
+{
+    std::lock_guard<std::mutex> l(proxyLock_);
+    return proxyUrl_;
+}
+
+void
+DhtProxyClient::probeProxies(const asio::error_code& ec)
+{
+    if (ec == asio::error::operation_aborted or isDestroying_)
+        return;
+    std::vector<std::string> urls;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        for (const auto& proxy : proxies_)
+            urls.emplace_back(proxy.url);
+    }
+    for (size_t i = 0; i < urls.size(); i++) {
+        try {
+            auto request = buildRequest(std::make_shared<http::Resolver>(httpContext_, urls[i], logger_), {});
+            auto reqid = request->id();
+            request->set_method(restinio::http_method_get());
+            setHeaderFields(*request);
+            auto start = std::chrono::steady_clock::now();
+            request->add_on_done_callback([this, reqid, i, start](const http::Response& response) {
+                auto latency = std::chrono::steady_clock::now() - start;
+                if (not response.aborted) {
+                    bool ok = false;
+                    if (response.status_code == 200) {
+                        std::string err;
+                        Json::Value proxyInfos;
+                        ok = jsonReader_->parse(response.body.data(), response.body.data() + response.body.size(), &proxyInfos, &err)
+                         and proxyInfos.isMember("node_id");
+                    }
+                    onProxyProbe(i, ok, latency);
+                }
+                if (not isDestroying_) {
+                    std::lock_guard<std::mutex> l(requestLock_);
+                    requests_.erase(reqid);
+                }
+            });
+            {
+                std::lock_guard<std::mutex> l(requestLock_);
+                requests_[reqid] = request;
+            }
+            request->send();
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->e("[proxy:client] [probe] error sending request to %s: %s", urls[i].c_str(), e.what());
+        }
+    }
+    proxyProbeTimer_->expires_at(std::chrono::steady_clock::now() + PROXY_PROBE_PERIOD);
+    proxyProbeTimer_->async_wait(std::bind(&DhtProxyClient::probeProxies, this, std::placeholders::_1));
+}
+
+void
+DhtProxyClient::onProxyProbe(size_t index, bool ok, std::chrono::steady_clock::duration latency)
+{
+    if (isDestroying_)
+        return;
+    size_t next;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        if (index >= proxies_.size())
+            return;
+        auto& proxy = proxies_[index];
+        proxy.healthy = ok;
+        if (ok)
+            proxy.latency = proxy.latency == std::chrono::steady_clock::duration::max()
+                ? latency : (3 * proxy.latency + latency) / 4;
+        if (logger_)
+            logger_->d("[proxy:client] [probe] %s: %s, %lld ms", proxy.url.c_str(), ok ? "ok" : "failed",
+                (long long)std::chrono::duration_cast<std::chrono::milliseconds>(proxy.latency).count());
+        next = selectProxy(index == currentProxy_ and not ok);
+    }
+    if (next < proxies_.size())
+        switchProxy(next);
+}
+
+size_t
+DhtProxyClient::selectProxy(bool failed) const
+{
+    if (std::chrono::steady_clock::now() < lastProxySwitch_ + PROXY_SWITCH_DELAY)
+        return proxies_.size();
+    const auto& current = proxies_[currentProxy_];
+    size_t best = proxies_.size();
+    for (size_t i = 0; i < proxies_.size(); i++) {
+        const auto& proxy = proxies_[i];
+        if (i == currentProxy_ or not proxy.healthy)
+            continue;
+        // a proxy not probed yet is only tried if the current one failed
+        if (not failed and proxy.latency == std::chrono::steady_clock::duration::max())
+            continue;
+        if (best == proxies_.size() or proxy.latency < proxies_[best].latency)
+            best = i;
+    }
+    if (best == proxies_.size() or failed)
+        return best;
+    auto latency = current.latency;
+    if (current.healthy and latency != std::chrono::steady_clock::duration::max()
+        and (latency < PROXY_LATENCY_THRESHOLD or proxies_[best].latency * 2 > latency))
+        return proxies_.size();
+    return best;
+}
+
+void
+DhtProxyClient::switchProxy(size_t index)
+{
+    std::string oldUrl;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        if (index >= proxies_.size() or index == currentProxy_)
+            return;
+        oldUrl = std::move(proxyUrl_);
+        currentProxy_ = index;
+        proxyUrl_ = proxies_[index].url;
+        resolver_.reset();
+        lastProxySwitch_ = std::chrono::steady_clock::now();
+        if (logger_)
+            logger_->w("[proxy:client] switching from proxy %s to %s", oldUrl.c_str(), proxyUrl_.c_str());
+    }
+    resetConnections(oldUrl);
+    {
+        // subscriptions are made again on the new proxy
+        std::lock_guard<std::mutex> l(searchLock_);
+        for (auto& search : searches_)
+            for (auto& listener : search.second.listeners)
+                if (listener.second.opstate)
+                    listener.second.opstate->ok = false;
+    }
+    {
+        // listeners and permanent puts move once the new proxy is connected
+        std::lock_guard<std::mutex> l(lockCurrentProxyInfos_);
+        statusIpv4_ = NodeStatus::Disconnected;
+        statusIpv6_ = NodeStatus::Disconnected;
+    }
+    getConnectivityStatus();
+    loopSignal_();
+}
+
+void
+DhtProxyClient::onProxyFailed()
+{
+    if (isDestroying_)
+        return;
+    size_t next;
+    {
+        std::lock_guard<std::mutex> l(proxyLock_);
+        if (proxies_.size() < 2)
+            return;
+        next = selectProxy(true);
+        if (next < proxies_.size())
+            proxies_[currentProxy_].healthy = false;
+    }
+    if (next < proxies_.size())
+        switchProxy(next);
+}
+
 void
 DhtProxyClient::opFailed()
 {
@@ -1059,6 +1992,11 @@ DhtProxyClient::opFailed()
         return;
     if (logger_)
         logger_->e("[proxy:client] proxy request failed");
+    if (proxies_.size() > 1) {
+        // callers may hold locks taken by switchProxy
+        httpContext_.post([this]{ onProxyFailed(); });
+    }
+    resetConnections(getProxyUrl());
     {
         std::lock_guard<std::mutex> l(lockCurrentProxyInfos_);
         statusIpv4_ = NodeStatus::Disconnected;
@@ -1125,10 +2063,21 @@ DhtProxyClient::restartListeners(const asio::error_code &ec)
             auto& listener = l.second;
             if (auto opstate = listener.opstate)
                 opstate->stop = true;
-            listener.request->cancel();
-            listener.request.reset();
+            if (listener.request) {
+                listener.request->cancel();
+                listener.request.reset();
+            }
+            listener.streamed = false;
         }
     }
+    if (stream_) {
+        stream_->stop = true;
+        if (stream_->request)
+            stream_->request->cancel();
+        stream_.reset();
+    }
+    // the proxy may have changed, try the stream again
+    streamUnsupported_ = false;
     for (auto& search: searches_) {
         for (auto& l: search.second.listeners) {
             auto& listener = l.second;
@@ -1136,17 +2085,7 @@ DhtProxyClient::restartListeners(const asio::error_code &ec)
             // Redo listen
             opstate->stop.store(false);
             opstate->ok.store(true);
-            auto cb = listener.cb;
-            // define header
-            restinio::http_request_header_t header;
-#ifdef OPENDHT_PROXY_HTTP_PARSER_FORK
-            header.method(restinio::method_listen);
-            header.request_target("/" + search.first.toString());
-#else
-            header.method(restinio::http_method_get());
-            header.request_target("/key/" + search.first.toString() + "/listen");
-#endif
-            sendListen(header, cb, opstate, listener, ListenMethod::LISTEN);
+            startListen(search.first, l.first, listener);
         }
     }
 }
@@ -31,10 +31,12 @@
 #include <json/json.h>
 
 #include <chrono>
+#include <cstdio>
 #include <functional>
 #include <limits>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 using namespace std::placeholders;
 using namespace std::chrono_literals;
@@ -65,6 +67,8 @@ constexpr char RESP_MSG_SERVICE_UNAVAILABLE[] = "{\"err\":\"Incorrect DhtRunner\
 constexpr char RESP_MSG_INTERNAL_SERVER_ERRROR[] = "{\"err\":\"Internal server error\"}";
 constexpr char RESP_MSG_MISSING_PARAMS[] = "{\"err\":\"Missing parameters\"}";
 constexpr char RESP_MSG_PUT_FAILED[] = "{\"err\":\"Put failed\"}";
+constexpr char RESP_MSG_STREAM_NOT_FOUND[] = "{\"err\":\"Stream not found\"}";
+constexpr char RESP_MSG_TOO_MANY_REQUESTS[] = "{\"err\":\"Too many requests\"}";
 #ifdef OPENDHT_PROXY_SERVER_IDENTITY
 constexpr char RESP_MSG_DESTINATION_NOT_FOUND[] = "{\"err\":\"No destination found\"}";
 #endif
@@ -73,10 +77,33 @@ constexpr char RESP_MSG_NO_TOKEN[] = "{\"err\":\"No token\"}";
 #endif
 
 constexpr const std::chrono::minutes PRINT_STATS_PERIOD {2};
+constexpr char CONTENT_TYPE_MSGPACK[] = "application/msgpack";
+constexpr const std::chrono::milliseconds RESTORE_PERIOD {100};
+/* version of the state format, older states are msgpack maps */
+constexpr unsigned STATE_VERSION {1};
+/* maximum number of operations in a batch request */
+constexpr unsigned MAX_BATCH_OPS {256};
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+constexpr const std::chrono::milliseconds PUSH_BATCH_DELAY {100};
+#endif
 
 using ResponseByParts = restinio::chunked_output_t;
 using ResponseByPartsBuilder = restinio::response_builder_t<ResponseByParts>;
 
+/** @return true if the client accepts msgpack responses */
+static bool
+acceptsMsgpack(const restinio::request_t& request)
+{
+    return request.header().get_field_or(restinio::http_field::accept, "").find(CONTENT_TYPE_MSGPACK) != std::string::npos;
+}
+
+/** @return true if the request body is in msgpack */
+static bool
+hasMsgpackBody(const restinio::request_t& request)
+{
+    return request.header().get_field_or(restinio::http_field::content_type, "").find(CONTENT_TYPE_MSGPACK) != std::string::npos;
+}
+
 class opendht_logger_t
 {
 public:
@@ -128,14 +155,21 @@ public:
      */
     void state_changed(const restinio::connection_state::notice_t& notice) noexcept;
 
+    /** @return the number of connections currently open */
+    size_t count() const { return open_.load(std::memory_order_relaxed); }
+
 private:
     std::function<void(restinio::connection_id_t)> onClosed_;
+    std::atomic<size_t> open_ {0};
 };
 
 void
 DhtProxyServer::ConnectionListener::state_changed(const restinio::connection_state::notice_t& notice) noexcept
 {
-    if (restinio::holds_alternative<restinio::connection_state::closed_t>(notice.cause())) {
+    if (restinio::holds_alternative<restinio::connection_state::accepted_t>(notice.cause())) {
+        open_.fetch_add(1, std::memory_order_relaxed);
+    } else if (restinio::holds_alternative<restinio::connection_state::closed_t>(notice.cause())) {
+        open_.fetch_sub(1, std::memory_order_relaxed);
         onClosed_(notice.connection_id());
     }
 }
@@ -143,13 +177,128 @@ DhtProxyServer::ConnectionListener::state_changed(const restinio::connection_sta
 void
 DhtProxyServer::onConnectionClosed(restinio::connection_id_t id)
 {
-    std::lock_guard<std::mutex> lock(lockListener_);
-    auto it = listeners_.find(id);
-    if (it != listeners_.end()) {
-        dht_->cancelListen(it->second.hash, std::move(it->second.token));
-        listeners_.erase(it);
+    auto& shard = listeners_.shard(id);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(id);
+    if (it != shard.map.end()) {
+        unsubscribeListen(it->second.hash, it->second.subscription);
+        shard.map.erase(it);
+        auto count = --listenCount_;
         if (logger_)
-            logger_->d("[proxy:server] [connection:%li] listener cancelled, %li still connected", id, listeners_.size());
+            logger_->d("[proxy:server] [connection:%li] listener cancelled, %li still connected", id, count);
+    }
+    std::string stream;
+    {
+        auto& sshard = streamConnections_.shard(id);
+        std::lock_guard<std::mutex> l(sshard.lock);
+        auto sit = sshard.map.find(id);
+        if (sit != sshard.map.end()) {
+            stream = std::move(sit->second);
+            sshard.map.erase(sit);
+        }
+    }
+    if (not stream.empty())
+        closeStream(stream);
+}
+
+// expiration wheel
+
+class DhtProxyServer::ExpirationWheel
+{
+public:
+    ExpirationWheel(asio::io_context& ctx) : timer_(ctx) {}
+
+    Sp<Scheduler::Job> add(time_point t, std::function<void()>&& task) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto job = scheduler_.add(t, [this, task = std::move(task)] {
+            fired_.emplace_back(task);
+        });
+        arm();
+        return job;
+    }
+
+    void reschedule(const Sp<Scheduler::Job>& job, time_point t) {
+        std::lock_guard<std::mutex> lock(lock_);
+        scheduler_.add(job, t);
+        arm();
+    }
+
+    void cancel(const Sp<Scheduler::Job>& job) {
+        std::lock_guard<std::mutex> lock(lock_);
+        job->cancel();
+    }
+
+private:
+    std::mutex lock_;
+    Scheduler scheduler_;
+    asio::steady_timer timer_;
+    /* time the timer is waiting for */
+    time_point armed_ {time_point::max()};
+    /* tasks of the jobs run by the scheduler, executed once unlocked */
+    std::vector<std::function<void()>> fired_;
+
+    /* with lock_ held */
+    void arm() {
+        auto next = scheduler_.getNextJobTime();
+        if (next >= armed_)
+            return;
+        armed_ = next;
+        timer_.expires_at(next);
+        timer_.async_wait([this](const asio::error_code& ec) {
+            if (ec != asio::error::operation_aborted)
+                run();
+        });
+    }
+
+    void run() {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            armed_ = time_point::max();
+            scheduler_.syncTime();
+            scheduler_.run();
+            tasks = std::move(fired_);
+            fired_.clear();
+            arm();
+        }
+        // tasks lock the maps, that cancel expirations
+        for (auto& task : tasks)
+            task();
+    }
+};
+
+DhtProxyServer::Expiration&
+DhtProxyServer::Expiration::operator=(Expiration&& o) noexcept
+{
+    if (this != &o) {
+        cancel();
+        wheel_ = o.wheel_;
+        job_ = std::move(o.job_);
+    }
+    return *this;
+}
+
+void
+DhtProxyServer::Expiration::set(ExpirationWheel& wheel, time_point t, std::function<void()>&& task)
+{
+    cancel();
+    wheel_ = &wheel;
+    job_ = wheel.add(t, std::move(task));
+}
+
+void
+DhtProxyServer::Expiration::reschedule(time_point t)
+{
+    if (job_)
+        wheel_->reschedule(job_, t);
+}
+
+void
+DhtProxyServer::Expiration::cancel()
+{
+    if (job_) {
+        wheel_->cancel(job_);
+        job_.reset();
     }
 }
 
@@ -229,7 +378,14 @@ DhtProxyServer::DhtProxyServer(const std::shared_ptr<DhtRunner>& dht,
     :   ioContext_(std::make_shared<asio::io_context>()),
         dht_(dht), persistPath_(config.persistStatePath), logger_(logger),
         printStatsTimer_(std::make_unique<asio::steady_timer>(*ioContext_, 3s)),
+        expirations_(std::make_unique<ExpirationWheel>(*ioContext_)),
         connListener_(std::make_shared<ConnectionListener>(std::bind(&DhtProxyServer::onConnectionClosed, this, std::placeholders::_1))),
+        restoreRate_(config.restoreRate),
+        getCacheTtl_(config.getCacheTtl),
+        maxRequestsPerIp_(config.maxRequestsPerIp),
+        maxRequestsPerPushToken_(config.maxRequestsPerPushToken),
+        maxConcurrentRequests_(config.maxConcurrentRequests),
+        ipv6LimitPrefix_(std::min(config.ipv6LimitPrefix, 128u)),
         pushServer_(config.pushServer)
 {
     if (not dht_)
@@ -296,11 +452,10 @@ DhtProxyServer::DhtProxyServer(const std::shared_ptr<DhtRunner>& dht,
             std::forward<restinio::run_on_this_thread_settings_t<RestRouterTraitsTls>>(std::move(settings))
         );
         // run http server
-        serverThread_ = std::thread([this]{
+        startServerThreads(config.threads, [this]{
             httpsServer_->open_async([]{/*ok*/}, [](std::exception_ptr ex){
                 std::rethrow_exception(ex);
             });
-            httpsServer_->io_context().run();
         });
     }
     else {
@@ -312,11 +467,10 @@ DhtProxyServer::DhtProxyServer(const std::shared_ptr<DhtRunner>& dht,
             std::forward<restinio::run_on_this_thread_settings_t<RestRouterTraits>>(std::move(settings))
         );
         // run http server
-        serverThread_ = std::thread([this](){
+        startServerThreads(config.threads, [this]{
             httpServer_->open_async([]{/*ok*/}, [](std::exception_ptr ex){
                 std::rethrow_exception(ex);
             });
-            httpServer_->io_context().run();
         });
     }
     dht->forwardAllMessages(true);
@@ -344,135 +498,565 @@ template <typename Os>
 void
 DhtProxyServer::saveState(Os& stream) {
     msgpack::packer<Os> pk(&stream);
-    pk.pack_map(2);
-    {
-        std::lock_guard<std::mutex> lock(lockSearchPuts_);
-        pk.pack("puts");
-        pk.pack(puts_);
-    }
+    // [version, [put rows], [push listener rows]]
+    pk.pack_array(3);
+    pk.pack(STATE_VERSION);
+    packRows(pk, puts_, [](const SearchPuts& puts) {
+        return puts.puts.size();
+    }, [](msgpack::packer<Os>& pk, const InfoHash& key, const SearchPuts& puts) {
+        for (const auto& put : puts.puts) {
+            const auto& pput = put.second;
+            pk.pack_array(8);
+            pk.pack(key);
+            pk.pack(put.first);
+            pk.pack(to_time_t(pput.expiration));
+            pk.pack(*pput.value);
+            pk.pack(pput.clientId);
+            if (pput.sessionCtx) {
+                std::lock_guard<std::mutex> l(pput.sessionCtx->lock);
+                pk.pack(pput.sessionCtx->sessionId);
+            } else
+                pk.pack_str(0);
+            pk.pack(pput.pushToken.empty() ? PushType::None : pput.type);
+            pk.pack(pput.pushToken);
+        }
+    });
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
-    {
-        std::lock_guard<std::mutex> lock(lockListener_);
-        pk.pack("pushListeners");
-        pk.pack(pushListeners_);
-    }
+    packRows(pk, pushListeners_, [](const PushListener& pushListener) {
+        size_t n = 0;
+        for (const auto& listeners : pushListener.listeners)
+            n += listeners.second.size();
+        return n;
+    }, [](msgpack::packer<Os>& pk, const std::string& pushToken, const PushListener& pushListener) {
+        for (const auto& listeners : pushListener.listeners) {
+            for (const auto& listener : listeners.second) {
+                pk.pack_array(6);
+                pk.pack(pushToken);
+                pk.pack(listeners.first);
+                pk.pack(listener.clientId);
+                if (listener.sessionCtx) {
+                    std::lock_guard<std::mutex> l(listener.sessionCtx->lock);
+                    pk.pack(listener.sessionCtx->sessionId);
+                } else
+                    pk.pack_str(0);
+                pk.pack(listener.type);
+                pk.pack(to_time_t(listener.expiration));
+            }
+        }
+    });
+#else
+    pk.pack_array(0);
 #endif
 }
 
+template <typename Packer, typename Key, typename T, typename Rows, typename Pack>
+void
+DhtProxyServer::packRows(Packer& pk, ShardedMap<Key, T>& map, Rows&& rows, Pack&& pack)
+{
+    // lock all shards to pack a consistent map
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(map.shards().size());
+    size_t size = 0;
+    for (auto& shard : map.shards()) {
+        locks.emplace_back(shard.lock);
+        for (const auto& e : shard.map)
+            size += rows(e.second);
+    }
+    pk.pack_array(size);
+    for (auto& shard : map.shards())
+        for (const auto& e : shard.map)
+            pack(pk, e.first, e.second);
+}
+
 template <typename Is>
 void
 DhtProxyServer::loadState(Is& is, size_t size) {
     msgpack::unpacker pac;
     pac.reserve_buffer(size);
-    if (is.read(pac.buffer(), size)) {
-        pac.buffer_consumed(size);
+    if (not is.read(pac.buffer(), size))
+        return;
+    pac.buffer_consumed(size);
 
-        msgpack::object_handle oh;
-        while (pac.next(oh)) {
-            if (oh.get().type != msgpack::type::MAP)
-                continue;
-            if (auto puts = findMapValue(oh.get(), "puts")) {
-                std::lock_guard<std::mutex> lock(lockSearchPuts_);
-                puts_ = puts->as<decltype(puts_)>();
-                if (logger_)
-                    logger_->d("Loading %zu persistent puts", puts_.size());
-                for (auto& put : puts_) {
-                    for (auto& pput : put.second.puts) {
-                        pput.second.expireTimer = std::make_unique<asio::steady_timer>(io_context(), pput.second.expiration);
-                        pput.second.expireTimer->async_wait(std::bind(&DhtProxyServer::handleCancelPermamentPut, this,
-                                                std::placeholders::_1, put.first, pput.first));
+    std::map<InfoHash, SearchPuts> puts;
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
-                        if (not pput.second.pushToken.empty()) {
-                            auto jsonProvider = [infoHash=put.first.toString(), clientId=pput.second.clientId, vid = pput.first, sessionCtx = pput.second.sessionCtx](){
-                                Json::Value json;
-                                json["timeout"] = infoHash;
-                                json["to"] = clientId;
-                                json["vid"] = std::to_string(vid);
-                                if (sessionCtx) {
-                                    std::lock_guard<std::mutex> l(sessionCtx->lock);
-                                    json["s"] = sessionCtx->sessionId;
-                                }
-                                return json;
-                            };
-                            pput.second.expireNotifyTimer = std::make_unique<asio::steady_timer>(io_context(), pput.second.expiration - proxy::OP_MARGIN);
-                            pput.second.expireNotifyTimer->async_wait(std::bind(
-                                &DhtProxyServer::handleNotifyPushListenExpire, this,
-                                std::placeholders::_1, pput.second.pushToken, std::move(jsonProvider), pput.second.type));
-                        }
+    std::map<std::string, PushListener> pushListeners;
 #endif
-                        dht_->put(put.first, pput.second.value, DoneCallbackSimple{}, time_point::max(), true);
-                    }
-                }
-            } else {
-                if (logger_)
-                    logger_->d("No persistent puts in state");
+    msgpack::object_handle oh;
+    while (pac.next(oh)) {
+        const auto& o = oh.get();
+        if (o.type == msgpack::type::ARRAY and o.via.array.size == 3
+            and o.via.array.ptr[0].as<unsigned>() == STATE_VERSION)
+        {
+            const auto& putRows = o.via.array.ptr[1];
+            if (putRows.type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            for (unsigned i = 0; i < putRows.via.array.size; i++) {
+                const auto& row = putRows.via.array.ptr[i];
+                if (row.type != msgpack::type::ARRAY or row.via.array.size < 8)
+                    throw msgpack::type_error();
+                const auto* f = row.via.array.ptr;
+                PermanentPut pput;
+                pput.expiration = from_time_t(f[2].as<time_t>());
+                pput.value = std::make_shared<Value>(f[3]);
+                pput.clientId = f[4].as<std::string>();
+                auto sid = f[5].as<std::string>();
+                if (not sid.empty())
+                    pput.sessionCtx = std::make_shared<PushSessionContext>(sid);
+                pput.type = f[6].as<PushType>();
+                pput.pushToken = f[7].as<std::string>();
+                puts[f[0].as<InfoHash>()].puts.emplace(f[1].as<Value::Id>(), std::move(pput));
             }
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
-            if (auto listeners = findMapValue(oh.get(), "pushListeners")) {
-                std::lock_guard<std::mutex> lock(lockListener_);
-                pushListeners_ = listeners->as<decltype(pushListeners_)>();
-                if (logger_)
-                    logger_->d("Loading %zu push listeners", pushListeners_.size());
-                for (auto& pushListener : pushListeners_) {
-                    for (auto& listeners : pushListener.second.listeners) {
-                        for (auto& listener : listeners.second) {
-                            listener.internalToken = dht_->listen(listeners.first,
-                                [this, infoHash=listeners.first, pushToken=pushListener.first, type=listener.type, clientId=listener.clientId, sessionCtx = listener.sessionCtx]
-                                (const std::vector<std::shared_ptr<Value>>& values, bool expired) {
-                                    // Build message content
-                                    Json::Value json;
-                                    json["key"] = infoHash.toString();
-                                    json["to"] = clientId;
-                                    json["t"] = Json::Value::Int64(std::chrono::duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count());
-                                    {
-                                        std::lock_guard<std::mutex> l(sessionCtx->lock);
-                                        json["s"] = sessionCtx->sessionId;
-                                    }
-                                    if (expired and values.size() < 2){
-                                        std::stringstream ss;
-                                        for(size_t i = 0; i < values.size(); ++i){
-                                            if(i != 0) ss << ",";
-                                            ss << values[i]->id;
-                                        }
-                                        json["exp"] = ss.str();
-                                    }
-                                    auto maxPrio = 1000u;
-                                    for (const auto& v : values)
-                                        maxPrio = std::min(maxPrio, v->priority);
-                                    sendPushNotification(pushToken, std::move(json), type, !expired and maxPrio == 0);
-                                    return true;
-                                }
-                            );
-                            // expire notify
-                            listener.expireNotifyTimer = std::make_unique<asio::steady_timer>(io_context(), listener.expiration - proxy::OP_MARGIN);
-                            auto jsonProvider = [infoHash = listeners.first.toString(), clientId = listener.clientId, sessionCtx = listener.sessionCtx](){
-                                Json::Value json;
-                                json["timeout"] = infoHash;
-                                json["to"] = clientId;
-                                std::lock_guard<std::mutex> l(sessionCtx->lock);
-                                json["s"] = sessionCtx->sessionId;
-                                return json;
-                            };
-                            listener.expireNotifyTimer->async_wait(std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
-                                                                std::placeholders::_1, pushListener.first, std::move(jsonProvider), listener.type));
-                            // cancel push listen
-                            listener.expireTimer = std::make_unique<asio::steady_timer>(io_context(), listener.expiration);
-                            listener.expireTimer->async_wait(std::bind(&DhtProxyServer::handleCancelPushListen, this,
-                                                            std::placeholders::_1, pushListener.first, listeners.first, listener.clientId));
-                        }
+            const auto& listenerRows = o.via.array.ptr[2];
+            if (listenerRows.type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            for (unsigned i = 0; i < listenerRows.via.array.size; i++) {
+                const auto& row = listenerRows.via.array.ptr[i];
+                if (row.type != msgpack::type::ARRAY or row.via.array.size < 6)
+                    throw msgpack::type_error();
+                const auto* f = row.via.array.ptr;
+                Listener listener;
+                listener.clientId = f[2].as<std::string>();
+                listener.sessionCtx = std::make_shared<PushSessionContext>(f[3].as<std::string>());
+                listener.type = f[4].as<PushType>();
+                listener.expiration = from_time_t(f[5].as<time_t>());
+                pushListeners[f[0].as<std::string>()].listeners[f[1].as<InfoHash>()].emplace_back(std::move(listener));
+            }
+#endif
+        } else if (o.type == msgpack::type::MAP) {
+            // format of previous versions
+            if (auto p = findMapValue(o, "puts"))
+                puts = p->as<std::map<InfoHash, SearchPuts>>();
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+            if (auto l = findMapValue(o, "pushListeners"))
+                pushListeners = l->as<std::map<std::string, PushListener>>();
+#endif
+        }
+    }
+
+    // entries are inserted now, the DHT operations are paced by startRestore
+    auto now = clock::now();
+    std::vector<RestoreOp> ops;
+    if (logger_)
+        logger_->d("Loading %zu persistent puts", puts.size());
+    for (auto& loadedPut : puts) {
+        auto& shard = puts_.shard(loadedPut.first);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto putIt = shard.map.emplace(loadedPut.first, std::move(loadedPut.second)).first;
+        auto& put = *putIt;
+        for (auto pput = put.second.puts.begin(); pput != put.second.puts.end();) {
+            if (pput->second.expiration <= now or not pput->second.value)
+                pput = put.second.puts.erase(pput);
+            else
+                ++pput;
+        }
+        if (put.second.puts.empty()) {
+            shard.map.erase(putIt);
+            continue;
+        }
+        putCount_++;
+        permanentPutCount_ += put.second.puts.size();
+        for (auto& pput : put.second.puts) {
+            pput.second.expireTimer.set(*expirations_, pput.second.expiration,
+                std::bind(&DhtProxyServer::handleCancelPermamentPut, this, put.first, pput.first));
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+            if (not pput.second.pushToken.empty()) {
+                auto jsonProvider = [infoHash=put.first.toString(), clientId=pput.second.clientId, vid = pput.first, sessionCtx = pput.second.sessionCtx](){
+                    Json::Value json;
+                    json["timeout"] = infoHash;
+                    json["to"] = clientId;
+                    json["vid"] = std::to_string(vid);
+                    if (sessionCtx) {
+                        std::lock_guard<std::mutex> l(sessionCtx->lock);
+                        json["s"] = sessionCtx->sessionId;
                     }
-                }
-            } else {
-                if (logger_)
-                    logger_->d("No push listeners in state");
+                    return json;
+                };
+                pput.second.expireNotifyTimer.set(*expirations_, pput.second.expiration - proxy::OP_MARGIN,
+                    std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
+                              pput.second.pushToken, std::move(jsonProvider), pput.second.type));
             }
 #endif
+            ops.emplace_back(RestoreOp {pput.second.expiration, put.first, pput.first, {}, {}});
         }
-        if (logger_)
-            logger_->d("loading ended");
     }
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+    if (logger_)
+        logger_->d("Loading %zu push listeners", pushListeners.size());
+    for (auto& loadedListener : pushListeners) {
+        auto& shard = pushListeners_.shard(loadedListener.first);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto pushListenerIt = shard.map.emplace(loadedListener.first, std::move(loadedListener.second)).first;
+        auto& pushListener = *pushListenerIt;
+        auto& keys = pushListener.second.listeners;
+        for (auto listeners = keys.begin(); listeners != keys.end();) {
+            auto& l = listeners->second;
+            l.erase(std::remove_if(l.begin(), l.end(), [&](const Listener& listener) {
+                return listener.expiration <= now;
+            }), l.end());
+            if (l.empty())
+                listeners = keys.erase(listeners);
+            else
+                ++listeners;
+        }
+        if (keys.empty()) {
+            shard.map.erase(pushListenerIt);
+            continue;
+        }
+        pushListenersCount_++;
+        for (auto& listeners : keys) {
+            for (auto& listener : listeners.second) {
+                if (not listener.sessionCtx)
+                    listener.sessionCtx = std::make_shared<PushSessionContext>("");
+                // expire notify
+                auto jsonProvider = [infoHash = listeners.first.toString(), clientId = listener.clientId, sessionCtx = listener.sessionCtx](){
+                    Json::Value json;
+                    json["timeout"] = infoHash;
+                    json["to"] = clientId;
+                    std::lock_guard<std::mutex> l(sessionCtx->lock);
+                    json["s"] = sessionCtx->sessionId;
+                    return json;
+                };
+                listener.expireNotifyTimer.set(*expirations_, listener.expiration - proxy::OP_MARGIN,
+                    std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
+                              pushListener.first, std::move(jsonProvider), listener.type));
+                // cancel push listen
+                listener.expireTimer.set(*expirations_, listener.expiration,
+                    std::bind(&DhtProxyServer::handleCancelPushListen, this,
+                              pushListener.first, listeners.first, listener.clientId));
+                ops.emplace_back(RestoreOp {listener.expiration, listeners.first, 0, pushListener.first, listener.clientId});
+            }
+        }
+    }
+#endif
+    if (logger_)
+        logger_->d("loading ended, %zu operations to restore", ops.size());
+    {
+        std::lock_guard<std::mutex> lock(restoreLock_);
+        restoreQueue_ = std::move(ops);
+    }
+    startRestore();
+}
+
+void
+DhtProxyServer::startRestore()
+{
+    std::lock_guard<std::mutex> lock(restoreLock_);
+    if (restoreQueue_.empty())
+        return;
+    // popped from the back
+    std::sort(restoreQueue_.begin(), restoreQueue_.end(), [](const RestoreOp& a, const RestoreOp& b) {
+        return a.expiration < b.expiration;
+    });
+    // the first batch is restored right away
+    restoreTimer_ = std::make_unique<asio::steady_timer>(io_context(), std::chrono::steady_clock::now());
+    restoreTimer_->async_wait(std::bind(&DhtProxyServer::handleRestore, this, std::placeholders::_1));
+}
+
+void
+DhtProxyServer::handleRestore(const asio::error_code& ec)
+{
+    if (ec == asio::error::operation_aborted)
+        return;
+    std::vector<RestoreOp> ops;
+    {
+        std::lock_guard<std::mutex> lock(restoreLock_);
+        size_t n = restoreQueue_.size();
+        if (restoreRate_)
+            n = std::min(n, std::max<size_t>(1, restoreRate_ * RESTORE_PERIOD.count() / 1000));
+        ops.assign(std::make_move_iterator(restoreQueue_.end() - n), std::make_move_iterator(restoreQueue_.end()));
+        restoreQueue_.resize(restoreQueue_.size() - n);
+        if (not restoreQueue_.empty()) {
+            // from now: a late batch must not make the next ones catch up
+            restoreTimer_->expires_after(RESTORE_PERIOD);
+            restoreTimer_->async_wait(std::bind(&DhtProxyServer::handleRestore, this, std::placeholders::_1));
+        } else if (logger_)
+            logger_->d("[proxy:server] state restored");
+    }
+    for (auto it = ops.rbegin(); it != ops.rend(); ++it)
+        restore(*it);
+}
+
+void
+DhtProxyServer::restore(const RestoreOp& op)
+{
+    if (op.pushToken.empty()) {
+        auto& shard = puts_.shard(op.key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto sPuts = shard.map.find(op.key);
+        if (sPuts == shard.map.end())
+            return;
+        auto put = sPuts->second.puts.find(op.vid);
+        if (put != sPuts->second.puts.end())
+            dht_->put(op.key, put->second.value, DoneCallbackSimple{}, time_point::max(), true);
+        return;
+    }
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+    auto& shard = pushListeners_.shard(op.pushToken);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto pushListener = shard.map.find(op.pushToken);
+    if (pushListener == shard.map.end())
+        return;
+    auto listeners = pushListener->second.listeners.find(op.key);
+    if (listeners == pushListener->second.listeners.end())
+        return;
+    for (auto& listener : listeners->second)
+        // a refresh of the client may have subscribed it already
+        if (listener.clientId == op.clientId and not listener.subscription)
+            subscribePushListen(op.pushToken, op.key, listener);
+#endif
+}
+
+
+void
+DhtProxyServer::startServerThreads(unsigned threads, std::function<void()>&& open)
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (logger_)
+        logger_->d("[proxy:server] [init] using %u threads", threads);
+    // connections are served through strands, so that handlers of
+    // a connection never run concurrently
+    open();
+    serverThreads_.reserve(threads);
+    for (unsigned i = 0; i < threads; i++)
+        serverThreads_.emplace_back([this]{
+            ioContext_->run();
+        });
+}
+
+size_t
+DhtProxyServer::subscribeListen(const InfoHash& key, ListenSubscriber&& cb, ListenBody body)
+{
+    auto subscriber = std::make_shared<ListenSubscriber>(std::move(cb));
+    Sp<SharedListen> listen;
+    std::unique_lock<std::mutex> listenLock;
+    {
+        auto& shard = sharedListens_.shard(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto& l = shard.map[key];
+        if (not l) {
+            l = std::make_shared<SharedListen>(key);
+            std::weak_ptr<SharedListen> w = l;
+            l->token = dht_->listen(key, [this, w](const std::vector<Sp<Value>>& values, bool expired) {
+                if (auto listen = w.lock()) {
+                    onListenValues(*listen, values, expired);
+                    return true;
+                }
+                return false;
+            });
+        }
+        listen = l;
+        listenLock = std::unique_lock<std::mutex>(listen->lock);
+    }
+    auto id = listen->nextId++;
+    listen->subscribers.emplace(id, std::make_pair(subscriber, body));
+    listen->bodySubscribers[static_cast<size_t>(body)]++;
+    // send the values already received by the shared listen
+    if (not listen->values.empty()) {
+        std::vector<Sp<Value>> values;
+        values.reserve(listen->values.size());
+        for (const auto& v : listen->values)
+            values.emplace_back(v.second);
+        std::shared_ptr<std::string> serialized;
+        if (body != ListenBody::None)
+            serialized = serializeValues(values, false, body, key);
+        (*subscriber)(values, false, serialized);
+    }
+    return id;
 }
 
+void
+DhtProxyServer::unsubscribeListen(const InfoHash& key, size_t id)
+{
+    auto& shard = sharedListens_.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end())
+        return;
+    auto& listen = *it->second;
+    {
+        std::lock_guard<std::mutex> l(listen.lock);
+        auto s = listen.subscribers.find(id);
+        if (s == listen.subscribers.end())
+            return;
+        listen.bodySubscribers[static_cast<size_t>(s->second.second)]--;
+        listen.subscribers.erase(s);
+        if (not listen.subscribers.empty())
+            return;
+    }
+    dht_->cancelListen(key, std::move(listen.token));
+    shard.map.erase(it);
+}
+
+void
+DhtProxyServer::onListenValues(SharedListen& listen, const std::vector<Sp<Value>>& values, bool expired)
+{
+    std::lock_guard<std::mutex> lock(listen.lock);
+    listen.bodies = {};
+    for (const auto& v : values) {
+        if (expired)
+            listen.values.erase(v->id);
+        else
+            listen.values[v->id] = v;
+    }
+    // serialize once for all the subscribers needing a format
+    std::array<std::shared_ptr<std::string>, LISTEN_BODIES> bodies {};
+    for (size_t b = 1; b < LISTEN_BODIES; b++)
+        if (listen.bodySubscribers[b])
+            bodies[b] = serializeValues(values, expired, static_cast<ListenBody>(b), listen.key);
+    for (const auto& s : listen.subscribers)
+        (*s.second.first)(values, expired, bodies[static_cast<size_t>(s.second.second)]);
+}
+
+std::shared_ptr<std::string>
+DhtProxyServer::serializeValues(const std::vector<Sp<Value>>& values, bool expired, ListenBody body, const InfoHash& key) const
+{
+    bool keyed = body == ListenBody::KeyedValues or body == ListenBody::KeyedPacked;
+    if (body == ListenBody::Packed or body == ListenBody::KeyedPacked) {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        for (const auto& value : values) {
+            pk.pack_map(1 + (expired ? 1 : 0) + (keyed ? 1 : 0));
+            pk.pack("v"); pk.pack(*value);
+            if (expired) {
+                pk.pack("exp"); pk.pack(true);
+            }
+            if (keyed) {
+                pk.pack("key"); pk.pack(key);
+            }
+        }
+        return std::make_shared<std::string>(buffer.data(), buffer.size());
+    }
+    auto output = std::make_shared<std::string>();
+    for (const auto& value : values) {
+        auto jsonVal = value->toJson();
+        if (expired)
+            jsonVal["expired"] = true;
+        if (keyed)
+            jsonVal["key"] = key.toString();
+        *output += Json::writeString(jsonBuilder_, jsonVal);
+        *output += "\n";
+    }
+    return output;
+}
+
+std::shared_ptr<std::string>
+DhtProxyServer::getCached(const InfoHash& key, const std::string& where, ListenBody format)
+{
+    if (getCacheTtl_ <= duration::zero())
+        return {};
+    auto now = clock::now();
+    if (where.empty()) {
+        Sp<SharedListen> listen;
+        {
+            auto& shard = sharedListens_.shard(key);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            auto it = shard.map.find(key);
+            if (it != shard.map.end())
+                listen = it->second;
+        }
+        if (listen) {
+            std::lock_guard<std::mutex> lock(listen->lock);
+            if (now - listen->start >= getCacheTtl_) {
+                auto& body = listen->bodies[static_cast<size_t>(format)];
+                if (not body) {
+                    std::vector<Sp<Value>> values;
+                    values.reserve(listen->values.size());
+                    for (const auto& v : listen->values)
+                        values.emplace_back(v.second);
+                    body = serializeValues(values, false, format);
+                }
+                getCacheHits_++;
+                return body;
+            }
+        }
+    }
+    auto& shard = getCache_.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) {
+        auto& entries = it->second.entries;
+        auto c = entries.find(std::make_pair(format, where));
+        if (c != entries.end()) {
+            if (c->second.expiration > now and c->second.generation >= it->second.invalidated) {
+                getCacheHits_++;
+                return c->second.body;
+            }
+            entries.erase(c);
+        }
+    }
+    getCacheMisses_++;
+    return {};
+}
+
+void
+DhtProxyServer::cacheGet(const InfoHash& key, const std::string& where, ListenBody format, std::shared_ptr<std::string> body, uint64_t generation)
+{
+    if (getCacheTtl_ <= duration::zero())
+        return;
+    auto now = clock::now();
+    auto& shard = getCache_.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        // the last PUT on the key may have been forgotten
+        if (generation < getCacheEvicted_)
+            return;
+        if (shard.map.size() >= MAX_CACHED_GETS / getCache_.shards().size()) {
+            pruneGetCache(shard, now);
+            if (shard.map.size() >= MAX_CACHED_GETS / getCache_.shards().size())
+                return;
+        }
+        it = shard.map.emplace(key, CachedGets {}).first;
+    } else if (generation < it->second.invalidated) {
+        // a PUT came after this get started
+        return;
+    }
+    it->second.entries[std::make_pair(format, where)] = CachedGet {std::move(body), now + getCacheTtl_, generation};
+}
+
+void
+DhtProxyServer::invalidateGetCache(const InfoHash& key)
+{
+    if (getCacheTtl_ <= duration::zero())
+        return;
+    auto generation = ++getCacheGeneration_;
+    auto& shard = getCache_.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        if (shard.map.size() >= MAX_CACHED_GETS / getCache_.shards().size())
+            pruneGetCache(shard, clock::now());
+        it = shard.map.emplace(key, CachedGets {}).first;
+    }
+    it->second.invalidated = generation;
+    it->second.entries.clear();
+}
+
+void
+DhtProxyServer::pruneGetCache(ShardedMap<InfoHash, CachedGets>::Shard& shard, time_point now)
+{
+    // Keys without responses only remember their last PUT:
+    // forget them and raise the eviction floor instead.
+    auto evicted = getCacheEvicted_.load();
+    for (auto it = shard.map.begin(); it != shard.map.end();) {
+        auto& entries = it->second.entries;
+        for (auto c = entries.begin(); c != entries.end();) {
+            if (c->second.expiration <= now)
+                c = entries.erase(c);
+            else
+                ++c;
+        }
+        if (entries.empty()) {
+            evicted = std::max(evicted, it->second.invalidated);
+            it = shard.map.erase(it);
+        } else
+            ++it;
+    }
+    auto prev = getCacheEvicted_.load();
+    while (prev < evicted and not getCacheEvicted_.compare_exchange_weak(prev, evicted));
+}
 
 asio::io_context&
 DhtProxyServer::io_context() const
@@ -482,38 +1066,86 @@ DhtProxyServer::io_context() const
 
 DhtProxyServer::~DhtProxyServer()
 {
+    {
+        std::lock_guard<std::mutex> lock(restoreLock_);
+        restoreQueue_.clear();
+        if (restoreTimer_)
+            restoreTimer_->cancel();
+    }
     if (not persistPath_.empty()) {
         if (logger_)
             logger_->d("Saving proxy state to %.*s", (int)persistPath_.size(), persistPath_.c_str());
-        std::ofstream stateFile(persistPath_, std::ios::binary);
-        saveState(stateFile);
+        // replace the previous state only once fully written
+        auto tmpPath = persistPath_ + ".tmp";
+        bool written = false;
+        try {
+            std::ofstream stateFile(tmpPath, std::ios::binary);
+            saveState(stateFile);
+            stateFile.close();
+            written = stateFile.good();
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->e("Error saving proxy state: %s", e.what());
+        }
+        if (not written or std::rename(tmpPath.c_str(), persistPath_.c_str()) != 0) {
+            if (logger_)
+                logger_->e("Error saving proxy state to %s", persistPath_.c_str());
+            std::remove(tmpPath.c_str());
+        }
     }
     if (dht_) {
-        std::lock_guard<std::mutex> lock(lockListener_);
-        for (auto& l : listeners_) {
-            dht_->cancelListen(l.second.hash, std::move(l.second.token));
-            if (l.second.response)
-                l.second.response->done();
+        for (auto& shard : listeners_.shards()) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            for (auto& l : shard.map) {
+                unsubscribeListen(l.second.hash, l.second.subscription);
+                if (l.second.response)
+                    l.second.response->done();
+            }
         }
-#ifdef OPENDHT_PUSH_NOTIFICATIONS
-        for (auto& lm: pushListeners_)  {
-            for (auto& ls: lm.second.listeners)
-                for (auto& l : ls.second) {
-                    if (l.expireNotifyTimer)
-                        l.expireNotifyTimer->cancel();
-                    if (l.expireTimer)
-                        l.expireTimer->cancel();
-                    dht_->cancelListen(ls.first, std::move(l.internalToken));
+        for (auto& shard : streams_.shards()) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            for (auto& s : shard.map) {
+                auto& session = *s.second;
+                {
+                    std::lock_guard<std::mutex> l(session.lock);
+                    for (const auto& sub : session.subscriptions)
+                        unsubscribeListen(sub.first, sub.second);
+                    session.subscriptions.clear();
                 }
+                std::lock_guard<std::mutex> l(session.writeLock);
+                if (session.response) {
+                    session.response->done();
+                    session.response.reset();
+                }
+            }
+            shard.map.clear();
+        }
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+        for (auto& shard : pushListeners_.shards()) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            for (auto& lm: shard.map)  {
+                for (auto& ls: lm.second.listeners)
+                    for (auto& l : ls.second) {
+                        l.expireNotifyTimer.cancel();
+                        l.expireTimer.cancel();
+                        unsubscribeListen(ls.first, l.subscription);
+                    }
+            }
+            shard.map.clear();
         }
-        pushListeners_.clear();
+        pushListenersCount_ = 0;
+        std::lock_guard<std::mutex> l(pushLock_);
+        if (pushTimer_)
+            pushTimer_->cancel();
+        pushBatches_.clear();
 #endif
     }
     if (logger_)
         logger_->d("[proxy:server] closing http server");
     ioContext_->stop();
-    if (serverThread_.joinable())
-        serverThread_.join();
+    for (auto& thread : serverThreads_)
+        if (thread.joinable())
+            thread.join();
     if (logger_)
         logger_->d("[proxy:server] http server closed");
 }
@@ -560,24 +1192,38 @@ DhtProxyServer::updateStats(std::shared_ptr<NodeInfo> info) const
     auto sstats = std::make_shared<ServerStats>();
     auto& stats = *sstats;
     stats.requestRate = count / dt.count();
-#ifdef OPENDHT_PUSH_NOTIFICATIONS
-    stats.pushListenersCount = pushListeners_.size();
-#endif
-    stats.totalPermanentPuts = 0;
-    std::for_each(puts_.begin(), puts_.end(), [&stats](const auto& put) {
-        stats.totalPermanentPuts += put.second.puts.size();
-    });
-    stats.putCount = puts_.size();
-    stats.listenCount = listeners_.size();
+    stats.pushListenersCount = pushListenersCount_;
+    stats.totalPermanentPuts = permanentPutCount_;
+    stats.putCount = putCount_;
+    stats.listenCount = listenCount_;
+    stats.getCacheHits = getCacheHits_;
+    stats.getCacheMisses = getCacheMisses_;
     stats.nodeInfo = std::move(info);
     return sstats;
 }
 
+MemoryStats
+DhtProxyServer::getMemoryStats() const
+{
+    // entries of node-based containers also use about 4 pointers
+    constexpr size_t NODE_OVERHEAD {4 * sizeof(void*)};
+    auto stats = dht_->getMemoryStats();
+    // a listen is a subscriber to a shared listen, with its callback
+    stats.proxy = listenCount_.load() * (sizeof(std::pair<size_t, std::pair<Sp<ListenSubscriber>, ListenBody>>)
+                                         + sizeof(ListenSubscriber) + 2 * NODE_OVERHEAD)
+                + putCount_.load() * (sizeof(std::pair<InfoHash, SearchPuts>) + NODE_OVERHEAD)
+                + permanentPutCount_.load() * (sizeof(std::pair<Value::Id, PermanentPut>) + NODE_OVERHEAD);
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+    stats.proxy += pushListenersCount_.load() * (sizeof(std::pair<std::string, PushListener>) + sizeof(Listener) + 2 * NODE_OVERHEAD);
+#endif
+    return stats;
+}
+
 void
 DhtProxyServer::updateStats() {
     dht_->getNodeInfo([this](std::shared_ptr<NodeInfo> newInfo){
-        stats_ = updateStats(newInfo);
-        nodeInfo_ = newInfo;
+        std::atomic_store(&stats_, updateStats(newInfo));
+        std::atomic_store(&nodeInfo_, newInfo);
         if (logger_) {
             auto str = Json::writeString(jsonBuilder_, newInfo->toJson());
             logger_->d("[proxy:server] [stats] %s", str.c_str());
@@ -596,85 +1242,177 @@ DhtProxyServer::handlePrintStats(const asio::error_code &ec)
 }
 
 template <typename HttpResponse>
-HttpResponse DhtProxyServer::initHttpResponse(HttpResponse response)
+HttpResponse DhtProxyServer::initHttpResponse(HttpResponse response, bool msgpack)
 {
     response.append_header("Server", "RESTinio");
-    response.append_header(restinio::http_field::content_type, "application/json");
+    response.append_header(restinio::http_field::content_type, msgpack ? CONTENT_TYPE_MSGPACK : "application/json");
     response.append_header(restinio::http_field::access_control_allow_origin, "*");
     return response;
 }
 
+DhtProxyServer::RouteHandler
+DhtProxyServer::measured(Route route, RouteHandler&& handler)
+{
+    return [this, route, handler = std::move(handler)](restinio::request_handle_t request,
+                                                       restinio::router::route_params_t params) {
+        auto r = static_cast<size_t>(route);
+        requestsInFlight_.fetch_add(1, std::memory_order_relaxed);
+        routeOps_[r].fetch_add(1, std::memory_order_relaxed);
+        auto start = clock::now();
+        auto status = admit(route, *request)
+                    ? handler(request, std::move(params))
+                    : tooManyRequests(*request);
+        routeLatency_[r].record(clock::now() - start);
+        routeOps_[r].fetch_sub(1, std::memory_order_relaxed);
+        requestsInFlight_.fetch_sub(1, std::memory_order_relaxed);
+        return status;
+    };
+}
+
+bool
+DhtProxyServer::admit(Route route, const restinio::request_t& request)
+{
+    auto r = static_cast<size_t>(route);
+    if (maxRequestsPerIp_ and not limit(ipLimiters_, clientKey(request), maxRequestsPerIp_)) {
+        rateLimited_[r].fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (maxConcurrentRequests_) {
+        // the request itself is already counted
+        auto ops = route == Route::Listen ? listenCount_.load() : routeOps_[r].load() - 1;
+        if (ops >= maxConcurrentRequests_) {
+            concurrencyLimited_[r].fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+DhtProxyServer::limit(Limiters& limiters, const std::string& key, size_t quota)
+{
+    auto now = clock::now();
+    auto& shard = limiters.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        if (shard.map.size() >= MAX_LIMITERS / Limiters::SHARDS) {
+            // forget the least recently seen client
+            auto oldest = shard.map.find(*shard.lru.front());
+            shard.lru.pop_front();
+            shard.map.erase(oldest);
+        }
+        it = shard.map.emplace(key, ClientLimiter {RateLimiter(quota), {}}).first;
+        it->second.lru = shard.lru.insert(shard.lru.end(), &it->first);
+    } else
+        shard.lru.splice(shard.lru.end(), shard.lru, it->second.lru);
+    return it->second.limiter.limit(now);
+}
+
+std::string
+DhtProxyServer::clientKey(const restinio::request_t& request) const
+{
+    auto addr = request.remote_endpoint().address();
+    if (not addr.is_v6() or addr.to_v6().is_v4_mapped() or ipv6LimitPrefix_ >= 128)
+        return addr.to_string();
+    auto bytes = addr.to_v6().to_bytes();
+    for (size_t i = 0; i < bytes.size(); i++) {
+        auto bits = std::min<size_t>(8, std::max<size_t>(ipv6LimitPrefix_, 8 * i) - 8 * i);
+        bytes[i] &= static_cast<uint8_t>(0xff00 >> bits);
+    }
+    return asio::ip::address_v6(bytes).to_string() + "/" + std::to_string(ipv6LimitPrefix_);
+}
+
+RequestStatus
+DhtProxyServer::tooManyRequests(restinio::request_t& request)
+{
+    auto response = initHttpResponse(request.create_response(restinio::status_too_many_requests()));
+    response.set_body(RESP_MSG_TOO_MANY_REQUESTS);
+    return response.done();
+}
+
 std::unique_ptr<RestRouter>
 DhtProxyServer::createRestRouter()
 {
     using namespace std::placeholders;
     auto router = std::make_unique<RestRouter>();
 
+    // Routes are matched in order: single segment routes must be
+    // registered before the legacy "/:hash" routes, which would match them.
+    // node.metrics
+    router->http_get("/metrics", measured(Route::Metrics, std::bind(&DhtProxyServer::getMetrics, this, _1, _2)));
+    // batch
+    router->http_post("/batch", measured(Route::Batch, std::bind(&DhtProxyServer::batch, this, _1, _2)));
+
     // **************************** LEGACY ROUTES ****************************
     // node.info
-    router->http_get("/", std::bind(&DhtProxyServer::getNodeInfo, this, _1, _2));
+    router->http_get("/", measured(Route::NodeInfo, std::bind(&DhtProxyServer::getNodeInfo, this, _1, _2)));
 #ifdef OPENDHT_PROXY_HTTP_PARSER_FORK
     // node.stats
     router->add_handler(restinio::custom_http_methods_t::from_nodejs(restinio::method_stats.raw_id()),
-                        "/", std::bind(&DhtProxyServer::getStats, this, _1, _2));
+                        "/", measured(Route::NodeStats, std::bind(&DhtProxyServer::getStats, this, _1, _2)));
 #endif
     // key.options
     router->add_handler(restinio::http_method_options(),
-                        "/:hash", std::bind(&DhtProxyServer::options, this, _1, _2));
+                        "/:hash", measured(Route::Options, std::bind(&DhtProxyServer::options, this, _1, _2)));
     // key.get
-    router->http_get("/:hash", std::bind(&DhtProxyServer::get, this, _1, _2));
+    router->http_get("/:hash", measured(Route::Get, std::bind(&DhtProxyServer::get, this, _1, _2)));
     // key.post
-    router->http_post("/:hash", std::bind(&DhtProxyServer::put, this, _1, _2));
+    router->http_post("/:hash", measured(Route::Put, std::bind(&DhtProxyServer::put, this, _1, _2)));
 #ifdef OPENDHT_PROXY_HTTP_PARSER_FORK
     // key.listen
     router->add_handler(restinio::custom_http_methods_t::from_nodejs(restinio::method_listen.raw_id()),
-                        "/:hash", std::bind(&DhtProxyServer::listen, this, _1, _2));
+                        "/:hash", measured(Route::Listen, std::bind(&DhtProxyServer::listen, this, _1, _2)));
 #endif
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
     // key.subscribe
     router->add_handler(restinio::http_method_subscribe(),
-                        "/:hash", std::bind(&DhtProxyServer::subscribe, this, _1, _2));
+                        "/:hash", measured(Route::Subscribe, std::bind(&DhtProxyServer::subscribe, this, _1, _2)));
     // key.unsubscribe
     router->add_handler(restinio::http_method_unsubscribe(),
-                        "/:hash", std::bind(&DhtProxyServer::unsubscribe, this, _1, _2));
+                        "/:hash", measured(Route::Unsubscribe, std::bind(&DhtProxyServer::unsubscribe, this, _1, _2)));
 #endif //OPENDHT_PUSH_NOTIFICATIONS
 #ifdef OPENDHT_PROXY_SERVER_IDENTITY
 #ifdef OPENDHT_PROXY_HTTP_PARSER_FORK
     // key.sign
     router->add_handler(restinio::custom_http_methods_t::from_nodejs(restinio::method_sign.raw_id()),
-                        "/:hash", std::bind(&DhtProxyServer::putSigned, this, _1, _2));
+                        "/:hash", measured(Route::Sign, std::bind(&DhtProxyServer::putSigned, this, _1, _2)));
     // key.encrypt
     router->add_handler(restinio::custom_http_methods_t::from_nodejs(restinio::method_encrypt.raw_id()),
-                        "/:hash", std::bind(&DhtProxyServer::putEncrypted, this, _1, _2));
+                        "/:hash", measured(Route::Encrypt, std::bind(&DhtProxyServer::putEncrypted, this, _1, _2)));
 #endif
 #endif // OPENDHT_PROXY_SERVER_IDENTITY
 
     // **************************** NEW ROUTES ****************************
     // node.info
-    router->http_get("/node/info", std::bind(&DhtProxyServer::getNodeInfo, this, _1, _2));
+    router->http_get("/node/info", measured(Route::NodeInfo, std::bind(&DhtProxyServer::getNodeInfo, this, _1, _2)));
     // node.stats
-    router->http_get("/node/stats", std::bind(&DhtProxyServer::getStats, this, _1, _2));
+    router->http_get("/node/stats", measured(Route::NodeStats, std::bind(&DhtProxyServer::getStats, this, _1, _2)));
     // key.options
-    router->http_get("/key/:hash/options", std::bind(&DhtProxyServer::options, this, _1, _2));
+    router->http_get("/key/:hash/options", measured(Route::Options, std::bind(&DhtProxyServer::options, this, _1, _2)));
     // key.get
-    router->http_get("/key/:hash", std::bind(&DhtProxyServer::get, this, _1, _2));
+    router->http_get("/key/:hash", measured(Route::Get, std::bind(&DhtProxyServer::get, this, _1, _2)));
     // key.post
-    router->http_post("/key/:hash", std::bind(&DhtProxyServer::put, this, _1, _2));
+    router->http_post("/key/:hash", measured(Route::Put, std::bind(&DhtProxyServer::put, this, _1, _2)));
     // key.listen
-    router->http_get("/key/:hash/listen", std::bind(&DhtProxyServer::listen, this, _1, _2));
+    router->http_get("/key/:hash/listen", measured(Route::Listen, std::bind(&DhtProxyServer::listen, this, _1, _2)));
+    // stream.open
+    router->http_get("/stream/open", measured(Route::Stream, std::bind(&DhtProxyServer::openStream, this, _1, _2)));
+    // stream.operations
+    router->http_post("/stream/:id", measured(Route::Stream, std::bind(&DhtProxyServer::streamOperations, this, _1, _2)));
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
     // key.subscribe
     router->add_handler(restinio::http_method_subscribe(),
-                        "/key/:hash", std::bind(&DhtProxyServer::subscribe, this, _1, _2));
+                        "/key/:hash", measured(Route::Subscribe, std::bind(&DhtProxyServer::subscribe, this, _1, _2)));
     // key.unsubscribe
     router->add_handler(restinio::http_method_unsubscribe(),
-                        "/key/:hash", std::bind(&DhtProxyServer::unsubscribe, this, _1, _2));
+                        "/key/:hash", measured(Route::Unsubscribe, std::bind(&DhtProxyServer::unsubscribe, this, _1, _2)));
 #endif //OPENDHT_PUSH_NOTIFICATIONS
 #ifdef OPENDHT_PROXY_SERVER_IDENTITY
     // key.sign
-    router->http_post("/key/:hash/sign", std::bind(&DhtProxyServer::putSigned, this, _1, _2));
+    router->http_post("/key/:hash/sign", measured(Route::Sign, std::bind(&DhtProxyServer::putSigned, this, _1, _2)));
     // key.encrypt
-    router->http_post("/key/:hash/encrypt", std::bind(&DhtProxyServer::putEncrypted, this, _1, _2));
+    router->http_post("/key/:hash/encrypt", measured(Route::Encrypt, std::bind(&DhtProxyServer::putEncrypted, this, _1, _2)));
 #endif // OPENDHT_PROXY_SERVER_IDENTITY
 
     return router;
@@ -685,10 +1423,16 @@ DhtProxyServer::getNodeInfo(restinio::request_handle_t request,
                             restinio::router::route_params_t /*params*/) const
 {
     try {
-        if (auto nodeInfo = nodeInfo_) {
+        if (auto nodeInfo = std::atomic_load(&nodeInfo_)) {
             auto result = nodeInfo->toJson();
             // [ipv6:ipv4]:port or ipv4:port
             result["public_ip"] = request->remote_endpoint().address().to_string();
+            // content types supported for values
+            Json::Value formats(Json::arrayValue);
+            formats.append("json");
+            formats.append("msgpack");
+            formats.append("batch");
+            result["formats"] = std::move(formats);
             auto response = initHttpResponse(request->create_response());
             response.append_body(Json::writeString(jsonBuilder_, result) + "\n");
             return response.done();
@@ -707,7 +1451,14 @@ DhtProxyServer::getStats(restinio::request_handle_t request,
 {
     requestNum_++;
     try {
-        if (auto stats = stats_) {
+        if (auto stats = std::atomic_load(&stats_)) {
+            if (acceptsMsgpack(*request)) {
+                msgpack::sbuffer buffer;
+                msgpack::pack(buffer, *stats);
+                auto response = initHttpResponse(request->create_response(), true);
+                response.append_body(std::string(buffer.data(), buffer.size()));
+                return response.done();
+            }
             auto response = initHttpResponse(request->create_response());
             response.append_body(Json::writeString(jsonBuilder_, stats->toJson()) + "\n");
             return response.done();
@@ -721,6 +1472,103 @@ DhtProxyServer::getStats(restinio::request_handle_t request,
     }
 }
 
+/* Upper bounds of the latency histograms exposed, in milliseconds */
+static const std::vector<double> METRICS_BOUNDS {
+    .5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static void
+writeHistogram(std::ostream& os, const std::string& name, const std::string& labels, const LatencyHistogram& h)
+{
+    auto counts = h.getCumulativeCounts(METRICS_BOUNDS);
+    auto sep = labels.empty() ? "" : ",";
+    for (size_t i = 0; i < METRICS_BOUNDS.size(); i++)
+        os << name << "_bucket{" << labels << sep << "le=\"" << METRICS_BOUNDS[i] / 1000. << "\"} " << counts[i] << "\n";
+    os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << h.count() << "\n";
+    auto braces = labels.empty() ? std::string() : "{" + labels + "}";
+    os << name << "_sum" << braces << " " << h.sum() / 1000. << "\n";
+    os << name << "_count" << braces << " " << h.count() << "\n";
+}
+
+static void
+writeMetric(std::ostream& os, const char* name, const char* type, const char* help, double value)
+{
+    os << "# HELP " << name << " " << help << "\n";
+    os << "# TYPE " << name << " " << type << "\n";
+    os << name << " " << value << "\n";
+}
+
+RequestStatus
+DhtProxyServer::getMetrics(restinio::request_handle_t request,
+                           restinio::router::route_params_t /*params*/)
+{
+    static const std::array<const char*, ROUTES> routeNames {{
+        "node.info", "node.stats", "metrics", "options", "get", "put",
+        "listen", "stream", "subscribe", "unsubscribe", "sign", "encrypt",
+        "batch"
+    }};
+    try {
+        std::ostringstream os;
+        os << "# HELP opendht_proxy_request_duration_seconds Time spent handling requests, by route\n";
+        os << "# TYPE opendht_proxy_request_duration_seconds histogram\n";
+        for (size_t r = 0; r < ROUTES; r++)
+            writeHistogram(os, "opendht_proxy_request_duration_seconds",
+                           std::string("route=\"") + routeNames[r] + "\"", routeLatency_[r]);
+        writeMetric(os, "opendht_proxy_requests_in_flight", "gauge", "Requests being handled", requestsInFlight_.load());
+        os << "# HELP opendht_proxy_rejected_requests_total Requests rejected by admission control, by route and reason\n";
+        os << "# TYPE opendht_proxy_rejected_requests_total counter\n";
+        for (size_t r = 0; r < ROUTES; r++) {
+            os << "opendht_proxy_rejected_requests_total{route=\"" << routeNames[r] << "\",reason=\"rate\"} " << rateLimited_[r].load() << "\n";
+            os << "opendht_proxy_rejected_requests_total{route=\"" << routeNames[r] << "\",reason=\"concurrency\"} " << concurrencyLimited_[r].load() << "\n";
+        }
+        writeMetric(os, "opendht_proxy_connections", "gauge", "Open HTTP connections", connListener_->count());
+        writeMetric(os, "opendht_proxy_listens", "gauge", "Listen operations", listenCount_.load());
+        writeMetric(os, "opendht_proxy_permanent_puts", "gauge", "Permanent put values", permanentPutCount_.load());
+        writeMetric(os, "opendht_proxy_push_listeners", "gauge", "Push tokens with a listen operation", pushListenersCount_.load());
+        writeMetric(os, "opendht_proxy_get_cache_hits_total", "counter", "GET requests answered from the cache", getCacheHits_.load());
+        writeMetric(os, "opendht_proxy_get_cache_misses_total", "counter", "GET requests sent to the DHT", getCacheMisses_.load());
+#ifdef OPENDHT_PUSH_NOTIFICATIONS
+        size_t pushQueue {0};
+        {
+            std::lock_guard<std::mutex> l(pushLock_);
+            for (const auto& batch : pushBatches_)
+                pushQueue += batch.second.size();
+        }
+        writeMetric(os, "opendht_proxy_push_queue_depth", "gauge", "Push notifications waiting to be sent", pushQueue);
+#endif
+
+        writeMetric(os, "opendht_proxy_dht_ops_in_flight", "gauge", "DHT operations pending for requests", dhtOpsInFlight_.load());
+        os << "# HELP opendht_proxy_dht_op_duration_seconds Time of DHT operations made for requests\n";
+        os << "# TYPE opendht_proxy_dht_op_duration_seconds histogram\n";
+        writeHistogram(os, "opendht_proxy_dht_op_duration_seconds", "op=\"get\"", dhtGetLatency_);
+        writeHistogram(os, "opendht_proxy_dht_op_duration_seconds", "op=\"put\"", dhtPutLatency_);
+
+        // NetworkEngine latencies, by family (rtt, handle, rx) and message type
+        if (auto metrics = dht_->getNetworkMetrics()) {
+            std::map<std::string, std::vector<std::pair<std::string, const LatencyHistogram*>>> families;
+            metrics->forEach([&](const char* name, const LatencyHistogram& h) {
+                std::string n(name);
+                auto dot = n.find('.');
+                families[n.substr(0, dot)].emplace_back(n.substr(dot + 1), &h);
+            });
+            for (const auto& family : families) {
+                auto name = "opendht_dht_" + family.first + "_seconds";
+                os << "# TYPE " << name << " histogram\n";
+                for (const auto& h : family.second)
+                    writeHistogram(os, name, "type=\"" + h.first + "\"", *h.second);
+            }
+        }
+
+        auto response = request->create_response();
+        response.append_header("Server", "RESTinio");
+        response.append_header(restinio::http_field::content_type, "text/plain; version=0.0.4");
+        response.set_body(os.str());
+        return response.done();
+    } catch (...) {
+        return serverError(*request);
+    }
+}
+
 RequestStatus
 DhtProxyServer::get(restinio::request_handle_t request,
                     restinio::router::route_params_t params)
@@ -730,19 +1578,33 @@ DhtProxyServer::get(restinio::request_handle_t request,
         InfoHash infoHash(params["hash"].to_string());
         if (!infoHash)
             infoHash = InfoHash::get(params["hash"].to_string());
+        auto format = acceptsMsgpack(*request) ? ListenBody::Packed : ListenBody::Values;
         auto response = std::make_shared<ResponseByPartsBuilder>(
-            initHttpResponse(request->create_response<ResponseByParts>()));
+            initHttpResponse(request->create_response<ResponseByParts>(), format == ListenBody::Packed));
+        if (auto cached = getCached(infoHash, {}, format)) {
+            response->append_chunk(cached);
+            response->done();
+            return restinio::request_handling_status_t::accepted;
+        }
         response->flush();
-        dht_->get(infoHash, [this, response](const std::vector<Sp<Value>>& values) {
-            std::stringstream output;
-            for (const auto& value : values) {
-                output << Json::writeString(jsonBuilder_, value->toJson()) << "\n";
-            }
-            response->append_chunk(output.str());
+        auto body = std::make_shared<std::string>();
+        auto start = clock::now();
+        auto generation = getCacheGeneration();
+        dhtOpsInFlight_++;
+        routeOps_[static_cast<size_t>(Route::Get)]++;
+        dht_->get(infoHash, [this, response, body, format](const std::vector<Sp<Value>>& values) {
+            auto output = serializeValues(values, false, format);
+            *body += *output;
+            response->append_chunk(std::move(output));
             response->flush();
             return true;
         },
-        [response] (bool /*ok*/){
+        [this, response, body, infoHash, format, start, generation] (bool ok){
+            dhtGetLatency_.record(clock::now() - start);
+            dhtOpsInFlight_--;
+            routeOps_[static_cast<size_t>(Route::Get)]--;
+            if (ok)
+                cacheGet(infoHash, {}, format, body, generation);
             response->done();
         });
         return restinio::request_handling_status_t::accepted;
@@ -761,25 +1623,29 @@ DhtProxyServer::listen(restinio::request_handle_t request,
         InfoHash infoHash(params["hash"].to_string());
         if (!infoHash)
             infoHash = InfoHash::get(params["hash"].to_string());
+        auto format = acceptsMsgpack(*request) ? ListenBody::Packed : ListenBody::Values;
         auto response = std::make_shared<ResponseByPartsBuilder>(
-            initHttpResponse(request->create_response<ResponseByParts>()));
+            initHttpResponse(request->create_response<ResponseByParts>(), format == ListenBody::Packed));
         response->flush();
-        std::lock_guard<std::mutex> lock(lockListener_);
+        auto& shard = listeners_.shard(request->connection_id());
+        std::lock_guard<std::mutex> lock(shard.lock);
         // save the listener to handle a disconnect
-        auto &session = listeners_[request->connection_id()];
+        auto sessionIt = shard.map.find(request->connection_id());
+        if (sessionIt == shard.map.end()) {
+            sessionIt = shard.map.emplace(request->connection_id(), http::ListenerSession{}).first;
+            listenCount_++;
+        } else {
+            unsubscribeListen(sessionIt->second.hash, sessionIt->second.subscription);
+        }
+        auto& session = sessionIt->second;
         session.hash = infoHash;
         session.response = response;
-        session.token = dht_->listen(infoHash, [this, response]
-                (const std::vector<Sp<Value>>& values, bool expired){
-            for (const auto& value: values){
-                auto jsonVal = value->toJson();
-                if (expired)
-                    jsonVal["expired"] = true;
-                response->append_chunk(Json::writeString(jsonBuilder_, jsonVal) + "\n");
-            }
+        // values are serialized once for all the sessions listening to infoHash
+        session.subscription = subscribeListen(infoHash, [response]
+                (const std::vector<Sp<Value>>&, bool, const std::shared_ptr<std::string>& body){
+            response->append_chunk(body);
             response->flush();
-            return true;
-        });
+        }, format);
         return restinio::request_handling_status_t::accepted;
     } catch (const std::exception& e){
         return serverError(*request);
@@ -788,6 +1654,37 @@ DhtProxyServer::listen(restinio::request_handle_t request,
 
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
 
+void
+DhtProxyServer::subscribePushListen(const std::string& pushToken, const InfoHash& infoHash, Listener& listener)
+{
+    listener.subscription = subscribeListen(infoHash,
+        [this, infoHash, pushToken, type = listener.type, clientId = listener.clientId, sessionCtx = listener.sessionCtx]
+        (const std::vector<std::shared_ptr<Value>>& values, bool expired, const std::shared_ptr<std::string>&){
+            // Build message content
+            Json::Value json;
+            json["key"] = infoHash.toString();
+            json["to"] = clientId;
+            json["t"] = Json::Value::Int64(std::chrono::duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count());
+            {
+                std::lock_guard<std::mutex> l(sessionCtx->lock);
+                json["s"] = sessionCtx->sessionId;
+            }
+            if (expired and values.size() < 2){
+                std::stringstream ss;
+                for(size_t i = 0; i < values.size(); ++i){
+                    if(i != 0) ss << ",";
+                    ss << values[i]->id;
+                }
+                json["exp"] = ss.str();
+            }
+            auto maxPrio = 1000u;
+            for (const auto& v : values)
+                maxPrio = std::min(maxPrio, v->priority);
+            sendPushNotification(pushToken, std::move(json), type, !expired and maxPrio == 0);
+        }, ListenBody::None
+    );
+}
+
 RequestStatus
 DhtProxyServer::subscribe(restinio::request_handle_t request,
                           restinio::router::route_params_t params)
@@ -814,6 +1711,10 @@ DhtProxyServer::subscribe(restinio::request_handle_t request,
             response.set_body(RESP_MSG_NO_TOKEN);
             return response.done();
         }
+        if (maxRequestsPerPushToken_ and not limit(pushTokenLimiters_, pushToken, maxRequestsPerPushToken_)) {
+            rateLimited_[static_cast<size_t>(Route::Subscribe)]++;
+            return tooManyRequests(*request);
+        }
         auto type = root["platform"].asString() == "android" ? PushType::Android : PushType::iOS;
         auto clientId = root["client_id"].asString();
         auto sessionId = root["session_id"].asString();
@@ -822,8 +1723,14 @@ DhtProxyServer::subscribe(restinio::request_handle_t request,
             logger_->d("[proxy:server] [subscribe %s] [client %s] [session %s]", infoHash.toString().c_str(), clientId.c_str(), sessionId.c_str());
 
         // Insert new or return existing push listeners of a token
-        std::lock_guard<std::mutex> lock(lockPushListeners_);
-        auto& pushListener = pushListeners_[pushToken];
+        auto& shard = pushListeners_.shard(pushToken);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto pushListenerIt = shard.map.find(pushToken);
+        if (pushListenerIt == shard.map.end()) {
+            pushListenerIt = shard.map.emplace(pushToken, PushListener{}).first;
+            pushListenersCount_++;
+        }
+        auto& pushListener = pushListenerIt->second;
         auto& pushListeners = pushListener.listeners[infoHash];
 
         auto listIt = std::find_if(pushListeners.begin(), pushListeners.end(), [&](const Listener& l) {
@@ -845,10 +1752,6 @@ DhtProxyServer::subscribe(restinio::request_handle_t request,
         auto timeout = std::chrono::steady_clock::now() + proxy::OP_TIMEOUT;
         listener.expiration = timeout;
         listener.type = type;
-        if (listener.expireNotifyTimer)
-            listener.expireNotifyTimer->expires_at(timeout - proxy::OP_MARGIN);
-        else
-            listener.expireNotifyTimer = std::make_unique<asio::steady_timer>(io_context(), timeout - proxy::OP_MARGIN);
         auto jsonProvider = [h=infoHash.toString(), clientId, sessionCtx = listener.sessionCtx](){
             Json::Value json;
             json["timeout"] = h;
@@ -857,19 +1760,23 @@ DhtProxyServer::subscribe(restinio::request_handle_t request,
             json["s"] = sessionCtx->sessionId;
             return json;
         };
-        listener.expireNotifyTimer->async_wait(std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
-                                               std::placeholders::_1, pushToken, std::move(jsonProvider), listener.type));
-        if (!listener.expireTimer)
-            listener.expireTimer = std::make_unique<asio::steady_timer>(io_context(), timeout);
+        // the push type may change
+        listener.expireNotifyTimer.set(*expirations_, timeout - proxy::OP_MARGIN,
+            std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
+                      pushToken, std::move(jsonProvider), listener.type));
+        if (listener.expireTimer)
+            listener.expireTimer.reschedule(timeout);
         else
-            listener.expireTimer->expires_at(timeout);
-        listener.expireTimer->async_wait(std::bind(&DhtProxyServer::handleCancelPushListen, this,
-                                        std::placeholders::_1, pushToken, infoHash, clientId));
+            listener.expireTimer.set(*expirations_, timeout,
+                std::bind(&DhtProxyServer::handleCancelPushListen, this, pushToken, infoHash, clientId));
 
         // Send response
         if (not newListener) {
             if (logger_)
                 logger_->d("[proxy:server] [subscribe] found [client %s]", listener.clientId.c_str());
+            // restored from the saved state, but not yet listening
+            if (not listener.subscription)
+                subscribePushListen(pushToken, infoHash, listener);
             // Send response header
             auto response = std::make_shared<ResponseByPartsBuilder>(initHttpResponse(request->create_response<ResponseByParts>()));
             response->flush();
@@ -892,33 +1799,7 @@ DhtProxyServer::subscribe(restinio::request_handle_t request,
         } else {
             // =========== No existing listener for an infoHash ============
             // Add listen on dht
-            listener.internalToken = dht_->listen(infoHash,
-                [this, infoHash, pushToken, type, clientId, sessionCtx = listener.sessionCtx]
-                (const std::vector<std::shared_ptr<Value>>& values, bool expired){
-                    // Build message content
-                    Json::Value json;
-                    json["key"] = infoHash.toString();
-                    json["to"] = clientId;
-                    json["t"] = Json::Value::Int64(std::chrono::duration_cast<std::chrono::milliseconds>(system_clock::now().time_since_epoch()).count());
-                    {
-                        std::lock_guard<std::mutex> l(sessionCtx->lock);
-                        json["s"] = sessionCtx->sessionId;
-                    }
-                    if (expired and values.size() < 2){
-                        std::stringstream ss;
-                        for(size_t i = 0; i < values.size(); ++i){
-                            if(i != 0) ss << ",";
-                            ss << values[i]->id;
-                        }
-                        json["exp"] = ss.str();
-                    }
-                    auto maxPrio = 1000u;
-                    for (const auto& v : values)
-                        maxPrio = std::min(maxPrio, v->priority);
-                    sendPushNotification(pushToken, std::move(json), type, !expired and maxPrio == 0);
-                    return true;
-                }
-            );
+            subscribePushListen(pushToken, infoHash, listener);
             auto response = initHttpResponse(request->create_response());
             response.set_body("{}\n");
             return response.done();
@@ -960,7 +1841,7 @@ DhtProxyServer::unsubscribe(restinio::request_handle_t request,
             return restinio::request_handling_status_t::rejected;
         auto clientId = root["client_id"].asString();
 
-        handleCancelPushListen(asio::error_code() /*success*/, pushToken, infoHash, clientId);
+        handleCancelPushListen(pushToken, infoHash, clientId);
         auto response = initHttpResponse(request->create_response());
         return response.done();
     }
@@ -970,38 +1851,26 @@ DhtProxyServer::unsubscribe(restinio::request_handle_t request,
 }
 
 void
-DhtProxyServer::handleNotifyPushListenExpire(const asio::error_code &ec, const std::string pushToken,
+DhtProxyServer::handleNotifyPushListenExpire(const std::string pushToken,
                                              std::function<Json::Value()> jsonProvider, PushType type)
 {
-    if (ec == asio::error::operation_aborted)
-        return;
-    else if (ec) {
-        if (logger_)
-            logger_->e("[proxy:server] [subscribe] error sending put refresh: %s", ec.message().c_str());
-    }
     if (logger_)
         logger_->d("[proxy:server] [subscribe] sending put refresh to %s token", pushToken.c_str());
     sendPushNotification(pushToken, jsonProvider(), type, false);
 }
 
 void
-DhtProxyServer::handleCancelPushListen(const asio::error_code &ec, const std::string pushToken,
+DhtProxyServer::handleCancelPushListen(const std::string pushToken,
                                        const InfoHash key, const std::string clientId)
 {
-    if (ec == asio::error::operation_aborted)
-        return;
-    else if (ec){
-        if (logger_)
-            logger_->e("[proxy:server] [listen:push %s] error cancel: %s",
-                        key.toString().c_str(), ec.message().c_str());
-    }
     if (logger_)
         logger_->d("[proxy:server] [listen:push %s] cancelled for %s",
                    key.toString().c_str(), clientId.c_str());
-    std::lock_guard<std::mutex> lock(lockListener_);
+    auto& shard = pushListeners_.shard(pushToken);
+    std::lock_guard<std::mutex> lock(shard.lock);
 
-    auto pushListener = pushListeners_.find(pushToken);
-    if (pushListener == pushListeners_.end())
+    auto pushListener = shard.map.find(pushToken);
+    if (pushListener == shard.map.end())
         return;
     auto listeners = pushListener->second.listeners.find(key);
     if (listeners == pushListener->second.listeners.end())
@@ -1010,7 +1879,7 @@ DhtProxyServer::handleCancelPushListen(const asio::error_code &ec, const std::st
     for (auto listener = listeners->second.begin(); listener != listeners->second.end();){
         if (listener->clientId == clientId){
             if (dht_)
-                dht_->cancelListen(key, std::move(listener->internalToken));
+                unsubscribeListen(key, listener->subscription);
             listener = listeners->second.erase(listener);
         } else {
             ++listener;
@@ -1018,8 +1887,10 @@ DhtProxyServer::handleCancelPushListen(const asio::error_code &ec, const std::st
     }
     if (listeners->second.empty())
         pushListener->second.listeners.erase(listeners);
-    if (pushListener->second.listeners.empty())
-        pushListeners_.erase(pushListener);
+    if (pushListener->second.listeners.empty()) {
+        shard.map.erase(pushListener);
+        pushListenersCount_--;
+    }
 }
 
 void
@@ -1028,6 +1899,59 @@ DhtProxyServer::sendPushNotification(const std::string& token, Json::Value&& jso
     if (pushServer_.empty())
         return;
 
+    // NOTE: see https://github.com/appleboy/gorush
+    Json::Value notification(Json::objectValue);
+    Json::Value tokens(Json::arrayValue);
+    tokens[0] = token;
+    notification["tokens"] = std::move(tokens);
+    notification["platform"] = type == PushType::Android ? 2 : 1;
+    notification["data"] = std::move(json);
+    notification["priority"] = highPriority ? "high" : "normal";
+    notification["time_to_live"] = 600;
+
+    Json::Value full;
+    {
+        std::lock_guard<std::mutex> l(pushLock_);
+        auto& batch = pushBatches_[std::make_pair(type, highPriority)];
+        if (batch.isNull())
+            batch = Json::Value(Json::arrayValue);
+        batch.append(std::move(notification));
+        if (batch.size() >= PUSH_BATCH_SIZE) {
+            full = std::move(batch);
+            pushBatches_.erase(std::make_pair(type, highPriority));
+        } else if (not pushTimerScheduled_) {
+            // high priority notifications are sent earlier
+            if (not pushTimer_)
+                pushTimer_ = std::make_unique<asio::steady_timer>(io_context());
+            pushTimer_->expires_after(highPriority ? PUSH_BATCH_DELAY / 10 : PUSH_BATCH_DELAY);
+            pushTimer_->async_wait([this](const asio::error_code& ec) {
+                if (ec != asio::error::operation_aborted)
+                    flushPushNotifications();
+            });
+            pushTimerScheduled_ = true;
+        }
+    }
+    if (not full.isNull())
+        sendPushBatch(std::move(full));
+}
+
+void
+DhtProxyServer::flushPushNotifications()
+{
+    std::map<std::pair<PushType, bool>, Json::Value> batches;
+    {
+        std::lock_guard<std::mutex> l(pushLock_);
+        batches = std::move(pushBatches_);
+        pushBatches_.clear();
+        pushTimerScheduled_ = false;
+    }
+    for (auto& batch : batches)
+        sendPushBatch(std::move(batch.second));
+}
+
+void
+DhtProxyServer::sendPushBatch(Json::Value&& notifications)
+{
     unsigned reqid = 0;
     try {
         auto request = std::make_shared<http::Request>(io_context(), pushHostPort_.first, pushHostPort_.second,
@@ -1039,19 +1963,8 @@ DhtProxyServer::sendPushNotification(const std::string& token, Json::Value&& jso
         request->set_header_field(restinio::http_field_t::user_agent, "RESTinio client");
         request->set_header_field(restinio::http_field_t::accept, "*/*");
         request->set_header_field(restinio::http_field_t::content_type, "application/json");
-
-        // NOTE: see https://github.com/appleboy/gorush
-        Json::Value notification(Json::objectValue);
-        Json::Value tokens(Json::arrayValue);
-        tokens[0] = token;
-        notification["tokens"] = std::move(tokens);
-        notification["platform"] = type == PushType::Android ? 2 : 1;
-        notification["data"] = std::move(json);
-        notification["priority"] = highPriority ? "high" : "normal";
-        notification["time_to_live"] = 600;
-
-        Json::Value notifications(Json::arrayValue);
-        notifications[0] = notification;
+        request->set_connection_type(restinio::http_connection_header_t::keep_alive);
+        request->set_connection_pool(pushConnections_);
 
         Json::Value content;
         content["notifications"] = std::move(notifications);
@@ -1061,13 +1974,20 @@ DhtProxyServer::sendPushNotification(const std::string& token, Json::Value&& jso
             if (state == http::Request::State::DONE){
                 if (logger_ and response.status_code != 200)
                     logger_->e("[proxy:server] [notification] push failed: %i", response.status_code);
-                std::lock_guard<std::mutex> l(requestLock_);
-                requests_.erase(reqid);
+                std::shared_ptr<http::Request> request;
+                auto& shard = requests_.shard(reqid);
+                std::lock_guard<std::mutex> l(shard.lock);
+                auto it = shard.map.find(reqid);
+                if (it != shard.map.end()) {
+                    request = std::move(it->second);
+                    shard.map.erase(it);
+                }
             }
         });
         {
-            std::lock_guard<std::mutex> l(requestLock_);
-            requests_[reqid] = request;
+            auto& shard = requests_.shard(reqid);
+            std::lock_guard<std::mutex> l(shard.lock);
+            shard.map[reqid] = request;
         }
         request->send();
     }
@@ -1075,8 +1995,9 @@ DhtProxyServer::sendPushNotification(const std::string& token, Json::Value&& jso
         if (logger_)
             logger_->e("[proxy:server] [notification] error send push: %i", e.what());
         if (reqid) {
-            std::lock_guard<std::mutex> l(requestLock_);
-            requests_.erase(reqid);
+            auto& shard = requests_.shard(reqid);
+            std::lock_guard<std::mutex> l(shard.lock);
+            shard.map.erase(reqid);
         }
     }
 }
@@ -1084,19 +2005,14 @@ DhtProxyServer::sendPushNotification(const std::string& token, Json::Value&& jso
 #endif //OPENDHT_PUSH_NOTIFICATIONS
 
 void
-DhtProxyServer::handleCancelPermamentPut(const asio::error_code &ec, const InfoHash& key, Value::Id vid)
+DhtProxyServer::handleCancelPermamentPut(const InfoHash& key, Value::Id vid)
 {
-    if (ec == asio::error::operation_aborted)
-        return;
-    else if (ec){
-        if (logger_)
-            logger_->e("[proxy:server] [put:permament] error sending put refresh: %s", ec.message().c_str());
-    }
     if (logger_)
         logger_->d("[proxy:server] [put %s] cancel permament put %i", key.toString().c_str(), vid);
-    std::lock_guard<std::mutex> lock(lockSearchPuts_);
-    auto sPuts = puts_.find(key);
-    if (sPuts == puts_.end())
+    auto& shard = puts_.shard(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto sPuts = shard.map.find(key);
+    if (sPuts == shard.map.end())
         return;
     auto& sPutsMap = sPuts->second.puts;
     auto put = sPutsMap.find(vid);
@@ -1104,13 +2020,12 @@ DhtProxyServer::handleCancelPermamentPut(const asio::error_code &ec, const InfoH
         return;
     if (dht_)
         dht_->cancelPut(key, vid);
-    if (put->second.expireTimer)
-        put->second.expireTimer->cancel();
-    if (put->second.expireNotifyTimer)
-        put->second.expireNotifyTimer->cancel();
     sPutsMap.erase(put);
-    if (sPutsMap.empty())
-        puts_.erase(sPuts);
+    permanentPutCount_--;
+    if (sPutsMap.empty()) {
+        shard.map.erase(sPuts);
+        putCount_--;
+    }
 }
 
 RequestStatus
@@ -1133,58 +2048,130 @@ DhtProxyServer::put(restinio::request_handle_t request,
         Json::Value root;
         auto* char_data = reinterpret_cast<const char*>(request->body().data());
         auto reader = std::unique_ptr<Json::CharReader>(jsonReaderBuilder_.newCharReader());
+        auto format = acceptsMsgpack(*request) ? ListenBody::Packed : ListenBody::Values;
+
+        Sp<Value> value;
+        if (hasMsgpackBody(*request)) {
+            // {"v": value, "permanent": true or {"key": push token, ...}}
+            auto msg = msgpack::unpack(char_data, request->body().size());
+            const auto& o = msg.get();
+            if (auto v = findMapValue(o, "v"))
+                value = std::make_shared<Value>(*v);
+            if (auto p = findMapValue(o, "permanent")) {
+                if (p->type == msgpack::type::MAP) {
+                    Json::Value pVal(Json::objectValue);
+                    for (uint32_t i = 0; i < p->via.map.size; i++) {
+                        const auto& kv = p->via.map.ptr[i];
+                        pVal[kv.key.as<std::string>()] = kv.val.as<std::string>();
+                    }
+                    root["permanent"] = std::move(pVal);
+                } else
+                    root["permanent"] = true;
+            }
+        } else if (reader->parse(char_data, char_data + request->body().size(), &root, &err))
+            value = std::make_shared<Value>(root);
 
-        if (reader->parse(char_data, char_data + request->body().size(), &root, &err)){
-            auto value = std::make_shared<Value>(root);
-            bool permanent = root.isMember("permanent");
-            if (logger_)
-                logger_->d("[proxy:server] [put %s] %s %s", infoHash.toString().c_str(),
-                          value->toString().c_str(), (permanent ? "permanent" : ""));
-            if (permanent) {
-                std::string pushToken, clientId, sessionId, platform;
-                auto& pVal = root["permanent"];
-                if (pVal.isObject()){
-                    pushToken = pVal["key"].asString();
-                    clientId = pVal["client_id"].asString();
-                    platform = pVal["platform"].asString();
-                    sessionId = pVal["session_id"].asString();
+        if (value) {
+            auto done = [this, request, value, format](bool ok) {
+                if (ok){
+                    auto response = initHttpResponse(request->create_response(), format == ListenBody::Packed);
+                    response.append_body(*serializeValues({value}, false, format));
+                    response.done();
+                } else {
+                    auto response = initHttpResponse(request->create_response(restinio::status_bad_gateway()));
+                    response.set_body(RESP_MSG_PUT_FAILED);
+                    response.done();
                 }
-                std::lock_guard<std::mutex> lock(lockSearchPuts_);
-                auto timeout = std::chrono::steady_clock::now() + proxy::OP_TIMEOUT;
-                auto& sPuts = puts_[infoHash];
-                if (value->id == Value::INVALID_ID) {
-                    for (auto& pp : sPuts.puts) {
-                        if (pp.second.pushToken == pushToken
-                            and pp.second.clientId == clientId
-                            and pp.second.value->contentEquals(*value))
-                        {
-                            pp.second.expireTimer->expires_at(timeout);
-                            pp.second.expireTimer->async_wait(std::bind(&DhtProxyServer::handleCancelPermamentPut, this,
-                                                        std::placeholders::_1, infoHash, pp.second.value->id));
-                            if (not sessionId.empty()) {
-                                if (not pp.second.sessionCtx)
-                                    pp.second.sessionCtx = std::make_shared<PushSessionContext>(sessionId);
-                                else {
-                                    std::lock_guard<std::mutex> l(pp.second.sessionCtx->lock);
-                                    pp.second.sessionCtx->sessionId = sessionId;
-                                }
+            };
+            if (not putValue(infoHash, value, root["permanent"], std::move(done))) {
+                rateLimited_[static_cast<size_t>(Route::Put)]++;
+                return tooManyRequests(*request);
+            }
+            return restinio::request_handling_status_t::accepted;
+        } else {
+            auto response = initHttpResponse(request->create_response(restinio::status_bad_request()));
+            response.set_body(RESP_MSG_JSON_INCORRECT);
+            return response.done();
+        }
+    } catch (const std::exception& e){
+        if (logger_)
+            logger_->d("[proxy:server] error in put: %s", e.what());
+        return serverError(*request);
+    }
+}
+
+bool
+DhtProxyServer::putValue(const InfoHash& infoHash, const Sp<Value>& value, const Json::Value& pVal, PutCallback done)
+{
+    bool permanent = not pVal.isNull();
+    if (logger_)
+        logger_->d("[proxy:server] [put %s] %s %s", infoHash.toString().c_str(),
+                  value->toString().c_str(), (permanent ? "permanent" : ""));
+    invalidateGetCache(infoHash);
+    if (permanent) {
+        std::string pushToken, clientId, sessionId, platform;
+        if (pVal.isObject()){
+            pushToken = pVal["key"].asString();
+            clientId = pVal["client_id"].asString();
+            platform = pVal["platform"].asString();
+            sessionId = pVal["session_id"].asString();
+        }
+        if (maxRequestsPerPushToken_ and not pushToken.empty()
+            and not limit(pushTokenLimiters_, pushToken, maxRequestsPerPushToken_))
+            return false;
+        bool refreshed = false;
+        {
+            auto& shard = puts_.shard(infoHash);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            auto timeout = std::chrono::steady_clock::now() + proxy::OP_TIMEOUT;
+            auto sPutsIt = shard.map.find(infoHash);
+            if (sPutsIt == shard.map.end()) {
+                sPutsIt = shard.map.emplace(infoHash, SearchPuts{}).first;
+                putCount_++;
+            }
+            auto& sPuts = sPutsIt->second;
+            if (value->id == Value::INVALID_ID) {
+                for (auto& pp : sPuts.puts) {
+                    if (pp.second.pushToken == pushToken
+                        and pp.second.clientId == clientId
+                        and pp.second.value->contentEquals(*value))
+                    {
+                        pp.second.expiration = timeout;
+                        pp.second.expireTimer.reschedule(timeout);
+                        pp.second.expireNotifyTimer.reschedule(timeout - proxy::OP_MARGIN);
+                        if (not sessionId.empty()) {
+                            if (not pp.second.sessionCtx)
+                                pp.second.sessionCtx = std::make_shared<PushSessionContext>(sessionId);
+                            else {
+                                std::lock_guard<std::mutex> l(pp.second.sessionCtx->lock);
+                                pp.second.sessionCtx->sessionId = sessionId;
                             }
-                            auto response = initHttpResponse(request->create_response());
-                            response.append_body(Json::writeString(jsonBuilder_, value->toJson()) + "\n");
-                            return response.done();
                         }
+                        value->id = pp.first;
+                        refreshed = true;
+                        break;
                     }
+                }
+                if (not refreshed) {
+                    std::lock_guard<std::mutex> l(rdLock_);
                     value->id = std::uniform_int_distribution<Value::Id>{1}(rd);
                 }
+            }
 
+            if (not refreshed) {
                 auto vid = value->id;
-                auto& pput = sPuts.puts[vid];
+                auto pputIt = sPuts.puts.find(vid);
+                if (pputIt == sPuts.puts.end()) {
+                    pputIt = sPuts.puts.emplace(vid, PermanentPut{}).first;
+                    permanentPutCount_++;
+                }
+                auto& pput = pputIt->second;
                 pput.value = value;
                 pput.expiration = timeout;
                 if (not pput.expireTimer) {
-                    auto &ctx = io_context();
                     // cancel permanent put
-                    pput.expireTimer = std::make_unique<asio::steady_timer>(ctx, timeout);
+                    pput.expireTimer.set(*expirations_, timeout,
+                        std::bind(&DhtProxyServer::handleCancelPermamentPut, this, infoHash, vid));
 #ifdef OPENDHT_PUSH_NOTIFICATIONS
                     if (not pushToken.empty()){
                         bool isAndroid = platform == "android";
@@ -1202,14 +2189,9 @@ DhtProxyServer::put(restinio::request_handle_t request,
                             json["s"] = sessionCtx->sessionId;
                             return json;
                         };
-                        if (!pput.expireNotifyTimer)
-                            pput.expireNotifyTimer = std::make_unique<asio::steady_timer>(ctx,
-                                                     timeout - proxy::OP_MARGIN);
-                        else
-                            pput.expireNotifyTimer->expires_at(timeout - proxy::OP_MARGIN);
-                        pput.expireNotifyTimer->async_wait(std::bind(
-                            &DhtProxyServer::handleNotifyPushListenExpire, this,
-                            std::placeholders::_1, pushToken, std::move(jsonProvider), pput.type));
+                        pput.expireNotifyTimer.set(*expirations_, timeout - proxy::OP_MARGIN,
+                            std::bind(&DhtProxyServer::handleNotifyPushListenExpire, this,
+                                      pushToken, std::move(jsonProvider), pput.type));
                     }
 #endif
                 } else {
@@ -1221,33 +2203,342 @@ DhtProxyServer::put(restinio::request_handle_t request,
                             pput.sessionCtx->sessionId = sessionId;
                         }
                     }
-                    pput.expireTimer->expires_at(timeout);
-                    if (pput.expireNotifyTimer)
-                        pput.expireNotifyTimer->expires_at(timeout - proxy::OP_MARGIN);
+                    pput.expireTimer.reschedule(timeout);
+                    pput.expireNotifyTimer.reschedule(timeout - proxy::OP_MARGIN);
                 }
-                pput.expireTimer->async_wait(std::bind(&DhtProxyServer::handleCancelPermamentPut, this,
-                                                std::placeholders::_1, infoHash, vid));
             }
-            dht_->put(infoHash, value, [this, request, value](bool ok){
-                if (ok){
-                    auto response = initHttpResponse(request->create_response());
-                    response.append_body(Json::writeString(jsonBuilder_, value->toJson()) + "\n");
-                    response.done();
-                } else {
-                    auto response = initHttpResponse(request->create_response(restinio::status_bad_gateway()));
-                    response.set_body(RESP_MSG_PUT_FAILED);
-                    response.done();
-                }
-            }, time_point::max(), permanent);
-            return restinio::request_handling_status_t::accepted;
+        }
+        if (refreshed) {
+            done(true);
+            return true;
+        }
+    }
+    auto start = clock::now();
+    dhtOpsInFlight_++;
+    routeOps_[static_cast<size_t>(Route::Put)]++;
+    dht_->put(infoHash, value, [this, done = std::move(done), start](bool ok){
+        dhtPutLatency_.record(clock::now() - start);
+        dhtOpsInFlight_--;
+        routeOps_[static_cast<size_t>(Route::Put)]--;
+        done(ok);
+    }, time_point::max(), permanent);
+    return true;
+}
+
+RequestStatus
+DhtProxyServer::batch(restinio::request_handle_t request,
+                      restinio::router::route_params_t /*params*/)
+{
+    requestNum_++;
+    try {
+        std::string err;
+        Json::Value root;
+        auto* char_data = reinterpret_cast<const char*>(request->body().data());
+        auto reader = std::unique_ptr<Json::CharReader>(jsonReaderBuilder_.newCharReader());
+        if (not reader->parse(char_data, char_data + request->body().size(), &root, &err)
+            or not root.isArray() or root.size() > MAX_BATCH_OPS)
+        {
+            auto response = initHttpResponse(request->create_response(restinio::status_bad_request()));
+            response.set_body(RESP_MSG_JSON_INCORRECT);
+            return response.done();
+        }
+
+        // Results are sent once every operation is done,
+        // the extra pending operation is released after they are all started.
+        struct BatchState {
+            std::mutex lock;
+            Json::Value results {Json::arrayValue};
+            size_t pending;
+        };
+        auto state = std::make_shared<BatchState>();
+        state->pending = root.size() + 1;
+        for (Json::ArrayIndex i = 0; i < root.size(); i++)
+            state->results[i]["ok"] = false;
+        auto opDone = [this, request, state](Json::ArrayIndex i, bool ok, Value::Id vid) {
+            std::unique_lock<std::mutex> l(state->lock);
+            if (i < state->results.size()) {
+                state->results[i]["ok"] = ok;
+                if (ok)
+                    state->results[i]["id"] = std::to_string(vid);
+            }
+            if (--state->pending)
+                return;
+            auto body = Json::writeString(jsonBuilder_, state->results) + "\n";
+            l.unlock();
+            auto response = initHttpResponse(request->create_response());
+            response.set_body(std::move(body));
+            response.done();
+        };
+        // puts are admitted one by one, as REST puts are
+        const auto ip = clientKey(*request);
+        auto admitPut = [&] {
+            if (maxRequestsPerIp_ and not limit(ipLimiters_, ip, maxRequestsPerIp_)) {
+                rateLimited_[static_cast<size_t>(Route::Batch)]++;
+                return false;
+            }
+            if (maxConcurrentRequests_ and routeOps_[static_cast<size_t>(Route::Put)] >= maxConcurrentRequests_) {
+                concurrencyLimited_[static_cast<size_t>(Route::Batch)]++;
+                return false;
+            }
+            return true;
+        };
+
+        for (Json::ArrayIndex i = 0; i < root.size(); i++) {
+            const auto& op = root[i];
+            if (not op.isObject() or op["op"].asString() != "put" or not op["value"].isObject()) {
+                opDone(i, false, {});
+                continue;
+            }
+            InfoHash infoHash(op["key"].asString());
+            if (not infoHash)
+                infoHash = InfoHash::get(op["key"].asString());
+            Sp<Value> value;
+            try {
+                value = std::make_shared<Value>(op["value"]);
+            } catch (const std::exception& e) {
+                if (logger_)
+                    logger_->d("[proxy:server] error in batch put: %s", e.what());
+                opDone(i, false, {});
+                continue;
+            }
+            if (not admitPut()) {
+                opDone(i, false, {});
+                continue;
+            }
+            if (not putValue(infoHash, value, op["permanent"], [opDone, i, value](bool ok) {
+                opDone(i, ok, value->id);
+            })) {
+                rateLimited_[static_cast<size_t>(Route::Batch)]++;
+                opDone(i, false, {});
+            }
+        }
+        opDone(root.size(), true, {});
+        return restinio::request_handling_status_t::accepted;
+    } catch (const std::exception& e){
+        if (logger_)
+            logger_->d("[proxy:server] error in batch: %s", e.what());
+        return serverError(*request);
+    }
+}
+
+void
+DhtProxyServer::StreamSession::write(std::shared_ptr<std::string> data)
+{
+    std::lock_guard<std::mutex> l(writeLock);
+    if (response) {
+        response->append_chunk(std::move(data));
+        response->flush();
+    }
+}
+
+void
+DhtProxyServer::closeStream(const std::string& id)
+{
+    Sp<StreamSession> session;
+    {
+        auto& shard = streams_.shard(id);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.map.find(id);
+        if (it == shard.map.end())
+            return;
+        session = std::move(it->second);
+        shard.map.erase(it);
+    }
+    {
+        std::lock_guard<std::mutex> l(session->lock);
+        for (const auto& sub : session->subscriptions)
+            unsubscribeListen(sub.first, sub.second);
+        listenCount_ -= session->subscriptions.size();
+        session->subscriptions.clear();
+    }
+    std::lock_guard<std::mutex> l(session->writeLock);
+    session->response.reset();
+    if (logger_)
+        logger_->d("[proxy:server] [stream %s] closed", id.c_str());
+}
+
+RequestStatus
+DhtProxyServer::openStream(restinio::request_handle_t request,
+                           restinio::router::route_params_t /*params*/)
+{
+    requestNum_++;
+    try {
+        auto session = std::make_shared<StreamSession>();
+        session->packed = acceptsMsgpack(*request);
+        session->response = std::make_shared<ResponseByPartsBuilder>(
+            initHttpResponse(request->create_response<ResponseByParts>(), session->packed));
+        // the stream id gives control over the stream, it must not be guessed
+        auto id = InfoHash::getRandom().toString();
+        {
+            auto& shard = streams_.shard(id);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            shard.map.emplace(id, session);
+        }
+        std::string previous;
+        {
+            auto& shard = streamConnections_.shard(request->connection_id());
+            std::lock_guard<std::mutex> lock(shard.lock);
+            auto& s = shard.map[request->connection_id()];
+            previous = std::move(s);
+            s = id;
+        }
+        if (not previous.empty())
+            closeStream(previous);
+        if (logger_)
+            logger_->d("[proxy:server] [stream %s] opened", id.c_str());
+        if (session->packed) {
+            msgpack::sbuffer buffer;
+            msgpack::packer<msgpack::sbuffer> pk(&buffer);
+            pk.pack_map(1);
+            pk.pack("stream"); pk.pack(id);
+            session->write(std::make_shared<std::string>(buffer.data(), buffer.size()));
         } else {
+            Json::Value json;
+            json["stream"] = id;
+            session->write(std::make_shared<std::string>(Json::writeString(jsonBuilder_, json) + "\n"));
+        }
+        return restinio::request_handling_status_t::accepted;
+    } catch (const std::exception& e){
+        return serverError(*request);
+    }
+}
+
+RequestStatus
+DhtProxyServer::streamOperations(restinio::request_handle_t request,
+                                 restinio::router::route_params_t params)
+{
+    requestNum_++;
+    auto id = params["id"].to_string();
+    Sp<StreamSession> session;
+    {
+        auto& shard = streams_.shard(id);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.map.find(id);
+        if (it != shard.map.end())
+            session = it->second;
+    }
+    if (not session) {
+        auto response = initHttpResponse(request->create_response(restinio::status_not_found()));
+        response.set_body(RESP_MSG_STREAM_NOT_FOUND);
+        return response.done();
+    }
+    try {
+        std::string err;
+        Json::Value root;
+        auto* char_data = reinterpret_cast<const char*>(request->body().data());
+        auto reader = std::unique_ptr<Json::CharReader>(jsonReaderBuilder_.newCharReader());
+        if (not reader->parse(char_data, char_data + request->body().size(), &root, &err) or not root.isArray()) {
             auto response = initHttpResponse(request->create_response(restinio::status_bad_request()));
             response.set_body(RESP_MSG_JSON_INCORRECT);
             return response.done();
         }
+        std::weak_ptr<StreamSession> w = session;
+        // results of put operations are sent on the stream
+        auto putDone = [this](const Sp<StreamSession>& s, const InfoHash& key, Value::Id vid, bool ok) {
+            if (s->packed) {
+                msgpack::sbuffer buffer;
+                msgpack::packer<msgpack::sbuffer> pk(&buffer);
+                pk.pack_map(3);
+                pk.pack("key"); pk.pack(key);
+                pk.pack("put"); pk.pack(vid);
+                pk.pack("ok"); pk.pack(ok);
+                s->write(std::make_shared<std::string>(buffer.data(), buffer.size()));
+                return;
+            }
+            Json::Value json;
+            json["key"] = key.toString();
+            json["put"] = std::to_string(vid);
+            json["ok"] = ok;
+            s->write(std::make_shared<std::string>(Json::writeString(jsonBuilder_, json) + "\n"));
+        };
+        // puts are admitted one by one, as REST puts are
+        const auto ip = clientKey(*request);
+        auto admitPut = [&] {
+            if (maxRequestsPerIp_ and not limit(ipLimiters_, ip, maxRequestsPerIp_)) {
+                rateLimited_[static_cast<size_t>(Route::Stream)]++;
+                return false;
+            }
+            if (maxConcurrentRequests_ and routeOps_[static_cast<size_t>(Route::Put)] >= maxConcurrentRequests_) {
+                concurrencyLimited_[static_cast<size_t>(Route::Stream)]++;
+                return false;
+            }
+            return true;
+        };
+
+        // an invalid operation fails alone, with an error in its result
+        Json::Value results(Json::arrayValue);
+        for (const auto& op : root) {
+            auto& result = results.append(Json::Value(Json::objectValue));
+            result["ok"] = false;
+            if (not op.isObject() or not op["op"].isString() or not op["key"].isString()) {
+                result["err"] = "Invalid operation";
+                continue;
+            }
+            const auto& name = op["op"].asString();
+            const auto& hash = op["key"].asString();
+            InfoHash key(hash);
+            if (!key)
+                key = InfoHash::get(hash);
+            if (name == "listen") {
+                std::lock_guard<std::mutex> l(session->lock);
+                if (session->subscriptions.find(key) != session->subscriptions.end()) {
+                    result["ok"] = true;
+                    continue;
+                }
+                if (maxConcurrentRequests_ and listenCount_ >= maxConcurrentRequests_) {
+                    concurrencyLimited_[static_cast<size_t>(Route::Stream)]++;
+                    result["err"] = "Too many requests";
+                    continue;
+                }
+                session->subscriptions[key] = subscribeListen(key, [w]
+                        (const std::vector<Sp<Value>>&, bool, const std::shared_ptr<std::string>& body){
+                    if (auto s = w.lock())
+                        s->write(body);
+                }, session->packed ? ListenBody::KeyedPacked : ListenBody::KeyedValues);
+                listenCount_++;
+                result["ok"] = true;
+            } else if (name == "cancel") {
+                std::lock_guard<std::mutex> l(session->lock);
+                auto sub = session->subscriptions.find(key);
+                if (sub == session->subscriptions.end()) {
+                    result["err"] = "Not listening";
+                    continue;
+                }
+                unsubscribeListen(key, sub->second);
+                session->subscriptions.erase(sub);
+                listenCount_--;
+                result["ok"] = true;
+            } else if (name == "put") {
+                Sp<Value> value;
+                try {
+                    if (op["value"].isObject())
+                        value = std::make_shared<Value>(op["value"]);
+                } catch (const std::exception& e) {
+                    if (logger_)
+                        logger_->d("[proxy:server] [stream %s] invalid value: %s", id.c_str(), e.what());
+                }
+                if (not value) {
+                    result["err"] = "Invalid value";
+                    continue;
+                }
+                if (not admitPut() or not putValue(key, value, op["permanent"], [w, key, value, putDone](bool ok) {
+                    if (auto s = w.lock())
+                        putDone(s, key, value->id, ok);
+                })) {
+                    result["err"] = "Too many requests";
+                    putDone(session, key, value->id, false);
+                    continue;
+                }
+                result["ok"] = true;
+            } else
+                result["err"] = "Unknown operation";
+        }
+        auto response = initHttpResponse(request->create_response());
+        response.set_body(Json::writeString(jsonBuilder_, results) + "\n");
+        return response.done();
     } catch (const std::exception& e){
         if (logger_)
-            logger_->d("[proxy:server] error in put: %s", e.what());
+            logger_->d("[proxy:server] [stream %s] error: %s", id.c_str(), e.what());
         return serverError(*request);
     }
 }
@@ -1387,16 +2678,34 @@ DhtProxyServer::getFiltered(restinio::request_handle_t request,
         infoHash = InfoHash::get(params["hash"].to_string());
 
     try {
+        auto format = acceptsMsgpack(*request) ? ListenBody::Packed : ListenBody::Values;
         auto response = std::make_shared<ResponseByPartsBuilder>(
-            initHttpResponse(request->create_response<ResponseByParts>()));
+            initHttpResponse(request->create_response<ResponseByParts>(), format == ListenBody::Packed));
+        if (auto cached = getCached(infoHash, value, format)) {
+            response->append_chunk(cached);
+            response->done();
+            return restinio::request_handling_status_t::accepted;
+        }
         response->flush();
+        auto body = std::make_shared<std::string>();
+        auto start = clock::now();
+        auto generation = getCacheGeneration();
+        dhtOpsInFlight_++;
+        routeOps_[static_cast<size_t>(Route::Get)]++;
         dht_->get(infoHash,
-            [this, response](const Sp<Value>& value) {
-                response->append_chunk(Json::writeString(jsonBuilder_, value->toJson()) + "\n");
+            [this, response, body, format](const Sp<Value>& value) {
+                auto output = serializeValues({value}, false, format);
+                *body += *output;
+                response->append_chunk(std::move(output));
                 response->flush();
                 return true;
             },
-            [response] (bool /*ok*/){
+            [this, response, body, infoHash, value, format, start, generation] (bool ok){
+                dhtGetLatency_.record(clock::now() - start);
+                dhtOpsInFlight_--;
+                routeOps_[static_cast<size_t>(Route::Get)]--;
+                if (ok)
+                    cacheGet(infoHash, value, format, body, generation);
                 response->done();
             },
             {}, value);
@@ -52,9 +52,16 @@ struct NodeInsertionPack {
     dht::InfoHash nodeId;
     in_port_t port;
     dht::NetId net;
-    MSGPACK_DEFINE(nodeId, port, net)
+    /* good nodes of the routing table, for LAN bootstrap (ignored by older peers) */
+    std::vector<NodeExport> nodes;
+    MSGPACK_DEFINE(nodeId, port, net, nodes)
 };
 
+/* maximum number of nodes published for LAN bootstrap */
+static constexpr size_t LAN_BOOTSTRAP_NODES {32};
+/* period of the update of the nodes published for LAN bootstrap */
+static constexpr std::chrono::minutes LAN_EXPORT_PERIOD {10};
+
 DhtRunner::DhtRunner() : dht_()
 #ifdef OPENDHT_PROXY_CLIENT
 , dht_via_proxy_()
@@ -125,7 +132,7 @@ DhtRunner::run(SockAddr& local4, SockAddr& local6, const Config& config, Context
         }
 
         if (not context.sock)
-            context.sock.reset(new net::UdpSocket(local4, local6, context.logger));
+            context.sock.reset(new net::UdpSocket(local4, local6, context.logger, config.receive_threads));
 
         if (not state_path.empty()) {
             std::ofstream outConfig(state_path);
@@ -149,30 +156,61 @@ DhtRunner::run(const Config& config, Context&& context)
         logger_->d("[runner %p] state changed to Running", this);
     }
 
-    context.sock->setOnReceive([&] (net::PacketList&& pkts) {
+    // Packets are decoded and checked on the receive thread,
+    // so that the DHT thread only has to process valid messages.
+    auto network = config.dht_config.node_config.network;
+    auto maxSize = std::max<size_t>(config.rx_queue_max_size, 1);
+    auto shedRequests = config.rx_queue_policy == RxQueuePolicy::ShedRequests;
+    context.sock->setOnReceive([this, network, maxSize, shedRequests] (net::PacketList&& pkts) {
         net::PacketList ret;
+        for (auto it = pkts.begin(); it != pkts.end();) {
+            it->msg = net::NetworkEngine::parseMessage(it->data.data(), it->data.size(), it->from, network, logger_);
+            if (it->msg)
+                ++it;
+            else
+                ret.splice(ret.end(), pkts, it++);
+        }
+        size_t dropped {0};
+        auto drop = [&](net::PacketList& list, net::PacketList::iterator it) {
+            rx_dropped_.add(net::NetworkEngine::getMessageType(*it->msg));
+            it->msg.reset();
+            ret.splice(ret.end(), list, it);
+            dropped++;
+        };
         {
             std::lock_guard<std::mutex> lck(sock_mtx);
-            auto maxSize = net::RX_QUEUE_MAX_SIZE - pkts.size();
-            while (rcv.size() > maxSize) {
-                if (logger_)
-                    logger_->e("Dropping packet: queue is full!");
-                rcv.pop_front();
+            while (not pkts.empty()) {
+                auto it = pkts.begin();
+                bool request = shedRequests and net::NetworkEngine::isRequest(*it->msg);
+                if (rcv.size() + rcv_requests.size() >= maxSize) {
+                    if (request) {
+                        drop(pkts, it);
+                        continue;
+                    }
+                    if (not rcv_requests.empty())
+                        drop(rcv_requests, std::prev(rcv_requests.end()));
+                    else
+                        drop(rcv, rcv.begin());
+                }
+                auto& queue = request ? rcv_requests : rcv;
+                queue.splice(queue.end(), pkts, it);
             }
-
-            rcv.splice(rcv.end(), std::move(pkts));
-            ret = std::move(rcv_free);
+            ret.splice(ret.end(), std::move(rcv_free));
         }
-        cv.notify_all();
+        if (dropped and logger_)
+            logger_->w("Dropped %zu packets: receive queue is full", dropped);
+        wakeUp();
         return ret;
     });
 
     auto dht = std::unique_ptr<DhtInterface>(new Dht(std::move(context.sock), SecureDht::getConfig(config.dht_config), context.logger));
     dht_ = std::unique_ptr<SecureDht>(new SecureDht(std::move(dht), config.dht_config));
+    dht_->setLoopCallback(getLoopCallback());
+    metrics_ = dht_->getNetworkMetrics();
+    if (config.shards > 1)
+        startShards(config, context.logger, context.certificateStore);
 
-#ifdef OPENDHT_PROXY_CLIENT
     config_ = config;
-#endif
     enableProxy(not config.proxy_server.empty());
     if (context.logger and dht_via_proxy_) {
         dht_via_proxy_->setLogger(context.logger);
@@ -198,23 +236,26 @@ DhtRunner::run(const Config& config, Context&& context)
                     return true;
                 {
                     std::lock_guard<std::mutex> lck(sock_mtx);
-                    if (not rcv.empty())
-                        return true;
-                }
-                {
-                    std::lock_guard<std::mutex> lck(storage_mtx);
-                    if (not pending_ops_prio.empty())
-                        return true;
-                    auto s = getStatus();
-                    if (not pending_ops.empty() and (s == NodeStatus::Connected or s == NodeStatus::Disconnected))
+                    if (not rcv.empty() or not rcv_requests.empty())
                         return true;
                 }
+                if (not pending_ops_prio.empty())
+                    return true;
+                auto s = getStatus();
+                if (not pending_ops.empty() and (s == NodeStatus::Connected or s == NodeStatus::Disconnected))
+                    return true;
                 return false;
             };
-            if (wakeup == time_point::max())
-                cv.wait(lk, hasJobToDo);
-            else
-                cv.wait_until(lk, wakeup, hasJobToDo);
+            // Producers only signal cv once parked is set,
+            // so it must be set before checking for work.
+            parked = true;
+            if (not hasJobToDo()) {
+                if (wakeup == time_point::max())
+                    cv.wait(lk);
+                else
+                    cv.wait_until(lk, wakeup);
+            }
+            parked = false;
         }
     });
 
@@ -231,37 +272,156 @@ DhtRunner::run(const Config& config, Context&& context)
 #ifdef OPENDHT_PEER_DISCOVERY
     auto netId = config.dht_config.node_config.network;
     if (config.peer_discovery) {
-        peerDiscovery_->startDiscovery<NodeInsertionPack>(PEER_DISCOVERY_DHT_SERVICE, [this, netId](NodeInsertionPack&& v, SockAddr&& addr){
+        auto lanBootstrap = config.lan_bootstrap;
+        peerDiscovery_->startDiscovery<NodeInsertionPack>(PEER_DISCOVERY_DHT_SERVICE, [this, netId, lanBootstrap](NodeInsertionPack&& v, SockAddr&& addr){
             addr.setPort(v.port);
             if (v.nodeId != dht_->getNodeId() && netId == v.net){
-                bootstrap(v.nodeId, addr);
+                if (lanBootstrap and not v.nodes.empty())
+                    bootstrapLan(v.nodeId, addr, std::move(v.nodes));
+                else
+                    bootstrap(v.nodeId, addr);
             }
         });
     }
-    if (config.peer_publish) {
-        msgpack::sbuffer sbuf_node;
-        NodeInsertionPack adc;
-        adc.net = netId;
-        adc.nodeId = dht_->getNodeId();
-        // IPv4
-        if (const auto& bound4 = dht_->getSocket()->getBoundRef(AF_INET)) {
-            adc.port = bound4.getPort();
-            msgpack::pack(sbuf_node, adc);
-            peerDiscovery_->startPublish(AF_INET, PEER_DISCOVERY_DHT_SERVICE, sbuf_node);
+    if (config.peer_publish)
+        publishPeer();
+#endif
+}
+
+void
+DhtRunner::publishPeer(const std::vector<NodeExport>& nodes)
+{
+#ifdef OPENDHT_PEER_DISCOVERY
+    msgpack::sbuffer sbuf_node;
+    NodeInsertionPack adc;
+    adc.net = config_.dht_config.node_config.network;
+    adc.nodeId = dht_->getNodeId();
+    adc.nodes = nodes;
+    // IPv4
+    if (const auto& bound4 = dht_->getSocket()->getBoundRef(AF_INET)) {
+        adc.port = bound4.getPort();
+        msgpack::pack(sbuf_node, adc);
+        peerDiscovery_->startPublish(AF_INET, PEER_DISCOVERY_DHT_SERVICE, sbuf_node);
+    }
+    // IPv6
+    if (const auto& bound6 = dht_->getSocket()->getBoundRef(AF_INET6)) {
+        adc.port = bound6.getPort();
+        sbuf_node.clear();
+        msgpack::pack(sbuf_node, adc);
+        peerDiscovery_->startPublish(AF_INET6, PEER_DISCOVERY_DHT_SERVICE, sbuf_node);
+    }
+#else
+    (void)nodes;
+#endif
+}
+
+void
+DhtRunner::bootstrapLan(const InfoHash& id, const SockAddr& addr, std::vector<NodeExport>&& nodes)
+{
+    if (nodes.size() > LAN_BOOTSTRAP_NODES)
+        nodes.resize(LAN_BOOTSTRAP_NODES);
+    for (auto& shard : shards_)
+        shard->bootstrapLan(id, addr, std::vector<NodeExport>(nodes));
+    if (running != State::Running)
+        return;
+    pending_ops_prio.emplace([id, addr, nodes = std::move(nodes)](SecureDht& dht) mutable {
+        // a connected node only needs the peer
+        if (dht.getStatus(addr.getFamily()) == NodeStatus::Connected) {
+            dht.insertNode(id, addr);
+            return;
         }
-        // IPv6
-        if (const auto& bound6 = dht_->getSocket()->getBoundRef(AF_INET6)) {
-            adc.port = bound6.getPort();
-            sbuf_node.clear();
-            msgpack::pack(sbuf_node, adc);
-            peerDiscovery_->startPublish(AF_INET6, PEER_DISCOVERY_DHT_SERVICE, sbuf_node);
+        // the nodes of the peer are unverified: they are only inserted
+        // in the routing table once they answer
+        dht.pingNode(addr);
+        const auto& myid = dht.getNodeId();
+        for (const auto& node : nodes)
+            if (node.id != myid)
+                dht.pingNode(SockAddr(node.ss, node.sslen));
+    });
+    wakeUp();
+}
+
+void
+DhtRunner::startShards(const Config& config, const std::shared_ptr<Logger>& logger, const CertificateStoreQuery& certificateStore)
+{
+    shards_.clear();
+    slices_.clear();
+    if (not config.threaded or not config.proxy_server.empty()) {
+        if (logger)
+            logger->w("[runner %p] sharding requires threaded mode without proxy", this);
+        return;
+    }
+    auto n = std::min(config.shards, 256u);
+    auto sliceOf = [n](const InfoHash& h) { return h[0] * n / 256; };
+    auto sock = dht_->getSocket();
+    const auto nodeId = dht_->getNodeId();
+
+    Config shardConfig = config;
+    shardConfig.shards = 1;
+    shardConfig.peer_discovery = false;
+    shardConfig.peer_publish = false;
+    shardConfig.dht_config.node_config.persist_path = {};
+    shardConfig.dht_config.node_config.storage_backend = {};
+
+    slices_.resize(n, this);
+    for (unsigned slice = 0; slice < n; slice++) {
+        if (slice == sliceOf(nodeId))
+            continue;
+        // first byte of the slice, so that the engine is close to its keys
+        auto id = InfoHash::getRandom();
+        id[0] = (256 * slice + n - 1) / n;
+        shardConfig.dht_config.node_config.node_id = id;
+
+        Context context;
+        context.logger = logger;
+        context.certificateStore = certificateStore;
+        SockAddr local4 = sock->getBound(AF_INET);
+        SockAddr local6 = sock->getBound(AF_INET6);
+        if (local4) local4.setPort(0);
+        if (local6) local6.setPort(0);
+        auto shard = std::unique_ptr<DhtRunner>(new DhtRunner);
+        shard->run(local4, local6, shardConfig, std::move(context));
+
+        // engines know each other from the start
+        for (auto af : {AF_INET, AF_INET6}) {
+            auto addr = sock->getBound(af);
+            auto shardAddr = shard->getBound(af);
+            if (not addr or not shardAddr)
+                continue;
+            if (addr.isUnspecified())
+                addr.setAddress(af == AF_INET ? "127.0.0.1" : "::1");
+            if (shardAddr.isUnspecified())
+                shardAddr.setAddress(af == AF_INET ? "127.0.0.1" : "::1");
+            shard->bootstrap(nodeId, addr);
+            dht_->insertNode(id, shardAddr);
         }
+        slices_[slice] = shard.get();
+        shards_.emplace_back(std::move(shard));
     }
-#endif
+    if (logger)
+        logger->d("[runner %p] started %zu more DHT engines", this, shards_.size());
+}
+
+DhtRunner*
+DhtRunner::shardFor(const InfoHash& key) const
+{
+    if (shards_.empty())
+        return nullptr;
+    auto shard = slices_[key[0] * slices_.size() / 256];
+    return shard == this ? nullptr : shard;
 }
 
 void
 DhtRunner::shutdown(ShutdownCallback cb) {
+    if (not shards_.empty()) {
+        auto remaining = std::make_shared<std::atomic_size_t>(shards_.size() + 1);
+        cb = [remaining, cb = std::move(cb)] {
+            if (--*remaining == 0 and cb)
+                cb();
+        };
+        for (auto& shard : shards_)
+            shard->shutdown(cb);
+    }
     auto expected = State::Running;
     if (not running.compare_exchange_strong(expected, State::Stopping)) {
         if (expected == State::Stopping and ongoing_ops) {
@@ -273,9 +433,11 @@ DhtRunner::shutdown(ShutdownCallback cb) {
     }
     if (logger_)
         logger_->d("[runner %p] state changed to Stopping, %zu ongoing ops", this, ongoing_ops.load());
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
-    shutdownCallbacks_.emplace_back(std::move(cb));
+    {
+        std::lock_guard<std::mutex> lck(storage_mtx);
+        shutdownCallbacks_.emplace_back(std::move(cb));
+    }
     pending_ops_prio.emplace([=](SecureDht&) mutable {
         auto onShutdown = [this]{ opEnded(); };
 #ifdef OPENDHT_PROXY_CLIENT
@@ -285,7 +447,7 @@ DhtRunner::shutdown(ShutdownCallback cb) {
         if (dht_)
             dht_->shutdown(onShutdown);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -327,6 +489,8 @@ DhtRunner::checkShutdown() {
 void
 DhtRunner::join()
 {
+    for (auto& shard : shards_)
+        shard->join();
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
         if (running.exchange(State::Idle) == State::Idle)
@@ -346,12 +510,9 @@ DhtRunner::join()
     if (dht_thread.joinable())
         dht_thread.join();
 
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops = decltype(pending_ops)();
-        pending_ops_prio = decltype(pending_ops_prio)();
-        ongoing_ops = 0;
-    }
+    pending_ops.clear();
+    pending_ops_prio.clear();
+    ongoing_ops = 0;
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
         resetDht();
@@ -360,6 +521,28 @@ DhtRunner::join()
     }
 }
 
+void
+DhtRunner::wakeUp()
+{
+    // Only one producer needs to signal a parked thread. Taking dht_mtx
+    // ensures the thread is waiting on cv, and not about to.
+    if (parked.exchange(false)) {
+        { std::lock_guard<std::mutex> lck(dht_mtx); }
+        cv.notify_all();
+    }
+}
+
+std::function<void(std::function<void()>&&)>
+DhtRunner::getLoopCallback()
+{
+    return [this](std::function<void()>&& f) {
+        pending_ops_prio.emplace([f = std::move(f)](SecureDht&) {
+            f();
+        });
+        wakeUp();
+    };
+}
+
 SockAddr
 DhtRunner::getBound(sa_family_t af) const {
     std::lock_guard<std::mutex> lck(dht_mtx);
@@ -410,6 +593,14 @@ DhtRunner::getStoreSize() const {
     return dht_->getStoreSize();
 }
 
+MemoryStats
+DhtRunner::getMemoryStats() const {
+    std::lock_guard<std::mutex> lck(dht_mtx);
+    if (!dht_)
+        return {};
+    return dht_->getMemoryStats();
+}
+
 void
 DhtRunner::setStorageLimit(size_t limit) {
     std::lock_guard<std::mutex> lck(dht_mtx);
@@ -434,6 +625,20 @@ DhtRunner::exportValues() const {
     return dht_->exportValues();
 }
 
+void
+DhtRunner::exportValuesTo(const ValuesExportCallback& cb) const {
+    std::vector<ValuesSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return;
+        snapshot = dht_->getValuesSnapshot();
+    }
+    for (const auto& s : snapshot)
+        if (not cb(s.pack()))
+            break;
+}
+
 void
 DhtRunner::setLogger(const Sp<Logger>& logger) {
     std::lock_guard<std::mutex> lck(dht_mtx);
@@ -513,13 +718,15 @@ DhtRunner::getNodeInfo() const {
         }
     }
     info.ongoing_ops = ongoing_ops;
+    if (metrics_)
+        info.latency = metrics_->getStats();
+    info.rx_dropped = rx_dropped_.getStats();
     return info;
 }
 
 void
 DhtRunner::getNodeInfo(std::function<void(std::shared_ptr<NodeInfo>)> cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops_prio.emplace([cb = std::move(cb), this](SecureDht& dht){
         auto sinfo = std::make_shared<NodeInfo>();
@@ -533,10 +740,13 @@ DhtRunner::getNodeInfo(std::function<void(std::shared_ptr<NodeInfo>)> cb)
             info.bound6 = sock->getBoundRef(AF_INET6).getPort();
         }
         info.ongoing_ops = ongoing_ops;
+        if (metrics_)
+            info.latency = metrics_->getStats();
+        info.rx_dropped = rx_dropped_.getStats();
         cb(std::move(sinfo));
         opEnded();
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 std::vector<unsigned>
@@ -616,48 +826,39 @@ DhtRunner::loop_()
     if (not dht)
         return {};
 
-    decltype(pending_ops) ops {};
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        auto s = getStatus();
-        ops = (pending_ops_prio.empty() && (s == NodeStatus::Connected or s == NodeStatus::Disconnected)) ?
-               std::move(pending_ops) : std::move(pending_ops_prio);
-    }
-    while (not ops.empty()) {
-        ops.front()(*dht);
-        ops.pop();
-    }
+    auto s = getStatus();
+    auto& ops = (pending_ops_prio.empty() && (s == NodeStatus::Connected or s == NodeStatus::Disconnected)) ?
+                pending_ops : pending_ops_prio;
+    // operations pushed meanwhile run on the next loop
+    ops.drain([&](Operation& op) {
+        op(*dht);
+    });
 
     time_point wakeup {};
     decltype(rcv) received {};
     decltype(rcv) received_treated {};
     {
         std::lock_guard<std::mutex> lck(sock_mtx);
-        // move to stack
+        // move to stack, replies first so that our own operations progress under load
         received = std::move(rcv);
+        received.splice(received.end(), std::move(rcv_requests));
     }
 
-    // Discard old packets
+    // Handle packets, discarding old ones
     size_t dropped {0};
-    if (not received.empty()) {
-        auto limit = clock::now() - net::RX_QUEUE_MAX_DELAY;
-        auto it = received.begin();
-        while (it != received.end() and it->received < limit) {
-            it->data.clear();
-            ++it;
-            dropped++;
-        }
-        received_treated.splice(received_treated.end(), received, received.begin(), it);
-    }
-
-    // Handle packets
     if (not received.empty()) {
         for (auto& pkt : received) {
             auto now = clock::now();
-            if (now - pkt.received > net::RX_QUEUE_MAX_DELAY)
+            if (now - pkt.received > net::RX_QUEUE_MAX_DELAY) {
+                if (pkt.msg)
+                    rx_dropped_.add(net::NetworkEngine::getMessageType(*pkt.msg));
                 dropped++;
-            else
-                wakeup = dht->periodic(pkt.data.data(), pkt.data.size(), std::move(pkt.from), now);
+            } else {
+                if (metrics_)
+                    metrics_->rx_queue.record(now - pkt.received);
+                wakeup = dht->periodic(std::move(pkt), now);
+            }
+            pkt.msg.reset();
             pkt.data.clear();
         }
         received_treated.splice(received_treated.end(), std::move(received));
@@ -682,7 +883,22 @@ DhtRunner::loop_()
         status6 = nstatus6;
         if (statusCb)
             statusCb(status4, status6);
+        nextLanExport_ = time_point::min();
+    }
+
+#ifdef OPENDHT_PEER_DISCOVERY
+    if (config_.lan_bootstrap and config_.peer_publish and peerDiscovery_ and not use_proxy
+        and getStatus() == NodeStatus::Connected) {
+        auto now = clock::now();
+        if (now >= nextLanExport_) {
+            nextLanExport_ = now + LAN_EXPORT_PERIOD;
+            auto nodes = dht->exportNodes();
+            if (nodes.size() > LAN_BOOTSTRAP_NODES)
+                nodes.resize(LAN_BOOTSTRAP_NODES);
+            publishPeer(nodes);
+        }
     }
+#endif
 
     return wakeup;
 }
@@ -690,16 +906,17 @@ DhtRunner::loop_()
 void
 DhtRunner::get(InfoHash hash, GetCallback vcb, DoneCallback dcb, Value::Filter f, Where w)
 {
+    if (auto shard = shardFor(hash))
+        return shard->get(hash, std::move(vcb), std::move(dcb), std::move(f), std::move(w));
     if (running != State::Running) {
         if (dcb) dcb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=](SecureDht& dht) mutable {
         dht.get(hash, std::move(vcb), bindOpDoneCallback(std::move(dcb)), std::move(f), std::move(w));
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -709,52 +926,60 @@ DhtRunner::get(const std::string& key, GetCallback vcb, DoneCallbackSimple dcb,
 }
 void
 DhtRunner::query(const InfoHash& hash, QueryCallback cb, DoneCallback done_cb, Query q) {
+    if (auto shard = shardFor(hash))
+        return shard->query(hash, std::move(cb), std::move(done_cb), std::move(q));
     if (running != State::Running) {
         if (done_cb) done_cb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=](SecureDht& dht) mutable {
         dht.query(hash, std::move(cb), bindOpDoneCallback(std::move(done_cb)), std::move(q));
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 std::future<size_t>
 DhtRunner::listen(InfoHash hash, ValueCallback vcb, Value::Filter f, Where w)
 {
+    if (auto shard = shardFor(hash))
+        return shard->listen(hash, std::move(vcb), std::move(f), std::move(w));
     auto ret_token = std::make_shared<std::promise<size_t>>();
     if (running != State::Running) {
         ret_token->set_value(0);
         return ret_token->get_future();
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     pending_ops.emplace([=](SecureDht& dht) mutable {
+        ret_token->set_value(listen_(dht, hash, std::move(vcb), std::move(f), std::move(w)));
+    });
+    wakeUp();
+    return ret_token->get_future();
+}
+
+size_t
+DhtRunner::listen_(SecureDht& dht, InfoHash hash, ValueCallback vcb, Value::Filter f, Where w)
+{
 #ifdef OPENDHT_PROXY_CLIENT
-        auto tokenbGlobal = listener_token_++;
-        auto& listener = listeners_[tokenbGlobal];
-        listener.hash = hash;
-        listener.f = std::move(f);
-        listener.w = std::move(w);
-        listener.gcb = [hash,vcb,tokenbGlobal,this](const std::vector<Sp<Value>>& vals, bool expired) {
-            if (not vcb(vals, expired)) {
-                cancelListen(hash, tokenbGlobal);
-                return false;
-            }
-            return true;
-        };
-        if (auto token = dht.listen(hash, listener.gcb, listener.f, listener.w)) {
-            if (use_proxy)  listener.tokenProxyDht = token;
-            else            listener.tokenClassicDht = token;
+    auto tokenbGlobal = listener_token_++;
+    auto& listener = listeners_[tokenbGlobal];
+    listener.hash = hash;
+    listener.f = std::move(f);
+    listener.w = std::move(w);
+    listener.gcb = [hash,vcb,tokenbGlobal,this](const std::vector<Sp<Value>>& vals, bool expired) {
+        if (not vcb(vals, expired)) {
+            cancelListen(hash, tokenbGlobal);
+            return false;
         }
-        ret_token->set_value(tokenbGlobal);
+        return true;
+    };
+    if (auto token = dht.listen(hash, listener.gcb, listener.f, listener.w)) {
+        if (use_proxy)  listener.tokenProxyDht = token;
+        else            listener.tokenClassicDht = token;
+    }
+    return tokenbGlobal;
 #else
-        ret_token->set_value(dht.listen(hash, std::move(vcb), std::move(f), std::move(w)));
+    return dht.listen(hash, std::move(vcb), std::move(f), std::move(w));
 #endif
-    });
-    cv.notify_all();
-    return ret_token->get_future();
 }
 
 std::future<size_t>
@@ -766,7 +991,8 @@ DhtRunner::listen(const std::string& key, GetCallback vcb, Value::Filter f, Wher
 void
 DhtRunner::cancelListen(InfoHash h, size_t token)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    if (auto shard = shardFor(h))
+        return shard->cancelListen(h, token);
 #ifdef OPENDHT_PROXY_CLIENT
     pending_ops.emplace([=](SecureDht&) {
         auto it = listeners_.find(token);
@@ -782,13 +1008,14 @@ DhtRunner::cancelListen(InfoHash h, size_t token)
         dht.cancelListen(h, token);
     });
 #endif // OPENDHT_PROXY_CLIENT
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::cancelListen(InfoHash h, std::shared_future<size_t> ftoken)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    if (auto shard = shardFor(h))
+        return shard->cancelListen(h, std::move(ftoken));
 #ifdef OPENDHT_PROXY_CLIENT
     pending_ops.emplace([=](SecureDht&) {
         auto it = listeners_.find(ftoken.get());
@@ -804,17 +1031,18 @@ DhtRunner::cancelListen(InfoHash h, std::shared_future<size_t> ftoken)
         dht.cancelListen(h, ftoken.get());
     });
 #endif // OPENDHT_PROXY_CLIENT
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::put(InfoHash hash, Value&& value, DoneCallback cb, time_point created, bool permanent)
 {
+    if (auto shard = shardFor(hash))
+        return shard->put(hash, std::move(value), std::move(cb), created, permanent);
     if (running != State::Running) {
         if (cb) cb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=,
         cb = std::move(cb),
@@ -822,22 +1050,23 @@ DhtRunner::put(InfoHash hash, Value&& value, DoneCallback cb, time_point created
     ] (SecureDht& dht) mutable {
         dht.put(hash, sv, bindOpDoneCallback(std::move(cb)), created, permanent);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::put(InfoHash hash, std::shared_ptr<Value> value, DoneCallback cb, time_point created, bool permanent)
 {
+    if (auto shard = shardFor(hash))
+        return shard->put(hash, std::move(value), std::move(cb), created, permanent);
     if (running != State::Running) {
         if (cb) cb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=, cb = std::move(cb)](SecureDht& dht) mutable {
         dht.put(hash, value, bindOpDoneCallback(std::move(cb)), created, permanent);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -849,31 +1078,34 @@ DhtRunner::put(const std::string& key, Value&& value, DoneCallbackSimple cb, tim
 void
 DhtRunner::cancelPut(const InfoHash& h, Value::Id id)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    if (auto shard = shardFor(h))
+        return shard->cancelPut(h, id);
     pending_ops.emplace([=](SecureDht& dht) {
         dht.cancelPut(h, id);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::cancelPut(const InfoHash& h, const std::shared_ptr<Value>& value)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    if (auto shard = shardFor(h))
+        return shard->cancelPut(h, value);
     pending_ops.emplace([=](SecureDht& dht) {
         dht.cancelPut(h, value->id);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::putSigned(InfoHash hash, std::shared_ptr<Value> value, DoneCallback cb, bool permanent)
 {
+    if (auto shard = shardFor(hash))
+        return shard->putSigned(hash, std::move(value), std::move(cb), permanent);
     if (running != State::Running) {
         if (cb) cb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=,
         cb = std::move(cb),
@@ -881,7 +1113,7 @@ DhtRunner::putSigned(InfoHash hash, std::shared_ptr<Value> value, DoneCallback c
     ](SecureDht& dht) mutable {
         dht.putSigned(hash, value, bindOpDoneCallback(std::move(cb)), permanent);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -899,11 +1131,12 @@ DhtRunner::putSigned(const std::string& key, Value&& value, DoneCallbackSimple c
 void
 DhtRunner::putEncrypted(InfoHash hash, InfoHash to, std::shared_ptr<Value> value, DoneCallback cb, bool permanent)
 {
+    if (auto shard = shardFor(hash))
+        return shard->putEncrypted(hash, to, std::move(value), std::move(cb), permanent);
     if (running != State::Running) {
         if (cb) cb(false, {});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([=,
         cb = std::move(cb),
@@ -911,7 +1144,7 @@ DhtRunner::putEncrypted(InfoHash hash, InfoHash to, std::shared_ptr<Value> value
     ] (SecureDht& dht) mutable {
         dht.putEncrypted(hash, to, value, bindOpDoneCallback(std::move(cb)), permanent);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -926,50 +1159,275 @@ DhtRunner::putEncrypted(const std::string& key, InfoHash to, Value&& value, Done
     putEncrypted(InfoHash::get(key), to, std::forward<Value>(value), std::move(cb), permanent);
 }
 
+/**
+ * Calls cb once all count items are done,
+ * with success if all of them succeeded.
+ */
+static BatchDoneCallback
+bindBatchDoneCb(DoneCallbackSimple&& cb, size_t count)
+{
+    if (not cb)
+        return {};
+    auto state = std::make_shared<std::pair<size_t, bool>>(count, true);
+    return [state, cb = std::move(cb)](size_t, bool ok) {
+        state->second = state->second and ok;
+        if (--state->first == 0)
+            cb(state->second);
+    };
+}
+
+/**
+ * Splits a batch by engine, keeping the index of each item in the batch.
+ */
+template <typename T, typename GetRunner>
+static std::map<DhtRunner*, std::pair<std::vector<size_t>, std::vector<T>>>
+splitBatch(std::vector<T>&& items, GetRunner&& getRunner)
+{
+    std::map<DhtRunner*, std::pair<std::vector<size_t>, std::vector<T>>> parts;
+    for (size_t i = 0; i < items.size(); i++) {
+        auto& part = parts[getRunner(items[i])];
+        part.first.emplace_back(i);
+        part.second.emplace_back(std::move(items[i]));
+    }
+    return parts;
+}
+
+static BatchDoneCallback
+remapBatchDoneCb(const std::shared_ptr<BatchDoneCallback>& cb, std::vector<size_t>&& indexes)
+{
+    if (not *cb)
+        return {};
+    return [cb, indexes = std::move(indexes)](size_t i, bool ok) {
+        (*cb)(indexes[i], ok);
+    };
+}
+
+void
+DhtRunner::putMany(std::vector<std::pair<InfoHash, Sp<Value>>> values, BatchDoneCallback cb, bool permanent)
+{
+    if (shards_.empty())
+        return putMany_(std::move(values), std::move(cb), permanent);
+    auto done = std::make_shared<BatchDoneCallback>(std::move(cb));
+    auto parts = splitBatch(std::move(values), [this](const std::pair<InfoHash, Sp<Value>>& v) {
+        return &runnerFor(v.first);
+    });
+    for (auto& part : parts)
+        part.first->putMany_(std::move(part.second.second), remapBatchDoneCb(done, std::move(part.second.first)), permanent);
+}
+
+void
+DhtRunner::putMany_(std::vector<std::pair<InfoHash, Sp<Value>>> values, BatchDoneCallback cb, bool permanent)
+{
+    if (running != State::Running) {
+        if (cb)
+            for (size_t i = 0; i < values.size(); i++)
+                cb(i, false);
+        return;
+    }
+    if (values.empty())
+        return;
+    ongoing_ops++;
+    pending_ops.emplace([=,
+        values = std::move(values),
+        cb = std::move(cb)
+    ](SecureDht& dht) mutable {
+        // the batch counts as a single ongoing operation
+        auto remaining = std::make_shared<size_t>(values.size());
+        auto done = std::make_shared<BatchDoneCallback>(std::move(cb));
+        for (size_t i = 0; i < values.size(); i++) {
+            dht.put(values[i].first, std::move(values[i].second), [this, i, remaining, done](bool ok, const std::vector<Sp<Node>>&) {
+                if (*done)
+                    (*done)(i, ok);
+                if (--*remaining == 0)
+                    opEnded();
+            }, time_point::max(), permanent);
+        }
+    });
+    wakeUp();
+}
+
+void
+DhtRunner::putMany(std::vector<std::pair<InfoHash, Sp<Value>>> values, DoneCallbackSimple cb, bool permanent)
+{
+    if (values.empty()) {
+        if (cb) cb(running == State::Running);
+        return;
+    }
+    auto count = values.size();
+    putMany(std::move(values), bindBatchDoneCb(std::move(cb), count), permanent);
+}
+
+void
+DhtRunner::getMany(std::vector<InfoHash> keys, BatchGetCallback vcb, BatchDoneCallback dcb, Value::Filter f, Where w)
+{
+    if (shards_.empty())
+        return getMany_(std::move(keys), std::move(vcb), std::move(dcb), std::move(f), std::move(w));
+    auto get = std::make_shared<BatchGetCallback>(std::move(vcb));
+    auto done = std::make_shared<BatchDoneCallback>(std::move(dcb));
+    auto parts = splitBatch(std::move(keys), [this](const InfoHash& key) {
+        return &runnerFor(key);
+    });
+    for (auto& part : parts) {
+        auto indexes = std::make_shared<std::vector<size_t>>(part.second.first);
+        part.first->getMany_(std::move(part.second.second), [get, indexes](size_t i, const std::vector<Sp<Value>>& values) {
+            return not *get or (*get)((*indexes)[i], values);
+        }, remapBatchDoneCb(done, std::move(part.second.first)), f, w);
+    }
+}
+
+void
+DhtRunner::getMany_(std::vector<InfoHash> keys, BatchGetCallback vcb, BatchDoneCallback dcb, Value::Filter f, Where w)
+{
+    if (running != State::Running) {
+        if (dcb)
+            for (size_t i = 0; i < keys.size(); i++)
+                dcb(i, false);
+        return;
+    }
+    if (keys.empty())
+        return;
+    ongoing_ops++;
+    pending_ops.emplace([=,
+        keys = std::move(keys),
+        vcb = std::move(vcb),
+        dcb = std::move(dcb)
+    ](SecureDht& dht) mutable {
+        auto remaining = std::make_shared<size_t>(keys.size());
+        auto get = std::make_shared<BatchGetCallback>(std::move(vcb));
+        auto done = std::make_shared<BatchDoneCallback>(std::move(dcb));
+        for (size_t i = 0; i < keys.size(); i++) {
+            // without a value callback, the get runs until done
+            dht.get(keys[i], [i, get](const std::vector<Sp<Value>>& values) {
+                return not *get or (*get)(i, values);
+            }, [this, i, remaining, done](bool ok, const std::vector<Sp<Node>>&) {
+                if (*done)
+                    (*done)(i, ok);
+                if (--*remaining == 0)
+                    opEnded();
+            }, Value::Filter(f), Where(w));
+        }
+    });
+    wakeUp();
+}
+
+void
+DhtRunner::getMany(std::vector<InfoHash> keys, BatchGetCallback vcb, DoneCallbackSimple dcb, Value::Filter f, Where w)
+{
+    if (keys.empty()) {
+        if (dcb) dcb(running == State::Running);
+        return;
+    }
+    auto count = keys.size();
+    getMany(std::move(keys), std::move(vcb), bindBatchDoneCb(std::move(dcb), count), std::move(f), std::move(w));
+}
+
+std::future<std::vector<size_t>>
+DhtRunner::listenMany(std::vector<InfoHash> keys, BatchValueCallback vcb, Value::Filter f, Where w)
+{
+    if (shards_.empty())
+        return listenMany_(std::move(keys), std::move(vcb), std::move(f), std::move(w));
+    auto count = keys.size();
+    auto cb = std::make_shared<BatchValueCallback>(std::move(vcb));
+    auto parts = splitBatch(std::move(keys), [this](const InfoHash& key) {
+        return &runnerFor(key);
+    });
+    std::vector<std::pair<std::vector<size_t>, std::future<std::vector<size_t>>>> tokens;
+    for (auto& part : parts) {
+        auto indexes = std::make_shared<std::vector<size_t>>(part.second.first);
+        tokens.emplace_back(std::move(part.second.first), part.first->listenMany_(std::move(part.second.second),
+            [cb, indexes](size_t i, const std::vector<Sp<Value>>& values, bool expired) {
+                return (*cb)((*indexes)[i], values, expired);
+            }, f, w));
+    }
+    return std::async(std::launch::deferred, [count, tokens = std::move(tokens)]() mutable {
+        std::vector<size_t> ret(count, 0);
+        for (auto& part : tokens) {
+            auto t = part.second.get();
+            for (size_t i = 0; i < t.size(); i++)
+                ret[part.first[i]] = t[i];
+        }
+        return ret;
+    });
+}
+
+std::future<std::vector<size_t>>
+DhtRunner::listenMany_(std::vector<InfoHash> keys, BatchValueCallback vcb, Value::Filter f, Where w)
+{
+    auto ret_tokens = std::make_shared<std::promise<std::vector<size_t>>>();
+    if (running != State::Running or keys.empty()) {
+        ret_tokens->set_value(std::vector<size_t>(keys.size(), 0));
+        return ret_tokens->get_future();
+    }
+    pending_ops.emplace([=,
+        keys = std::move(keys),
+        vcb = std::move(vcb)
+    ](SecureDht& dht) mutable {
+        auto cb = std::make_shared<BatchValueCallback>(std::move(vcb));
+        std::vector<size_t> tokens;
+        tokens.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            tokens.emplace_back(listen_(dht, keys[i], [i, cb](const std::vector<Sp<Value>>& values, bool expired) {
+                return (*cb)(i, values, expired);
+            }, f, w));
+        }
+        ret_tokens->set_value(std::move(tokens));
+    });
+    wakeUp();
+    return ret_tokens->get_future();
+}
+
 void
 DhtRunner::bootstrap(const std::string& host, const std::string& service)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    for (auto& shard : shards_)
+        shard->bootstrap(host, service);
     pending_ops_prio.emplace([host, service] (SecureDht& dht) mutable {
         dht.addBootstrap(host, service);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::bootstrap(const std::string& hostService)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    for (auto& shard : shards_)
+        shard->bootstrap(hostService);
     pending_ops_prio.emplace([host_service = splitPort(hostService)] (SecureDht& dht) mutable {
         dht.addBootstrap(host_service.first, host_service.second);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::clearBootstrap()
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    for (auto& shard : shards_)
+        shard->clearBootstrap();
     pending_ops_prio.emplace([] (SecureDht& dht) mutable {
         dht.clearBootstrap();
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::bootstrap(std::vector<SockAddr> nodes, DoneCallbackSimple&& cb)
 {
+    for (auto& shard : shards_)
+        shard->bootstrap(nodes);
     if (running != State::Running) {
-        cb(false);
+        if (cb) cb(false);
+        return;
+    }
+    if (nodes.empty()) {
+        if (cb) cb(false);
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops_prio.emplace([
         cb = bindOpDoneCallback(std::move(cb)),
         nodes = std::move(nodes)
     ] (SecureDht& dht) mutable {
-        auto rem = cb ? std::make_shared<std::pair<size_t, bool>>(nodes.size(), false) : nullptr;
+        auto rem = std::make_shared<std::pair<size_t, bool>>(nodes.size(), false);
         for (auto& node : nodes) {
             if (node.getPort() == 0)
                 node.setPort(net::DHT_DEFAULT_PORT);
@@ -983,53 +1441,57 @@ DhtRunner::bootstrap(std::vector<SockAddr> nodes, DoneCallbackSimple&& cb)
             });
         }
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::bootstrap(const SockAddr& addr, DoneCallbackSimple&& cb)
 {
+    for (auto& shard : shards_)
+        shard->bootstrap(addr);
     if (running != State::Running) {
         if (cb) cb(false);
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops_prio.emplace([addr, cb = bindOpDoneCallback(std::move(cb))](SecureDht& dht) mutable {
         dht.pingNode(std::move(addr), std::move(cb));
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::bootstrap(const InfoHash& id, const SockAddr& address)
 {
+    for (auto& shard : shards_)
+        shard->bootstrap(id, address);
     if (running != State::Running)
         return;
-    std::unique_lock<std::mutex> lck(storage_mtx);
     pending_ops_prio.emplace([id, address](SecureDht& dht) mutable {
         dht.insertNode(id, address);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::bootstrap(const std::vector<NodeExport>& nodes)
 {
+    for (auto& shard : shards_)
+        shard->bootstrap(nodes);
     if (running != State::Running)
         return;
-    std::lock_guard<std::mutex> lck(storage_mtx);
     pending_ops_prio.emplace([=](SecureDht& dht) {
         for (auto& node : nodes)
             dht.insertNode(node);
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::connectivityChanged()
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
+    for (auto& shard : shards_)
+        shard->connectivityChanged();
     pending_ops_prio.emplace([=](SecureDht& dht) {
         dht.connectivityChanged();
 #ifdef OPENDHT_PEER_DISCOVERY
@@ -1037,16 +1499,17 @@ DhtRunner::connectivityChanged()
             peerDiscovery_->connectivityChanged();
 #endif
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
 DhtRunner::findCertificate(InfoHash hash, std::function<void(const Sp<crypto::Certificate>&)> cb) {
+    if (auto shard = shardFor(hash))
+        return shard->findCertificate(hash, std::move(cb));
     if (running != State::Running) {
         cb({});
         return;
     }
-    std::lock_guard<std::mutex> lck(storage_mtx);
     ongoing_ops++;
     pending_ops.emplace([this, hash, cb = std::move(cb)] (SecureDht& dht) {
         dht.findCertificate(hash, [this, cb = std::move(cb)](const Sp<crypto::Certificate>& crt){
@@ -1054,7 +1517,7 @@ DhtRunner::findCertificate(InfoHash hash, std::function<void(const Sp<crypto::Ce
             opEnded();
         });
     });
-    cv.notify_all();
+    wakeUp();
 }
 
 void
@@ -1109,10 +1572,8 @@ DhtRunner::enableProxy(bool proxify)
                 config_.client_identity,
                 [this]{
                     if (config_.threaded) {
-                        {
-                            std::lock_guard<std::mutex> lck(storage_mtx);
-                            pending_ops_prio.emplace([=](SecureDht&) mutable {});
-                        }
+                        // may be called with dht_mtx held (from enableProxy)
+                        pending_ops_prio.emplace([=](SecureDht&) mutable {});
                         cv.notify_all();
                     }
                 },
@@ -1123,6 +1584,7 @@ DhtRunner::enableProxy(bool proxify)
             dht_via_proxy->setPushNotificationToken(config_.push_token);
 #endif
         dht_via_proxy_ = std::unique_ptr<SecureDht>(new SecureDht(std::move(dht_via_proxy), config_.dht_config));
+        dht_via_proxy_->setLoopCallback(getLoopCallback());
         // add current listeners
         for (auto& l: listeners_)
             l.second.tokenProxyDht = dht_via_proxy_->listen(l.second.hash, l.second.gcb, l.second.f, l.second.w);
@@ -1130,7 +1592,6 @@ DhtRunner::enableProxy(bool proxify)
         use_proxy = proxify;
     } else {
         use_proxy = proxify;
-        std::lock_guard<std::mutex> lck(storage_mtx);
         if (not listeners_.empty()) {
             pending_ops.emplace([this](SecureDht& /*dht*/) mutable {
                 if (not dht_)
@@ -1184,14 +1645,11 @@ void
 DhtRunner::pushNotificationReceived(const std::map<std::string, std::string>& data)
 {
 #if defined(OPENDHT_PROXY_CLIENT) && defined(OPENDHT_PUSH_NOTIFICATIONS)
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops_prio.emplace([=](SecureDht&) {
-            if (dht_via_proxy_)
-                dht_via_proxy_->pushNotificationReceived(data);
-        });
-    }
-    cv.notify_all();
+    pending_ops_prio.emplace([=](SecureDht&) {
+        if (dht_via_proxy_)
+            dht_via_proxy_->pushNotificationReceived(data);
+    });
+    wakeUp();
 #else
     (void) data;
 #endif
@@ -26,6 +26,8 @@
 #include <http_parser.h>
 #include <json/json.h>
 
+#include <algorithm>
+
 namespace dht {
 namespace http {
 
@@ -361,6 +363,26 @@ Connection::async_read_some(size_t bytes, BytesHandlerCb cb)
     else              socket_->async_read_some(buf, onEnd);
 }
 
+std::shared_ptr<SSL_SESSION>
+Connection::get_tls_session() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (not ssl_socket_)
+        return {};
+    auto session = SSL_get1_session(ssl_socket_->asio_ssl_stream().native_handle());
+    if (not session)
+        return {};
+    return {session, SSL_SESSION_free};
+}
+
+void
+Connection::set_tls_session(const std::shared_ptr<SSL_SESSION>& session)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ssl_socket_ and session)
+        SSL_set_session(ssl_socket_->asio_ssl_stream().native_handle(), session.get());
+}
+
 void
 Connection::timeout(const std::chrono::seconds timeout, HandlerCb cb)
 {
@@ -386,6 +408,240 @@ Connection::timeout(const std::chrono::seconds timeout, HandlerCb cb)
     });
 }
 
+// connection pool
+
+ConnectionPool::~ConnectionPool()
+{
+    clear();
+}
+
+std::shared_ptr<Connection>
+ConnectionPool::get(const Key& key)
+{
+    std::vector<std::shared_ptr<Connection>> expired;
+    std::shared_ptr<Connection> conn;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        expire(clock::now(), expired);
+        auto it = hosts_.find(key);
+        if (it != hosts_.end()) {
+            // the most recently used connection is the least likely to be closed by the server
+            auto& idle = it->second.idle;
+            while (not conn and not idle.empty()) {
+                auto c = std::move(idle.back().conn);
+                idle.pop_back();
+                if (c->is_open())
+                    conn = std::move(c);
+            }
+        }
+    }
+    for (auto& c : expired)
+        c->close();
+    return conn;
+}
+
+void
+ConnectionPool::put(const Key& key, std::shared_ptr<Connection> conn)
+{
+    if (not conn or not conn->is_open())
+        return;
+    std::vector<std::shared_ptr<Connection>> expired;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto now = clock::now();
+        expire(now, expired);
+        auto& idle = hosts_[key].idle;
+        if (idle.size() >= config_.maxIdlePerHost) {
+            expired.emplace_back(std::move(idle.front().conn));
+            idle.pop_front();
+        }
+        if (config_.maxIdlePerHost)
+            idle.push_back({std::move(conn), now});
+        else
+            expired.emplace_back(std::move(conn));
+    }
+    for (auto& c : expired)
+        c->close();
+}
+
+void
+ConnectionPool::expire(clock::time_point now, std::vector<std::shared_ptr<Connection>>& expired)
+{
+    for (auto it = hosts_.begin(); it != hosts_.end();) {
+        auto& idle = it->second.idle;
+        while (not idle.empty() and idle.front().since + config_.idleTimeout <= now) {
+            expired.emplace_back(std::move(idle.front().conn));
+            idle.pop_front();
+        }
+        if (idle.empty() and not it->second.session)
+            it = hosts_.erase(it);
+        else
+            ++it;
+    }
+}
+
+void
+ConnectionPool::clear()
+{
+    decltype(hosts_) hosts;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        hosts = std::move(hosts_);
+        hosts_.clear();
+    }
+    for (auto& host : hosts)
+        for (auto& idle : host.second.idle)
+            idle.conn->close();
+}
+
+size_t
+ConnectionPool::size() const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    size_t n = 0;
+    for (const auto& host : hosts_)
+        n += host.second.idle.size();
+    return n;
+}
+
+std::shared_ptr<SSL_SESSION>
+ConnectionPool::get_tls_session(const Key& key) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = hosts_.find(key);
+    return it != hosts_.end() ? it->second.session : std::shared_ptr<SSL_SESSION>{};
+}
+
+void
+ConnectionPool::set_tls_session(const Key& key, std::shared_ptr<SSL_SESSION> session)
+{
+    if (not session)
+        return;
+    std::lock_guard<std::mutex> lock(lock_);
+    hosts_[key].session = std::move(session);
+}
+
+// resolver cache
+
+/*
+ * Alternates address families, starting with IPv6, as per RFC 8305.
+ * This only orders the addresses: connections try them one at a time.
+ */
+static std::vector<asio::ip::tcp::endpoint>
+interleave(const std::vector<asio::ip::tcp::endpoint>& endpoints)
+{
+    std::vector<asio::ip::tcp::endpoint> v4, v6, ret;
+    for (const auto& ep : endpoints)
+        (ep.address().is_v6() ? v6 : v4).emplace_back(ep);
+    ret.reserve(endpoints.size());
+    for (size_t i = 0; i < std::max(v4.size(), v6.size()); i++) {
+        if (i < v6.size()) ret.emplace_back(v6[i]);
+        if (i < v4.size()) ret.emplace_back(v4[i]);
+    }
+    return ret;
+}
+
+ResolverCache&
+ResolverCache::instance()
+{
+    static ResolverCache cache;
+    return cache;
+}
+
+void
+ResolverCache::setConfig(const Config& config)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    config_ = config;
+}
+
+bool
+ResolverCache::get(const std::string& host, const std::string& service, asio::error_code& ec,
+                   std::vector<asio::ip::tcp::endpoint>& endpoints, bool& refresh)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find({host, service});
+    if (it == entries_.end())
+        return false;
+    auto& entry = it->second;
+    auto age = clock::now() - entry.resolved;
+    if (not entry.refreshing and age >= config_.refreshAfter) {
+        entry.refreshing = true;
+        refresh = true;
+    }
+    if (age >= (entry.ec ? config_.errorTtl : config_.ttl))
+        return false;
+    ec = entry.ec;
+    endpoints = entry.endpoints;
+    return true;
+}
+
+std::vector<asio::ip::tcp::endpoint>
+ResolverCache::set(const std::string& host, const std::string& service, const asio::error_code& ec,
+                   std::vector<asio::ip::tcp::endpoint> endpoints)
+{
+    if (not ec)
+        endpoints = interleave(endpoints);
+    std::lock_guard<std::mutex> lock(lock_);
+    auto now = clock::now();
+    auto it = entries_.find({host, service});
+    if (it != entries_.end()) {
+        auto& entry = it->second;
+        entry.refreshing = false;
+        // keep serving the endpoints resolved before a failure, until they expire
+        if (ec and (ec == asio::error::operation_aborted
+                    or (not entry.ec and now - entry.resolved < config_.ttl)))
+            return endpoints;
+        if (not ec and not entry.ec and not entry.endpoints.empty()) {
+            // keep trying first the endpoint we last connected to
+            auto preferred = entry.endpoints.front();
+            auto p = std::find(endpoints.begin(), endpoints.end(), preferred);
+            if (p != endpoints.end())
+                std::rotate(endpoints.begin(), p, p + 1);
+        }
+    } else if (ec == asio::error::operation_aborted) {
+        return endpoints;
+    } else if (entries_.size() >= config_.maxEntries) {
+        auto oldest = std::min_element(entries_.begin(), entries_.end(), [](const auto& a, const auto& b) {
+            return a.second.resolved < b.second.resolved;
+        });
+        entries_.erase(oldest);
+    }
+    auto& entry = entries_[{host, service}];
+    entry.ec = ec;
+    entry.endpoints = endpoints;
+    entry.resolved = now;
+    entry.refreshing = false;
+    return endpoints;
+}
+
+void
+ResolverCache::connected(const std::string& host, const std::string& service, const asio::ip::tcp::endpoint& endpoint)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find({host, service});
+    if (it == entries_.end())
+        return;
+    auto& endpoints = it->second.endpoints;
+    auto p = std::find(endpoints.begin(), endpoints.end(), endpoint);
+    if (p != endpoints.end())
+        std::rotate(endpoints.begin(), p, p + 1);
+}
+
+void
+ResolverCache::erase(const std::string& host, const std::string& service)
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    entries_.erase({host, service});
+}
+
+void
+ResolverCache::clear()
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    entries_.clear();
+}
+
 // Resolver
 
 Resolver::Resolver(asio::io_context& ctx, const std::string& url, std::shared_ptr<dht::Logger> logger)
@@ -449,6 +705,16 @@ void
 Resolver::add_callback(ResolverCb cb, sa_family_t family)
 {
     std::lock_guard<std::mutex> lock(mutex_);
+    if (completed_ and cached_) {
+        // pick up the endpoints refreshed since the last callback
+        bool refresh = false;
+        if (not ResolverCache::instance().get(url_.host, service_, ec_, endpoints_, refresh)) {
+            // the resolution expired, wait for a new one
+            completed_ = false;
+            lookup(url_.host, service_, false);
+        } else if (refresh)
+            lookup(url_.host, service_, true);
+    }
     if (!completed_)
         cbs_.emplace(family == AF_UNSPEC ? std::move(cb) : [cb, family](const asio::error_code& ec, const std::vector<asio::ip::tcp::endpoint>& endpoints){
             if (ec)
@@ -462,12 +728,30 @@ Resolver::add_callback(ResolverCb cb, sa_family_t family)
 
 void
 Resolver::resolve(const std::string& host, const std::string& service)
+{
+    bool refresh = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    cached_ = true;
+    service_ = service;
+    if (not ResolverCache::instance().get(host, service, ec_, endpoints_, refresh))
+        lookup(host, service, false);
+    else {
+        completed_ = true;
+        if (refresh)
+            lookup(host, service, true);
+    }
+}
+
+void
+Resolver::lookup(const std::string& host, const std::string& service, bool background)
 {
     asio::ip::tcp::resolver::query query_(host, service);
-    resolver_.async_resolve(query_, [this, host, service, destroyed = destroyed_]
-        (const asio::error_code& ec, asio::ip::tcp::resolver::results_type endpoints)
+    resolver_.async_resolve(query_, [this, host, service, background, destroyed = destroyed_]
+        (const asio::error_code& ec, asio::ip::tcp::resolver::results_type results)
     {
-        if (ec == asio::error::operation_aborted or *destroyed)
+        auto endpoints = ResolverCache::instance().set(host, service, ec,
+            std::vector<asio::ip::tcp::endpoint>{results.begin(), results.end()});
+        if (ec == asio::error::operation_aborted or *destroyed or background)
             return;
         if (logger_) {
             if (ec)
@@ -478,7 +762,7 @@ Resolver::resolve(const std::string& host, const std::string& service)
         {
             std::lock_guard<std::mutex> lock(mutex_);
             ec_ = ec;
-            endpoints_ = std::vector<asio::ip::tcp::endpoint>{endpoints.begin(), endpoints.end()};
+            endpoints_ = std::move(endpoints);
             completed_ = true;
             cbs = std::move(cbs_);
         }
@@ -618,6 +902,22 @@ Request::get_connection() const {
     return conn_;
 }
 
+void
+Request::set_connection_pool(std::shared_ptr<ConnectionPool> pool) {
+    pool_ = std::move(pool);
+}
+
+ConnectionPool::Key
+Request::pool_key() const
+{
+    const auto& url = get_url();
+    ConnectionPool::Key key {url.host, url.service, url.protocol == "https"};
+    if (key.ssl and (server_ca_ or client_identity_.second))
+        key.credentials = (server_ca_ ? server_ca_->getId().toString() : std::string{}) + ":"
+                        + (client_identity_.second ? client_identity_.second->getId().toString() : std::string{});
+    return key;
+}
+
 void
 Request::set_certificate_authority(std::shared_ptr<dht::crypto::Certificate> certificate) {
     server_ca_ = certificate;
@@ -826,6 +1126,8 @@ Request::connect(std::vector<asio::ip::tcp::endpoint>&& endpoints, HandlerCb cb)
             conn_ = std::make_shared<Connection>(ctx_, true/*ssl*/, logger_);
         conn_->set_ssl_verification(get_url().host, asio::ssl::verify_peer
                                                     | asio::ssl::verify_fail_if_no_peer_cert);
+        if (pool_)
+            conn_->set_tls_session(pool_->get_tls_session(pool_key()));
     }
     else
         conn_ = std::make_shared<Connection>(ctx_, false/*ssl*/, logger_);
@@ -848,6 +1150,8 @@ Request::connect(std::vector<asio::ip::tcp::endpoint>&& endpoints, HandlerCb cb)
                 this_.logger_->e("[http:request:%i] connect failed with all endpoints: %s", this_.id_, ec.message().c_str());
         } else {
             const auto& url = this_.get_url();
+            if (not url.host.empty())
+                ResolverCache::instance().connected(url.host, url.service.empty() ? url.protocol : url.service, endpoint);
             auto port = endpoint.port();
             if ((!isHttps && port == (in_port_t)80)
              || (isHttps && port == (in_port_t)443))
@@ -895,6 +1199,24 @@ Request::send()
                 this_.terminate(asio::error::connection_aborted);
             }
             else if (!this_.conn_ or !this_.conn_->is_open()) {
+                if (this_.pool_ and not this_.get_url().host.empty()) {
+                    if (auto conn = this_.pool_->get(this_.pool_key())) {
+                        const auto& url = this_.get_url();
+                        bool isHttps = url.protocol == "https";
+                        if (url.service.empty()
+                         or (!isHttps and url.service == "80")
+                         or (isHttps and url.service == "443"))
+                            this_.set_header_field(restinio::http_field_t::host, url.host);
+                        else
+                            this_.set_header_field(restinio::http_field_t::host, url.host + ":" + url.service);
+                        if (this_.logger_)
+                            this_.logger_->d("[http:request:%i] reuse connection %i", this_.id_, conn->id());
+                        this_.conn_ = std::move(conn);
+                        this_.reused_ = true;
+                        this_.post();
+                        return;
+                    }
+                }
                 this_.connect(std::move(endpoints), [wthis](const asio::error_code &ec) {
                     if (auto sthis = wthis.lock()) {
                         if (ec)
@@ -931,9 +1253,9 @@ Request::post()
     notify_state_change(State::SENDING);
 
     std::weak_ptr<Request> wthis = shared_from_this();
-    conn_->async_write([wthis](const asio::error_code& ec, size_t) {
+    conn_->async_write([wthis](const asio::error_code& ec, size_t n) {
         if (auto sthis = wthis.lock())
-            sthis->handle_request(ec);
+            sthis->handle_request(ec, n);
     });
 }
 
@@ -952,16 +1274,58 @@ Request::terminate(const asio::error_code& ec)
             logger_->d("[http:request:%i] done with status code %u", id_, response_.status_code);
     }
 
-    if (!parser_ or !http_should_keep_alive(parser_.get()))
+    if (!parser_ or !http_should_keep_alive(parser_.get())) {
         if (auto c = conn_)
             c->close();
+    } else if (pool_ and ec == asio::error::eof and conn_ and conn_->is_open()) {
+        // the response is complete: the connection can serve another request
+        auto key = pool_key();
+        if (conn_->is_ssl())
+            pool_->set_tls_session(key, conn_->get_tls_session());
+        pool_->put(key, std::move(conn_));
+    }
     notify_state_change(State::DONE);
 }
 
+bool
+Request::retry(const asio::error_code& ec, bool sent)
+{
+    if (not reused_ or ec == asio::error::operation_aborted or response_.status_code != 0)
+        return false;
+    // the server may have processed a request it received
+    if (sent and not is_idempotent())
+        return false;
+    if (logger_)
+        logger_->d("[http:request:%i] pooled connection failed: %s, retrying", id_, ec.message().c_str());
+    reused_ = false;
+    if (auto c = std::move(conn_))
+        c->close();
+    // send() may call back synchronously, the lock is held here
+    std::weak_ptr<Request> wthis = shared_from_this();
+    ctx_.post([wthis]{
+        if (auto sthis = wthis.lock())
+            sthis->send();
+    });
+    return true;
+}
+
 void
-Request::handle_request(const asio::error_code& ec)
+Request::is_idempotent() const
+{
+    const auto method = header_.method();
+    return method == restinio::http_method_get()
+        or method == restinio::http_method_head()
+        or method == restinio::http_method_put()
+        or method == restinio::http_method_delete()
+        or method == restinio::http_method_options();
+}
+
+void
+Request::handle_request(const asio::error_code& ec, size_t sent)
 {
     std::lock_guard<std::mutex> lock(mutex_);
+    if (ec and ec != asio::error::eof and retry(ec, sent != 0))
+        return;
     if (ec and ec != asio::error::eof){
         terminate(ec);
         return;
@@ -986,6 +1350,8 @@ void
 Request::handle_response(const asio::error_code& ec, size_t /* n_bytes */)
 {
     std::lock_guard<std::mutex> lock(mutex_);
+    if (ec and retry(ec, true))
+        return;
     if (ec && ec != asio::error::eof){
         terminate(ec);
         return;
@@ -1000,6 +1366,11 @@ Request::handle_response(const asio::error_code& ec, size_t /* n_bytes */)
         terminate(asio::error::basic_errors::broken_pipe);
         return;
     }
+    // the server closed the connection before the end of the response
+    if (ec == asio::error::eof and state_ != State::DONE) {
+        terminate(asio::error::connection_reset);
+        return;
+    }
 
     if (state_ != State::DONE and parser_ and not http_body_is_final(parser_.get())) {
         auto toRead = parser_->content_length ? std::min<uint64_t>(parser_->content_length, 64 * 1024) : 64 * 1024;
@@ -1065,9 +1436,9 @@ Request::onHeadersComplete() {
             std::ostream request_stream(&conn_->input());
             request_stream << body_ << "\r\n";
             std::weak_ptr<Request> wthis = shared_from_this();
-            conn_->async_write([wthis](const asio::error_code& ec, size_t) {
+            conn_->async_write([wthis](const asio::error_code& ec, size_t n) {
                 if (auto sthis = wthis.lock())
-                    sthis->handle_request(ec);
+                    sthis->handle_request(ec, n);
             });
         }
     }
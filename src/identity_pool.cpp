@@ -0,0 +1,225 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "identity_pool.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dht {
+namespace crypto {
+
+struct IdentityPool::State {
+    Config config;
+    mutable std::mutex lock {};
+    /* identities ready, with the file slot they are saved to */
+    std::deque<std::pair<Identity, size_t>> ready {};
+    std::vector<bool> usedSlots {};
+    /* number of identities being generated */
+    size_t generating {0};
+    bool stopped {false};
+
+    State(Config c) : config(std::move(c)), usedSlots(config.size, false) {}
+
+    std::string slotPath(size_t slot) const {
+        return config.path + "." + std::to_string(slot);
+    }
+    void load();
+    /** @return a free slot, now marked used, or usedSlots.size() if none */
+    size_t reserve();
+    /** Saves an identity to its slot files, without the lock held */
+    bool save(const Identity& id, size_t slot) const;
+    /** Removes the files of a slot, without the lock held */
+    void remove(size_t slot) const;
+    static void fill(const std::shared_ptr<State>& state);
+};
+
+static Blob
+readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (not file)
+        throw CryptoException("Can't read file: " + path);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+void
+IdentityPool::State::load()
+{
+    if (config.path.empty())
+        return;
+    for (size_t slot = 0; slot < config.size; slot++) {
+        auto path = slotPath(slot);
+        try {
+            auto key = std::make_shared<PrivateKey>(readFile(path + ".pem"), config.password);
+            auto cert = std::make_shared<Certificate>(readFile(path + ".crt"));
+            if (cert->getId() != key->getPublicKey().getId())
+                continue;
+            ready.emplace_back(Identity {std::move(key), std::move(cert)}, slot);
+            usedSlots[slot] = true;
+        } catch (const std::exception&) {
+            // missing or invalid: the slot will be overwritten
+        }
+    }
+}
+
+/* Creates a file readable by its owner only, before a private key is written to it */
+static void
+createPrivateFile(const std::string& path)
+{
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        throw CryptoException("Can't create file: " + path);
+    // the file may exist already, with other permissions
+    bool ok = fchmod(fd, S_IRUSR | S_IWUSR) == 0;
+    close(fd);
+    if (not ok)
+        throw CryptoException("Can't restrict permissions of file: " + path);
+#else
+    (void)path;
+#endif
+}
+
+size_t
+IdentityPool::State::reserve()
+{
+    size_t slot = 0;
+    while (slot < usedSlots.size() and usedSlots[slot])
+        slot++;
+    if (slot < usedSlots.size())
+        usedSlots[slot] = true;
+    return slot;
+}
+
+bool
+IdentityPool::State::save(const Identity& id, size_t slot) const
+{
+    if (config.path.empty())
+        return true;
+    auto path = slotPath(slot);
+    try {
+        createPrivateFile(path + ".pem");
+        saveIdentity(id, path, config.password);
+        return true;
+    } catch (const std::exception&) {
+        remove(slot);
+        return false;
+    }
+}
+
+void
+IdentityPool::State::remove(size_t slot) const
+{
+    if (config.path.empty())
+        return;
+    auto path = slotPath(slot);
+    std::remove((path + ".pem").c_str());
+    std::remove((path + ".crt").c_str());
+}
+
+void
+IdentityPool::State::fill(const std::shared_ptr<State>& state)
+{
+    while (not state->stopped and state->ready.size() + state->generating < state->config.size) {
+        state->generating++;
+        ThreadPool::computation().run([state] {
+            Identity id;
+            try {
+                id = state->config.generator();
+            } catch (const std::exception&) {}
+            std::unique_lock<std::mutex> lk(state->lock);
+            if (state->stopped or not id.first or not id.second) {
+                state->generating--;
+                return;
+            }
+            auto slot = state->reserve();
+            if (slot == state->usedSlots.size()) {
+                state->generating--;
+                return;
+            }
+            // the slot is ours until released: save it without the lock
+            lk.unlock();
+            bool saved = state->save(id, slot);
+            lk.lock();
+            state->generating--;
+            if (saved)
+                state->ready.emplace_back(std::move(id), slot);
+            else
+                state->usedSlots[slot] = false;
+        }, ThreadPool::Priority::Low);
+    }
+}
+
+IdentityPool::IdentityPool() : IdentityPool(Config {}) {}
+
+IdentityPool::IdentityPool(Config config)
+{
+    if (not config.generator)
+        config.generator = []{ return generateIdentity(); };
+    state_ = std::make_shared<State>(std::move(config));
+    // not shared yet: load without the lock
+    state_->load();
+    std::lock_guard<std::mutex> lk(state_->lock);
+    State::fill(state_);
+}
+
+IdentityPool::~IdentityPool()
+{
+    std::lock_guard<std::mutex> lk(state_->lock);
+    state_->stopped = true;
+}
+
+Identity
+IdentityPool::get()
+{
+    std::unique_lock<std::mutex> lk(state_->lock);
+    if (not state_->ready.empty()) {
+        auto entry = std::move(state_->ready.front());
+        state_->ready.pop_front();
+        // the slot stays used until its files are removed
+        lk.unlock();
+        state_->remove(entry.second);
+        lk.lock();
+        state_->usedSlots[entry.second] = false;
+        State::fill(state_);
+        return std::move(entry.first);
+    }
+    State::fill(state_);
+    lk.unlock();
+    return state_->config.generator();
+}
+
+size_t
+IdentityPool::available() const
+{
+    std::lock_guard<std::mutex> lk(state_->lock);
+    return state_->ready.size();
+}
+
+}
+}
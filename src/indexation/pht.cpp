@@ -21,9 +21,15 @@
 #include "indexation/pht.h"
 #include "rng.h"
 
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
 namespace dht {
 namespace indexation {
 
+static constexpr size_t CACHE_READ_CHUNK {64 * 1024};
+
 /**
  * Output the blob into string and readable way
  *
@@ -59,18 +65,34 @@ std::string Prefix::toString() const {
     return ss.str();
 }
 
-void Pht::Cache::insert(const Prefix& p) {
+void Pht::Cache::expire(time_point now) {
+    while (not leaves_.empty()
+        and (leaves_.back().node->last_reply + NODE_EXPIRE_TIME < now
+          or leaves_.size() > MAX_ELEMENT)) {
+
+        leaves_.back().node->is_leaf = false;
+        leaves_.pop_back();
+    }
+}
+
+void Pht::Cache::touch(const std::shared_ptr<Node>& node, const Prefix& p) {
+    if (node->is_leaf) {
+        leaves_.splice(leaves_.begin(), leaves_, node->leaf);
+    } else {
+        leaves_.push_front(Leaf {p, node});
+        node->leaf = leaves_.begin();
+        node->is_leaf = true;
+    }
+}
+
+void Pht::Cache::insert(const Prefix& p, time_point last_reply) {
     size_t i = 0;
-    auto now = clock::now();
 
     std::shared_ptr<Node> curr_node;
 
-    while ((leaves_.size() > 0
-        and leaves_.begin()->first + NODE_EXPIRE_TIME < now)
-        or  leaves_.size() > MAX_ELEMENT) {
-
-        leaves_.erase(leaves_.begin());
-    }
+    auto now = clock::now();
+    if (last_reply + NODE_EXPIRE_TIME < now) return;
+    expire(now);
 
     if (not (curr_node = root_.lock()) ) {
         /* Root does not exist, need to create one*/
@@ -78,7 +100,7 @@ void Pht::Cache::insert(const Prefix& p) {
         root_ = curr_node;
     }
 
-    curr_node->last_reply = now;
+    curr_node->last_reply = std::max(curr_node->last_reply, last_reply);
 
     /* Iterate through all bit of the Blob */
     for ( i = 0; i < p.size_; i++ ) {
@@ -100,53 +122,50 @@ void Pht::Cache::insert(const Prefix& p) {
             curr_node = std::move(tmp_curr_node);
         }
 
-        curr_node->last_reply = now;
+        curr_node->last_reply = std::max(curr_node->last_reply, last_reply);
     }
 
-    /* Insert the leaf (curr_node) into the multimap */
-    leaves_.emplace(std::move(now), std::move(curr_node) );
+    /* Insert the leaf (curr_node) into the list */
+    touch(curr_node, p);
 }
 
 int Pht::Cache::lookup(const Prefix& p) {
     int pos = -1;
-    auto now = clock::now(), last_node_time = now;
+    auto now = clock::now();
 
     /* Before lookup remove the useless one [i.e. too old] */
-    while ( leaves_.size() > 0
-        and leaves_.begin()->first + NODE_EXPIRE_TIME < now ) {
-
-        leaves_.erase(leaves_.begin());
-    }
+    expire(now);
 
     auto next = root_;
     std::shared_ptr<Node> curr_node;
 
-    while ( auto n = next.lock() ) {
+    /* Depths beyond the last bit of the prefix can't be looked up */
+    while ( pos + 1 < (int) p.size_ ) {
+        auto n = next.lock();
+        if (not n) break;
         ++pos;
-        /* Safe since pos is equal to 0 until here */
-        if ( (unsigned) pos >= p.content_.size() * 8) break;
 
-        curr_node = n;
-        last_node_time = curr_node->last_reply;
+        curr_node = std::move(n);
         curr_node->last_reply = now;
 
         /* Get the Prefix bit by bit, starting from left */
         next = ( p.isContentBitActive(pos) ) ? curr_node->right_child : curr_node->left_child;
     }
 
-    if ( pos >= 0 ) {
-        auto to_erase = leaves_.find(last_node_time);
-        if ( to_erase != leaves_.end() )
-            leaves_.erase( to_erase );
-
-        leaves_.emplace( std::move(now), std::move(curr_node) );
-    }
+    if ( curr_node )
+        touch(curr_node, Prefix(p, pos));
 
     return pos;
 }
 
+void Pht::Cache::forEach(const std::function<void(const Prefix& p, time_point last_reply)>& cb) const {
+    for (auto it = leaves_.rbegin(); it != leaves_.rend(); ++it)
+        cb(it->prefix, it->node->last_reply);
+}
+
 const ValueType IndexEntry::TYPE = ValueType::USER_DATA;
-constexpr std::chrono::minutes Pht::Cache::NODE_EXPIRE_TIME;
+constexpr std::chrono::hours Pht::Cache::NODE_EXPIRE_TIME;
+constexpr int Pht::LOOKUP_PROBES;
 
 void Pht::lookupStep(Prefix p, std::shared_ptr<int> lo, std::shared_ptr<int> hi,
         std::shared_ptr<std::vector<std::shared_ptr<IndexEntry>>> vals,
@@ -154,136 +173,148 @@ void Pht::lookupStep(Prefix p, std::shared_ptr<int> lo, std::shared_ptr<int> hi,
         std::shared_ptr<unsigned> max_common_prefix_len,
         int start, bool all_values)
 {
-    struct node_lookup_result {
-        bool done {false};
-        bool is_pht {false};
+    struct step_state {
+        std::vector<int> depths;
+        std::vector<bool> is_pht;
+        size_t pending {0};
+        bool ok {true};
     };
 
-    /* start could be under 0 but after the compare it to 0 it always will be unsigned, so we can cast it*/
-    auto mid = (start >= 0) ? (unsigned) start : (*lo + *hi)/2;
+    /* Nodes deeper than the last bit of the prefix don't exist */
+    const int max_depth = std::max((int) p.size_ - 1, 0);
+    *hi = std::min(*hi, max_depth);
+
+    auto state = std::make_shared<step_state>();
+    if (start >= 0) {
+        /* The cached leaf, its child and its parent */
+        start = std::min(start, max_depth);
+        for (int d = std::max(start - 1, 0); d <= std::min(start + 1, max_depth); d++)
+            state->depths.push_back(d);
+    } else if (*lo <= *hi) {
+        /* Split points of the range, with their child */
+        for (int i = 1; i <= LOOKUP_PROBES; i++) {
+            auto mid = *lo + (*hi - *lo) * i / (LOOKUP_PROBES + 1);
+            state->depths.push_back(mid);
+            if (mid < max_depth)
+                state->depths.push_back(mid + 1);
+        }
+        std::sort(state->depths.begin(), state->depths.end());
+        state->depths.erase(std::unique(state->depths.begin(), state->depths.end()), state->depths.end());
+    }
+    state->is_pht.resize(state->depths.size(), false);
+    state->pending = state->depths.size();
+
+    auto on_leaf = [=](int mid) {
+        // leaf node
+        Prefix to_insert = p.getPrefix(mid);
+        cache_.insert(to_insert);
+
+        if (cb) {
+            if (vals->size() == 0 and max_common_prefix_len and mid > 0) {
+                auto p_ = (p.getPrefix(mid)).getSibling().getFullSize();
+                *lo = mid;
+                *hi = p_.size_;
+                lookupStep(p_, lo, hi, vals, cb, done_cb, max_common_prefix_len, -1, all_values);
+            }
+
+            cb(*vals, to_insert);
+        }
 
-    auto first_res = std::make_shared<node_lookup_result>();
-    auto second_res = std::make_shared<node_lookup_result>();
+        if (done_cb)
+            done_cb(true);
+    };
 
-    auto on_done = [=](bool ok) {
-        bool is_leaf = first_res->is_pht and not second_res->is_pht;
-        if (not ok) {
+    auto on_done = [=]() {
+        if (not state->ok) {
             if (done_cb)
                 done_cb(false);
+            return;
         }
-        else if (is_leaf or *lo > *hi) {
-            // leaf node
-            Prefix to_insert = p.getPrefix(mid);
-            cache_.insert(to_insert);
-
-            if (cb) {
-                if (vals->size() == 0 and max_common_prefix_len and mid > 0) {
-                    auto p_ = (p.getPrefix(mid)).getSibling().getFullSize();
-                    *lo = mid;
-                    *hi = p_.size_;
-                    lookupStep(p_, lo, hi, vals, cb, done_cb, max_common_prefix_len, -1, all_values);
-                }
 
-                cb(*vals, to_insert);
+        /* The leaf is the first node in the trie without a child in the trie */
+        for (size_t i = 0; i < state->depths.size(); i++) {
+            auto d = state->depths[i];
+            if (not state->is_pht[i])
+                continue;
+            if (d == max_depth or (i + 1 < state->depths.size()
+                               and state->depths[i + 1] == d + 1 and not state->is_pht[i + 1])) {
+                on_leaf(d);
+                return;
             }
+        }
 
-            if (done_cb)
-                done_cb(true);
-        } else if (first_res->is_pht) {
-            // internal node
-            *lo = mid+1;
-            lookupStep(p, lo, hi, vals, cb, done_cb, max_common_prefix_len, -1, all_values);
-        } else {
-            // first get failed before second.
-            if (done_cb)
-                done_cb(false);
+        /* Otherwise keep the range between the deepest node and the first missing one */
+        for (size_t i = 0; i < state->depths.size(); i++) {
+            if (state->is_pht[i])
+                *lo = std::max(*lo, state->depths[i] + 1);
+            else
+                *hi = std::min(*hi, state->depths[i] - 1);
         }
+
+        if (*lo > *hi)
+            on_leaf(std::max(*lo - 1, 0));
+        else
+            lookupStep(p, lo, hi, vals, cb, done_cb, max_common_prefix_len, -1, all_values);
     };
 
-    if (*lo <= *hi) {
-        auto pht_filter = [&](const dht::Value& v) {
-            return v.user_type.compare(0, name_.size(), name_) == 0;
-        };
+    if (state->depths.empty()) {
+        on_leaf(std::max(*lo - 1, 0));
+        return;
+    }
 
-        auto on_get = [=](const std::shared_ptr<dht::Value>& value, std::shared_ptr<node_lookup_result> res) {
-            if (value->user_type == canary_) {
-                res->is_pht = true;
-            }
-            else {
-                IndexEntry entry;
-                entry.unpackValue(*value);
+    auto pht_filter = [&](const dht::Value& v) {
+        return v.user_type.compare(0, name_.size(), name_) == 0;
+    };
 
-                auto it = std::find_if(vals->cbegin(), vals->cend(), [&](const std::shared_ptr<IndexEntry>& ie) {
-                    return ie->value == entry.value;
-                });
+    auto on_get = [=](const std::shared_ptr<dht::Value>& value, size_t i) {
+        if (value->user_type == canary_) {
+            state->is_pht[i] = true;
+        }
+        else {
+            IndexEntry entry;
+            entry.unpackValue(*value);
 
-                /* If we already got the value then get the next one */
-                if (it != vals->cend())
-                    return true;
+            auto it = std::find_if(vals->cbegin(), vals->cend(), [&](const std::shared_ptr<IndexEntry>& ie) {
+                return ie->value == entry.value;
+            });
+
+            /* If we already got the value then get the next one */
+            if (it != vals->cend())
+                return true;
 
-                if (max_common_prefix_len) { /* inexact match case */
-                    auto common_bits = Prefix::commonBits(p, entry.prefix);
+            if (max_common_prefix_len) { /* inexact match case */
+                auto common_bits = Prefix::commonBits(p, entry.prefix);
 
-                    if (vals->empty()) {
+                if (vals->empty()) {
+                    vals->emplace_back(std::make_shared<IndexEntry>(entry));
+                    *max_common_prefix_len = common_bits;
+                }
+                else {
+                    if (common_bits == *max_common_prefix_len) /* this is the max so far */
+                        vals->emplace_back(std::make_shared<IndexEntry>(entry));
+                    else if (common_bits > *max_common_prefix_len) { /* new max found! */
+                        vals->clear();
                         vals->emplace_back(std::make_shared<IndexEntry>(entry));
                         *max_common_prefix_len = common_bits;
                     }
-                    else {
-                        if (common_bits == *max_common_prefix_len) /* this is the max so far */
-                            vals->emplace_back(std::make_shared<IndexEntry>(entry));
-                        else if (common_bits > *max_common_prefix_len) { /* new max found! */
-                            vals->clear();
-                            vals->emplace_back(std::make_shared<IndexEntry>(entry));
-                            *max_common_prefix_len = common_bits;
-                        }
-                    }
-                } else if (all_values or entry.prefix == p.content_) /* exact match case */
-                    vals->emplace_back(std::make_shared<IndexEntry>(entry));
-            }
+                }
+            } else if (all_values or entry.prefix == p.content_) /* exact match case */
+                vals->emplace_back(std::make_shared<IndexEntry>(entry));
+        }
 
-            return true;
-        };
+        return true;
+    };
 
-        dht_->get(p.getPrefix(mid).hash(),
-                std::bind(on_get, std::placeholders::_1, first_res),
+    for (size_t i = 0; i < state->depths.size(); i++) {
+        dht_->get(p.getPrefix(state->depths[i]).hash(),
+                std::bind(on_get, std::placeholders::_1, i),
                 [=](bool ok) {
-                    if (not ok) {
-                        // DHT failed
-                        first_res->done = true;
-                        if (done_cb and second_res->done)
-                            on_done(false);
-                    }
-                    else {
-                        if (not first_res->is_pht) {
-                            // Not a PHT node.
-                            *hi = mid-1;
-                            lookupStep(p, lo, hi, vals, cb, done_cb, max_common_prefix_len, -1, all_values);
-                        } else {
-                            first_res->done = true;
-                            if (second_res->done or mid >= p.size_ - 1)
-                                on_done(true);
-                        }
-                    }
-                }, pht_filter);
-
-        if (mid < p.size_ - 1)
-           dht_->get(p.getPrefix(mid+1).hash(),
-                    std::bind(on_get, std::placeholders::_1, second_res),
-                    [=](bool ok) {
-                        if (not ok) {
-                            // DHT failed
-                            second_res->done = true;
-                            if (done_cb and first_res->done)
-                                on_done(false);
-                        }
-                        else {
-                            second_res->done = true;
-                            if (first_res->done)
-                                on_done(true);
-                        }
+                    // DHT failed
+                    if (not ok)
+                        state->ok = false;
+                    if (--state->pending == 0)
+                        on_done();
                 }, pht_filter);
-    } else {
-        on_done(true);
     }
 }
 
@@ -308,6 +339,249 @@ void Pht::lookup(Key k, Pht::LookupCallback cb, DoneCallbackSimple done_cb, bool
         }, done_cb, max_common_prefix_len, cache_.lookup(prefix));
 }
 
+struct Pht::RangeSlot {
+    Prefix prefix;
+    bool loaded {false};   /* entries of the node are known */
+    bool fetching {false};
+    bool leaf {false};
+    std::vector<IndexEntry> entries;
+
+    RangeSlot(Prefix p) : prefix(std::move(p)) {}
+};
+
+struct Pht::RangeQuery {
+    Blob min;
+    Blob max;
+    size_t max_depth;
+    size_t window;
+    size_t in_flight {0};
+    bool ok {true};
+    bool ended {false};
+    std::list<std::shared_ptr<RangeSlot>> slots;
+    RangeCallback cb;
+    DoneCallbackSimple done_cb;
+
+    /* The node at p covers keys of the range */
+    bool overlaps(const Prefix& p) const {
+        return Prefix(Prefix(min), p.size_).content_ <= p.content_
+           and p.content_ <= Prefix(Prefix(max), p.size_).content_;
+    }
+
+    bool contains(const Blob& prefix) const {
+        return min <= prefix and prefix <= max;
+    }
+
+    /* Prefix of the child of p, for bit */
+    Prefix child(const Prefix& p, bool bit) const {
+        Blob content(p.content_);
+        content.resize(min.size(), 0);
+        if (bit)
+            content[p.size_ / 8] |= 0x80 >> (p.size_ % 8);
+        return Prefix(Prefix(content), p.size_ + 1);
+    }
+
+    void end() {
+        if (ended)
+            return;
+        ended = true;
+        if (done_cb)
+            done_cb(ok);
+    }
+};
+
+void Pht::rangeQuery(Key min, Key max, RangeCallback cb, DoneCallbackSimple done_cb, size_t window) {
+    auto q = std::make_shared<RangeQuery>();
+    q->min = linearize(min).content_;
+    q->max = linearize(max).content_;
+    q->max_depth = q->min.size() * 8 - 1;
+    q->window = std::max(window, (size_t) 1);
+    q->cb = std::move(cb);
+    q->done_cb = std::move(done_cb);
+
+    if (q->max < q->min) {
+        q->end();
+        return;
+    }
+
+    /* The walk starts from the root of the trie */
+    q->slots.emplace_back(std::make_shared<RangeSlot>(Prefix(Prefix(q->min), 0)));
+    rangeStep(q);
+}
+
+void Pht::rangeStep(const std::shared_ptr<RangeQuery>& q) {
+    if (q->ended)
+        return;
+
+    /* Leaves are passed in key order */
+    while (not q->slots.empty() and q->slots.front()->leaf) {
+        auto slot = std::move(q->slots.front());
+        q->slots.pop_front();
+        if (slot->entries.empty())
+            continue;
+
+        std::vector<std::shared_ptr<Value>> vals;
+        vals.reserve(slot->entries.size());
+        for (const auto& entry : slot->entries)
+            vals.emplace_back(std::make_shared<Value>(entry.value));
+
+        if (q->cb and not q->cb(vals)) {
+            q->end();
+            return;
+        }
+    }
+
+    if (q->slots.empty()) {
+        q->end();
+        return;
+    }
+
+    /* Fetch the first nodes of the range, up to the window */
+    std::vector<std::shared_ptr<RangeSlot>> to_fetch;
+    for (const auto& slot : q->slots) {
+        if (q->in_flight >= q->window)
+            break;
+        if (slot->fetching or slot->leaf)
+            continue;
+        slot->fetching = true;
+        q->in_flight++;
+        to_fetch.emplace_back(slot);
+    }
+
+    for (const auto& slot : to_fetch)
+        rangeFetch(q, slot);
+}
+
+void Pht::rangeFetch(const std::shared_ptr<RangeQuery>& q, const std::shared_ptr<RangeSlot>& slot) {
+    struct FetchState {
+        unsigned pending {0};
+        bool ok {true};
+        bool child_pht {false};
+        std::vector<IndexEntry> child_entries;
+    };
+    auto fs = std::make_shared<FetchState>();
+
+    const auto& p = slot->prefix;
+    bool probe_child = p.size_ < q->max_depth;
+    fs->pending = (slot->loaded ? 0 : 1) + (probe_child ? 1 : 0);
+
+    auto on_done = [=](bool ok) {
+        fs->ok = fs->ok and ok;
+        if (fs->pending and --fs->pending)
+            return;
+        q->in_flight--;
+        if (q->ended)
+            return;
+        if (not fs->ok)
+            q->ok = false;
+
+        if (fs->child_pht) {
+            /* Internal node: replace it by its children in the range */
+            auto c0 = std::make_shared<RangeSlot>(q->child(slot->prefix, false));
+            c0->loaded = true;
+            c0->entries = std::move(fs->child_entries);
+            auto c1 = std::make_shared<RangeSlot>(q->child(slot->prefix, true));
+
+            auto it = std::find(q->slots.begin(), q->slots.end(), slot);
+            if (it != q->slots.end()) {
+                it = q->slots.erase(it);
+                if (q->overlaps(c0->prefix))
+                    q->slots.insert(it, std::move(c0));
+                if (q->overlaps(c1->prefix))
+                    q->slots.insert(it, std::move(c1));
+            }
+        } else {
+            /* Leaf: keep its entries in the range, in key order */
+            auto& entries = slot->entries;
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const IndexEntry& e) {
+                return not q->contains(e.prefix);
+            }), entries.end());
+            std::sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+                return a.prefix < b.prefix;
+            });
+            entries.erase(std::unique(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+                return a.prefix == b.prefix and a.value == b.value;
+            }), entries.end());
+            slot->leaf = true;
+        }
+
+        rangeStep(q);
+    };
+
+    if (fs->pending == 0) {
+        on_done(true);
+        return;
+    }
+
+    auto pht_filter = [&](const dht::Value& v) {
+        return v.user_type.compare(0, name_.size(), name_) == 0;
+    };
+
+    if (not slot->loaded) {
+        dht_->get(p.hash(),
+            [=](const std::shared_ptr<dht::Value>& value) {
+                if (value->user_type != canary_) {
+                    IndexEntry entry;
+                    entry.unpackValue(*value);
+                    slot->entries.emplace_back(std::move(entry));
+                }
+                return true;
+            }, on_done, pht_filter);
+    }
+
+    if (probe_child) {
+        dht_->get(q->child(p, false).hash(),
+            [=](const std::shared_ptr<dht::Value>& value) {
+                if (value->user_type == canary_) {
+                    fs->child_pht = true;
+                } else {
+                    IndexEntry entry;
+                    entry.unpackValue(*value);
+                    fs->child_entries.emplace_back(std::move(entry));
+                }
+                return true;
+            }, on_done, pht_filter);
+    }
+}
+
+void Pht::saveCache(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary);
+    msgpack::packer<std::ofstream> pk(&file);
+
+    /* One [content, size, last reply] array per leaf, least recently used first */
+    cache_.forEach([&](const Prefix& p, time_point last_reply) {
+        pk.pack_array(3);
+        pk.pack(p.content_);
+        pk.pack(p.size_);
+        pk.pack(to_time_t(last_reply));
+    });
+}
+
+void Pht::loadCache(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (not file.is_open())
+        return;
+
+    try {
+        msgpack::unpacker pac;
+        msgpack::object_handle oh;
+        while (file) {
+            pac.reserve_buffer(CACHE_READ_CHUNK);
+            file.read(pac.buffer(), CACHE_READ_CHUNK);
+            pac.buffer_consumed(file.gcount());
+            while (pac.next(oh)) {
+                const auto& o = oh.get();
+                if (o.type != msgpack::type::ARRAY or o.via.array.size < 3)
+                    continue;
+                Prefix content(o.via.array.ptr[0].as<Blob>());
+                auto size = std::min(o.via.array.ptr[1].as<size_t>(), content.size_);
+                cache_.insert(Prefix(content, size), from_time_t(o.via.array.ptr[2].as<std::time_t>()));
+            }
+        }
+    } catch (const std::exception&) {
+        /* Keep the leaves loaded so far */
+    }
+}
+
 void Pht::updateCanary(Prefix p) {
     // TODO: change this... copy value
     dht::Value canary_value;
@@ -368,6 +642,117 @@ void Pht::insert(const Prefix& kp, IndexEntry entry, std::shared_ptr<int> lo, st
         }, nullptr, cache_.lookup(kp), true);
 }
 
+void Pht::bulkInsert(const std::vector<std::pair<Key, Value>>& entries, DoneCallbackSimple done_cb) {
+    std::vector<IndexEntry> index_entries;
+    index_entries.reserve(entries.size());
+
+    for ( auto const& e : entries ) {
+        IndexEntry entry;
+        entry.value = e.second;
+        entry.prefix = linearize(e.first).content_;
+        entry.name = name_;
+        index_entries.emplace_back(std::move(entry));
+    }
+
+    bulkInsert(std::move(index_entries), clock::now(), std::move(done_cb));
+}
+
+void Pht::bulkInsert(std::vector<IndexEntry> entries, time_point time_p, DoneCallbackSimple done_cb) {
+    auto op = std::make_shared<BulkInsert>();
+    op->entries = std::move(entries);
+    op->time_p = time_p;
+    op->done_cb = std::move(done_cb);
+
+    /* Entries of a leaf are next to each other once sorted */
+    std::sort(op->entries.begin(), op->entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.prefix < b.prefix;
+    });
+
+    bulkInsertStep(op);
+}
+
+void Pht::bulkInsertStep(std::shared_ptr<BulkInsert> op) {
+    if ( op->next >= op->entries.size() ) {
+        op->end(true);
+        return;
+    }
+    if ( op->time_p + ValueType::USER_DATA.expiration < clock::now() ) {
+        op->end(false);
+        return;
+    }
+
+    Prefix kp = op->entries[op->next].prefix;
+
+    auto lo = std::make_shared<int>(0);
+    auto hi = std::make_shared<int>(kp.size_);
+    auto vals = std::make_shared<std::vector<std::shared_ptr<IndexEntry>>>();
+    auto leaf = std::make_shared<Prefix>();
+
+    lookupStep(kp, lo, hi, vals,
+        [=](std::vector<std::shared_ptr<IndexEntry>>&, Prefix p) {
+            *leaf = Prefix(p);
+        },
+        [=](bool ok) {
+            auto in_leaf = [&](const Blob& prefix) {
+                return Prefix(Prefix(prefix), leaf->size_).content_ == leaf->content_;
+            };
+
+            /* Following entries belonging to the same leaf */
+            auto first = op->next, last = first + 1;
+            while ( ok and last < op->entries.size() and in_leaf(op->entries[last].prefix) )
+                last++;
+            op->next = last;
+
+            if (ok) {
+                std::vector<IndexEntry> leaf_entries(std::make_move_iterator(op->entries.begin() + first),
+                                                     std::make_move_iterator(op->entries.begin() + last));
+
+                /* Entries already in the leaf move with the new ones if it splits */
+                for ( auto const& v : *vals )
+                    if ( in_leaf(v->prefix) )
+                        leaf_entries.emplace_back(*v);
+
+                publishLeaves(std::move(leaf_entries), leaf->size_, op);
+            } else {
+                op->ok = false;
+            }
+
+            bulkInsertStep(op);
+        }, nullptr, cache_.lookup(kp), true);
+}
+
+void Pht::publishLeaves(std::vector<IndexEntry> entries, size_t depth, const std::shared_ptr<BulkInsert>& op) {
+    const Prefix full = entries.front().prefix;
+    const Prefix node(full, depth);
+
+    updateCanary(node);
+
+    if ( entries.size() <= MAX_NODE_ENTRY_COUNT or depth >= full.size_ - 1 ) {
+        cache_.insert(node);
+        checkPhtUpdate(node, entries, op->time_p);
+
+        for ( auto& entry : entries ) {
+            op->pending++;
+            dht_->put(node.hash(), std::move(entry), [op](bool ok) { op->end(ok); }, op->time_p);
+        }
+        return;
+    }
+
+    /* Too many entries for a leaf: split it by the next bit */
+    std::vector<IndexEntry> left, right;
+    for ( auto& entry : entries ) {
+        if ( Prefix(entry.prefix).isContentBitActive(depth) )
+            right.emplace_back(std::move(entry));
+        else
+            left.emplace_back(std::move(entry));
+    }
+
+    if ( not left.empty() )
+        publishLeaves(std::move(left), depth + 1, op);
+    if ( not right.empty() )
+        publishLeaves(std::move(right), depth + 1, op);
+}
+
 Prefix Pht::zcurve(const std::vector<Prefix>& all_prefix) const {
     Prefix p;
 
@@ -520,6 +905,31 @@ void Pht::checkPhtUpdate(Prefix p, IndexEntry entry, time_point time_p) {
     );
 }
 
+void Pht::checkPhtUpdate(Prefix p, std::vector<IndexEntry> entries, time_point time_p) {
+
+    Prefix full = entries.front().prefix;
+    if ( p.content_.size() * 8 >= full.content_.size() * 8 ) return;
+
+    auto next_prefix = full.getPrefix( p.size_ + 1 );
+
+    dht_->listen(next_prefix.hash(),
+        [=](const std::shared_ptr<dht::Value> &value) {
+            if (value->user_type == canary_) {
+                bulkInsert(entries, time_p, nullptr);
+
+                /* Cancel listen since we found where we need to update*/
+                return false;
+            }
+
+            return true;
+        },
+        [=](const dht::Value& v) {
+            /* Filter value v thats start with the same name as ours */
+            return v.user_type.compare(0, name_.size(), name_) == 0;
+        }
+    );
+}
+
 void Pht::split(const Prefix& insert, const std::vector<std::shared_ptr<IndexEntry>>& vals, IndexEntry entry, RealInsertCallback end_cb ) {
     const auto full = Prefix(entry.prefix);
 
@@ -25,6 +25,7 @@
 namespace dht {
 
 const HexMap hex_map = {};
+const HexUnmap hex_unmap = {};
 
 void
 NodeExport::msgpack_unpack(msgpack::object o)
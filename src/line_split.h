@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstring>
+#include <string>
+
+namespace dht {
+
+/*
+ * Splits the lines received in parts.
+ * The lines of the last part appended are read in place, and the end of
+ * the part after its last line is copied: a part only needs to stay valid
+ * while its lines are read, until the next append.
+ * Lines not read before the next append are dropped.
+ */
+struct LineSplit {
+    struct Line {
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+        const char* data_ {nullptr};
+        size_t size_ {0};
+    };
+    explicit LineSplit(char separator = '\n') : sep_(separator) {}
+
+    void append(const char* d, size_t l) {
+        if (owned_)
+            buf_.erase(0, pos_);
+        pos_ = 0;
+        // buf_ now holds the start of a line from previous parts
+        if (not buf_.empty()) {
+            buf_.append(d, l);
+            owned_ = true;
+            data_ = buf_.data();
+            size_ = buf_.size();
+            return;
+        }
+        size_t n = l;
+        while (n and d[n - 1] != sep_)
+            n--;
+        buf_.assign(d + n, l - n);
+        owned_ = false;
+        data_ = d;
+        size_ = n;
+    }
+    bool getLine() {
+        if (pos_ >= size_)
+            return false;
+        auto b = data_ + pos_;
+        auto e = static_cast<const char*>(std::memchr(b, sep_, size_ - pos_));
+        if (not e)
+            return false;
+        line_ = {b, (size_t)(e + 1 - b)};
+        pos_ = e + 1 - data_;
+        return true;
+    }
+    const Line& line() const { return line_; }
+private:
+    const char sep_;
+    std::string buf_ {};
+    const char* data_ {nullptr};
+    size_t size_ {0};
+    /* read position in data_ */
+    size_t pos_ {0};
+    /* set if data_ is buf_, otherwise buf_ holds the end of the part */
+    bool owned_ {false};
+    Line line_ {};
+};
+
+}
@@ -21,6 +21,11 @@
 #include "value.h"
 #include "utils.h"
 #include "callbacks.h"
+#include "node.h"
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
 
 namespace dht {
 
@@ -40,6 +45,99 @@ struct Listener {
     }
 };
 
+/**
+ * Remote listeners of a key, indexed by node and socket id.
+ *
+ * Listeners are kept in a contiguous array, scanned linearly to send
+ * updates. Adding, refreshing and removing a listener is O(1).
+ * All listeners live for Node::NODE_EXPIRE_TIME after their last refresh,
+ * so refreshes arrive in expiration order: they are queued, and
+ * expiration only looks at the listeners due at the front of the queue.
+ */
+class RemoteListeners {
+public:
+    struct Entry {
+        Sp<Node> node;
+        size_t socket_id;
+        Listener listener;
+    };
+    using const_iterator = std::vector<Entry>::const_iterator;
+
+    const_iterator begin() const { return entries_.begin(); }
+    const_iterator end() const { return entries_.end(); }
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    Entry* find(const Sp<Node>& node, size_t socket_id) {
+        auto it = index_.find({node.get(), socket_id});
+        return it == index_.end() ? nullptr : &entries_[it->second];
+    }
+    const Entry* find(const Sp<Node>& node, size_t socket_id) const {
+        return const_cast<RemoteListeners*>(this)->find(node, socket_id);
+    }
+
+    /** Adds a listener, which must not be registered already */
+    void add(const Sp<Node>& node, size_t socket_id, Listener&& l) {
+        Key k {node.get(), socket_id};
+        index_.emplace(k, entries_.size());
+        expirations_.emplace_back(l.time, k);
+        entries_.emplace_back(Entry {node, socket_id, std::move(l)});
+    }
+
+    void refresh(Entry& e, time_point t, Query&& q) {
+        e.listener.refresh(t, std::move(q));
+        expirations_.emplace_back(t, Key {e.node.get(), e.socket_id});
+    }
+
+    /**
+     * Removes the listeners not refreshed for Node::NODE_EXPIRE_TIME.
+     * @return the number of listeners removed
+     */
+    size_t expire(time_point now) {
+        size_t removed {0};
+        while (not expirations_.empty() and expirations_.front().first + Node::NODE_EXPIRE_TIME < now) {
+            auto k = expirations_.front().second;
+            expirations_.pop_front();
+            // the listener may have been refreshed or removed since
+            auto it = index_.find(k);
+            if (it == index_.end() or entries_[it->second].listener.time + Node::NODE_EXPIRE_TIME >= now)
+                continue;
+            auto i = it->second;
+            index_.erase(it);
+            // move the last listener to the free slot
+            if (i != entries_.size() - 1) {
+                entries_[i] = std::move(entries_.back());
+                index_[{entries_[i].node.get(), entries_[i].socket_id}] = i;
+            }
+            entries_.pop_back();
+            removed++;
+        }
+        return removed;
+    }
+
+    /** @return the next time a listener may expire */
+    time_point getNextExpiration() const {
+        return expirations_.empty() ? time_point::max() : expirations_.front().first + Node::NODE_EXPIRE_TIME;
+    }
+
+private:
+    struct Key {
+        const Node* node;
+        size_t socket_id;
+        bool operator==(const Key& o) const { return node == o.node and socket_id == o.socket_id; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return std::hash<const Node*>{}(k.node) ^ (k.socket_id * 0x9E3779B97F4A7C15ull);
+        }
+    };
+
+    std::vector<Entry> entries_ {};
+    std::unordered_map<Key, size_t, KeyHash> index_ {};
+    /* refresh times of the listeners, oldest first */
+    std::deque<std::pair<time_point, Key>> expirations_ {};
+};
+
 /**
  * A single "listen" operation data
  */
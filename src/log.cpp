@@ -24,30 +24,42 @@
 #include <syslog.h>
 #endif
 
-#include <fstream>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
 namespace dht {
 namespace log {
 
+/* Longest formatted message, longer ones are truncated */
+constexpr size_t LOG_MESSAGE_MAX {8192};
+
+static void
+printTimestamp(std::ostream& s, const std::chrono::steady_clock::time_point& t) {
+    using namespace std::chrono;
+    using log_precision = microseconds;
+    constexpr auto den = log_precision::period::den;
+    auto num = duration_cast<log_precision>(t.time_since_epoch()).count();
+    s << "[" << std::setfill('0') << std::setw(6) << num / den << "."
+             << std::setfill('0') << std::setw(6) << num % den << "]" << " ";
+}
+
 /**
  * Print va_list to std::ostream (used for logging).
  */
 void
 printLog(std::ostream& s, char const *m, va_list args) {
     // print log to buffer
-    std::array<char, 8192> buffer;
+    std::array<char, LOG_MESSAGE_MAX> buffer;
     int ret = vsnprintf(buffer.data(), buffer.size(), m, args);
     if (ret < 0)
         return;
 
-    // write timestamp
-    using namespace std::chrono;
-    using log_precision = microseconds;
-    constexpr auto den = log_precision::period::den;
-    auto num = duration_cast<log_precision>(steady_clock::now().time_since_epoch()).count();
-    s << "[" << std::setfill('0') << std::setw(6) << num / den << "."
-             << std::setfill('0') << std::setw(6) << num % den << "]" << " ";
+    printTimestamp(s, std::chrono::steady_clock::now());
 
     // write log
     s.write(buffer.data(), std::min((size_t) ret, buffer.size()));
@@ -56,21 +68,242 @@ printLog(std::ostream& s, char const *m, va_list args) {
     s << std::endl;
 }
 
+void
+printRecord(std::ostream& s, const LogRecord& record) {
+    printTimestamp(s, record.time);
+    s << record.message << std::endl;
+}
+
+struct AsyncLogger::Impl {
+    /*
+     * Bounded multi-producer ring buffer: a slot can be written when
+     * its sequence is the position of the writer, and read when it is
+     * the position plus one.
+     */
+    struct Slot {
+        std::atomic<size_t> seq {0};
+        LogRecord record {};
+    };
+
+    Impl(LogSink&& s, size_t capacity);
+    void push(LogLevel level, char const* format, va_list args);
+    bool available() const;
+    size_t drain();
+    void reportDropped();
+    void run();
+    void flush();
+    void stop();
+
+    LogSink sink;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> head {0};
+    /* used by the writer thread only */
+    size_t tail {0};
+    uint64_t reported {0};
+
+    std::atomic<size_t> written {0};
+    std::atomic<uint64_t> dropped {0};
+    std::atomic<bool> running {true};
+    std::atomic<bool> sleeping {false};
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::condition_variable cvFlushed;
+    std::thread writer;
+};
+
+AsyncLogger::Impl::Impl(LogSink&& s, size_t capacity) : sink(std::move(s))
+{
+    size_t size = 1;
+    while (size < std::max<size_t>(capacity, 2))
+        size <<= 1;
+    mask = size - 1;
+    slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; i++)
+        slots[i].seq.store(i, std::memory_order_relaxed);
+}
+
+void
+AsyncLogger::Impl::push(LogLevel level, char const* format, va_list args)
+{
+    if (not running.load(std::memory_order_relaxed)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // format before taking a slot, so that slots are filled quickly
+    std::array<char, LOG_MESSAGE_MAX> buffer;
+    int ret = vsnprintf(buffer.data(), buffer.size(), format, args);
+    if (ret < 0)
+        return;
+    auto len = std::min((size_t)ret, buffer.size() - 1);
+    auto now = std::chrono::steady_clock::now();
+
+    auto pos = head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots[pos & mask];
+        auto seq = slot->seq.load(std::memory_order_acquire);
+        auto diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else
+            pos = head.load(std::memory_order_relaxed);
+    }
+    auto& r = slot->record;
+    r.level = level;
+    r.time = now;
+    // the slot keeps the capacity of its previous message
+    r.message.assign(buffer.data(), len);
+    if ((size_t)ret >= buffer.size())
+        r.message += "[[TRUNCATED]]";
+    // seq_cst, with the writer setting sleeping before checking the slot:
+    // either the writer sees the record, or it is seen sleeping here
+    slot->seq.store(pos + 1);
+    if (sleeping.load()) {
+        // the writer may be checking the slot: notify once it waits
+        std::lock_guard<std::mutex> lk(lock);
+        cv.notify_one();
+    }
+}
+
+bool
+AsyncLogger::Impl::available() const
+{
+    // seq_cst for the handshake with push(), see run()
+    return slots[tail & mask].seq.load() == tail + 1;
+}
+
+size_t
+AsyncLogger::Impl::drain()
+{
+    size_t n = 0;
+    while (available()) {
+        auto& slot = slots[tail & mask];
+        try {
+            sink(slot.record);
+        } catch (const std::exception&) {}
+        slot.seq.store(tail + mask + 1, std::memory_order_release);
+        tail++;
+        n++;
+    }
+    written.store(tail, std::memory_order_release);
+    return n;
+}
+
+void
+AsyncLogger::Impl::reportDropped()
+{
+    auto d = dropped.load(std::memory_order_relaxed);
+    if (d == reported)
+        return;
+    LogRecord r;
+    r.level = LogLevel::warning;
+    r.time = std::chrono::steady_clock::now();
+    r.message = "[[" + std::to_string(d - reported) + " log records dropped]]";
+    reported = d;
+    try {
+        sink(r);
+    } catch (const std::exception&) {}
+}
+
+void
+AsyncLogger::Impl::run()
+{
+    for (;;) {
+        auto n = drain();
+        reportDropped();
+        std::unique_lock<std::mutex> lk(lock);
+        if (n)
+            cvFlushed.notify_all();
+        if (not running)
+            break;
+        if (n)
+            continue;
+        // producers only take the lock to notify once they see sleeping set
+        sleeping = true;
+        cv.wait(lk, [&]{ return not running or available(); });
+        sleeping = false;
+    }
+    drain();
+    reportDropped();
+    std::lock_guard<std::mutex> lk(lock);
+    cvFlushed.notify_all();
+}
+
+void
+AsyncLogger::Impl::flush()
+{
+    auto target = head.load();
+    std::unique_lock<std::mutex> lk(lock);
+    cv.notify_one();
+    cvFlushed.wait(lk, [&]{
+        return written.load(std::memory_order_acquire) >= target or not running;
+    });
+}
+
+void
+AsyncLogger::Impl::stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        running = false;
+    }
+    cv.notify_one();
+    if (writer.joinable())
+        writer.join();
+}
+
+AsyncLogger::AsyncLogger(LogSink sink, size_t capacity)
+    : impl_(std::make_shared<Impl>(std::move(sink), capacity))
+{
+    auto impl = impl_;
+    ERR = [impl](char const* m, va_list args) { impl->push(LogLevel::error, m, args); };
+    WARN = [impl](char const* m, va_list args) { impl->push(LogLevel::warning, m, args); };
+    DBG = [impl](char const* m, va_list args) { impl->push(LogLevel::debug, m, args); };
+    impl_->writer = std::thread([impl]{ impl->run(); });
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    impl_->stop();
+}
+
+void
+AsyncLogger::flush()
+{
+    impl_->flush();
+}
+
+uint64_t
+AsyncLogger::getDropped() const
+{
+    return impl_->dropped.load(std::memory_order_relaxed);
+}
+
 std::shared_ptr<Logger>
 getStdLogger() {
-    return std::make_shared<Logger>(
-        [](char const *m, va_list args) {
+    return std::make_shared<AsyncLogger>([](const LogRecord& r) {
+        switch (r.level) {
+        case LogLevel::error:
             std::cerr << red;
-            printLog(std::cerr, m, args);
+            printRecord(std::cerr, r);
             std::cerr << def;
-        },
-        [](char const *m, va_list args) {
+            break;
+        case LogLevel::warning:
             std::cout << yellow;
-            printLog(std::cout, m, args);
+            printRecord(std::cout, r);
             std::cout << def;
-        },
-        [](char const *m, va_list args) { printLog(std::cout, m, args); }
-    );
+            break;
+        default:
+            printRecord(std::cout, r);
+        }
+    });
 }
 
 std::shared_ptr<Logger>
@@ -78,11 +311,9 @@ getFileLogger(const std::string &path) {
     auto logfile = std::make_shared<std::ofstream>();
     logfile->open(path, std::ios::out);
 
-    return std::make_shared<Logger>(
-        [=](char const *m, va_list args) { printLog(*logfile, m, args); },
-        [=](char const *m, va_list args) { printLog(*logfile, m, args); },
-        [=](char const *m, va_list args) { printLog(*logfile, m, args); }
-    );
+    return std::make_shared<AsyncLogger>([logfile](const LogRecord& r) {
+        printRecord(*logfile, r);
+    });
 }
 
 std::shared_ptr<Logger>
@@ -103,11 +334,11 @@ getSyslogLogger(const char* name) {
         logfile = std::make_shared<Syslog>(name);
         opened_logfile = logfile;
     }
-    return std::make_shared<Logger>(
-        [logfile](char const *m, va_list args) { vsyslog(LOG_ERR, m, args); },
-        [logfile](char const *m, va_list args) { vsyslog(LOG_WARNING, m, args); },
-        [logfile](char const *m, va_list args) { vsyslog(LOG_INFO, m, args); }
-    );
+    return std::make_shared<AsyncLogger>([logfile](const LogRecord& r) {
+        auto priority = r.level == LogLevel::error ? LOG_ERR
+                     : (r.level == LogLevel::warning ? LOG_WARNING : LOG_INFO);
+        syslog(priority, "%s", r.message.c_str());
+    });
 #else
     return std::make_shared<Logger>();
 #endif
@@ -0,0 +1,161 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "net.h"
+
+#include <sstream>
+
+namespace dht {
+
+constexpr unsigned LatencyHistogram::BUCKETS;
+
+std::string
+LatencyStats::toString() const
+{
+    std::stringstream ss;
+    ss << count << " samples, mean " << mean << " ms, p50 " << p50 << " ms, p90 " << p90
+       << " ms, p99 " << p99 << " ms, max " << max << " ms";
+    return ss.str();
+}
+
+#ifdef OPENDHT_JSONCPP
+Json::Value
+LatencyStats::toJson() const
+{
+    Json::Value val;
+    val["count"] = static_cast<Json::LargestUInt>(count);
+    val["mean"] = mean;
+    val["p50"] = p50;
+    val["p90"] = p90;
+    val["p99"] = p99;
+    val["max"] = max;
+    return val;
+}
+
+LatencyStats::LatencyStats(const Json::Value& val)
+{
+    count = val["count"].asLargestUInt();
+    mean = val["mean"].asDouble();
+    p50 = val["p50"].asDouble();
+    p90 = val["p90"].asDouble();
+    p99 = val["p99"].asDouble();
+    max = val["max"].asDouble();
+}
+#endif
+
+LatencyStats
+LatencyHistogram::getStats() const
+{
+    std::array<uint64_t, BUCKETS> counts;
+    uint64_t total {0};
+    for (unsigned i = 0; i < BUCKETS; i++) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    LatencyStats stats;
+    if (total == 0)
+        return stats;
+    stats.count = total;
+    stats.mean = sum_.load(std::memory_order_relaxed) / (1000. * total);
+    stats.max = max_.load(std::memory_order_relaxed) / 1000.;
+
+    const std::array<std::pair<double, double*>, 3> quantiles {{
+        {.5, &stats.p50}, {.9, &stats.p90}, {.99, &stats.p99}
+    }};
+    uint64_t n {0};
+    unsigned q {0};
+    for (unsigned i = 0; i < BUCKETS and q < quantiles.size(); i++) {
+        n += counts[i];
+        while (q < quantiles.size() and n >= quantiles[q].first * total) {
+            *quantiles[q].second = std::min(bucketValue(i) / 1000., stats.max);
+            q++;
+        }
+    }
+    return stats;
+}
+
+std::vector<uint64_t>
+LatencyHistogram::getCumulativeCounts(const std::vector<double>& bounds) const
+{
+    std::vector<uint64_t> ret(bounds.size(), 0);
+    size_t b {0};
+    uint64_t n {0};
+    for (unsigned i = 0; i < BUCKETS and b < bounds.size(); i++) {
+        // buckets are counted in the first bound above their middle value
+        while (b < bounds.size() and bucketValue(i) / 1000. > bounds[b])
+            ret[b++] = n;
+        n += counts_[i].load(std::memory_order_relaxed);
+    }
+    while (b < bounds.size())
+        ret[b++] = n;
+    return ret;
+}
+
+namespace net {
+
+std::map<std::string, LatencyStats>
+NetworkMetrics::getStats() const
+{
+    std::map<std::string, LatencyStats> ret;
+    forEach([&](const char* name, const LatencyHistogram& h) {
+        if (h.count())
+            ret.emplace(name, h.getStats());
+    });
+    return ret;
+}
+
+void
+NetworkMetrics::forEach(const std::function<void(const char* name, const LatencyHistogram&)>& add) const
+{
+    add("rtt.ping", rtt_ping);
+    add("rtt.find", rtt_find);
+    add("rtt.get", rtt_get);
+    add("rtt.put", rtt_put);
+    add("rtt.listen", rtt_listen);
+    add("rtt.refresh", rtt_refresh);
+    add("rtt.update", rtt_update);
+    add("handle.ping", handle_ping);
+    add("handle.find", handle_find);
+    add("handle.get", handle_get);
+    add("handle.put", handle_put);
+    add("handle.listen", handle_listen);
+    add("handle.refresh", handle_refresh);
+    add("handle.update", handle_update);
+    add("rx.queue", rx_queue);
+}
+
+constexpr unsigned DropCounters::MESSAGE_TYPES;
+
+std::map<std::string, uint64_t>
+DropCounters::getStats() const
+{
+    static_assert(unsigned(MessageType::ValueMissing) + 1 == MESSAGE_TYPES, "message types changed");
+    static const std::array<const char*, MESSAGE_TYPES> names {{
+        "error", "reply", "ping", "find", "get", "put",
+        "refresh", "listen", "value.data", "value.update", "update", "value.missing"
+    }};
+    std::map<std::string, uint64_t> ret;
+    for (unsigned i = 0; i < MESSAGE_TYPES; i++)
+        if (auto c = counts_[i].load(std::memory_order_relaxed))
+            ret.emplace(names[i], c);
+    return ret;
+}
+
+}
+}
@@ -22,9 +22,13 @@
 #include "default_types.h"
 #include "log_enable.h"
 #include "parsed_message.h"
+#include "compression.h"
+#include "tracepoints.h"
 
 #include <msgpack.hpp>
 
+#include <set>
+
 namespace dht {
 namespace net {
 using namespace std::chrono_literals;
@@ -40,6 +44,10 @@ const std::string DhtProtocolException::STORAGE_NOT_FOUND {"Access operation for
 constexpr std::chrono::seconds NetworkEngine::UDP_REPLY_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_MAX_PACKET_TIME;
 constexpr std::chrono::seconds NetworkEngine::RX_TIMEOUT;
+constexpr std::chrono::seconds NetworkEngine::RX_PART_TIMEOUT;
+constexpr size_t NetworkEngine::MAX_ANNOUNCE_VALUES;
+constexpr size_t NetworkEngine::MAX_ANNOUNCE_SIZE;
+constexpr size_t NetworkEngine::MAX_REFRESH_VALUES;
 
 const std::string NetworkEngine::my_v {"RNG1"};
 
@@ -47,21 +55,95 @@ static constexpr uint8_t v4prefix[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xF
 
 constexpr unsigned SEND_NODES {8};
 
+/* Errors after which a node is considered unreachable */
+static bool
+isUnreachable(int err)
+{
+    return err == ENETUNREACH  ||
+           err == EHOSTUNREACH ||
+           err == EAFNOSUPPORT ||
+           err == EPIPE        ||
+           err == EPERM;
+}
+
+/* Capability bits advertised in the version field, above the protocol version */
+constexpr int CAPABILITY_COMPRESSION {1 << 8};
+constexpr int CAPABILITY_ANNOUNCE_VALUES {1 << 9};
+constexpr int CAPABILITY_REFRESH_VALUES {1 << 10};
+
+int
+localVersion()
+{
+    return 1 | CAPABILITY_ANNOUNCE_VALUES | CAPABILITY_REFRESH_VALUES
+             | (compressionSupported() ? CAPABILITY_COMPRESSION : 0);
+}
+
+bool
+canCompress(int version)
+{
+    return compressionSupported() and (version & CAPABILITY_COMPRESSION);
+}
+
 
 struct NetworkEngine::PartialMessage {
     SockAddr from;
     time_point start;
     time_point last_part;
+    size_t size {0};
+    unsigned missing_requests {0};
     std::unique_ptr<ParsedMessage> msg;
 };
 
+struct NetworkEngine::SentParts {
+    time_point sent;
+    size_t size {0};
+    unsigned resent {0};
+    std::vector<Blob> values;
+};
+
+LatencyHistogram*
+rttHistogram(NetworkMetrics& m, MessageType type)
+{
+    switch (type) {
+    case MessageType::Ping:          return &m.rtt_ping;
+    case MessageType::FindNode:      return &m.rtt_find;
+    case MessageType::GetValues:     return &m.rtt_get;
+    case MessageType::AnnounceValue: return &m.rtt_put;
+    case MessageType::Listen:        return &m.rtt_listen;
+    case MessageType::Refresh:       return &m.rtt_refresh;
+    case MessageType::UpdateValue:   return &m.rtt_update;
+    default:                         return nullptr;
+    }
+}
+
+LatencyHistogram*
+handlerHistogram(NetworkMetrics& m, MessageType type)
+{
+    switch (type) {
+    case MessageType::Ping:          return &m.handle_ping;
+    case MessageType::FindNode:      return &m.handle_find;
+    case MessageType::GetValues:     return &m.handle_get;
+    case MessageType::AnnounceValue: return &m.handle_put;
+    case MessageType::Listen:        return &m.handle_listen;
+    case MessageType::Refresh:       return &m.handle_refresh;
+    case MessageType::UpdateValue:   return &m.handle_update;
+    default:                         return nullptr;
+    }
+}
+
 std::vector<Blob>
-serializeValues(const std::vector<Sp<Value>>& st)
+serializeValues(const std::vector<Sp<Value>>& st, bool compress)
 {
     std::vector<Blob> svals;
     svals.reserve(st.size());
-    for (const auto& v : st)
+    for (const auto& v : st) {
         svals.emplace_back(packMsg(v));
+        if (compress) {
+            auto c = compressValue(svals.back());
+            if (not c.empty())
+                svals.back() = std::move(c);
+        }
+    }
     return svals;
 }
 
@@ -83,7 +165,7 @@ RequestAnswer::RequestAnswer(ParsedMessage&& msg)
 {}
 
 NetworkEngine::NetworkEngine(const Sp<Logger>& log, std::mt19937_64& rand, Scheduler& scheduler, std::unique_ptr<DatagramSocket>&& sock)
-    : myid(zeroes), dht_socket(std::move(sock)), logger_(log), rd(rand), cache(rd), rate_limiter((size_t)-1), scheduler(scheduler)
+    : myid(zeroes), dht_socket(std::move(sock)), logger_(log), rd(rand), cache(rd), address_rate_limiter(0, SockAddr::ipHash{rd()}), overflow_rate_limiter((size_t)-1), rate_limiter((size_t)-1), scheduler(scheduler)
 {}
 
 NetworkEngine::NetworkEngine(InfoHash& myid, NetworkConfig c,
@@ -111,6 +193,8 @@ NetworkEngine::NetworkEngine(InfoHash& myid, NetworkConfig c,
     onRefresh(std::move(onRefresh)),
     myid(myid), config(c), dht_socket(std::move(sock)), logger_(log), rd(rand),
     cache(rd),
+    address_rate_limiter(0, SockAddr::ipHash{rd()}),
+    overflow_rate_limiter(config.max_peer_req_per_sec),
     rate_limiter(config.max_req_per_sec),
     scheduler(scheduler)
 {}
@@ -130,7 +214,7 @@ NetworkEngine::tellListener(Sp<Node> node, Tid socket_id, const InfoHash& hash,
         if (version >= 1) {
             sendUpdateValues(node, hash, values, scheduler.time(), ntoken, socket_id);
         } else {
-            sendNodesValues(node->getAddr(), socket_id, nnodes.first, nnodes.second, values, query, ntoken);
+            sendNodesValues(node->getAddr(), socket_id, nnodes.first, nnodes.second, values, query, ntoken, canCompress(node->getVersion()));
         }
     } catch (const std::overflow_error& e) {
         if (logger_)
@@ -259,11 +343,14 @@ NetworkEngine::isRunning(sa_family_t af) const
 void
 NetworkEngine::clear()
 {
-    for (auto& request : requests) {
+    auto reqs = std::move(requests);
+    for (auto& request : reqs) {
         request.second->cancel();
         request.second->node->setExpired();
     }
-    requests.clear();
+    packed_values.clear();
+    packed_values_lru.clear();
+    packed_values_size = 0;
 }
 
 void
@@ -272,6 +359,28 @@ NetworkEngine::connectivityChanged(sa_family_t af)
     cache.clearBadNodes(af);
 }
 
+void
+NetworkEngine::onSendErrors(const std::vector<DatagramSocket::SendError>& errors)
+{
+    std::set<SockAddr> unreachable;
+    for (const auto& e : errors)
+        if (isUnreachable(e.second))
+            unreachable.emplace(e.first);
+    if (unreachable.empty())
+        return;
+    // a single pass over the requests, whatever the number of errors.
+    // Node expiration may complete requests and change the table.
+    std::vector<Sp<Request>> failed;
+    for (const auto& r : requests)
+        if (r.second->pending() and unreachable.count(r.second->node->getAddr()))
+            failed.emplace_back(r.second);
+    for (const auto& req : failed) {
+        req->node->setExpired();
+        if (not req->node->id)
+            requests.erase(req->tid);
+    }
+}
+
 void
 NetworkEngine::requestStep(Sp<Request> sreq)
 {
@@ -284,6 +393,7 @@ NetworkEngine::requestStep(Sp<Request> sreq)
     if (req.isExpired(now)) {
         // if (logger_)
         //     logger_->d(node.id, "[node %s] expired !", node.toString().c_str());
+        DHT_TRACE(request__expire, node.id.data(), req.tid, (int)req.getType());
         node.setExpired();
         if (not node.id)
             requests.erase(req.tid);
@@ -291,14 +401,12 @@ NetworkEngine::requestStep(Sp<Request> sreq)
     } else if (req.attempt_count == 1) {
         req.on_expired(req, false);
     }
+    if (req.attempt_count)
+        node.timedOut();
 
+    DHT_TRACE(request__send, node.id.data(), req.tid, (int)req.getType(), req.msg.size(), req.attempt_count);
     auto err = send(node.getAddr(), (char*)req.msg.data(), req.msg.size(), node.getReplyTime() < now - UDP_REPLY_TIME);
-    if (err == ENETUNREACH  ||
-        err == EHOSTUNREACH ||
-        err == EAFNOSUPPORT ||
-        err == EPIPE        ||
-        err == EPERM)
-    {
+    if (isUnreachable(err)) {
         node.setExpired();
         if (not node.id)
             requests.erase(req.tid);
@@ -307,7 +415,7 @@ NetworkEngine::requestStep(Sp<Request> sreq)
         if (err != EAGAIN) {
             ++req.attempt_count;
             req.attempt_duration +=
-                req.attempt_duration + uniform_duration_distribution<>(0ms, ((duration)Node::MAX_RESPONSE_TIME)/4)(rd);
+                req.attempt_duration + uniform_duration_distribution<>(0ms, req.attempt_duration/4)(rd);
             if (not req.parts.empty()){
                 sendValueParts(req.tid, req.parts, node.getAddr());
             }
@@ -331,6 +439,7 @@ NetworkEngine::sendRequest(const Sp<Request>& request)
     if (not node.id)
         requests.emplace(request->tid, request);
     request->start = scheduler.time();
+    request->attempt_duration = node.getRetransmitTimeout();
     node.requested(request);
     requestStep(request);
 }
@@ -346,7 +455,7 @@ NetworkEngine::rateLimit(const SockAddr& addr)
     if (limiter_maintenance++ == config.max_peer_req_per_sec) {
         for (auto it = address_rate_limiter.begin(); it != address_rate_limiter.end();) {
             if (it->second.maintain(now) == 0)
-                address_rate_limiter.erase(it++);
+                it = address_rate_limiter.erase(it);
             else
                 ++it;
         }
@@ -354,11 +463,20 @@ NetworkEngine::rateLimit(const SockAddr& addr)
     }
 
     // invoke per IP, then global rate limiter
-    return (config.max_peer_req_per_sec < 0
-            or address_rate_limiter
-                .emplace(addr, config.max_peer_req_per_sec).first->second
-                .limit(now))
-            and rate_limiter.limit(now);
+    if (config.max_peer_req_per_sec >= 0) {
+        auto it = address_rate_limiter.find(addr);
+        if (it == address_rate_limiter.end()) {
+            // when full, new addresses share a single per IP quota
+            // until idle entries are evicted by the next maintenance
+            if (address_rate_limiter.size() < IP_LIMITER_MAX_SIZE)
+                it = address_rate_limiter.emplace(addr, config.max_peer_req_per_sec).first;
+            else if (not overflow_rate_limiter.limit(now))
+                return false;
+        }
+        if (it != address_rate_limiter.end() and not it->second.limit(now))
+            return false;
+    }
+    return rate_limiter.limit(now);
 }
 
 bool
@@ -403,39 +521,77 @@ NetworkEngine::isNodeBlacklisted(const SockAddr& addr) const
     return blacklist.find(addr) != blacklist.end();
 }
 
-void
-NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
+ParsedMessagePtr
+NetworkEngine::parseMessage(const uint8_t *buf, size_t buflen, SockAddr addr, NetId network, const Sp<Logger>& logger)
 {
-    auto from = f.getMappedIPv4();
+    ParsedMessagePtr msg {nullptr, [](ParsedMessage* m) { delete m; }};
+    auto from = addr.getMappedIPv4();
     if (isMartian(from)) {
-        if (logger_)
-            logger_->w("Received packet from martian node %s", from.toString().c_str());
-        return;
+        if (logger)
+            logger->w("Received packet from martian node %s", from.toString().c_str());
+        return msg;
     }
 
-    if (isNodeBlacklisted(from)) {
-        if (logger_)
-            logger_->w("Received packet from blacklisted node %s", from.toString().c_str());
-        return;
-    }
-
-    std::unique_ptr<ParsedMessage> msg {new ParsedMessage};
+    msg.reset(new ParsedMessage);
     try {
-        msgpack::unpacked msg_res = msgpack::unpack((const char*)buf, buflen);
+        msgpack::unpacked msg_res = msgpack::unpack((const char*)buf, buflen, unpackReference);
         msg->msgpack_unpack(msg_res.get());
     } catch (const std::exception& e) {
-        if (logger_)
-            logger_->w("Can't parse message of size %lu: %s", buflen, e.what());
-        // if (logger_)
-        //     logger_->DBG.logPrintable(buf, buflen);
-        return;
+        if (logger)
+            logger->w("Can't parse message of size %lu: %s", buflen, e.what());
+        msg.reset();
+        return msg;
+    }
+
+    if (msg->network != network) {
+        if (logger)
+            logger->d("Received message from other config.network %u", msg->network);
+        msg.reset();
+    }
+    return msg;
+}
+
+unsigned
+NetworkEngine::getMessageType(const ParsedMessage& msg)
+{
+    return unsigned(msg.type);
+}
+
+bool
+NetworkEngine::isRequest(const ParsedMessage& msg)
+{
+    switch (msg.type) {
+    case MessageType::Ping:
+    case MessageType::FindNode:
+    case MessageType::GetValues:
+    case MessageType::AnnounceValue:
+    case MessageType::Refresh:
+    case MessageType::Listen:
+        return true;
+    default:
+        return false;
     }
+}
 
-    if (msg->network != config.network) {
+void
+NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr from)
+{
+    if (auto msg = parseMessage(buf, buflen, from, config.network, logger_))
+        processMessage(std::move(msg), std::move(from));
+}
+
+void
+NetworkEngine::processMessage(ParsedMessagePtr&& m, SockAddr f)
+{
+    DHT_TRACE(message__entry, m->id.data(), m->tid, (int)m->type);
+    DHT_TRACE_RETURN(message__return, m->tid, (int)m->type);
+    auto from = f.getMappedIPv4();
+    if (isNodeBlacklisted(from)) {
         if (logger_)
-            logger_->d("Received message from other config.network %u", msg->network);
+            logger_->w("Received packet from blacklisted node %s", from.toString().c_str());
         return;
     }
+    std::unique_ptr<ParsedMessage> msg {m.release()};
 
     const auto& now = scheduler.time();
 
@@ -461,14 +617,22 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
             // check data completion
             if (pmsg_it->second.msg->complete()) {
                 // process the full message
-                process(std::move(pmsg_it->second.msg), from);
+                auto pmsg = std::move(pmsg_it->second.msg);
+                partial_size -= pmsg_it->second.size;
                 partial_messages.erase(pmsg_it);
-            } else
-                scheduler.add(now + RX_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, msg->tid));
+                process(std::move(pmsg), from);
+            }
         }
         return;
     }
 
+    // request to resend value parts
+    if (msg->type == MessageType::ValueMissing) {
+        if (rateLimit(from))
+            resendValueParts(*msg, from);
+        return;
+    }
+
     if (msg->id == myid or not msg->id) {
         if (logger_)
             logger_->d("Received message from self");
@@ -489,14 +653,23 @@ NetworkEngine::processMessage(const uint8_t *buf, size_t buflen, SockAddr f)
     } else {
         // starting partial message session
         auto k = msg->tid;
+        auto size = msg->partsSize();
+        if (partial_size + size > RX_PARTIAL_MAX_SIZE) {
+            if (logger_)
+                logger_->w("Dropping partial message from %s: reassembly buffer full", from.toString().c_str());
+            return;
+        }
         auto& pmsg = partial_messages[k];
         if (not pmsg.msg) {
             pmsg.from = from;
+            msg->own();
+            msg->allocateParts();
             pmsg.msg = std::move(msg);
             pmsg.start = now;
             pmsg.last_part = now;
-            scheduler.add(now + RX_MAX_PACKET_TIME, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
-            scheduler.add(now + RX_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
+            pmsg.size = size;
+            partial_size += size;
+            scheduler.add(now + RX_PART_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, k));
         } else
             if (logger_)
                 logger_->e("Partial message with given TID already exists");
@@ -508,6 +681,8 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
 {
     const auto& now = scheduler.time();
     auto node = cache.getNode(msg->id, from, now, true, msg->is_client);
+    if (msg->version)
+        node->setVersion(msg->version);
 
     if (msg->type == MessageType::ValueUpdate) {
         auto rsocket = node->getSocket(msg->tid);
@@ -579,6 +754,13 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                     r.node->authSuccess();
                 }
                 r.reply_time = scheduler.time();
+                DHT_TRACE(request__reply, r.node->id.data(), r.tid, (int)r.getType(),
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(r.reply_time - r.last_try).count());
+                if (auto h = rttHistogram(*metrics, r.getType()))
+                    h->record(r.reply_time - r.last_try);
+                // Karn's algorithm: ambiguous samples from retransmitted requests are ignored
+                if (r.attempt_count == 1)
+                    r.node->updateRtt(r.reply_time - r.last_try);
 
                 deserializeNodes(*msg, from);
                 r.setDone(std::move(*msg));
@@ -595,6 +777,7 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
         node->received(now, {});
         if (not node->isClient())
             onNewNode(node, 1);
+        auto handle_start = clock::now();
         try {
             switch (msg->type) {
             case MessageType::Ping:
@@ -620,7 +803,7 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 ++in_stats.get;
                 RequestAnswer answer = onGetValues(node, msg->info_hash, msg->want, msg->query);
                 auto nnodes = bufferNodes(from.getFamily(), msg->info_hash, msg->want, answer.nodes4, answer.nodes6);
-                sendNodesValues(from, msg->tid, nnodes.first, nnodes.second, answer.values, msg->query, answer.ntoken);
+                sendNodesValues(from, msg->tid, nnodes.first, nnodes.second, answer.values, msg->query, answer.ntoken, canCompress(msg->version));
                 break;
             }
             case MessageType::AnnounceValue: {
@@ -632,15 +815,36 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
                 /* Note that if storageStore failed, we lie to the requestor.
                    This is to prevent them from backtracking, and hence
                    polluting the DHT. */
-                for (auto& v : msg->values) {
-                   sendValueAnnounced(from, msg->tid, v->id);
+                if (msg->values.size() > 1 and canAnnounceValues(msg->version)) {
+                    /* a single reply acknowledges the whole request */
+                    sendValueAnnounced(from, msg->tid, msg->values.front()->id);
+                } else {
+                    for (auto& v : msg->values) {
+                       sendValueAnnounced(from, msg->tid, v->id);
+                    }
                 }
                 break;
             }
             case MessageType::Refresh:
                 if (logIncoming_ and logger_)
                     logger_->d(msg->info_hash, node->id, "[node %s] got 'refresh' request for %s", node->toString().c_str(), msg->info_hash.toString().c_str());
-                onRefresh(node, msg->info_hash, msg->token, msg->value_id);
+                if (msg->value_ids.empty()) {
+                    onRefresh(node, msg->info_hash, msg->token, msg->value_id);
+                } else {
+                    /* refresh every known value, then report missing ones */
+                    bool not_found = false;
+                    for (const auto& vid : msg->value_ids) {
+                        try {
+                            onRefresh(node, msg->info_hash, msg->token, vid);
+                        } catch (const DhtProtocolException& e) {
+                            if (e.getCode() != DhtProtocolException::NOT_FOUND)
+                                throw;
+                            not_found = true;
+                        }
+                    }
+                    if (not_found)
+                        throw DhtProtocolException {DhtProtocolException::NOT_FOUND, DhtProtocolException::STORAGE_NOT_FOUND};
+                }
                 /* Same note as above in MessageType::AnnounceValue applies. */
                 sendValueAnnounced(from, msg->tid, msg->value_id);
                 break;
@@ -673,6 +877,8 @@ NetworkEngine::process(std::unique_ptr<ParsedMessage>&& msg, const SockAddr& fro
         } catch (const DhtProtocolException& e) {
             sendError(from, msg->tid, e.getCode(), e.getMsg().c_str(), true);
         }
+        if (auto h = handlerHistogram(*metrics, msg->type))
+            h->record(clock::now() - handle_start);
     }
 }
 
@@ -808,8 +1014,9 @@ NetworkEngine::sendGetValues(Sp<Node> n, const InfoHash& info_hash, const Query&
     unsigned sendQuery = (not query.where.empty() or not query.select.empty()) ? 1 : 0;
     unsigned sendWant = (want > 0) ? 1 : 0;
 
-    pk.pack(KEY_A);  pk.pack_map(2 + sendQuery + sendWant);
+    pk.pack(KEY_A);  pk.pack_map(3 + sendQuery + sendWant);
       pk.pack(KEY_REQ_ID); pk.pack(myid);
+      pk.pack(KEY_VERSION); pk.pack(localVersion());
       pk.pack(KEY_REQ_H);  pk.pack(info_hash);
       if (sendQuery) {
         pk.pack(KEY_Q); pk.pack(query);
@@ -908,9 +1115,15 @@ NetworkEngine::deserializeNodes(ParsedMessage& msg, const SockAddr& from) {
 }
 
 std::vector<Blob>
-NetworkEngine::packValueHeader(msgpack::sbuffer& buffer, const std::vector<Sp<Value>>& st)
+NetworkEngine::packValueHeader(msgpack::sbuffer& buffer, const std::vector<Sp<Value>>& st, bool compress, bool cached)
 {
-    auto svals = serializeValues(st);
+    std::vector<Blob> svals;
+    if (cached) {
+        svals.reserve(st.size());
+        for (const auto& v : st)
+            svals.emplace_back(packValue(v, compress));
+    } else
+        svals = serializeValues(st, compress);
     size_t total_size = 0;
     for (const auto& v : svals)
         total_size += v.size();
@@ -932,46 +1145,190 @@ NetworkEngine::packValueHeader(msgpack::sbuffer& buffer, const std::vector<Sp<Va
     return svals;
 }
 
+Blob
+NetworkEngine::packValue(const Sp<Value>& v, bool compress)
+{
+    if (v->id == Value::INVALID_ID)
+        return serializeValues({v}, compress).front();
+
+    auto it = packed_values.find(v->id);
+    if (it != packed_values.end() and it->second.value.lock() != v) {
+        // other value with the same id
+        erasePackedValue(it);
+        it = packed_values.end();
+    }
+    if (it == packed_values.end()) {
+        packed_values_lru.emplace_front(v->id);
+        it = packed_values.emplace(v->id, PackedValue {v, packMsg(v), {}, false, packed_values_lru.begin()}).first;
+        packed_values_size += it->second.packed.size();
+    } else {
+        packed_values_lru.splice(packed_values_lru.begin(), packed_values_lru, it->second.lru);
+    }
+
+    auto& p = it->second;
+    if (compress and not p.compressed_done) {
+        p.compressed = compressValue(p.packed);
+        p.compressed_done = true;
+        packed_values_size += p.compressed.size();
+    }
+    Blob ret = (compress and not p.compressed.empty()) ? p.compressed : p.packed;
+
+    while (packed_values_size > PACKED_VALUES_MAX_SIZE and not packed_values_lru.empty())
+        erasePackedValue(packed_values.find(packed_values_lru.back()));
+    return ret;
+}
+
 void
-NetworkEngine::sendValueParts(Tid tid, const std::vector<Blob>& svals, const SockAddr& addr)
+NetworkEngine::erasePackedValue(std::unordered_map<Value::Id, PackedValue>::iterator it)
+{
+    packed_values_size -= it->second.packed.size() + it->second.compressed.size();
+    packed_values_lru.erase(it->second.lru);
+    packed_values.erase(it);
+}
+
+void
+NetworkEngine::invalidatePackedValue(Value::Id id)
 {
+    auto it = packed_values.find(id);
+    if (it != packed_values.end())
+        erasePackedValue(it);
+}
+
+void
+NetworkEngine::sendValuePart(Tid tid, unsigned index, const Blob& v, size_t start, const SockAddr& addr)
+{
+    auto end = std::min(start + MTU, v.size());
+    // {y:"p", t, p:{index:{o:offset, d:data}}}
     msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_map(3+(config.network?1:0));
+    if (config.network) {
+        pk.pack(KEY_NETID); pk.pack(config.network);
+    }
+    pk.pack(KEY_Y); pk.pack(KEY_V);
+    pk.pack(KEY_TID); pk.pack(tid);
+    pk.pack(KEY_V); pk.pack_map(1);
+        pk.pack(index); pk.pack_map(2);
+            pk.pack(std::string("o")); pk.pack(start);
+            pk.pack(std::string("d")); pk.pack_bin(end-start);
+                                       pk.pack_bin_body((const char*)v.data()+start, end-start);
+    send(addr, buffer.data(), buffer.size());
+}
+
+void
+NetworkEngine::sendValueParts(Tid tid, const std::vector<Blob>& svals, const SockAddr& addr)
+{
+    size_t total_size {0};
     unsigned i=0;
     for (const auto& v: svals) {
-        size_t start {0}, end;
+        size_t start {0};
         do {
-            end = std::min(start + MTU, v.size());
-            buffer.clear();
-            msgpack::packer<msgpack::sbuffer> pk(&buffer);
-            pk.pack_map(3+(config.network?1:0));
-            if (config.network) {
-                pk.pack(KEY_NETID); pk.pack(config.network);
-            }
-            pk.pack(KEY_Y); pk.pack(KEY_V);
-            pk.pack(KEY_TID); pk.pack(tid);
-            pk.pack(KEY_V); pk.pack_map(1);
-                pk.pack(i); pk.pack_map(2);
-                    pk.pack(std::string("o")); pk.pack(start);
-                    pk.pack(std::string("d")); pk.pack_bin(end-start);
-                                               pk.pack_bin_body((const char*)v.data()+start, end-start);
-            send(addr, buffer.data(), buffer.size());
-            start = end;
+            sendValuePart(tid, i, v, start, addr);
+            start = std::min(start + MTU, v.size());
         } while (start != v.size());
+        total_size += v.size();
         i++;
     }
+
+    // keep sent values for a while to answer missing part requests
+    if (sent_parts_size + total_size > TX_PARTS_MAX_SIZE)
+        return;
+    auto key = std::make_pair(tid, addr);
+    auto& sent = sent_parts[key];
+    if (not sent.values.empty())
+        sent_parts_size -= sent.size;
+    sent.sent = scheduler.time();
+    sent.size = total_size;
+    sent.resent = 0;
+    sent.values = svals;
+    sent_parts_size += total_size;
+    scheduler.add(sent.sent + RX_MAX_PACKET_TIME, std::bind(&NetworkEngine::maintainSentParts, this, tid, addr));
+}
+
+void
+NetworkEngine::sendMissingParts(Tid tid, const ParsedMessage& msg, const SockAddr& addr)
+{
+    /* Keep the request small enough to fit in a single packet */
+    static constexpr size_t MAX_MISSING_RANGES {128};
+    // {y:"p", t, m:{index:[begin, end, ...]}}, with the missing byte ranges
+    std::map<unsigned, std::vector<unsigned>> missing;
+    size_t n {0};
+    for (const auto& p : msg.value_parts) {
+        if (p.second.complete())
+            continue;
+        auto ranges = p.second.missingRanges();
+        if (n + ranges.size() / 2 > MAX_MISSING_RANGES)
+            ranges.resize(2 * (MAX_MISSING_RANGES - n));
+        n += ranges.size() / 2;
+        missing.emplace(p.first, std::move(ranges));
+        if (n == MAX_MISSING_RANGES)
+            break;
+    }
+    if (missing.empty())
+        return;
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_map(3+(config.network?1:0));
+    if (config.network) {
+        pk.pack(KEY_NETID); pk.pack(config.network);
+    }
+    pk.pack(KEY_Y); pk.pack(KEY_V);
+    pk.pack(KEY_TID); pk.pack(tid);
+    pk.pack(KEY_MISSING); pk.pack(missing);
+    send(addr, buffer.data(), buffer.size());
+}
+
+void
+NetworkEngine::resendValueParts(const ParsedMessage& msg, const SockAddr& from)
+{
+    auto sent = sent_parts.find(std::make_pair(msg.tid, from));
+    if (sent == sent_parts.end() or sent->second.resent >= RX_MAX_MISSING_REQUESTS)
+        return;
+    sent->second.resent++;
+    const auto& values = sent->second.values;
+    // our parts overlapping the missing ranges, each one once: repeated or
+    // overlapping ranges don't make us send more than the values
+    std::map<size_t, std::set<size_t>> parts;
+    for (const auto& m : msg.value_missing) {
+        if (m.first >= values.size())
+            continue;
+        const auto& v = values[m.first];
+        auto& starts = parts[m.first];
+        auto n = std::min(m.second.size() / 2, RX_MAX_MISSING_RANGES);
+        for (size_t i = 0; i + 1 < 2 * n; i += 2) {
+            auto end = std::min<size_t>(m.second[i + 1], v.size());
+            for (size_t start = m.second[i] - m.second[i] % MTU; start < end; start += MTU)
+                starts.emplace(start);
+        }
+    }
+    for (const auto& p : parts)
+        for (auto start : p.second)
+            sendValuePart(msg.tid, p.first, values[p.first], start, from);
+}
+
+void
+NetworkEngine::maintainSentParts(Tid tid, const SockAddr& addr)
+{
+    auto sent = sent_parts.find(std::make_pair(tid, addr));
+    if (sent != sent_parts.end() and sent->second.sent + RX_MAX_PACKET_TIME <= scheduler.time()) {
+        sent_parts_size -= sent->second.size;
+        sent_parts.erase(sent);
+    }
 }
 
 void
 NetworkEngine::sendNodesValues(const SockAddr& addr, Tid tid, const Blob& nodes, const Blob& nodes6,
-        const std::vector<Sp<Value>>& st, const Query& query, const Blob& token)
+        const std::vector<Sp<Value>>& st, const Query& query, const Blob& token, bool compress)
 {
     msgpack::sbuffer buffer;
     msgpack::packer<msgpack::sbuffer> pk(&buffer);
     pk.pack_map(4+(config.network?1:0));
 
     pk.pack(KEY_R);
-    pk.pack_map(2 + (not st.empty()?1:0) + (nodes.size()>0?1:0) + (nodes6.size()>0?1:0) + (not token.empty()?1:0));
+    pk.pack_map(3 + (not st.empty()?1:0) + (nodes.size()>0?1:0) + (nodes6.size()>0?1:0) + (not token.empty()?1:0));
     pk.pack(KEY_REQ_ID); pk.pack(myid);
+    pk.pack(KEY_VERSION); pk.pack(localVersion());
     insertAddr(pk, addr);
     if (nodes.size() > 0) {
         pk.pack(KEY_REQ_NODES4);
@@ -989,7 +1346,7 @@ NetworkEngine::sendNodesValues(const SockAddr& addr, Tid tid, const Blob& nodes,
     std::vector<Blob> svals {};
     if (not st.empty()) { /* pack complete values */
         if (query.select.empty()) {
-            svals = packValueHeader(buffer, st);
+            svals = packValueHeader(buffer, st, compress, true);
         } else { /* pack fields */
             auto fields = query.select.getSelection();
             pk.pack(KEY_REQ_FIELDS);
@@ -1085,7 +1442,7 @@ NetworkEngine::sendListen(Sp<Node> n,
     auto has_query = not query.where.empty() or not query.select.empty();
     pk.pack(KEY_A); pk.pack_map(5 + has_query);
       pk.pack(KEY_REQ_ID);    pk.pack(myid);
-      pk.pack(KEY_VERSION);   pk.pack(1);
+      pk.pack(KEY_VERSION);   pk.pack(localVersion());
       pk.pack(KEY_REQ_H);     pk.pack(hash);
       pk.pack(KEY_REQ_TOKEN); packToken(pk, token);
       pk.pack(KEY_REQ_SID);   pk.pack(socketId);
@@ -1137,6 +1494,12 @@ NetworkEngine::sendListenConfirmation(const SockAddr& addr, Tid tid) {
     send(addr, buffer.data(), buffer.size());
 }
 
+bool
+NetworkEngine::canAnnounceValues(int version)
+{
+    return version & CAPABILITY_ANNOUNCE_VALUES;
+}
+
 Sp<Request>
 NetworkEngine::sendAnnounceValue(Sp<Node> n,
         const InfoHash& infohash,
@@ -1145,16 +1508,29 @@ NetworkEngine::sendAnnounceValue(Sp<Node> n,
         const Blob& token,
         RequestCb&& on_done,
         RequestExpiredCb&& on_expired)
+{
+    return sendAnnounceValues(n, infohash, {value}, created, token, std::move(on_done), std::move(on_expired));
+}
+
+Sp<Request>
+NetworkEngine::sendAnnounceValues(Sp<Node> n,
+        const InfoHash& infohash,
+        const std::vector<Sp<Value>>& values,
+        time_point created,
+        const Blob& token,
+        RequestCb&& on_done,
+        RequestExpiredCb&& on_expired)
 {
     Tid tid (n->getNewTid());
     msgpack::sbuffer buffer;
     msgpack::packer<msgpack::sbuffer> pk(&buffer);
     pk.pack_map(5+(config.network?1:0));
 
-    pk.pack(KEY_A); pk.pack_map((created < scheduler.time() ? 5 : 4));
+    pk.pack(KEY_A); pk.pack_map((created < scheduler.time() ? 6 : 5));
       pk.pack(KEY_REQ_ID);     pk.pack(myid);
+      pk.pack(KEY_VERSION);    pk.pack(localVersion());
       pk.pack(KEY_REQ_H);      pk.pack(infohash);
-      auto v = packValueHeader(buffer, {value});
+      auto v = packValueHeader(buffer, values, canCompress(n->getVersion()));
       if (created < scheduler.time()) {
           pk.pack(KEY_REQ_CREATION);
           pk.pack(to_time_t(created));
@@ -1171,14 +1547,15 @@ NetworkEngine::sendAnnounceValue(Sp<Node> n,
 
     auto req = std::make_shared<Request>(MessageType::AnnounceValue, tid, n,
         Blob(buffer.data(), buffer.data() + buffer.size()),
-        [=](const Request& req_status, ParsedMessage&& msg) { /* on done */
+        [=,batch=values.size() > 1](const Request& req_status, ParsedMessage&& msg) { /* on done */
             if (msg.value_id == Value::INVALID_ID) {
                 if (logger_)
                     logger_->d(infohash, "Unknown search or announce!");
             } else {
                 if (on_done) {
                     RequestAnswer answer {};
-                    answer.vid = msg.value_id;
+                    /* no single value id for a batch: all of its values are acknowledged */
+                    answer.vid = batch ? Value::INVALID_ID : msg.value_id;
                     on_done(req_status, std::move(answer));
                 }
             }
@@ -1212,10 +1589,10 @@ NetworkEngine::sendUpdateValues(Sp<Node> n,
 
     pk.pack(KEY_A); pk.pack_map((created < scheduler.time() ? 7 : 6));
       pk.pack(KEY_REQ_ID);     pk.pack(myid);
-      pk.pack(KEY_VERSION);    pk.pack(1);
+      pk.pack(KEY_VERSION);    pk.pack(localVersion());
       pk.pack(KEY_REQ_H);      pk.pack(infohash);
       pk.pack(KEY_REQ_SID);   pk.pack(sid);
-      auto v = packValueHeader(buffer, values);
+      auto v = packValueHeader(buffer, values, canCompress(n->getVersion()));
       if (created < scheduler.time()) {
           pk.pack(KEY_REQ_CREATION);
           pk.pack(to_time_t(created));
@@ -1241,6 +1618,12 @@ NetworkEngine::sendUpdateValues(Sp<Node> n,
     return req;
 }
 
+bool
+NetworkEngine::canRefreshValues(int version)
+{
+    return version & CAPABILITY_REFRESH_VALUES;
+}
+
 Sp<Request>
 NetworkEngine::sendRefreshValue(Sp<Node> n,
                 const InfoHash& infohash,
@@ -1249,16 +1632,32 @@ NetworkEngine::sendRefreshValue(Sp<Node> n,
                 RequestCb&& on_done,
                 RequestErrorCb&& on_error,
                 RequestExpiredCb&& on_expired)
+{
+    return sendRefreshValues(n, infohash, {vid}, token, std::move(on_done), std::move(on_error), std::move(on_expired));
+}
+
+Sp<Request>
+NetworkEngine::sendRefreshValues(Sp<Node> n,
+                const InfoHash& infohash,
+                const std::vector<Value::Id>& vids,
+                const Blob& token,
+                RequestCb&& on_done,
+                RequestErrorCb&& on_error,
+                RequestExpiredCb&& on_expired)
 {
     Tid tid (n->getNewTid());
     msgpack::sbuffer buffer;
     msgpack::packer<msgpack::sbuffer> pk(&buffer);
     pk.pack_map(5+(config.network?1:0));
 
-    pk.pack(KEY_A); pk.pack_map(4);
+    const bool batch = vids.size() > 1;
+    pk.pack(KEY_A); pk.pack_map(4 + (batch?1:0));
       pk.pack(KEY_REQ_ID);       pk.pack(myid);
       pk.pack(KEY_REQ_H);        pk.pack(infohash);
-      pk.pack(KEY_REQ_VALUE_ID); pk.pack(vid);
+      pk.pack(KEY_REQ_VALUE_ID); pk.pack(vids.front());
+      if (batch) {
+          pk.pack(KEY_REQ_VALUE_IDS); pk.pack(vids);
+      }
       pk.pack(KEY_REQ_TOKEN);    pk.pack(token);
 
     pk.pack(KEY_Q); pk.pack(QUERY_REFRESH);
@@ -1278,7 +1677,7 @@ NetworkEngine::sendRefreshValue(Sp<Node> n,
             } else {
                 if (on_done) {
                     RequestAnswer answer {};
-                    answer.vid = msg.value_id;
+                    answer.vid = batch ? Value::INVALID_ID : msg.value_id;
                     on_done(req_status, std::move(answer));
                 }
             }
@@ -1352,12 +1751,24 @@ NetworkEngine::maintainRxBuffer(Tid tid)
     auto msg = partial_messages.find(tid);
     if (msg != partial_messages.end()) {
         const auto& now = scheduler.time();
-        if (msg->second.start + RX_MAX_PACKET_TIME < now
-         || msg->second.last_part + RX_TIMEOUT < now) {
+        auto& pmsg = msg->second;
+        if (pmsg.start + RX_MAX_PACKET_TIME < now
+         || pmsg.last_part + RX_TIMEOUT < now) {
             if (logger_)
-                logger_->w("Dropping expired partial message from %s", msg->second.from.toString().c_str());
+                logger_->w("Dropping expired partial message from %s", pmsg.from.toString().c_str());
+            partial_size -= pmsg.size;
             partial_messages.erase(msg);
+            return;
         }
+        if (pmsg.last_part + RX_PART_TIMEOUT <= now) {
+            // transfer stalled: ask for the parts we are missing
+            if (pmsg.missing_requests < RX_MAX_MISSING_REQUESTS) {
+                pmsg.missing_requests++;
+                sendMissingParts(tid, *pmsg.msg, pmsg.from);
+            }
+            scheduler.add(now + RX_PART_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, tid));
+        } else
+            scheduler.add(pmsg.last_part + RX_PART_TIMEOUT, std::bind(&NetworkEngine::maintainRxBuffer, this, tid));
     }
 }
 
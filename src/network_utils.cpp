@@ -30,13 +30,30 @@
 #include <fcntl.h>
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define DHT_HAVE_RECVMMSG 1
+#define DHT_HAVE_SENDMMSG 1
+#endif
+
+#if defined(__linux__)
+#define DHT_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define DHT_HAVE_KQUEUE 1
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 namespace dht {
 namespace net {
 
 int
-bindSocket(const SockAddr& addr, SockAddr& bound)
+bindSocket(const SockAddr& addr, SockAddr& bound, bool reusePort)
 {
     bool is_ipv6 = addr.getFamily() == AF_INET6;
     int sock = socket(is_ipv6 ? PF_INET6 : PF_INET, SOCK_DGRAM, 0);
@@ -48,6 +65,12 @@ bindSocket(const SockAddr& addr, SockAddr& bound)
 #endif
     if (is_ipv6)
         setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&set, sizeof(set));
+#ifdef SO_REUSEPORT
+    if (reusePort)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&set, sizeof(set));
+#else
+    (void)reusePort;
+#endif
     net::setNonblocking(sock);
     int rc = bind(sock, addr.get(), addr.getLength());
     if (rc < 0) {
@@ -106,19 +129,191 @@ void udpPipe(int fds[2])
 }
 #endif
 
-UdpSocket::UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l) : logger(l) {
+/**
+ * Receive buffers for the receive threads. With recvmmsg, up to
+ * RX_BATCH_MAX_SIZE datagrams are read with a single system call.
+ */
+struct RecvBatch {
+    static constexpr size_t PACKET_MAX_SIZE = 1024 * 64;
+#ifdef DHT_HAVE_RECVMMSG
+    static constexpr size_t MAX_PACKETS = RX_BATCH_MAX_SIZE;
+#else
+    static constexpr size_t MAX_PACKETS = 1;
+#endif
+
+    std::vector<uint8_t> buf;
+    std::array<sockaddr_storage, MAX_PACKETS> from;
+    std::array<socklen_t, MAX_PACKETS> from_len;
+    std::array<size_t, MAX_PACKETS> len;
+#ifdef DHT_HAVE_RECVMMSG
+    std::array<mmsghdr, MAX_PACKETS> msgs;
+    std::array<iovec, MAX_PACKETS> iovs;
+#endif
+
+    RecvBatch() : buf(MAX_PACKETS * PACKET_MAX_SIZE) {
+#ifdef DHT_HAVE_RECVMMSG
+        for (size_t i = 0; i < MAX_PACKETS; i++) {
+            iovs[i].iov_base = packet(i);
+            iovs[i].iov_len = PACKET_MAX_SIZE;
+        }
+#endif
+    }
+
+    uint8_t* packet(size_t i) { return buf.data() + i * PACKET_MAX_SIZE; }
+
+    /** Returns the number of datagrams read, or -1 on error (errno is set) */
+    int receive(int fd) {
+#ifdef DHT_HAVE_RECVMMSG
+        for (size_t i = 0; i < MAX_PACKETS; i++) {
+            auto& hdr = msgs[i].msg_hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &from[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = 1;
+            msgs[i].msg_len = 0;
+        }
+        int rc = recvmmsg(fd, msgs.data(), msgs.size(), MSG_DONTWAIT, nullptr);
+        if (rc == -1 and (errno == EAGAIN or errno == EWOULDBLOCK))
+            return 0;
+        for (int i = 0; i < rc; i++) {
+            len[i] = msgs[i].msg_len;
+            from_len[i] = msgs[i].msg_hdr.msg_namelen;
+        }
+        return rc;
+#else
+        from_len[0] = sizeof(sockaddr_storage);
+        int rc = recvfrom(fd, (char*)buf.data(), PACKET_MAX_SIZE, 0, (sockaddr*)&from[0], &from_len[0]);
+        if (rc <= 0)
+            return rc;
+        len[0] = rc;
+        return 1;
+#endif
+    }
+};
+
+/**
+ * Waits for a set of file descriptors to become readable.
+ * Descriptors are registered once. Uses epoll on Linux, kqueue on BSD
+ * and macOS, and select() elsewhere.
+ */
+class FdPoller {
+public:
+    FdPoller() {
+#if defined(DHT_HAVE_EPOLL)
+        pfd = epoll_create1(EPOLL_CLOEXEC);
+        if (pfd == -1)
+            throw DhtException(std::string("Can't create epoll instance: ") + strerror(errno));
+#elif defined(DHT_HAVE_KQUEUE)
+        pfd = kqueue();
+        if (pfd == -1)
+            throw DhtException(std::string("Can't create kqueue: ") + strerror(errno));
+#endif
+    }
+    ~FdPoller() {
+#if defined(DHT_HAVE_EPOLL) || defined(DHT_HAVE_KQUEUE)
+        if (pfd != -1)
+            close(pfd);
+#endif
+    }
+    FdPoller(const FdPoller&) = delete;
+    FdPoller& operator=(const FdPoller&) = delete;
+
+    void add(int fd) {
+        if (fd < 0)
+            return;
+#if defined(DHT_HAVE_EPOLL)
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(pfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            throw DhtException(std::string("Can't register socket: ") + strerror(errno));
+#elif defined(DHT_HAVE_KQUEUE)
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        if (kevent(pfd, &ev, 1, nullptr, 0, nullptr) == -1)
+            throw DhtException(std::string("Can't register socket: ") + strerror(errno));
+#endif
+        fds.emplace_back(fd);
+    }
+
+    /** Must be called before closing a registered descriptor */
+    void remove(int fd) {
+        auto it = std::find(fds.begin(), fds.end(), fd);
+        if (it == fds.end())
+            return;
+        fds.erase(it);
+#if defined(DHT_HAVE_EPOLL)
+        epoll_ctl(pfd, EPOLL_CTL_DEL, fd, nullptr);
+#elif defined(DHT_HAVE_KQUEUE)
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        kevent(pfd, &ev, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    /**
+     * Block until at least one registered descriptor is readable.
+     * @return the number of ready descriptors, or -1 on error (errno is set).
+     */
+    int wait() {
+        ready_.clear();
+#if defined(DHT_HAVE_EPOLL)
+        std::array<epoll_event, MAX_EVENTS> evs;
+        int rc = epoll_wait(pfd, evs.data(), evs.size(), -1);
+        for (int i = 0; i < rc; i++)
+            ready_.push_back(int(evs[i].data.fd));
+#elif defined(DHT_HAVE_KQUEUE)
+        std::array<struct kevent, MAX_EVENTS> evs;
+        int rc = kevent(pfd, nullptr, 0, evs.data(), evs.size(), nullptr);
+        for (int i = 0; i < rc; i++)
+            ready_.emplace_back((int)evs[i].ident);
+#else
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        int maxFd = -1;
+        for (auto fd : fds) {
+            FD_SET(fd, &readfds);
+            maxFd = std::max(maxFd, fd);
+        }
+        int rc = select(maxFd + 1, &readfds, nullptr, nullptr, nullptr);
+        if (rc > 0)
+            for (auto fd : fds)
+                if (FD_ISSET(fd, &readfds))
+                    ready_.emplace_back(fd);
+#endif
+        return rc;
+    }
+
+    bool isReady(int fd) const {
+        return fd >= 0 and std::find(ready_.begin(), ready_.end(), fd) != ready_.end();
+    }
+
+private:
+    static constexpr size_t MAX_EVENTS {16};
+    std::vector<int> fds;
+    std::vector<int> ready_;
+    int pfd {-1};
+};
+
+UdpSocket::UdpSocket(in_port_t port, const std::shared_ptr<Logger>& l, unsigned rxThreads)
+    : logger(l), rx_threads(std::max(rxThreads, 1u))
+{
     SockAddr bind4;
     bind4.setFamily(AF_INET);
     bind4.setPort(port);
     SockAddr bind6;
     bind6.setFamily(AF_INET6);
     bind6.setPort(port);
+    reservePackets(RX_POOL_INITIAL_SIZE);
     std::lock_guard<std::mutex> lk(lock);
     openSockets(bind4, bind6);
 }
 
-UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l) : logger(l)
+UdpSocket::UdpSocket(const SockAddr& bind4, const SockAddr& bind6, const std::shared_ptr<Logger>& l, unsigned rxThreads)
+    : logger(l), rx_threads(std::max(rxThreads, 1u))
 {
+    reservePackets(RX_POOL_INITIAL_SIZE);
     std::lock_guard<std::mutex> lk(lock);
     openSockets(bind4, bind6);
 }
@@ -134,6 +329,110 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool r
     if (not dest)
         return EFAULT;
 
+    {
+        std::lock_guard<std::mutex> lk(tx_lock);
+        if (tx_batch) {
+            int s;
+            switch (dest.getFamily()) {
+            case AF_INET:  s = s4; break;
+            case AF_INET6: s = s6; break;
+            default:       s = -1; break;
+            }
+            if (s < 0)
+                return EAFNOSUPPORT;
+            tx_queue.emplace_back(PendingPacket {dest, Blob(data, data + size), replied});
+            return 0;
+        }
+    }
+    return sendPacket(dest, data, size, replied);
+}
+
+void
+UdpSocket::startBatch()
+{
+    std::lock_guard<std::mutex> lk(tx_lock);
+    tx_batch = true;
+}
+
+std::vector<DatagramSocket::SendError>
+UdpSocket::flush()
+{
+    std::vector<SendError> errors;
+    std::vector<PendingPacket> pkts;
+    {
+        std::lock_guard<std::mutex> lk(tx_lock);
+        tx_batch = false;
+        pkts.swap(tx_queue);
+    }
+    if (pkts.empty())
+        return errors;
+
+    auto pkts6 = std::stable_partition(pkts.begin(), pkts.end(), [](const PendingPacket& p) {
+        return p.dest.getFamily() == AF_INET;
+    });
+    sendBatch(AF_INET, pkts.begin(), pkts6, errors);
+    sendBatch(AF_INET6, pkts6, pkts.end(), errors);
+
+    // Keep the allocated queue for the next batch
+    pkts.clear();
+    std::lock_guard<std::mutex> lk(tx_lock);
+    if (tx_queue.empty())
+        tx_queue.swap(pkts);
+    return errors;
+}
+
+void
+UdpSocket::sendBatch(sa_family_t af, std::vector<PendingPacket>::iterator begin, std::vector<PendingPacket>::iterator end,
+                     std::vector<SendError>& errors)
+{
+#ifdef DHT_HAVE_SENDMMSG
+    std::array<mmsghdr, TX_BATCH_MAX_SIZE> msgs;
+    std::array<iovec, TX_BATCH_MAX_SIZE> iovs;
+    while (begin != end) {
+        int s = (af == AF_INET) ? s4 : s6;
+        if (s < 0) {
+            for (; begin != end; ++begin)
+                errors.emplace_back(std::move(begin->dest), EAFNOSUPPORT);
+            return;
+        }
+
+        // Packets sharing the same flags are sent with a single system call
+        bool replied = begin->replied;
+        size_t n = 0;
+        for (auto it = begin; it != end and n < TX_BATCH_MAX_SIZE and it->replied == replied; ++it, ++n) {
+            iovs[n].iov_base = it->data.data();
+            iovs[n].iov_len = it->data.size();
+            auto& hdr = msgs[n].msg_hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = const_cast<sockaddr*>(it->dest.get());
+            hdr.msg_namelen = it->dest.getLength();
+            hdr.msg_iov = &iovs[n];
+            hdr.msg_iovlen = 1;
+            msgs[n].msg_len = 0;
+        }
+
+        int flags = MSG_NOSIGNAL;
+        if (replied)
+            flags |= MSG_CONFIRM;
+        int rc = sendmmsg(s, msgs.data(), n, flags);
+        if (rc <= 0) {
+            // The first packet failed: send it alone to handle and log the error
+            if (auto err = sendPacket(begin->dest, begin->data.data(), begin->data.size(), begin->replied))
+                errors.emplace_back(begin->dest, err);
+            rc = 1;
+        }
+        begin += rc;
+    }
+#else
+    (void)af;
+    for (; begin != end; ++begin)
+        if (auto err = sendPacket(begin->dest, begin->data.data(), begin->data.size(), begin->replied))
+            errors.emplace_back(begin->dest, err);
+#endif
+}
+
+int
+UdpSocket::sendPacket(const SockAddr& dest, const uint8_t* data, size_t size, bool replied) {
     int s;
     switch (dest.getFamily()) {
     case AF_INET:  s = s4; break;
@@ -161,7 +460,7 @@ UdpSocket::sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool r
             std::lock_guard<std::mutex> lk(lock);
             auto bind4 = std::move(bound4), bind6 = std::move(bound6);
             openSockets(bind4, bind6);
-            return sendTo(dest, data, size, false);
+            return sendPacket(dest, data, size, false);
         }
         return err;
     }
@@ -193,7 +492,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
     bound4 = {};
     if (bind4) {
         try {
-            s4 = bindSocket(bind4, bound4);
+            s4 = bindSocket(bind4, bound4, rx_threads > 1);
         } catch (const DhtException& e) {
             if (logger)
                 logger->e("Can't bind inet socket: %s", e.what());
@@ -209,7 +508,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                 auto b6 = bind6;
                 b6.setPort(p4);
                 try {
-                    s6 = bindSocket(b6, bound6);
+                    s6 = bindSocket(b6, bound6, rx_threads > 1);
                 } catch (const DhtException& e) {
                     if (logger)
                         logger->e("Can't bind inet6 socket: %s", e.what());
@@ -218,7 +517,7 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
         }
         if (s6 == -1) {
             try {
-                s6 = bindSocket(bind6, bound6);
+                s6 = bindSocket(bind6, bound6, rx_threads > 1);
             } catch (const DhtException& e) {
                 if (logger)
                     logger->e("Can't bind inet6 socket: %s", e.what());
@@ -231,25 +530,103 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
         throw DhtException("Can't bind socket");
     }
 
-    running = true;
-    rcv_thread = std::thread([this, stop_readfd, ls4=s4, ls6=s6]() mutable {
-        int selectFd = std::max({ls4, ls6, stop_readfd}) + 1;
+    // Additional sockets bound to the same port, each served by its own thread
+    std::vector<std::pair<int, int>> shards;
+#ifdef SO_REUSEPORT
+    for (unsigned i = 1; i < rx_threads; i++) {
+        int sh4 = -1, sh6 = -1;
+        SockAddr b;
         try {
-            while (running) {
-                fd_set readfds;
+            if (s4 != -1)
+                sh4 = bindSocket(bound4, b, true);
+            if (s6 != -1)
+                sh6 = bindSocket(bound6, b, true);
+        } catch (const DhtException& e) {
+            if (logger)
+                logger->e("Can't bind receive shard socket: %s", e.what());
+            if (sh4 != -1)
+                close(sh4);
+            break;
+        }
+        shards.emplace_back(sh4, sh6);
+    }
+#else
+    if (rx_threads > 1 and logger)
+        logger->w("SO_REUSEPORT is not available: using a single receive thread");
+#endif
 
-                FD_ZERO(&readfds);
-                FD_SET(stop_readfd, &readfds);
-                if(ls4 >= 0)
-                    FD_SET(ls4, &readfds);
-                if(ls6 >= 0)
-                    FD_SET(ls6, &readfds);
+    running = true;
+    rcv_thread = std::thread([this, stop_readfd, ls4=s4, ls6=s6, shards]() mutable {
+        auto receive = [this](int fd, RecvBatch& batch) {
+            int rc = batch.receive(fd);
+            if (rc > 0) {
+                auto pkts = getNewPackets(rc);
+                auto now = clock::now();
+                size_t i = 0;
+                for (auto& pkt : pkts) {
+                    const auto* data = batch.packet(i);
+                    pkt.data.insert(pkt.data.end(), data, data + batch.len[i]);
+                    pkt.from = {batch.from[i], batch.from_len[i]};
+                    pkt.received = now;
+                    i++;
+                }
+                onReceived(std::move(pkts));
+            }
+            return rc;
+        };
 
-                int rc = select(selectFd, &readfds, nullptr, nullptr, nullptr);
+        // The stop pipe is never drained once stopping, so it wakes every thread.
+        std::vector<std::thread> shard_threads;
+        shard_threads.reserve(shards.size());
+        for (const auto& shard : shards) {
+            shard_threads.emplace_back([this, stop_readfd, shard, receive]() {
+                int sh4 = shard.first, sh6 = shard.second;
+                try {
+                    std::unique_ptr<RecvBatch> batch(new RecvBatch);
+                    FdPoller poller;
+                    poller.add(stop_readfd);
+                    poller.add(sh4);
+                    poller.add(sh6);
+                    while (running) {
+                        int rc = poller.wait();
+                        if (not running)
+                            break;
+                        if (rc < 0) {
+                            if (errno != EINTR) {
+                                if (logger)
+                                    logger->e("Poll error: %s", strerror(errno));
+                                std::this_thread::sleep_for(std::chrono::seconds(1));
+                            }
+                            continue;
+                        }
+                        if (poller.isReady(sh4) and receive(sh4, *batch) == -1 and logger)
+                            logger->e("Error receiving packet: %s", strerror(errno));
+                        if (poller.isReady(sh6) and receive(sh6, *batch) == -1 and logger)
+                            logger->e("Error receiving packet: %s", strerror(errno));
+                    }
+                } catch (const std::exception& e) {
+                    if (logger)
+                        logger->e("Error in UdpSocket rx shard thread: %s", e.what());
+                }
+                if (sh4 >= 0)
+                    close(sh4);
+                if (sh6 >= 0)
+                    close(sh6);
+            });
+        }
+
+        try {
+            std::unique_ptr<RecvBatch> batch(new RecvBatch);
+            FdPoller poller;
+            poller.add(stop_readfd);
+            poller.add(ls4);
+            poller.add(ls6);
+            while (running) {
+                int rc = poller.wait();
                 if (rc < 0) {
                     if (errno != EINTR) {
                         if (logger)
-                            logger->e("Select error: %s", strerror(errno));
+                            logger->e("Poll error: %s", strerror(errno));
                         std::this_thread::sleep_for(std::chrono::seconds(1));
                     }
                 }
@@ -258,32 +635,22 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                     break;
 
                 if (rc > 0) {
-                    std::array<uint8_t, 1024 * 64> buf;
-                    sockaddr_storage from;
-                    socklen_t from_len = sizeof(from);
-
-                    if (FD_ISSET(stop_readfd, &readfds)) {
-                        if (recv(stop_readfd, (char*)buf.data(), buf.size(), 0) < 0) {
+                    if (poller.isReady(stop_readfd)) {
+                        char stopbuf[16];
+                        if (recv(stop_readfd, stopbuf, sizeof(stopbuf), 0) < 0) {
                             if (logger)
                                 logger->e("Got stop packet error: %s", strerror(errno));
                             break;
                         }
                     }
-                    else if (ls4 >= 0 && FD_ISSET(ls4, &readfds))
-                        rc = recvfrom(ls4, (char*)buf.data(), buf.size(), 0, (sockaddr*)&from, &from_len);
-                    else if (ls6 >= 0 && FD_ISSET(ls6, &readfds))
-                        rc = recvfrom(ls6, (char*)buf.data(), buf.size(), 0, (sockaddr*)&from, &from_len);
+                    else if (poller.isReady(ls4))
+                        rc = receive(ls4, *batch);
+                    else if (poller.isReady(ls6))
+                        rc = receive(ls6, *batch);
                     else
                         continue;
 
-                    if (rc > 0) {
-                        auto pkts = getNewPacket();
-                        auto& pkt = pkts.front();
-                        pkt.data.insert(pkt.data.end(), buf.begin(), buf.begin()+rc);
-                        pkt.from = {from, from_len};
-                        pkt.received = clock::now();
-                        onReceived(std::move(pkts));
-                    } else if (rc == -1) {
+                    if (rc == -1) {
                         if (logger)
                             logger->e("Error receiving packet: %s", strerror(errno));
                         int err = errno;
@@ -293,28 +660,33 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
                             if (lk.owns_lock()) {
                                 if (not running) break;
                                 if (ls4 >= 0) {
+                                    poller.remove(ls4);
                                     close(ls4);
+                                    ls4 = -1;
                                     try {
-                                        ls4 = bindSocket(bound4, bound4);
+                                        ls4 = bindSocket(bound4, bound4, rx_threads > 1);
                                     } catch (const DhtException& e) {
                                         if (logger)
                                             logger->e("Can't bind inet socket: %s", e.what());
                                     }
+                                    poller.add(ls4);
                                 }
                                 if (ls6 >= 0) {
+                                    poller.remove(ls6);
                                     close(ls6);
+                                    ls6 = -1;
                                     try {
-                                        ls6 = bindSocket(bound6, bound6);
+                                        ls6 = bindSocket(bound6, bound6, rx_threads > 1);
                                     } catch (const DhtException& e) {
                                         if (logger)
                                             logger->e("Can't bind inet6 socket: %s", e.what());
                                     }
+                                    poller.add(ls6);
                                 }
                                 if (ls4 < 0 && ls6 < 0)
                                     break;
                                 s4 = ls4;
                                 s6 = ls6;
-                                selectFd = std::max({ls4, ls6, stop_readfd}) + 1;
                             } else {
                                 break;
                             }
@@ -326,6 +698,13 @@ UdpSocket::openSockets(const SockAddr& bind4, const SockAddr& bind6)
             if (logger)
                 logger->e("Error in UdpSocket rx thread: %s", e.what());
         }
+        if (not shard_threads.empty()) {
+            // Make sure shard threads wake up before closing the stop pipe
+            if (running.exchange(false) and stopfd != -1 and write(stopfd, "\0", 1) == -1 and logger)
+                logger->e("Can't write to stop fd");
+            for (auto& t : shard_threads)
+                t.join();
+        }
         if (ls4 >= 0)
             close(ls4);
         if (ls6 >= 0)
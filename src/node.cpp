@@ -29,19 +29,53 @@ namespace dht {
 constexpr std::chrono::minutes Node::NODE_EXPIRE_TIME;
 constexpr std::chrono::minutes Node::NODE_GOOD_TIME;
 constexpr std::chrono::seconds Node::MAX_RESPONSE_TIME;
+constexpr std::chrono::milliseconds Node::MIN_RETRANSMIT_TIME;
+constexpr std::chrono::milliseconds Node::MAX_RETRANSMIT_TIME;
+constexpr std::chrono::seconds Node::MAX_RTT;
 
 Node::Node(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client)
-: id(id), addr(addr), is_client(client), sockets_()
+: id(id), addr(addr), is_client(client)
 {
     transaction_id = std::uniform_int_distribution<Tid>{1}(rd);
 }
 
 Node::Node(const InfoHash& id, SockAddr&& addr, std::mt19937_64& rd, bool client)
-: id(id), addr(std::move(addr)), is_client(client), sockets_()
+: id(id), addr(std::move(addr)), is_client(client)
 {
     transaction_id = std::uniform_int_distribution<Tid>{1}(rd);
 }
 
+void
+Node::updateRtt(duration rtt)
+{
+    if (rtt < duration::zero())
+        return;
+    auto sample = std::chrono::duration_cast<rtt_duration>(std::min<duration>(rtt, MAX_RTT));
+    if (srtt_ == rtt_duration::zero()) {
+        srtt_ = sample;
+        rttvar_ = sample / 2;
+    } else {
+        auto delta = srtt_ > sample ? srtt_ - sample : sample - srtt_;
+        rttvar_ = (3 * rttvar_ + delta) / 4;
+        srtt_ = (7 * srtt_ + sample) / 8;
+    }
+}
+
+duration
+Node::getRetransmitTimeout() const
+{
+    if (srtt_ == rtt_duration::zero())
+        return ((duration)MAX_RESPONSE_TIME) / 2;
+    return std::min<duration>(std::max<duration>(srtt_ + 4 * rttvar_, MIN_RETRANSMIT_TIME), MAX_RETRANSMIT_TIME);
+}
+
+duration
+Node::getExpectedLatency() const
+{
+    auto rtt = srtt_ == rtt_duration::zero() ? ((duration)MAX_RESPONSE_TIME) / 2 : (duration)srtt_;
+    return rtt * (1 + timeouts_);
+}
+
 /* This is our definition of a known-good node. */
 bool
 Node::isGood(time_point now) const
@@ -100,7 +134,9 @@ Node::received(time_point now, const Sp<net::Request>& req)
     expired_ = false;
     if (req) {
         reply_time = now;
+        timeouts_ /= 2;
         requests_.erase(req->getTid());
+        requests_.shrink();
     }
 }
 
@@ -117,6 +153,7 @@ Node::cancelRequest(const Sp<net::Request>& req)
     if (req) {
         req->cancel();
         requests_.erase(req->getTid());
+        requests_.shrink();
     }
 }
 
@@ -124,11 +161,11 @@ void
 Node::setExpired()
 {
     expired_ = true;
-    for (auto r : requests_) {
-        r.second->setExpired();
-    }
-    requests_.clear();
+    // request callbacks may cancel or complete requests of this node
+    auto requests = std::move(requests_);
     sockets_.clear();
+    for (auto& r : requests)
+        r.second->setExpired();
 }
 
 Tid
@@ -17,11 +17,41 @@
  */
 
 #include "node_cache.h"
+#include "pool.h"
 
 namespace dht {
 
-constexpr size_t CLEANUP_MAX_NODES {1024};
-constexpr size_t CLEANUP_FREQ {1024};
+constexpr size_t NodeCache::MAX_NODES;
+
+/* Number of least recently used entries checked for expiration on insertion */
+constexpr size_t CLEANUP_MAX_NODES {2};
+/* Number of least recently used entries checked on insertion when the cache is full */
+constexpr size_t EVICT_MAX_NODES {8};
+
+/* Number of nodes allocated at once by the node pool */
+constexpr size_t NODE_POOL_CHUNK {256};
+
+namespace {
+
+/**
+ * Nodes and their shared_ptr control blocks are allocated from a pool:
+ * avoids the per allocation overhead of malloc for the millions of nodes
+ * of large networks. Never destroyed, as nodes can outlive static objects.
+ */
+Sp<BlockPool>&
+nodePool()
+{
+    static auto pool = new Sp<BlockPool>(std::make_shared<BlockPool>(NODE_POOL_CHUNK));
+    return *pool;
+}
+
+Sp<Node>
+makeNode(const InfoHash& id, const SockAddr& addr, std::mt19937_64& rd, bool client)
+{
+    return std::allocate_shared<Node>(PoolAllocator<Node>(nodePool()), id, addr, rd, client);
+}
+
+}
 
 NodeCache::~NodeCache()
 {
@@ -37,7 +67,7 @@ NodeCache::getNode(const InfoHash& id, sa_family_t family) {
 Sp<Node>
 NodeCache::getNode(const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client) {
     if (not id)
-        return std::make_shared<Node>(id, addr, rd, client);
+        return makeNode(id, addr, rd, client);
     return cache(addr.getFamily()).getNode(id, addr, now, confirm, client, rd);
 }
 
@@ -51,28 +81,31 @@ std::vector<Sp<Node>>
 NodeCache::NodeMap::getCachedNodes(const InfoHash& id, size_t count) const
 {
     std::vector<Sp<Node>> nodes;
-    nodes.reserve(std::min(size(), count));
-    const_iterator it;
-    auto dec_it = [this](const_iterator& it) {
+    nodes.reserve(std::min(sorted_.size(), count));
+    std::set<InfoHash>::const_iterator it;
+    auto dec_it = [this](std::set<InfoHash>::const_iterator& it) {
         auto ret = it;
-        it = (it == cbegin()) ? cend() : std::prev(it);
+        it = (it == sorted_.cbegin()) ? sorted_.cend() : std::prev(it);
         return ret;
     };
 
-    auto it_p = lower_bound(id),
+    auto it_p = sorted_.lower_bound(id),
         it_n = it_p;
-    if (not empty())
+    if (not sorted_.empty())
         dec_it(it_p); /* Create 2 separate iterator if we could */
 
-    while (nodes.size() < count and (it_n != cend() or it_p != cend())) {
+    while (nodes.size() < count and (it_n != sorted_.cend() or it_p != sorted_.cend())) {
         /* If one of the iterator is at the end, then take the other one
            If they are both in middle of somewhere comapre both and take
            the closest to the id. */
-        if (it_p == cend())      it = it_n++;
-        else if (it_n == cend()) it = dec_it(it_p);
-        else                     it = id.xorCmp(it_p->first, it_n->first) < 0 ? dec_it(it_p) : it_n++;
-
-        if (auto n = it->second.lock())
+        if (it_p == sorted_.cend())      it = it_n++;
+        else if (it_n == sorted_.cend()) it = dec_it(it_p);
+        else                             it = id.xorCmp(*it_p, *it_n) < 0 ? dec_it(it_p) : it_n++;
+
+        auto e = nodes_.find(*it);
+        if (e == nodes_.end())
+            continue;
+        if (auto n = e->second->node.lock())
             if ( not n->isExpired() and not n->isClient() )
                 nodes.emplace_back(std::move(n));
     }
@@ -94,66 +127,91 @@ NodeCache::clearBadNodes(sa_family_t family)
 Sp<Node>
 NodeCache::NodeMap::getNode(const InfoHash& id)
 {
-    auto wn = find(id);
-    if (wn == end())
+    auto wn = nodes_.find(id);
+    if (wn == nodes_.end())
         return {};
-    if (auto n = wn->second.lock())
+    if (auto n = wn->second->node.lock())
         return n;
-    erase(wn);
+    erase(wn->second);
     return {};
 }
 
 Sp<Node>
 NodeCache::NodeMap::getNode(const InfoHash& id, const SockAddr& addr, time_point now, bool confirm, bool client, std::mt19937_64& rd)
 {
-    auto& nref = (*this)[id];
-    auto node = nref.lock();
+    auto wn = nodes_.find(id);
+    Lru::iterator entry;
+    bool inserted = wn == nodes_.end();
+    if (not inserted) {
+        // move to the front of the LRU list
+        entry = wn->second;
+        lru_.splice(lru_.begin(), lru_, entry);
+    } else {
+        entry = lru_.emplace(lru_.begin(), Entry{id, {}});
+        nodes_.emplace(id, entry);
+        sorted_.emplace(id);
+    }
+    auto node = entry->node.lock();
     if (not node) {
-        node = std::make_shared<Node>(id, addr, rd, client);
-        nref = node;
-        if (cleanup_counter++ == CLEANUP_FREQ) {
-            cleanup();
-            cleanup_counter = 0;
-        }
+        node = makeNode(id, addr, rd, client);
+        entry->node = node;
     } else if (confirm or node->isOld(now)) {
         node->update(addr);
     }
+    // after the new node is set, so that it's not evicted
+    if (inserted)
+        evict();
     return node;
 }
 
 void
 NodeCache::NodeMap::clearBadNodes() {
-    for (auto it = cbegin(); it != cend();) {
-        if (auto n = it->second.lock()) {
+    for (auto it = lru_.begin(); it != lru_.end();) {
+        if (auto n = it->node.lock()) {
             n->reset();
             ++it;
         } else {
             erase(it++);
         }
     }
-    cleanup_counter = 0;
 }
 
 void
 NodeCache::NodeMap::setExpired() {
-    for (auto& wn : *this)
-        if (auto n = wn.second.lock())
+    for (auto& e : lru_)
+        if (auto n = e.node.lock())
             n->setExpired();
-    clear();
-    cleanup_counter = 0;
+    lru_.clear();
+    nodes_.clear();
+    sorted_.clear();
 }
 
 void
-NodeCache::NodeMap::cleanup()
+NodeCache::NodeMap::erase(Lru::iterator it)
 {
-    auto it = lower_bound(InfoHash::getRandom());
-    for (size_t n = 0, maxNodes = std::min(size(), CLEANUP_MAX_NODES); n != maxNodes; n++) {
-        if (it == end())
-            it = begin();
-        if (it->second.expired())
-            erase(it++);
+    nodes_.erase(it->id);
+    sorted_.erase(it->id);
+    lru_.erase(it);
+}
+
+void
+NodeCache::NodeMap::evict()
+{
+    // drop the least recently used entries if expired, or if the cache is full
+    for (size_t n = 0; n < CLEANUP_MAX_NODES and lru_.size() > 1; n++) {
+        auto last = std::prev(lru_.end());
+        if (not last->node.expired())
+            break;
+        erase(last);
+    }
+    // nodes still in use must stay indexed: they're moved to the front,
+    // the cache only grows beyond MAX_NODES if all nodes are in use
+    for (size_t n = 0; n < EVICT_MAX_NODES and lru_.size() > MAX_NODES; n++) {
+        auto last = std::prev(lru_.end());
+        if (last->node.expired())
+            erase(last);
         else
-            ++it;
+            lru_.splice(lru_.begin(), lru_, last);
     }
 }
 
@@ -129,6 +129,21 @@ OpCache::onValuesExpired(const std::vector<Sp<Value>>& vals) {
     }
 }
 
+void
+OpCache::absorb(OpCache& o) {
+    auto moved = std::move(o.listeners);
+    o.listeners.clear();
+    o.lastRemoved = time_point::min();
+    for (auto& l : moved) {
+        auto old = o.cache.get(l.second.filter);
+        // Listener callbacks count sources of each value (see OpValueCache::cacheCallback):
+        // values of this operation are added, then the ones of the other operation
+        // are expired, so that only values unknown to this operation are reported as expired.
+        if (addListener(l.first, l.second.get_cb, l.second.query, l.second.filter) and not old.empty())
+            l.second.get_cb(old, true);
+    }
+}
+
 time_point
 OpCache::getExpiration() const {
     if (not listeners.empty())
@@ -212,6 +227,14 @@ SearchCache::cancelAll(const std::function<void(size_t)>& onCancel) {
 
 time_point
 SearchCache::expire(const time_point& now, const std::function<void(size_t)>& onCancel) {
+    // serve listeners of narrower queries with synced broader ones
+    for (auto& op : ops) {
+        if (op.second->isDone() or not op.second->isSynced())
+            continue;
+        for (auto& o : ops)
+            if (o.second != op.second and not o.second->isDone() and o.first->isSatisfiedBy(*op.first))
+                op.second->absorb(*o.second);
+    }
     nextExpiration_ = time_point::max();
     auto ret = nextExpiration_;
     for (auto it = ops.begin(); it != ops.end();) {
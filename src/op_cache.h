@@ -123,6 +123,12 @@ public:
         listeners.clear();
     }
 
+    /**
+     * Moves the listeners of another operation to this one,
+     * leaving the other one expired.
+     */
+    void absorb(OpCache& o);
+
     bool isDone() {
         return listeners.empty();
     }
@@ -166,6 +172,11 @@ public:
     bool cancelListen(size_t gtoken, const time_point& now);
     void cancelAll(const std::function<void(size_t)>& onCancel);
 
+    /**
+     * Expires unused operations, after moving the listeners of operations
+     * satisfied by a broader synced one to it.
+     * onCancel is called for every removed operation.
+     */
     time_point expire(const time_point& now, const std::function<void(size_t)>& onCancel);
     time_point getExpiration() const {
         return nextExpiration_;
@@ -20,6 +20,7 @@
 #include "infohash.h"
 #include "sockaddr.h"
 #include "net.h"
+#include "compression.h"
 
 #include <map>
 
@@ -37,6 +38,7 @@ static const std::string KEY_NETID {"n"};
 static const std::string KEY_ISCLIENT {"s"};
 static const std::string KEY_Q {"q"};
 static const std::string KEY_A {"a"};
+static const std::string KEY_MISSING {"m"};
 
 static const std::string KEY_REQ_SID {"sid"};
 static const std::string KEY_REQ_ID {"id"};
@@ -45,6 +47,7 @@ static const std::string KEY_REQ_TARGET {"target"};
 static const std::string KEY_REQ_QUERY {"q"};
 static const std::string KEY_REQ_TOKEN {"token"};
 static const std::string KEY_REQ_VALUE_ID {"vid"};
+static const std::string KEY_REQ_VALUE_IDS {"vids"};
 static const std::string KEY_REQ_NODES4 {"n4"};
 static const std::string KEY_REQ_NODES6 {"n6"};
 static const std::string KEY_REQ_CREATION {"c"};
@@ -64,7 +67,7 @@ static const std::string QUERY_PUT {"put"};
 static const std::string QUERY_LISTEN {"listen"};
 static const std::string QUERY_REFRESH {"refresh"};
 
-Tid unpackTid(const msgpack::object& o) {
+inline Tid unpackTid(const msgpack::object& o) {
     switch (o.type) {
     case msgpack::type::POSITIVE_INTEGER:
         return o.as<Tid>();
@@ -73,6 +76,133 @@ Tid unpackTid(const msgpack::object& o) {
     }
 }
 
+/**
+ * Non-owning view of bytes from the received packet.
+ * Only valid while the packet is being processed.
+ */
+struct BlobView {
+    const uint8_t* ptr {nullptr};
+    size_t len {0};
+
+    BlobView() {}
+    BlobView(const uint8_t* p, size_t l) : ptr(p), len(l) {}
+    BlobView(const Blob& b) : ptr(b.data()), len(b.size()) {}
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + len; }
+};
+
+inline BlobView unpackBlobView(const msgpack::object& o) {
+    switch (o.type) {
+    case msgpack::type::BIN:
+        return {(const uint8_t*)o.via.bin.ptr, o.via.bin.size};
+    case msgpack::type::STR:
+        return {(const uint8_t*)o.via.str.ptr, o.via.str.size};
+    default:
+        throw msgpack::type_error();
+    }
+}
+
+/**
+ * Unpack a value, either sent as a msgpack map or compressed
+ * in a bin object by peers advertising compression support.
+ */
+inline Sp<Value> unpackValueObject(const msgpack::object& o) {
+    if (o.type == msgpack::type::BIN) {
+        // Small margin for header overhead, as for values sent in parts
+        auto packed = decompressValue((const uint8_t*)o.via.bin.ptr, o.via.bin.size, MAX_VALUE_SIZE + 32);
+        msgpack::unpacked msg;
+        msgpack::unpack(msg, (const char*)packed.data(), packed.size());
+        return makeValue(msg.get());
+    }
+    return makeValue(o);
+}
+
+/**
+ * Lets msgpack reference strings and binaries from the packet buffer
+ * instead of copying them into the object zone.
+ */
+inline bool unpackReference(msgpack::type::object_type, std::size_t, void*) {
+    return true;
+}
+
+/**
+ * Reassembly buffer for a value sent in parts.
+ * The buffer is allocated to the full value size when the transfer starts.
+ * Parts are stored at their declared offset, whatever part size the sender
+ * uses, and the received byte ranges are tracked, so parts may arrive in
+ * any order or more than once.
+ */
+struct PartialValue {
+    /* Maximum number of disjoint received ranges */
+    static constexpr size_t MAX_RANGES {1024};
+
+    /* total size of the value */
+    unsigned size {0};
+    Blob data {};
+    /* received byte ranges, begin to end, disjoint and not adjacent */
+    std::map<unsigned, unsigned> received {};
+    /* number of bytes not received yet */
+    unsigned missing {0};
+
+    PartialValue(unsigned size) : size(size), missing(size) {}
+
+    void allocate() {
+        data.resize(size);
+    }
+
+    bool complete() const { return missing == 0; }
+
+    /** Store part at offset. Return true if the part had new data. */
+    bool insert(size_t offset, const BlobView& part) {
+        if (part.size() == 0 or offset >= size or part.size() > size - offset)
+            return false;
+        unsigned b = offset, e = offset + part.size();
+        // first range overlapping or adjacent to [b, e)
+        auto first = received.upper_bound(b);
+        if (first != received.begin() and std::prev(first)->second >= b)
+            --first;
+        if (first != received.end() and first->first <= b and first->second >= e)
+            return false;
+        auto last = first;
+        unsigned covered {0};
+        unsigned nb = b, ne = e;
+        for (; last != received.end() and last->first <= e; ++last) {
+            nb = std::min(nb, last->first);
+            ne = std::max(ne, last->second);
+            covered += last->second - last->first;
+        }
+        if (first == last and received.size() >= MAX_RANGES)
+            return false;
+        std::copy(part.begin(), part.end(), data.begin() + offset);
+        received.erase(first, last);
+        received.emplace(nb, ne);
+        missing -= (ne - nb) - covered;
+        return true;
+    }
+
+    /** Byte ranges not received yet, as a flat list of begin and end offsets */
+    std::vector<unsigned> missingRanges() const {
+        std::vector<unsigned> ret;
+        unsigned pos {0};
+        for (const auto& r : received) {
+            if (r.first > pos) {
+                ret.emplace_back(pos);
+                ret.emplace_back(r.first);
+            }
+            pos = r.second;
+        }
+        if (pos < size) {
+            ret.emplace_back(pos);
+            ret.emplace_back(size);
+        }
+        return ret;
+    }
+};
+
 struct ParsedMessage {
     MessageType type;
     /* Node ID of the sender */
@@ -95,18 +225,24 @@ struct ParsedMessage {
     Value::Id value_id {0};
     /* time when value was first created */
     time_point created { time_point::max() };
-    /* IPv4 nodes in response to a 'find' request */
-    Blob nodes4_raw, nodes6_raw;
+    /* IPv4 nodes in response to a 'find' request.
+     * Borrowed from the packet buffer until own() is called. */
+    BlobView nodes4_raw, nodes6_raw;
     std::vector<Sp<Node>> nodes4, nodes6;
     /* values to store or retreive request */
     std::vector<Sp<Value>> values;
     std::vector<Value::Id> refreshed_values {};
     std::vector<Value::Id> expired_values {};
+    /* values to refresh, for a 'refresh' request of several values */
+    std::vector<Value::Id> value_ids {};
     /* index for fields values */
     std::vector<Sp<FieldValueIndex>> fields;
-    /** When part of the message header: {index -> (total size, {})}
-     *  When part of partial value data: {index -> (offset, part_data)} */
-    std::map<unsigned, std::pair<unsigned, Blob>> value_parts;
+    /** Values sent separately: {index -> reassembly buffer} */
+    std::map<unsigned, PartialValue> value_parts;
+    /** Partial value data borrowed from the packet buffer: {index -> (offset, part_data)} */
+    std::map<unsigned, std::pair<unsigned, BlobView>> value_data;
+    /** Parts requested again by the receiver: {index -> offsets} */
+    std::map<unsigned, std::vector<unsigned>> value_missing;
     /* query describing a filter to apply on values. */
     Query query;
     /* states if ipv4 or ipv6 request */
@@ -119,49 +255,78 @@ struct ParsedMessage {
     SockAddr addr;
     void msgpack_unpack(const msgpack::object& o);
 
+    /** Total size of values sent separately */
+    size_t partsSize() const;
+    /** Allocate reassembly buffers for values sent in parts */
+    void allocateParts();
     bool append(const ParsedMessage& block);
     bool complete();
+
+    /** Copy borrowed data, so the message can outlive the packet buffer. */
+    void own();
+
+private:
+    Blob nodes_buf;
 };
 
-bool
+inline size_t
+ParsedMessage::partsSize() const
+{
+    size_t ret {0};
+    for (const auto& e : value_parts)
+        ret += e.second.size;
+    return ret;
+}
+
+inline void
+ParsedMessage::allocateParts()
+{
+    for (auto& e : value_parts)
+        e.second.allocate();
+}
+
+inline bool
 ParsedMessage::append(const ParsedMessage& block)
 {
     bool ret(false);
-    for (const auto& ve : block.value_parts) {
+    for (const auto& ve : block.value_data) {
         auto part_val = value_parts.find(ve.first);
-        if (part_val == value_parts.end()
-            || part_val->second.second.size() >= part_val->second.first)
+        if (part_val == value_parts.end())
             continue;
-        // TODO: handle out-of-order packets
-        if (ve.second.first != part_val->second.second.size()) {
-            //std::cout << "skipping out-of-order packet" << std::endl;
-            continue;
-        }
-        ret = true;
-        part_val->second.second.insert(part_val->second.second.end(),
-                                       ve.second.second.begin(),
-                                       ve.second.second.end());
+        if (part_val->second.insert(ve.second.first, ve.second.second))
+            ret = true;
     }
     return ret;
 }
 
-bool
+inline void
+ParsedMessage::own()
+{
+    Blob buf;
+    buf.reserve(nodes4_raw.size() + nodes6_raw.size());
+    buf.insert(buf.end(), nodes4_raw.begin(), nodes4_raw.end());
+    buf.insert(buf.end(), nodes6_raw.begin(), nodes6_raw.end());
+    nodes_buf = std::move(buf);
+    nodes4_raw = {nodes_buf.data(), nodes4_raw.size()};
+    nodes6_raw = {nodes_buf.data() + nodes4_raw.size(), nodes6_raw.size()};
+}
+
+inline bool
 ParsedMessage::complete()
 {
     for (auto& e : value_parts) {
-        //std::cout << "part " << e.first << ": " << e.second.second.size() << "/" << e.second.first << std::endl;
-        if (e.second.first > e.second.second.size())
+        if (not e.second.complete())
             return false;
     }
     for (auto& e : value_parts) {
         msgpack::unpacked msg;
-        msgpack::unpack(msg, (const char*)e.second.second.data(), e.second.second.size());
-        values.emplace_back(std::make_shared<Value>(msg.get()));
+        msgpack::unpack(msg, (const char*)e.second.data.data(), e.second.data.size());
+        values.emplace_back(unpackValueObject(msg.get()));
     }
     return true;
 }
 
-void
+inline void
 ParsedMessage::msgpack_unpack(const msgpack::object& msg)
 {
     if (msg.type != msgpack::type::MAP) throw msgpack::type_error();
@@ -173,6 +338,7 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         msgpack::object* e;
         msgpack::object* v;
         msgpack::object* a;
+        msgpack::object* m;
         std::string q;
     } parsed {};
 
@@ -203,6 +369,8 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             parsed.q = o.val.as<std::string>();
         else if (key == KEY_A)
             parsed.a = &o.val;
+        else if (key == KEY_MISSING)
+            parsed.m = &o.val;
     }
 
     if (parsed.e)
@@ -211,6 +379,8 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
         type = MessageType::Reply;
     else if (parsed.v)
         type = MessageType::ValueData;
+    else if (parsed.m)
+        type = MessageType::ValueMissing;
     else if (parsed.u)
         type = MessageType::ValueUpdate;
     else if (parsed.y and parsed.y->as<std::string>() != "q")
@@ -241,7 +411,17 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             auto d = findMapValue(vdat.val, "d");
             if (not o or not d)
                 continue;
-            value_parts.emplace(vdat.key.as<unsigned>(), std::pair<size_t, Blob>(o->as<size_t>(), unpackBlob(*d)));
+            value_data.emplace(vdat.key.as<unsigned>(), std::pair<size_t, BlobView>(o->as<size_t>(), unpackBlobView(*d)));
+        }
+        return;
+    }
+
+    if (type == MessageType::ValueMissing) {
+        if (parsed.m->type != msgpack::type::MAP)
+            throw msgpack::type_error();
+        for (size_t i = 0; i < parsed.m->via.map.size; ++i) {
+            auto& vm = parsed.m->via.map.ptr[i];
+            value_missing.emplace(vm.key.as<unsigned>(), vm.val.as<std::vector<unsigned>>());
         }
         return;
     }
@@ -282,10 +462,12 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
             token = unpackBlob(o.val);
         else if (key == KEY_REQ_VALUE_ID)
             value_id = o.val.as<Value::Id>();
+        else if (key == KEY_REQ_VALUE_IDS)
+            value_ids = o.val.as<decltype(value_ids)>();
         else if (key == KEY_REQ_NODES4)
-            nodes4_raw = unpackBlob(o.val);
+            nodes4_raw = unpackBlobView(o.val);
         else if (key == KEY_REQ_NODES6)
-            nodes6_raw = unpackBlob(o.val);
+            nodes6_raw = unpackBlobView(o.val);
         else if (key == KEY_REQ_ADDRESS)
             parsedReq.sa = &o.val;
         else if (key == KEY_REQ_CREATION)
@@ -331,10 +513,10 @@ ParsedMessage::msgpack_unpack(const msgpack::object& msg)
                 // Skip oversize values with a small margin for header overhead
                 if (packed_v.via.u64 > MAX_VALUE_SIZE + 32)
                     continue;
-                value_parts.emplace(i, std::make_pair(packed_v.via.u64, Blob{}));
+                value_parts.emplace(i, PartialValue((unsigned)packed_v.via.u64));
             } else {
                 try {
-                    values.emplace_back(std::make_shared<Value>(parsedReq.values->via.array.ptr[i]));
+                    values.emplace_back(unpackValueObject(packed_v));
                 } catch (const std::exception& e) {
                      //DHT_LOG_WARN("Error reading value: %s", e.what());
                 }
@@ -21,15 +21,29 @@
 #include "peer_discovery.h"
 #include "network_utils.h"
 #include "utils.h"
+#include "rng.h"
 
 #include <asio.hpp>
 
+#include <random>
+#include <set>
+
 namespace dht {
 
 // Organization-local Scope multicast
 constexpr char MULTICAST_ADDRESS_IPV4[] = "239.192.0.1";
 constexpr char MULTICAST_ADDRESS_IPV6[] = "ff08::101";
 
+// Changes to the published services within this delay are sent together
+constexpr std::chrono::milliseconds ANNOUNCE_DELAY {100};
+// Announcements interval, doubling up to the maximum while peers are stable
+constexpr std::chrono::seconds ANNOUNCE_MIN_INTERVAL {2};
+constexpr std::chrono::minutes ANNOUNCE_MAX_INTERVAL {10};
+// Queries are answered after a random delay up to this one
+constexpr std::chrono::milliseconds ANSWER_MAX_DELAY {500};
+// Peers remembered to detect changes of the peer set
+constexpr size_t MAX_KNOWN_PEERS {1024};
+
 class PeerDiscovery::DomainPeerDiscovery
 {
 public:
@@ -65,6 +79,17 @@ private:
     bool lrunning_ {false};
     bool drunning_ {false};
 
+    // Only used on the io context thread
+    asio::steady_timer announceTimer_;
+    asio::steady_timer answerTimer_;
+    std::chrono::steady_clock::duration announceInterval_ {ANNOUNCE_MIN_INTERVAL};
+    std::chrono::steady_clock::time_point lastAnnounce_ {};
+    // peers waiting for an answer, with the time of their first query
+    std::map<asio::ip::udp::endpoint, std::chrono::steady_clock::time_point> queriers_;
+    // peers heard from, to detect changes of the peer set
+    std::set<asio::ip::udp::endpoint> peers_;
+    std::mt19937_64 rd_ {crypto::random_device{}()};
+
     void loopListener();
     void query(const asio::ip::udp::endpoint& peer);
     void reloadMessages();
@@ -74,6 +99,16 @@ private:
 
     void publish(const asio::ip::udp::endpoint& peer);
 
+    /** Multicasts the services, then schedules the next announcement */
+    void announce();
+    /** Restarts announcements from the minimum interval */
+    void resetAnnounce(std::chrono::steady_clock::duration delay);
+    /** Sends the services to querier after a random delay, unless multicast meanwhile */
+    void answer(const asio::ip::udp::endpoint& querier);
+    /** Called with a message of peer, to detect changes of the peer set */
+    void onPeerMessage(const asio::ip::udp::endpoint& peer, const char* data, size_t size);
+    std::chrono::steady_clock::duration randomDelay(std::chrono::steady_clock::duration max);
+
     void reDiscover();
 };
 
@@ -83,6 +118,8 @@ PeerDiscovery::DomainPeerDiscovery::DomainPeerDiscovery(asio::ip::udp domain, in
     , sockFd_(*ioContext_, domain)
     , sockAddrSend_(asio::ip::address::from_string(domain.family() == AF_INET ? MULTICAST_ADDRESS_IPV4
                                                                               : MULTICAST_ADDRESS_IPV6), port)
+    , announceTimer_(*ioContext_)
+    , answerTimer_(*ioContext_)
 {
     try {
         sockFd_.set_option(asio::ip::multicast::join_group(sockAddrSend_.address()));
@@ -133,9 +170,10 @@ PeerDiscovery::DomainPeerDiscovery::loopListener()
             msgpack::object obj = rcv.get();
 
             if (obj.type == msgpack::type::STR) {
-                if (lrunning_ and obj.as<std::string>() == "q")
-                    publish(receiveFrom_);
+                if (obj.as<std::string>() == "q")
+                    answer(receiveFrom_);
             } else if (obj.type == msgpack::type::MAP) {
+                onPeerMessage(receiveFrom_, receiveBuf_.data(), bytes);
                 for (unsigned i = 0; i < obj.via.map.size; i++) {
                     auto& o = obj.via.map.ptr[i];
                     if (o.key.type != msgpack::type::STR)
@@ -215,7 +253,7 @@ PeerDiscovery::DomainPeerDiscovery::startPublish(const std::string &type, const
     messages_[type] = std::move(pack_buf_c);
     reloadMessages();
     lrunning_ = true;
-    ioContext_->post([this] () { publish(sockAddrSend_); });
+    ioContext_->post([this] () { resetAnnounce(ANNOUNCE_DELAY); });
 }
 
 bool
@@ -237,8 +275,10 @@ PeerDiscovery::DomainPeerDiscovery::stopPublish(const std::string& type)
     if (messages_.erase(type) > 0) {
         if (messages_.empty())
             stopPublish();
-        else
+        else {
             reloadMessages();
+            ioContext_->post([this] () { resetAnnounce(ANNOUNCE_DELAY); });
+        }
         return true;
     }
     return false;
@@ -294,11 +334,111 @@ PeerDiscovery::DomainPeerDiscovery::reDiscover()
     query(sockAddrSend_);
 }
 
+std::chrono::steady_clock::duration
+PeerDiscovery::DomainPeerDiscovery::randomDelay(std::chrono::steady_clock::duration max)
+{
+    return std::chrono::steady_clock::duration(
+        std::uniform_int_distribution<std::chrono::steady_clock::rep>{0, max.count()}(rd_));
+}
+
+void
+PeerDiscovery::DomainPeerDiscovery::announce()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (not lrunning_)
+            return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    // a query was just answered, skip this one
+    if (now - lastAnnounce_ >= ANNOUNCE_MIN_INTERVAL / 2) {
+        publish(sockAddrSend_);
+        lastAnnounce_ = now;
+        // the queriers received the announcement
+        if (not queriers_.empty()) {
+            queriers_.clear();
+            answerTimer_.cancel();
+        }
+    }
+
+    // next announcement in [interval/2, interval]
+    announceInterval_ = std::min<std::chrono::steady_clock::duration>(announceInterval_ * 2, ANNOUNCE_MAX_INTERVAL);
+    announceTimer_.expires_after(announceInterval_ / 2 + randomDelay(announceInterval_ / 2));
+    announceTimer_.async_wait([this](const asio::error_code& ec) {
+        if (ec != asio::error::operation_aborted)
+            announce();
+    });
+}
+
+void
+PeerDiscovery::DomainPeerDiscovery::resetAnnounce(std::chrono::steady_clock::duration delay)
+{
+    announceInterval_ = ANNOUNCE_MIN_INTERVAL / 2;
+    announceTimer_.expires_after(delay);
+    announceTimer_.async_wait([this](const asio::error_code& ec) {
+        if (ec != asio::error::operation_aborted)
+            announce();
+    });
+}
+
+void
+PeerDiscovery::DomainPeerDiscovery::answer(const asio::ip::udp::endpoint& querier)
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (not lrunning_)
+            return;
+    }
+    // queriers are answered together, once each
+    bool pending = not queriers_.empty();
+    if (queriers_.size() < MAX_KNOWN_PEERS)
+        queriers_.emplace(querier, std::chrono::steady_clock::now());
+    if (pending)
+        return;
+    answerTimer_.expires_after(randomDelay(ANSWER_MAX_DELAY));
+    answerTimer_.async_wait([this](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        auto queriers = std::move(queriers_);
+        queriers_.clear();
+        for (const auto& q : queriers)
+            // an announcement since the query answered it
+            if (lastAnnounce_ < q.second)
+                publish(q.first);
+    });
+}
+
+void
+PeerDiscovery::DomainPeerDiscovery::onPeerMessage(const asio::ip::udp::endpoint& peer, const char* data, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        // our own announcement, looped back
+        if (size == sbuf_.size() and std::equal(data, data + size, sbuf_.data()))
+            return;
+    }
+    if (peers_.size() >= MAX_KNOWN_PEERS)
+        peers_.clear();
+    // the content of known peers changes, for instance with the nodes
+    // they export for LAN bootstrap: only a new peer is a change
+    if (not peers_.emplace(peer).second)
+        return;
+    // the peer set changed: announce more often again
+    if (announceInterval_ > ANNOUNCE_MIN_INTERVAL) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (lrunning_)
+            resetAnnounce(ANNOUNCE_MIN_INTERVAL / 2 + randomDelay(ANNOUNCE_MIN_INTERVAL / 2));
+    }
+}
+
 void
 PeerDiscovery::DomainPeerDiscovery::connectivityChanged()
 {
     reDiscover();
-    publish(sockAddrSend_);
+    ioContext_->post([this] () {
+        peers_.clear();
+        resetAnnounce(ANNOUNCE_DELAY);
+    });
 }
 
 PeerDiscovery::PeerDiscovery(in_port_t port, Sp<asio::io_context> ioContext, Sp<Logger> logger)
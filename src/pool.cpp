@@ -0,0 +1,82 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+
+#include <algorithm>
+
+namespace dht {
+
+constexpr size_t BlockPool::STRIPES;
+
+BlockPool::~BlockPool()
+{
+    for (auto& s : stripes_)
+        for (auto c : s.chunks)
+            ::operator delete(c);
+}
+
+BlockPool::Stripe&
+BlockPool::stripe()
+{
+    static std::atomic<unsigned> threads {0};
+    static thread_local const unsigned index = threads++;
+    return stripes_[index % STRIPES];
+}
+
+void*
+BlockPool::allocate(size_t size)
+{
+    size_t block_size = 0;
+    if (block_size_.compare_exchange_strong(block_size, size) or block_size == size) {
+        constexpr size_t align = alignof(std::max_align_t);
+        const size_t stride = (std::max(size, sizeof(FreeBlock)) + align - 1) / align * align;
+        auto& s = stripe();
+        std::lock_guard<std::mutex> lk(s.lock);
+        if (not s.free) {
+            auto chunk = static_cast<unsigned char*>(::operator new(stride * chunk_blocks_));
+            s.chunks.emplace_back(chunk);
+            chunk_count_++;
+            for (size_t i = chunk_blocks_; i--;) {
+                auto b = reinterpret_cast<FreeBlock*>(chunk + i * stride);
+                b->next = s.free;
+                s.free = b;
+            }
+        }
+        auto b = s.free;
+        s.free = b->next;
+        return b;
+    }
+    return ::operator new(size);
+}
+
+void
+BlockPool::deallocate(void* p, size_t size)
+{
+    if (size == block_size_.load()) {
+        auto& s = stripe();
+        std::lock_guard<std::mutex> lk(s.lock);
+        auto b = static_cast<FreeBlock*>(p);
+        b->next = s.free;
+        s.free = b;
+        return;
+    }
+    ::operator delete(p);
+}
+
+}
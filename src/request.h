@@ -85,6 +85,8 @@ struct Request {
 
     Tid getTid() const { return tid; }
     MessageType getType() const { return type; }
+    /** Size of the serialized message, cleared when the request is over */
+    size_t getMessageSize() const { return msg.size(); }
 
     void setExpired() {
         if (pending()) {
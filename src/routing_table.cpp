@@ -109,42 +109,41 @@ std::vector<Sp<Node>>
 RoutingTable::findClosestNodes(const InfoHash id, time_point now, size_t count) const
 {
     std::vector<Sp<Node>> nodes;
-    nodes.reserve(count);
     auto bucket = findBucket(id);
 
     if (bucket == end()) { return nodes; }
 
-    auto sortedBucketInsert = [&](const Bucket &b) {
-        for (auto n : b.nodes) {
+    // collect candidates from the closest buckets, then sort them once
+    std::vector<Sp<Node>> candidates;
+    std::vector<InfoHash> ids;
+    candidates.reserve(2 * count);
+    ids.reserve(2 * count);
+    auto bucketInsert = [&](const Bucket &b) {
+        for (const auto& n : b.nodes) {
             if (not n->isGood(now))
                 continue;
-
-            auto here = std::find_if(nodes.begin(), nodes.end(),
-                [&id,&n](Sp<Node> &node) {
-                    return id.xorCmp(n->id, node->id) < 0;
-                }
-            );
-            nodes.insert(here, n);
+            candidates.emplace_back(n);
+            ids.emplace_back(n->id);
         }
     };
 
     auto itn = bucket;
     auto itp = (bucket == begin()) ? end() : std::prev(bucket);
-    while (nodes.size() < count && (itn != end() || itp != end())) {
+    while (candidates.size() < count && (itn != end() || itp != end())) {
         if (itn != end()) {
-            sortedBucketInsert(*itn);
+            bucketInsert(*itn);
             itn = std::next(itn);
         }
         if (itp != end()) {
-            sortedBucketInsert(*itp);
+            bucketInsert(*itp);
             itp = (itp == begin()) ? end() : std::prev(itp);
         }
     }
 
-    // shrink to the count closest nodes.
-    if (nodes.size() > count) {
-        nodes.resize(count);
-    }
+    auto closest = id.closest(ids.data(), ids.size(), count);
+    nodes.reserve(closest.size());
+    for (auto i : closest)
+        nodes.emplace_back(std::move(candidates[i]));
     return nodes;
 }
 
@@ -153,15 +152,11 @@ RoutingTable::findBucket(const InfoHash& id)
 {
     if (empty())
         return end();
-    auto b = begin();
-    while (true) {
-        auto next = std::next(b);
-        if (next == end())
-            return b;
-        if (InfoHash::cmp(id, next->first) < 0)
-            return b;
-        b = next;
-    }
+    // last bucket starting at or before id
+    auto next = std::upper_bound(std::next(begin()), end(), id, [](const InfoHash& id, const Bucket& b) {
+        return InfoHash::cmp(id, b.first) < 0;
+    });
+    return std::prev(next);
 }
 
 RoutingTable::const_iterator
@@ -183,20 +178,27 @@ RoutingTable::split(const RoutingTable::iterator& b)
         return false;
     }
 
-    // Insert new bucket
-    insert(std::next(b), Bucket {b->af, new_id, b->time});
+    // Insert new bucket, invalidating b
+    auto nb = insert(std::next(b), Bucket {b->af, new_id, b->time});
+    auto ob = std::prev(nb);
 
     // Re-assign nodes
-    std::list<Sp<Node>> nodes {};
-    nodes.splice(nodes.begin(), b->nodes);
-    while (!nodes.empty()) {
-        auto n = nodes.begin();
-        auto b = findBucket((*n)->id);
-        if (b == end())
-            nodes.erase(n);
-        else
-            b->nodes.splice(b->nodes.begin(), nodes, n);
-    }
+    auto nodes = std::move(ob->nodes);
+    for (auto& n : nodes)
+        (InfoHash::cmp(n->id, new_id) < 0 ? ob : nb)->nodes.emplace_back(std::move(n));
+    return true;
+}
+
+bool
+RoutingTable::restoreNode(const Sp<Node>& node)
+{
+    auto b = findBucket(node->id);
+    if (b == end() or b->nodes.full())
+        return false;
+    for (const auto& n : b->nodes)
+        if (n == node)
+            return false;
+    b->nodes.emplace_back(node);
     return true;
 }
 
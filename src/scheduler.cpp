@@ -0,0 +1,219 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+#include "tracepoints.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace dht {
+
+constexpr size_t Scheduler::TASK_INLINE_SIZE;
+
+Scheduler::~Scheduler()
+{
+    // Jobs are released once all of them are unlinked:
+    // destroying one may cancel others.
+    std::vector<Sp<Job>> jobs;
+    for (auto& head : slots_)
+        while (head)
+            jobs.emplace_back(unlink(*head));
+}
+
+void
+Scheduler::add(const Sp<Scheduler::Job>& job, time_point t)
+{
+    if (job->scheduler_)
+        job->scheduler_->unlink(*job);
+    if (t == time_point::max() or not job->do_)
+        return;
+    job->time_ = t;
+    job->seq_ = ++seq_;
+    job->self_ = job;
+    job->scheduler_ = this;
+    link(*job);
+}
+
+time_point
+Scheduler::run()
+{
+    std::vector<Sp<Job>> ready;
+    for (;;) {
+        collect(ready);
+        if (ready.empty())
+            break;
+        std::sort(ready.begin(), ready.end(), [](const Sp<Job>& a, const Sp<Job>& b) {
+            return a->time_ < b->time_ or (a->time_ == b->time_ and a->seq_ < b->seq_);
+        });
+        for (const auto& job : ready) {
+            // a previous job may have rescheduled this one
+            if (job->scheduled())
+                continue;
+            if (job->do_) {
+                DHT_TRACE(job__entry, job.get(), std::chrono::duration_cast<std::chrono::nanoseconds>(now - job->time_).count());
+                // the job may reschedule itself: arguments are evaluated first
+                DHT_TRACE_RETURN(job__return, job.get(), std::chrono::duration_cast<std::chrono::nanoseconds>(now - job->time_).count());
+                job->do_();
+            }
+        }
+        /*
+         * Jobs rescheduled before "now" are run by the next pass.
+         * Running jobs scheduled before "now" prevents run+rescheduling
+         * loops before this method ends. It is garanteed by the fact that a
+         * job will at least be scheduled for "now" and not before.
+         */
+        ready.clear();
+    }
+    return getNextJobTime();
+}
+
+time_point
+Scheduler::getNextJobTime() const
+{
+    if (next_valid_)
+        return next_;
+    next_ = time_point::max();
+    next_valid_ = true;
+    // The first non-empty slot of the lowest non-empty level holds the next job
+    for (unsigned level = 0; level < LEVELS; level++) {
+        if (counts_[level] == 0)
+            continue;
+        auto current = (current_ >> (SLOT_BITS * level)) & SLOT_MASK;
+        for (auto i = current + (level ? 1 : 0); i < SLOTS; i++) {
+            if (auto job = slots_[level * SLOTS + i]) {
+                for (; job; job = job->next_)
+                    next_ = std::min(next_, job->time_);
+                return next_;
+            }
+        }
+    }
+    for (auto job = slots_[OVERFLOW_SLOT]; job; job = job->next_)
+        next_ = std::min(next_, job->time_);
+    return next_;
+}
+
+uint64_t
+Scheduler::tick(const time_point& t) const
+{
+    if (t <= epoch_)
+        return 0;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t - epoch_).count();
+}
+
+unsigned
+Scheduler::slotIndex(uint64_t tick) const
+{
+    // lowest level where the tick shares all upper bits with the current tick
+    for (unsigned level = 0; level < LEVELS; level++) {
+        auto shift = SLOT_BITS * (level + 1);
+        if ((tick >> shift) == (current_ >> shift))
+            return level * SLOTS + ((tick >> (SLOT_BITS * level)) & SLOT_MASK);
+    }
+    return OVERFLOW_SLOT;
+}
+
+void
+Scheduler::link(Job& job)
+{
+    auto i = slotIndex(std::max(tick(job.time_), current_));
+    auto& head = slots_[i];
+    job.slot_ = &head;
+    job.prev_ = nullptr;
+    job.next_ = head;
+    if (head)
+        head->prev_ = &job;
+    head = &job;
+    counts_[i / SLOTS]++;
+    if (next_valid_)
+        next_ = std::min(next_, job.time_);
+}
+
+Sp<Scheduler::Job>
+Scheduler::unlink(Job& job)
+{
+    if (not job.slot_)
+        return {};
+    if (job.prev_)
+        job.prev_->next_ = job.next_;
+    else
+        *job.slot_ = job.next_;
+    if (job.next_)
+        job.next_->prev_ = job.prev_;
+    counts_[(job.slot_ - slots_.data()) / SLOTS]--;
+    if (job.time_ == next_)
+        next_valid_ = false;
+    job.slot_ = nullptr;
+    job.prev_ = nullptr;
+    job.next_ = nullptr;
+    job.scheduler_ = nullptr;
+    return std::move(job.self_);
+}
+
+void
+Scheduler::cascade()
+{
+    auto redistribute = [this](unsigned i) {
+        auto job = slots_[i];
+        slots_[i] = nullptr;
+        while (job) {
+            auto next = job->next_;
+            counts_[i / SLOTS]--;
+            link(*job);
+            job = next;
+        }
+    };
+    if ((current_ & ((UINT64_C(1) << (SLOT_BITS * LEVELS)) - 1)) == 0)
+        redistribute(OVERFLOW_SLOT);
+    for (unsigned level = LEVELS - 1; level > 0; level--) {
+        if ((current_ & ((UINT64_C(1) << (SLOT_BITS * level)) - 1)) == 0)
+            redistribute(level * SLOTS + ((current_ >> (SLOT_BITS * level)) & SLOT_MASK));
+    }
+}
+
+void
+Scheduler::collect(std::vector<Sp<Job>>& ready)
+{
+    const auto target = tick(now);
+    for (;;) {
+        for (auto job = slots_[current_ & SLOT_MASK]; job;) {
+            auto next = job->next_;
+            if (job->time_ <= now)
+                ready.emplace_back(unlink(*job));
+            job = next;
+        }
+        if (current_ >= target)
+            break;
+
+        // skip to the next tick where lower levels may need to be refilled
+        unsigned level = 0;
+        while (level <= LEVELS and counts_[level] == 0)
+            level++;
+        if (level > LEVELS) {
+            current_ = target;
+            break;
+        }
+        auto next = level == 0
+            ? current_ + 1
+            : ((current_ >> (SLOT_BITS * level)) + 1) << (SLOT_BITS * level);
+        current_ = std::min(next, target);
+        cascade();
+    }
+}
+
+}
@@ -30,12 +30,16 @@ namespace dht {
  * A single "get" operation data
  */
 struct Dht::Get {
+    using ValueMap = std::map<Value::Id, Sp<Value>>;
+
     time_point start;
     Value::Filter filter;
     Sp<Query> query;
     QueryCallback query_cb;
     GetCallback get_cb;
     DoneCallback done_cb;
+    /* values received for the query, shared by coalesced value gets */
+    Sp<ValueMap> received {};
 };
 
 /**
@@ -66,8 +70,8 @@ struct Dht::SearchNode {
         Sp<Scheduler::Job> cacheExpirationJob {};
         Sp<net::Request> req {};
         Tid socketId {0};
-        CachedListenStatus(ValueStateCallback&& cb, SyncCallback scb, Tid sid)
-         : cache(std::forward<ValueStateCallback>(cb), std::forward<SyncCallback>(scb)), socketId(sid) {}
+        CachedListenStatus(ValueStateCallback&& cb, SyncCallback scb, Tid sid, size_t* memory = nullptr)
+         : cache(std::forward<ValueStateCallback>(cb), std::forward<SyncCallback>(scb), memory), socketId(sid) {}
         CachedListenStatus(CachedListenStatus&&) = delete;
         CachedListenStatus(const CachedListenStatus&) = delete;
         ~CachedListenStatus() {
@@ -380,6 +384,14 @@ struct Dht::Search {
     time_point refill_time {time_point::min()};
     time_point step_time {time_point::min()};           /* the time of the last search step */
     Sp<Scheduler::Job> nextSearchStep {};
+    /* operations to evaluate on the next step (STEP_*) */
+    unsigned step_dirty {0};
+    /* number of steps, and of node and operation pairs evaluated by them */
+    size_t step_count {0};
+    size_t step_cost {0};
+    /* step to refresh permanent values, and its time */
+    Sp<Scheduler::Job> nextRefresh {};
+    time_point refresh_time {time_point::max()};
 
     bool expired {false};              /* no node, or all nodes expired */
     bool done {false};                 /* search is over, cached for later */
@@ -391,6 +403,13 @@ struct Dht::Search {
     /* pending gets */
     std::multimap<time_point, Get> callbacks {};
 
+    /* values found by the last completed value get */
+    struct GetResult {
+        time_point time {time_point::min()};
+        Sp<Query> query {};
+        std::vector<Sp<Value>> values {};
+    } last_result {};
+
     /* listeners */
     struct SearchListener {
         Sp<Query> query;
@@ -495,29 +514,151 @@ struct Dht::Search {
     bool isAnnounced(Value::Id id) const;
     bool isListening(time_point now, duration exp) const;
 
-    void get(const Value::Filter& f, const Sp<Query>& q, const QueryCallback& qcb, const GetCallback& gcb, const DoneCallback& dcb, Scheduler& scheduler) {
+    /**
+     * Adds a get operation to the search.
+     * @return true if the get was answered by the values of a listen.
+     */
+    bool get(const Value::Filter& f, const Sp<Query>& q, const QueryCallback& qcb, const GetCallback& gcb, const DoneCallback& dcb, Scheduler& scheduler) {
         if (gcb or qcb) {
-            if (not cache.get(f, q, gcb, dcb)) {
-                const auto& now = scheduler.time();
-                callbacks.emplace(now, Get { now, f, q, qcb, gcb, dcb });
-                scheduler.edit(nextSearchStep, now);
+            if (cache.get(f, q, gcb, dcb))
+                return true;
+            const auto& now = scheduler.time();
+            if (not qcb and joinGet(now, f, q, gcb, dcb))
+                return false;
+            callbacks.emplace(now, Get { now, f, q, qcb, gcb, dcb,
+                qcb ? Sp<Get::ValueMap>{} : std::make_shared<Get::ValueMap>() });
+            scheduleStep(scheduler, STEP_GETS);
+        }
+        return false;
+    }
+
+    /**
+     * Ends a get removed from the callbacks before completion. Its pending
+     * requests are cancelled, unless they are shared with other gets.
+     */
+    void stopGet(const Get& get) {
+        bool shared = std::find_if(callbacks.begin(), callbacks.end(), [&](const std::pair<const time_point, Get>& g) {
+            return g.second.query == get.query;
+        }) != callbacks.end();
+        if (not shared) {
+            for (auto& n : nodes) {
+                auto cancel = [&](const Sp<Query>& q) {
+                    auto s = n->getStatus.find(q);
+                    if (s == n->getStatus.end())
+                        return;
+                    if (s->second and s->second->pending())
+                        n->node->cancelRequest(s->second);
+                    n->getStatus.erase(s);
+                };
+                auto pqs = n->pagination_queries.find(get.query);
+                if (pqs != n->pagination_queries.end()) {
+                    for (const auto& pq : pqs->second)
+                        cancel(pq);
+                    n->pagination_queries.erase(pqs);
+                }
+                cancel(get.query);
             }
         }
+        if (get.done_cb)
+            get.done_cb(true, getNodes());
+    }
+
+    /**
+     * Keeps the values found by a completed value get,
+     * to answer the next gets satisfied by its query.
+     */
+    void cacheResult(const Get& get, time_point now) {
+        if (not get.received or not get.query)
+            return;
+        last_result.time = now;
+        last_result.query = get.query;
+        last_result.values.clear();
+        last_result.values.reserve(get.received->size());
+        for (const auto& v : *get.received)
+            last_result.values.emplace_back(v.second);
+    }
+
+    /**
+     * Answers a value get with the last result, if it satisfies q and is
+     * more recent than ttl, or negative_ttl if no value was found.
+     * @return true if the get was answered.
+     */
+    bool getCachedResult(time_point now, duration ttl, duration negative_ttl,
+            const Value::Filter& f, const Sp<Query>& q, const GetCallback& gcb, const DoneCallback& dcb) const {
+        if (not q or not last_result.query or not q->isSatisfiedBy(*last_result.query))
+            return false;
+        auto maxAge = last_result.values.empty() ? negative_ttl : ttl;
+        if (maxAge <= duration::zero() or last_result.time + maxAge < now)
+            return false;
+        std::vector<Sp<Value>> values;
+        for (const auto& v : last_result.values)
+            if (not f or f(*v))
+                values.emplace_back(v);
+        if (not values.empty())
+            gcb(values);
+        if (dcb)
+            dcb(true, getNodes());
+        return true;
+    }
+
+    /**
+     * Coalesces a value get with an in-flight one whose query satisfies q:
+     * the new get shares its requests, and first receives the values
+     * already found, filtered by f.
+     *
+     * @return true if the get was coalesced.
+     */
+    bool joinGet(time_point now, const Value::Filter& f, const Sp<Query>& q, const GetCallback& gcb, const DoneCallback& dcb) {
+        if (not q)
+            return false;
+        for (const auto& g : callbacks) {
+            const auto& leader = g.second;
+            if (not leader.received or not leader.query or not q->isSatisfiedBy(*leader.query))
+                continue;
+            std::vector<Sp<Value>> values;
+            for (const auto& v : *leader.received)
+                if (not f or f(*v.second))
+                    values.emplace_back(v.second);
+            if (not values.empty() and not gcb(values)) {
+                if (dcb)
+                    dcb(true, getNodes());
+                return true;
+            }
+            // same start time: results received since the leader started are fresh enough
+            callbacks.emplace(now, Get { leader.start, f, leader.query, {}, gcb, dcb, leader.received });
+            return true;
+        }
+        return false;
     }
 
     size_t listen(const ValueCallback& cb, const Value::Filter& f, const Sp<Query>& q, Scheduler& scheduler) {
         //DHT_LOG.e(id, "[search %s IPv%c] listen", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
-        return cache.listen(cb, q, f, [&](const Sp<Query>& q, ValueCallback vcb, SyncCallback scb){
+        auto token = cache.listen(cb, q, f, [&](const Sp<Query>& q, ValueCallback vcb, SyncCallback scb){
             done = false;
             auto token = ++listener_token;
-            listeners.emplace(token, SearchListener{q, vcb, scb});
-            scheduler.edit(nextSearchStep, scheduler.time());
+            listeners.emplace(token, SearchListener{q, vcb, [this,&scheduler,scb](ListenSyncStatus status) {
+                scb(status);
+                /* listeners of narrower queries may now be served by this one */
+                if (status == ListenSyncStatus::SYNCED)
+                    scheduleOpExpiration(scheduler, scheduler.time());
+            }});
+            scheduleStep(scheduler, STEP_LISTENERS);
             return token;
         });
+        scheduleOpExpiration(scheduler, scheduler.time());
+        return token;
     }
 
     void cancelListen(size_t token, Scheduler& scheduler) {
         cache.cancelListen(token, scheduler.time());
+        scheduleOpExpiration(scheduler, cache.getExpiration());
+    }
+
+    /**
+     * Schedules the cache maintenance: expiration of unused operations,
+     * and merging of operations with a broader synced one.
+     */
+    void scheduleOpExpiration(Scheduler& scheduler, time_point t) {
         if (not opExpirationJob)
             opExpirationJob = scheduler.add(time_point::max(), [this,&scheduler]{
                 auto nextExpire = cache.expire(scheduler.time(), [&](size_t t){
@@ -536,7 +677,7 @@ struct Dht::Search {
                 });
                 scheduler.edit(opExpirationJob, nextExpire);
             });
-        scheduler.edit(opExpirationJob, cache.getExpiration());
+        scheduler.edit(opExpirationJob, t);
     }
 
     std::vector<Sp<Value>> getPut() const {
@@ -568,9 +709,13 @@ struct Dht::Search {
         for (auto& n : nodes) {
             auto ackIt = n->acked.find(vid);
             if (ackIt != n->acked.end()) {
-                if (ackIt->second.first)
-                    ackIt->second.first->cancel();
+                auto req = std::move(ackIt->second.first);
                 n->acked.erase(ackIt);
+                // the request may still announce other values of its batch
+                if (req and std::none_of(n->acked.begin(), n->acked.end(), [&](const SearchNode::AnnounceStatus::value_type& a) {
+                        return a.second.first == req;
+                    }))
+                    req->cancel();
             }
         }
         return canceled;
@@ -613,6 +758,31 @@ struct Dht::Search {
         }
     }
 
+    /**
+     * Picks the node to send the next request to, among the first
+     * "window" nodes that can be sent query q, closest first:
+     * the one with the lowest expected latency.
+     *
+     * @return the node, or nullptr if no node can be sent the request.
+     */
+    SearchNode* selectNode(time_point now, time_point update, const Sp<Query>& q, unsigned window) const {
+        SearchNode* best = nullptr;
+        duration best_latency {};
+        unsigned candidates = 0;
+        for (const auto& sn : nodes) {
+            if (not sn->canGet(now, update, q))
+                continue;
+            auto latency = sn->node->getExpectedLatency();
+            if (not best or latency < best_latency) {
+                best = sn.get();
+                best_latency = latency;
+            }
+            if (++candidates >= window)
+                break;
+        }
+        return best;
+    }
+
     /**
      * @return The number of non-good search nodes.
      */
@@ -729,12 +899,25 @@ struct Dht::Search {
 
     std::vector<Sp<Node>> getNodes() const;
 
+    /**
+     * Schedules a step of the search for now,
+     * evaluating at least the given operations.
+     */
+    void scheduleStep(Scheduler& scheduler, unsigned what = STEP_ALL) {
+        step_dirty |= what;
+        scheduler.edit(nextSearchStep, scheduler.time());
+    }
+
     void clear() {
         announce.clear();
         callbacks.clear();
         listeners.clear();
         nodes.clear();
         nextSearchStep.reset();
+        if (nextRefresh)
+            nextRefresh->cancel();
+        nextRefresh.reset();
+        refresh_time = time_point::max();
     }
 };
 
@@ -23,6 +23,8 @@
 
 #include "securedht.h"
 #include "rng.h"
+#include "thread_pool.h"
+#include "identity_pool.h"
 
 #include "default_types.h"
 
@@ -36,9 +38,20 @@ extern "C" {
 
 namespace dht {
 
+/* typical memory of parsed certificates and public keys, GnuTLS structures included */
+constexpr size_t CERTIFICATE_MEMORY {4096};
+constexpr size_t PUBLIC_KEY_MEMORY {1024};
+
 SecureDht::SecureDht(std::unique_ptr<DhtInterface> dht, SecureDht::Config conf)
-: dht_(std::move(dht)), key_(conf.id.first), certificate_(conf.id.second), enableCache_(conf.cert_cache_all)
+: dht_(std::move(dht)), key_(conf.id.first), certificate_(conf.id.second),
+  nodesCertificates_(conf.key_cache_size, conf.key_cache_ttl), nodesPubKeys_(conf.key_cache_size, conf.key_cache_ttl),
+  sessionKeyLifetime_(conf.session_key_lifetime), sessionKeyMaxUse_(conf.session_key_max_use),
+  outgoingSessions_(conf.key_cache_size, conf.session_key_lifetime), incomingSessions_(conf.key_cache_size, conf.key_cache_ttl),
+  enableCache_(conf.cert_cache_all),
+  signatureCacheSize_(conf.signature_cache_size), signatureCache_(0, SeededIdHash {crypto::random_device{}()})
 {
+    if (not key_ and not certificate_ and conf.identity_pool)
+        std::tie(key_, certificate_) = conf.identity_pool->get();
     if (!dht_) return;
     for (const auto& type : DEFAULT_TYPES)
         registerType(type);
@@ -65,16 +78,56 @@ SecureDht::SecureDht(std::unique_ptr<DhtInterface> dht, SecureDht::Config conf)
     }
 }
 
-SecureDht::~SecureDht() = default;
+struct SecureDht::CheckQueue {
+    /* A reply, or the end of a get operation if done is set */
+    struct Entry {
+        std::vector<Sp<Value>> values;
+        bool expired {false};
+        /* per value: 0 if not checked in the pool, 1 if valid, 2 if not */
+        std::vector<uint8_t> valid;
+        std::atomic<size_t> pending {0};
+        bool ready {false};
+        std::function<void()> done;
+    };
+
+    ValueCallback cb;
+    Value::Filter filter;
+    std::deque<Sp<Entry>> entries;
+    /* set once the callback returned false or the listen was cancelled */
+    bool stopped {false};
+};
+
+SecureDht::~SecureDht()
+{
+    *self_ = nullptr;
+    // checks running in the pool hold values received by this node
+    std::unique_lock<std::mutex> lk(runningChecks_->lock);
+    runningChecks_->cv.wait(lk, [&]{ return runningChecks_->count == 0; });
+}
+
+MemoryStats
+SecureDht::getMemoryStats() const
+{
+    // cache entries: a map entry and a list entry, of about 6 pointers
+    constexpr size_t ENTRY_OVERHEAD {6 * sizeof(void*) + 2 * HASH_LEN};
+    auto stats = dht_->getMemoryStats();
+    stats.certificates = nodesCertificates_.size() * (CERTIFICATE_MEMORY + ENTRY_OVERHEAD)
+        + nodesPubKeys_.size() * (PUBLIC_KEY_MEMORY + ENTRY_OVERHEAD)
+        + outgoingSessions_.size() * (sizeof(OutgoingSession) + ENTRY_OVERHEAD)
+        + incomingSessions_.size() * (sizeof(crypto::SessionKey) + ENTRY_OVERHEAD)
+        + signatureCache_.size() * (sizeof(decltype(signatureCache_)::value_type) + ENTRY_OVERHEAD);
+    return stats;
+}
 
 ValueType
 SecureDht::secureType(ValueType&& type)
 {
     type.storePolicy = [this,type](InfoHash id, Sp<Value>& v, const InfoHash& nid, const SockAddr& a) {
         if (v->isSigned()) {
-            if (!v->signatureChecked) {
+            if (!v->signatureChecked and !lookupSignature(*v)) {
                 v->signatureChecked = true;
                 v->signatureValid = v->owner and v->owner->checkSignature(v->getToSign(), v->signature);
+                cacheSignature(*v);
             }
             if (!v->signatureValid) {
                 if (logger_)
@@ -92,9 +145,10 @@ SecureDht::secureType(ValueType&& type)
                 logger_->w("Edition forbidden: owner changed.");
             return false;
         }
-        if (!n->signatureChecked) {
+        if (!n->signatureChecked and !lookupSignature(*n)) {
             n->signatureChecked = true;
             n->signatureValid = o->owner and o->owner->checkSignature(n->getToSign(), n->signature);
+            cacheSignature(*n);
         }
         if (!n->signatureValid) {
             if (logger_)
@@ -122,11 +176,7 @@ SecureDht::getCertificate(const InfoHash& node) const
 {
     if (node == getId())
         return certificate_;
-    auto it = nodesCertificates_.find(node);
-    if (it == nodesCertificates_.end())
-        return nullptr;
-    else
-        return it->second;
+    return nodesCertificates_.get(node);
 }
 
 const Sp<const crypto::PublicKey>
@@ -134,11 +184,7 @@ SecureDht::getPublicKey(const InfoHash& node) const
 {
     if (node == getId())
         return std::make_shared<crypto::PublicKey>(certificate_->getPublicKey());
-    auto it = nodesPubKeys_.find(node);
-    if (it == nodesPubKeys_.end())
-        return nullptr;
-    else
-        return it->second;
+    return nodesPubKeys_.get(node);
 }
 
 const Sp<crypto::Certificate>
@@ -154,12 +200,8 @@ SecureDht::registerCertificate(const InfoHash& node, const Blob& data)
     if (node == h) {
         if (logger_)
             logger_->d("Registering certificate for %s", h.toString().c_str());
-        auto it = nodesCertificates_.find(h);
-        if (it == nodesCertificates_.end())
-            std::tie(it, std::ignore) = nodesCertificates_.emplace(h, std::move(crt));
-        else
-            it->second = std::move(crt);
-        return it->second;
+        nodesCertificates_.put(h, crt);
+        return crt;
     } else {
         if (logger_)
             logger_->w("Certificate %s for node %s does not match node id !", h.toString().c_str(), node.toString().c_str());
@@ -171,7 +213,7 @@ void
 SecureDht::registerCertificate(Sp<crypto::Certificate>& cert)
 {
     if (cert)
-        nodesCertificates_[cert->getId()] = cert;
+        nodesCertificates_.put(cert->getId(), cert);
 }
 
 void
@@ -190,15 +232,35 @@ SecureDht::findCertificate(const InfoHash& node, const std::function<void(const
         if (not res.empty()) {
             if (logger_)
                 logger_->d("Registering certificate from local store for %s", node.to_c_str());
-            nodesCertificates_.emplace(node, res.front());
+            nodesCertificates_.put(node, res.front(), false);
             if (cb)
                 cb(res.front());
             return;
         }
     }
 
+    // a single lookup for concurrent calls
+    auto l = certificateLookups_.find(node);
+    if (l != certificateLookups_.end()) {
+        if (cb)
+            l->second.emplace_back(cb);
+        return;
+    }
+    auto& cbs = certificateLookups_[node];
+    if (cb)
+        cbs.emplace_back(cb);
+
     auto found = std::make_shared<bool>(false);
-    dht_->get(node, [cb,node,found,this](const std::vector<Sp<Value>>& vals) {
+    auto done = [this, node](const Sp<crypto::Certificate>& cert) {
+        auto l = certificateLookups_.find(node);
+        if (l == certificateLookups_.end())
+            return;
+        auto cbs = std::move(l->second);
+        certificateLookups_.erase(l);
+        for (const auto& cb : cbs)
+            cb(cert);
+    };
+    dht_->get(node, [node,found,done,this](const std::vector<Sp<Value>>& vals) {
         if (*found)
             return false;
         for (const auto& v : vals) {
@@ -206,15 +268,14 @@ SecureDht::findCertificate(const InfoHash& node, const std::function<void(const
                 *found = true;
                 if (logger_)
                     logger_->d(node, "Found certificate for %s", node.to_c_str());
-                if (cb)
-                    cb(cert);
+                done(cert);
                 return false;
             }
         }
         return true;
-    }, [cb,found](bool) {
-        if (!*found and cb)
-            cb(nullptr);
+    }, [found,done](bool) {
+        if (!*found)
+            done(nullptr);
     }, Value::TypeFilter(CERTIFICATE_TYPE));
 }
 
@@ -233,7 +294,7 @@ SecureDht::findPublicKey(const InfoHash& node, const std::function<void(const Sp
         if (crt && *crt) {
             auto pk = std::make_shared<crypto::PublicKey>(crt->getPublicKey());
             if (*pk) {
-                nodesPubKeys_[pk->getId()] = pk;
+                nodesPubKeys_.put(pk->getId(), pk);
                 if (cb) cb(pk);
                 return;
             }
@@ -262,8 +323,8 @@ SecureDht::checkValue(const Sp<Value>& v)
             Value decrypted_val (decrypt(*v));
             if (decrypted_val.recipient == getId()) {
                 if (decrypted_val.owner)
-                    nodesPubKeys_[decrypted_val.owner->getId()] = decrypted_val.owner;
-                v->decryptedValue = std::make_shared<Value>(std::move(decrypted_val));
+                    nodesPubKeys_.put(decrypted_val.owner->getId(), decrypted_val.owner);
+                v->decryptedValue = makeValue(std::move(decrypted_val));
                 return v->decryptedValue;
             }
             // Ignore values belonging to other people
@@ -274,18 +335,11 @@ SecureDht::checkValue(const Sp<Value>& v)
     }
     // Check signed values
     else if (v->isSigned()) {
-        if (v->signatureChecked) {
+        if (v->signatureChecked or lookupSignature(*v)) {
             return v->signatureValid ? v : Sp<Value>{};
         }
-        v->signatureChecked = true;
-        if (v->owner and v->owner->checkSignature(v->getToSign(), v->signature)) {
-            v->signatureValid = true;
-            if (enableCache_)
-                nodesPubKeys_[v->owner->getId()] = v->owner;
-            return v;
-        }
-        else if (logger_)
-            logger_->w("Signature verification failed for %s", v->toString().c_str());
+        setSignatureChecked(*v, v->owner and v->owner->checkSignature(v->getToSign(), v->signature));
+        return v->signatureValid ? v : Sp<Value>{};
     }
     // Forward normal values
     else {
@@ -294,60 +348,240 @@ SecureDht::checkValue(const Sp<Value>& v)
     return {};
 }
 
-ValueCallback
-SecureDht::getCallbackFilter(const ValueCallback& cb, Value::Filter&& filter)
+/* Key of a signature check: SHA-256 of the signed data, which includes the owner key, and of the signature */
+static h256
+signatureKey(const Value& v)
 {
-    return [=](const std::vector<Sp<Value>>& values, bool expired) {
-        std::vector<Sp<Value>> tmpvals {};
-        if (not filter)
-            tmpvals.reserve(values.size());
-        for (const auto& v : values) {
-            if (auto nv = checkValue(v))
-                if (not filter or filter(*nv))
-                    tmpvals.emplace_back(std::move(nv));
-        }
-        if (cb and not tmpvals.empty())
-            return cb(tmpvals, expired);
+    auto data = v.getToSign();
+    data.insert(data.end(), v.signature.begin(), v.signature.end());
+    auto h = crypto::hash(data, h256::size());
+    return h256(h.data(), h.size());
+}
+
+bool
+SecureDht::lookupSignature(Value& v)
+{
+    if (not signatureCacheSize_)
+        return false;
+    auto it = signatureCache_.find(signatureKey(v));
+    if (it == signatureCache_.end())
+        return false;
+    signatureLru_.splice(signatureLru_.begin(), signatureLru_, it->second.lru);
+    v.signatureChecked = true;
+    v.signatureValid = it->second.valid;
+    return true;
+}
+
+void
+SecureDht::cacheSignature(const Value& v)
+{
+    if (not signatureCacheSize_)
+        return;
+    auto key = signatureKey(v);
+    auto it = signatureCache_.find(key);
+    if (it != signatureCache_.end()) {
+        it->second.valid = v.signatureValid;
+        return;
+    }
+    signatureLru_.emplace_front(key);
+    signatureCache_.emplace(key, SignatureCheck {v.signatureValid, signatureLru_.begin()});
+    if (signatureCache_.size() > signatureCacheSize_) {
+        signatureCache_.erase(signatureLru_.back());
+        signatureLru_.pop_back();
+    }
+}
+
+void
+SecureDht::setSignatureChecked(Value& v, bool valid)
+{
+    v.signatureChecked = true;
+    v.signatureValid = valid;
+    cacheSignature(v);
+    if (valid) {
+        if (enableCache_)
+            nodesPubKeys_.put(v.owner->getId(), v.owner);
+    } else if (logger_)
+        logger_->w("Signature verification failed for %s", v.toString().c_str());
+}
+
+bool
+SecureDht::filterValues(CheckQueue& q, const std::vector<Sp<Value>>& values, bool expired)
+{
+    std::vector<Sp<Value>> tmpvals {};
+    if (not q.filter)
+        tmpvals.reserve(values.size());
+    for (const auto& v : values) {
+        if (auto nv = checkValue(v))
+            if (not q.filter or q.filter(*nv))
+                tmpvals.emplace_back(std::move(nv));
+    }
+    if (q.cb and not tmpvals.empty())
+        return q.cb(tmpvals, expired);
+    return true;
+}
+
+bool
+SecureDht::enqueueValues(const Sp<CheckQueue>& q, const std::vector<Sp<Value>>& values, bool expired)
+{
+    if (q->stopped)
+        return false;
+    std::vector<size_t> toCheck;
+    for (size_t i = 0; i < values.size(); i++) {
+        auto& v = *values[i];
+        if (not v.isEncrypted() and v.isSigned() and not v.signatureChecked and not lookupSignature(v))
+            toCheck.emplace_back(i);
+    }
+    if (q->entries.empty() and toCheck.size() < ASYNC_CHECK_MIN)
+        return filterValues(*q, values, expired);
+
+    // keep the order of replies: wait for earlier ones to be checked
+    auto e = std::make_shared<CheckQueue::Entry>();
+    e->values = values;
+    e->expired = expired;
+    q->entries.emplace_back(e);
+    if (toCheck.empty()) {
+        e->ready = true;
         return true;
-    };
+    }
+
+    e->valid.resize(values.size());
+    auto tasks = (toCheck.size() + CHECK_CHUNK - 1) / CHECK_CHUNK;
+    e->pending = tasks;
+    {
+        std::lock_guard<std::mutex> lk(runningChecks_->lock);
+        runningChecks_->count += tasks;
+    }
+    auto indexes = std::make_shared<std::vector<size_t>>(std::move(toCheck));
+    for (size_t t = 0; t < tasks; t++) {
+        auto begin = t * CHECK_CHUNK;
+        auto end = std::min(begin + CHECK_CHUNK, indexes->size());
+        ThreadPool::computation().run([e, q, indexes, begin, end, self = self_, onLoop = onLoop_, running = runningChecks_] {
+            for (auto i = begin; i < end; i++) {
+                auto idx = (*indexes)[i];
+                const auto& v = *e->values[idx];
+                bool valid = v.owner and v.owner->checkSignature(v.getToSign(), v.signature);
+                e->valid[idx] = valid ? 1 : 2;
+            }
+            if (e->pending.fetch_sub(1) == 1) {
+                (*onLoop)([e, q, self] {
+                    if (auto dht = *self) {
+                        e->ready = true;
+                        dht->drainChecks(*q);
+                    }
+                });
+            }
+            std::lock_guard<std::mutex> lk(running->lock);
+            if (--running->count == 0)
+                running->cv.notify_all();
+        });
+    }
+    return true;
 }
 
+void
+SecureDht::drainChecks(CheckQueue& q)
+{
+    while (not q.entries.empty() and q.entries.front()->ready) {
+        auto e = std::move(q.entries.front());
+        q.entries.pop_front();
+        // a stopped get still completes
+        if (e->done) {
+            e->done();
+            continue;
+        }
+        if (q.stopped)
+            continue;
+        for (size_t i = 0; i < e->valid.size(); i++) {
+            auto& v = *e->values[i];
+            if (e->valid[i] and not v.signatureChecked)
+                setSignatureChecked(v, e->valid[i] == 1);
+        }
+        if (not filterValues(q, e->values, e->expired))
+            q.stopped = true;
+    }
+}
+
+ValueCallback
+SecureDht::getCallbackFilter(const ValueCallback& cb, Value::Filter&& filter, Sp<CheckQueue>* queue)
+{
+    auto q = std::make_shared<CheckQueue>();
+    q->cb = cb;
+    q->filter = std::move(filter);
+    if (queue)
+        *queue = q;
+    if (not onLoop_) {
+        return [this, q](const std::vector<Sp<Value>>& values, bool expired) {
+            return filterValues(*q, values, expired);
+        };
+    }
+    return [this, q](const std::vector<Sp<Value>>& values, bool expired) {
+        return enqueueValues(q, values, expired);
+    };
+}
 
 GetCallback
-SecureDht::getCallbackFilter(const GetCallback& cb, Value::Filter&& filter)
+SecureDht::getCallbackFilter(const GetCallback& cb, Value::Filter&& filter, Sp<CheckQueue>* queue)
 {
-    return [=](const std::vector<Sp<Value>>& values) {
-        std::vector<Sp<Value>> tmpvals {};
-        if (not filter)
-            tmpvals.reserve(values.size());
-        for (const auto& v : values) {
-            if (auto nv = checkValue(v))
-                if (not filter or filter(*nv))
-                    tmpvals.emplace_back(std::move(nv));
-        }
-        if (cb and not tmpvals.empty())
-            return cb(tmpvals);
-        return true;
+    auto vcb = getCallbackFilter(ValueCallback([cb](const std::vector<Sp<Value>>& values, bool) {
+        return cb(values);
+    }), std::move(filter), queue);
+    return [vcb](const std::vector<Sp<Value>>& values) {
+        return vcb(values, false);
     };
 }
 
 void
 SecureDht::get(const InfoHash& id, GetCallback cb, DoneCallback donecb, Value::Filter&& f, Where&& w)
 {
-    dht_->get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb, {}, std::forward<Where>(w));
+    Sp<CheckQueue> q;
+    auto gcb = getCallbackFilter(cb, std::forward<Value::Filter>(f), &q);
+    if (onLoop_ and donecb) {
+        // call donecb once the values received before are delivered
+        donecb = [q, donecb](bool ok, const std::vector<Sp<Node>>& nodes) {
+            if (q->entries.empty()) {
+                donecb(ok, nodes);
+                return;
+            }
+            auto e = std::make_shared<CheckQueue::Entry>();
+            e->ready = true;
+            e->done = [donecb, ok, nodes] { donecb(ok, nodes); };
+            q->entries.emplace_back(std::move(e));
+        };
+    }
+    dht_->get(id, std::move(gcb), donecb, {}, std::forward<Where>(w));
 }
 
 size_t
 SecureDht::listen(const InfoHash& id, ValueCallback cb, Value::Filter f, Where w)
 {
-    return dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), {}, std::forward<Where>(w));
+    Sp<CheckQueue> q;
+    auto token = dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f), &q), {}, std::forward<Where>(w));
+    if (onLoop_ and token)
+        listenQueues_[token] = q;
+    return token;
 }
 
 
 size_t
 SecureDht::listen(const InfoHash& id, GetCallback cb, Value::Filter f, Where w)
 {
-    return dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), {}, std::forward<Where>(w));
+    Sp<CheckQueue> q;
+    auto token = dht_->listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f), &q), {}, std::forward<Where>(w));
+    if (onLoop_ and token)
+        listenQueues_[token] = q;
+    return token;
+}
+
+bool
+SecureDht::cancelListen(const InfoHash& h, size_t token)
+{
+    auto it = listenQueues_.find(token);
+    if (it != listenQueues_.end()) {
+        if (auto q = it->second.lock())
+            q->stopped = true;
+        listenQueues_.erase(it);
+    }
+    return dht_->cancelListen(h, token);
 }
 
 void
@@ -413,7 +647,7 @@ SecureDht::putEncrypted(const InfoHash& hash, const InfoHash& to, Sp<Value> val,
         if (logger_)
             logger_->w("Encrypting data for PK: %s", pk->getId().toString().c_str());
         try {
-            dht_->put(hash, encrypt(*val, *pk), callback, time_point::max(), permanent);
+            dht_->put(hash, encryptFor(*val, *pk), callback, time_point::max(), permanent);
         } catch (const std::exception& e) {
             if (logger_)
                 logger_->e("Error putting encrypted data: %s", e.what());
@@ -435,13 +669,44 @@ SecureDht::encrypt(Value& v, const crypto::PublicKey& to) const
     return v.encrypt(*key_, to);
 }
 
+Value
+SecureDht::encryptFor(Value& v, const crypto::PublicKey& to)
+{
+    if (sessionKeyLifetime_ <= duration::zero() or not sessionKeyMaxUse_)
+        return encrypt(v, to);
+    auto id = to.getId();
+    auto session = outgoingSessions_.get(id);
+    if (not session or not session->remaining) {
+        session = std::make_shared<OutgoingSession>(OutgoingSession {to.generateSessionKey(), sessionKeyMaxUse_});
+        outgoingSessions_.put(id, session);
+    }
+    session->remaining--;
+    return v.encrypt(*key_, to, session->key);
+}
+
+Blob
+SecureDht::decryptCypher(const Blob& cypher)
+{
+    auto block_size = key_->getCypherBlockSize();
+    if (cypher.size() <= block_size)
+        return key_->decrypt(cypher);
+    // the AES key of the sender may be reused for several values
+    auto id = InfoHash::get(cypher.data(), block_size);
+    auto session = incomingSessions_.get(id);
+    if (not session) {
+        session = std::make_shared<const crypto::SessionKey>(key_->decryptSessionKey(cypher));
+        incomingSessions_.put(id, session);
+    }
+    return session->decrypt(cypher);
+}
+
 Value
 SecureDht::decrypt(const Value& v)
 {
     if (not v.isEncrypted())
         throw DhtException("Data is not encrypted.");
 
-    auto decrypted = key_->decrypt(v.cypher);
+    auto decrypted = decryptCypher(v.cypher);
 
     Value ret {v.id};
     auto msg = msgpack::unpack((const char*)decrypted.data(), decrypted.size());
@@ -0,0 +1,241 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "simulated_network.h"
+
+#include <algorithm>
+
+namespace dht {
+namespace net {
+
+/* Addresses of nodes are 10.0.0.1 and the following ones */
+constexpr uint32_t SIMULATED_ADDRESS_BASE {0x0A000001};
+constexpr uint32_t SIMULATED_ADDRESS_MAX {0x00FFFFFE};
+constexpr in_port_t SIMULATED_PORT {4222};
+
+class SimulatedNetwork::Socket : public DatagramSocket {
+public:
+    Socket(SimulatedNetwork& net, size_t index, const SockAddr& bound)
+        : net_(net), index_(index), bound_(bound) {}
+
+    int sendTo(const SockAddr& dest, const uint8_t* data, size_t size, bool) override {
+        if (not dest)
+            return EFAULT;
+        if (dest.getFamily() != AF_INET)
+            return EAFNOSUPPORT;
+        net_.send(index_, dest, data, size);
+        return 0;
+    }
+
+    bool hasIPv4() const override { return true; }
+    bool hasIPv6() const override { return false; }
+
+    const SockAddr& getBoundRef(sa_family_t family = AF_UNSPEC) const override {
+        static const SockAddr none {};
+        return family == AF_INET6 ? none : bound_;
+    }
+
+    void stop() override {}
+
+private:
+    SimulatedNetwork& net_;
+    const size_t index_;
+    const SockAddr bound_;
+};
+
+struct SimulatedNetwork::Node {
+    SockAddr addr;
+    std::unique_ptr<Dht> dht;
+    Traffic traffic {};
+    /* time of the next wake-up scheduled */
+    time_point next {time_point::max()};
+    /* time at which the upload link is free */
+    time_point tx_free {time_point::min()};
+};
+
+bool
+SimulatedNetwork::later(const Event& a, const Event& b)
+{
+    return a.time > b.time or (a.time == b.time and a.seq > b.seq);
+}
+
+SimulatedNetwork::SimulatedNetwork() : SimulatedNetwork(Config {}) {}
+
+SimulatedNetwork::SimulatedNetwork(Config config, const Sp<Logger>& logger)
+    : config_(std::move(config)),
+    logger_(logger),
+    rd_(config_.seed),
+    latency_(config_.min_latency.count(), std::max(config_.min_latency, config_.max_latency).count()),
+    loss_(std::min(std::max(config_.loss, 0.), 1.)),
+    now_(config_.start)
+{}
+
+SimulatedNetwork::~SimulatedNetwork()
+{
+    // nodes may send packets when stopping
+    for (auto& n : nodes_)
+        n->dht.reset();
+}
+
+size_t
+SimulatedNetwork::addNode(dht::Config config)
+{
+    auto i = nodes_.size();
+    if (i >= SIMULATED_ADDRESS_MAX)
+        throw DhtException("Too many simulated nodes");
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(SIMULATED_ADDRESS_BASE + (uint32_t)i);
+    sin.sin_port = htons(SIMULATED_PORT);
+
+    auto node = std::make_unique<Node>();
+    node->addr = SockAddr((const sockaddr*)&sin, sizeof(sin));
+    if (not config.node_id)
+        config.node_id = InfoHash::getRandom(rd_);
+    if (not config.random_seed)
+        config.random_seed = rd_();
+    config.virtual_time_start = now_;
+    // added before the Dht is created, which may send packets
+    nodes_.emplace_back(std::move(node));
+    auto& n = *nodes_.back();
+    n.dht = std::make_unique<Dht>(std::make_unique<Socket>(*this, i, n.addr), config, logger_);
+    wake(i, now_);
+    return i;
+}
+
+Dht&
+SimulatedNetwork::node(size_t i)
+{
+    auto& n = *nodes_.at(i);
+    wake(i, now_);
+    return *n.dht;
+}
+
+const Dht&
+SimulatedNetwork::node(size_t i) const
+{
+    return *nodes_.at(i)->dht;
+}
+
+const SockAddr&
+SimulatedNetwork::address(size_t i) const
+{
+    return nodes_.at(i)->addr;
+}
+
+size_t
+SimulatedNetwork::find(const SockAddr& addr) const
+{
+    if (addr.getFamily() != AF_INET or addr.getPort() != SIMULATED_PORT)
+        return nodes_.size();
+    auto a = ntohl(addr.getIPv4().sin_addr.s_addr);
+    if (a < SIMULATED_ADDRESS_BASE or a - SIMULATED_ADDRESS_BASE >= nodes_.size())
+        return nodes_.size();
+    return a - SIMULATED_ADDRESS_BASE;
+}
+
+const SimulatedNetwork::Traffic&
+SimulatedNetwork::traffic(size_t i) const
+{
+    return nodes_.at(i)->traffic;
+}
+
+void
+SimulatedNetwork::bootstrap(size_t i, size_t j)
+{
+    node(i).pingNode(address(j));
+}
+
+void
+SimulatedNetwork::push(Event&& ev)
+{
+    ev.seq = seq_++;
+    events_.emplace_back(std::move(ev));
+    std::push_heap(events_.begin(), events_.end(), &SimulatedNetwork::later);
+}
+
+void
+SimulatedNetwork::wake(size_t i, const time_point& t)
+{
+    auto& n = *nodes_[i];
+    if (t >= n.next)
+        return;
+    n.next = t;
+    push(Event {t, 0, i, {}, 0});
+}
+
+void
+SimulatedNetwork::send(size_t from, const SockAddr& dest, const uint8_t* data, size_t size)
+{
+    auto& src = *nodes_[from];
+    src.traffic.packets_sent++;
+    src.traffic.bytes_sent += size;
+
+    auto to = find(dest);
+    if (to == nodes_.size() or loss_(rd_)) {
+        src.traffic.packets_lost++;
+        return;
+    }
+    // packets wait for the upload link, then travel
+    auto departure = std::max(now_, src.tx_free);
+    if (config_.bandwidth)
+        departure += std::chrono::duration_cast<duration>(std::chrono::duration<double>((double)size / config_.bandwidth));
+    src.tx_free = departure;
+    auto arrival = departure + duration(latency_(rd_));
+    push(Event {arrival, 0, to, Blob(data, data + size), from});
+}
+
+void
+SimulatedNetwork::process(Event&& ev)
+{
+    auto& n = *nodes_[ev.node];
+    time_point next;
+    if (ev.data.empty()) {
+        // skip wake-ups replaced by an earlier one
+        if (ev.time != n.next)
+            return;
+        n.next = time_point::max();
+        next = n.dht->periodic(nullptr, 0, SockAddr(), now_);
+    } else {
+        n.traffic.packets_received++;
+        n.traffic.bytes_received += ev.data.size();
+        ReceivedPacket pkt;
+        pkt.data = std::move(ev.data);
+        pkt.from = nodes_[ev.from]->addr;
+        pkt.received = now_;
+        next = n.dht->periodic(std::move(pkt), now_);
+    }
+    if (next != time_point::max())
+        wake(ev.node, std::max(next, now_));
+}
+
+void
+SimulatedNetwork::runUntil(const time_point& t)
+{
+    while (not events_.empty() and events_.front().time <= t) {
+        std::pop_heap(events_.begin(), events_.end(), &SimulatedNetwork::later);
+        auto ev = std::move(events_.back());
+        events_.pop_back();
+        now_ = std::max(now_, ev.time);
+        process(std::move(ev));
+    }
+    now_ = std::max(now_, t);
+}
+
+}
+}
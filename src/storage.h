@@ -21,8 +21,14 @@
 #include "infohash.h"
 #include "value.h"
 #include "listener.h"
+#include "callbacks.h"
 
+#include <algorithm>
+#include <limits>
+#include <list>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
 namespace dht {
@@ -32,26 +38,54 @@ namespace dht {
  */
 class StorageBucket {
 public:
-    void insert(const InfoHash& id, const Value& value, time_point expiration) {
+    struct Entry {
+        InfoHash key;
+        Value::Id vid;
+        /* reads since stored, halved when the value survives an eviction */
+        uint32_t hits {0};
+        Entry(const InfoHash& k, Value::Id v) : key(k), vid(v) {}
+    };
+    /** Position of a value in the bucket, kept by its ValueStorage */
+    using Handle = std::list<Entry>::iterator;
+
+    /* Number of least recently used values among which LFU evicts */
+    static constexpr unsigned LFU_SAMPLES {8};
+
+    Handle insert(const InfoHash& id, const Value& value) {
         totalSize_ += value.size();
-        storedValues_.emplace(expiration, std::pair<InfoHash, Value::Id>(id, value.id));
+        return storedValues_.emplace(storedValues_.end(), id, value.id);
+    }
+    void erase(Handle h, const Value& value) {
+        totalSize_ -= value.size();
+        storedValues_.erase(h);
     }
-    void erase(const InfoHash& id, const Value& value, time_point expiration) {
-        auto size = value.size();
-        totalSize_ -= size;
-        auto range = storedValues_.equal_range(expiration);
-        for (auto rit = range.first; rit != range.second;) {
-            if (rit->second.first == id && rit->second.second == value.id) {
-                storedValues_.erase(rit);
-                break;
+    /** Records a read of the value, making it the most recently used */
+    void touch(Handle h) {
+        if (h->hits < std::numeric_limits<uint32_t>::max())
+            h->hits++;
+        storedValues_.splice(storedValues_.end(), storedValues_, h);
+    }
+    size_t size() const { return totalSize_; }
+    bool empty() const { return storedValues_.empty(); }
+
+    /** @return the value to evict first, the bucket must not be empty */
+    const Entry& getEvictionCandidate(EvictionPolicy policy) {
+        if (policy != EvictionPolicy::LFU)
+            return storedValues_.front();
+        auto victim = storedValues_.begin();
+        auto it = std::next(victim);
+        for (unsigned i = 1; i < LFU_SAMPLES and it != storedValues_.end(); ++i, ++it) {
+            if (it->hits < victim->hits) {
+                victim->hits /= 2;
+                victim = it;
             } else
-                ++rit;
+                it->hits /= 2;
         }
+        return *victim;
     }
-    size_t size() const { return totalSize_; }
-    std::pair<InfoHash, Value::Id> getOldest() const { return storedValues_.begin()->second; }
 private:
-    std::multimap<time_point, std::pair<InfoHash, Value::Id>> storedValues_;
+    /* stored values, oldest or least recently used first */
+    std::list<Entry> storedValues_;
     size_t totalSize_ {0};
 };
 
@@ -60,6 +94,9 @@ struct ValueStorage {
     time_point created {};
     time_point expiration {};
     StorageBucket* store_bucket {nullptr};
+    StorageBucket::Handle bucket_handle {};
+    /* id of the owner key, set once the value is in the field indexes */
+    InfoHash owner_id {};
 
     ValueStorage() {}
     ValueStorage(const Sp<Value>& v, time_point t, time_point e)
@@ -69,12 +106,16 @@ struct ValueStorage {
 
 struct Storage {
     time_point maintenance_time {};
-    std::map<Sp<Node>, std::map<size_t, Listener>> listeners;
+    /* earliest time this storage is due in the expiration index of the Dht */
+    time_point indexed_expiration {time_point::max()};
+    RemoteListeners listeners {};
     std::map<size_t, LocalListener> local_listeners {};
     size_t listener_token {1};
 
     /* The maximum number of values we store for a given hash. */
     static constexpr unsigned MAX_VALUES {1024};
+    /* Number of values from which field indexes are maintained */
+    static constexpr unsigned INDEX_MIN_VALUES {64};
 
     /**
      * Changes caused by an operation on the storage.
@@ -107,12 +148,19 @@ struct Storage {
         return total_size;
     }
 
+    /** @return the next time a value or a remote listener expires */
+    time_point getNextExpiration() const {
+        auto t = time_point::max();
+        for (const auto& v : values)
+            t = std::min(t, v.expiration);
+        return std::min(t, listeners.getNextExpiration());
+    }
+
     const std::vector<ValueStorage>& getValues() const { return values; }
 
     Sp<Value> getById(Value::Id vid) const {
-        for (auto& v : values)
-            if (v.data->id == vid) return v.data;
-        return {};
+        auto it = index.find(vid);
+        return it == index.end() ? Sp<Value>{} : values[it->second].data;
     }
 
     std::vector<Sp<Value>> get(const Value::Filter& f = {}) const {
@@ -125,6 +173,12 @@ struct Storage {
         return newvals;
     }
 
+    /**
+     * Same as get(f) for the values matching where, using the field
+     * indexes when where pins the id, owner, value type or user type.
+     */
+    std::vector<Sp<Value>> get(const Where& where, const Value::Filter& f = {}) const;
+
     /**
      * Stores a new value in this storage, or replace a previous value
      *
@@ -144,13 +198,25 @@ struct Storage {
      * @return time of the next expiration, time_point::max() if no expiration
      */
     time_point refresh(const time_point& now, const Value::Id& vid, const TypeStore& types) {
-        for (auto& vs : values)
-            if (vs.data->id == vid) {
-                vs.created = now;
-                vs.expiration = std::max(vs.expiration, now + types.getType(vs.data->type).expiration);
-                return vs.expiration;
-            }
-        return time_point::max();
+        auto it = index.find(vid);
+        if (it == index.end())
+            return time_point::max();
+        auto& vs = values[it->second];
+        vs.created = now;
+        vs.expiration = std::max(vs.expiration, now + types.getType(vs.data->type).expiration);
+        return vs.expiration;
+    }
+
+    /** Records a read of the values, for the eviction policy */
+    void touch(const std::vector<Sp<Value>>& vals) {
+        for (const auto& v : vals) {
+            auto it = index.find(v->id);
+            if (it == index.end())
+                continue;
+            auto& vs = values[it->second];
+            if (vs.store_bucket)
+                vs.store_bucket->touch(vs.bucket_handle);
+        }
     }
 
     size_t listen(ValueCallback& cb, Value::Filter& f, const Sp<Query>& q);
@@ -159,20 +225,146 @@ struct Storage {
         local_listeners.erase(token);
     }
 
-    StoreDiff remove(const InfoHash& id, Value::Id);
+    StoreDiff remove(Value::Id);
 
-    std::pair<ssize_t, std::vector<Sp<Value>>> expire(const InfoHash& id, time_point now);
+    std::pair<ssize_t, std::vector<Sp<Value>>> expire(time_point now);
 
 private:
     Storage(const Storage&) = delete;
     Storage& operator=(const Storage&) = delete;
 
+    /* values, in insertion order except after removals */
     std::vector<ValueStorage> values {};
+    /* position of each value in values, by id */
+    std::unordered_map<Value::Id, size_t> index {};
     size_t total_size {};
+
+    /* ids of the values by field, maintained from INDEX_MIN_VALUES values */
+    using IdSet = std::unordered_set<Value::Id>;
+    bool field_indexed {false};
+    std::unordered_map<InfoHash, IdSet, SeededIdHash> by_owner {};
+    std::unordered_map<ValueType::Id, IdSet> by_type {};
+    std::unordered_map<std::string, IdSet> by_user_type {};
+
+    void reindex() {
+        index.clear();
+        for (size_t i = 0; i < values.size(); i++)
+            index.emplace(values[i].data->id, i);
+    }
+
+    void addToFieldIndex(ValueStorage& vs) {
+        const auto& v = *vs.data;
+        if (v.owner) {
+            vs.owner_id = v.owner->getId();
+            by_owner[vs.owner_id].emplace(v.id);
+        }
+        by_type[v.type].emplace(v.id);
+        if (not v.user_type.empty())
+            by_user_type[v.user_type].emplace(v.id);
+    }
+
+    template <typename Map, typename K>
+    static void unindex(Map& m, const K& k, Value::Id vid) {
+        auto it = m.find(k);
+        if (it == m.end())
+            return;
+        it->second.erase(vid);
+        if (it->second.empty())
+            m.erase(it);
+    }
+
+    void removeFromFieldIndex(const ValueStorage& vs) {
+        const auto& v = *vs.data;
+        if (v.owner)
+            unindex(by_owner, vs.owner_id, v.id);
+        unindex(by_type, v.type, v.id);
+        if (not v.user_type.empty())
+            unindex(by_user_type, v.user_type, v.id);
+    }
+
+    void buildFieldIndex() {
+        by_owner.clear();
+        by_type.clear();
+        by_user_type.clear();
+        for (auto& vs : values)
+            addToFieldIndex(vs);
+    }
+
+    void clearFieldIndex() {
+        field_indexed = false;
+        by_owner.clear();
+        by_type.clear();
+        by_user_type.clear();
+    }
+
+    /**
+     * @return the smallest set of ids holding all the values matching
+     * where, or nullptr if where pins no indexed field.
+     */
+    const IdSet* getCandidates(const Where& where) const;
 };
 
+inline std::vector<Sp<Value>>
+Storage::get(const Where& where, const Value::Filter& filter) const
+{
+    auto f = Value::Filter::chain(where.getFilter(), filter);
+    if (auto fid = where.getFieldValue(Value::Field::Id)) {
+        auto it = index.find(fid->getInt());
+        if (it == index.end())
+            return {};
+        const auto& v = values[it->second].data;
+        if (f and not f(*v))
+            return {};
+        return {v};
+    }
+    auto candidates = getCandidates(where);
+    if (not candidates)
+        return get(f);
+
+    // keep the storage order, as get(f) does
+    std::vector<size_t> pos;
+    pos.reserve(candidates->size());
+    for (const auto& vid : *candidates) {
+        auto it = index.find(vid);
+        if (it != index.end())
+            pos.emplace_back(it->second);
+    }
+    std::sort(pos.begin(), pos.end());
+    std::vector<Sp<Value>> newvals {};
+    for (auto p : pos) {
+        const auto& v = values[p].data;
+        if (not f or f(*v))
+            newvals.push_back(v);
+    }
+    return newvals;
+}
 
-size_t
+inline const Storage::IdSet*
+Storage::getCandidates(const Where& where) const
+{
+    if (not field_indexed)
+        return nullptr;
+    static const IdSet EMPTY {};
+    const IdSet* best = nullptr;
+    auto pick = [&](const auto& map, const auto& key) {
+        auto it = map.find(key);
+        const IdSet* set = it == map.end() ? &EMPTY : &it->second;
+        if (not best or set->size() < best->size())
+            best = set;
+    };
+    if (auto fv = where.getFieldValue(Value::Field::OwnerPk))
+        pick(by_owner, fv->getHash());
+    if (auto fv = where.getFieldValue(Value::Field::ValueType))
+        pick(by_type, static_cast<ValueType::Id>(fv->getInt()));
+    if (auto fv = where.getFieldValue(Value::Field::UserType)) {
+        auto b = fv->getBlob();
+        pick(by_user_type, std::string {b.begin(), b.end()});
+    }
+    return best;
+}
+
+
+inline size_t
 Storage::listen(ValueCallback& gcb, Value::Filter& filter, const Sp<Query>& query)
 {
     if (not empty()) {
@@ -188,12 +380,11 @@ Storage::listen(ValueCallback& gcb, Value::Filter& filter, const Sp<Query>& quer
 }
 
 
-std::pair<ValueStorage*, Storage::StoreDiff>
+inline std::pair<ValueStorage*, Storage::StoreDiff>
 Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, time_point expiration, StorageBucket* sb)
 {
-    auto it = std::find_if (values.begin(), values.end(), [&](const ValueStorage& vr) {
-        return vr.data == value || vr.data->id == value->id;
-    });
+    auto i = index.find(value->id);
+    auto it = i == index.end() ? values.end() : values.begin() + i->second;
     ssize_t size_new = value->size();
     if (it != values.end()) {
         /* Already there, only need to refresh */
@@ -204,13 +395,17 @@ Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, t
             //DHT_LOG.DEBUG("Updating %s -> %s", id.toString().c_str(), value->toString().c_str());
             // clear quota for previous value
             if (it->store_bucket)
-                it->store_bucket->erase(id, *value, it->expiration);
+                it->store_bucket->erase(it->bucket_handle, *it->data);
+            if (field_indexed)
+                removeFromFieldIndex(*it);
             it->expiration = expiration;
             // update quota for new value
             it->store_bucket = sb;
             if (sb)
-                sb->insert(id, *value, expiration);
+                it->bucket_handle = sb->insert(id, *value);
             it->data = value;
+            if (field_indexed)
+                addToFieldIndex(*it);
             total_size += size_diff;
             return std::make_pair(&(*it), StoreDiff{size_diff, 0, 0});
         }
@@ -219,63 +414,65 @@ Storage::store(const InfoHash& id, const Sp<Value>& value, time_point created, t
         //DHT_LOG.DEBUG("Storing %s -> %s", id.toString().c_str(), value->toString().c_str());
         if (values.size() < MAX_VALUES) {
             total_size += size_new;
+            index.emplace(value->id, values.size());
             values.emplace_back(value, created, expiration);
             values.back().store_bucket = sb;
             if (sb)
-                sb->insert(id, *value, expiration);
+                values.back().bucket_handle = sb->insert(id, *value);
+            if (field_indexed)
+                addToFieldIndex(values.back());
+            else if (values.size() >= INDEX_MIN_VALUES) {
+                field_indexed = true;
+                buildFieldIndex();
+            }
             return std::make_pair(&values.back(), StoreDiff{size_new, 1, 0});
         }
         return std::make_pair(nullptr, StoreDiff{});
     }
 }
 
-Storage::StoreDiff
-Storage::remove(const InfoHash& id, Value::Id vid)
+inline Storage::StoreDiff
+Storage::remove(Value::Id vid)
 {
-    auto it = std::find_if (values.begin(), values.end(), [&](const ValueStorage& vr) {
-        return vr.data->id == vid;
-    });
-    if (it == values.end())
+    auto i = index.find(vid);
+    if (i == index.end())
         return {};
+    auto it = values.begin() + i->second;
     ssize_t size = it->data->size();
     if (it->store_bucket)
-        it->store_bucket->erase(id, *it->data, it->expiration);
+        it->store_bucket->erase(it->bucket_handle, *it->data);
+    if (field_indexed)
+        removeFromFieldIndex(*it);
     total_size -= size;
-    values.erase(it);
+    // move the last value to the free slot
+    if (it != values.end() - 1) {
+        *it = std::move(values.back());
+        index[it->data->id] = i->second;
+    }
+    index.erase(i);
+    values.pop_back();
     return {-size, -1, 0};
 }
 
-Storage::StoreDiff
+inline Storage::StoreDiff
 Storage::clear()
 {
     ssize_t num_values = values.size();
     ssize_t tot_size = total_size;
+    for (const auto& v : values)
+        if (v.store_bucket)
+            v.store_bucket->erase(v.bucket_handle, *v.data);
     values.clear();
+    index.clear();
+    clearFieldIndex();
     total_size = 0;
     return {-tot_size, -num_values, 0};
 }
 
-std::pair<ssize_t, std::vector<Sp<Value>>>
-Storage::expire(const InfoHash& id, time_point now)
+inline std::pair<ssize_t, std::vector<Sp<Value>>>
+Storage::expire(time_point now)
 {
-    // expire listeners
-    ssize_t del_listen {0};
-    for (auto nl_it = listeners.begin(); nl_it != listeners.end();) {
-        auto& node_listeners = nl_it->second;
-        for (auto l = node_listeners.cbegin(); l != node_listeners.cend();) {
-            bool expired = l->second.time + Node::NODE_EXPIRE_TIME < now;
-            if (expired)
-                l = node_listeners.erase(l);
-            else
-                ++l;
-        }
-        if (node_listeners.empty()) {
-            nl_it = listeners.erase(nl_it);
-            del_listen--;
-        }
-        else
-            ++nl_it;
-    }
+    listeners.expire(now);
 
     // expire values
     auto r = std::partition(values.begin(), values.end(), [&](const ValueStorage& v) {
@@ -287,11 +484,16 @@ Storage::expire(const InfoHash& id, time_point now)
     std::for_each(r, values.end(), [&](const ValueStorage& v) {
         size_diff -= v.data->size();
         if (v.store_bucket)
-            v.store_bucket->erase(id, *v.data, v.expiration);
+            v.store_bucket->erase(v.bucket_handle, *v.data);
+        if (field_indexed)
+            removeFromFieldIndex(v);
         ret.emplace_back(std::move(v.data));
     });
     total_size += size_diff;
-    values.erase(r, values.end());
+    if (r != values.end()) {
+        values.erase(r, values.end());
+        reindex();
+    }
     return {size_diff, std::move(ret)};
 }
 
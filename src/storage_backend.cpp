@@ -0,0 +1,397 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "storage_backend.h"
+
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+namespace dht {
+
+constexpr size_t LogStorageBackend::DEFAULT_SEGMENT_SIZE;
+
+/* Records are msgpack arrays: [op, key, value id, created, expiration, (value, (source))] */
+static constexpr unsigned RECORD_FIELDS {5};
+static constexpr int64_t NO_EXPIRATION {std::numeric_limits<int64_t>::max()};
+
+/* times are saved as milliseconds of the system clock, to outlive the process */
+static int64_t
+toSystemTime(time_point t)
+{
+    if (t == time_point::max())
+        return NO_EXPIRATION;
+    auto st = system_clock::now() + std::chrono::duration_cast<system_clock::duration>(t - clock::now());
+    return std::chrono::duration_cast<std::chrono::milliseconds>(st.time_since_epoch()).count();
+}
+
+static time_point
+fromSystemTime(int64_t t)
+{
+    if (t == NO_EXPIRATION)
+        return time_point::max();
+    auto st = system_clock::time_point(std::chrono::duration_cast<system_clock::duration>(std::chrono::milliseconds(t)));
+    return clock::now() + std::chrono::duration_cast<duration>(st - system_clock::now());
+}
+
+/* the source of a put record, absent from records of older versions */
+static SockAddr
+readSource(const msgpack::object& record)
+{
+    if (record.via.array.size <= RECORD_FIELDS + 1)
+        return {};
+    const auto& o = record.via.array.ptr[RECORD_FIELDS + 1];
+    if (o.type != msgpack::type::BIN or o.via.bin.size < sizeof(sa_family_t)
+        or o.via.bin.size > sizeof(sockaddr_storage))
+        return {};
+    return {(const sockaddr*)o.via.bin.ptr, (socklen_t)o.via.bin.size};
+}
+
+static std::vector<char>
+readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (not file.is_open())
+        return {};
+    std::vector<char> data(static_cast<size_t>(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    file.read(data.data(), data.size());
+    data.resize(file.gcount());
+    return data;
+}
+
+LogStorageBackend::LogStorageBackend(const std::string& path, size_t segment_size, const Sp<Logger>& logger)
+    : path_(path), segment_size_(segment_size), logger_(logger)
+{
+    readManifest();
+    for (auto it = segments_.begin(); it != segments_.end(); ++it)
+        scanSegment(it->first);
+    // the last segment may end with a partial record: never append to it
+    openSegment();
+    if (logger_)
+        logger_->d("[storage %s] %zu values, %zu bytes live in %zu bytes of log",
+            path_.c_str(), index_.size(), live_size_, log_size_);
+}
+
+LogStorageBackend::~LogStorageBackend()
+{
+    active_.flush();
+}
+
+std::string
+LogStorageBackend::segmentPath(uint64_t id) const
+{
+    return path_ + "." + std::to_string(id);
+}
+
+void
+LogStorageBackend::readManifest()
+{
+    auto data = readFile(path_);
+    if (data.empty())
+        return;
+    try {
+        auto oh = msgpack::unpack(data.data(), data.size());
+        for (auto id : oh.get().as<std::vector<uint64_t>>())
+            segments_.emplace(id, Segment{});
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->e("[storage %s] can't read manifest: %s", path_.c_str(), e.what());
+    }
+}
+
+void
+LogStorageBackend::writeManifest() const
+{
+    std::vector<uint64_t> ids;
+    ids.reserve(segments_.size());
+    for (const auto& s : segments_)
+        ids.emplace_back(s.first);
+    auto tmp = path_ + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        msgpack::pack(file, ids);
+        if (not file)
+            throw DhtException("Can't write storage manifest " + tmp);
+    }
+#ifdef _WIN32
+    std::remove(path_.c_str());
+#endif
+    if (std::rename(tmp.c_str(), path_.c_str()) != 0)
+        throw DhtException("Can't write storage manifest " + path_);
+}
+
+void
+LogStorageBackend::openSegment()
+{
+    active_.close();
+    active_id_ = segments_.empty() ? 0 : segments_.rbegin()->first + 1;
+    active_.open(segmentPath(active_id_), std::ios::binary | std::ios::trunc);
+    if (not active_.is_open())
+        throw DhtException("Can't open storage segment " + segmentPath(active_id_));
+    segments_.emplace(active_id_, Segment{});
+    writeManifest();
+}
+
+void
+LogStorageBackend::scanSegment(uint64_t id)
+{
+    auto data = readFile(segmentPath(id));
+    auto& segment = segments_[id];
+    size_t off = 0;
+    while (off < data.size()) {
+        auto start = off;
+        msgpack::object_handle oh;
+        try {
+            oh = msgpack::unpack(data.data(), data.size(), off);
+        } catch (const std::exception&) {
+            if (logger_)
+                logger_->w("[storage %s] segment %llu truncated at %zu", path_.c_str(), (unsigned long long)id, start);
+            off = start;
+            break;
+        }
+        try {
+            const auto& o = oh.get();
+            if (o.type != msgpack::type::ARRAY or o.via.array.size < RECORD_FIELDS)
+                throw msgpack::type_error();
+            auto op = static_cast<Op>(o.via.array.ptr[0].as<uint8_t>());
+            Key key {o.via.array.ptr[1].as<InfoHash>(), o.via.array.ptr[2].as<Value::Id>()};
+            auto created = o.via.array.ptr[3].as<int64_t>();
+            auto expiration = o.via.array.ptr[4].as<int64_t>();
+            auto it = index_.find(key);
+            switch (op) {
+            case Op::PUT: {
+                Location loc {id, start, off - start, created, expiration};
+                if (it != index_.end())
+                    drop(it);
+                index_.emplace(key, loc);
+                segment.live += loc.size;
+                live_size_ += loc.size;
+                break;
+            }
+            case Op::REFRESH:
+                if (it != index_.end()) {
+                    it->second.created = created;
+                    it->second.expiration = expiration;
+                }
+                break;
+            case Op::ERASE:
+                if (it != index_.end())
+                    drop(it);
+                break;
+            }
+        } catch (const std::exception&) {
+            if (logger_)
+                logger_->w("[storage %s] skipping invalid record in segment %llu at %zu", path_.c_str(), (unsigned long long)id, start);
+        }
+    }
+    segment.size = off;
+    log_size_ += off;
+}
+
+void
+LogStorageBackend::load(const LoadCallback& cb)
+{
+    const auto now = toSystemTime(clock::now());
+    std::map<uint64_t, std::vector<std::map<Key, Location>::iterator>> bySegment;
+    std::vector<std::map<Key, Location>::iterator> expired;
+    for (auto it = index_.begin(); it != index_.end(); ++it) {
+        if (it->second.expiration <= now)
+            expired.emplace_back(it);
+        else
+            bySegment[it->second.segment].emplace_back(it);
+    }
+    for (auto it : expired)
+        drop(it);
+
+    for (const auto& s : bySegment) {
+        auto data = readFile(segmentPath(s.first));
+        for (auto it : s.second) {
+            const auto& loc = it->second;
+            if (loc.offset + loc.size > data.size())
+                continue;
+            try {
+                auto oh = msgpack::unpack(data.data() + loc.offset, loc.size);
+                const auto& o = oh.get();
+                if (o.type != msgpack::type::ARRAY or o.via.array.size <= RECORD_FIELDS)
+                    throw msgpack::type_error();
+                auto value = makeValue(o.via.array.ptr[RECORD_FIELDS]);
+                cb(it->first.first, value, fromSystemTime(loc.created), fromSystemTime(loc.expiration), readSource(o));
+            } catch (const std::exception& e) {
+                if (logger_)
+                    logger_->e(it->first.first, "[storage %s] can't read value %s: %s",
+                        path_.c_str(), it->first.first.toString().c_str(), e.what());
+            }
+        }
+    }
+}
+
+LogStorageBackend::Location
+LogStorageBackend::append(const msgpack::sbuffer& record, int64_t created, int64_t expiration)
+{
+    auto& active = segments_[active_id_];
+    if (active.size and active.size + record.size() > segment_size_)
+        openSegment();
+    auto& segment = segments_[active_id_];
+    Location loc {active_id_, segment.size, record.size(), created, expiration};
+    active_.write(record.data(), record.size());
+    if (not active_ and logger_)
+        logger_->e("[storage %s] can't write to segment %llu", path_.c_str(), (unsigned long long)active_id_);
+    segment.size += record.size();
+    log_size_ += record.size();
+    return loc;
+}
+
+template <typename V>
+void
+LogStorageBackend::writePut(const Key& key, const V& value, int64_t created, int64_t expiration, const SockAddr& source)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(RECORD_FIELDS + (source ? 2 : 1));
+    pk.pack(static_cast<uint8_t>(Op::PUT));
+    pk.pack(key.first);
+    pk.pack(key.second);
+    pk.pack(created);
+    pk.pack(expiration);
+    pk.pack(value);
+    if (source) {
+        pk.pack_bin(source.getLength());
+        pk.pack_bin_body((const char*)source.get(), source.getLength());
+    }
+    auto loc = append(buffer, created, expiration);
+
+    // replaced in place: compact() iterates the index
+    auto it = index_.emplace(key, loc);
+    if (not it.second) {
+        auto& old = it.first->second;
+        segments_[old.segment].live -= old.size;
+        live_size_ -= old.size;
+        old = loc;
+    }
+    segments_[loc.segment].live += loc.size;
+    live_size_ += loc.size;
+}
+
+void
+LogStorageBackend::drop(std::map<Key, Location>::iterator it)
+{
+    segments_[it->second.segment].live -= it->second.size;
+    live_size_ -= it->second.size;
+    index_.erase(it);
+}
+
+void
+LogStorageBackend::put(const InfoHash& key, const Value& value, time_point created, time_point expiration, const SockAddr& source)
+{
+    writePut({key, value.id}, value, toSystemTime(created), toSystemTime(expiration), source);
+}
+
+void
+LogStorageBackend::refresh(const InfoHash& key, Value::Id vid, time_point created, time_point expiration)
+{
+    auto it = index_.find({key, vid});
+    if (it == index_.end())
+        return;
+    auto c = toSystemTime(created), e = toSystemTime(expiration);
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(RECORD_FIELDS);
+    pk.pack(static_cast<uint8_t>(Op::REFRESH));
+    pk.pack(key);
+    pk.pack(vid);
+    pk.pack(c);
+    pk.pack(e);
+    append(buffer, c, e);
+    it->second.created = c;
+    it->second.expiration = e;
+}
+
+void
+LogStorageBackend::erase(const InfoHash& key, Value::Id vid)
+{
+    auto it = index_.find({key, vid});
+    if (it == index_.end())
+        return;
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(RECORD_FIELDS);
+    pk.pack(static_cast<uint8_t>(Op::ERASE));
+    pk.pack(key);
+    pk.pack(vid);
+    pk.pack(int64_t(0));
+    pk.pack(int64_t(0));
+    append(buffer, 0, 0);
+    drop(it);
+}
+
+void
+LogStorageBackend::maintain()
+{
+    active_.flush();
+    // Only the oldest segment can be dropped: erase records of later
+    // segments may hide values of earlier ones.
+    if (segments_.size() > 1 and log_size_ > 2 * live_size_)
+        compact(segments_.begin()->first);
+}
+
+void
+LogStorageBackend::compact(uint64_t id)
+{
+    auto data = readFile(segmentPath(id));
+    size_t moved = 0;
+    for (auto& e : index_) {
+        const auto loc = e.second;
+        if (loc.segment != id)
+            continue;
+        if (loc.offset + loc.size > data.size())
+            continue;
+        try {
+            auto oh = msgpack::unpack(data.data() + loc.offset, loc.size);
+            const auto& o = oh.get();
+            if (o.type != msgpack::type::ARRAY or o.via.array.size <= RECORD_FIELDS)
+                throw msgpack::type_error();
+            writePut(e.first, o.via.array.ptr[RECORD_FIELDS], loc.created, loc.expiration, readSource(o));
+            moved++;
+        } catch (const std::exception& ex) {
+            if (logger_)
+                logger_->e(e.first.first, "[storage %s] can't move value %s: %s",
+                    path_.c_str(), e.first.first.toString().c_str(), ex.what());
+        }
+    }
+    // values left in the segment couldn't be read
+    std::vector<std::map<Key, Location>::iterator> lost;
+    for (auto it = index_.begin(); it != index_.end(); ++it)
+        if (it->second.segment == id)
+            lost.emplace_back(it);
+    for (auto it : lost)
+        drop(it);
+
+    // the moved values must be on disk before the segment is forgotten
+    active_.flush();
+    auto s = segments_.find(id);
+    log_size_ -= s->second.size;
+    segments_.erase(s);
+    writeManifest();
+    std::remove(segmentPath(id).c_str());
+    if (logger_)
+        logger_->d("[storage %s] compacted segment %llu, moved %zu values, %zu bytes live in %zu bytes of log",
+            path_.c_str(), (unsigned long long)id, moved, live_size_, log_size_);
+}
+
+}
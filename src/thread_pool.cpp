@@ -22,16 +22,195 @@
 #include <atomic>
 #include <thread>
 #include <iostream>
+#include <sstream>
 #include <ciso646> // fix windows compiler bug
 
 namespace dht {
 
 constexpr const size_t IO_THREADS_MAX {64};
 
-struct ThreadPool::ThreadState
+/* Pool and worker index of the current thread, if it is a pool worker */
+static thread_local const ThreadPool* current_pool {nullptr};
+static thread_local unsigned current_worker {0};
+
+/**
+ * Chase-Lev work-stealing deque.
+ * The owner pushes and takes at the bottom, other threads steal at the top.
+ */
+class ThreadPool::TaskDeque
+{
+public:
+    TaskDeque() {
+        arrays_.emplace_back(new Array(INITIAL_SIZE));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+
+    /* Owner only */
+    void push(Task* task) {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_.load(std::memory_order_acquire);
+        auto a = array_.load(std::memory_order_relaxed);
+        if (b - t > (int64_t)a->size - 1)
+            a = grow(a, t, b);
+        a->put(b, task);
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    /* Owner only */
+    Task* take() {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        auto a = array_.load(std::memory_order_relaxed);
+        // seq_cst orders the bottom update before reading top
+        bottom_.store(b, std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_seq_cst);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto task = a->get(b);
+        if (t == b) {
+            // last task: race with stealers
+            if (not top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                task = nullptr;
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    /* Any thread */
+    Task* steal() {
+        auto t = top_.load(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_seq_cst);
+        if (t >= b)
+            return nullptr;
+        auto task = array_.load(std::memory_order_acquire)->get(t);
+        if (not top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+
+private:
+    static constexpr size_t INITIAL_SIZE {64};
+
+    struct Array {
+        const size_t size;
+        std::unique_ptr<std::atomic<Task*>[]> tasks;
+        Array(size_t s) : size(s), tasks(new std::atomic<Task*>[s]) {}
+        Task* get(int64_t i) const { return tasks[i & (size - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, Task* t) { tasks[i & (size - 1)].store(t, std::memory_order_relaxed); }
+    };
+
+    std::atomic<int64_t> top_ {0};
+    std::atomic<int64_t> bottom_ {0};
+    std::atomic<Array*> array_ {nullptr};
+    /* Replaced arrays may still be read by stealers: they are kept until destruction */
+    std::vector<std::unique_ptr<Array>> arrays_;
+
+    Array* grow(Array* a, int64_t t, int64_t b) {
+        arrays_.emplace_back(new Array(a->size * 2));
+        auto n = arrays_.back().get();
+        for (auto i = t; i < b; i++)
+            n->put(i, a->get(i));
+        array_.store(n, std::memory_order_release);
+        return n;
+    }
+};
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue (Vyukov),
+ * falling back to a locked queue when full.
+ */
+class ThreadPool::TaskQueue
+{
+public:
+    TaskQueue() : cells_(new Cell[SIZE]) {
+        for (size_t i = 0; i < SIZE; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    void push(Task* task) {
+        if (tryPush(task))
+            return;
+        std::lock_guard<std::mutex> l(overflowLock_);
+        overflow_.emplace(task);
+        overflowSize_++;
+    }
+
+    Task* pop() {
+        if (auto task = tryPop())
+            return task;
+        if (overflowSize_.load() == 0)
+            return nullptr;
+        std::lock_guard<std::mutex> l(overflowLock_);
+        if (overflow_.empty())
+            return nullptr;
+        auto task = overflow_.front();
+        overflow_.pop();
+        overflowSize_--;
+        return task;
+    }
+
+private:
+    static constexpr size_t SIZE {4096};
+    struct Cell {
+        std::atomic<size_t> seq;
+        Task* task;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    std::atomic<size_t> head_ {0};
+    char pad0_[64];
+    std::atomic<size_t> tail_ {0};
+    char pad1_[64];
+
+    std::mutex overflowLock_;
+    std::queue<Task*> overflow_;
+    std::atomic<size_t> overflowSize_ {0};
+
+    bool tryPush(Task* task) {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = cells_[pos & (SIZE - 1)];
+            auto seq = cell.seq.load(std::memory_order_acquire);
+            auto dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.task = task;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    Task* tryPop() {
+        auto pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = cells_[pos & (SIZE - 1)];
+            auto seq = cell.seq.load(std::memory_order_acquire);
+            auto dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    auto task = cell.task;
+                    cell.seq.store(pos + SIZE, std::memory_order_release);
+                    return task;
+                }
+            } else if (dif < 0) {
+                return nullptr;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+struct ThreadPool::Worker
 {
     std::thread thread {};
-    std::atomic_bool run {true};
+    TaskDeque tasks {};
 };
 
 ThreadPool&
@@ -49,9 +228,17 @@ ThreadPool::io()
 }
 
 
-ThreadPool::ThreadPool(size_t maxThreads) : maxThreads_(maxThreads)
+constexpr unsigned ThreadPool::PRIORITY_COUNT;
+
+ThreadPool::ThreadPool(size_t maxThreads)
+ : maxThreads_(std::max<size_t>(maxThreads, 1))
 {
-    threads_.reserve(maxThreads_);
+    for (auto& q : injectors_)
+        q.reset(new TaskQueue);
+    // workers are allocated upfront so that they can be read without locking
+    workers_.reserve(maxThreads_);
+    for (unsigned i = 0; i < maxThreads_; i++)
+        workers_.emplace_back(new Worker);
 }
 
 ThreadPool::ThreadPool()
@@ -64,50 +251,107 @@ ThreadPool::~ThreadPool()
 }
 
 void
-ThreadPool::run(std::function<void()>&& cb)
+ThreadPool::run(std::function<void()>&& cb, Priority priority)
 {
-    std::unique_lock<std::mutex> l(lock_);
     if (not running_) return;
 
-    // launch new thread if necessary
-    if (not readyThreads_ && threads_.size() < maxThreads_) {
-        threads_.emplace_back(new ThreadState());
-        auto& t = *threads_.back();
-        t.thread = std::thread([&]() {
-            while (t.run) {
-                std::function<void()> task;
-
-                // pick task from queue
-                {
-                    std::unique_lock<std::mutex> l(lock_);
-                    readyThreads_++;
-                    cv_.wait(l, [&](){
-                        return not t.run or not tasks_.empty();
-                    });
-                    readyThreads_--;
-                    if (not t.run)
-                        break;
-                    task = std::move(tasks_.front());
-                    tasks_.pop();
-                }
+    auto task = new Task {std::move(cb), priority, clock::now()};
+    auto p = (unsigned)priority;
+    queued_[p]++;
+    // normal priority tasks from workers stay local, others are shared
+    if (current_pool == this and priority == Priority::Normal)
+        workers_[current_worker]->tasks.push(task);
+    else
+        injectors_[p]->push(task);
+    pending_++;
 
-                // run task
-                try {
-                    if (task)
-                        task();
-                } catch (const std::exception& e) {
-                    // LOG_ERR("Exception running task: %s", e.what());
-                    std::cerr << "Exception running task: " << e.what() << std::endl;
-                }
-            }
-        });
+    if (sleeping_.load()) {
+        // wake up a worker: taking the lock ensures it is waiting or will see the task
+        { std::lock_guard<std::mutex> l(lock_); }
+        cv_.notify_one();
+    } else if (threadCount_.load() < maxThreads_) {
+        // launch new thread if necessary
+        startThread();
     }
+}
 
-    // push task to queue
-    tasks_.emplace(std::move(cb));
+void
+ThreadPool::startThread()
+{
+    std::lock_guard<std::mutex> l(lock_);
+    auto i = threadCount_.load();
+    if (i >= maxThreads_ or not running_)
+        return;
+    workers_[i]->thread = std::thread([this, i]() { workerLoop(i); });
+    threadCount_ = i + 1;
+}
 
-    // notify thread
-    cv_.notify_one();
+ThreadPool::Task*
+ThreadPool::pickTask(unsigned index, uint64_t& rand, unsigned& picked)
+{
+    auto& low = *injectors_[(unsigned)Priority::Low];
+    if (++picked % LOW_PRIORITY_PERIOD == 0)
+        if (auto task = low.pop())
+            return task;
+    if (auto task = injectors_[(unsigned)Priority::High]->pop())
+        return task;
+    if (auto task = workers_[index]->tasks.take())
+        return task;
+    if (auto task = injectors_[(unsigned)Priority::Normal]->pop())
+        return task;
+    // steal from other workers, starting at a random one
+    auto n = threadCount_.load();
+    if (n > 1) {
+        rand ^= rand << 13; rand ^= rand >> 7; rand ^= rand << 17;
+        auto start = (unsigned)(rand % n);
+        for (unsigned i = 0; i < n; i++) {
+            auto victim = (start + i) % n;
+            if (victim == index)
+                continue;
+            if (auto task = workers_[victim]->tasks.steal())
+                return task;
+        }
+    }
+    return low.pop();
+}
+
+void
+ThreadPool::workerLoop(unsigned index)
+{
+    current_pool = this;
+    current_worker = index;
+    uint64_t rand = 0x9E3779B97F4A7C15ull * (index + 1);
+    unsigned picked = 0;
+    while (running_) {
+        std::unique_ptr<Task> task {pickTask(index, rand, picked)};
+        if (not task) {
+            std::unique_lock<std::mutex> l(lock_);
+            sleeping_++;
+            cv_.wait(l, [&](){
+                return not running_ or pending_.load() != 0;
+            });
+            sleeping_--;
+            continue;
+        }
+        pending_--;
+        auto p = (unsigned)task->priority;
+        queued_[p]--;
+        auto start = clock::now();
+        waitTime_[p].record(start - task->queued);
+        active_++;
+
+        // run task
+        try {
+            if (task->cb)
+                task->cb();
+        } catch (const std::exception& e) {
+            // LOG_ERR("Exception running task: %s", e.what());
+            std::cerr << "Exception running task: " << e.what() << std::endl;
+        }
+        active_--;
+        runTime_[p].record(clock::now() - start);
+    }
+    current_pool = nullptr;
 }
 
 void
@@ -117,8 +361,6 @@ ThreadPool::stop()
         std::lock_guard<std::mutex> l(lock_);
         running_ = false;
     }
-    for (auto& t : threads_)
-        t->run = false;
     cv_.notify_all();
 }
 
@@ -126,9 +368,49 @@ void
 ThreadPool::join()
 {
     stop();
-    for (auto& t : threads_)
-        t->thread.join();
-    threads_.clear();
+    for (auto& w : workers_)
+        if (w->thread.joinable())
+            w->thread.join();
+    // drop tasks that were not run
+    for (auto& w : workers_)
+        while (auto task = w->tasks.steal())
+            delete task;
+    for (auto& q : injectors_)
+        while (auto task = q->pop())
+            delete task;
+    pending_ = 0;
+    for (auto& q : queued_)
+        q = 0;
+}
+
+ThreadPool::Stats
+ThreadPool::getStats() const
+{
+    Stats stats;
+    stats.threads = threadCount_.load();
+    stats.active = active_.load();
+    for (unsigned p = 0; p < PRIORITY_COUNT; p++) {
+        stats.queued[p] = queued_[p].load();
+        stats.wait[p] = waitTime_[p].getStats();
+        stats.run[p] = runTime_[p].getStats();
+    }
+    return stats;
+}
+
+std::string
+ThreadPool::Stats::toString() const
+{
+    static const char* NAMES[PRIORITY_COUNT] {"high", "normal", "low"};
+    std::stringstream ss;
+    ss << threads << " threads, " << active << " active" << std::endl;
+    for (unsigned p = 0; p < PRIORITY_COUNT; p++) {
+        if (not queued[p] and not wait[p].count)
+            continue;
+        ss << NAMES[p] << ": " << queued[p] << " queued" << std::endl
+           << "  wait: " << wait[p].toString() << std::endl
+           << "  run: " << run[p].toString() << std::endl;
+    }
+    return ss.str();
 }
 
 void
@@ -159,7 +441,7 @@ Executor::run_(std::function<void()>&& task)
             this_.current_--;
             this_.schedule();
         }
-    });
+    }, priority_);
 }
 
 void
@@ -0,0 +1,83 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *  Author(s) : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * Static tracepoints (USDT probes) of the "opendht" provider, built when
+ * OPENDHT_TRACEPOINTS is defined, and compiled out otherwise.
+ * A disabled probe is a nop instruction, listed with:
+ *   bpftrace -l 'usdt:/path/to/libopendht.so:opendht:*'
+ *
+ * Ids are passed as pointers to their HASH_LEN bytes, durations in
+ * nanoseconds and message types as their MessageType value:
+ *
+ *   message__entry     node id, tid, message type
+ *   message__return    tid, message type
+ *   request__send      node id, tid, message type, size, attempt
+ *   request__reply     node id, tid, message type, rtt
+ *   request__expire    node id, tid, message type
+ *   search__step       search id, family, step flags, search nodes
+ *   storage__store     key, value id, value size
+ *   storage__changed   key, value id, local listeners, remote listeners
+ *   job__entry         job, lateness of the job
+ *   job__return        job, lateness of the job
+ */
+
+#ifdef OPENDHT_TRACEPOINTS
+
+#include <sys/sdt.h>
+
+#include <utility>
+
+#define DHT_TRACE(name, ...) STAP_PROBEV(opendht, name, __VA_ARGS__)
+
+namespace dht {
+namespace trace {
+
+template <typename F>
+class ScopeExit {
+public:
+    ScopeExit(F&& f) : f_(std::move(f)) {}
+    ScopeExit(ScopeExit&& o) : f_(std::move(o.f_)), active_(o.active_) { o.active_ = false; }
+    ~ScopeExit() { if (active_) f_(); }
+private:
+    F f_;
+    bool active_ {true};
+};
+
+template <typename F>
+ScopeExit<F> onScopeExit(F&& f) { return ScopeExit<F>(std::forward<F>(f)); }
+
+}
+}
+
+/*
+ * Fires the probe with two arguments, evaluated now, when leaving
+ * the current scope, including by an exception.
+ */
+#define DHT_TRACE_RETURN(name, a, b) \
+    const auto dht_trace_a_ = (a); \
+    const auto dht_trace_b_ = (b); \
+    auto dht_trace_return_ = ::dht::trace::onScopeExit([&]{ DHT_TRACE(name, dht_trace_a_, dht_trace_b_); })
+
+#else
+
+#define DHT_TRACE(name, ...)
+#define DHT_TRACE_RETURN(name, a, b)
+
+#endif
@@ -272,7 +272,7 @@ unpackBlob(const msgpack::object& o) {
 }
 
 msgpack::unpacked
-unpackMsg(Blob b) {
+unpackMsg(const Blob& b) {
     return msgpack::unpack((const char*)b.data(), b.size());
 }
 
@@ -35,6 +35,30 @@ namespace dht {
 
 const std::string Query::QUERY_PARSE_ERROR {"Error parsing query."};
 
+/* Number of value blocks allocated at once by the value pool */
+static constexpr size_t VALUE_POOL_CHUNK {256};
+
+ValuesExport
+ValuesSnapshot::pack() const
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(values.size());
+    for (const auto& v : values) {
+        pk.pack_array(2);
+        pk.pack(v.first.time_since_epoch().count());
+        v.second->msgpack_pack(pk);
+    }
+    return {key, {buffer.data(), buffer.data()+buffer.size()}};
+}
+
+const Sp<BlockPool>&
+getValuePool()
+{
+    static const Sp<BlockPool> pool {std::make_shared<BlockPool>(VALUE_POOL_CHUNK)};
+    return pool;
+}
+
 Value::Filter bindFilterRaw(FilterRaw raw_filter, void* user_data) {
     if (not raw_filter) return {};
     return [=](const Value& value) {
@@ -297,6 +321,95 @@ FieldValue::getLocalFilter() const
     }
 }
 
+namespace {
+
+/* Constraints of a Where on the value fields, checked in one pass */
+struct WherePredicate {
+    enum : uint8_t {
+        CHECK_ID = 1 << 0,
+        CHECK_TYPE = 1 << 1,
+        CHECK_SEQ = 1 << 2,
+        CHECK_USER_TYPE = 1 << 3,
+        CHECK_OWNER = 1 << 4,
+        /* conflicting constraints, no value can match */
+        NEVER = 1 << 7
+    };
+    uint8_t checks {0};
+    Value::Id id {};
+    ValueType::Id type {};
+    uint16_t seq {};
+    std::string user_type {};
+    InfoHash owner {};
+
+    explicit WherePredicate(const std::vector<FieldValue>& filters) {
+        for (const auto& f : filters) {
+            switch (f.getField()) {
+            case Value::Field::Id:
+                set(CHECK_ID, id, f.getInt());
+                break;
+            case Value::Field::ValueType:
+                set(CHECK_TYPE, type, static_cast<ValueType::Id>(f.getInt()));
+                break;
+            case Value::Field::SeqNum:
+                set(CHECK_SEQ, seq, static_cast<uint16_t>(f.getInt()));
+                break;
+            case Value::Field::UserType: {
+                auto b = f.getBlob();
+                set(CHECK_USER_TYPE, user_type, std::string {b.begin(), b.end()});
+                break;
+            }
+            case Value::Field::OwnerPk:
+                set(CHECK_OWNER, owner, f.getHash());
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    bool operator()(const Value& v) const {
+        if (checks & NEVER)
+            return false;
+        if ((checks & CHECK_ID) and v.id != id)
+            return false;
+        if ((checks & CHECK_TYPE) and v.type != type)
+            return false;
+        if ((checks & CHECK_SEQ) and v.seq != seq)
+            return false;
+        if ((checks & CHECK_USER_TYPE) and v.user_type != user_type)
+            return false;
+        // computing the key id is the costly check, keep it last
+        if ((checks & CHECK_OWNER) and not (v.owner and v.owner->getId() == owner))
+            return false;
+        return true;
+    }
+
+private:
+    template <typename T>
+    void set(uint8_t check, T& field, T&& value) {
+        if (checks & check) {
+            if (field != value)
+                checks |= NEVER;
+        } else {
+            checks |= check;
+            field = std::move(value);
+        }
+    }
+};
+
+}
+
+Value::Filter
+Where::getFilter() const
+{
+    WherePredicate predicate {filters_};
+    if (not predicate.checks)
+        return {};
+    return [predicate = std::move(predicate)](const Value& v) {
+        return predicate(v);
+    };
+}
+
 FieldValueIndex::FieldValueIndex(const Value& v, const Select& s)
 {
     if (not s.empty()) {
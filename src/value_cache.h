@@ -28,13 +28,18 @@ using CallbackQueue = std::list<std::function<void()>>;
 
 class ValueCache {
 public:
-    ValueCache(ValueStateCallback&& cb, SyncCallback&& scb = {})
-        : callback(std::forward<ValueStateCallback>(cb)), syncCallback(std::move(scb))
+    /**
+     * @param memory if set, the approximate memory used by cached values
+     *               is added to it, and removed when they are dropped.
+     */
+    ValueCache(ValueStateCallback&& cb, SyncCallback&& scb = {}, size_t* memory = nullptr)
+        : callback(std::forward<ValueStateCallback>(cb)), syncCallback(std::move(scb)), memory_(memory)
     {
         if (syncCallback)
             syncCallback(ListenSyncStatus::ADDED);
     }
-    ValueCache(ValueCache&& o) noexcept : values(std::move(o.values)), callback(std::move(o.callback)), syncCallback(std::move(o.syncCallback)) {
+    ValueCache(ValueCache&& o) noexcept : values(std::move(o.values)), callback(std::move(o.callback)), syncCallback(std::move(o.syncCallback)), memory_(o.memory_) {
+        o.values.clear();
         o.callback = {};
         o.syncCallback = {};
     }
@@ -53,8 +58,10 @@ public:
     CallbackQueue clear() {
         std::vector<Sp<Value>> expired_values;
         expired_values.reserve(values.size());
-        for (const auto& v : values)
+        for (const auto& v : values) {
+            account(*v.second.data, false);
             expired_values.emplace_back(std::move(v.second.data));
+        }
         values.clear();
         CallbackQueue ret;
         if (not expired_values.empty() and callback) {
@@ -80,6 +87,7 @@ public:
         std::vector<Sp<Value>> expired_values;
         for (auto it = values.begin(); it != values.end();) {
             if (it->second.expiration <= now) {
+                account(*it->second.data, false);
                 expired_values.emplace_back(std::move(it->second.data));
                 it = values.erase(it);
             } else {
@@ -97,6 +105,7 @@ public:
                     oldest_creation = it->second.created;
                 }
             if (oldest_value != values.end()) {
+                account(*oldest_value->second.data, false);
                 expired_values.emplace_back(std::move(oldest_value->second.data));
                 values.erase(oldest_value);
             }
@@ -165,6 +174,18 @@ private:
     ValueStateCallback callback;
     SyncCallback syncCallback;
     ListenSyncStatus status {ListenSyncStatus::UNSYNCED};
+    size_t* memory_ {nullptr};
+
+    void account(const Value& v, bool added) {
+        if (not memory_)
+            return;
+        // map node: entry and about 4 pointers
+        auto size = v.size() + sizeof(decltype(values)::value_type) + 4 * sizeof(void*);
+        if (added)
+            *memory_ += size;
+        else
+            *memory_ -= std::min(size, *memory_);
+    }
 
     CallbackQueue addValues(const std::vector<Sp<Value>>& new_values, const TypeStore& types, const time_point& now) {
         std::vector<Sp<Value>> nvals;
@@ -173,6 +194,7 @@ private:
             if (v == values.end()) {
                 // new value
                 nvals.emplace_back(value);
+                account(*value, true);
                 values.emplace(value->id, CacheValueStorage(value, now, now + types.getType(value->type).expiration));
             } else {
                 // refreshed value
@@ -192,6 +214,7 @@ private:
         auto v = values.find(vid);
         if (v == values.end())
             return {};
+        account(*v->second.data, false);
         const std::vector<Sp<Value>> val {std::move(v->second.data)};
         values.erase(v);
         auto cb = callback;
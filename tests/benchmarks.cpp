@@ -0,0 +1,384 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the core data structures, including internal ones:
+ * built against the static library, with the src/ headers.
+ */
+
+#include <benchmark/benchmark.h>
+
+// opendht
+#include "opendht/infohash.h"
+#include "opendht/value.h"
+#include "opendht/scheduler.h"
+#include "opendht/rate_limiter.h"
+#include "opendht/routing_table.h"
+#include "opendht/node.h"
+#include "opendht/node_cache.h"
+
+// internal
+#include "storage.h"
+#include "parsed_message.h"
+
+#include <random>
+#include <vector>
+
+using namespace dht;
+
+namespace {
+
+using namespace std::chrono_literals;
+
+std::vector<InfoHash>
+randomHashes(size_t n, std::mt19937_64& rd)
+{
+    std::vector<InfoHash> hashes;
+    hashes.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        hashes.emplace_back(InfoHash::getRandom(rd));
+    return hashes;
+}
+
+Value
+benchValue(size_t size, Value::Id id = 1)
+{
+    Value v {Blob(size, 42)};
+    v.id = id;
+    v.user_type = "benchmark";
+    return v;
+}
+
+/* Value */
+
+void
+BM_ValuePack(benchmark::State& state)
+{
+    auto v = benchValue(state.range(0));
+    for (auto _ : state) {
+        msgpack::sbuffer buffer;
+        msgpack::pack(buffer, v);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValuePack)->Arg(64)->Arg(1024)->Arg(56 * 1024);
+
+void
+BM_ValueUnpack(benchmark::State& state)
+{
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, benchValue(state.range(0)));
+    for (auto _ : state) {
+        auto msg = msgpack::unpack(buffer.data(), buffer.size());
+        Value v {msg.get()};
+        benchmark::DoNotOptimize(v.data.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValueUnpack)->Arg(64)->Arg(1024)->Arg(56 * 1024);
+
+/* InfoHash */
+
+void
+BM_InfoHashGet(benchmark::State& state)
+{
+    std::string key(state.range(0), 'k');
+    for (auto _ : state)
+        benchmark::DoNotOptimize(InfoHash::get(key));
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InfoHashGet)->Arg(16)->Arg(1024);
+
+void
+BM_InfoHashXorCmp(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto hashes = randomHashes(1024, rd);
+    auto target = InfoHash::getRandom(rd);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(target.xorCmp(hashes[i % 1024], hashes[(i + 1) % 1024]));
+        i++;
+    }
+}
+BENCHMARK(BM_InfoHashXorCmp);
+
+void
+BM_InfoHashCommonBits(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto hashes = randomHashes(1024, rd);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(InfoHash::commonBits(hashes[i % 1024], hashes[(i + 1) % 1024]));
+        i++;
+    }
+}
+BENCHMARK(BM_InfoHashCommonBits);
+
+void
+BM_InfoHashToString(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto h = InfoHash::getRandom(rd);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(h.toString());
+}
+BENCHMARK(BM_InfoHashToString);
+
+void
+BM_InfoHashClosest(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto hashes = randomHashes(state.range(0), rd);
+    auto target = InfoHash::getRandom(rd);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(target.closest(hashes.data(), hashes.size(), TARGET_NODES));
+}
+BENCHMARK(BM_InfoHashClosest)->Arg(16)->Arg(256);
+
+/* RoutingTable */
+
+void
+BM_RoutingTableFindClosestNodes(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto myid = InfoHash::getRandom(rd);
+    RoutingTable table {Bucket {AF_INET}};
+    // nodes never replied: their reply time is time_point::min(),
+    // so they are good nodes until NODE_GOOD_TIME after it
+    const auto now = time_point::min() + std::chrono::minutes(120);
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(4222);
+    for (int64_t i = 0; i < state.range(0); i++) {
+        sin.sin_addr.s_addr = htonl(0x0A000001 + (uint32_t)i);
+        auto node = std::make_shared<Node>(InfoHash::getRandom(rd), SockAddr((const sockaddr*)&sin, sizeof(sin)), rd);
+        node->setTime(now);
+        auto b = table.findBucket(node->id);
+        while (b->nodes.full() and table.contains(b, myid) and table.split(b))
+            b = table.findBucket(node->id);
+        table.restoreNode(node);
+    }
+    auto targets = randomHashes(1024, rd);
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(table.findClosestNodes(targets[i++ % targets.size()], now));
+    state.counters["buckets"] = table.size();
+}
+BENCHMARK(BM_RoutingTableFindClosestNodes)->Arg(256)->Arg(4096);
+
+/* NodeCache */
+
+void
+BM_NodeCacheGetNode(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    auto ids = randomHashes(state.range(0), rd);
+    sockaddr_in6 sin6 {};
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(4222);
+    const SockAddr addr((const sockaddr*)&sin6, sizeof(sin6));
+    const auto now = clock::now();
+    std::vector<Sp<Node>> nodes;
+    nodes.reserve(ids.size());
+    for (auto _ : state) {
+        NodeCache cache(rd);
+        for (const auto& id : ids)
+            nodes.emplace_back(cache.getNode(id, addr, now, true));
+        nodes.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["node_size"] = sizeof(Node);
+}
+BENCHMARK(BM_NodeCacheGetNode)->Arg(1024)->Arg(16 * 1024);
+
+/* Scheduler */
+
+void
+BM_SchedulerAddRun(benchmark::State& state)
+{
+    Scheduler scheduler;
+    auto start = scheduler.time();
+    const auto n = state.range(0);
+    std::mt19937_64 rd {42};
+    std::uniform_int_distribution<int64_t> delay {0, 60 * 1000};
+    size_t ran = 0;
+    auto now = start;
+    for (auto _ : state) {
+        for (int64_t i = 0; i < n; i++)
+            scheduler.add(now + std::chrono::milliseconds(delay(rd)), [&]{ ran++; });
+        now += 1min;
+        scheduler.syncTime(now);
+        scheduler.run();
+    }
+    benchmark::DoNotOptimize(ran);
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_SchedulerAddRun)->Arg(1024);
+
+void
+BM_SchedulerEdit(benchmark::State& state)
+{
+    Scheduler scheduler;
+    auto now = scheduler.time();
+    std::mt19937_64 rd {42};
+    std::uniform_int_distribution<int64_t> delay {1, 3600 * 1000};
+    std::vector<Sp<Scheduler::Job>> jobs;
+    for (int64_t i = 0; i < state.range(0); i++)
+        jobs.emplace_back(scheduler.add(now + std::chrono::milliseconds(delay(rd)), []{}));
+    size_t i = 0;
+    for (auto _ : state)
+        scheduler.edit(jobs[i++ % jobs.size()], now + std::chrono::milliseconds(delay(rd)));
+}
+BENCHMARK(BM_SchedulerEdit)->Arg(1024)->Arg(64 * 1024);
+
+/* Storage */
+
+void
+BM_StorageStore(benchmark::State& state)
+{
+    const auto n = state.range(0);
+    auto key = InfoHash::get("benchmark");
+    std::vector<Sp<Value>> values;
+    for (int64_t i = 0; i < n; i++)
+        values.emplace_back(std::make_shared<Value>(benchValue(64, i + 1)));
+    auto now = clock::now();
+    StorageBucket bucket;
+    for (auto _ : state) {
+        Storage storage(now);
+        for (const auto& v : values)
+            benchmark::DoNotOptimize(storage.store(key, v, now, now + 10min, &bucket));
+        for (const auto& v : values)
+            storage.remove(v->id);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_StorageStore)->Arg(16)->Arg(512);
+
+void
+BM_StorageGet(benchmark::State& state)
+{
+    const auto n = state.range(0);
+    auto key = InfoHash::get("benchmark");
+    auto now = clock::now();
+    Storage storage(now);
+    for (int64_t i = 0; i < n; i++)
+        storage.store(key, std::make_shared<Value>(benchValue(64, i + 1)), now, now + 10min, nullptr);
+    std::mt19937_64 rd {42};
+    std::uniform_int_distribution<Value::Id> id {1, (Value::Id)n};
+    for (auto _ : state) {
+        Where w;
+        w.id(id(rd));
+        benchmark::DoNotOptimize(storage.get(w));
+    }
+}
+BENCHMARK(BM_StorageGet)->Arg(16)->Arg(512);
+
+/* RateLimiter */
+
+void
+BM_RateLimiterLimit(benchmark::State& state)
+{
+    RateLimiter limiter(state.range(0));
+    auto now = clock::now();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(limiter.limit(now));
+        now += 10us;
+    }
+}
+BENCHMARK(BM_RateLimiterLimit)->Arg(1600)->Arg(1000000);
+
+/* ParsedMessage */
+
+using namespace net;
+using Packer = msgpack::packer<msgpack::sbuffer>;
+
+void
+packHeader(Packer& pk, const char* y)
+{
+    pk.pack(KEY_TID); pk.pack((Tid)42);
+    pk.pack(KEY_Y); pk.pack(y);
+    pk.pack(KEY_UA); pk.pack("RNG1");
+}
+
+msgpack::sbuffer
+packPing(const InfoHash& id)
+{
+    msgpack::sbuffer buffer;
+    Packer pk(&buffer);
+    pk.pack_map(5);
+    pk.pack(KEY_A); pk.pack_map(1);
+      pk.pack(KEY_REQ_ID); pk.pack(id);
+    pk.pack(KEY_Q); pk.pack(QUERY_PING);
+    packHeader(pk, "q");
+    return buffer;
+}
+
+msgpack::sbuffer
+packGetReply(const InfoHash& id, size_t nvalues, size_t vsize)
+{
+    msgpack::sbuffer buffer;
+    Packer pk(&buffer);
+    pk.pack_map(4);
+    pk.pack(KEY_R); pk.pack_map(4);
+      pk.pack(KEY_REQ_ID); pk.pack(id);
+      pk.pack(KEY_REQ_TOKEN); pk.pack(Blob(32, 7));
+      // 8 IPv4 nodes: id, address and port
+      Blob nodes4(8 * (HASH_LEN + 6), 1);
+      pk.pack(KEY_REQ_NODES4); pk.pack_bin(nodes4.size()); pk.pack_bin_body((const char*)nodes4.data(), nodes4.size());
+      pk.pack(KEY_REQ_VALUES); pk.pack_array(nvalues);
+      for (size_t i = 0; i < nvalues; i++)
+          pk.pack(benchValue(vsize, i + 1));
+    packHeader(pk, "r");
+    return buffer;
+}
+
+void
+decode(benchmark::State& state, const msgpack::sbuffer& buffer)
+{
+    for (auto _ : state) {
+        auto unpacked = msgpack::unpack(buffer.data(), buffer.size(), unpackReference);
+        ParsedMessage msg;
+        msg.msgpack_unpack(unpacked.get());
+        benchmark::DoNotOptimize(msg.values.data());
+    }
+    state.SetBytesProcessed(state.iterations() * buffer.size());
+}
+
+void
+BM_ParsedMessagePing(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    decode(state, packPing(InfoHash::getRandom(rd)));
+}
+BENCHMARK(BM_ParsedMessagePing);
+
+void
+BM_ParsedMessageGetReply(benchmark::State& state)
+{
+    std::mt19937_64 rd {42};
+    decode(state, packGetReply(InfoHash::getRandom(rd), state.range(0), 256));
+}
+BENCHMARK(BM_ParsedMessageGetReply)->Arg(1)->Arg(16);
+
+}
+
+BENCHMARK_MAIN();
@@ -21,6 +21,12 @@
 #include "cryptotester.h"
 
 #include <opendht/crypto.h>
+#include <opendht/identity_pool.h>
+#include <opendht/value.h>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(CryptoTester);
@@ -72,6 +78,89 @@ CryptoTester::testSignatureEncryption() {
     }
 }
 
+void
+CryptoTester::testEcSignature() {
+    auto ec_id = dht::crypto::generateEcIdentity("ec");
+    auto ed_id = dht::crypto::generateEd25519Identity("ed");
+    auto rsa_key = dht::crypto::PrivateKey::generate(2048);
+
+    for (const auto& key : {ec_id.first, ed_id.first}) {
+        dht::Value value {std::vector<uint8_t>(1024, 42)};
+        value.sign(*key);
+        CPPUNIT_ASSERT(value.checkSignature());
+
+        value.data[0]++;
+        CPPUNIT_ASSERT(not value.checkSignature());
+
+        // the signature doesn't match another key
+        auto signature = key->sign(value.data);
+        CPPUNIT_ASSERT(key->getPublicKey().checkSignature(value.data, signature));
+        CPPUNIT_ASSERT(not rsa_key.getPublicKey().checkSignature(value.data, signature));
+    }
+}
+
+void
+CryptoTester::testSessionKey()
+{
+    auto key = dht::crypto::PrivateKey::generate(2048);
+    auto pk = key.getPublicKey();
+    const dht::Blob data1 (64, 1), data2 (64, 2);
+
+    // cyphers of a session share their encapsulated key
+    auto session = pk.generateSessionKey();
+    auto cypher1 = session.encrypt(data1);
+    auto cypher2 = session.encrypt(data2);
+    auto block = key.getCypherBlockSize();
+    CPPUNIT_ASSERT_EQUAL(block, session.encapsulated.size());
+    CPPUNIT_ASSERT(std::equal(cypher1.begin(), cypher1.begin() + block, cypher2.begin()));
+    CPPUNIT_ASSERT(key.decrypt(cypher1) == data1);
+    CPPUNIT_ASSERT(key.decrypt(cypher2) == data2);
+
+    // the recipient decrypts the key once to reuse it
+    auto received = key.decryptSessionKey(cypher1);
+    CPPUNIT_ASSERT(received.key == session.key);
+    CPPUNIT_ASSERT(received.decrypt(cypher2) == data2);
+
+    // a new session, or a plain cypher, isn't decrypted with a stale session
+    auto cypher3 = pk.generateSessionKey().encrypt(data1);
+    CPPUNIT_ASSERT(not std::equal(cypher1.begin(), cypher1.begin() + block, cypher3.begin()));
+    CPPUNIT_ASSERT_THROW(received.decrypt(cypher3), dht::crypto::DecryptError);
+    CPPUNIT_ASSERT_THROW(received.decrypt(pk.encrypt(data1)), dht::crypto::DecryptError);
+    CPPUNIT_ASSERT(key.decrypt(cypher3) == data1);
+
+    // cyphers altered after the encapsulated key don't decrypt
+    cypher2.back()++;
+    CPPUNIT_ASSERT_THROW(received.decrypt(cypher2), dht::crypto::DecryptError);
+}
+
+void
+CryptoTester::testTrustListCache()
+{
+    auto ca1 = dht::crypto::generateEcIdentity("ca1", {}, true);
+    auto ca2 = dht::crypto::generateEcIdentity("ca2", {}, true);
+    auto dev1 = dht::crypto::generateEcIdentity("dev1", ca1);
+    auto dev2 = dht::crypto::generateEcIdentity("dev2", ca2);
+
+    dht::crypto::TrustList list;
+    list.add(*ca1.second);
+    // cached results of a chain don't apply to another one
+    for (unsigned i = 0; i < 2; i++) {
+        CPPUNIT_ASSERT(list.verify(*dev1.second));
+        CPPUNIT_ASSERT(not list.verify(*dev2.second));
+    }
+    // changes of the list invalidate cached results
+    list.add(*ca2.second);
+    CPPUNIT_ASSERT(list.verify(*dev2.second));
+    list.remove(*ca1.second);
+    CPPUNIT_ASSERT(not list.verify(*dev1.second));
+    CPPUNIT_ASSERT(list.verify(*dev2.second));
+
+    // without cache
+    list.setCacheTtl({}, {});
+    CPPUNIT_ASSERT(not list.verify(*dev1.second));
+    CPPUNIT_ASSERT(list.verify(*dev2.second));
+}
+
 void
 CryptoTester::testCertificateRevocation()
 {
@@ -106,6 +195,11 @@ CryptoTester::testCertificateRevocation()
     CPPUNIT_ASSERT_MESSAGE(v.toString(), !v);
     v = list2.verify(*device12.second);
     CPPUNIT_ASSERT_MESSAGE(v.toString(), v);
+
+    // results cached by list are dropped when it gets the revocation
+    list.add(*account1.second);
+    v = list.verify(*device11.second);
+    CPPUNIT_ASSERT_MESSAGE(v.toString(), !v);
 }
 
 void
@@ -161,6 +255,43 @@ void CryptoTester::testCertificateSerialNumber()
     CPPUNIT_ASSERT(std::equal(SERIAL.begin(), SERIAL.end(), serial.begin(), serial.end()));
 }
 
+void
+CryptoTester::testIdentityPool() {
+    dht::crypto::IdentityPool::Config config;
+    config.size = 1;
+    config.generator = []{ return dht::crypto::generateEcIdentity(); };
+    config.path = "identity_pool_test";
+    auto waitReady = [](const dht::crypto::IdentityPool& pool) {
+        for (unsigned i = 0; i < 100 and not pool.available(); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return pool.available();
+    };
+
+    dht::InfoHash saved;
+    {
+        dht::crypto::IdentityPool pool(config);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, waitReady(pool));
+        // an identity taken is replaced
+        auto id = pool.get();
+        CPPUNIT_ASSERT(id.first and id.second);
+        CPPUNIT_ASSERT(id.second->getId() == id.first->getPublicKey().getId());
+        CPPUNIT_ASSERT_EQUAL((size_t)1, waitReady(pool));
+    }
+    {
+        // the identity ready is loaded from disk, and removed once taken
+        dht::crypto::IdentityPool pool(config);
+        CPPUNIT_ASSERT_EQUAL((size_t)1, pool.available());
+        auto id = pool.get();
+        saved = id.second->getId();
+        waitReady(pool);
+    }
+    dht::crypto::IdentityPool pool(config);
+    CPPUNIT_ASSERT(pool.get().second->getId() != saved);
+    waitReady(pool);
+    std::remove("identity_pool_test.0.pem");
+    std::remove("identity_pool_test.0.crt");
+}
+
 void
 CryptoTester::tearDown() {
 
@@ -29,9 +29,13 @@ namespace test {
 class CryptoTester : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(CryptoTester);
     CPPUNIT_TEST(testSignatureEncryption);
+    CPPUNIT_TEST(testEcSignature);
+    CPPUNIT_TEST(testSessionKey);
     CPPUNIT_TEST(testCertificateRevocation);
+    CPPUNIT_TEST(testTrustListCache);
     CPPUNIT_TEST(testCertificateRequest);
     CPPUNIT_TEST(testCertificateSerialNumber);
+    CPPUNIT_TEST(testIdentityPool);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -47,6 +51,18 @@ class CryptoTester : public CppUnit::TestFixture {
      * Test data signature, encryption and decryption
      */
     void testSignatureEncryption();
+    /**
+     * Test value signature with EC keys
+     */
+    void testEcSignature();
+    /**
+     * Test encryption with reused session keys
+     */
+    void testSessionKey();
+    /**
+     * Test the cache of trust list verification results
+     */
+    void testTrustListCache();
     /**
      * Test certificate generation, validation and revocation
      */
@@ -59,6 +75,10 @@ class CryptoTester : public CppUnit::TestFixture {
      * Test certificate serial number extraction
      */
     void testCertificateSerialNumber();
+    /**
+     * Test identity generation ahead of demand, and persistence
+     */
+    void testIdentityPool();
 };
 
 }  // namespace test
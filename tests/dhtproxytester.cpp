@@ -26,6 +26,8 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <cstdio>
+#include <thread>
 
 using namespace std::chrono_literals;
 
@@ -45,7 +47,7 @@ DhtProxyTester::setUp() {
 
     auto serverCAIdentity = dht::crypto::generateEcIdentity("DHT Node CA");
 
-    dht::ProxyServerConfig serverConfig;
+    serverConfig = {};
     serverConfig.identity = dht::crypto::generateIdentity("DHT Node", serverCAIdentity);
     serverConfig.port = 8080;
     serverConfig.pushServer = "127.0.0.1:8090";
@@ -74,6 +76,14 @@ DhtProxyTester::tearDown() {
     CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&]{ return done; }));
     serverProxy.reset();
     nodeProxy.reset();
+    if (not serverConfig.persistStatePath.empty())
+        std::remove(serverConfig.persistStatePath.c_str());
+}
+
+void
+DhtProxyTester::restartServer() {
+    serverProxy.reset();
+    serverProxy = std::make_unique<dht::DhtProxyServer>(nodeProxy, serverConfig);
 }
 
 void
@@ -289,4 +299,163 @@ DhtProxyTester::testFuzzy()
         CPPUNIT_ASSERT(value->data == mtu);
 }
 
+
+void
+DhtProxyTester::testPersistState()
+{
+    serverConfig.persistStatePath = "dhtproxytester.state";
+    std::remove(serverConfig.persistStatePath.c_str());
+    restartServer();
+    nodeClient.run(0, clientConfig);
+
+    std::condition_variable cv;
+    std::mutex cv_m;
+    std::unique_lock<std::mutex> lk(cv_m);
+    bool done = false;
+    bool ok = false;
+    auto key = dht::InfoHash::get("testPersistState");
+    nodeClient.put(key, dht::Value("persistent"), [&](bool r) {
+        std::lock_guard<std::mutex> lk(cv_m);
+        done = true;
+        ok = r;
+        cv.notify_all();
+    }, dht::time_point::max(), true);
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done; }));
+    CPPUNIT_ASSERT(ok);
+    CPPUNIT_ASSERT_EQUAL((size_t)1u, serverProxy->updateStats({})->totalPermanentPuts);
+    lk.unlock();
+
+    // the state is saved when the proxy stops, and loaded when it starts
+    nodeClient.join();
+    restartServer();
+    CPPUNIT_ASSERT_EQUAL((size_t)1u, serverProxy->updateStats({})->totalPermanentPuts);
+
+    // the value of the restored put is found on the DHT
+    auto vals = nodePeer.get(key).get();
+    CPPUNIT_ASSERT_EQUAL((size_t)1u, vals.size());
+    CPPUNIT_ASSERT(vals.front()->data == dht::Value("persistent").data);
+}
+
+void
+DhtProxyTester::testRateLimit()
+{
+    constexpr unsigned N = 32;
+    serverConfig.maxRequestsPerIp = 4;
+    restartServer();
+    nodeClient.run(0, clientConfig);
+
+    std::condition_variable cv;
+    std::mutex cv_m;
+    std::unique_lock<std::mutex> lk(cv_m);
+    unsigned done = 0, failed = 0;
+    auto key = dht::InfoHash::get("testRateLimit");
+    for (unsigned i = 0; i < N; i++) {
+        nodeClient.get(key, [](const std::vector<std::shared_ptr<dht::Value>>&) {
+            return true;
+        }, [&](bool ok) {
+            std::lock_guard<std::mutex> lk(cv_m);
+            done++;
+            if (not ok)
+                failed++;
+            cv.notify_all();
+        });
+    }
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done == N; }));
+    // the requests over the quota are refused with 429
+    CPPUNIT_ASSERT(failed >= N - serverConfig.maxRequestsPerIp);
+
+    // and accepted again once the quota is renewed
+    lk.unlock();
+    std::this_thread::sleep_for(1500ms);
+    lk.lock();
+    bool getOk = false;
+    done = 0;
+    nodeClient.get(key, [](const std::vector<std::shared_ptr<dht::Value>>&) {
+        return true;
+    }, [&](bool ok) {
+        std::lock_guard<std::mutex> lk(cv_m);
+        done++;
+        getOk = ok;
+        cv.notify_all();
+    });
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done == 1; }));
+    CPPUNIT_ASSERT(getOk);
+}
+
+void
+DhtProxyTester::testBatchPut()
+{
+    constexpr unsigned N = 8;
+    nodeClient.run(0, clientConfig);
+    // the client batches puts once it knows the proxy supports it
+    for (unsigned i = 0; i < 100 and nodeClient.getStatus() != dht::NodeStatus::Connected; i++)
+        std::this_thread::sleep_for(100ms);
+    CPPUNIT_ASSERT(nodeClient.getStatus() == dht::NodeStatus::Connected);
+
+    std::condition_variable cv;
+    std::mutex cv_m;
+    std::unique_lock<std::mutex> lk(cv_m);
+    unsigned done = 0, ok = 0;
+    std::vector<dht::InfoHash> keys;
+    for (unsigned i = 0; i < N; i++) {
+        keys.emplace_back(dht::InfoHash::get("testBatchPut" + std::to_string(i)));
+        nodeClient.put(keys.back(), dht::Value("batch " + std::to_string(i)), [&](bool r) {
+            std::lock_guard<std::mutex> lk(cv_m);
+            done++;
+            if (r)
+                ok++;
+            cv.notify_all();
+        });
+    }
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done == N; }));
+    CPPUNIT_ASSERT_EQUAL(N, ok);
+    lk.unlock();
+
+    // each put of the batch reached the DHT
+    for (unsigned i = 0; i < N; i++) {
+        auto vals = nodePeer.get(keys[i]).get();
+        CPPUNIT_ASSERT_EQUAL((size_t)1u, vals.size());
+        CPPUNIT_ASSERT(vals.front()->data == dht::Value("batch " + std::to_string(i)).data);
+    }
+}
+
+void
+DhtProxyTester::testFailover()
+{
+    // a second proxy on the same node, while the first one is stopped
+    auto secondConfig = serverConfig;
+    secondConfig.port = 8081;
+    auto secondProxy = std::make_unique<dht::DhtProxyServer>(nodeProxy, secondConfig);
+    serverProxy.reset();
+
+    clientConfig.proxy_server = "https://127.0.0.1:8080,https://127.0.0.1:8081";
+    nodeClient.run(0, clientConfig);
+    for (unsigned i = 0; i < 200 and nodeClient.getStatus() != dht::NodeStatus::Connected; i++)
+        std::this_thread::sleep_for(100ms);
+    CPPUNIT_ASSERT(nodeClient.getStatus() == dht::NodeStatus::Connected);
+
+    // operations go through the second proxy
+    std::condition_variable cv;
+    std::mutex cv_m;
+    std::unique_lock<std::mutex> lk(cv_m);
+    bool done = false;
+    bool ok = false;
+    auto key = dht::InfoHash::get("testFailover");
+    nodeClient.put(key, dht::Value("failover"), [&](bool r) {
+        std::lock_guard<std::mutex> lk(cv_m);
+        done = true;
+        ok = r;
+        cv.notify_all();
+    });
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done; }));
+    CPPUNIT_ASSERT(ok);
+    lk.unlock();
+
+    auto vals = nodePeer.get(key).get();
+    CPPUNIT_ASSERT_EQUAL((size_t)1u, vals.size());
+    CPPUNIT_ASSERT(vals.front()->data == dht::Value("failover").data);
+
+    nodeClient.join();
+}
+
 }  // namespace test
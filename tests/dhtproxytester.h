@@ -36,6 +36,10 @@ class DhtProxyTester : public CppUnit::TestFixture {
     CPPUNIT_TEST(testResubscribeGetValues);
     CPPUNIT_TEST(testPutGet40KChars);
     CPPUNIT_TEST(testFuzzy);
+    CPPUNIT_TEST(testPersistState);
+    CPPUNIT_TEST(testRateLimit);
+    CPPUNIT_TEST(testBatchPut);
+    CPPUNIT_TEST(testFailover);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -67,8 +71,28 @@ class DhtProxyTester : public CppUnit::TestFixture {
    void testPutGet40KChars();
 
    void testFuzzy();
+    /**
+     * Test that permanent puts are restored by a restarted proxy
+     */
+   void testPersistState();
+    /**
+     * Test that requests over the quota of an address are refused
+     */
+   void testRateLimit();
+    /**
+     * Test the results of puts sent in a batch
+     */
+   void testBatchPut();
+    /**
+     * Test that the client moves to the next proxy when the first one is down
+     */
+   void testFailover();
 
  private:
+    /** Restarts the proxy server with serverConfig */
+   void restartServer();
+
+    dht::ProxyServerConfig serverConfig {};
     dht::DhtRunner::Config clientConfig {};
     dht::DhtRunner nodePeer;
     dht::DhtRunner nodeClient;
@@ -22,6 +22,8 @@
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <set>
+#include <thread>
 using namespace std::chrono_literals;
 
 namespace test {
@@ -75,6 +77,198 @@ DhtRunnerTester::testGetPut() {
     auto vals = node1.get(key).get();
     CPPUNIT_ASSERT(not vals.empty());
     CPPUNIT_ASSERT(vals.front()->data == val_data);
+    auto first = node1.getFirst(key).get();
+    CPPUNIT_ASSERT(first);
+    CPPUNIT_ASSERT(first->data == val_data);
+
+    auto mem = node1.getMemoryStats();
+    CPPUNIT_ASSERT(mem.storage >= val_data.size());
+    CPPUNIT_ASSERT(mem.routing_table > 0);
+    CPPUNIT_ASSERT(mem.getTotal() >= mem.storage + mem.routing_table);
+}
+
+void
+DhtRunnerTester::testGetPutMany() {
+    constexpr unsigned N = 16;
+    std::vector<std::pair<dht::InfoHash, std::shared_ptr<dht::Value>>> values;
+    std::vector<dht::InfoHash> keys;
+    for (unsigned i = 0; i < N; i++) {
+        auto key = dht::InfoHash::get("many" + std::to_string(i));
+        values.emplace_back(key, std::make_shared<dht::Value>(std::to_string(i)));
+        keys.emplace_back(key);
+    }
+
+    std::promise<bool> p;
+    node2.putMany(std::move(values), [&](bool ok){
+        p.set_value(ok);
+    });
+    CPPUNIT_ASSERT(p.get_future().get());
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<unsigned> found(N, 0);
+    unsigned done {0};
+    node1.getMany(keys, [&](size_t i, const std::vector<std::shared_ptr<dht::Value>>& vals) {
+        auto expected = std::to_string(i);
+        std::lock_guard<std::mutex> lk(mutex);
+        for (const auto& v : vals)
+            if (v->data == dht::Blob(expected.begin(), expected.end()))
+                found[i]++;
+        return true;
+    }, [&](size_t, bool ok) {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (ok)
+            done++;
+        cv.notify_all();
+    });
+    std::unique_lock<std::mutex> lk(mutex);
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&]{ return done == N; }));
+    for (auto f : found)
+        CPPUNIT_ASSERT(f > 0);
+    lk.unlock();
+
+    // the value callback is optional
+    std::promise<bool> allDone;
+    node1.getMany(keys, {}, [&](bool ok) { allDone.set_value(ok); });
+    auto doneFuture = allDone.get_future();
+    CPPUNIT_ASSERT(doneFuture.wait_for(10s) == std::future_status::ready);
+    CPPUNIT_ASSERT(doneFuture.get());
+}
+
+/* Puts n values signed by key under hash, from node */
+static bool
+putSigned(dht::DhtRunner& node, const dht::InfoHash& hash, const dht::crypto::PrivateKey& key, unsigned n)
+{
+    std::vector<std::pair<dht::InfoHash, std::shared_ptr<dht::Value>>> values;
+    for (unsigned i = 0; i < n; i++) {
+        auto v = std::make_shared<dht::Value>(std::to_string(i));
+        v->id = i + 1;
+        v->sign(key);
+        values.emplace_back(hash, std::move(v));
+    }
+    std::promise<bool> p;
+    node.putMany(std::move(values), [&](bool ok) { p.set_value(ok); });
+    return p.get_future().get();
+}
+
+void
+DhtRunnerTester::testSignedGet() {
+    // values read from the local storage are delivered at once, with
+    // enough unchecked signatures to be checked on the computation pool
+    constexpr unsigned N = 16;
+    auto key = dht::crypto::PrivateKey::generateEC();
+    auto stopKey = dht::InfoHash::get("signed_stop");
+    auto getKey = dht::InfoHash::get("signed_get");
+    CPPUNIT_ASSERT(putSigned(node1, stopKey, key, N));
+    CPPUNIT_ASSERT(putSigned(node1, getKey, key, N));
+
+    // a get stopped by its callback still completes
+    std::atomic_uint calls {0};
+    std::promise<bool> stopped;
+    node1.get(stopKey, [&](const std::vector<std::shared_ptr<dht::Value>>&) {
+        calls++;
+        return false;
+    }, [&](bool) { stopped.set_value(true); });
+    auto stoppedFuture = stopped.get_future();
+    CPPUNIT_ASSERT(stoppedFuture.wait_for(10s) == std::future_status::ready);
+    CPPUNIT_ASSERT_EQUAL(1u, calls.load());
+
+    // every checked value is delivered before the done callback
+    std::mutex lock;
+    std::set<dht::Value::Id> received;
+    bool lateValue {false};
+    bool finished {false};
+    std::promise<size_t> done;
+    node1.get(getKey, [&](const std::vector<std::shared_ptr<dht::Value>>& values) {
+        std::lock_guard<std::mutex> l(lock);
+        lateValue |= finished;
+        for (const auto& v : values)
+            received.emplace(v->id);
+        return true;
+    }, [&](bool) {
+        std::lock_guard<std::mutex> l(lock);
+        finished = true;
+        done.set_value(received.size());
+    });
+    auto doneFuture = done.get_future();
+    CPPUNIT_ASSERT(doneFuture.wait_for(10s) == std::future_status::ready);
+    CPPUNIT_ASSERT_EQUAL((size_t)N, doneFuture.get());
+    std::lock_guard<std::mutex> l(lock);
+    CPPUNIT_ASSERT(not lateValue);
+}
+
+void
+DhtRunnerTester::testEncryptedSessions() {
+    auto sender = dht::crypto::generateIdentity("sender", {}, 2048);
+    auto recipient = dht::crypto::generateIdentity("recipient", {}, 2048);
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    // new sessions after two values, or once expired
+    config.dht_config.session_key_max_use = 2;
+    config.dht_config.session_key_lifetime = 500ms;
+    config.dht_config.id = sender;
+    dht::DhtRunner node3;
+    node3.run(42242, config);
+    config.dht_config.id = recipient;
+    dht::DhtRunner node4;
+    node4.run(42252, config);
+    node3.bootstrap(node1.getBound());
+    node4.bootstrap(node1.getBound());
+
+    auto key = dht::InfoHash::get("encrypted");
+    auto to = recipient.first->getPublicKey().getId();
+    auto putEncrypted = [&](unsigned i) {
+        std::promise<bool> p;
+        node3.putEncrypted(key, to, dht::Value(std::to_string(i)), [&](bool ok) { p.set_value(ok); });
+        return p.get_future().get();
+    };
+    constexpr unsigned N = 5;
+    for (unsigned i = 0; i < 3; i++)
+        CPPUNIT_ASSERT(putEncrypted(i));
+    // the session of the third value expires
+    std::this_thread::sleep_for(600ms);
+    for (unsigned i = 3; i < N; i++)
+        CPPUNIT_ASSERT(putEncrypted(i));
+
+    // the recipient decrypts values of every session
+    auto values = node4.get(key).get();
+    std::set<std::string> decrypted;
+    for (const auto& v : values) {
+        CPPUNIT_ASSERT(not v->isEncrypted());
+        decrypted.emplace(v->data.begin(), v->data.end());
+    }
+    CPPUNIT_ASSERT_EQUAL((size_t)N, decrypted.size());
+    node3.join();
+    node4.join();
+}
+
+void
+DhtRunnerTester::testSharded() {
+    dht::DhtRunner::Config config;
+    config.dht_config.node_config.max_peer_req_per_sec = -1;
+    config.dht_config.node_config.max_req_per_sec = -1;
+    config.shards = 4;
+    dht::DhtRunner node3;
+    node3.run(42242, config);
+    node3.bootstrap(node1.getBound());
+
+    constexpr unsigned N = 8;
+    for (unsigned i = 0; i < N; i++) {
+        auto key = dht::InfoHash::get("shard" + std::to_string(i));
+        std::promise<bool> p;
+        node3.put(key, dht::Value {"hey"}, [&](bool ok){
+            p.set_value(ok);
+        });
+        CPPUNIT_ASSERT(p.get_future().get());
+        CPPUNIT_ASSERT(not node2.get(key).get().empty());
+        CPPUNIT_ASSERT(not node3.get(key).get().empty());
+    }
+
+    std::promise<void> p;
+    node3.shutdown([&]{ p.set_value(); });
+    CPPUNIT_ASSERT(p.get_future().wait_for(5s) == std::future_status::ready);
+    node3.join();
 }
 
 void
@@ -31,6 +31,10 @@ class DhtRunnerTester : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(DhtRunnerTester);
     CPPUNIT_TEST(testConstructors);
     CPPUNIT_TEST(testGetPut);
+    CPPUNIT_TEST(testGetPutMany);
+    CPPUNIT_TEST(testSignedGet);
+    CPPUNIT_TEST(testEncryptedSessions);
+    CPPUNIT_TEST(testSharded);
     CPPUNIT_TEST(testListen);
     CPPUNIT_TEST(testListenLotOfBytes);
     CPPUNIT_TEST_SUITE_END();
@@ -54,6 +58,22 @@ class DhtRunnerTester : public CppUnit::TestFixture {
      * Test get and put methods
      */
     void testGetPut();
+    /**
+     * Test batch get and put methods
+     */
+    void testGetPutMany();
+    /**
+     * Test gets of signed values, checked on the computation pool
+     */
+    void testSignedGet();
+    /**
+     * Test encrypted puts reusing and renewing session keys
+     */
+    void testEncryptedSessions();
+    /**
+     * Test get and put through a runner with several DHT engines
+     */
+    void testSharded();
     /**
      * Test listen method
      */
@@ -24,12 +24,56 @@
 
 #include <iostream>
 #include <string>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <future>
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(HttpTester);
 
+namespace {
+
+struct PooledResponse {
+    unsigned status {0};
+    /* id of the connection that received the response headers */
+    unsigned connection {0};
+};
+
+std::future<PooledResponse>
+sendPooled(asio::io_context& ctx, const std::shared_ptr<dht::http::ConnectionPool>& pool,
+           const std::string& url, restinio::http_method_id_t method = restinio::http_method_get())
+{
+    auto promise = std::make_shared<std::promise<PooledResponse>>();
+    auto result = std::make_shared<PooledResponse>();
+    auto request = std::make_shared<dht::http::Request>(ctx, url);
+    request->set_method(method);
+    request->set_connection_type(restinio::http_connection_header_t::keep_alive);
+    request->set_connection_pool(pool);
+    request->add_on_state_change_callback([promise, result](dht::http::Request::State state,
+                                                            const dht::http::Response& response) {
+        if (state == dht::http::Request::State::HEADER_RECEIVED) {
+            if (auto r = response.request.lock())
+                if (auto c = r->get_connection())
+                    result->connection = c->id();
+        } else if (state == dht::http::Request::State::DONE) {
+            result->status = response.status_code;
+            promise->set_value(*result);
+        }
+    });
+    request->send();
+    return promise->get_future();
+}
+
+PooledResponse
+waitResponse(std::future<PooledResponse>&& f)
+{
+    CPPUNIT_ASSERT(f.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    return f.get();
+}
+
+}
+
 void
 HttpTester::setUp() {
     nodePeer = std::make_shared<dht::DhtRunner>();
@@ -297,4 +341,185 @@ HttpTester::test_send_json() {
 #endif
 }
 
+void
+HttpTester::test_pool_reuse() {
+    auto pool = std::make_shared<dht::http::ConnectionPool>();
+    auto& ctx = serverProxy->io_context();
+    const std::string url = "http://127.0.0.1:8080/node/info";
+
+    auto first = waitResponse(sendPooled(ctx, pool, url));
+    CPPUNIT_ASSERT_EQUAL(200u, first.status);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, pool->size());
+
+    auto second = waitResponse(sendPooled(ctx, pool, url));
+    CPPUNIT_ASSERT_EQUAL(200u, second.status);
+    CPPUNIT_ASSERT_EQUAL(first.connection, second.connection);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, pool->size());
+
+    pool->clear();
+    CPPUNIT_ASSERT_EQUAL((size_t)0, pool->size());
+}
+
+void
+HttpTester::test_pool_idle_limit() {
+    dht::http::ConnectionPool::Config config;
+    config.maxIdlePerHost = 2;
+    auto pool = std::make_shared<dht::http::ConnectionPool>(config);
+    auto& ctx = serverProxy->io_context();
+    const std::string url = "http://127.0.0.1:8080/node/info";
+
+    // concurrent requests each open their own connection
+    std::vector<std::future<PooledResponse>> responses;
+    for (unsigned i = 0; i < 8; i++)
+        responses.emplace_back(sendPooled(ctx, pool, url));
+    for (auto& r : responses)
+        CPPUNIT_ASSERT_EQUAL(200u, waitResponse(std::move(r)).status);
+    CPPUNIT_ASSERT_EQUAL(config.maxIdlePerHost, pool->size());
+}
+
+void
+HttpTester::test_pool_retry() {
+    // a server closing every connection after one response,
+    // as it would when its keep-alive timeout expired
+    asio::io_context serverCtx;
+    asio::ip::tcp::acceptor acceptor(serverCtx, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    const auto url = "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()) + "/";
+    std::atomic_uint accepted {0};
+    std::thread server([&]{
+        for (unsigned i = 0; i < 3; i++) {
+            asio::error_code ec;
+            asio::ip::tcp::socket socket(serverCtx);
+            acceptor.accept(socket, ec);
+            if (ec)
+                return;
+            accepted++;
+            asio::streambuf buf;
+            asio::read_until(socket, buf, "\r\n\r\n", ec);
+            asio::write(socket, asio::buffer(std::string("HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n")), ec);
+            socket.close(ec);
+        }
+    });
+
+    auto pool = std::make_shared<dht::http::ConnectionPool>();
+    auto& ctx = serverProxy->io_context();
+    CPPUNIT_ASSERT_EQUAL(200u, waitResponse(sendPooled(ctx, pool, url)).status);
+    CPPUNIT_ASSERT_EQUAL(1u, accepted.load());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // the GET fails on the closed pooled connection, and is sent again on a new one
+    CPPUNIT_ASSERT_EQUAL((size_t)1, pool->size());
+    CPPUNIT_ASSERT_EQUAL(200u, waitResponse(sendPooled(ctx, pool, url)).status);
+    CPPUNIT_ASSERT_EQUAL(2u, accepted.load());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // the POST may have been processed by the server: it fails instead
+    CPPUNIT_ASSERT_EQUAL((size_t)1, pool->size());
+    CPPUNIT_ASSERT_EQUAL(0u, waitResponse(sendPooled(ctx, pool, url, restinio::http_method_post())).status);
+    CPPUNIT_ASSERT_EQUAL(2u, accepted.load());
+
+    // unblock the server
+    asio::ip::tcp::socket client(serverCtx);
+    client.connect(acceptor.local_endpoint());
+    server.join();
+}
+
+void
+HttpTester::test_resolver_cache_ttl() {
+    auto& cache = dht::http::ResolverCache::instance();
+    cache.clear();
+    dht::http::ResolverCache::Config config;
+    config.ttl = std::chrono::seconds(1);
+    config.refreshAfter = std::chrono::seconds(1);
+    cache.setConfig(config);
+
+    asio::ip::tcp::endpoint v4a(asio::ip::make_address("192.0.2.1"), 80);
+    asio::ip::tcp::endpoint v4b(asio::ip::make_address("192.0.2.2"), 80);
+    asio::ip::tcp::endpoint v6(asio::ip::make_address("2001:db8::1"), 80);
+    cache.set("example.test", "80", {}, {v4a, v4b, v6});
+
+    asio::error_code ec;
+    std::vector<asio::ip::tcp::endpoint> endpoints;
+    bool refresh = false;
+    CPPUNIT_ASSERT(cache.get("example.test", "80", ec, endpoints, refresh));
+    CPPUNIT_ASSERT(not ec);
+    CPPUNIT_ASSERT(not refresh);
+    // address families alternate, IPv6 first
+    CPPUNIT_ASSERT((endpoints == std::vector<asio::ip::tcp::endpoint>{v6, v4a, v4b}));
+
+    // the last connected endpoint comes first
+    cache.connected("example.test", "80", v4b);
+    CPPUNIT_ASSERT(cache.get("example.test", "80", ec, endpoints, refresh));
+    CPPUNIT_ASSERT(endpoints.front() == v4b);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    CPPUNIT_ASSERT(not cache.get("example.test", "80", ec, endpoints, refresh));
+
+    cache.setConfig({});
+    cache.clear();
+}
+
+void
+HttpTester::test_resolver_cache_refresh() {
+    auto& cache = dht::http::ResolverCache::instance();
+    cache.clear();
+    dht::http::ResolverCache::Config config;
+    config.refreshAfter = std::chrono::seconds(0);
+    cache.setConfig(config);
+
+    asio::ip::tcp::endpoint ep(asio::ip::make_address("192.0.2.1"), 80);
+    cache.set("example.test", "80", {}, {ep});
+
+    asio::error_code ec;
+    std::vector<asio::ip::tcp::endpoint> endpoints;
+    bool refresh = false;
+    CPPUNIT_ASSERT(cache.get("example.test", "80", ec, endpoints, refresh));
+    CPPUNIT_ASSERT(refresh);
+    // only one caller refreshes the entry
+    refresh = false;
+    CPPUNIT_ASSERT(cache.get("example.test", "80", ec, endpoints, refresh));
+    CPPUNIT_ASSERT(not refresh);
+
+    // a failed refresh keeps serving the valid endpoints
+    cache.set("example.test", "80", asio::error::host_not_found, {});
+    CPPUNIT_ASSERT(cache.get("example.test", "80", ec, endpoints, refresh));
+    CPPUNIT_ASSERT(not ec);
+    CPPUNIT_ASSERT(endpoints == std::vector<asio::ip::tcp::endpoint>{ep});
+    // and a next caller refreshes again
+    CPPUNIT_ASSERT(refresh);
+
+    cache.setConfig({});
+    cache.clear();
+}
+
+void
+HttpTester::test_resolver_expired() {
+    auto& cache = dht::http::ResolverCache::instance();
+    cache.clear();
+    auto resolver = std::make_shared<dht::http::Resolver>(serverProxy->io_context(), "http://127.0.0.1:8080");
+
+    auto resolve = [&]{
+        auto promise = std::make_shared<std::promise<std::pair<asio::error_code, size_t>>>();
+        auto f = promise->get_future();
+        resolver->add_callback([promise](const asio::error_code& ec, const std::vector<asio::ip::tcp::endpoint>& endpoints) {
+            promise->set_value({ec, endpoints.size()});
+        });
+        CPPUNIT_ASSERT(f.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+        return f.get();
+    };
+    auto first = resolve();
+    CPPUNIT_ASSERT(not first.first);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, first.second);
+
+    // once the cached resolution is gone, the resolver resolves again
+    cache.erase("127.0.0.1", "8080");
+    auto second = resolve();
+    CPPUNIT_ASSERT(not second.first);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, second.second);
+    asio::error_code ec;
+    std::vector<asio::ip::tcp::endpoint> endpoints;
+    bool refresh = false;
+    CPPUNIT_ASSERT(cache.get("127.0.0.1", "8080", ec, endpoints, refresh));
+    cache.clear();
+}
+
 }  // namespace test
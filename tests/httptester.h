@@ -49,6 +49,14 @@ class HttpTester : public CppUnit::TestFixture {
     CPPUNIT_TEST(test_parse_url_target_ipv6);
     // send
     CPPUNIT_TEST(test_send_json);
+    // connection pool
+    CPPUNIT_TEST(test_pool_reuse);
+    CPPUNIT_TEST(test_pool_idle_limit);
+    CPPUNIT_TEST(test_pool_retry);
+    // resolver cache
+    CPPUNIT_TEST(test_resolver_cache_ttl);
+    CPPUNIT_TEST(test_resolver_cache_refresh);
+    CPPUNIT_TEST(test_resolver_expired);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -86,6 +94,31 @@ class HttpTester : public CppUnit::TestFixture {
      * Test send(json)
      */
    void test_send_json();
+    /**
+     * Test that sequential requests share a pooled connection
+     */
+   void test_pool_reuse();
+    /**
+     * Test that at most maxIdlePerHost connections are kept
+     */
+   void test_pool_idle_limit();
+    /**
+     * Test that only idempotent requests are sent again
+     * when a pooled connection was closed by the server
+     */
+   void test_pool_retry();
+    /**
+     * Test the order and lifetime of cached resolutions
+     */
+   void test_resolver_cache_ttl();
+    /**
+     * Test that a refresh is asked once, and that errors keep valid endpoints
+     */
+   void test_resolver_cache_refresh();
+    /**
+     * Test that a resolver resolves again once its resolution expired
+     */
+   void test_resolver_expired();
 
  private:
     std::shared_ptr<dht::DhtRunner> nodePeer;
@@ -70,6 +70,13 @@ InfoHashTester::testConstructors() {
     for (auto i = 0; i < 20; ++i) {
         CPPUNIT_ASSERT_EQUAL((int)dataStr[i], (int)data[i]);
     }
+    CPPUNIT_ASSERT_EQUAL(std::string("0102030405060708090a0102030405060708090a"), infohashFromStr.toString());
+    // Invalid hex strings build a null infohash
+    CPPUNIT_ASSERT(!dht::InfoHash("0102030405060708090A01020304050607080g0A"));
+    // Other hash sizes
+    auto h256 = dht::h256::getRandom();
+    CPPUNIT_ASSERT(h256 == dht::h256(h256.toString()));
+    CPPUNIT_ASSERT_EQUAL((unsigned)256, dht::h256::commonBits(h256, h256));
 }
 
 void
@@ -136,6 +143,23 @@ InfoHashTester::testXorCmp() {
     CPPUNIT_ASSERT_EQUAL(maxHash.xorCmp(minHash, nullHash), 1);
 }
 
+void
+InfoHashTester::testClosest() {
+    auto target = dht::InfoHash("0100000000000000000000000000000000000000");
+    std::vector<dht::InfoHash> ids {
+        dht::InfoHash("ff00000000000000000000000000000000000000"),
+        dht::InfoHash("0100000000000000000000000000000000000010"),
+        dht::InfoHash(),
+        dht::InfoHash("0100000000000000000000000000000000000001"),
+    };
+    auto closest = target.closest(ids.data(), ids.size(), 3);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, closest.size());
+    CPPUNIT_ASSERT_EQUAL((size_t)3, closest[0]);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, closest[1]);
+    CPPUNIT_ASSERT_EQUAL((size_t)2, closest[2]);
+    CPPUNIT_ASSERT_EQUAL((size_t)4, target.closest(ids.data(), ids.size(), 10).size());
+}
+
 void
 InfoHashTester::tearDown() {
 
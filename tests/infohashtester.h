@@ -32,6 +32,7 @@ class InfoHashTester : public CppUnit::TestFixture {
     CPPUNIT_TEST(testLowBit);
     CPPUNIT_TEST(testCommonBits);
     CPPUNIT_TEST(testXorCmp);
+    CPPUNIT_TEST(testClosest);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -63,6 +64,10 @@ class InfoHashTester : public CppUnit::TestFixture {
      * Test xorCmp operators
      */
     void testXorCmp();
+    /**
+     * Test closest
+     */
+    void testClosest();
 
 };
 
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "linesplittester.h"
+
+#include "line_split.h"
+
+#include <memory>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(LineSplitTester);
+
+static std::string
+lineOf(const dht::LineSplit& split)
+{
+    return {split.line().data(), split.line().size()};
+}
+
+/* Appends data from a buffer freed right after, as bodies received by parts */
+static void
+appendCopy(dht::LineSplit& split, const std::string& data)
+{
+    std::unique_ptr<char[]> part(new char[data.size()]);
+    std::memcpy(part.get(), data.data(), data.size());
+    split.append(part.get(), data.size());
+}
+
+void
+LineSplitTester::setUp() {
+
+}
+
+void
+LineSplitTester::testLines()
+{
+    dht::LineSplit split;
+    std::string part {"first\nsecond\n"};
+    split.append(part.data(), part.size());
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("first\n"), lineOf(split));
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("second\n"), lineOf(split));
+    CPPUNIT_ASSERT(not split.getLine());
+}
+
+void
+LineSplitTester::testSplitLine()
+{
+    dht::LineSplit split;
+    // the parts are freed before the lines they end are read
+    split.append(nullptr, 0);
+    CPPUNIT_ASSERT(not split.getLine());
+    {
+        std::unique_ptr<char[]> part(new char[10]);
+        std::memcpy(part.get(), "one\ntw", 6);
+        split.append(part.get(), 6);
+        CPPUNIT_ASSERT(split.getLine());
+        CPPUNIT_ASSERT_EQUAL(std::string("one\n"), lineOf(split));
+        CPPUNIT_ASSERT(not split.getLine());
+    }
+    appendCopy(split, "o\nthr");
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("two\n"), lineOf(split));
+    CPPUNIT_ASSERT(not split.getLine());
+
+    // a line over several parts, without a separator in between
+    appendCopy(split, "e");
+    CPPUNIT_ASSERT(not split.getLine());
+    appendCopy(split, "e\nfour\nfi");
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("three\n"), lineOf(split));
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("four\n"), lineOf(split));
+    CPPUNIT_ASSERT(not split.getLine());
+    appendCopy(split, "ve\n");
+    CPPUNIT_ASSERT(split.getLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("five\n"), lineOf(split));
+    CPPUNIT_ASSERT(not split.getLine());
+}
+
+void
+LineSplitTester::tearDown() {
+}
+
+}  // namespace test
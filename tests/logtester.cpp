@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "logtester.h"
+
+#include "opendht/log.h"
+
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(LogTester);
+
+void
+LogTester::setUp() {}
+
+void
+LogTester::tearDown() {}
+
+void
+LogTester::testOrder() {
+    constexpr unsigned THREADS = 4;
+    constexpr unsigned N = 4096;
+    std::vector<std::string> messages;
+    {
+        dht::log::AsyncLogger logger([&](const dht::log::LogRecord& r) {
+            messages.emplace_back(r.message);
+        }, THREADS * N);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < THREADS; t++)
+            threads.emplace_back([&logger, t]{
+                for (unsigned i = 0; i < N; i++)
+                    logger.DBG("%u %u", t, i);
+            });
+        for (auto& t : threads)
+            t.join();
+        logger.flush();
+        CPPUNIT_ASSERT_EQUAL((uint64_t)0, logger.getDropped());
+        CPPUNIT_ASSERT_EQUAL((size_t)(THREADS * N), messages.size());
+    }
+
+    std::vector<unsigned> next(THREADS, 0);
+    for (const auto& m : messages) {
+        unsigned t, i;
+        CPPUNIT_ASSERT(sscanf(m.c_str(), "%u %u", &t, &i) == 2);
+        CPPUNIT_ASSERT(t < THREADS);
+        CPPUNIT_ASSERT_EQUAL(next[t], i);
+        next[t]++;
+    }
+}
+
+void
+LogTester::testDropWhenFull() {
+    std::promise<void> entered, release;
+    auto released = release.get_future().share();
+    bool first = true;
+    std::vector<dht::log::LogRecord> records;
+    {
+        // 4 slots, the writer holds the first one in the sink
+        dht::log::AsyncLogger logger([&](const dht::log::LogRecord& r) {
+            if (first) {
+                first = false;
+                entered.set_value();
+                released.wait();
+            }
+            records.emplace_back(r);
+        }, 4);
+        logger.DBG("first");
+        entered.get_future().wait();
+        for (unsigned i = 0; i < 100; i++)
+            logger.DBG("%u", i);
+        CPPUNIT_ASSERT_EQUAL((uint64_t)97, logger.getDropped());
+        release.set_value();
+        logger.flush();
+    }
+
+    // the records that fit, then the report of the dropped ones
+    CPPUNIT_ASSERT_EQUAL((size_t)5, records.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("first"), records[0].message);
+    for (unsigned i = 0; i < 3; i++)
+        CPPUNIT_ASSERT_EQUAL(std::to_string(i), records[i + 1].message);
+    CPPUNIT_ASSERT(records[4].level == dht::log::LogLevel::warning);
+    CPPUNIT_ASSERT(records[4].message.find("97") != std::string::npos);
+}
+
+void
+LogTester::testFlush() {
+    std::mutex lock;
+    size_t written = 0;
+    dht::log::AsyncLogger logger([&](const dht::log::LogRecord&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> l(lock);
+        written++;
+    });
+    // nothing to wait for
+    logger.flush();
+
+    for (unsigned i = 0; i < 50; i++)
+        logger.DBG("%u", i);
+    logger.flush();
+    {
+        std::lock_guard<std::mutex> l(lock);
+        CPPUNIT_ASSERT_EQUAL((size_t)50, written);
+    }
+
+    // a record is written without a flush
+    std::promise<void> done;
+    dht::log::AsyncLogger logger2([&](const dht::log::LogRecord&) { done.set_value(); });
+    logger2.DBG("one");
+    CPPUNIT_ASSERT(done.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+}
+
+}  // namespace test
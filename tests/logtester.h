@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class LogTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(LogTester);
+    CPPUNIT_TEST(testOrder);
+    CPPUNIT_TEST(testDropWhenFull);
+    CPPUNIT_TEST(testFlush);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+    /**
+     * Test that the records of every thread are written in order
+     */
+    void testOrder();
+    /**
+     * Test that records logged while the buffer is full are dropped and reported
+     */
+    void testDropWhenFull();
+    /**
+     * Test that flush waits for the records logged before it
+     */
+    void testFlush();
+};
+
+}  // namespace test
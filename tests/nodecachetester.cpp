@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "nodecachetester.h"
+
+#include "opendht/node_cache.h"
+
+#include <random>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(NodeCacheTester);
+
+static dht::SockAddr
+nodeAddr(size_t i)
+{
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(4222);
+    sin.sin_addr.s_addr = htonl(0x0A000000 + (uint32_t)i);
+    return dht::SockAddr((const sockaddr*)&sin, sizeof(sin));
+}
+
+void
+NodeCacheTester::setUp() {
+
+}
+
+void
+NodeCacheTester::testSameNode()
+{
+    std::mt19937_64 rd {42};
+    dht::NodeCache cache(rd);
+    auto now = dht::clock::now();
+    // nodes in use beyond the cache size, as kept by buckets and searches
+    const size_t n = dht::NodeCache::MAX_NODES + 100;
+    std::vector<dht::Sp<dht::Node>> nodes;
+    nodes.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        nodes.emplace_back(cache.getNode(dht::InfoHash::getRandom(rd), nodeAddr(i), now, true));
+    CPPUNIT_ASSERT_EQUAL(n, cache.size(AF_INET));
+
+    // they keep mapping to the same instance
+    for (size_t i = 0; i < n; i += 97) {
+        const auto& node = nodes[i];
+        CPPUNIT_ASSERT(cache.getNode(node->id, AF_INET) == node);
+        CPPUNIT_ASSERT(cache.getNode(node->id, node->getAddr(), now, false) == node);
+    }
+}
+
+void
+NodeCacheTester::testEvictReleased()
+{
+    std::mt19937_64 rd {42};
+    dht::NodeCache cache(rd);
+    auto now = dht::clock::now();
+    auto kept = cache.getNode(dht::InfoHash::getRandom(rd), nodeAddr(0), now, true);
+    const size_t n = 2 * dht::NodeCache::MAX_NODES;
+    for (size_t i = 1; i < n; i++)
+        cache.getNode(dht::InfoHash::getRandom(rd), nodeAddr(i), now, true);
+    // released nodes are evicted, the one in use stays
+    CPPUNIT_ASSERT(cache.size(AF_INET) <= dht::NodeCache::MAX_NODES);
+    CPPUNIT_ASSERT(cache.getNode(kept->id, AF_INET) == kept);
+}
+
+void
+NodeCacheTester::tearDown() {
+}
+
+}  // namespace test
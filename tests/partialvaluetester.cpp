@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "partialvaluetester.h"
+
+#include "opendht/network_engine.h"
+
+// internal
+#include "parsed_message.h"
+
+#include <algorithm>
+#include <random>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(PartialValueTester);
+
+using dht::net::PartialValue;
+
+static dht::Blob
+makeData(size_t size)
+{
+    dht::Blob data(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7);
+    return data;
+}
+
+/* Offsets of the parts of a value of size bytes sent in parts of psize bytes */
+static std::vector<size_t>
+partOffsets(size_t size, size_t psize)
+{
+    std::vector<size_t> offsets;
+    for (size_t o = 0; o < size; o += psize)
+        offsets.emplace_back(o);
+    return offsets;
+}
+
+static bool
+insertPart(PartialValue& pv, const dht::Blob& data, size_t offset, size_t psize)
+{
+    auto len = std::min(psize, data.size() - offset);
+    return pv.insert(offset, dht::net::BlobView(data.data() + offset, len));
+}
+
+void
+PartialValueTester::setUp() {
+
+}
+
+void
+PartialValueTester::testOutOfOrder()
+{
+    auto data = makeData(10000);
+    auto offsets = partOffsets(data.size(), 1280);
+    std::mt19937 rd {42};
+    std::shuffle(offsets.begin(), offsets.end(), rd);
+
+    PartialValue pv(data.size());
+    pv.allocate();
+    for (size_t i = 0; i < offsets.size(); i++) {
+        CPPUNIT_ASSERT(not pv.complete());
+        CPPUNIT_ASSERT(insertPart(pv, data, offsets[i], 1280));
+    }
+    CPPUNIT_ASSERT(pv.complete());
+    CPPUNIT_ASSERT(pv.data == data);
+}
+
+void
+PartialValueTester::testDuplicates()
+{
+    auto data = makeData(5000);
+    PartialValue pv(data.size());
+    pv.allocate();
+    CPPUNIT_ASSERT(insertPart(pv, data, 2560, 1280));
+    CPPUNIT_ASSERT(not insertPart(pv, data, 2560, 1280));
+    CPPUNIT_ASSERT(insertPart(pv, data, 0, 1280));
+    CPPUNIT_ASSERT(not insertPart(pv, data, 0, 1280));
+    // a part covered by already received ones
+    CPPUNIT_ASSERT(not insertPart(pv, data, 100, 500));
+    CPPUNIT_ASSERT(insertPart(pv, data, 1280, 1280));
+    CPPUNIT_ASSERT(not pv.complete());
+    CPPUNIT_ASSERT(insertPart(pv, data, 3840, 1280));
+    CPPUNIT_ASSERT(not insertPart(pv, data, 3840, 1280));
+    CPPUNIT_ASSERT(pv.complete());
+    CPPUNIT_ASSERT(pv.data == data);
+
+    // parts out of bounds are rejected
+    PartialValue small(100);
+    small.allocate();
+    CPPUNIT_ASSERT(not small.insert(100, dht::net::BlobView(data.data(), 1)));
+    CPPUNIT_ASSERT(not small.insert(50, dht::net::BlobView(data.data(), 51)));
+    CPPUNIT_ASSERT(not small.insert(0, dht::net::BlobView(data.data(), 0)));
+    CPPUNIT_ASSERT_EQUAL(100u, small.missing);
+}
+
+void
+PartialValueTester::testSenderPartSize()
+{
+    // the sender's part size doesn't need to match ours
+    auto data = makeData(7000);
+    for (size_t psize : {500, 1000, 1400, 4096}) {
+        auto offsets = partOffsets(data.size(), psize);
+        std::reverse(offsets.begin(), offsets.end());
+        PartialValue pv(data.size());
+        pv.allocate();
+        for (auto o : offsets)
+            CPPUNIT_ASSERT(insertPart(pv, data, o, psize));
+        CPPUNIT_ASSERT(pv.complete());
+        CPPUNIT_ASSERT(pv.data == data);
+    }
+}
+
+void
+PartialValueTester::testMissingRanges()
+{
+    auto data = makeData(4000);
+    PartialValue pv(data.size());
+    pv.allocate();
+    CPPUNIT_ASSERT((pv.missingRanges() == std::vector<unsigned>{0, 4000}));
+    insertPart(pv, data, 1000, 1000);
+    insertPart(pv, data, 3000, 1000);
+    CPPUNIT_ASSERT((pv.missingRanges() == std::vector<unsigned>{0, 1000, 2000, 3000}));
+    // overlapping and adjacent parts merge
+    insertPart(pv, data, 1500, 1000);
+    insertPart(pv, data, 0, 1000);
+    CPPUNIT_ASSERT((pv.missingRanges() == std::vector<unsigned>{2500, 3000}));
+    CPPUNIT_ASSERT_EQUAL(500u, pv.missing);
+    insertPart(pv, data, 2500, 500);
+    CPPUNIT_ASSERT(pv.missingRanges().empty());
+    CPPUNIT_ASSERT(pv.complete());
+    CPPUNIT_ASSERT(pv.data == data);
+}
+
+void
+PartialValueTester::tearDown() {
+}
+
+}  // namespace test
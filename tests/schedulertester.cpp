@@ -0,0 +1,126 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "schedulertester.h"
+
+#include "opendht/scheduler.h"
+
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(SchedulerTester);
+
+using namespace std::chrono_literals;
+
+void
+SchedulerTester::setUp() {
+
+}
+
+void
+SchedulerTester::testRunOrder()
+{
+    dht::Scheduler scheduler;
+    auto start = scheduler.time();
+    std::vector<int> order;
+    scheduler.add(start + 20ms, [&]{ order.emplace_back(3); });
+    scheduler.add(start + 1500us, [&]{ order.emplace_back(2); });
+    scheduler.add(start + 1200us, [&]{ order.emplace_back(1); });
+    scheduler.add(start + 20ms, [&]{ order.emplace_back(4); });
+    scheduler.add(start + 2s, [&]{ order.emplace_back(5); });
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 1200us);
+
+    scheduler.syncTime(start + 1400us);
+    CPPUNIT_ASSERT(scheduler.run() == start + 1500us);
+    CPPUNIT_ASSERT((order == std::vector<int>{1}));
+
+    scheduler.syncTime(start + 1s);
+    CPPUNIT_ASSERT(scheduler.run() == start + 2s);
+    CPPUNIT_ASSERT((order == std::vector<int>{1, 2, 3, 4}));
+
+    // jobs scheduled in the past run on the next pass
+    scheduler.add(start, [&]{ order.emplace_back(0); });
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start);
+    scheduler.syncTime(start + 3s);
+    CPPUNIT_ASSERT(scheduler.run() == dht::time_point::max());
+    CPPUNIT_ASSERT((order == std::vector<int>{1, 2, 3, 4, 0, 5}));
+}
+
+void
+SchedulerTester::testEditCancel()
+{
+    dht::Scheduler scheduler;
+    auto start = scheduler.time();
+    unsigned count {0};
+    auto job1 = scheduler.add(start + 10ms, [&]{ count += 1; });
+    auto job2 = scheduler.add(start + 20ms, [&]{ count += 10; });
+    auto job3 = scheduler.add(dht::time_point::max(), [&]{ count += 100; });
+    CPPUNIT_ASSERT(job1->scheduled());
+    CPPUNIT_ASSERT(not job3->scheduled());
+
+    job1->cancel();
+    CPPUNIT_ASSERT(not job1->scheduled());
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 20ms);
+
+    scheduler.edit(job2, start + 5min);
+    scheduler.edit(job3, start + 30ms);
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 30ms);
+
+    scheduler.syncTime(start + 1min);
+    CPPUNIT_ASSERT(scheduler.run() == start + 5min);
+    CPPUNIT_ASSERT_EQUAL(100u, count);
+
+    // a job can reschedule itself
+    dht::Sp<dht::Scheduler::Job> job4;
+    job4 = scheduler.add(start + 2min, [&]{
+        count += 1000;
+        scheduler.edit(job4, scheduler.time() + 1min);
+    });
+    scheduler.syncTime(start + 2min);
+    CPPUNIT_ASSERT(scheduler.run() == start + 3min);
+    CPPUNIT_ASSERT_EQUAL(1100u, count);
+    job4->cancel();
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 5min);
+}
+
+void
+SchedulerTester::testLongDelays()
+{
+    dht::Scheduler scheduler;
+    auto start = scheduler.time();
+    std::vector<int> order;
+    scheduler.add(start + 24h * 100, [&]{ order.emplace_back(3); });
+    scheduler.add(start + 24h, [&]{ order.emplace_back(2); });
+    scheduler.add(start + 70s, [&]{ order.emplace_back(1); });
+    CPPUNIT_ASSERT(scheduler.getNextJobTime() == start + 70s);
+
+    scheduler.syncTime(start + 24h * 99);
+    CPPUNIT_ASSERT(scheduler.run() == start + 24h * 100);
+    CPPUNIT_ASSERT((order == std::vector<int>{1, 2}));
+
+    scheduler.syncTime(start + 24h * 100);
+    CPPUNIT_ASSERT(scheduler.run() == dht::time_point::max());
+    CPPUNIT_ASSERT((order == std::vector<int>{1, 2, 3}));
+}
+
+void
+SchedulerTester::tearDown() {
+}
+
+}  // namespace test
@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "simulatednetworktester.h"
+
+#include "opendht/simulated_network.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(SimulatedNetworkTester);
+
+using namespace std::chrono_literals;
+
+/* Builds a network of n nodes, each bootstrapped from the previous one */
+static void
+populate(dht::net::SimulatedNetwork& net, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        net.addNode();
+        if (i)
+            net.bootstrap(i, i - 1);
+    }
+    net.runFor(1min);
+}
+
+static uint64_t
+totalPacketsSent(const dht::net::SimulatedNetwork& net)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < net.size(); i++)
+        total += net.traffic(i).packets_sent;
+    return total;
+}
+
+static std::string
+readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return ss.str();
+}
+
+/* Buckets and their live nodes from a routing table log, without counts nor times */
+static std::string
+routingView(const std::string& log)
+{
+    std::istringstream in(log);
+    std::string view, line;
+    while (std::getline(in, line)) {
+        if (line.find("[expired]") != std::string::npos)
+            continue;
+        view += line.substr(0, std::min(line.find(" count:"), line.find(" updated:"))) + '\n';
+    }
+    return view;
+}
+
+void
+SimulatedNetworkTester::setUp() {
+
+}
+
+void
+SimulatedNetworkTester::testPutGet()
+{
+    dht::net::SimulatedNetwork::Config config;
+    config.loss = 0.01;
+    dht::net::SimulatedNetwork net(config);
+    populate(net, 64);
+    CPPUNIT_ASSERT(net.node(0).getNodesStats(AF_INET).good_nodes > 0);
+
+    auto key = dht::InfoHash::get("simulated");
+    bool putDone {false}, putOk {false};
+    net.node(3).put(key, dht::Value {dht::Blob {42}}, [&](bool ok) {
+        putDone = true;
+        putOk = ok;
+    });
+    auto start = net.now();
+    while (not putDone and net.now() - start < 1min)
+        net.runFor(100ms);
+    CPPUNIT_ASSERT(putOk);
+
+    std::vector<std::shared_ptr<dht::Value>> values;
+    bool getDone {false};
+    net.node(60).get(key, [&](const std::vector<std::shared_ptr<dht::Value>>& vals) {
+        values.insert(values.end(), vals.begin(), vals.end());
+        return true;
+    }, [&](bool) {
+        getDone = true;
+    });
+    start = net.now();
+    while (not getDone and net.now() - start < 1min)
+        net.runFor(100ms);
+    CPPUNIT_ASSERT(getDone);
+    CPPUNIT_ASSERT(not values.empty());
+    CPPUNIT_ASSERT((values.front()->data == dht::Blob {42}));
+}
+
+void
+SimulatedNetworkTester::testDeterministic()
+{
+    dht::net::SimulatedNetwork::Config config;
+    config.seed = 42;
+    config.loss = 0.05;
+    config.bandwidth = 64 * 1024;
+    dht::net::SimulatedNetwork a(config), b(config);
+    populate(a, 32);
+    populate(b, 32);
+    CPPUNIT_ASSERT_EQUAL(totalPacketsSent(a), totalPacketsSent(b));
+    for (size_t i = 0; i < a.size(); i++) {
+        CPPUNIT_ASSERT_EQUAL(a.node(i).getNodeId(), b.node(i).getNodeId());
+        CPPUNIT_ASSERT_EQUAL(a.traffic(i).bytes_received, b.traffic(i).bytes_received);
+    }
+}
+
+void
+SimulatedNetworkTester::testConnectivityChanged()
+{
+    dht::net::SimulatedNetwork net;
+    populate(net, 32);
+    auto key = dht::InfoHash::get("connectivity");
+    std::vector<std::shared_ptr<dht::Value>> values;
+    net.node(0).listen(key, [&](const std::vector<std::shared_ptr<dht::Value>>& vals) {
+        values.insert(values.end(), vals.begin(), vals.end());
+        return true;
+    });
+    net.runFor(10s);
+
+    // the address didn't change: known nodes stay good
+    auto good = net.node(0).getNodesStats(AF_INET).good_nodes;
+    CPPUNIT_ASSERT(good > 0);
+    net.node(0).connectivityChanged();
+    CPPUNIT_ASSERT_EQUAL(good, net.node(0).getNodesStats(AF_INET).good_nodes);
+    net.runFor(10s);
+    CPPUNIT_ASSERT(net.node(0).getNodesStats(AF_INET).good_nodes > 0);
+
+    // and the listen is still registered
+    net.node(16).put(key, dht::Value {dht::Blob {42}});
+    auto start = net.now();
+    while (values.empty() and net.now() - start < 1min)
+        net.runFor(100ms);
+    CPPUNIT_ASSERT(not values.empty());
+    CPPUNIT_ASSERT((values.front()->data == dht::Blob {42}));
+}
+
+void
+SimulatedNetworkTester::testRoutingSnapshot()
+{
+    dht::net::SimulatedNetwork net;
+    populate(net, 32);
+    auto& node = net.node(0);
+    const std::string path {"routing_snapshot_test"};
+    const std::string snapshotPath {path + ".nodes"};
+
+    // saving an unchanged table gives the same snapshot
+    node.saveState(path);
+    auto snapshot = readFile(snapshotPath);
+    CPPUNIT_ASSERT(not snapshot.empty());
+    node.saveState(path);
+    CPPUNIT_ASSERT(snapshot == readFile(snapshotPath));
+
+    // buckets and nodes are restored as they were
+    dht::net::SimulatedNetwork restoredNet;
+    restoredNet.addNode();
+    auto& restored = restoredNet.node(0);
+    restored.loadState(path);
+    CPPUNIT_ASSERT_EQUAL(node.getNodeId(), restored.getNodeId());
+    auto stats = node.getNodesStats(AF_INET);
+    auto restoredStats = restored.getNodesStats(AF_INET);
+    CPPUNIT_ASSERT(stats.getKnownNodes() > 0);
+    CPPUNIT_ASSERT_EQUAL(stats.getKnownNodes(), restoredStats.getKnownNodes());
+    CPPUNIT_ASSERT_EQUAL(stats.table_depth, restoredStats.table_depth);
+    CPPUNIT_ASSERT_EQUAL(routingView(node.getRoutingTablesLog(AF_INET)),
+                         routingView(restored.getRoutingTablesLog(AF_INET)));
+
+    std::remove(path.c_str());
+    std::remove(snapshotPath.c_str());
+}
+
+void
+SimulatedNetworkTester::tearDown() {
+
+}
+
+}  // namespace test
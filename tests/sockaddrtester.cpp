@@ -0,0 +1,191 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sockaddrtester.h"
+
+#include "opendht/sockaddr.h"
+
+#include <cstring>
+#include <vector>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(SockAddrTester);
+
+/* Addresses stored inline (IPv4, IPv6) and on the heap (larger ones) */
+static std::vector<dht::SockAddr>
+addresses()
+{
+    std::vector<dht::SockAddr> addrs;
+    addrs.emplace_back();
+
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(4222);
+    sin.sin_addr.s_addr = htonl(0x7F000001);
+    addrs.emplace_back((const sockaddr*)&sin, sizeof(sin));
+
+    sockaddr_in6 sin6 {};
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(4223);
+    sin6.sin6_addr.s6_addr[15] = 1;
+    addrs.emplace_back((const sockaddr*)&sin6, sizeof(sin6));
+
+    sockaddr_storage ss;
+    std::memset(&ss, 0x5a, sizeof(ss));
+    ss.ss_family = AF_UNIX;
+    addrs.emplace_back((const sockaddr*)&ss, sizeof(ss));
+    addrs.emplace_back((const sockaddr*)&ss, sizeof(sockaddr_in6) + 1);
+    return addrs;
+}
+
+static void
+checkBytes(const dht::SockAddr& addr, const dht::SockAddr& expected)
+{
+    CPPUNIT_ASSERT_EQUAL(expected.getLength(), addr.getLength());
+    CPPUNIT_ASSERT(addr == expected);
+    if (addr.getLength()) {
+        CPPUNIT_ASSERT(addr.get() != expected.get());
+        CPPUNIT_ASSERT(std::memcmp(addr.get(), expected.get(), addr.getLength()) == 0);
+    } else {
+        CPPUNIT_ASSERT(not addr);
+        CPPUNIT_ASSERT(addr.get() == nullptr);
+    }
+}
+
+void
+SockAddrTester::setUp() {
+
+}
+
+void
+SockAddrTester::testStorage()
+{
+    auto addrs = addresses();
+    CPPUNIT_ASSERT(not addrs[0]);
+    CPPUNIT_ASSERT_EQUAL((sa_family_t)AF_INET, addrs[1].getFamily());
+    CPPUNIT_ASSERT_EQUAL((in_port_t)4222, addrs[1].getPort());
+    CPPUNIT_ASSERT_EQUAL((sa_family_t)AF_INET6, addrs[2].getFamily());
+    CPPUNIT_ASSERT_EQUAL((in_port_t)4223, addrs[2].getPort());
+    CPPUNIT_ASSERT_EQUAL((sa_family_t)AF_UNIX, addrs[3].getFamily());
+    CPPUNIT_ASSERT_EQUAL((socklen_t)sizeof(sockaddr_storage), addrs[3].getLength());
+    CPPUNIT_ASSERT(((const uint8_t*)addrs[3].get())[sizeof(sockaddr_storage) - 1] == 0x5a);
+    CPPUNIT_ASSERT(not (addrs[3] == addrs[4]));
+
+    // empty addresses have no storage
+    dht::SockAddr empty;
+    CPPUNIT_ASSERT(addrs[0] == empty);
+    CPPUNIT_ASSERT(not (addrs[0] < empty));
+    CPPUNIT_ASSERT(dht::SockAddr::ipEqual {}(addrs[0], empty));
+    CPPUNIT_ASSERT(not dht::SockAddr::ipCmp {}(addrs[0], empty));
+}
+
+void
+SockAddrTester::testCopy()
+{
+    auto addrs = addresses();
+    for (const auto& a : addrs) {
+        dht::SockAddr copy(a);
+        checkBytes(copy, a);
+        // assignment over every storage size
+        for (const auto& b : addrs) {
+            dht::SockAddr c(b);
+            c = a;
+            checkBytes(c, a);
+            checkBytes(copy, a);
+        }
+        const auto& self = copy;
+        copy = self;
+        checkBytes(copy, a);
+    }
+}
+
+void
+SockAddrTester::testMove()
+{
+    auto addrs = addresses();
+    for (const auto& a : addrs) {
+        dht::SockAddr src(a);
+        dht::SockAddr moved(std::move(src));
+        checkBytes(moved, a);
+        CPPUNIT_ASSERT(not src);
+        // move assignment over every storage size
+        for (const auto& b : addrs) {
+            dht::SockAddr from(a), to(b);
+            to = std::move(from);
+            checkBytes(to, a);
+            CPPUNIT_ASSERT(not from);
+            // the moved-from address can be set again
+            from = b;
+            checkBytes(from, b);
+        }
+        auto& self = moved;
+        moved = std::move(self);
+        checkBytes(moved, a);
+    }
+}
+
+void
+SockAddrTester::testSetFamily()
+{
+    auto addrs = addresses();
+    // switching between inline and heap storage
+    dht::SockAddr addr(addrs[3]);
+    addr.setFamily(AF_INET);
+    CPPUNIT_ASSERT_EQUAL((socklen_t)sizeof(sockaddr_in), addr.getLength());
+    CPPUNIT_ASSERT_EQUAL((sa_family_t)AF_INET, addr.getFamily());
+    CPPUNIT_ASSERT_EQUAL((in_port_t)0, addr.getPort());
+    addr.setFamily(AF_INET6);
+    CPPUNIT_ASSERT_EQUAL((socklen_t)sizeof(sockaddr_in6), addr.getLength());
+    addr.setPort(4224);
+    CPPUNIT_ASSERT_EQUAL((in_port_t)4224, addr.getPort());
+    addr = addrs[4];
+    checkBytes(addr, addrs[4]);
+    addr.setFamily(AF_UNSPEC);
+    CPPUNIT_ASSERT(not addr);
+}
+
+void
+SockAddrTester::testIpHash()
+{
+    auto addrs = addresses();
+    // the port is not part of the hash
+    dht::SockAddr other(addrs[1]);
+    other.setPort(4224);
+    const dht::SockAddr::ipHash h1 {1}, h2 {2};
+    CPPUNIT_ASSERT_EQUAL(h1(addrs[1]), h1(other));
+    CPPUNIT_ASSERT(dht::SockAddr::ipEqual {}(addrs[1], other));
+
+    // the seed changes the hash of every address
+    unsigned collisions = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+        sockaddr_in sin {};
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(0x0A000000 | i);
+        dht::SockAddr addr((const sockaddr*)&sin, sizeof(sin));
+        if (h1(addr) == h2(addr))
+            collisions++;
+    }
+    CPPUNIT_ASSERT_EQUAL(0u, collisions);
+}
+
+void
+SockAddrTester::tearDown() {
+}
+
+}  // namespace test
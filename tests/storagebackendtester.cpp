@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "storagebackendtester.h"
+
+#include "opendht/storage_backend.h"
+
+#include <cstdio>
+#include <map>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(StorageBackendTester);
+
+using namespace std::chrono_literals;
+
+static std::map<dht::Value::Id, dht::Blob>
+loadValues(dht::LogStorageBackend& backend)
+{
+    std::map<dht::Value::Id, dht::Blob> values;
+    backend.load([&](const dht::InfoHash&, const std::shared_ptr<dht::Value>& v, dht::time_point, dht::time_point,
+                     const dht::SockAddr&) {
+        values.emplace(v->id, v->data);
+    });
+    return values;
+}
+
+void
+StorageBackendTester::setUp() {
+    path_ = "opendht_test_storage_" + dht::InfoHash::getRandom().toString().substr(0, 8);
+}
+
+void
+StorageBackendTester::testReload()
+{
+    auto key = dht::InfoHash::get("key");
+    auto now = dht::clock::now();
+    {
+        dht::LogStorageBackend backend(path_);
+        for (dht::Value::Id id = 1; id <= 3; id++) {
+            dht::Value v {dht::Blob {(uint8_t)id}};
+            v.id = id;
+            backend.put(key, v, now, now + 10min);
+        }
+        dht::Value v {dht::Blob {42}};
+        v.id = 2;
+        backend.put(key, v, now, now + 10min);
+        backend.erase(key, 3);
+        backend.refresh(key, 1, now, now + 20min);
+    }
+    dht::LogStorageBackend backend(path_);
+    auto values = loadValues(backend);
+    CPPUNIT_ASSERT_EQUAL((size_t)2, values.size());
+    CPPUNIT_ASSERT((values[1] == dht::Blob {1}));
+    CPPUNIT_ASSERT((values[2] == dht::Blob {42}));
+}
+
+void
+StorageBackendTester::testCompaction()
+{
+    auto key = dht::InfoHash::get("key");
+    auto now = dht::clock::now();
+    {
+        // small segments, so that every few puts start a new one
+        dht::LogStorageBackend backend(path_, 256);
+        for (unsigned i = 0; i < 64; i++) {
+            dht::Value v {dht::Blob(16, (uint8_t)i)};
+            v.id = i % 4;
+            backend.put(key, v, now, now + 10min);
+        }
+        auto size = backend.logSize();
+        for (unsigned i = 0; i < 64; i++)
+            backend.maintain();
+        CPPUNIT_ASSERT(backend.logSize() < size);
+        CPPUNIT_ASSERT(backend.logSize() <= 2 * backend.liveSize() + 256);
+    }
+    dht::LogStorageBackend backend(path_, 256);
+    auto values = loadValues(backend);
+    CPPUNIT_ASSERT_EQUAL((size_t)4, values.size());
+    for (unsigned i = 0; i < 4; i++)
+        CPPUNIT_ASSERT((values[i] == dht::Blob(16, (uint8_t)(60 + i))));
+}
+
+void
+StorageBackendTester::testSource()
+{
+    auto key = dht::InfoHash::get("key");
+    auto now = dht::clock::now();
+    dht::SockAddr source;
+    source.setFamily(AF_INET);
+    source.setAddress("192.168.1.4");
+    source.setPort(4222);
+    {
+        dht::LogStorageBackend backend(path_, 128);
+        dht::Value local {dht::Blob {1}};
+        local.id = 1;
+        backend.put(key, local, now, now + 10min);
+        for (unsigned i = 0; i < 16; i++) {
+            dht::Value v {dht::Blob(16, (uint8_t)i)};
+            v.id = 2;
+            backend.put(key, v, now, now + 10min, source);
+        }
+        // move the values to a new segment
+        for (unsigned i = 0; i < 16; i++)
+            backend.maintain();
+    }
+    dht::LogStorageBackend backend(path_, 128);
+    std::map<dht::Value::Id, dht::SockAddr> sources;
+    backend.load([&](const dht::InfoHash&, const std::shared_ptr<dht::Value>& v, dht::time_point, dht::time_point,
+                     const dht::SockAddr& sa) {
+        sources.emplace(v->id, sa);
+    });
+    CPPUNIT_ASSERT_EQUAL((size_t)2, sources.size());
+    CPPUNIT_ASSERT(not sources[1]);
+    CPPUNIT_ASSERT(sources[2] == source);
+}
+
+void
+StorageBackendTester::tearDown() {
+    for (unsigned i = 0; i < 256; i++)
+        std::remove((path_ + "." + std::to_string(i)).c_str());
+    std::remove(path_.c_str());
+}
+
+}  // namespace test
@@ -20,7 +20,10 @@
 #include "threadpooltester.h"
 
 #include "opendht/thread_pool.h"
+#include "opendht/mpsc_queue.h"
 #include <atomic>
+#include <iostream>
+#include <thread>
 
 namespace test {
 CPPUNIT_TEST_SUITE_REGISTRATION(ThreadPoolTester);
@@ -83,6 +86,136 @@ ThreadPoolTester::testExecutor()
     CPPUNIT_ASSERT_EQUAL(N, count8.load());
 }
 
+void
+ThreadPoolTester::testPriority()
+{
+    dht::ThreadPool pool(1);
+    std::promise<void> started;
+    std::promise<void> blocked;
+    std::mutex lock;
+    std::vector<int> order;
+    auto add = [&](int i) {
+        std::lock_guard<std::mutex> l(lock);
+        order.emplace_back(i);
+    };
+
+    // keep the only thread busy while queuing tasks
+    auto busy = pool.get<bool>([&started, f = blocked.get_future().share()] {
+        started.set_value();
+        f.wait();
+        return true;
+    });
+    started.get_future().wait();
+    for (int i = 0; i < 3; i++)
+        pool.run([&, i] { add(20 + i); }, dht::ThreadPool::Priority::Low);
+    for (int i = 0; i < 3; i++)
+        pool.run([&, i] { add(10 + i); });
+    for (int i = 0; i < 3; i++)
+        pool.run([&, i] { add(i); }, dht::ThreadPool::Priority::High);
+    auto stats = pool.getStats();
+    CPPUNIT_ASSERT_EQUAL(1u, stats.threads);
+    CPPUNIT_ASSERT_EQUAL(1u, stats.active);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, stats.queued[(unsigned)dht::ThreadPool::Priority::High]);
+
+    blocked.set_value();
+    CPPUNIT_ASSERT(busy.get());
+    auto last = pool.get<bool>([] { return true; }, dht::ThreadPool::Priority::Low);
+    CPPUNIT_ASSERT(last.get());
+    {
+        std::lock_guard<std::mutex> l(lock);
+        CPPUNIT_ASSERT((order == std::vector<int>{0, 1, 2, 10, 11, 12, 20, 21, 22}));
+    }
+    // run time is recorded after the task returns: wait for the worker to exit
+    pool.join();
+    stats = pool.getStats();
+    CPPUNIT_ASSERT_EQUAL((uint64_t)3, stats.wait[(unsigned)dht::ThreadPool::Priority::High].count);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)4, stats.run[(unsigned)dht::ThreadPool::Priority::Low].count);
+}
+
+void
+ThreadPoolTester::testMpscQueue()
+{
+    constexpr unsigned PRODUCERS = 4;
+    constexpr unsigned N = 64 * 1024;
+    dht::MpscQueue<unsigned> queue;
+    std::atomic_uint done {0};
+    std::vector<std::thread> producers;
+    for (unsigned p = 0; p < PRODUCERS; p++)
+        producers.emplace_back([&, p] {
+            for (unsigned i = 0; i < N; i++)
+                queue.emplace(p * N + i);
+            done++;
+        });
+
+    // values of each producer must come out once and in order
+    std::vector<unsigned> next(PRODUCERS, 0);
+    unsigned count = 0;
+    bool ordered = true;
+    auto check = [&](unsigned v) {
+        auto& n = next[v / N];
+        ordered &= v % N == n++;
+        count++;
+    };
+    while (done.load() != PRODUCERS)
+        queue.drain(check);
+    for (auto& t : producers)
+        t.join();
+    // all pushes completed: a single drain must find every remaining value
+    queue.drain(check);
+    CPPUNIT_ASSERT(ordered);
+    CPPUNIT_ASSERT_EQUAL(PRODUCERS * N, count);
+    CPPUNIT_ASSERT(queue.empty());
+    unsigned v;
+    CPPUNIT_ASSERT(not queue.pop(v));
+}
+
+void
+ThreadPoolTester::testBenchmark()
+{
+    dht::ThreadPool pool(std::max(std::thread::hardware_concurrency(), 4u));
+    constexpr unsigned SUBMITTERS = 4;
+    constexpr unsigned N = 256 * 1024;
+    auto waitFor = [](const std::atomic_uint& count, unsigned n) {
+        auto start = clock::now();
+        while (count.load() != n && clock::now() - start < std::chrono::seconds(30))
+            std::this_thread::yield();
+        return count.load() == n;
+    };
+
+    // tasks submitted from external threads
+    std::atomic_uint count {0};
+    auto start = clock::now();
+    std::vector<std::thread> submitters;
+    for (unsigned s = 0; s < SUBMITTERS; s++)
+        submitters.emplace_back([&] {
+            for (unsigned i = 0; i < N / SUBMITTERS; i++)
+                pool.run([&] { count++; });
+        });
+    for (auto& t : submitters)
+        t.join();
+    CPPUNIT_ASSERT(waitFor(count, N));
+    auto external = clock::now() - start;
+
+    // tasks submitted by tasks, kept on the worker deques
+    std::atomic_uint nested {0};
+    constexpr unsigned FORK = 64;
+    start = clock::now();
+    for (unsigned i = 0; i < N / FORK; i++)
+        pool.run([&] {
+            for (unsigned j = 0; j < FORK; j++)
+                pool.run([&] { nested++; });
+        });
+    CPPUNIT_ASSERT(waitFor(nested, N));
+    auto forked = clock::now() - start;
+
+    auto rate = [](clock::duration d) {
+        return (unsigned)(N / std::chrono::duration<double>(d).count());
+    };
+    std::cout << std::endl << "ThreadPool: " << rate(external) << " external tasks/s, "
+              << rate(forked) << " nested tasks/s" << std::endl;
+    pool.join();
+}
+
 void
 ThreadPoolTester::tearDown() {
 }
@@ -29,6 +29,9 @@ class ThreadPoolTester : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(ThreadPoolTester);
     CPPUNIT_TEST(testThreadPool);
     CPPUNIT_TEST(testExecutor);
+    CPPUNIT_TEST(testPriority);
+    CPPUNIT_TEST(testMpscQueue);
+    CPPUNIT_TEST(testBenchmark);
     CPPUNIT_TEST_SUITE_END();
 
  public:
@@ -43,6 +46,9 @@ class ThreadPoolTester : public CppUnit::TestFixture {
 
     void testThreadPool();
     void testExecutor();
+    void testPriority();
+    void testMpscQueue();
+    void testBenchmark();
 };
 
 }  // namespace test
@@ -0,0 +1,213 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tidmaptester.h"
+
+#include "opendht/tid_map.h"
+
+#include <map>
+#include <random>
+
+namespace test {
+CPPUNIT_TEST_SUITE_REGISTRATION(TidMapTester);
+
+using Map = dht::TidMap<int>;
+
+/* Checks that m holds exactly the entries of ref */
+static void
+checkSame(const Map& m, const std::map<dht::Tid, int>& ref)
+{
+    CPPUNIT_ASSERT_EQUAL(ref.size(), m.size());
+    for (const auto& e : ref) {
+        auto it = m.find(e.first);
+        CPPUNIT_ASSERT(it != m.end());
+        CPPUNIT_ASSERT_EQUAL(e.second, it->second);
+    }
+    size_t n {0};
+    for (const auto& e : m) {
+        CPPUNIT_ASSERT(ref.count(e.first));
+        n++;
+    }
+    CPPUNIT_ASSERT_EQUAL(ref.size(), n);
+}
+
+void
+TidMapTester::setUp() {
+
+}
+
+void
+TidMapTester::testInsertErase()
+{
+    Map m;
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT(m.find(1) == m.end());
+
+    auto r = m.emplace(42, 1);
+    CPPUNIT_ASSERT(r.second);
+    CPPUNIT_ASSERT_EQUAL(42u, r.first->first);
+    // already present: the value is kept
+    r = m.emplace(42, 2);
+    CPPUNIT_ASSERT(not r.second);
+    CPPUNIT_ASSERT_EQUAL(1, r.first->second);
+    // tid 0 marks empty slots and is never inserted
+    CPPUNIT_ASSERT(not m.emplace(0, 3).second);
+    CPPUNIT_ASSERT(m.find(0) == m.end());
+    CPPUNIT_ASSERT_EQUAL((size_t)1, m.size());
+
+    // the largest tids wrap around the end of the table
+    CPPUNIT_ASSERT(m.emplace(UINT32_MAX, 4).second);
+    CPPUNIT_ASSERT(m.emplace(UINT32_MAX - 1, 5).second);
+    CPPUNIT_ASSERT_EQUAL(4, m.find(UINT32_MAX)->second);
+    CPPUNIT_ASSERT_EQUAL(5, m.find(UINT32_MAX - 1)->second);
+
+    CPPUNIT_ASSERT_EQUAL((size_t)1, m.erase(42));
+    CPPUNIT_ASSERT_EQUAL((size_t)0, m.erase(42));
+    CPPUNIT_ASSERT(m.find(42) == m.end());
+    m.erase(m.find(UINT32_MAX));
+    CPPUNIT_ASSERT_EQUAL(5, m.find(UINT32_MAX - 1)->second);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, m.size());
+
+    m.clear();
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT(m.begin() == m.end());
+    CPPUNIT_ASSERT(m.emplace(7, 6).second);
+
+    // moving leaves the source empty
+    Map moved = std::move(m);
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT(m.find(7) == m.end());
+    CPPUNIT_ASSERT_EQUAL(6, moved.find(7)->second);
+}
+
+void
+TidMapTester::testRehash()
+{
+    Map m;
+    std::map<dht::Tid, int> ref;
+    // sequential tids, as allocated by nodes, across several rehashes
+    for (dht::Tid t = 1; t <= 1000; t++) {
+        CPPUNIT_ASSERT(m.emplace(t, t).second);
+        ref.emplace(t, t);
+        if ((t & (t - 1)) == 0)
+            checkSame(m, ref);
+    }
+    checkSame(m, ref);
+}
+
+void
+TidMapTester::testProbeChain()
+{
+    // a tiny key space over a small table gives long probe chains
+    for (dht::Tid first = 1; first <= 8; first++) {
+        Map m;
+        std::map<dht::Tid, int> ref;
+        for (dht::Tid t = 1; t <= 12; t++) {
+            m.emplace(t, t);
+            ref.emplace(t, t);
+        }
+        // backward shift deletion must keep the rest of each chain reachable
+        for (dht::Tid t = first; t <= 12; t += 3) {
+            CPPUNIT_ASSERT_EQUAL((size_t)1, m.erase(t));
+            ref.erase(t);
+            checkSame(m, ref);
+        }
+    }
+}
+
+void
+TidMapTester::testRandomOps()
+{
+    std::mt19937 rd {42};
+    std::uniform_int_distribution<dht::Tid> tid {0, 64};
+    Map m;
+    std::map<dht::Tid, int> ref;
+    for (int i = 0; i < 20000; i++) {
+        auto t = tid(rd);
+        if (rd() % 3) {
+            auto r = m.emplace(t, i);
+            bool inserted = t and ref.emplace(t, i).second;
+            CPPUNIT_ASSERT_EQUAL(inserted, r.second);
+        } else {
+            CPPUNIT_ASSERT_EQUAL(ref.erase(t), m.erase(t));
+        }
+        if (i % 64 == 0)
+            checkSame(m, ref);
+    }
+    checkSame(m, ref);
+}
+
+void
+TidMapTester::testShrink()
+{
+    Map m;
+    std::map<dht::Tid, int> ref;
+    for (dht::Tid t = 1; t <= 64; t++) {
+        m.emplace(t, t);
+        ref.emplace(t, t);
+    }
+    const auto capacity = m.capacity();
+    // erasing the last entries keeps the table until shrink()
+    for (dht::Tid t = 1; t <= 64; t++)
+        m.erase(t);
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT_EQUAL(capacity, m.capacity());
+    m.shrink();
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT_EQUAL((size_t)0, m.capacity());
+    CPPUNIT_ASSERT(m.begin() == m.end());
+
+    // a table more than an eighth full is kept
+    for (dht::Tid t = 1; t <= 64; t++)
+        m.emplace(t, t);
+    for (dht::Tid t = 1; t <= 44; t++) {
+        m.erase(t);
+        ref.erase(t);
+    }
+    m.shrink();
+    CPPUNIT_ASSERT_EQUAL(capacity, m.capacity());
+    checkSame(m, ref);
+
+    // a mostly unused table is shrunk, keeping its entries
+    for (dht::Tid t = 45; t <= 60; t++) {
+        m.erase(t);
+        ref.erase(t);
+    }
+    CPPUNIT_ASSERT_EQUAL(capacity, m.capacity());
+    m.shrink();
+    CPPUNIT_ASSERT(m.capacity() < capacity);
+    checkSame(m, ref);
+    // neither erasure nor insertion shrinks the table
+    const auto shrunk = m.capacity();
+    for (dht::Tid t = 61; t <= 63; t++) {
+        m.erase(t);
+        ref.erase(t);
+    }
+    CPPUNIT_ASSERT_EQUAL(shrunk, m.capacity());
+    CPPUNIT_ASSERT(m.emplace(100, 100).second);
+    CPPUNIT_ASSERT_EQUAL(shrunk, m.capacity());
+    ref.emplace(100, 100);
+    checkSame(m, ref);
+}
+
+void
+TidMapTester::tearDown() {
+}
+
+}  // namespace test
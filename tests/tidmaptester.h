@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// cppunit
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+namespace test {
+
+class TidMapTester : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(TidMapTester);
+    CPPUNIT_TEST(testInsertErase);
+    CPPUNIT_TEST(testRehash);
+    CPPUNIT_TEST(testProbeChain);
+    CPPUNIT_TEST(testRandomOps);
+    CPPUNIT_TEST(testShrink);
+    CPPUNIT_TEST_SUITE_END();
+
+ public:
+    /**
+     * Method automatically called before each test by CppUnit
+     */
+    void setUp();
+    /**
+     * Method automatically called after each test CppUnit
+     */
+    void tearDown();
+
+    void testInsertErase();
+    void testRehash();
+    void testProbeChain();
+    void testRandomOps();
+    void testShrink();
+};
+
+}  // namespace test
@@ -27,6 +27,7 @@ extern "C" {
 #include <gnutls/gnutls.h>
 }
 
+#include <fstream>
 #include <set>
 #include <thread> // std::this_thread::sleep_for
 
@@ -43,7 +44,7 @@ void print_version() {
 }
 
 void print_usage() {
-    std::cout << "Usage: dhtnode [-v [-l logfile]] [-i] [-d] [-n network_id] [-p local_port] [-b bootstrap_host[:port]] [--proxyserver local_port] [--proxyserverssl local_port]" << std::endl << std::endl;
+    std::cout << "Usage: dhtnode [-v [-l logfile]] [-i] [-d] [-n network_id] [-p local_port] [-b bootstrap_host[:port]] [--proxyserver local_port] [--proxyserverssl local_port] [--proxy-threads count]" << std::endl << std::endl;
     print_info();
 }
 
@@ -62,7 +63,10 @@ void print_help() {
               << "  ll         Print basic information and stats about the current node." << std::endl
               << "  ls [key]   Print basic information about current search(es)." << std::endl
               << "  ld [key]   Print basic information about currenty stored values on this node (or key)." << std::endl
-              << "  lr         Print the full current routing table of this node." << std::endl;
+              << "  lr         Print the full current routing table of this node." << std::endl
+              << "  lm         Print the approximate memory used by this node." << std::endl
+              << "  sv <file>  Save the values stored on this node to <file>." << std::endl
+              << "  lv <file>  Load values saved with 'sv' from <file>." << std::endl;
 
 #ifdef OPENDHT_PROXY_SERVER
     std::cout << std::endl << "Operations with the proxy:" << std::endl
@@ -161,6 +165,14 @@ void cmd_loop(std::shared_ptr<DhtRunner>& node, dht_params& params
 #endif
             });
             continue;
+        } else if (op == "lm") {
+            std::cout << node->getMemoryStats().toString();
+#ifdef OPENDHT_PROXY_SERVER
+            for (const auto& proxy : proxies)
+                std::cout << "Proxy server on port " << proxy.first << ": "
+                          << proxy.second->getMemoryStats().proxy / 1024 << " KiB" << std::endl;
+#endif
+            continue;
         } else if (op == "lr") {
             std::cout << "IPv4 routing table:" << std::endl;
             std::cout << node->getRoutingTablesLog(AF_INET) << std::endl;
@@ -175,6 +187,49 @@ void cmd_loop(std::shared_ptr<DhtRunner>& node, dht_params& params
             else
                 std::cout << node->getStorageLog() << std::endl;
             continue;
+        } else if (op == "sv") {
+            std::string path;
+            iss >> path;
+            std::ofstream file(path, std::ios::binary);
+            if (not file.is_open()) {
+                std::cout << "Can't open " << path << std::endl;
+                continue;
+            }
+            size_t keys = 0;
+            node->exportValuesTo([&](ValuesExport&& e) {
+                msgpack::pack(file, e);
+                keys++;
+                return (bool)file;
+            });
+            std::cout << "Saved values of " << keys << " keys to " << path << std::endl;
+            continue;
+        } else if (op == "lv") {
+            std::string path;
+            iss >> path;
+            std::ifstream file(path, std::ios::binary);
+            if (not file.is_open()) {
+                std::cout << "Can't open " << path << std::endl;
+                continue;
+            }
+            size_t keys = 0;
+            try {
+                msgpack::unpacker pac;
+                msgpack::object_handle oh;
+                while (file) {
+                    pac.reserve_buffer(64 * 1024);
+                    file.read(pac.buffer(), 64 * 1024);
+                    pac.buffer_consumed(file.gcount());
+                    std::vector<ValuesExport> values;
+                    while (pac.next(oh))
+                        values.emplace_back(oh.get().as<ValuesExport>());
+                    keys += values.size();
+                    node->importValues(values);
+                }
+            } catch (const std::exception& e) {
+                std::cout << "Error reading " << path << ": " << e.what() << std::endl;
+            }
+            std::cout << "Loaded values of " << keys << " keys" << std::endl;
+            continue;
         } else if (op == "ls") {
             iss >> idstr;
             InfoHash filter(idstr);
@@ -542,6 +597,7 @@ main(int argc, char **argv)
 #ifdef OPENDHT_PROXY_SERVER
             ProxyServerConfig serverConfig;
             serverConfig.pushServer = params.pushserver;
+            serverConfig.threads = params.proxy_threads;
             if (params.proxyserverssl and params.proxy_id.first and params.proxy_id.second){
                 serverConfig.identity = params.proxy_id;
                 serverConfig.port = params.proxyserverssl;
@@ -20,59 +20,382 @@
 #include "config.h"
 #endif
 
-#include "tools_common.h"
-#include <opendht/node.h>
+#include <opendht/infohash.h>
+#include <opendht/network_utils.h>
+#include <opendht/utils.h>
+#include <opendht/rng.h>
 
 extern "C" {
+#include <getopt.h>
 #include <gnutls/gnutls.h>
 }
-#include <set>
+#include <msgpack.hpp>
+
 #include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
 #include <mutex>
+#include <set>
+#include <unordered_map>
 
 using namespace dht;
+using namespace dht::net;
+using namespace std::chrono_literals;
+
+/* Number of bits of the regions of the keyspace queried first */
+constexpr unsigned SCAN_REGION_BITS {4};
+constexpr size_t NODE4_INFO_LEN {HASH_LEN + sizeof(in_addr) + sizeof(in_port_t)};
+constexpr size_t NODE6_INFO_LEN {HASH_LEN + sizeof(in6_addr) + sizeof(in_port_t)};
 
 void print_usage() {
-    std::cout << "Usage: dhtscanner [-n network_id] [-p local_port] [-b bootstrap_host[:port]]" << std::endl << std::endl;
+    std::cout << "Usage: dhtscanner [-n network_id] [-p local_port] -b bootstrap_host[:port] [-c concurrency] [-t timeout_ms] [-r retries] [-f csv|msgpack] [-o output]" << std::endl << std::endl;
     std::cout << "dhtscanner, a simple OpenDHT command line utility generating scan result the network." << std::endl;
+    std::cout << "Nodes are crawled with find_node requests, sent in parallel from a single socket," << std::endl;
+    std::cout << "and written as they answer or time out, as CSV lines or a stream of msgpack maps." << std::endl;
     std::cout << "Report bugs to: https://opendht.net" << std::endl;
 }
 
-struct snode_compare {
-    bool operator() (const std::shared_ptr<Node>& lhs, const std::shared_ptr<Node>& rhs) const{
-        return (lhs->id < rhs->id) ||
-            (lhs->id == rhs->id && lhs->getFamily() == AF_INET && rhs->getFamily() == AF_INET6);
+struct scan_params {
+    bool help {false};
+    NetId network {0};
+    in_port_t port {0};
+    std::string bootstrap {};
+    size_t concurrency {256};
+    duration timeout {1s};
+    unsigned retries {1};
+    bool msgpack {false};
+    std::string output {};
+};
+
+static const constexpr struct option scan_options[] = {
+    {"help",        no_argument      , nullptr, 'h'},
+    {"net",         required_argument, nullptr, 'n'},
+    {"port",        required_argument, nullptr, 'p'},
+    {"bootstrap",   required_argument, nullptr, 'b'},
+    {"concurrency", required_argument, nullptr, 'c'},
+    {"timeout",     required_argument, nullptr, 't'},
+    {"retries",     required_argument, nullptr, 'r'},
+    {"format",      required_argument, nullptr, 'f'},
+    {"output",      required_argument, nullptr, 'o'},
+    {nullptr,       0                , nullptr,  0}
+};
+
+scan_params
+parseScanArgs(int argc, char **argv) {
+    scan_params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hn:p:b:c:t:r:f:o:", scan_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'n':
+            params.network = std::stoul(optarg, nullptr, 0);
+            break;
+        case 'p':
+            params.port = std::stoi(optarg);
+            break;
+        case 'b':
+            params.bootstrap = (optarg[0] == '=') ? optarg+1 : optarg;
+            break;
+        case 'c':
+            params.concurrency = std::max(1ul, std::stoul(optarg));
+            break;
+        case 't':
+            params.timeout = std::chrono::milliseconds(std::stoul(optarg));
+            break;
+        case 'r':
+            params.retries = std::stoul(optarg);
+            break;
+        case 'f':
+            if (std::string(optarg) == "msgpack")
+                params.msgpack = true;
+            else if (std::string(optarg) != "csv")
+                throw std::invalid_argument("unknown format " + std::string(optarg));
+            break;
+        case 'o':
+            params.output = optarg;
+            break;
+        default:
+            params.help = true;
+            break;
+        }
     }
+    return params;
+}
+
+/** A node of the network, as found by the scan */
+struct ScannedNode {
+    InfoHash id;
+    SockAddr addr;
+    /* round-trip time of the first answer, or zero if it didn't answer */
+    duration rtt {duration::zero()};
+    /* nodes returned by the node */
+    size_t returned {0};
+    std::string agent {};
 };
 
-using NodeSet = std::set<std::shared_ptr<Node>, snode_compare>;
-std::condition_variable cv;
+/**
+ * Crawls the network with find_node requests, at most `concurrency` at
+ * a time. Every node found is queried once for the nodes close to its
+ * own id; the regions of the keyspace are queried first from the
+ * bootstrap nodes, so that the crawl spreads over the network quickly.
+ */
+class Scanner {
+public:
+    Scanner(const scan_params& params, std::function<void(const ScannedNode&)>&& out)
+        : params_(params), out_(std::move(out)), socket_(params.port)
+    {
+        myid_ = InfoHash::getRandom(rd_);
+        tid_ = rd_();
+        socket_.setOnReceive([this](PacketList&& packets) {
+            {
+                std::lock_guard<std::mutex> lk(lock_);
+                received_.splice(received_.end(), packets);
+            }
+            cv_.notify_one();
+            return PacketList {};
+        });
+    }
+
+    ~Scanner() {
+        socket_.stop();
+    }
 
-void
-step(DhtRunner& dht, std::atomic_uint& done, std::shared_ptr<NodeSet> all_nodes, dht::InfoHash cur_h, unsigned cur_depth)
-{
-    std::cout << "step at " << cur_h << ", depth " << cur_depth << std::endl;
-    done++;
-    dht.get(cur_h, [all_nodes](const std::vector<std::shared_ptr<Value>>& /*values*/) {
-        return true;
-    }, [&,all_nodes,cur_h,cur_depth](bool, const std::vector<std::shared_ptr<Node>>& nodes) {
-        all_nodes->insert(nodes.begin(), nodes.end());
-        NodeSet sbuck {nodes.begin(), nodes.end()};
-        if (not sbuck.empty()) {
-            unsigned bdepth = sbuck.size()==1 ? 0u : InfoHash::commonBits((*sbuck.begin())->id, (*sbuck.rbegin())->id);
-            unsigned target_depth = std::min(8u, bdepth+6u);
-            std::cout << cur_h << " : " << nodes.size() << " nodes; target is " << target_depth << " bits deep (cur " << cur_depth << ")" << std::endl;
-            for (unsigned b = cur_depth ; b < target_depth; b++) {
-                auto new_h = cur_h;
-                new_h.setBit(b, 1);
-                step(dht, done, all_nodes, new_h, b+1);
+    void addBootstrap(const SockAddr& addr) {
+        // bootstrap nodes are queried for each region, and for themselves
+        for (unsigned r = 0; r < (1u << SCAN_REGION_BITS); r++) {
+            InfoHash target;
+            target[0] = (uint8_t)r;
+            target[HASH_LEN - 1] = 1;
+            queue_.emplace_back(Query {addr, {}, target, 0});
+        }
+    }
+
+    void run() {
+        start_ = clock::now();
+        while (not queue_.empty() or not pending_.empty()) {
+            send();
+            PacketList packets;
+            {
+                std::unique_lock<std::mutex> lk(lock_);
+                cv_.wait_for(lk, 10ms, [&]{ return not received_.empty(); });
+                packets = std::move(received_);
             }
+            for (auto& pkt : packets)
+                onPacket(pkt);
+            expire(clock::now());
         }
-        done--;
-        std::cout << done.load() << " operations left, " << all_nodes->size() << " nodes found." << std::endl;
-        cv.notify_one();
-    });
-}
+        // nodes that never answered
+        for (auto& n : nodes_)
+            if (n.second.rtt == duration::zero())
+                out_(n.second);
+    }
+
+    size_t found() const { return nodes_.size(); }
+    size_t answered() const { return answered_; }
+    size_t sent() const { return sent_; }
+    duration elapsed() const { return clock::now() - start_; }
+
+private:
+    struct Query {
+        SockAddr addr;
+        /* id of the queried node, unknown for bootstrap nodes */
+        InfoHash id;
+        InfoHash target;
+        unsigned attempt;
+    };
+    struct Pending {
+        Query query;
+        time_point sent;
+    };
+    /* nodes seen, by id and family */
+    using NodeKey = std::pair<InfoHash, sa_family_t>;
+    struct NodeKeyHash {
+        size_t operator()(const NodeKey& k) const {
+            // ids are random
+            size_t h;
+            std::memcpy(&h, k.first.data(), sizeof(h));
+            return h ^ k.second;
+        }
+    };
+
+    const scan_params& params_;
+    std::function<void(const ScannedNode&)> out_;
+    std::mt19937_64 rd_ {crypto::getSeededRandomEngine<std::mt19937_64>()};
+    InfoHash myid_;
+    uint32_t tid_;
+    time_point start_;
+    size_t answered_ {0};
+    size_t sent_ {0};
+
+    std::deque<Query> queue_;
+    std::unordered_map<uint32_t, Pending> pending_;
+    std::unordered_map<NodeKey, ScannedNode, NodeKeyHash> nodes_;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    PacketList received_;
+    net::UdpSocket socket_;
+
+    void send() {
+        auto now = clock::now();
+        socket_.startBatch();
+        while (pending_.size() < params_.concurrency and not queue_.empty()) {
+            auto q = std::move(queue_.front());
+            queue_.pop_front();
+            auto tid = tid_++;
+            auto msg = packFindNode(tid, q.target, q.addr.getFamily());
+            if (socket_.sendTo(q.addr, (const uint8_t*)msg.data(), msg.size(), false) == 0) {
+                pending_.emplace(tid, Pending {std::move(q), now});
+                sent_++;
+            }
+        }
+        socket_.flush();
+    }
+
+    msgpack::sbuffer packFindNode(uint32_t tid, const InfoHash& target, sa_family_t af) const {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        pk.pack_map(5 + (params_.network ? 1 : 0));
+        pk.pack("a"); pk.pack_map(3);
+          pk.pack("id");     pk.pack(myid_);
+          pk.pack("target"); pk.pack(target);
+          // nodes of the family of the queried node
+          pk.pack("w"); pk.pack_array(1); pk.pack(af);
+        pk.pack("q"); pk.pack("find");
+        pk.pack("t"); pk.pack(tid);
+        pk.pack("y"); pk.pack("q");
+        pk.pack("v"); pk.pack("RNG1");
+        if (params_.network) {
+            pk.pack("n"); pk.pack(params_.network);
+        }
+        return buffer;
+    }
+
+    void expire(const time_point& now) {
+        for (auto it = pending_.begin(); it != pending_.end();) {
+            if (now - it->second.sent < params_.timeout) {
+                ++it;
+                continue;
+            }
+            auto q = std::move(it->second.query);
+            it = pending_.erase(it);
+            if (++q.attempt <= params_.retries)
+                queue_.emplace_front(std::move(q));
+        }
+    }
+
+    void onPacket(const ReceivedPacket& pkt) {
+        uint32_t tid;
+        InfoHash id;
+        std::string agent;
+        const msgpack::object* n4 {nullptr};
+        const msgpack::object* n6 {nullptr};
+        msgpack::object_handle msg;
+        try {
+            msg = msgpack::unpack((const char*)pkt.data.data(), pkt.data.size());
+            const auto& o = msg.get();
+            if (o.type != msgpack::type::MAP)
+                return;
+            bool reply = false, found_tid = false;
+            for (unsigned i = 0; i < o.via.map.size; i++) {
+                const auto& kv = o.via.map.ptr[i];
+                if (kv.key.type != msgpack::type::STR)
+                    continue;
+                auto key = kv.key.as<std::string>();
+                if (key == "t") {
+                    tid = kv.val.as<uint32_t>();
+                    found_tid = true;
+                } else if (key == "y")
+                    reply = kv.val.as<std::string>() == "r";
+                else if (key == "v")
+                    agent = kv.val.as<std::string>();
+                else if (key == "r" and kv.val.type == msgpack::type::MAP) {
+                    for (unsigned j = 0; j < kv.val.via.map.size; j++) {
+                        const auto& r = kv.val.via.map.ptr[j];
+                        if (r.key.type != msgpack::type::STR)
+                            continue;
+                        auto rkey = r.key.as<std::string>();
+                        if (rkey == "id")
+                            id.msgpack_unpack(r.val);
+                        else if (rkey == "n4")
+                            n4 = &r.val;
+                        else if (rkey == "n6")
+                            n6 = &r.val;
+                    }
+                }
+            }
+            if (not reply or not found_tid or not id)
+                return;
+        } catch (const std::exception&) {
+            return;
+        }
+        auto p = pending_.find(tid);
+        if (p == pending_.end())
+            return;
+        auto query = std::move(p->second.query);
+        auto rtt = pkt.received - p->second.sent;
+        pending_.erase(p);
+
+        size_t returned = 0;
+        if (n4 and n4->type == msgpack::type::BIN)
+            returned += onNodes((const uint8_t*)n4->via.bin.ptr, n4->via.bin.size, NODE4_INFO_LEN, AF_INET);
+        if (n6 and n6->type == msgpack::type::BIN)
+            returned += onNodes((const uint8_t*)n6->via.bin.ptr, n6->via.bin.size, NODE6_INFO_LEN, AF_INET6);
+
+        auto& n = node(id, pkt.from);
+        n.returned += returned;
+        if (n.rtt == duration::zero()) {
+            // first answer of the node
+            n.rtt = std::max<duration>(rtt, 1ns);
+            n.agent = std::move(agent);
+            answered_++;
+            out_(n);
+        }
+    }
+
+    size_t onNodes(const uint8_t* buf, size_t len, size_t info_len, sa_family_t af) {
+        size_t count = 0;
+        for (size_t off = 0; off + info_len <= len; off += info_len) {
+            const auto& id = *reinterpret_cast<const InfoHash*>(buf + off);
+            sockaddr_storage ss {};
+            socklen_t sslen;
+            const uint8_t* a = buf + off + HASH_LEN;
+            if (af == AF_INET) {
+                auto& sin = (sockaddr_in&)ss;
+                sin.sin_family = AF_INET;
+                std::memcpy(&sin.sin_addr, a, sizeof(in_addr));
+                std::memcpy(&sin.sin_port, a + sizeof(in_addr), sizeof(in_port_t));
+                sslen = sizeof(sockaddr_in);
+            } else {
+                auto& sin6 = (sockaddr_in6&)ss;
+                sin6.sin6_family = AF_INET6;
+                std::memcpy(&sin6.sin6_addr, a, sizeof(in6_addr));
+                std::memcpy(&sin6.sin6_port, a + sizeof(in6_addr), sizeof(in_port_t));
+                sslen = sizeof(sockaddr_in6);
+            }
+            SockAddr addr(ss, sslen);
+            if (id == myid_ or not addr.getPort() or addr.isUnspecified())
+                continue;
+            count++;
+            auto key = std::make_pair(id, af);
+            if (nodes_.find(key) != nodes_.end())
+                continue;
+            node(id, addr);
+            // new node: ask for its neighbours
+            queue_.emplace_back(Query {addr, id, id, 0});
+        }
+        return count;
+    }
+
+    ScannedNode& node(const InfoHash& id, const SockAddr& addr) {
+        auto& n = nodes_[std::make_pair(id, addr.getFamily())];
+        if (not n.id) {
+            n.id = id;
+            n.addr = addr;
+        }
+        return n;
+    }
+};
 
 int
 main(int argc, char **argv)
@@ -80,49 +403,73 @@ main(int argc, char **argv)
 #ifdef WIN32_NATIVE
     gnutls_global_init();
 #endif
-    auto params = parseArgs(argc, argv);
-    if (params.help) {
+    scan_params params;
+    try {
+        params = parseScanArgs(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        params.help = true;
+    }
+    if (params.help or params.bootstrap.empty()) {
         print_usage();
-        return 0;
+        return params.help ? 0 : EXIT_FAILURE;
     }
 
-    DhtRunner dht;
-    try {
-        auto dhtConf = getDhtConfig(params);
-        dht.run(params.port, dhtConf.first, std::move(dhtConf.second));
-
-        if (not params.bootstrap.empty())
-            dht.bootstrap(params.bootstrap);
-
-        print_node_info(dht.getNodeInfo());
-        std::cout << "Scanning network..." << std::endl;
-        auto all_nodes = std::make_shared<NodeSet>();
-
-        // Set hash to 1 because 0 is the null hash
-        dht::InfoHash cur_h {};
-        cur_h.setBit(8*HASH_LEN-1, 1);
-
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+    std::ofstream file;
+    if (not params.output.empty()) {
+        file.open(params.output, std::ios::binary);
+        if (not file) {
+            std::cerr << "Can't open " << params.output << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::ostream& out = params.output.empty() ? std::cout : file;
 
-        std::atomic_uint done {0};
-        step(dht, done, all_nodes, cur_h, 0);
+    std::function<void(const ScannedNode&)> write;
+    if (params.msgpack) {
+        write = [&](const ScannedNode& n) {
+            msgpack::sbuffer buffer;
+            msgpack::packer<msgpack::sbuffer> pk(&buffer);
+            pk.pack_map(5);
+            pk.pack("id");    pk.pack(n.id);
+            pk.pack("addr");  pk.pack(n.addr.toString());
+            pk.pack("rtt");   pk.pack(std::chrono::duration_cast<std::chrono::microseconds>(n.rtt).count());
+            pk.pack("nodes"); pk.pack(n.returned);
+            pk.pack("v");     pk.pack(n.agent);
+            out.write(buffer.data(), buffer.size());
+        };
+    } else {
+        out << "id,address,rtt_us,nodes,agent" << std::endl;
+        write = [&](const ScannedNode& n) {
+            out << n.id << ',' << n.addr.toString() << ','
+                << std::chrono::duration_cast<std::chrono::microseconds>(n.rtt).count() << ','
+                << n.returned << ',' << n.agent << '\n';
+        };
+    }
 
-        {
-            std::mutex m;
-            std::unique_lock<std::mutex> lk(m);
-            cv.wait(lk, [&](){
-                return done.load() == 0;
-            });
+    try {
+        Scanner scanner(params, std::move(write));
+        auto hp = splitPort(params.bootstrap);
+        auto addrs = SockAddr::resolve(hp.first, hp.second.empty() ? std::to_string(DHT_DEFAULT_PORT) : hp.second);
+        if (addrs.empty()) {
+            std::cerr << "Can't resolve " << params.bootstrap << std::endl;
+            return EXIT_FAILURE;
         }
+        for (const auto& addr : addrs)
+            scanner.addBootstrap(addr);
+
+        std::cerr << "Scanning network..." << std::endl;
+        scanner.run();
+        out.flush();
 
-        std::cout << std::endl << "Scan ended: " << all_nodes->size() << " nodes found." << std::endl;
-        for (const auto& n : *all_nodes)
-            std::cout << "Node " << *n << std::endl;
+        auto secs = std::chrono::duration<double>(scanner.elapsed()).count();
+        std::cerr << "Scan ended in " << secs << " s: " << scanner.found() << " nodes found, "
+                  << scanner.answered() << " answered, " << scanner.sent() << " requests sent." << std::endl;
     } catch(const std::exception&e) {
         std::cerr << std::endl <<  e.what() << std::endl;
+        return EXIT_FAILURE;
     }
 
-    dht.join();
 #ifdef WIN32_NATIVE
     gnutls_global_deinit();
 #endif
@@ -22,6 +22,8 @@
 
 #include "tools_common.h"
 #include <opendht/node.h>
+#include <opendht/metrics.h>
+#include <opendht/simulated_network.h>
 
 extern "C" {
 #include <gnutls/gnutls.h>
@@ -29,10 +31,42 @@ extern "C" {
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
+#include <random>
+#include <thread>
+#include <iomanip>
+#include <cmath>
 
 void print_usage() {
-    std::cout << "Usage: perftest" << std::endl << std::endl;
+    std::cout << "Usage: perftest [-s scenarios] [-n network_size] [-c concurrency] [-o count]" << std::endl;
+    std::cout << "                [-j results.json] [-r baseline.json] [-t tolerance]" << std::endl << std::endl;
     std::cout << "perftest, a simple OpenDHT basic performance tester." << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -h, --help                 Show this help message and exit." << std::endl;
+    std::cout << "  -s, --scenario <list>      Comma separated scenarios to run (default: hash,sweep):" << std::endl;
+    std::cout << "                             hash       InfoHash operations" << std::endl;
+    std::cout << "                             sweep      ping-pong over network sizes and concurrencies" << std::endl;
+    std::cout << "                             pingpong   ping-pong put/listen between two nodes" << std::endl;
+    std::cout << "                             put        put throughput" << std::endl;
+    std::cout << "                             get        get latency" << std::endl;
+    std::cout << "                             listen     listen fan-out, from put to notification" << std::endl;
+    std::cout << "                             verify     signed value verification rate" << std::endl;
+    std::cout << "                             storage    storage scale, on a single node" << std::endl;
+    std::cout << "                             proxy      proxy request rate" << std::endl;
+    std::cout << "                             sim        convergence, puts and gets on a simulated network" << std::endl;
+    std::cout << "                             all        all of the above" << std::endl;
+    std::cout << "  -n, --network-size <n>     Number of nodes of the local network (default: 8)." << std::endl;
+    std::cout << "  -c, --concurrency <n>      Operations in flight, verification threads," << std::endl;
+    std::cout << "                             or listeners per node (default: 8)." << std::endl;
+    std::cout << "  -o, --count <n>            Operations per scenario (default: 4096)." << std::endl;
+    std::cout << "  -S, --storage-values <n>   Values stored by the storage scenario (default: 1000000)." << std::endl;
+    std::cout << "  -z, --value-size <n>       Size of the values, in bytes (default: 64)." << std::endl;
+    std::cout << "  -N, --sim-nodes <n>        Number of nodes of the simulated network (default: 1000)." << std::endl;
+    std::cout << "  -l, --sim-loss <ratio>     Packet loss of the simulated network (default: 0)." << std::endl;
+    std::cout << "  -p, --proxy-port <port>    Port of the proxy server of the proxy scenario (default: 8081)." << std::endl;
+    std::cout << "  -j, --json <file>          Write the results as JSON to file, - for stdout." << std::endl;
+    std::cout << "  -r, --compare <file>       Compare the results with JSON results from a previous run." << std::endl;
+    std::cout << "                             Exit with status 2 if a result regressed." << std::endl;
+    std::cout << "  -t, --tolerance <percent>  Change allowed before reporting a regression (default: 10)." << std::endl;
     std::cout << "Report bugs to: https://opendht.net" << std::endl;
 }
 constexpr unsigned PINGPONG_MAX = 2048;
@@ -43,11 +77,227 @@ namespace tests {
 using clock = std::chrono::high_resolution_clock;
 using duration = clock::duration;
 
-duration
-benchPingPong(unsigned netSize, unsigned n_parallel) {
+/* Time allowed for a scenario to complete */
+constexpr std::chrono::minutes SCENARIO_TIMEOUT {2};
+/* Time allowed for the nodes of a network to connect */
+constexpr std::chrono::seconds CONNECT_TIMEOUT {10};
+/* Time given to listens to reach the storing nodes */
+constexpr std::chrono::seconds LISTEN_SETUP_DELAY {1};
+/* Keys used by the get and proxy scenarios */
+constexpr unsigned GET_KEYS {1024};
+/* Values stored under each key by the storage scenario */
+constexpr unsigned STORAGE_VALUES_PER_KEY {64};
+/* Signed values used by the verify scenario, per key type */
+constexpr unsigned VERIFY_VALUES {256};
+/* Good nodes known by every node of a converged simulated network */
+constexpr unsigned SIM_CONVERGED_NODES {8};
+/* Virtual time allowed for the simulated network to converge, or for an operation */
+constexpr std::chrono::minutes SIM_TIMEOUT {10};
+
+struct Params {
+    bool help {false};
+    std::vector<std::string> scenarios {"hash", "sweep"};
+    unsigned network_size {8};
+    unsigned concurrency {8};
+    unsigned count {4096};
+    unsigned storage_values {1000000};
+    unsigned sim_nodes {1000};
+    double sim_loss {0};
+    size_t value_size {64};
+    in_port_t proxy_port {8081};
+    std::string json {};
+    std::string compare {};
+    double tolerance {10};
+};
+
+/**
+ * Result of a benchmark: ops operations done in time,
+ * with the latency of each of them when measured.
+ */
+struct Result {
+    std::string name;
+    uint64_t ops {0};
+    uint64_t errors {0};
+    duration time {0};
+    LatencyStats latency {};
+    /* other measures of the scenario */
+    std::map<std::string, double> metrics {};
+
+    double rate() const {
+        auto s = std::chrono::duration<double>(time).count();
+        return s > 0 ? ops / s : 0;
+    }
+    std::string toString() const {
+        std::stringstream ss;
+        ss << name << ": " << ops << " ops";
+        if (errors)
+            ss << " (" << errors << " errors)";
+        ss << " in " << print_duration(time) << ", " << rate() << " ops/s";
+        if (latency.count)
+            ss << std::endl << "  latency: " << latency.toString();
+        for (const auto& m : metrics)
+            ss << std::endl << "  " << m.first << ": " << m.second;
+        return ss.str();
+    }
+#ifdef OPENDHT_JSONCPP
+    Json::Value toJson() const {
+        Json::Value val;
+        val["ops"] = static_cast<Json::LargestUInt>(ops);
+        val["errors"] = static_cast<Json::LargestUInt>(errors);
+        val["time"] = std::chrono::duration<double>(time).count();
+        val["rate"] = rate();
+        if (latency.count)
+            val["latency"] = latency.toJson();
+        for (const auto& m : metrics)
+            val["metrics"][m.first] = m.second;
+        return val;
+    }
+#endif
+};
+
+DhtRunner::Config
+benchConfig() {
     DhtRunner::Config config {};
     config.dht_config.node_config.max_peer_req_per_sec = -1;
     config.dht_config.node_config.max_req_per_sec = -1;
+    return config;
+}
+
+Blob
+benchPayload(size_t size) {
+    Blob payload(size);
+    for (size_t i=0; i<size; i++)
+        payload[i] = 'a' + (i % 26);
+    return payload;
+}
+
+/**
+ * Local network of nodes bootstrapped from the first one,
+ * shut down when destroyed.
+ */
+struct Network {
+    std::vector<std::shared_ptr<DhtRunner>> nodes;
+
+    Network(unsigned size, const DhtRunner::Config& config = benchConfig()) {
+        nodes.reserve(size);
+        for (unsigned i=0; i<std::max(size, 1u); i++) {
+            auto node = std::make_shared<DhtRunner>();
+            node->run(0, config);
+            if (not nodes.empty())
+                node->bootstrap(nodes.front()->getBound());
+            nodes.emplace_back(std::move(node));
+        }
+    }
+    ~Network() {
+        for (auto& node : nodes)
+            node->shutdown();
+        for (auto& node : nodes)
+            node->join();
+    }
+
+    DhtRunner& operator[](size_t i) { return *nodes[i % nodes.size()]; }
+    size_t size() const { return nodes.size(); }
+
+    /** Waits for every node to know a good node, up to CONNECT_TIMEOUT */
+    void waitConnected() {
+        if (nodes.size() < 2)
+            return;
+        auto end = clock::now() + CONNECT_TIMEOUT;
+        for (auto& node : nodes) {
+            while (node->getNodesStats(AF_INET).good_nodes + node->getNodesStats(AF_INET6).good_nodes == 0
+                   and clock::now() < end)
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+};
+
+using OpDone = std::function<void(bool ok)>;
+using Op = std::function<void(unsigned i, OpDone done)>;
+
+/**
+ * Runs total operations, keeping up to concurrency of them in flight.
+ * op(i, done) starts operation i, and must call done once when it completes.
+ */
+Result
+runConcurrent(std::string name, unsigned total, unsigned concurrency, Op op) {
+    struct State {
+        Op op;
+        unsigned total;
+        std::mutex lock {};
+        std::condition_variable cv {};
+        unsigned started {0};
+        unsigned done {0};
+        uint64_t errors {0};
+        bool stopped {false};
+        LatencyHistogram latency {};
+
+        void launch(const std::shared_ptr<State>& self) {
+            unsigned i;
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                if (stopped or started == total)
+                    return;
+                i = started++;
+            }
+            auto start = clock::now();
+            op(i, [self, start](bool ok) {
+                self->latency.record(clock::now() - start);
+                {
+                    std::lock_guard<std::mutex> lk(self->lock);
+                    self->done++;
+                    if (not ok)
+                        self->errors++;
+                }
+                self->cv.notify_all();
+                self->launch(self);
+            });
+        }
+    };
+    auto state = std::make_shared<State>();
+    state->op = std::move(op);
+    state->total = total;
+
+    auto start = clock::now();
+    for (unsigned i=0; i<std::max(concurrency, 1u); i++)
+        state->launch(state);
+
+    Result result;
+    result.name = std::move(name);
+    std::unique_lock<std::mutex> lk(state->lock);
+    state->cv.wait_for(lk, SCENARIO_TIMEOUT, [&]{ return state->done == total; });
+    result.time = clock::now() - start;
+    // operations still running after a timeout are counted as errors
+    state->stopped = true;
+    result.ops = state->done;
+    result.errors = state->errors + (total - state->done);
+    result.latency = state->latency.getStats();
+    return result;
+}
+
+/**
+ * Starts a get of key on node, calling done at the first value received,
+ * or when the get completes without values.
+ */
+void
+getFirst(DhtRunner& node, const InfoHash& key, OpDone done) {
+    auto called = std::make_shared<bool>(false);
+    node.get(key, [done, called](const std::vector<std::shared_ptr<Value>>&) {
+        if (not *called) {
+            *called = true;
+            done(true);
+        }
+        return false;
+    }, [done, called](bool) {
+        if (not *called) {
+            *called = true;
+            done(false);
+        }
+    });
+}
+
+duration
+benchPingPong(unsigned netSize, unsigned n_parallel) {
+    auto config = benchConfig();
 
     DhtRunner ping_node, pong_node;
 
@@ -102,7 +352,7 @@ benchPingPong(unsigned netSize, unsigned n_parallel) {
 
     auto start = clock::now();
 
-    for (unsigned i=0; i<n_parallel; i++) 
+    for (unsigned i=0; i<n_parallel; i++)
         ping(pong_node, locs[i].first);
 
     {
@@ -127,20 +377,21 @@ benchPingPong(unsigned netSize, unsigned n_parallel) {
     return end-start;
 }
 
+Result
+benchPingPong(const Params& params) {
+    Result result;
+    result.name = "pingpong";
+    result.ops = PINGPONG_MAX * params.concurrency;
+    result.time = benchPingPong(params.network_size > 2 ? params.network_size - 2 : 0, params.concurrency);
+    return result;
 }
 
-int
-main(int argc, char **argv)
-{
-#ifdef WIN32_NATIVE
-    gnutls_global_init();
-#endif
-    auto params = parseArgs(argc, argv);
-    if (params.help) {
-        print_usage();
-        return 0;
-    }
-
+/**
+ * Ping-pong over network sizes from 2 to 16 and concurrencies from 1 to 32.
+ */
+std::vector<Result>
+benchPingPongSweep() {
+    std::vector<Result> ret;
     duration totalTime {0};
     unsigned totalOps {0};
 
@@ -158,6 +409,12 @@ main(int argc, char **argv)
             total += dt;
             totalOps += max;
             results.emplace_back(dt);
+
+            Result r;
+            r.name = "sweep_n" + std::to_string(i) + "_c" + std::to_string(nparallel);
+            r.ops = max;
+            r.time = dt;
+            ret.emplace_back(std::move(r));
         }
 
         totalTime += total;
@@ -172,9 +429,685 @@ main(int argc, char **argv)
     std::cout << std::endl << "Grand total: " << print_duration(totalTime) << " for " << totalOps << std::endl;
     std::cout << print_duration(totalTime/totalOps) << " per rt, "
             << totalOps/std::chrono::duration<double>(totalTime).count() << " ping per s" << std::endl << std::endl;
+    return ret;
+}
+
+Result
+benchPut(const Params& params) {
+    Network net(params.network_size);
+    net.waitConnected();
+    auto payload = benchPayload(params.value_size);
+    return runConcurrent("put", params.count, params.concurrency, [&](unsigned i, OpDone done) {
+        net[i].put(InfoHash::get("perftest_put" + std::to_string(i)), Value(payload), [done](bool ok) {
+            done(ok);
+        });
+    });
+}
+
+Result
+benchGet(const Params& params) {
+    Network net(params.network_size);
+    net.waitConnected();
+    auto payload = benchPayload(params.value_size);
+    auto keys = std::min(params.count, GET_KEYS);
+    auto key = [](unsigned i) { return InfoHash::get("perftest_get" + std::to_string(i)); };
+    runConcurrent("get_setup", keys, params.concurrency, [&](unsigned i, OpDone done) {
+        net[i].put(key(i), Value(payload), [done](bool ok) {
+            done(ok);
+        });
+    });
+    // get from another node than the one that put the key
+    return runConcurrent("get", params.count, params.concurrency, [&](unsigned i, OpDone done) {
+        getFirst(net[i % keys + 1], key(i % keys), std::move(done));
+    });
+}
+
+/**
+ * Listeners, concurrency per node, are notified of count values
+ * put on a single key by the first node.
+ * Latency is measured from the put to each notification.
+ */
+Result
+benchListen(const Params& params) {
+    const unsigned listeners = std::max(params.network_size, 1u) * params.concurrency;
+    const unsigned values = params.count;
+    const uint64_t total = (uint64_t)listeners * values;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<clock::time_point> sent(values);
+    std::vector<std::vector<bool>> received(listeners, std::vector<bool>(values, false));
+    uint64_t deliveries {0};
+    LatencyHistogram latency;
+
+    // destroyed first, as its callbacks use the state above
+    Network net(params.network_size);
+    net.waitConnected();
+
+    const auto key = InfoHash::get("perftest_listen");
+    for (unsigned l=0; l<listeners; l++) {
+        net[l].listen(key, [&,l](const std::shared_ptr<Value>& v) {
+            auto now = clock::now();
+            std::lock_guard<std::mutex> lk(m);
+            if (v->id and v->id <= values and not received[l][v->id - 1]) {
+                received[l][v->id - 1] = true;
+                latency.record(now - sent[v->id - 1]);
+                if (++deliveries == total)
+                    cv.notify_all();
+            }
+            return true;
+        });
+    }
+    std::this_thread::sleep_for(LISTEN_SETUP_DELAY);
+
+    auto payload = benchPayload(params.value_size);
+    auto start = clock::now();
+    for (unsigned i=0; i<values; i++) {
+        Value v(payload);
+        v.id = i + 1;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            sent[i] = clock::now();
+        }
+        net[0].put(key, std::move(v));
+    }
+
+    Result result;
+    result.name = "listen";
+    std::unique_lock<std::mutex> lk(m);
+    cv.wait_for(lk, SCENARIO_TIMEOUT, [&]{ return deliveries == total; });
+    result.time = clock::now() - start;
+    result.ops = deliveries;
+    result.errors = total - deliveries;
+    result.latency = latency.getStats();
+    return result;
+}
+
+std::vector<Result>
+benchVerify(const Params& params) {
+    std::vector<Result> results;
+    auto payload = benchPayload(params.value_size);
+    const std::vector<std::pair<std::string, std::function<crypto::Identity()>>> keyTypes {
+        {"ec", []{ return crypto::generateEcIdentity("perftest"); }},
+        {"rsa", []{ return crypto::generateIdentity("perftest"); }}
+    };
+    for (const auto& type : keyTypes) {
+        auto id = type.second();
+        std::vector<Value> values;
+        values.reserve(VERIFY_VALUES);
+
+        LatencyHistogram signLatency;
+        auto start = clock::now();
+        for (unsigned i=0; i<VERIFY_VALUES; i++) {
+            auto t = clock::now();
+            values.emplace_back(payload);
+            values.back().id = i + 1;
+            values.back().sign(*id.first);
+            signLatency.record(clock::now() - t);
+        }
+        Result sign;
+        sign.name = "sign_" + type.first;
+        sign.time = clock::now() - start;
+        sign.ops = VERIFY_VALUES;
+        sign.latency = signLatency.getStats();
+        results.emplace_back(std::move(sign));
+
+        // verify count signatures, over concurrency threads
+        LatencyHistogram latency;
+        std::atomic<uint64_t> errors {0};
+        const unsigned threads = std::max(params.concurrency, 1u);
+        std::vector<std::thread> workers;
+        workers.reserve(threads);
+        start = clock::now();
+        for (unsigned t=0; t<threads; t++) {
+            workers.emplace_back([&, t]{
+                for (unsigned i=t; i<params.count; i+=threads) {
+                    auto s = clock::now();
+                    if (not values[i % values.size()].checkSignature())
+                        errors++;
+                    latency.record(clock::now() - s);
+                }
+            });
+        }
+        for (auto& w : workers)
+            w.join();
+        Result verify;
+        verify.name = "verify_" + type.first;
+        verify.time = clock::now() - start;
+        verify.ops = params.count;
+        verify.errors = errors;
+        verify.latency = latency.getStats();
+        results.emplace_back(std::move(verify));
+    }
+    return results;
+}
+
+/**
+ * Stores storage_values values on a single node,
+ * then gets values from the full storage.
+ */
+std::vector<Result>
+benchStorage(const Params& params) {
+    std::vector<Result> results;
+    const unsigned values = params.storage_values;
+    const unsigned keys = (values + STORAGE_VALUES_PER_KEY - 1) / STORAGE_VALUES_PER_KEY;
+    auto key = [](unsigned i) { return InfoHash::get("perftest_storage" + std::to_string(i)); };
+
+    Network net(1);
+    auto& node = net[0];
+    node.setStorageLimit(std::max(DEFAULT_STORAGE_LIMIT, (size_t)values * (params.value_size + 256)));
+
+    auto payload = benchPayload(params.value_size);
+    auto start = clock::now();
+    for (unsigned i=0; i<values; i++)
+        node.put(key(i / STORAGE_VALUES_PER_KEY), Value(payload));
+
+    // values are stored locally before being announced
+    auto store = node.getStoreSize();
+    auto lastProgress = clock::now();
+    while (store.second < values and clock::now() - lastProgress < SCENARIO_TIMEOUT) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto s = node.getStoreSize();
+        if (s.second != store.second)
+            lastProgress = clock::now();
+        store = s;
+    }
+    Result put;
+    put.name = "storage_put";
+    put.time = clock::now() - start;
+    put.ops = store.second;
+    put.errors = values - std::min<size_t>(values, store.second);
+    std::cout << "Storage: " << store.second << " values stored, " << store.first << " bytes" << std::endl;
+    results.emplace_back(std::move(put));
+
+    results.emplace_back(runConcurrent("storage_get", params.count, params.concurrency, [&](unsigned i, OpDone done) {
+        getFirst(node, key(i % keys), std::move(done));
+    }));
+    return results;
+}
+
+#if defined(OPENDHT_PROXY_SERVER) && defined(OPENDHT_PROXY_CLIENT)
+/**
+ * Puts and gets through a proxy server, from a client node.
+ * The cache of the proxy is disabled, so that gets reach the DHT.
+ */
+std::vector<Result>
+benchProxy(const Params& params) {
+    std::vector<Result> results;
+    Network net(params.network_size);
+    net.waitConnected();
+
+    ProxyServerConfig serverConfig;
+    serverConfig.port = params.proxy_port;
+    serverConfig.threads = 0;
+    serverConfig.getCacheTtl = duration::zero();
+    DhtProxyServer server(net.nodes.front(), serverConfig);
+
+    auto config = benchConfig();
+    config.proxy_server = "127.0.0.1:" + std::to_string(params.proxy_port);
+    DhtRunner client;
+    client.run(0, config);
+
+    auto payload = benchPayload(params.value_size);
+    auto keys = std::min(params.count, GET_KEYS);
+    auto key = [](unsigned i) { return InfoHash::get("perftest_proxy" + std::to_string(i)); };
+    results.emplace_back(runConcurrent("proxy_put", params.count, params.concurrency, [&](unsigned i, OpDone done) {
+        client.put(key(i % keys), Value(payload), [done](bool ok) {
+            done(ok);
+        });
+    }));
+    results.emplace_back(runConcurrent("proxy_get", params.count, params.concurrency, [&](unsigned i, OpDone done) {
+        getFirst(client, key(i % keys), std::move(done));
+    }));
+
+    client.shutdown();
+    client.join();
+    return results;
+}
+#endif
+
+/**
+ * Nodes of a simulated network are bootstrapped from random nodes added
+ * before them, until every node knows SIM_CONVERGED_NODES good nodes.
+ * Values are then put and got from random nodes, concurrency at a time.
+ * Times and latencies are virtual.
+ */
+std::vector<Result>
+benchSimulation(const Params& params) {
+    std::vector<Result> results;
+    net::SimulatedNetwork::Config simConfig;
+    simConfig.seed = 42;
+    simConfig.loss = params.sim_loss;
+    net::SimulatedNetwork sim(simConfig);
+    std::mt19937_64 rd {42};
+
+    dht::Config nodeConfig;
+    nodeConfig.max_req_per_sec = -1;
+    nodeConfig.max_peer_req_per_sec = -1;
+    const unsigned n = std::max(params.sim_nodes, 2u);
+    auto realStart = clock::now();
+    auto start = sim.now();
+    for (unsigned i=0; i<n; i++) {
+        sim.addNode(nodeConfig);
+        if (i)
+            sim.bootstrap(i, std::uniform_int_distribution<unsigned>{0, i - 1}(rd));
+    }
+    const auto& csim = sim;
+    auto unconverged = [&] {
+        unsigned count = 0;
+        for (unsigned i=0; i<n; i++)
+            if (csim.node(i).getNodesStats(AF_INET).good_nodes < std::min(n - 1, SIM_CONVERGED_NODES))
+                count++;
+        return count;
+    };
+    unsigned remaining;
+    while ((remaining = unconverged()) and sim.now() - start < SIM_TIMEOUT)
+        sim.runFor(std::chrono::seconds(1));
+    Result convergence;
+    convergence.name = "sim_convergence";
+    convergence.ops = n - remaining;
+    convergence.errors = remaining;
+    convergence.time = sim.now() - start;
+    convergence.metrics["real_time_s"] = std::chrono::duration<double>(clock::now() - realStart).count();
+    results.emplace_back(std::move(convergence));
+
+    auto totalTraffic = [&] {
+        net::SimulatedNetwork::Traffic total;
+        for (unsigned i=0; i<n; i++) {
+            const auto& t = sim.traffic(i);
+            total.packets_sent += t.packets_sent;
+            total.bytes_sent += t.bytes_sent;
+        }
+        return total;
+    };
+    auto payload = benchPayload(params.value_size);
+    auto key = [](unsigned i) { return InfoHash::get("perftest_sim" + std::to_string(i)); };
+    std::uniform_int_distribution<unsigned> nodeDist {0, n - 1};
+
+    // runs count operations, concurrency at a time, until done or SIM_TIMEOUT
+    auto runOps = [&](const char* name, const std::function<void(unsigned i, OpDone)>& op) {
+        struct State {
+            Result result;
+            LatencyHistogram latency;
+            unsigned pending {0};
+        };
+        // operations may complete after a timeout
+        auto state = std::make_shared<State>();
+        auto& result = state->result;
+        result.name = name;
+        auto before = totalTraffic();
+        auto opsStart = sim.now();
+        for (unsigned i=0; i<params.count; i+=params.concurrency) {
+            for (unsigned j=i; j<std::min(params.count, i + params.concurrency); j++) {
+                state->pending++;
+                auto t = sim.now();
+                op(j, [state, &sim, t](bool ok) {
+                    state->latency.record(sim.now() - t);
+                    state->result.ops++;
+                    if (not ok)
+                        state->result.errors++;
+                    state->pending--;
+                });
+            }
+            auto batchStart = sim.now();
+            while (state->pending and sim.now() - batchStart < SIM_TIMEOUT)
+                sim.runFor(std::chrono::milliseconds(10));
+            if (state->pending)
+                throw std::runtime_error(std::string("Timeout: ") + name);
+        }
+        auto after = totalTraffic();
+        result.time = sim.now() - opsStart;
+        result.latency = state->latency.getStats();
+        if (result.ops) {
+            result.metrics["packets_per_op"] = (double)(after.packets_sent - before.packets_sent) / result.ops;
+            result.metrics["bytes_per_op"] = (double)(after.bytes_sent - before.bytes_sent) / result.ops;
+        }
+        return result;
+    };
+    results.emplace_back(runOps("sim_put", [&](unsigned i, OpDone done) {
+        DoneCallbackSimple cb = [done](bool ok) { done(ok); };
+        sim.node(nodeDist(rd)).put(key(i), Value(payload), std::move(cb));
+    }));
+    results.emplace_back(runOps("sim_get", [&](unsigned i, OpDone done) {
+        auto found = std::make_shared<bool>(false);
+        DoneCallbackSimple cb = [done, found](bool) { done(*found); };
+        sim.node(nodeDist(rd)).get(key(i), [found](const std::vector<std::shared_ptr<Value>>&) {
+            *found = true;
+            return false;
+        }, std::move(cb));
+    }));
+
+    // background traffic of the whole run, per node
+    auto total = totalTraffic();
+    auto seconds = std::chrono::duration<double>(sim.now() - start).count();
+    results.front().metrics["node_packets_per_s"] = total.packets_sent / (n * seconds);
+    results.front().metrics["node_bytes_per_s"] = total.bytes_sent / (n * seconds);
+    return results;
+}
+
+/**
+ * Runs op on consecutive pairs of random hashes.
+ * @return the total time of the calls.
+ */
+template <typename Op>
+Result
+benchHashOp(const char* name, const std::vector<InfoHash>& hashes, unsigned rounds, Op&& op) {
+    size_t sink = 0;
+    auto start = clock::now();
+    for (unsigned r=0; r<rounds; r++)
+        for (size_t i=1; i<hashes.size(); i++)
+            sink += op(hashes[i-1], hashes[i]);
+    Result result;
+    result.name = std::string("hash_") + name;
+    result.time = clock::now() - start;
+    result.ops = rounds * (hashes.size() - 1);
+    // keep the results alive
+    if (sink == (size_t)-1)
+        std::cout << std::endl;
+    return result;
+}
+
+std::vector<Result>
+benchInfoHash() {
+    constexpr unsigned HASH_COUNT = 4096;
+    constexpr unsigned ROUNDS = 256;
+    std::vector<InfoHash> hashes;
+    hashes.reserve(HASH_COUNT);
+    std::mt19937_64 rd {42};
+    for (unsigned i=0; i<HASH_COUNT; i++) {
+        auto h = InfoHash::getRandom(rd);
+        // share prefixes, like ids of a routing table bucket
+        if (i and (i % 4))
+            std::copy_n(hashes.back().cbegin(), i % HASH_LEN, h.begin());
+        hashes.emplace_back(h);
+    }
+    const auto target = InfoHash::getRandom(rd);
+    std::vector<std::string> hex;
+    hex.reserve(HASH_COUNT);
+    for (const auto& h : hashes)
+        hex.emplace_back(h.toString());
+
+    std::vector<Result> results;
+    auto print = [&](Result r) {
+        std::cout << r.name.substr(5) << ": " << std::chrono::duration<double, std::nano>(r.time).count() / r.ops << " ns" << std::endl;
+        results.emplace_back(std::move(r));
+    };
+    std::cout << "InfoHash operations, per call" << std::endl;
+    print(benchHashOp("commonBits", hashes, ROUNDS, [](const InfoHash& a, const InfoHash& b) {
+        return InfoHash::commonBits(a, b);
+    }));
+    print(benchHashOp("xorCmp", hashes, ROUNDS, [&](const InfoHash& a, const InfoHash& b) {
+        return target.xorCmp(a, b) + 1;
+    }));
+    print(benchHashOp("operator<", hashes, ROUNDS, [](const InfoHash& a, const InfoHash& b) {
+        return a < b;
+    }));
+    print(benchHashOp("lowbit", hashes, ROUNDS, [](const InfoHash& a, const InfoHash&) {
+        return a.lowbit();
+    }));
+    print(benchHashOp("toString", hashes, ROUNDS / 4, [](const InfoHash& a, const InfoHash&) {
+        return a.toString().size();
+    }));
+    size_t n = 0;
+    print(benchHashOp("fromString", hashes, ROUNDS / 4, [&](const InfoHash&, const InfoHash&) {
+        return InfoHash(hex[n++ % hex.size()])[0];
+    }));
+    std::cout << std::endl;
+    return results;
+}
+
+#ifdef OPENDHT_JSONCPP
+Json::Value
+resultsToJson(const Params& params, const std::vector<Result>& results) {
+    Json::Value json;
+    json["version"] = 1;
+    auto& p = json["params"];
+    p["network_size"] = params.network_size;
+    p["concurrency"] = params.concurrency;
+    p["count"] = params.count;
+    p["storage_values"] = params.storage_values;
+    p["value_size"] = static_cast<Json::LargestUInt>(params.value_size);
+    auto& r = json["results"];
+    r = Json::objectValue;
+    for (const auto& result : results)
+        r[result.name] = result.toJson();
+    return json;
+}
+
+/**
+ * Compares results with the results of a baseline run:
+ * a rate lower, or a median or 99th percentile latency higher,
+ * by more than tolerance percent is a regression.
+ * @return the number of regressions.
+ */
+unsigned
+compareResults(const Json::Value& baseline, const std::vector<Result>& results, double tolerance) {
+    unsigned regressions {0};
+    const auto& base = baseline["results"];
+    auto t = tolerance / 100.;
+    auto change = [](double from, double to) {
+        return from > 0 ? (to - from) * 100. / from : 0.;
+    };
+    auto report = [&](const std::string& name, const char* metric, double from, double to, bool regressed) {
+        std::cout << std::left << std::setw(24) << name << std::setw(12) << metric << std::right
+                  << std::setw(14) << from << " -> " << std::setw(14) << to
+                  << " (" << std::showpos << std::fixed << std::setprecision(1) << change(from, to) << "%)"
+                  << std::noshowpos << std::defaultfloat << std::setprecision(6);
+        if (regressed) {
+            std::cout << "  REGRESSION";
+            regressions++;
+        }
+        std::cout << std::endl;
+    };
+    std::cout << "Comparison with baseline, tolerance " << tolerance << "%" << std::endl;
+    for (const auto& result : results) {
+        if (not base.isMember(result.name)) {
+            std::cout << std::left << std::setw(24) << result.name << std::right << "not in baseline" << std::endl;
+            continue;
+        }
+        const auto& b = base[result.name];
+        auto baseRate = b["rate"].asDouble();
+        report(result.name, "ops/s", baseRate, result.rate(), result.rate() < baseRate * (1. - t));
+        if (result.latency.count and b.isMember("latency")) {
+            LatencyStats baseLatency(b["latency"]);
+            report(result.name, "p50 ms", baseLatency.p50, result.latency.p50, result.latency.p50 > baseLatency.p50 * (1. + t));
+            report(result.name, "p99 ms", baseLatency.p99, result.latency.p99, result.latency.p99 > baseLatency.p99 * (1. + t));
+        }
+    }
+    std::cout << regressions << " regression(s)" << std::endl;
+    return regressions;
+}
+#endif
+
+static const constexpr struct option perftest_options[] = {
+    {"help",            no_argument      , nullptr, 'h'},
+    {"scenario",        required_argument, nullptr, 's'},
+    {"network-size",    required_argument, nullptr, 'n'},
+    {"concurrency",     required_argument, nullptr, 'c'},
+    {"count",           required_argument, nullptr, 'o'},
+    {"storage-values",  required_argument, nullptr, 'S'},
+    {"value-size",      required_argument, nullptr, 'z'},
+    {"sim-nodes",       required_argument, nullptr, 'N'},
+    {"sim-loss",        required_argument, nullptr, 'l'},
+    {"proxy-port",      required_argument, nullptr, 'p'},
+    {"json",            required_argument, nullptr, 'j'},
+    {"compare",         required_argument, nullptr, 'r'},
+    {"tolerance",       required_argument, nullptr, 't'},
+    {nullptr,           0                , nullptr,  0}
+};
+
+Params
+parsePerftestArgs(int argc, char **argv) {
+    Params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hs:n:c:o:S:z:N:l:p:j:r:t:", perftest_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'h':
+            params.help = true;
+            break;
+        case 's': {
+            params.scenarios.clear();
+            std::istringstream ss(optarg);
+            std::string s;
+            while (std::getline(ss, s, ','))
+                if (not s.empty())
+                    params.scenarios.emplace_back(s);
+            break;
+        }
+        case 'n':
+            params.network_size = std::stoul(optarg);
+            break;
+        case 'c':
+            params.concurrency = std::max(1ul, std::stoul(optarg));
+            break;
+        case 'o':
+            params.count = std::stoul(optarg);
+            break;
+        case 'S':
+            params.storage_values = std::stoul(optarg);
+            break;
+        case 'z':
+            params.value_size = std::stoul(optarg);
+            break;
+        case 'N':
+            params.sim_nodes = std::stoul(optarg);
+            break;
+        case 'l':
+            params.sim_loss = std::stod(optarg);
+            break;
+        case 'p':
+            params.proxy_port = std::stoi(optarg);
+            break;
+        case 'j':
+            params.json = optarg;
+            break;
+        case 'r':
+            params.compare = optarg;
+            break;
+        case 't':
+            params.tolerance = std::stod(optarg);
+            break;
+        default:
+            params.help = true;
+            break;
+        }
+    }
+    return params;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+#ifdef WIN32_NATIVE
+    gnutls_global_init();
+#endif
+    tests::Params params;
+    try {
+        params = tests::parsePerftestArgs(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        params.help = true;
+    }
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
+#ifndef OPENDHT_JSONCPP
+    if (not params.json.empty() or not params.compare.empty()) {
+        std::cerr << "JSON output requested but OpenDHT built without JsonCpp support." << std::endl;
+        return EXIT_FAILURE;
+    }
+#endif
+
+    const std::vector<std::string> all {"hash", "pingpong", "put", "get", "listen", "verify", "storage", "proxy", "sim"};
+    std::vector<std::string> scenarios;
+    for (const auto& s : params.scenarios) {
+        if (s == "all")
+            scenarios.insert(scenarios.end(), all.begin(), all.end());
+        else
+            scenarios.emplace_back(s);
+    }
+
+    std::vector<tests::Result> results;
+    auto add = [&](std::vector<tests::Result>&& r) {
+        results.insert(results.end(), std::make_move_iterator(r.begin()), std::make_move_iterator(r.end()));
+    };
+    for (const auto& s : scenarios) {
+        std::vector<tests::Result> r;
+        try {
+            if (s == "hash")
+                add(tests::benchInfoHash());
+            else if (s == "sweep")
+                add(tests::benchPingPongSweep());
+            else if (s == "pingpong")
+                r.emplace_back(tests::benchPingPong(params));
+            else if (s == "put")
+                r.emplace_back(tests::benchPut(params));
+            else if (s == "get")
+                r.emplace_back(tests::benchGet(params));
+            else if (s == "listen")
+                r.emplace_back(tests::benchListen(params));
+            else if (s == "verify")
+                r = tests::benchVerify(params);
+            else if (s == "storage")
+                r = tests::benchStorage(params);
+            else if (s == "sim")
+                r = tests::benchSimulation(params);
+            else if (s == "proxy") {
+#if defined(OPENDHT_PROXY_SERVER) && defined(OPENDHT_PROXY_CLIENT)
+                r = tests::benchProxy(params);
+#else
+                std::cerr << "Proxy scenario requested but OpenDHT built without proxy support." << std::endl;
+#endif
+            } else {
+                std::cerr << "Unknown scenario: " << s << std::endl;
+                continue;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Scenario " << s << " failed: " << e.what() << std::endl;
+            continue;
+        }
+        for (const auto& result : r)
+            std::cout << result.toString() << std::endl;
+        if (not r.empty())
+            std::cout << std::endl;
+        add(std::move(r));
+    }
+
+    int ret = 0;
+#ifdef OPENDHT_JSONCPP
+    if (not params.json.empty()) {
+        Json::StreamWriterBuilder wbuilder;
+        wbuilder["commentStyle"] = "None";
+        wbuilder["indentation"] = "  ";
+        auto json = Json::writeString(wbuilder, tests::resultsToJson(params, results));
+        if (params.json == "-")
+            std::cout << json << std::endl;
+        else {
+            std::ofstream out(params.json);
+            out << json << std::endl;
+            if (not out)
+                std::cerr << "Can't write results to " << params.json << std::endl;
+        }
+    }
+    if (not params.compare.empty()) {
+        std::ifstream in(params.compare);
+        Json::Value baseline;
+        Json::CharReaderBuilder rbuilder;
+        std::string errs;
+        if (not in or not Json::parseFromStream(rbuilder, in, &baseline, &errs)) {
+            std::cerr << "Can't read baseline " << params.compare << ": " << errs << std::endl;
+            ret = EXIT_FAILURE;
+        } else if (tests::compareResults(baseline, results, params.tolerance)) {
+            ret = 2;
+        }
+    }
+#endif
 
 #ifdef WIN32_NATIVE
     gnutls_global_deinit();
 #endif
-    return 0;
+    return ret;
 }
@@ -0,0 +1,428 @@
+/*
+ *  Copyright (C) 2014-2020 Savoir-faire Linux Inc.
+ *
+ *  Author: Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tools_common.h"
+#include <opendht/http.h>
+#include <opendht/metrics.h>
+
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+extern "C" {
+#include <gnutls/gnutls.h>
+}
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iomanip>
+#include <random>
+#include <thread>
+
+void print_usage() {
+    std::cout << "Usage: proxyloadtest [-u url] [-r rate] [-d seconds] [-m mix]" << std::endl;
+    std::cout << "                     [-k keys] [-z value_size] [-l seconds] [-i max_inflight] [-j threads]" << std::endl << std::endl;
+    std::cout << "proxyloadtest, an OpenDHT proxy server load generator." << std::endl;
+    std::cout << "Requests are started at a fixed rate, whether or not previous requests completed." << std::endl;
+    std::cout << "Latencies are measured from the time each request should have started," << std::endl;
+    std::cout << "so that they include the time requests waited for the load generator." << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -h, --help                 Show this help message and exit." << std::endl;
+    std::cout << "  -u, --url <url>            URL of the proxy server (default: http://127.0.0.1:8080)." << std::endl;
+    std::cout << "  -r, --rate <n>             Requests started per second (default: 1000)." << std::endl;
+    std::cout << "  -d, --duration <seconds>   Time during which requests are started (default: 10)." << std::endl;
+    std::cout << "  -m, --mix <op:weight,...>  Relative weights of get, put, listen and subscribe" << std::endl;
+    std::cout << "                             requests (default: get:5,put:5,listen:1,subscribe:1)." << std::endl;
+    std::cout << "  -k, --keys <n>             Number of keys used (default: 1024)." << std::endl;
+    std::cout << "  -z, --value-size <n>       Size of the values put, in bytes (default: 64)." << std::endl;
+    std::cout << "  -l, --listen-time <sec>    Time each listen is kept open (default: 5)." << std::endl;
+    std::cout << "  -i, --max-inflight <n>     Requests in flight before new ones are delayed (default: 10000)." << std::endl;
+    std::cout << "  -j, --threads <n>          Client threads (default: 4)." << std::endl;
+    std::cout << "  -v, --verbose              Enable the logs of the http client." << std::endl;
+    std::cout << "Report bugs to: https://opendht.net" << std::endl;
+}
+
+using namespace dht;
+
+namespace tests {
+
+using clock = dht::clock;
+
+enum class Op : unsigned { Get, Put, Listen, Subscribe };
+constexpr unsigned OPS {4};
+constexpr std::array<const char*, OPS> OP_NAMES {{"get", "put", "listen", "subscribe"}};
+
+/* Time allowed for requests in flight to complete, after the last one started */
+constexpr std::chrono::seconds DRAIN_TIMEOUT {30};
+/* Upper bounds of the printed histograms, in milliseconds */
+const std::vector<double> HISTOGRAM_BOUNDS {.1, .2, .5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+
+struct Params {
+    bool help {false};
+    bool verbose {false};
+    std::string url {"http://127.0.0.1:8080"};
+    double rate {1000};
+    std::chrono::seconds duration {10};
+    std::array<unsigned, OPS> mix {{5, 5, 1, 1}};
+    unsigned keys {1024};
+    size_t value_size {64};
+    std::chrono::seconds listen_time {5};
+    unsigned max_inflight {10000};
+    unsigned threads {4};
+};
+
+struct OpStats {
+    std::atomic<uint64_t> started {0};
+    std::atomic<uint64_t> errors {0};
+    /* from the intended start of requests, corrected for coordinated omission */
+    LatencyHistogram latency;
+    /* from the actual start of requests */
+    LatencyHistogram service;
+};
+
+/**
+ * Open-loop load generator: request i is due at start + i / rate,
+ * and is started at that time unless max_inflight requests are pending.
+ * A listen completes when the proxy replied with its headers,
+ * and is then kept open for listen_time.
+ */
+class LoadTester {
+public:
+    LoadTester(const Params& params)
+        : params_(params),
+          logger_(params.verbose ? log::getStdLogger() : nullptr),
+          resolver_(std::make_shared<http::Resolver>(ctx_, params.url, logger_)),
+          pool_(std::make_shared<http::ConnectionPool>(http::ConnectionPool::Config {params.max_inflight, std::chrono::seconds(30)}))
+    {
+        for (unsigned i = 0; i < OPS; i++)
+            weights_ += params.mix[i];
+        if (weights_ == 0)
+            throw std::invalid_argument("empty request mix");
+        for (unsigned i = 0; i < params.keys; i++)
+            keys_.emplace_back(InfoHash::get("proxyloadtest" + std::to_string(i)).toString());
+        payload_.resize(params.value_size);
+        std::uniform_int_distribution<unsigned> byte(0, 255);
+        for (auto& b : payload_)
+            b = byte(rd_);
+        pushToken_ = InfoHash::getRandom(rd_).toString();
+        jsonBuilder_["commentStyle"] = "None";
+        jsonBuilder_["indentation"] = "";
+    }
+
+    void run() {
+        auto work = asio::make_work_guard(ctx_);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < std::max(1u, params_.threads); i++)
+            threads.emplace_back([this]{ ctx_.run(); });
+
+        const auto interval = std::chrono::duration_cast<duration>(std::chrono::duration<double>(1. / params_.rate));
+        const uint64_t total = params_.rate * params_.duration.count();
+        std::discrete_distribution<unsigned> pick(params_.mix.begin(), params_.mix.end());
+        std::uniform_int_distribution<unsigned> key(0, keys_.size() - 1);
+
+        start_ = clock::now();
+        for (uint64_t i = 0; i < total; i++) {
+            auto due = start_ + interval * i;
+            std::this_thread::sleep_until(due);
+            {
+                std::unique_lock<std::mutex> l(lock_);
+                cv_.wait(l, [&]{ return requests_.size() < params_.max_inflight; });
+            }
+            start((Op)pick(rd_), keys_[key(rd_)], due);
+        }
+        end_ = clock::now();
+
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            if (not cv_.wait_for(l, params_.listen_time + DRAIN_TIMEOUT, [&]{ return requests_.empty(); })) {
+                std::cerr << requests_.size() << " requests still pending, cancelling" << std::endl;
+                auto pending = requests_;
+                l.unlock();
+                for (const auto& r : pending)
+                    r.second->cancel();
+                l.lock();
+                cv_.wait_for(l, std::chrono::seconds(1), [&]{ return requests_.empty(); });
+            }
+        }
+        work.reset();
+        ctx_.stop();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    void print(std::ostream& out) const {
+        auto elapsed = std::chrono::duration<double>(end_ - start_).count();
+        uint64_t started {0};
+        for (const auto& s : stats_)
+            started += s.started;
+        out << started << " requests started in " << print_duration(end_ - start_)
+            << ", " << (elapsed > 0 ? started / elapsed : 0) << " req/s (target " << params_.rate << " req/s)" << std::endl;
+        for (unsigned i = 0; i < OPS; i++) {
+            const auto& s = stats_[i];
+            if (s.started == 0)
+                continue;
+            out << std::endl << OP_NAMES[i] << ": " << s.started << " requests";
+            if (s.errors)
+                out << " (" << s.errors << " errors)";
+            out << std::endl;
+            out << "  latency: " << s.latency.getStats().toString() << std::endl;
+            out << "  service: " << s.service.getStats().toString() << std::endl;
+            printHistogram(out, s.latency);
+        }
+    }
+
+private:
+    Params params_;
+    std::mt19937_64 rd_ {std::random_device{}()};
+    asio::io_context ctx_;
+    std::shared_ptr<Logger> logger_;
+    std::shared_ptr<http::Resolver> resolver_;
+    std::shared_ptr<http::ConnectionPool> pool_;
+
+    unsigned weights_ {0};
+    std::vector<std::string> keys_;
+    Blob payload_;
+    std::string pushToken_;
+    Json::StreamWriterBuilder jsonBuilder_;
+    std::atomic<uint64_t> clientId_ {0};
+
+    std::array<OpStats, OPS> stats_;
+    time_point start_, end_;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::map<unsigned, std::shared_ptr<http::Request>> requests_;
+
+    static void printHistogram(std::ostream& out, const LatencyHistogram& h) {
+        auto counts = h.getCumulativeCounts(HISTOGRAM_BOUNDS);
+        auto total = h.count();
+        uint64_t prev {0};
+        for (size_t i = 0; i < HISTOGRAM_BOUNDS.size() and prev < total; i++) {
+            out << "  <= " << std::setw(6) << HISTOGRAM_BOUNDS[i] << " ms: " << std::setw(9) << counts[i] - prev
+                << "  " << std::fixed << std::setprecision(3) << std::setw(7) << (100. * counts[i] / total) << "%"
+                << std::defaultfloat << std::setprecision(6) << std::endl;
+            prev = counts[i];
+        }
+        if (prev < total)
+            out << "  >  " << std::setw(6) << HISTOGRAM_BOUNDS.back() << " ms: " << std::setw(9) << total - prev << std::endl;
+    }
+
+    std::shared_ptr<http::Request> buildRequest(const std::string& target) {
+        auto request = std::make_shared<http::Request>(ctx_, resolver_, target);
+        request->set_header_field(restinio::http_field_t::user_agent, "RESTinio client");
+        request->set_header_field(restinio::http_field_t::accept, "*/*");
+        request->set_header_field(restinio::http_field_t::content_type, "application/json");
+        request->set_connection_type(restinio::http_connection_header_t::keep_alive);
+        request->set_connection_pool(pool_);
+        return request;
+    }
+
+    void done(Op op, const time_point& due, const time_point& sent, bool ok) {
+        auto now = clock::now();
+        auto& s = stats_[(unsigned)op];
+        s.latency.record(now - due);
+        s.service.record(now - sent);
+        if (not ok)
+            s.errors++;
+    }
+
+    void start(Op op, const std::string& key, const time_point& due) {
+        std::shared_ptr<http::Request> request;
+        switch (op) {
+        case Op::Get:
+            request = buildRequest("/key/" + key);
+            request->set_method(restinio::http_method_get());
+            break;
+        case Op::Put: {
+            request = buildRequest("/key/" + key);
+            request->set_method(restinio::http_method_post());
+            Value value {payload_};
+            value.id = std::uniform_int_distribution<Value::Id>{1}(rd_);
+            request->set_body(Json::writeString(jsonBuilder_, value.toJson()));
+            break;
+        }
+        case Op::Listen:
+            request = buildRequest("/key/" + key + "/listen");
+            request->set_method(restinio::http_method_get());
+            break;
+        case Op::Subscribe: {
+            request = buildRequest("/key/" + key);
+            request->set_method(restinio::http_method_subscribe());
+            Json::Value body;
+            body["key"] = pushToken_;
+            body["client_id"] = std::to_string(clientId_++);
+            body["platform"] = "android";
+            request->set_body(Json::writeString(jsonBuilder_, body));
+            break;
+        }
+        }
+
+        auto reqid = request->id();
+        auto sent = clock::now();
+        auto recorded = std::make_shared<std::atomic_bool>(false);
+        if (op == Op::Listen) {
+            auto timer = std::make_shared<asio::steady_timer>(ctx_);
+            std::weak_ptr<http::Request> wreq = request;
+            request->add_on_state_change_callback([this, due, sent, recorded, timer, wreq](http::Request::State state, const http::Response& response) {
+                if (state != http::Request::State::HEADER_RECEIVED or recorded->exchange(true))
+                    return;
+                done(Op::Listen, due, sent, response.status_code == 200);
+                timer->expires_after(params_.listen_time);
+                timer->async_wait([wreq](const asio::error_code& ec) {
+                    if (ec == asio::error::operation_aborted)
+                        return;
+                    if (auto r = wreq.lock())
+                        r->cancel();
+                });
+            });
+            request->add_on_done_callback([this, reqid, due, sent, recorded, timer](const http::Response&) {
+                timer->cancel();
+                if (not recorded->exchange(true))
+                    done(Op::Listen, due, sent, false);
+                remove(reqid);
+            });
+        } else {
+            request->add_on_done_callback([this, op, reqid, due, sent, recorded](const http::Response& response) {
+                if (not recorded->exchange(true))
+                    done(op, due, sent, not response.aborted and response.status_code == 200);
+                remove(reqid);
+            });
+        }
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            requests_[reqid] = request;
+        }
+        stats_[(unsigned)op].started++;
+        request->send();
+    }
+
+    void remove(unsigned reqid) {
+        std::lock_guard<std::mutex> l(lock_);
+        requests_.erase(reqid);
+        cv_.notify_all();
+    }
+};
+
+static const constexpr struct option loadtest_options[] = {
+    {"help",            no_argument      , nullptr, 'h'},
+    {"url",             required_argument, nullptr, 'u'},
+    {"rate",            required_argument, nullptr, 'r'},
+    {"duration",        required_argument, nullptr, 'd'},
+    {"mix",             required_argument, nullptr, 'm'},
+    {"keys",            required_argument, nullptr, 'k'},
+    {"value-size",      required_argument, nullptr, 'z'},
+    {"listen-time",     required_argument, nullptr, 'l'},
+    {"max-inflight",    required_argument, nullptr, 'i'},
+    {"threads",         required_argument, nullptr, 'j'},
+    {"verbose",         no_argument      , nullptr, 'v'},
+    {nullptr,           0                , nullptr,  0}
+};
+
+Params
+parseLoadtestArgs(int argc, char **argv) {
+    Params params;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hu:r:d:m:k:z:l:i:j:v", loadtest_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'h':
+            params.help = true;
+            break;
+        case 'u':
+            params.url = optarg;
+            break;
+        case 'r':
+            params.rate = std::stod(optarg);
+            if (params.rate <= 0)
+                throw std::invalid_argument("rate must be positive");
+            break;
+        case 'd':
+            params.duration = std::chrono::seconds(std::stoul(optarg));
+            break;
+        case 'm':
+            params.mix.fill(0);
+            for (const auto& w : parseStringMap(optarg)) {
+                auto op = std::find(OP_NAMES.begin(), OP_NAMES.end(), w.first);
+                if (op == OP_NAMES.end())
+                    throw std::invalid_argument("unknown request type " + w.first);
+                params.mix[op - OP_NAMES.begin()] = std::stoul(w.second);
+            }
+            break;
+        case 'k':
+            params.keys = std::max(1ul, std::stoul(optarg));
+            break;
+        case 'z':
+            params.value_size = std::stoul(optarg);
+            break;
+        case 'l':
+            params.listen_time = std::chrono::seconds(std::stoul(optarg));
+            break;
+        case 'i':
+            params.max_inflight = std::max(1ul, std::stoul(optarg));
+            break;
+        case 'j':
+            params.threads = std::max(1ul, std::stoul(optarg));
+            break;
+        case 'v':
+            params.verbose = true;
+            break;
+        default:
+            params.help = true;
+            break;
+        }
+    }
+    return params;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+#ifdef WIN32_NATIVE
+    gnutls_global_init();
+#endif
+    tests::Params params;
+    try {
+        params = tests::parseLoadtestArgs(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << std::endl;
+        params.help = true;
+    }
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
+
+    int ret = 0;
+    try {
+        tests::LoadTester tester(params);
+        tester.run();
+        tester.print(std::cout);
+    } catch (const std::exception& e) {
+        std::cerr << "Load test failed: " << e.what() << std::endl;
+        ret = EXIT_FAILURE;
+    }
+
+#ifdef WIN32_NATIVE
+    gnutls_global_deinit();
+#endif
+    return ret;
+}
@@ -129,6 +129,7 @@ struct dht_params {
     in_port_t port {0};
     in_port_t proxyserver {0};
     in_port_t proxyserverssl {0};
+    unsigned proxy_threads {1};
     std::string proxyclient {};
     std::string pushserver {};
     std::string devicekey {};
@@ -167,6 +168,7 @@ getDhtConfig(dht_params& params)
     config.push_token = params.devicekey;
     config.peer_discovery = params.peer_discovery;
     config.peer_publish = params.peer_discovery;
+    config.lan_bootstrap = params.peer_discovery;
     if (params.no_rate_limit) {
         config.dht_config.node_config.max_req_per_sec = -1;
         config.dht_config.node_config.max_peer_req_per_sec = -1;
@@ -222,6 +224,7 @@ static const constexpr struct option long_options[] = {
     {"syslog",                  no_argument      , nullptr, 'L'},
     {"proxyserver",             required_argument, nullptr, 'S'},
     {"proxyserverssl",          required_argument, nullptr, 'e'},
+    {"proxy-threads",           required_argument, nullptr, 'T'},
     {"proxy-certificate",       required_argument, nullptr, 'w'},
     {"proxy-privkey",           required_argument, nullptr, 'K'},
     {"proxy-privkey-password",  required_argument, nullptr, 'M'},
@@ -264,6 +267,9 @@ parseArgs(int argc, char **argv) {
                     std::cout << "Invalid port: " << port_arg << std::endl;
             }
             break;
+        case 'T':
+            params.proxy_threads = atoi(optarg);
+            break;
         case 'D':
             params.peer_discovery = true;
             break;